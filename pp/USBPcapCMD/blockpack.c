@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+#include "blockpack.h"
+
+int blockpack_init(struct blockpack *bp, unsigned int count,
+                   unsigned int block_size, unsigned int alignment)
+{
+    memset(bp, 0, sizeof(struct blockpack));
+    bp->alignment = alignment;
+    bp->block_size = (block_size + alignment - 1) & ~(alignment - 1);
+
+    /* Pool buffers start at page boundaries, which covers sectors too */
+    return bufpool_init_ex(&bp->pool, count, bp->block_size, BUFPOOL_PREFAULT);
+}
+
+void blockpack_destroy(struct blockpack *bp)
+{
+    bufpool_destroy(&bp->pool);
+}
+
+void blockpack_reset(struct blockpack *bp)
+{
+    if (bp->current != NULL)
+    {
+        bufpool_release(&bp->pool, bp->current);
+        bp->current = NULL;
+    }
+    if (bp->full != NULL)
+    {
+        bufpool_release(&bp->pool, bp->full);
+        bp->full = NULL;
+    }
+    bp->offset = 0;
+    bp->length = 0;
+}
+
+size_t blockpack_put(struct blockpack *bp, const void *data, size_t length)
+{
+    struct bufpool_buffer *block;
+    size_t n;
+
+    if (bp->full != NULL)
+    {
+        return 0;
+    }
+
+    if (bp->current == NULL)
+    {
+        bp->current = bufpool_get(&bp->pool, 0);
+        if (bp->current == NULL)
+        {
+            return 0;
+        }
+        bp->current->length = 0;
+    }
+    block = bp->current;
+
+    n = bp->block_size - block->length;
+    if (n > length)
+    {
+        n = length;
+    }
+    memcpy(&block->data[block->length], data, n);
+    block->length += (unsigned int)n;
+    bp->length += n;
+
+    if (block->length == bp->block_size)
+    {
+        bp->full = block;
+        bp->current = NULL;
+    }
+    return n;
+}
+
+struct bufpool_buffer *blockpack_take(struct blockpack *bp,
+                                      unsigned long long *offset)
+{
+    struct bufpool_buffer *block = bp->full;
+
+    if (block != NULL)
+    {
+        *offset = bp->offset;
+        bp->offset += bp->block_size;
+        bp->full = NULL;
+    }
+    return block;
+}
+
+void blockpack_release(struct blockpack *bp, struct bufpool_buffer *block)
+{
+    bufpool_release(&bp->pool, block);
+}
+
+struct bufpool_buffer *blockpack_tail(struct blockpack *bp,
+                                      unsigned long long *offset,
+                                      size_t *length)
+{
+    struct bufpool_buffer *block = bp->current;
+    size_t padded;
+
+    if ((block == NULL) || (block->length == 0))
+    {
+        return NULL;
+    }
+
+    padded = (block->length + bp->alignment - 1) & ~(size_t)(bp->alignment - 1);
+    memset(&block->data[block->length], 0, padded - block->length);
+
+    *offset = bp->offset;
+    *length = padded;
+    return block;
+}
+
+unsigned long long blockpack_length(const struct blockpack *bp)
+{
+    return bp->length;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Aligned block packer for unbuffered output.
+ *
+ * Files opened without file system cache (FILE_FLAG_NO_BUFFERING,
+ * O_DIRECT) only accept writes of whole sectors from sector aligned
+ * memory at sector aligned offsets. The packer copies the output stream,
+ * passed in arbitrary pieces, into a small pool of aligned blocks and
+ * hands out full blocks together with the file offset they go to.
+ *
+ * The last, partially filled block can be taken with blockpack_tail()
+ * at any time, e.g. to flush. It is padded with zeroes to whole sectors
+ * and stays in place, so it is written again once more data arrives.
+ * The file has to be truncated to blockpack_length() after writing it.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_BLOCKPACK_H
+#define USBPCAP_CMD_BLOCKPACK_H
+
+#include "bufpool.h"
+
+/* Covers 512 and 4096 byte sectors */
+#define BLOCKPACK_ALIGNMENT      4096
+
+struct blockpack
+{
+    struct bufpool pool;
+    unsigned int block_size;        /* Multiple of alignment */
+    unsigned int alignment;
+
+    struct bufpool_buffer *current; /* Block being filled, NULL if none */
+    struct bufpool_buffer *full;    /* Filled block not taken yet */
+    unsigned long long offset;      /* File offset of current block */
+    unsigned long long length;      /* Bytes packed so far */
+};
+
+/*
+ * Allocates count blocks of block_size bytes, rounded up to alignment.
+ * Alignment must be power of two not larger than page size. Returns 0
+ * if memory could not be allocated.
+ */
+int blockpack_init(struct blockpack *bp, unsigned int count,
+                   unsigned int block_size, unsigned int alignment);
+void blockpack_destroy(struct blockpack *bp);
+
+/* Starts packing a new file at offset 0. Blocks must not be in use. */
+void blockpack_reset(struct blockpack *bp);
+
+/*
+ * Copies data to current block and returns number of bytes taken. This
+ * is less than length once the block is full, or 0 if the full block was
+ * not taken yet or every block is still being written.
+ */
+size_t blockpack_put(struct blockpack *bp, const void *data, size_t length);
+
+/*
+ * Returns full block to be written at *offset, block_size bytes long.
+ * Give it back with blockpack_release() once written. NULL if there is
+ * no full block.
+ */
+struct bufpool_buffer *blockpack_take(struct blockpack *bp,
+                                      unsigned long long *offset);
+
+void blockpack_release(struct blockpack *bp, struct bufpool_buffer *block);
+
+/*
+ * Returns partially filled block padded to whole sectors, *length bytes
+ * to be written at *offset. The block is not given away and must not be
+ * in use when blockpack_put() is called next. NULL if it is empty.
+ */
+struct bufpool_buffer *blockpack_tail(struct blockpack *bp,
+                                      unsigned long long *offset,
+                                      size_t *length);
+
+/* Number of bytes packed, the file has to be truncated to it at the end */
+unsigned long long blockpack_length(const struct blockpack *bp);
+
+#endif /* USBPCAP_CMD_BLOCKPACK_H */
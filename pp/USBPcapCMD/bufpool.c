@@ -0,0 +1,543 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "bufpool.h"
+
+#ifndef _WIN32
+/* Default huge page size on x86 and arm64 */
+#define BUFPOOL_HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+#endif
+
+#ifdef _WIN32
+/* Interlocked functions are full barriers */
+static __inline LONG bufpool_load(bufpool_atomic *p)
+{
+    return InterlockedCompareExchange(p, 0, 0);
+}
+
+static __inline void bufpool_store(bufpool_atomic *p, LONG value)
+{
+    InterlockedExchange(p, value);
+}
+
+static __inline void bufpool_fence(void)
+{
+    MemoryBarrier();
+}
+#else
+static __inline int bufpool_load(bufpool_atomic *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static __inline void bufpool_store(bufpool_atomic *p, int value)
+{
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+static __inline void bufpool_fence(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+#endif
+
+static int event_init(struct bufpool_event *event)
+{
+#ifdef _WIN32
+    event->handle = CreateEvent(NULL,
+                                FALSE /* Auto Reset */,
+                                FALSE /* Default non signaled */,
+                                NULL /* No name */);
+    return (event->handle != NULL);
+#else
+    event->signalled = 0;
+    if (pthread_mutex_init(&event->mutex, NULL) != 0)
+    {
+        return 0;
+    }
+    if (pthread_cond_init(&event->cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&event->mutex);
+        return 0;
+    }
+    return 1;
+#endif
+}
+
+static void event_destroy(struct bufpool_event *event)
+{
+#ifdef _WIN32
+    CloseHandle(event->handle);
+#else
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->mutex);
+#endif
+}
+
+static void event_set(struct bufpool_event *event)
+{
+#ifdef _WIN32
+    SetEvent(event->handle);
+#else
+    pthread_mutex_lock(&event->mutex);
+    event->signalled = 1;
+    pthread_cond_signal(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+#endif
+}
+
+/* Returns non-zero if event was signalled before timeout expired */
+static int event_wait(struct bufpool_event *event, int timeout_ms)
+{
+#ifdef _WIN32
+    DWORD timeout = (timeout_ms < 0) ? INFINITE : (DWORD)timeout_ms;
+    return (WaitForSingleObject(event->handle, timeout) == WAIT_OBJECT_0);
+#else
+    struct timespec deadline;
+    int signalled;
+
+    if (timeout_ms >= 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&event->mutex);
+    while (!event->signalled)
+    {
+        if (timeout_ms < 0)
+        {
+            pthread_cond_wait(&event->cond, &event->mutex);
+        }
+        else if (pthread_cond_timedwait(&event->cond, &event->mutex,
+                                        &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    signalled = event->signalled;
+    event->signalled = 0;
+    pthread_mutex_unlock(&event->mutex);
+    return signalled;
+#endif
+}
+
+static int ring_init(struct bufpool_ring *ring, unsigned int count)
+{
+    unsigned int capacity = 1;
+
+    while (capacity < count)
+    {
+        capacity <<= 1;
+    }
+
+    ring->entries = calloc(capacity, sizeof(struct bufpool_buffer *));
+    if (ring->entries == NULL)
+    {
+        return 0;
+    }
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->waiting = 0;
+
+    if (!event_init(&ring->event))
+    {
+        free(ring->entries);
+        ring->entries = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static void ring_destroy(struct bufpool_ring *ring)
+{
+    if (ring->entries != NULL)
+    {
+        event_destroy(&ring->event);
+        free(ring->entries);
+        ring->entries = NULL;
+    }
+}
+
+/* Ring never overflows because every buffer is in at most one ring. */
+static void ring_push(struct bufpool_ring *ring, struct bufpool_buffer *buffer)
+{
+    unsigned int tail = (unsigned int)ring->tail; /* Only producer writes tail */
+
+    ring->entries[tail & ring->mask] = buffer;
+    bufpool_store(&ring->tail, tail + 1);
+
+    /* Pairs with the fence in ring_pop_wait(). Either the consumer sees
+     * the new tail or we see it waiting.
+     */
+    bufpool_fence();
+    if (bufpool_load(&ring->waiting))
+    {
+        event_set(&ring->event);
+    }
+}
+
+static struct bufpool_buffer *ring_pop(struct bufpool_ring *ring)
+{
+    unsigned int head = (unsigned int)ring->head; /* Only consumer writes head */
+    struct bufpool_buffer *buffer;
+
+    if (head == (unsigned int)bufpool_load(&ring->tail))
+    {
+        return NULL;
+    }
+
+    buffer = ring->entries[head & ring->mask];
+    bufpool_store(&ring->head, head + 1);
+    return buffer;
+}
+
+static struct bufpool_buffer *ring_pop_wait(struct bufpool_ring *ring,
+                                            int timeout_ms,
+                                            bufpool_atomic *closed)
+{
+    struct bufpool_buffer *buffer;
+
+    buffer = ring_pop(ring);
+    if ((buffer != NULL) || (timeout_ms == 0))
+    {
+        return buffer;
+    }
+
+    bufpool_store(&ring->waiting, 1);
+    bufpool_fence();
+    buffer = ring_pop(ring);
+    /* Event may be left signalled by push that the pop above already
+     * picked up, so a wakeup alone does not mean there is a buffer.
+     */
+    while ((buffer == NULL) && ((closed == NULL) || !bufpool_load(closed)))
+    {
+        if (!event_wait(&ring->event, timeout_ms))
+        {
+            break;
+        }
+        buffer = ring_pop(ring);
+    }
+    bufpool_store(&ring->waiting, 0);
+
+    return buffer;
+}
+
+static size_t round_up(size_t value, size_t multiple)
+{
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+#ifdef _WIN32
+/* Large pages need SeLockMemoryPrivilege, which has to be granted to the
+ * account and then enabled in the process token.
+ */
+static int enable_lock_memory_privilege(void)
+{
+    TOKEN_PRIVILEGES privileges;
+    HANDLE token;
+    BOOL ok;
+
+    if (!OpenProcessToken(GetCurrentProcess(),
+                          TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+    {
+        return 0;
+    }
+
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    ok = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME,
+                              &privileges.Privileges[0].Luid) &&
+         AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+         (GetLastError() == ERROR_SUCCESS); /* Not ERROR_NOT_ALL_ASSIGNED */
+    CloseHandle(token);
+    return ok;
+}
+
+static size_t system_page_size(void)
+{
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+}
+
+static int region_alloc(struct bufpool *pool, size_t length, int options)
+{
+    SIZE_T large_page = GetLargePageMinimum();
+    SIZE_T min_ws;
+    SIZE_T max_ws;
+
+    if ((options & BUFPOOL_LARGE_PAGES) && (large_page != 0) &&
+        enable_lock_memory_privilege())
+    {
+        pool->region_size = round_up(length, large_page);
+        pool->region = VirtualAlloc(NULL, pool->region_size,
+                                    MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                    PAGE_READWRITE);
+        if (pool->region != NULL)
+        {
+            /* Large pages are never paged out */
+            pool->page_size = large_page;
+            pool->memory = BUFPOOL_LARGE_PAGES | BUFPOOL_LOCKED;
+            return 1;
+        }
+    }
+
+    pool->page_size = system_page_size();
+    pool->region_size = round_up(length, pool->page_size);
+    pool->region = VirtualAlloc(NULL, pool->region_size,
+                                MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (pool->region == NULL)
+    {
+        return 0;
+    }
+
+    /* VirtualLock() cannot lock more than the minimum working set */
+    if ((options & BUFPOOL_PREFAULT) &&
+        GetProcessWorkingSetSize(GetCurrentProcess(), &min_ws, &max_ws) &&
+        SetProcessWorkingSetSize(GetCurrentProcess(),
+                                 min_ws + pool->region_size,
+                                 max_ws + pool->region_size) &&
+        VirtualLock(pool->region, pool->region_size))
+    {
+        pool->memory |= BUFPOOL_LOCKED;
+    }
+    return 1;
+}
+
+static void region_free(struct bufpool *pool)
+{
+    VirtualFree(pool->region, 0, MEM_RELEASE);
+}
+#else
+static size_t system_page_size(void)
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static int region_alloc(struct bufpool *pool, size_t length, int options)
+{
+    void *region = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (options & BUFPOOL_LARGE_PAGES)
+    {
+        /* Fails unless huge pages were reserved, see vm.nr_hugepages */
+        pool->region_size = round_up(length, BUFPOOL_HUGE_PAGE_SIZE);
+        region = mmap(NULL, pool->region_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED)
+        {
+            pool->page_size = BUFPOOL_HUGE_PAGE_SIZE;
+            pool->memory = BUFPOOL_LARGE_PAGES;
+        }
+    }
+#endif
+
+    if (region == MAP_FAILED)
+    {
+        pool->page_size = system_page_size();
+        pool->region_size = round_up(length, pool->page_size);
+        region = mmap(NULL, pool->region_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED)
+        {
+            return 0;
+        }
+    }
+    pool->region = region;
+
+    /* Limited by RLIMIT_MEMLOCK, pages are still touched if this fails */
+    if ((options & BUFPOOL_PREFAULT) && (mlock(region, pool->region_size) == 0))
+    {
+        pool->memory |= BUFPOOL_LOCKED;
+    }
+    return 1;
+}
+
+static void region_free(struct bufpool *pool)
+{
+    munmap(pool->region, pool->region_size);
+}
+#endif
+
+/* Writes every page so the buffers are backed by memory before use */
+static void region_prefault(struct bufpool *pool)
+{
+    size_t offset;
+
+    for (offset = 0; offset < pool->region_size; offset += pool->page_size)
+    {
+        ((volatile unsigned char *)pool->region)[offset] = 0;
+    }
+    pool->memory |= BUFPOOL_PREFAULT;
+}
+
+static int pool_init(struct bufpool *pool, unsigned int count)
+{
+    memset(pool, 0, sizeof(struct bufpool));
+
+    pool->buffers = calloc(count, sizeof(struct bufpool_buffer));
+    if (pool->buffers == NULL)
+    {
+        return 0;
+    }
+    pool->count = count;
+
+    if (!ring_init(&pool->free_ring, count) ||
+        !ring_init(&pool->filled_ring, count))
+    {
+        bufpool_destroy(pool);
+        return 0;
+    }
+    return 1;
+}
+
+int bufpool_init_ex(struct bufpool *pool, unsigned int count, unsigned int size,
+                    int options)
+{
+    size_t stride;
+    unsigned int i;
+
+    if (options == 0)
+    {
+        return bufpool_init(pool, count, size);
+    }
+
+    if (!pool_init(pool, count))
+    {
+        return 0;
+    }
+
+    /* Page aligned buffers can be used for unbuffered I/O too */
+    stride = round_up(size, system_page_size());
+    if (!region_alloc(pool, stride * count, options))
+    {
+        bufpool_destroy(pool);
+        return 0;
+    }
+
+    /* Huge pages on Linux are faulted in on first access too */
+    if (options & BUFPOOL_PREFAULT)
+    {
+        region_prefault(pool);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        pool->buffers[i].data = &pool->region[stride * i];
+        pool->buffers[i].size = size;
+        pool->buffers[i].length = 0;
+        ring_push(&pool->free_ring, &pool->buffers[i]);
+    }
+
+    return 1;
+}
+
+int bufpool_init(struct bufpool *pool, unsigned int count, unsigned int size)
+{
+    unsigned int i;
+
+    if (!pool_init(pool, count))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        pool->buffers[i].data = malloc(size);
+        if (pool->buffers[i].data == NULL)
+        {
+            bufpool_destroy(pool);
+            return 0;
+        }
+        pool->buffers[i].size = size;
+        pool->buffers[i].length = 0;
+        ring_push(&pool->free_ring, &pool->buffers[i]);
+    }
+
+    return 1;
+}
+
+void bufpool_destroy(struct bufpool *pool)
+{
+    unsigned int i;
+
+    if (pool->region != NULL)
+    {
+        region_free(pool);
+        pool->region = NULL;
+    }
+    else if (pool->buffers != NULL)
+    {
+        for (i = 0; i < pool->count; i++)
+        {
+            if (pool->buffers[i].data != NULL)
+            {
+                free(pool->buffers[i].data);
+            }
+        }
+    }
+
+    if (pool->buffers != NULL)
+    {
+        free(pool->buffers);
+        pool->buffers = NULL;
+    }
+
+    ring_destroy(&pool->free_ring);
+    ring_destroy(&pool->filled_ring);
+}
+
+struct bufpool_buffer *bufpool_get(struct bufpool *pool, int timeout_ms)
+{
+    return ring_pop_wait(&pool->free_ring, timeout_ms, NULL);
+}
+
+void bufpool_submit(struct bufpool *pool, struct bufpool_buffer *buffer)
+{
+    ring_push(&pool->filled_ring, buffer);
+}
+
+void bufpool_close(struct bufpool *pool)
+{
+    bufpool_store(&pool->closed, 1);
+    event_set(&pool->filled_ring.event);
+}
+
+struct bufpool_buffer *bufpool_next(struct bufpool *pool, int timeout_ms)
+{
+    return ring_pop_wait(&pool->filled_ring, timeout_ms, &pool->closed);
+}
+
+void bufpool_release(struct bufpool *pool, struct bufpool_buffer *buffer)
+{
+    buffer->length = 0;
+    ring_push(&pool->free_ring, buffer);
+}
+
+int bufpool_is_drained(struct bufpool *pool)
+{
+    return bufpool_load(&pool->closed) &&
+           ((unsigned int)pool->filled_ring.head ==
+            (unsigned int)bufpool_load(&pool->filled_ring.tail));
+}
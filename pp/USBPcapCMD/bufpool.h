@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Pool of equally sized buffers passed between exactly two threads.
+ *
+ * The producer takes free buffers with bufpool_get(), fills them and
+ * hands them over with bufpool_submit(). The consumer takes filled
+ * buffers with bufpool_next() in submission order and gives them back
+ * with bufpool_release(). Both directions are single producer, single
+ * consumer rings, so passing a buffer does not take any lock. A thread
+ * only enters the kernel when it has to sleep or wake up its peer.
+ *
+ * bufpool_init_ex() can place all buffers in one region that is backed
+ * by large pages, or pre-faulted and locked, so the first pass through
+ * the buffers does not take page faults and copies cause less TLB
+ * misses. Options that are not available fall back silently and
+ * bufpool.memory tells what was actually obtained.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_BUFPOOL_H
+#define USBPCAP_CMD_BUFPOOL_H
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/* Timeout value that never expires */
+#define BUFPOOL_INFINITE  (-1)
+
+/* bufpool_init_ex() options and bufpool.memory flags */
+#define BUFPOOL_LARGE_PAGES  0x01 /* Large (huge) pages */
+#define BUFPOOL_PREFAULT     0x02 /* Every page touched before use */
+#define BUFPOOL_LOCKED       0x04 /* Pages locked in memory, flag only */
+
+#ifdef _WIN32
+typedef volatile LONG bufpool_atomic;
+#else
+typedef volatile int bufpool_atomic;
+#endif
+
+/* Auto-reset event */
+struct bufpool_event
+{
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int signalled;
+#endif
+};
+
+struct bufpool_buffer
+{
+    unsigned char *data;
+    unsigned int size;   /* Allocated size of data */
+    unsigned int length; /* Number of valid bytes in data */
+};
+
+/* Single producer, single consumer ring of buffer pointers */
+struct bufpool_ring
+{
+    struct bufpool_buffer **entries;
+    unsigned int mask;     /* Capacity - 1, capacity is power of two */
+    bufpool_atomic head;   /* Next entry to be read, written by consumer */
+    bufpool_atomic tail;   /* Next entry to be written, written by producer */
+    bufpool_atomic waiting; /* Non-zero if consumer sleeps on event */
+    struct bufpool_event event;
+};
+
+struct bufpool
+{
+    struct bufpool_buffer *buffers;
+    unsigned int count;
+    struct bufpool_ring free_ring;   /* Consumer -> producer */
+    struct bufpool_ring filled_ring; /* Producer -> consumer */
+    bufpool_atomic closed;           /* Producer will not submit anymore */
+
+    unsigned char *region;           /* All buffers, NULL if allocated one by one */
+    size_t region_size;
+    size_t page_size;                /* Size of pages backing region */
+    int memory;                      /* BUFPOOL_* flags describing region */
+};
+
+int bufpool_init(struct bufpool *pool, unsigned int count, unsigned int size);
+/*
+ * Allocates all buffers in one region according to options. Buffers
+ * start at page boundaries. Returns 0 only if memory could not be
+ * allocated at all.
+ */
+int bufpool_init_ex(struct bufpool *pool, unsigned int count, unsigned int size,
+                    int options);
+void bufpool_destroy(struct bufpool *pool);
+
+/*
+ * Producer side.
+ *
+ * bufpool_get() returns NULL if there is no free buffer before timeout
+ * (in milliseconds) expires.
+ */
+struct bufpool_buffer *bufpool_get(struct bufpool *pool, int timeout_ms);
+void bufpool_submit(struct bufpool *pool, struct bufpool_buffer *buffer);
+/* No more buffers will be submitted. Wakes up the consumer. */
+void bufpool_close(struct bufpool *pool);
+
+/*
+ * Consumer side.
+ *
+ * bufpool_next() returns NULL on timeout or when the pool was closed and
+ * all submitted buffers have been taken. Use bufpool_is_drained() to
+ * tell these apart.
+ */
+struct bufpool_buffer *bufpool_next(struct bufpool *pool, int timeout_ms);
+void bufpool_release(struct bufpool *pool, struct bufpool_buffer *buffer);
+int bufpool_is_drained(struct bufpool *pool);
+
+#endif /* USBPCAP_CMD_BUFPOOL_H */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Unaligned little endian access to capture, index and cache files.
+ *
+ * Formats written by USBPcapCMD store their fields little endian on any
+ * host. USBPcap packet headers are always little endian and the pcap
+ * headers USBPcapDriver writes are little endian on every host it runs
+ * on. Captures written by big endian hosts are handled by the readers
+ * themselves. put functions return position following the value.
+ *
+ * Lengths and magics of pcap headers these files are made of are kept
+ * here as well, USBPcapCMD modules do not depend on include/USBPcap.h.
+ */
+
+#ifndef USBPCAP_CMD_BYTES_H
+#define USBPCAP_CMD_BYTES_H
+
+#define PCAP_MAGIC                0xA1B2C3D4
+#define PCAP_MAGIC_NANOSECOND     0xA1B23C4D
+#define PCAP_HDR_LEN              24
+#define PCAP_REC_HDR_LEN          16
+
+/* USBPCAP_BUFFER_PACKET_HEADER, without and with control stage */
+#define USBPCAP_HDR_LEN           27
+#define USBPCAP_CONTROL_HDR_LEN   28
+
+static __inline unsigned int get16(const unsigned char *p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8);
+}
+
+static __inline unsigned int get32(const unsigned char *p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+           ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static __inline unsigned long long get64(const unsigned char *p)
+{
+    return (unsigned long long)get32(p) | ((unsigned long long)get32(p + 4) << 32);
+}
+
+static __inline unsigned char *put16(unsigned char *p, unsigned int value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    return p + 2;
+}
+
+static __inline unsigned char *put32(unsigned char *p, unsigned int value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+    return p + 4;
+}
+
+static __inline unsigned char *put64(unsigned char *p, unsigned long long value)
+{
+    put32(p, (unsigned int)value);
+    return put32(p + 4, (unsigned int)(value >> 32));
+}
+
+#endif /* USBPCAP_CMD_BYTES_H */
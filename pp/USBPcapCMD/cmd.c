@@ -8,6 +8,7 @@
 
 #include <initguid.h>
 #include <windows.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <Shellapi.h>
@@ -20,12 +21,38 @@
 #include "roothubs.h"
 #include "version.h"
 #include "descriptors.h"
+#include "writer.h"
+#include "compress.h"
+#include "trigger.h"
+#include "recfilter.h"
 #include "USBPcap.h"
 
 #define INPUT_BUFFER_SIZE 1024
 
 #define DEFAULT_INTERNAL_KERNEL_BUFFER_SIZE (1024*1024)
 #define DEFAULT_SNAPSHOT_LENGTH             (65535)
+#define DEFAULT_READ_DEPTH                  (2)
+#define DEFAULT_NOTIFY_THRESHOLD            (0)
+#define DEFAULT_FLUSH_SIZE                  (0)
+#define DEFAULT_FLUSH_INTERVAL              (0)
+#define DEFAULT_ROTATE_SIZE                 (0)
+#define DEFAULT_ROTATE_SECONDS              (0)
+#define DEFAULT_ROTATE_FILES                (0)
+#define DEFAULT_COMPRESS_THREADS            COMPRESS_DEFAULT_THREADS
+#define DEFAULT_TRIGGER_BUFFER              (64)
+#define DEFAULT_TRIGGER_BEFORE              (10)
+#define DEFAULT_TRIGGER_AFTER               (10)
+#define MAX_FLUSH_SIZE                      (1048576)
+#define MAX_FLUSH_INTERVAL                  (86400000)
+#define MAX_TRIGGER_BUFFER                  (4096)
+#define MAX_TRIGGER_SECONDS                 (86400)
+#define MAX_ROTATE_SIZE                     (1000000)
+#define MAX_ROTATE_SECONDS                  (604800)
+#define MAX_ROTATE_FILES                    (100000)
+
+/* Shared memory ring (--shmem) holds this many capture buffers */
+#define SHMEM_RING_BUFFERS                  (4)
+#define SHMEM_RING_NAME_LEN                 (128)
 
 static BOOL IsElevated()
 {
@@ -258,6 +285,84 @@ EXTERN_C int WINAPI GetModuleFullName(__in HMODULE hModule, __out LPWSTR pszBuff
     return nLength;
 }
 
+/**
+ *  Generates name of shared memory ring used to pass data from elevated
+ *  worker. Both processes derive it from the capture device name.
+ *
+ *  \param[in] data thread_data containing capture configuration.
+ *  \param[out] name buffer to store the name.
+ *  \param[in] size size of name buffer.
+ */
+static void get_ring_name(struct thread_data *data, char *name, size_t size)
+{
+    char *tmp;
+
+    _snprintf_s(name, size, _TRUNCATE, "Local\\USBPcapRing_%s", data->device);
+    for (tmp = &name[sizeof("Local\\USBPcapRing_") - 1]; *tmp; tmp++)
+    {
+        if ((*tmp == '\\') || (*tmp == ','))
+        {
+            *tmp = '_';
+        }
+    }
+}
+
+/**
+ *  Quotes argument for worker command line so that CommandLineToArgvW()
+ *  and the C runtime give back the original string. Quotes are escaped
+ *  with backslash and backslashes are doubled only when they precede
+ *  a quote, including the closing one.
+ *
+ *  \param[in] arg argument to quote.
+ *
+ *  \return Quoted argument, must be freed using free(). NULL if out of memory.
+ */
+static char *quote_argument(const char *arg)
+{
+    char *quoted;
+    char *out;
+    size_t backslashes;
+
+    /* Every character is escaped at worst, plus quotes and terminator */
+    quoted = (char *)malloc(2 * strlen(arg) + 3);
+    if (quoted == NULL)
+    {
+        return NULL;
+    }
+
+    out = quoted;
+    *out++ = '"';
+    for (;;)
+    {
+        backslashes = 0;
+        while (*arg == '\\')
+        {
+            backslashes++;
+            arg++;
+        }
+        if ((*arg == '\0') || (*arg == '"'))
+        {
+            backslashes *= 2;
+        }
+        for (; backslashes > 0; backslashes--)
+        {
+            *out++ = '\\';
+        }
+        if (*arg == '\0')
+        {
+            break;
+        }
+        if (*arg == '"')
+        {
+            *out++ = '\\';
+        }
+        *out++ = *arg++;
+    }
+    *out++ = '"';
+    *out = '\0';
+    return quoted;
+}
+
 /**
  *  Generates command line for worker process.
  *
@@ -279,6 +384,8 @@ static BOOL generate_worker_command_line(struct thread_data *data,
     PWSTR cmdLine = NULL;
     int cmdLineLen;
     PWSTR pipeName = NULL;
+    char *filter = NULL;
+    char *trigger = NULL;
     int nChars;
 
     *pcap_handle = INVALID_HANDLE_VALUE;
@@ -335,6 +442,27 @@ static BOOL generate_worker_command_line(struct thread_data *data,
             free(pipeName);
             return FALSE;
         }
+
+        if (data->shmem)
+        {
+            char ringName[SHMEM_RING_NAME_LEN];
+
+            /* Ring is created by us because objects created by elevated
+             * worker could not be opened here. Pipe stays in use to let
+             * both processes know when the other one is gone.
+             */
+            get_ring_name(data, ringName, sizeof(ringName));
+            if (shmring_create(&data->ring, ringName,
+                               data->bufferlen * SHMEM_RING_BUFFERS))
+            {
+                data->input_ring = &data->ring;
+            }
+            else
+            {
+                fprintf(stderr, "Failed to create shared memory - %d. Using pipe.\n",
+                        GetLastError());
+            }
+        }
     }
     else
     {
@@ -345,10 +473,38 @@ static BOOL generate_worker_command_line(struct thread_data *data,
 #define WORKER_CMD_LINE_FORMATTER_PIPE        L"-d %S -b %u -o %s"
 
 #define WORKER_CMD_LINE_FORMATTER_SNAPLEN     L" -s %u"
+#define WORKER_CMD_LINE_FORMATTER_READS       L" --reads %u"
+#define WORKER_CMD_LINE_FORMATTER_NOTIFY      L" --notify %u"
+#define WORKER_CMD_LINE_FORMATTER_FLUSH_SIZE  L" --flush-size %u"
+#define WORKER_CMD_LINE_FORMATTER_FLUSH_INTERVAL L" --flush-interval %u"
+#define WORKER_CMD_LINE_FORMATTER_ROTATE_SIZE L" -C %u"
+#define WORKER_CMD_LINE_FORMATTER_ROTATE_SECONDS L" -G %u"
+#define WORKER_CMD_LINE_FORMATTER_ROTATE_FILES L" -W %u"
 #define WORKER_CMD_LINE_FORMATTER_DEVICES     L" --devices %S"
 #define WORKER_CMD_LINE_FORMATTER_CAPTURE_ALL L" --capture-from-all-devices"
 #define WORKER_CMD_LINE_FORMATTER_CAPTURE_NEW L" --capture-from-new-devices"
 #define WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS L" --inject-descriptors"
+#define WORKER_CMD_LINE_FORMATTER_PCAPNG      L" --pcapng"
+#define WORKER_CMD_LINE_FORMATTER_COMPRESS    L" --compress"
+#define WORKER_CMD_LINE_FORMATTER_COMPRESS_THREADS L" --compress-threads %u"
+#define WORKER_CMD_LINE_FORMATTER_INDEX       L" --index"
+#define WORKER_CMD_LINE_FORMATTER_DIRECT_IO   L" --direct-io"
+#define WORKER_CMD_LINE_FORMATTER_SHMEM       L" --shmem"
+#define WORKER_CMD_LINE_FORMATTER_FILTER      L" --filter %S"
+#define WORKER_CMD_LINE_FORMATTER_TRIGGER     L" --trigger %S"
+#define WORKER_CMD_LINE_FORMATTER_TRIGGER_BUFFER L" --trigger-buffer %u"
+#define WORKER_CMD_LINE_FORMATTER_TRIGGER_BEFORE L" --trigger-before %u"
+#define WORKER_CMD_LINE_FORMATTER_TRIGGER_AFTER L" --trigger-after %u"
+
+    /* Expressions may contain spaces, quotes and backslashes */
+    if (data->record_filter != NULL)
+    {
+        filter = quote_argument(data->record_filter);
+    }
+    if (data->trigger != NULL)
+    {
+        trigger = quote_argument(data->trigger);
+    }
 
     cmdLineLen = MultiByteToWideChar(CP_ACP, 0, data->device, -1, NULL, 0);
     cmdLineLen += (pipeName == NULL) ? strlen(data->filename) : wcslen(pipeName);
@@ -357,17 +513,53 @@ static BOOL generate_worker_command_line(struct thread_data *data,
     cmdLineLen += 1 /* NULL termination */;
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_SNAPLEN);
     cmdLineLen += 10 /* maximum snaplen in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_READS);
+    cmdLineLen += 2 /* maximum read depth in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_NOTIFY);
+    cmdLineLen += 9 /* maximum notification threshold in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_FLUSH_SIZE);
+    cmdLineLen += 10 /* maximum flush size in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_FLUSH_INTERVAL);
+    cmdLineLen += 10 /* maximum flush interval in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_ROTATE_SIZE);
+    cmdLineLen += 10 /* maximum rotate size in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_ROTATE_SECONDS);
+    cmdLineLen += 10 /* maximum rotate seconds in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_ROTATE_FILES);
+    cmdLineLen += 10 /* maximum number of files in characters */;
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_DEVICES);
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_CAPTURE_ALL);
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_CAPTURE_NEW);
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_PCAPNG);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_COMPRESS);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_COMPRESS_THREADS);
+    cmdLineLen += 2 /* maximum compression threads in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_INDEX);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_DIRECT_IO);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_SHMEM);
     cmdLineLen += (data->address_list == NULL) ? 0 : strlen(data->address_list);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_FILTER);
+    cmdLineLen += (filter == NULL) ? 0 : strlen(filter);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_TRIGGER);
+    cmdLineLen += (trigger == NULL) ? 0 : strlen(trigger);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_TRIGGER_BUFFER);
+    cmdLineLen += 10 /* maximum trigger buffer in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_TRIGGER_BEFORE);
+    cmdLineLen += 10 /* maximum seconds before trigger in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_TRIGGER_AFTER);
+    cmdLineLen += 10 /* maximum seconds after trigger in characters */;
 
     cmdLine = (PWSTR)malloc(cmdLineLen * sizeof(WCHAR));
 
-    if (cmdLine == NULL)
+    if ((cmdLine == NULL) ||
+        ((data->record_filter != NULL) && (filter == NULL)) ||
+        ((data->trigger != NULL) && (trigger == NULL)))
     {
         fprintf(stderr, "Failed to allocate command line\n");
+        free(cmdLine);
+        free(filter);
+        free(trigger);
         free(exePath);
         free(pipeName);
         return FALSE;
@@ -400,6 +592,63 @@ static BOOL generate_worker_command_line(struct thread_data *data,
                              data->snaplen);
     }
 
+    if (data->read_depth != DEFAULT_READ_DEPTH)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_READS,
+                             data->read_depth);
+    }
+
+    if (data->notify_threshold != DEFAULT_NOTIFY_THRESHOLD)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_NOTIFY,
+                             data->notify_threshold);
+    }
+
+    if (data->flush_size != DEFAULT_FLUSH_SIZE)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_FLUSH_SIZE,
+                             data->flush_size);
+    }
+
+    if (data->flush_interval != DEFAULT_FLUSH_INTERVAL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_FLUSH_INTERVAL,
+                             data->flush_interval);
+    }
+
+    /* Worker writing to the relay pipe has nothing to rotate */
+    if ((pipeName == NULL) && (data->rotate_size != DEFAULT_ROTATE_SIZE))
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_ROTATE_SIZE,
+                             data->rotate_size);
+    }
+
+    if ((pipeName == NULL) && (data->rotate_seconds != DEFAULT_ROTATE_SECONDS))
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_ROTATE_SECONDS,
+                             data->rotate_seconds);
+    }
+
+    if ((pipeName == NULL) && (data->rotate_files != DEFAULT_ROTATE_FILES))
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_ROTATE_FILES,
+                             data->rotate_files);
+    }
+
     if (data->address_list != NULL)
     {
         nChars += swprintf_s(&cmdLine[nChars],
@@ -428,15 +677,120 @@ static BOOL generate_worker_command_line(struct thread_data *data,
                              cmdLineLen - nChars,
                              WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS);
     }
+
+    if (data->pcapng)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_PCAPNG);
+    }
+
+    if (data->compress)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_COMPRESS);
+    }
+
+    if (data->compress_threads != DEFAULT_COMPRESS_THREADS)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_COMPRESS_THREADS,
+                             data->compress_threads);
+    }
+
+    /* Index is only written next to a file, not to the relay pipe */
+    if ((pipeName == NULL) && data->index)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_INDEX);
+    }
+
+    /* Pipes cannot be opened without buffering */
+    if ((pipeName == NULL) && data->direct_io)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_DIRECT_IO);
+    }
+
+    if (data->input_ring != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_SHMEM);
+    }
+
+    if (filter != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_FILTER,
+                             filter);
+    }
+
+    if (trigger != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_TRIGGER,
+                             trigger);
+    }
+
+    if (data->trigger_buffer != DEFAULT_TRIGGER_BUFFER)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_TRIGGER_BUFFER,
+                             data->trigger_buffer);
+    }
+
+    if (data->trigger_before != DEFAULT_TRIGGER_BEFORE)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_TRIGGER_BEFORE,
+                             data->trigger_before);
+    }
+
+    if (data->trigger_after != DEFAULT_TRIGGER_AFTER)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_TRIGGER_AFTER,
+                             data->trigger_after);
+    }
 #undef WORKER_CMD_LINE_FORMATTER_PIPE
 #undef WORKER_CMD_LINE_FORMATTER
 
+#undef WORKER_CMD_LINE_FORMATTER_TRIGGER_AFTER
+#undef WORKER_CMD_LINE_FORMATTER_TRIGGER_BEFORE
+#undef WORKER_CMD_LINE_FORMATTER_TRIGGER_BUFFER
+#undef WORKER_CMD_LINE_FORMATTER_TRIGGER
+#undef WORKER_CMD_LINE_FORMATTER_FILTER
+#undef WORKER_CMD_LINE_FORMATTER_SHMEM
+#undef WORKER_CMD_LINE_FORMATTER_DIRECT_IO
+#undef WORKER_CMD_LINE_FORMATTER_INDEX
+#undef WORKER_CMD_LINE_FORMATTER_COMPRESS_THREADS
+#undef WORKER_CMD_LINE_FORMATTER_COMPRESS
+#undef WORKER_CMD_LINE_FORMATTER_PCAPNG
 #undef WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS
 #undef WORKER_CMD_LINE_FORMATTER_CAPTURE_NEW
 #undef WORKER_CMD_LINE_FORMATTER_CAPTURE_ALL
 #undef WORKER_CMD_LINE_FORMATTER_DEVICES
+#undef WORKER_CMD_LINE_FORMATTER_ROTATE_FILES
+#undef WORKER_CMD_LINE_FORMATTER_ROTATE_SECONDS
+#undef WORKER_CMD_LINE_FORMATTER_ROTATE_SIZE
+#undef WORKER_CMD_LINE_FORMATTER_FLUSH_INTERVAL
+#undef WORKER_CMD_LINE_FORMATTER_FLUSH_SIZE
+#undef WORKER_CMD_LINE_FORMATTER_NOTIFY
+#undef WORKER_CMD_LINE_FORMATTER_READS
 #undef WORKER_CMD_LINE_FORMATTER_SNAPLEN
 
+    free(filter);
+    free(trigger);
     free(pipeName);
 
     *appPath = exePath;
@@ -824,12 +1178,109 @@ static void wait_for_exit_signal(struct thread_data *data, HANDLE process)
     }
 }
 
+/* Splits comma separated device option into data->devices */
+static BOOL split_device_list(struct thread_data *data)
+{
+    char *device;
+    char *next;
+    const char *digits;
+
+    data->device_list = _strdup(data->device);
+    if (data->device_list == NULL)
+    {
+        fprintf(stderr, "Failed to allocate device list\n");
+        return FALSE;
+    }
+
+    data->device_count = 0;
+    for (device = data->device_list; device != NULL; device = next)
+    {
+        next = strchr(device, ',');
+        if (next != NULL)
+        {
+            *next = '\0';
+            next++;
+        }
+
+        if (*device == '\0')
+        {
+            continue;
+        }
+
+        if (data->device_count == MAX_CAPTURE_DEVICES)
+        {
+            fprintf(stderr, "At most %d devices can be captured at once.\n",
+                    MAX_CAPTURE_DEVICES);
+            return FALSE;
+        }
+
+        /* Root hub number is at the end of control device name */
+        digits = device + strlen(device);
+        while ((digits > device) && isdigit((unsigned char)digits[-1]))
+        {
+            digits--;
+        }
+        data->buses[data->device_count] = (unsigned short)atoi(digits);
+        data->devices[data->device_count] = device;
+        data->device_count++;
+    }
+
+    if (data->device_count == 0)
+    {
+        fprintf(stderr, "No device to capture from.\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Collects descriptors of devices connected to every captured root hub.
+ * With several hubs the filter selects all devices or only new ones.
+ */
+static void generate_descriptors(struct thread_data *data)
+{
+    void *packets;
+    void *joined;
+    int length;
+    DWORD i;
+
+    for (i = 0; i < data->device_count; i++)
+    {
+        packets = descriptors_generate_pcap(data->devices[i], &length,
+                                            &data->filter);
+        if ((packets == NULL) || (length == 0))
+        {
+            descriptors_free_pcap(packets);
+        }
+        else if (data->descriptors.descriptors == NULL)
+        {
+            data->descriptors.descriptors = packets;
+            data->descriptors.descriptors_len = length;
+        }
+        else
+        {
+            joined = realloc(data->descriptors.descriptors,
+                             data->descriptors.descriptors_len + length);
+            if (joined != NULL)
+            {
+                memcpy((char *)joined + data->descriptors.descriptors_len,
+                       packets, length);
+                data->descriptors.descriptors = joined;
+                data->descriptors.descriptors_len += length;
+            }
+            descriptors_free_pcap(packets);
+        }
+    }
+}
+
 static void start_capture(struct thread_data *data)
 {
     HANDLE pipe_handle = INVALID_HANDLE_VALUE;
     HANDLE process = INVALID_HANDLE_VALUE;
     HANDLE thread = NULL;
     DWORD thread_id;
+    DWORD i;
 
     /* Sanity check capture configuration. */
     if ((data->capture_all == FALSE) &&
@@ -847,6 +1298,21 @@ static void start_capture(struct thread_data *data)
         return;
     }
 
+    if (FALSE == split_device_list(data))
+    {
+        return;
+    }
+
+    /* Every root hub assigns device addresses on its own, so one list
+     * would select unrelated devices on the other hubs.
+     */
+    if ((data->device_count > 1) && (data->address_list != NULL) &&
+        (data->capture_all == FALSE))
+    {
+        fprintf(stderr, "--devices cannot be used when capturing from several root hubs.\n");
+        return;
+    }
+
     data->exit_event = CreateEvent(NULL, /* Handle cannot be inherited */
                                    TRUE, /* Manual Reset */
                                    FALSE, /* Default to not signalled */
@@ -863,30 +1329,63 @@ static void start_capture(struct thread_data *data)
         }
         else
         {
-            data->write_handle = CreateFileA(data->filename,
-                                             GENERIC_WRITE,
-                                             0,
-                                             NULL,
-                                             CREATE_NEW,
-                                             FILE_ATTRIBUTE_NORMAL|FILE_FLAG_OVERLAPPED,
-                                             NULL);
+            data->write_handle = create_output_file(data);
+        }
+
+        if (data->shmem && (strncmp("-", data->filename, 2) != 0) &&
+            (data->write_handle != INVALID_HANDLE_VALUE) &&
+            (GetFileType(data->write_handle) == FILE_TYPE_PIPE))
+        {
+            char ringName[SHMEM_RING_NAME_LEN];
+
+            /* Output is the pipe to our parent process, it reads the
+             * data from shared memory it has created.
+             */
+            get_ring_name(data, ringName, sizeof(ringName));
+            if (shmring_open(&data->ring, ringName))
+            {
+                data->output_ring = &data->ring;
+            }
+            else
+            {
+                fprintf(stderr, "Failed to open shared memory - %d\n", GetLastError());
+                CloseHandle(data->write_handle);
+                data->write_handle = INVALID_HANDLE_VALUE;
+            }
         }
 
         if (data->inject_descriptors)
         {
-            data->descriptors.descriptors = descriptors_generate_pcap(data->device, &data->descriptors.descriptors_len,
-                                                                      &data->filter);
+            generate_descriptors(data);
             data->descriptors.buf_written = 0;
         }
 
-        data->read_handle = create_filter_read_handle(data);
+        if (data->device_count > 1)
+        {
+            /* Streams of all root hubs are merged into one output */
+            for (i = 0; i < data->device_count; i++)
+            {
+                data->read_handles[i] = open_filter_device(data, data->devices[i]);
+            }
 
-        thread = CreateThread(NULL, /* default security attributes */
-                              0,    /* use default stack size */
-                              read_thread,
-                              data,
-                              0,    /* use default creation flag */
-                              &thread_id);
+            thread = CreateThread(NULL, /* default security attributes */
+                                  0,    /* use default stack size */
+                                  merge_read_thread,
+                                  data,
+                                  0,    /* use default creation flag */
+                                  &thread_id);
+        }
+        else
+        {
+            data->read_handle = create_filter_read_handle(data);
+
+            thread = CreateThread(NULL, /* default security attributes */
+                                  0,    /* use default stack size */
+                                  read_thread,
+                                  data,
+                                  0,    /* use default creation flag */
+                                  &thread_id);
+        }
 
         if (thread == NULL)
         {
@@ -1038,9 +1537,14 @@ static void start_capture(struct thread_data *data)
                     data->write_handle = GetStdHandle(STD_OUTPUT_HANDLE);
                     data->read_handle = pipe_handle;
 
+                    /* Worker passes only the records to be written */
+                    data->record_filter = NULL;
+                    data->trigger = NULL;
+
                     thread = CreateThread(NULL, /* default security attributes */
                                           0,    /* use default stack size */
-                                          read_thread,
+                                          (data->input_ring != NULL) ?
+                                              ring_read_thread : read_thread,
                                           data,
                                           0,    /* use default creation flag */
                                           &thread_id);
@@ -1097,6 +1601,14 @@ static void start_capture(struct thread_data *data)
         CloseHandle(data->read_handle);
     }
 
+    for (i = 0; i < data->device_count; i++)
+    {
+        if (data->read_handles[i] != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(data->read_handles[i]);
+        }
+    }
+
     if (data->write_handle != INVALID_HANDLE_VALUE)
     {
         CloseHandle(data->write_handle);
@@ -1109,6 +1621,11 @@ static void start_capture(struct thread_data *data)
         CloseHandle(process);
     }
 
+    if ((data->input_ring != NULL) || (data->output_ring != NULL))
+    {
+        shmring_destroy(&data->ring);
+    }
+
     if (data->descriptors.descriptors)
     {
         descriptors_free_pcap(data->descriptors.descriptors);
@@ -1331,19 +1848,106 @@ static void print_help(void)
            "    Prints this help.\n"
            "  -d <device>, --device <device>\n"
            "    USBPcap control device to open. Example: -d \\\\.\\USBPcap1.\n"
+           "    Comma separated list of devices captures from several root hubs\n"
+           "    into one output with packets ordered by time. pcapng output has\n"
+           "    one interface per root hub.\n"
            "  -o <file>, --output <file>\n"
            "    Output .pcap file name.\n"
            "  -s <len>, --snaplen <len>\n"
            "    Sets snapshot length.\n"
            "  -b <len>, --bufferlen <len>\n"
            "    Sets internal capture buffer length. Valid range <4096,134217728>.\n"
+           "  --reads <count>\n"
+           "    Sets number of read requests kept pending on the capture device.\n"
+           "    Each request uses its own buffer of capture buffer length.\n"
+           "    All buffers together may take at most 2048 MiB.\n"
+           "    Valid range <1,64>. Default 2.\n"
+           "  --notify <bytes>\n"
+           "    Instead of keeping reads pending, waits for the driver to signal\n"
+           "    that <bytes> of data are buffered and then drains the buffer.\n"
+           "    Buffered data is also drained at least every 100 ms. Valid range\n"
+           "    <0,capture buffer length>, 0 (default) keeps reads pending.\n"
+           "    Only used when capturing from one root hub.\n"
+           "  --flush-size <MiB>\n"
+           "    Flushes output file to disk after every <MiB> of written data.\n"
+           "    Valid range <0,1048576>.\n"
+           "  --flush-interval <ms>\n"
+           "    Flushes output file to disk at least every <ms> milliseconds.\n"
+           "    Valid range <0,86400000>.\n"
+           "    Without any flush option the output is flushed only when capture\n"
+           "    ends. Output to pipe is never flushed.\n"
+           "  -C <size>\n"
+           "    Starts new output file once current one reaches <size> millions\n"
+           "    of bytes. Files are named like <file> with _00000, _00001, ...\n"
+           "    inserted before extension and are preallocated to <size>.\n"
+           "    Valid range <0,1000000>.\n"
+           "  -G <seconds>\n"
+           "    Starts new output file every <seconds> seconds.\n"
+           "    Valid range <0,604800>.\n"
+           "  -W <count>\n"
+           "    Keeps at most <count> output files, removing the oldest one.\n"
+           "    Requires -C or -G. Rotation is not done on standard output.\n"
+           "    Valid range <0,100000>.\n"
+           "  --pcapng\n"
+           "    Writes output in pcapng format. Driver packet and drop counters\n"
+           "    are stored in statistics block at the end of capture.\n"
+           "  --compress\n"
+           "    Compresses output into independent LZ4 frames of about 1 MiB\n"
+           "    followed by a seek table. Any LZ4 tool can decompress the file,\n"
+           "    USBPcapHost pcapcat can also extract time ranges.\n"
+           "  --compress-threads <count>\n"
+           "    Number of threads compressing the output.\n"
+           "    Valid range <1,64>. Default 2.\n"
+           "  --index\n"
+           "    Writes sidecar index <file>.idx next to every output file. It\n"
+           "    lets tools like USBPcapHost pcapseek find packets by time and\n"
+           "    by device or endpoint without reading the whole capture.\n"
+           "  --direct-io\n"
+           "    Writes output file without file system cache, in aligned 1 MiB\n"
+           "    blocks that go straight to disk. Useful for long captures at\n"
+           "    high rate. Output to standard output is not affected.\n"
+           "  --shmem\n"
+           "    Passes captured data from elevated worker process through shared\n"
+           "    memory instead of pipe. Only used when not elevated and writing\n"
+           "    to standard output, e.g. when started by Wireshark.\n"
+           "  --filter <expression>\n"
+           "    Writes only packets matching <expression>, e.g.\n"
+           "    \"device == 5 && (transfer == bulk || status != success)\".\n"
+           "    Fields: bus, device, endpoint, transfer, function, status,\n"
+           "    info, irp, length, stage, in, completion, data[<offset>] and\n"
+           "    data[<offset>:<length>] compared to hex bytes like 01:02:03.\n"
+           "    Operators: == != < <= > >= ! && || and parentheses.\n"
+           "  --trigger <expression>\n"
+           "    Keeps recent records in memory and writes them only when a\n"
+           "    record matches <expression>, followed by records until\n"
+           "    --trigger-after seconds after last match. Expression is comma\n"
+           "    separated list of stall, error or status=<USBD_STATUS>, each\n"
+           "    optionally limited with @<bus>[.<device>[.<endpoint>]].\n"
+           "    Example: --trigger stall@1.5.0x81,status=0xC0000011\n"
+           "  --trigger-buffer <MiB>\n"
+           "    Memory for records kept before trigger. Valid range <1,4096>.\n"
+           "    Default 64.\n"
+           "  --trigger-before <seconds>\n"
+           "    Keeps at most <seconds> of records before trigger, 0 keeps as\n"
+           "    many as fit into trigger buffer. Default 10.\n"
+           "  --trigger-after <seconds>\n"
+           "    Writes records until <seconds> after last match. Default 10.\n"
+           "  --monitor\n"
+           "    Prints bytes and URBs per second, errors and URB latency\n"
+           "    percentiles of every active device endpoint once a second\n"
+           "    instead of writing the capture. -o and output format options\n"
+           "    are ignored. Use -s to capture only the headers.\n"
            "  -A, --capture-from-all-devices\n"
            "    Captures data from all devices connected to selected Root Hub.\n"
            "  --devices <list>\n"
            "    Captures data only from devices with addresses present in list.\n"
            "    List is comma separated list of values. Example --devices 1,2,3.\n"
+           "    Addresses are only unique within one root hub, so the list can\n"
+           "    only be used when capturing from one.\n"
            "  --inject-descriptors\n"
            "    Inject already connected devices descriptors into capture data.\n"
+           "    Descriptors are cached in temporary directory so devices that\n"
+           "    did not change are not queried again on next capture.\n"
            "  -I,  --init-non-standard-hwids\n"
            "    Initializes NonStandardHWIDs registry key used by USBPcapDriver.\n"
            "    This registry key is needed for USB 3.0 capture.\n");
@@ -1353,6 +1957,22 @@ static void print_help(void)
 #define ARG_DEVICES                    900
 #define ARG_CAPTURE_FROM_NEW_DEVICES   901
 #define ARG_INJECT_DESCRIPTORS         902
+#define ARG_READS                      903
+#define ARG_FLUSH_SIZE                 904
+#define ARG_FLUSH_INTERVAL             905
+#define ARG_PCAPNG                     906
+#define ARG_COMPRESS                   907
+#define ARG_COMPRESS_THREADS           908
+#define ARG_INDEX                      909
+#define ARG_SHMEM                      910
+#define ARG_MONITOR                    911
+#define ARG_TRIGGER                    912
+#define ARG_TRIGGER_BUFFER             913
+#define ARG_TRIGGER_BEFORE             914
+#define ARG_TRIGGER_AFTER              915
+#define ARG_FILTER                     916
+#define ARG_DIRECT_IO                  917
+#define ARG_NOTIFY                     918
 #define ARG_EXTCAP_VERSION            1000
 #define ARG_EXTCAP_INTERFACES         1001
 #define ARG_EXTCAP_INTERFACE          1002
@@ -1361,6 +1981,32 @@ static void print_help(void)
 #define ARG_EXTCAP_CAPTURE            1005
 #define ARG_EXTCAP_FIFO               1006
 
+/**
+ *  Parses numeric option value. Unlike atol() it rejects negative numbers,
+ *  trailing garbage and values that do not fit.
+ *
+ *  \return TRUE if arg is a decimal number in <0,max>.
+ */
+static BOOL parse_number(const char *arg, UINT32 max, UINT32 *number)
+{
+    char *end;
+    unsigned long value;
+
+    if (!isdigit((unsigned char)arg[0]))
+    {
+        return FALSE;
+    }
+
+    value = strtoul(arg, &end, 10);
+    if ((*end != '\0') || (value > max))
+    {
+        return FALSE;
+    }
+
+    *number = (UINT32)value;
+    return TRUE;
+}
+
 #if _MSC_VER >= 1700
 int __cdecl usbpcapcmd_main(int argc, CHAR **argv)
 #else
@@ -1376,6 +2022,22 @@ int __cdecl main(int argc, CHAR **argv)
         {"output", required_argument, 0, 'o'},
         {"snaplen", required_argument, 0, 's'},
         {"bufferlen", required_argument, 0, 'b'},
+        {"reads", required_argument, 0, ARG_READS},
+        {"notify", required_argument, 0, ARG_NOTIFY},
+        {"flush-size", required_argument, 0, ARG_FLUSH_SIZE},
+        {"flush-interval", required_argument, 0, ARG_FLUSH_INTERVAL},
+        {"pcapng", no_argument, 0, ARG_PCAPNG},
+        {"compress", no_argument, 0, ARG_COMPRESS},
+        {"compress-threads", required_argument, 0, ARG_COMPRESS_THREADS},
+        {"index", no_argument, 0, ARG_INDEX},
+        {"direct-io", no_argument, 0, ARG_DIRECT_IO},
+        {"shmem", no_argument, 0, ARG_SHMEM},
+        {"monitor", no_argument, 0, ARG_MONITOR},
+        {"filter", required_argument, 0, ARG_FILTER},
+        {"trigger", required_argument, 0, ARG_TRIGGER},
+        {"trigger-buffer", required_argument, 0, ARG_TRIGGER_BUFFER},
+        {"trigger-before", required_argument, 0, ARG_TRIGGER_BEFORE},
+        {"trigger-after", required_argument, 0, ARG_TRIGGER_AFTER},
         {"init-non-standard-hwids", no_argument, 0, 'I'},
         /* Capture options. */
         {"devices", required_argument, 0, ARG_DEVICES},
@@ -1401,19 +2063,47 @@ int __cdecl main(int argc, CHAR **argv)
 
     data.filename = NULL;
     data.device = NULL;
+    data.device_list = NULL;
+    data.device_count = 0;
     data.address_list = NULL;
     data.capture_all = FALSE;
     data.capture_new = FALSE;
     data.inject_descriptors = FALSE;
+    data.pcapng = FALSE;
+    data.have_statistics = FALSE;
+    data.compress = FALSE;
+    data.compress_threads = DEFAULT_COMPRESS_THREADS;
+    data.index = FALSE;
+    data.direct_io = FALSE;
+    data.shmem = FALSE;
+    data.monitor = FALSE;
+    data.record_filter = NULL;
+    data.trigger = NULL;
+    data.trigger_buffer = DEFAULT_TRIGGER_BUFFER;
+    data.trigger_before = DEFAULT_TRIGGER_BEFORE;
+    data.trigger_after = DEFAULT_TRIGGER_AFTER;
+    data.input_ring = NULL;
+    data.output_ring = NULL;
     data.snaplen = DEFAULT_SNAPSHOT_LENGTH;
     data.bufferlen = DEFAULT_INTERNAL_KERNEL_BUFFER_SIZE;
+    data.read_depth = DEFAULT_READ_DEPTH;
+    data.notify_threshold = DEFAULT_NOTIFY_THRESHOLD;
+    data.flush_size = DEFAULT_FLUSH_SIZE;
+    data.flush_interval = DEFAULT_FLUSH_INTERVAL;
+    data.rotate_size = DEFAULT_ROTATE_SIZE;
+    data.rotate_seconds = DEFAULT_ROTATE_SECONDS;
+    data.rotate_files = DEFAULT_ROTATE_FILES;
     data.job_handle = INVALID_HANDLE_VALUE;
     data.worker_process_thread = INVALID_HANDLE_VALUE;
     data.read_handle = INVALID_HANDLE_VALUE;
+    for (c = 0; c < MAX_CAPTURE_DEVICES; c++)
+    {
+        data.read_handles[c] = INVALID_HANDLE_VALUE;
+    }
     data.write_handle = INVALID_HANDLE_VALUE;
     data.exit_event = INVALID_HANDLE_VALUE;
 
-    while (-1 != (c = getopt_long(argc, argv, "hd:o:s:b:IA", long_options, &option_index)))
+    while (-1 != (c = getopt_long(argc, argv, "hd:o:s:b:C:G:W:IA", long_options, &option_index)))
     {
         switch (c)
         {
@@ -1453,6 +2143,125 @@ int __cdecl main(int argc, CHAR **argv)
                     return -1;
                 }
                 break;
+            case ARG_READS:
+                data.read_depth = atol(optarg);
+                if (data.read_depth < 1 || data.read_depth > MAX_READ_DEPTH)
+                {
+                    fprintf(stderr, "Invalid number of reads! "
+                                    "Valid range <1,%d>.\n", MAX_READ_DEPTH);
+                    return -1;
+                }
+                break;
+            case ARG_NOTIFY:
+                if (!parse_number(optarg, 134217728, &data.notify_threshold))
+                {
+                    fprintf(stderr, "Invalid notification threshold! "
+                                    "Valid range <0,134217728>.\n");
+                    return -1;
+                }
+                break;
+            case ARG_FLUSH_SIZE:
+                if (!parse_number(optarg, MAX_FLUSH_SIZE, &data.flush_size))
+                {
+                    fprintf(stderr, "Invalid --flush-size value! "
+                                    "Valid range <0,%d> MiB.\n", MAX_FLUSH_SIZE);
+                    return -1;
+                }
+                break;
+            case ARG_FLUSH_INTERVAL:
+                if (!parse_number(optarg, MAX_FLUSH_INTERVAL, &data.flush_interval))
+                {
+                    fprintf(stderr, "Invalid --flush-interval value! "
+                                    "Valid range <0,%d> ms.\n", MAX_FLUSH_INTERVAL);
+                    return -1;
+                }
+                break;
+            case ARG_PCAPNG:
+                data.pcapng = TRUE;
+                break;
+            case ARG_COMPRESS:
+                data.compress = TRUE;
+                break;
+            case ARG_COMPRESS_THREADS:
+                data.compress_threads = atol(optarg);
+                if (data.compress_threads < 1 ||
+                    data.compress_threads > COMPRESS_MAX_THREADS)
+                {
+                    fprintf(stderr, "Invalid number of compression threads! "
+                                    "Valid range <1,%d>.\n",
+                            COMPRESS_MAX_THREADS);
+                    return -1;
+                }
+                break;
+            case ARG_INDEX:
+                data.index = TRUE;
+                break;
+            case ARG_DIRECT_IO:
+                data.direct_io = TRUE;
+                break;
+            case ARG_SHMEM:
+                data.shmem = TRUE;
+                break;
+            case ARG_MONITOR:
+                data.monitor = TRUE;
+                break;
+            case ARG_FILTER:
+                data.record_filter = optarg;
+                break;
+            case ARG_TRIGGER:
+                data.trigger = optarg;
+                break;
+            case ARG_TRIGGER_BUFFER:
+                if (!parse_number(optarg, MAX_TRIGGER_BUFFER, &data.trigger_buffer) ||
+                    (data.trigger_buffer == 0))
+                {
+                    fprintf(stderr, "Invalid trigger buffer size! "
+                                    "Valid range <1,%d>.\n", MAX_TRIGGER_BUFFER);
+                    return -1;
+                }
+                break;
+            case ARG_TRIGGER_BEFORE:
+                if (!parse_number(optarg, MAX_TRIGGER_SECONDS, &data.trigger_before))
+                {
+                    fprintf(stderr, "Invalid --trigger-before value! "
+                                    "Valid range <0,%d> seconds.\n",
+                            MAX_TRIGGER_SECONDS);
+                    return -1;
+                }
+                break;
+            case ARG_TRIGGER_AFTER:
+                if (!parse_number(optarg, MAX_TRIGGER_SECONDS, &data.trigger_after))
+                {
+                    fprintf(stderr, "Invalid --trigger-after value! "
+                                    "Valid range <0,%d> seconds.\n",
+                            MAX_TRIGGER_SECONDS);
+                    return -1;
+                }
+                break;
+            case 'C':
+                if (!parse_number(optarg, MAX_ROTATE_SIZE, &data.rotate_size))
+                {
+                    fprintf(stderr, "Invalid -C value! Valid range <0,%d>.\n",
+                            MAX_ROTATE_SIZE);
+                    return -1;
+                }
+                break;
+            case 'G':
+                if (!parse_number(optarg, MAX_ROTATE_SECONDS, &data.rotate_seconds))
+                {
+                    fprintf(stderr, "Invalid -G value! Valid range <0,%d> seconds.\n",
+                            MAX_ROTATE_SECONDS);
+                    return -1;
+                }
+                break;
+            case 'W':
+                if (!parse_number(optarg, MAX_ROTATE_FILES, &data.rotate_files))
+                {
+                    fprintf(stderr, "Invalid -W value! Valid range <0,%d>.\n",
+                            MAX_ROTATE_FILES);
+                    return -1;
+                }
+                break;
             case 'I': /* --init-non-standard-hwids */
                 init_non_standard_roothub_hwid();
                 return 0;
@@ -1491,6 +2300,73 @@ int __cdecl main(int argc, CHAR **argv)
         }
     }
 
+    if ((data.rotate_files > 0) && (data.rotate_size == 0) && (data.rotate_seconds == 0))
+    {
+        fprintf(stderr, "-W requires -C or -G.\n");
+        return -1;
+    }
+
+    if (data.monitor)
+    {
+        if (data.device == NULL)
+        {
+            fprintf(stderr, "--monitor requires -d.\n");
+            return -1;
+        }
+
+        /* Captured data only goes through write thread, summary is
+         * printed to standard output instead.
+         */
+        if (data.filename != NULL)
+        {
+            free(data.filename);
+        }
+        data.filename = _strdup("-");
+        data.inject_descriptors = FALSE;
+        data.pcapng = FALSE;
+        data.compress = FALSE;
+        data.index = FALSE;
+        data.direct_io = FALSE;
+        data.rotate_size = DEFAULT_ROTATE_SIZE;
+        data.rotate_seconds = DEFAULT_ROTATE_SECONDS;
+        data.rotate_files = DEFAULT_ROTATE_FILES;
+        data.record_filter = NULL;
+        data.trigger = NULL;
+    }
+
+    if (data.record_filter != NULL)
+    {
+        struct recfilter filter;
+        const char *error;
+        size_t error_pos;
+
+        if (!recfilter_compile(&filter, data.record_filter, &error, &error_pos))
+        {
+            fprintf(stderr, "Invalid filter: %s.\n  %s\n  %*s^\n",
+                    error, data.record_filter, (int)error_pos, "");
+            return -1;
+        }
+    }
+
+    if (data.trigger != NULL)
+    {
+        struct trigger_expr expr;
+        const char *error;
+
+        if (!trigger_parse(&expr, data.trigger, &error))
+        {
+            fprintf(stderr, "Invalid trigger '%s': %s.\n", data.trigger, error);
+            return -1;
+        }
+    }
+
+    if (data.notify_threshold > data.bufferlen)
+    {
+        fprintf(stderr, "Notification threshold exceeds buffer length %u.\n",
+                data.bufferlen);
+        return -1;
+    }
+
     if (data.snaplen > (data.bufferlen - sizeof(pcaprec_hdr_t)))
     {
         fprintf(stderr, "Packets larger than %u bytes won't be captured due to too small buffer.\n",
@@ -1535,6 +2411,10 @@ int __cdecl main(int argc, CHAR **argv)
     {
         free(data.device);
     }
+    if (data.device_list != NULL)
+    {
+        free(data.device_list);
+    }
     if (data.filename != NULL)
     {
         free(data.filename);
@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+#include "lz4.h"
+#include "bytes.h"
+
+/* Skippable frame header in front of seek table entries */
+#define SEEK_HEADER_LEN  8
+
+static void pool_lock(struct compress *c)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&c->lock);
+#else
+    pthread_mutex_lock(&c->lock);
+#endif
+}
+
+static void pool_unlock(struct compress *c)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&c->lock);
+#else
+    pthread_mutex_unlock(&c->lock);
+#endif
+}
+
+/* Called with lock held */
+static void signal_work(struct compress *c, unsigned int workers)
+{
+#ifdef _WIN32
+    ReleaseSemaphore(c->work, (LONG)workers, NULL);
+#else
+    if (workers > 1)
+    {
+        pthread_cond_broadcast(&c->work);
+    }
+    else
+    {
+        pthread_cond_signal(&c->work);
+    }
+#endif
+}
+
+/* Called with lock held, returns with lock held */
+static void wait_work(struct compress *c)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&c->lock);
+    WaitForSingleObject(c->work, INFINITE);
+    EnterCriticalSection(&c->lock);
+#else
+    pthread_cond_wait(&c->work, &c->lock);
+#endif
+}
+
+/* Called with lock held */
+static void signal_done(struct compress *c)
+{
+#ifdef _WIN32
+    SetEvent(c->done);
+#else
+    pthread_cond_signal(&c->done);
+#endif
+}
+
+/* Called with lock held, returns with lock held */
+static void wait_done(struct compress *c)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&c->lock);
+    WaitForSingleObject(c->done, INFINITE);
+    EnterCriticalSection(&c->lock);
+#else
+    pthread_cond_wait(&c->done, &c->lock);
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_thread(LPVOID param)
+#else
+static void *worker_thread(void *param)
+#endif
+{
+    struct compress_worker *worker = (struct compress_worker *)param;
+    struct compress *c = worker->c;
+    struct compress_frame *frame;
+
+    pool_lock(c);
+    for (;;)
+    {
+        while ((c->taken == c->submitted) && !c->stop)
+        {
+            wait_work(c);
+        }
+        if (c->taken == c->submitted)
+        {
+            /* Stopped with nothing left to do */
+            break;
+        }
+
+        frame = &c->frames[c->taken % c->count];
+        c->taken++;
+        pool_unlock(c);
+
+        frame->out_len = (unsigned int)lz4_compress_frame(frame->in, frame->in_len,
+                                                          frame->out,
+                                                          lz4_frame_bound(c->capacity),
+                                                          worker->hash_table);
+
+        pool_lock(c);
+        frame->done = 1;
+        signal_done(c);
+    }
+    pool_unlock(c);
+
+    return 0;
+}
+
+static void free_buffers(struct compress *c)
+{
+    unsigned int i;
+
+    if (c->frames != NULL)
+    {
+        for (i = 0; i < c->count; i++)
+        {
+            free(c->frames[i].in);
+            free(c->frames[i].out);
+        }
+        free(c->frames);
+        c->frames = NULL;
+    }
+
+    if (c->workers != NULL)
+    {
+        for (i = 0; i < c->worker_count; i++)
+        {
+            free(c->workers[i].hash_table);
+        }
+        free(c->workers);
+        c->workers = NULL;
+    }
+
+    free(c->table);
+    c->table = NULL;
+}
+
+/* Makes sure there is room for length more bytes and the footer */
+static int reserve_table(struct compress *c, unsigned int length)
+{
+    unsigned int size = c->table_size;
+    unsigned char *table;
+
+    if (c->table_len + length + COMPRESS_SEEK_FOOTER_LEN <= size)
+    {
+        return 1;
+    }
+
+    while (c->table_len + length + COMPRESS_SEEK_FOOTER_LEN > size)
+    {
+        size = (size == 0) ? 4096 : 2 * size;
+    }
+
+    table = realloc(c->table, size);
+    if (table == NULL)
+    {
+        return 0;
+    }
+    c->table = table;
+    c->table_size = size;
+    return 1;
+}
+
+int compress_init(struct compress *c, unsigned int threads,
+                  unsigned int frame_size, unsigned int max_packet)
+{
+    unsigned int i;
+
+    memset(c, 0, sizeof(struct compress));
+
+    if ((threads == 0) || (threads > COMPRESS_MAX_THREADS))
+    {
+        return 0;
+    }
+
+    /* Every worker can have one frame queued behind one being compressed,
+     * and caller needs some for filling and writing.
+     */
+    c->count = 2 * threads + 2;
+    c->frame_size = frame_size;
+    c->capacity = frame_size + max_packet;
+    c->frames = calloc(c->count, sizeof(struct compress_frame));
+    c->workers = calloc(threads, sizeof(struct compress_worker));
+    c->worker_count = threads;
+    if ((c->frames == NULL) || (c->workers == NULL))
+    {
+        free_buffers(c);
+        return 0;
+    }
+
+    for (i = 0; i < c->count; i++)
+    {
+        c->frames[i].in = malloc(c->capacity);
+        c->frames[i].out = malloc(lz4_frame_bound(c->capacity));
+        if ((c->frames[i].in == NULL) || (c->frames[i].out == NULL))
+        {
+            free_buffers(c);
+            return 0;
+        }
+    }
+
+    for (i = 0; i < threads; i++)
+    {
+        c->workers[i].c = c;
+        c->workers[i].hash_table = malloc(sizeof(unsigned int) * LZ4_HASH_SIZE);
+        if (c->workers[i].hash_table == NULL)
+        {
+            free_buffers(c);
+            return 0;
+        }
+    }
+
+    compress_reset(c);
+    if (!reserve_table(c, 0))
+    {
+        free_buffers(c);
+        return 0;
+    }
+
+#ifdef _WIN32
+    InitializeCriticalSection(&c->lock);
+    c->work = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+    c->done = CreateEvent(NULL,
+                          FALSE /* Auto Reset */,
+                          FALSE /* Default non signaled */,
+                          NULL /* No name */);
+    if ((c->work == NULL) || (c->done == NULL))
+    {
+        /* Do not start any thread */
+        threads = 0;
+    }
+#else
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->work, NULL);
+    pthread_cond_init(&c->done, NULL);
+#endif
+
+    for (i = 0; i < threads; i++)
+    {
+#ifdef _WIN32
+        c->workers[i].thread = CreateThread(NULL, 0, worker_thread, &c->workers[i], 0, NULL);
+        if (c->workers[i].thread == NULL)
+        {
+            break;
+        }
+#else
+        if (pthread_create(&c->workers[i].thread, NULL, worker_thread, &c->workers[i]) != 0)
+        {
+            break;
+        }
+#endif
+        c->threads++;
+    }
+
+    if (c->threads < c->worker_count)
+    {
+        /* Requested number of threads could not be started */
+        compress_destroy(c);
+        return 0;
+    }
+
+    return 1;
+}
+
+void compress_destroy(struct compress *c)
+{
+    unsigned int i;
+
+    if (c->frames == NULL)
+    {
+        return;
+    }
+
+    pool_lock(c);
+    c->stop = 1;
+    signal_work(c, c->threads);
+    pool_unlock(c);
+
+    for (i = 0; i < c->threads; i++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(c->workers[i].thread, INFINITE);
+        CloseHandle(c->workers[i].thread);
+#else
+        pthread_join(c->workers[i].thread, NULL);
+#endif
+    }
+
+#ifdef _WIN32
+    if (c->work != NULL)
+    {
+        CloseHandle(c->work);
+    }
+    if (c->done != NULL)
+    {
+        CloseHandle(c->done);
+    }
+    DeleteCriticalSection(&c->lock);
+#else
+    pthread_cond_destroy(&c->work);
+    pthread_cond_destroy(&c->done);
+    pthread_mutex_destroy(&c->lock);
+#endif
+
+    free_buffers(c);
+    memset(c, 0, sizeof(struct compress));
+}
+
+static void submit_frame(struct compress *c)
+{
+    struct compress_frame *frame = c->current;
+
+    frame->flags = c->flags;
+    frame->first_ts = c->first_ts;
+    frame->last_ts = c->last_ts;
+    c->flags = 0;
+    c->current = NULL;
+
+    pool_lock(c);
+    c->submitted++;
+    signal_work(c, 1);
+    pool_unlock(c);
+}
+
+unsigned char *compress_space(struct compress *c, unsigned int *size)
+{
+    struct compress_frame *frame;
+
+    if (c->current == NULL)
+    {
+        frame = &c->frames[c->submitted % c->count];
+        if (frame->busy)
+        {
+            return NULL;
+        }
+        frame->busy = 1;
+        frame->in_len = 0;
+        c->current = frame;
+    }
+
+    *size = c->capacity - c->current->in_len;
+    return &c->current->in[c->current->in_len];
+}
+
+void compress_commit(struct compress *c, unsigned int bytes)
+{
+    c->current->in_len += bytes;
+    c->total += bytes;
+    c->buffered += bytes;
+
+    if (c->current->in_len == c->capacity)
+    {
+        /* Packet longer than expected, next frame starts inside it */
+        submit_frame(c);
+        c->flags = COMPRESS_SEEK_CONTINUED;
+    }
+}
+
+int compress_frame_due(struct compress *c, unsigned int pending)
+{
+    unsigned int filled = (c->current != NULL) ? c->current->in_len : 0;
+
+    return (unsigned long long)filled + pending >= c->frame_size;
+}
+
+void compress_cut(struct compress *c, int continued)
+{
+    if ((c->current != NULL) && (c->current->in_len > 0))
+    {
+        submit_frame(c);
+    }
+    if (continued)
+    {
+        c->flags = COMPRESS_SEEK_CONTINUED;
+    }
+}
+
+void compress_close(struct compress *c)
+{
+    if ((c->current != NULL) && (c->current->in_len > 0))
+    {
+        submit_frame(c);
+    }
+}
+
+void compress_packet(struct compress *c, unsigned long long timestamp)
+{
+    if ((c->flags & COMPRESS_SEEK_HAS_PACKETS) == 0)
+    {
+        c->flags |= COMPRESS_SEEK_HAS_PACKETS;
+        c->first_ts = timestamp;
+    }
+    c->last_ts = timestamp;
+}
+
+void compress_mark_header(struct compress *c)
+{
+    c->header_length = (unsigned int)c->total;
+}
+
+unsigned long long compress_buffered(struct compress *c)
+{
+    return c->buffered;
+}
+
+static int add_seek_entry(struct compress *c, struct compress_frame *frame)
+{
+    unsigned char *p;
+
+    if (!reserve_table(c, COMPRESS_SEEK_ENTRY_LEN))
+    {
+        return 0;
+    }
+
+    p = &c->table[c->table_len];
+    put32(p, frame->out_len);
+    put32(p + 4, frame->in_len);
+    put64(p + 8, frame->first_ts);
+    put64(p + 16, frame->last_ts);
+    put32(p + 24, frame->flags);
+    put32(p + 28, 0);
+    c->table_len += COMPRESS_SEEK_ENTRY_LEN;
+    c->entries++;
+    return 1;
+}
+
+struct compress_frame *compress_output(struct compress *c, int wait)
+{
+    struct compress_frame *frame;
+
+    if (c->output == c->submitted)
+    {
+        return NULL;
+    }
+
+    frame = &c->frames[c->output % c->count];
+    pool_lock(c);
+    while (!frame->done)
+    {
+        if (!wait)
+        {
+            pool_unlock(c);
+            return NULL;
+        }
+        wait_done(c);
+    }
+    frame->done = 0;
+    pool_unlock(c);
+
+    c->output++;
+    c->buffered -= frame->in_len;
+
+    if (!add_seek_entry(c, frame))
+    {
+        /* Table would not match the frames, write an empty one instead.
+         * File is still readable from the start.
+         */
+        c->table_len = SEEK_HEADER_LEN;
+        c->entries = 0;
+        c->broken_table = 1;
+    }
+    else if (c->broken_table)
+    {
+        c->table_len = SEEK_HEADER_LEN;
+        c->entries = 0;
+    }
+
+    return frame;
+}
+
+void compress_release(struct compress *c, struct compress_frame *frame)
+{
+    (void)c;
+    frame->busy = 0;
+}
+
+unsigned char *compress_seek_table(struct compress *c, unsigned int *length)
+{
+    unsigned char *p;
+
+    p = &c->table[c->table_len];
+    put32(p, c->header_length);
+    put32(p + 4, c->entries);
+    put32(p + 8, COMPRESS_SEEK_VERSION);
+    put32(p + 12, COMPRESS_SEEK_MAGIC);
+
+    put32(c->table, COMPRESS_SEEK_FRAME_MAGIC);
+    put32(c->table + 4, c->table_len + COMPRESS_SEEK_FOOTER_LEN - SEEK_HEADER_LEN);
+
+    *length = c->table_len + COMPRESS_SEEK_FOOTER_LEN;
+    return c->table;
+}
+
+void compress_reset(struct compress *c)
+{
+    c->total = 0;
+    c->buffered = 0;
+    c->header_length = 0;
+    c->flags = 0;
+    c->entries = 0;
+    c->table_len = SEEK_HEADER_LEN;
+    c->broken_table = 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Compressed capture output.
+ *
+ * Output data is cut into frames that are compressed by a pool of
+ * worker threads and handed back in the original order. Every frame is
+ * a separate LZ4 frame so it can be decompressed on its own. Frames are
+ * normally cut between packets.
+ *
+ * The stream ends with a seek table stored in LZ4 skippable frame, so
+ * any LZ4 decoder gives back the original capture. All fields are
+ * little endian:
+ *   u32 COMPRESS_SEEK_FRAME_MAGIC
+ *   u32 length of the rest of the skippable frame
+ *   entries, COMPRESS_SEEK_ENTRY_LEN bytes each:
+ *     u32 compressed frame length
+ *     u32 decompressed frame length
+ *     u64 timestamp of first packet starting in the frame (ns)
+ *     u64 timestamp of last packet starting in the frame (ns)
+ *     u32 flags (COMPRESS_SEEK_xxx)
+ *     u32 reserved, 0
+ *   footer, COMPRESS_SEEK_FOOTER_LEN bytes:
+ *     u32 length of file header at the start of first frame
+ *     u32 number of entries
+ *     u32 COMPRESS_SEEK_VERSION
+ *     u32 COMPRESS_SEEK_MAGIC
+ *
+ * This file does not depend on Windows API other than threads so it can
+ * be built and measured on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_COMPRESS_H
+#define USBPCAP_CMD_COMPRESS_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/* Frames are cut at first packet boundary after this many bytes */
+#define COMPRESS_FRAME_SIZE          (1024*1024)
+#define COMPRESS_DEFAULT_THREADS     2
+#define COMPRESS_MAX_THREADS         64
+
+#define COMPRESS_SEEK_FRAME_MAGIC    0x184D2A5E
+#define COMPRESS_SEEK_MAGIC          0x4B454553 /* "SEEK" */
+#define COMPRESS_SEEK_VERSION        1
+#define COMPRESS_SEEK_ENTRY_LEN      32
+#define COMPRESS_SEEK_FOOTER_LEN     16
+
+/* Frame starts in the middle of a packet */
+#define COMPRESS_SEEK_CONTINUED      0x01
+/* Timestamps are valid, at least one packet starts in the frame */
+#define COMPRESS_SEEK_HAS_PACKETS    0x02
+
+struct compress_frame
+{
+    unsigned char *in;
+    unsigned int in_len;
+    unsigned char *out;
+    unsigned int out_len;
+
+    unsigned long long first_ts;
+    unsigned long long last_ts;
+    unsigned int flags;
+
+    int busy;          /* Filled, compressed or written, owned by caller */
+    int done;          /* Set by worker once compressed, under lock */
+};
+
+struct compress_worker
+{
+    struct compress *c;
+    unsigned int *hash_table;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+};
+
+struct compress
+{
+    struct compress_frame *frames;
+    unsigned int count;
+    unsigned int capacity;   /* Size of frame input buffer */
+    unsigned int frame_size; /* Frames are cut at packet boundary after this */
+
+    /* Frame indices are only ever incremented, frame is index % count */
+    unsigned int submitted;  /* Frames passed to workers */
+    unsigned int taken;      /* Frames workers have started with */
+    unsigned int output;     /* Frames returned by compress_output() */
+    struct compress_frame *current; /* Frame being filled, can be NULL */
+
+    /* Packet info for frame being filled */
+    unsigned int flags;
+    unsigned long long first_ts;
+    unsigned long long last_ts;
+
+    unsigned long long total;    /* Bytes passed since last reset */
+    unsigned long long buffered; /* Bytes passed but not yet output */
+    unsigned int header_length;
+
+    /* Seek table, entries are added as frames are output */
+    unsigned char *table;
+    unsigned int table_len;
+    unsigned int table_size;
+    unsigned int entries;
+    int broken_table;        /* Entry could not be added, table is empty */
+
+    struct compress_worker *workers;
+    unsigned int worker_count; /* Number of allocated workers */
+    unsigned int threads;      /* Number of running workers */
+    int stop;
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+    HANDLE work;  /* Semaphore, released once per submitted frame */
+    HANDLE done;  /* Auto reset event, set when any frame is compressed */
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+#endif
+};
+
+/*
+ * Starts threads compressing frames of frame_size bytes. Frames are
+ * only cut in the middle of a packet if a packet longer than max_packet
+ * does not fit.
+ *
+ * Returns 1 on success, 0 on failure.
+ */
+int compress_init(struct compress *c, unsigned int threads,
+                  unsigned int frame_size, unsigned int max_packet);
+
+/* Stops the threads and frees everything */
+void compress_destroy(struct compress *c);
+
+/*
+ * Returns space left in frame being filled and sets *size to its length.
+ * Returns NULL if all frames are busy, caller has to get frames with
+ * compress_output() and release them first.
+ */
+unsigned char *compress_space(struct compress *c, unsigned int *size);
+
+/* Adds bytes written to space returned by compress_space() */
+void compress_commit(struct compress *c, unsigned int bytes);
+
+/* Returns non-zero if frame should be cut before pending more bytes */
+int compress_frame_due(struct compress *c, unsigned int pending);
+
+/* Passes frame being filled to workers, called at packet boundary */
+void compress_close(struct compress *c);
+
+/*
+ * Passes frame being filled to workers when the data that follows does
+ * not fit. continued is non-zero if the cut is inside a packet.
+ */
+void compress_cut(struct compress *c, int continued);
+
+/* Records timestamp (ns) of packet starting in frame being filled */
+void compress_packet(struct compress *c, unsigned long long timestamp);
+
+/* Marks everything passed so far as file header */
+void compress_mark_header(struct compress *c);
+
+/* Returns number of bytes passed that are not yet output */
+unsigned long long compress_buffered(struct compress *c);
+
+/*
+ * Returns oldest compressed frame that has not been output yet. Waits for
+ * the frame to be compressed if wait is non-zero. Returns NULL if there
+ * is no such frame (or it is not compressed and wait is zero).
+ */
+struct compress_frame *compress_output(struct compress *c, int wait);
+
+/* Makes frame returned by compress_output() available again */
+void compress_release(struct compress *c, struct compress_frame *frame);
+
+/*
+ * Returns seek table for all frames output so far and sets *length to
+ * its length. Table remains valid until compress_reset().
+ */
+unsigned char *compress_seek_table(struct compress *c, unsigned int *length);
+
+/* Starts new stream, all frames must be output and released first */
+void compress_reset(struct compress *c);
+
+#endif /* USBPCAP_CMD_COMPRESS_H */
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "desccache.h"
+#include "bytes.h"
+
+#define ENTRY_HDR_LEN  (5 + DESCCACHE_DEVICE_LEN)
+
+#define FNV_OFFSET     0x811C9DC5
+#define FNV_PRIME      0x01000193
+
+static unsigned int hash(const unsigned char *data, size_t length)
+{
+    unsigned int h = FNV_OFFSET;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        h = (h ^ data[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+void desccache_init(struct desccache *c)
+{
+    memset(c, 0, sizeof(struct desccache));
+}
+
+void desccache_free(struct desccache *c)
+{
+    unsigned int i;
+
+    for (i = 0; i < c->count; i++)
+    {
+        free(c->entries[i].config);
+    }
+    free(c->entries);
+    memset(c, 0, sizeof(struct desccache));
+}
+
+static struct desccache_entry *find_path(const struct desccache *c, const char *path)
+{
+    unsigned int i;
+
+    /* Few devices are connected to a root hub, linear search is fine */
+    for (i = 0; i < c->count; i++)
+    {
+        if (strcmp(c->entries[i].path, path) == 0)
+        {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+const struct desccache_entry *desccache_find(const struct desccache *c,
+                                             const char *path,
+                                             unsigned short address,
+                                             const unsigned char *device)
+{
+    const struct desccache_entry *entry = find_path(c, path);
+
+    if ((entry == NULL) || (entry->address != address) ||
+        (memcmp(entry->device, device, DESCCACHE_DEVICE_LEN) != 0))
+    {
+        return NULL;
+    }
+    return entry;
+}
+
+int desccache_add(struct desccache *c, const char *path,
+                  unsigned short address, const unsigned char *device,
+                  const unsigned char *config, unsigned short config_len)
+{
+    struct desccache_entry *entry;
+    unsigned char *copy;
+
+    if (strlen(path) >= DESCCACHE_MAX_PATH)
+    {
+        return 0;
+    }
+
+    copy = (unsigned char *)malloc(config_len ? config_len : 1);
+    if (copy == NULL)
+    {
+        return 0;
+    }
+    memcpy(copy, config, config_len);
+
+    entry = find_path(c, path);
+    if (entry != NULL)
+    {
+        free(entry->config);
+    }
+    else
+    {
+        if (c->count == c->size)
+        {
+            unsigned int size = c->size ? c->size * 2 : 16;
+            struct desccache_entry *entries;
+
+            entries = (struct desccache_entry *)realloc(c->entries,
+                                                        size * sizeof(struct desccache_entry));
+            if (entries == NULL)
+            {
+                free(copy);
+                return 0;
+            }
+            c->entries = entries;
+            c->size = size;
+        }
+        entry = &c->entries[c->count];
+        c->count++;
+        strcpy(entry->path, path);
+    }
+
+    entry->address = address;
+    memcpy(entry->device, device, DESCCACHE_DEVICE_LEN);
+    entry->config = copy;
+    entry->config_len = config_len;
+    return 1;
+}
+
+int desccache_parse(struct desccache *c, const unsigned char *data, size_t length)
+{
+    const unsigned char *p;
+    const unsigned char *end = data + length;
+    unsigned int count;
+    unsigned int i;
+
+    desccache_free(c);
+
+    if ((length < DESCCACHE_HEADER_LEN) ||
+        (get32(data) != DESCCACHE_MAGIC) ||
+        (get16(&data[4]) != DESCCACHE_VERSION) ||
+        (get32(&data[12]) != hash(&data[DESCCACHE_HEADER_LEN],
+                                  length - DESCCACHE_HEADER_LEN)))
+    {
+        return 0;
+    }
+
+    count = get32(&data[8]);
+    p = &data[DESCCACHE_HEADER_LEN];
+    for (i = 0; i < count; i++)
+    {
+        char path[DESCCACHE_MAX_PATH];
+        unsigned int config_len;
+        unsigned int path_len;
+
+        if ((size_t)(end - p) < ENTRY_HDR_LEN)
+        {
+            break;
+        }
+        config_len = get16(&p[2]);
+        path_len = p[4];
+        if ((path_len >= DESCCACHE_MAX_PATH) ||
+            ((size_t)(end - p) < ENTRY_HDR_LEN + path_len + config_len))
+        {
+            break;
+        }
+        memcpy(path, &p[ENTRY_HDR_LEN], path_len);
+        path[path_len] = '\0';
+
+        if (!desccache_add(c, path, (unsigned short)get16(p), &p[5],
+                           &p[ENTRY_HDR_LEN + path_len],
+                           (unsigned short)config_len))
+        {
+            break;
+        }
+        p += ENTRY_HDR_LEN + path_len + config_len;
+    }
+
+    if ((i != count) || (p != end))
+    {
+        desccache_free(c);
+        return 0;
+    }
+    return 1;
+}
+
+unsigned char *desccache_serialize(const struct desccache *c, size_t *length)
+{
+    const struct desccache_entry *entry;
+    unsigned char *data;
+    unsigned char *p;
+    size_t total = DESCCACHE_HEADER_LEN;
+    size_t path_len;
+    unsigned int i;
+
+    for (i = 0; i < c->count; i++)
+    {
+        total += ENTRY_HDR_LEN + strlen(c->entries[i].path) +
+                 c->entries[i].config_len;
+    }
+
+    data = (unsigned char *)malloc(total);
+    if (data == NULL)
+    {
+        return NULL;
+    }
+
+    p = &data[DESCCACHE_HEADER_LEN];
+    for (i = 0; i < c->count; i++)
+    {
+        entry = &c->entries[i];
+        path_len = strlen(entry->path);
+        put16(p, entry->address);
+        put16(&p[2], entry->config_len);
+        p[4] = (unsigned char)path_len;
+        memcpy(&p[5], entry->device, DESCCACHE_DEVICE_LEN);
+        memcpy(&p[ENTRY_HDR_LEN], entry->path, path_len);
+        memcpy(&p[ENTRY_HDR_LEN + path_len], entry->config, entry->config_len);
+        p += ENTRY_HDR_LEN + path_len + entry->config_len;
+    }
+
+    put32(data, DESCCACHE_MAGIC);
+    put16(&data[4], DESCCACHE_VERSION);
+    put16(&data[6], 0);
+    put32(&data[8], c->count);
+    put32(&data[12], hash(&data[DESCCACHE_HEADER_LEN], total - DESCCACHE_HEADER_LEN));
+
+    *length = total;
+    return data;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Cache of configuration descriptors injected into capture.
+ *
+ * Querying configuration descriptor means two control transfers to the
+ * device. Device descriptor and address come for free with hub port
+ * enumeration, so an entry is looked up by port path, address and the
+ * complete device descriptor. Re-plugged or re-enumerated device gets
+ * new address and thus misses the cache.
+ *
+ * Serialized cache starts with header:
+ *   u32 DESCCACHE_MAGIC
+ *   u16 DESCCACHE_VERSION
+ *   u16 reserved, 0
+ *   u32 number of entries
+ *   u32 FNV-1a hash of all bytes following the header
+ * followed by entries:
+ *   u16 device address
+ *   u16 configuration descriptor length
+ *   u8  port path length
+ *   u8  device descriptor[DESCCACHE_DEVICE_LEN]
+ *   port path (port numbers from root hub, e.g. "3.1"), not terminated
+ *   configuration descriptor with all interface and endpoint descriptors
+ * All fields are in host byte order.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_DESCCACHE_H
+#define USBPCAP_CMD_DESCCACHE_H
+
+#include <stddef.h>
+
+#define DESCCACHE_MAGIC       0x43445055 /* "UPDC" */
+#define DESCCACHE_VERSION     1
+#define DESCCACHE_HEADER_LEN  16
+
+/* Standard device descriptor length */
+#define DESCCACHE_DEVICE_LEN  18
+/* Longest port path, 7 hub tiers with up to 3 digit port numbers */
+#define DESCCACHE_MAX_PATH    32
+
+struct desccache_entry
+{
+    char path[DESCCACHE_MAX_PATH];
+    unsigned short address;
+    unsigned char device[DESCCACHE_DEVICE_LEN];
+    unsigned char *config;
+    unsigned short config_len;
+};
+
+struct desccache
+{
+    struct desccache_entry *entries;
+    unsigned int count;
+    unsigned int size;  /* Allocated entries */
+};
+
+void desccache_init(struct desccache *c);
+
+/* Frees all entries, cache can be reused afterwards */
+void desccache_free(struct desccache *c);
+
+/*
+ * Replaces cache content with serialized cache. Returns 0 if data is not
+ * a valid cache, the cache is empty then.
+ */
+int desccache_parse(struct desccache *c, const unsigned char *data, size_t length);
+
+/*
+ * Returns newly allocated serialized cache, to be freed using free(),
+ * or NULL if memory could not be allocated.
+ */
+unsigned char *desccache_serialize(const struct desccache *c, size_t *length);
+
+/* Returns matching entry, NULL if device is not cached */
+const struct desccache_entry *desccache_find(const struct desccache *c,
+                                             const char *path,
+                                             unsigned short address,
+                                             const unsigned char *device);
+
+/*
+ * Adds entry, replacing any entry with the same path. Returns 0 if path
+ * is too long or memory could not be allocated.
+ */
+int desccache_add(struct desccache *c, const char *path,
+                  unsigned short address, const unsigned char *device,
+                  const unsigned char *config, unsigned short config_len);
+
+#endif /* USBPCAP_CMD_DESCCACHE_H */
@@ -10,14 +10,22 @@
 #include <Windows.h>
 #include <devioctl.h>
 #include <Usbioctl.h>
+#include <tchar.h>
 #include "enum.h"
 #include "iocontrol.h"
+#include "desccache.h"
 #include "USBPcap.h"
 
 #define URB_SELECT_CONFIGURATION       0x0000
 #define URB_CONTROL_TRANSFER           0x0008
 #define URB_GET_DESCRIPTOR_FROM_DEVICE 0x000b
 
+/* Configuration descriptors of at most this many devices are queried at once */
+#define MAX_QUERY_THREADS              8
+
+/* Cache files larger than this are not loaded */
+#define MAX_CACHE_FILE_SIZE            (4*1024*1024)
+
 typedef struct _list_entry
 {
     void *data; /* Packet data without pcaprec_hdr_t */
@@ -25,12 +33,30 @@ typedef struct _list_entry
     struct _list_entry *next;
 } list_entry;
 
+typedef struct _connected_device
+{
+    char path[ENUM_MAX_PORT_PATH]; /* Port numbers from root hub */
+    USHORT address;
+    UINT8 device[DESCCACHE_DEVICE_LEN]; /* Device descriptor as sent on the wire */
+    PTSTR hub_name; /* Hub to query configuration descriptor from, NULL if cached */
+    ULONG port;
+    PUSB_DESCRIPTOR_REQUEST request; /* Queried configuration descriptor */
+    const struct desccache_entry *cached; /* Cached configuration descriptor */
+} connected_device;
+
 typedef struct _descriptor_callback_context
 {
     USHORT roothub;
     PUSBPCAP_ADDRESS_FILTER addresses;
     list_entry *head;
     list_entry *tail;
+
+    connected_device *devices; /* Devices in enumeration order */
+    LONG device_count;
+    LONG devices_size;
+    volatile LONG next_query; /* Index of next device to query */
+
+    struct desccache cache; /* Descriptors cached by previous capture */
 } descriptor_callback_context;
 
 /* Get ddescriptor for given device
@@ -237,20 +263,9 @@ static void write_complete_packet(descriptor_callback_context *ctx,
     add_to_list(ctx, data, data_len);
 }
 
-static void
-write_device_descriptor_complete(descriptor_callback_context *ctx,
-                                 USHORT deviceAddress,
-                                 PUSB_DEVICE_DESCRIPTOR descriptor)
+/* Serializes device descriptor the way device sends it */
+static void device_descriptor_bytes(PUSB_DEVICE_DESCRIPTOR descriptor, UINT8 *payload)
 {
-    int data_len = sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + 18;
-    UINT8 *data = (UINT8*)malloc(data_len);
-    PUSBPCAP_BUFFER_CONTROL_HEADER hdr = (PUSBPCAP_BUFFER_CONTROL_HEADER)data;
-    UINT8 *payload = &data[sizeof(USBPCAP_BUFFER_CONTROL_HEADER)];
-
-    initialize_control_header(hdr, ctx->roothub, deviceAddress, 18,
-                              USBPCAP_CONTROL_STAGE_COMPLETE,
-                              URB_CONTROL_TRANSFER,
-                              TRUE, FALSE);
     payload[0] = descriptor->bLength;
     payload[1] = descriptor->bDescriptorType;
     payload[2] = (descriptor->bcdUSB & 0x00FF);
@@ -269,52 +284,268 @@ write_device_descriptor_complete(descriptor_callback_context *ctx,
     payload[15] = descriptor->iProduct;
     payload[16] = descriptor->iSerialNumber;
     payload[17] = descriptor->bNumConfigurations;
+}
 
-    add_to_list(ctx, data, data_len);
+static void write_device_packets(descriptor_callback_context *ctx,
+                                 connected_device *device)
+{
+    write_setup_packet(ctx, URB_GET_DESCRIPTOR_FROM_DEVICE,
+                       device->address, 0x80, 6,
+                       USB_DEVICE_DESCRIPTOR_TYPE << 8, 0, 18, FALSE);
+    write_complete_packet(ctx, URB_CONTROL_TRANSFER, device->address,
+                          device->device, DESCCACHE_DEVICE_LEN, FALSE);
 }
 
+/* config - configuration descriptor with all interface and endpoint descriptors */
+static void write_config_packets(descriptor_callback_context *ctx,
+                                 USHORT deviceAddress,
+                                 const UINT8 *config,
+                                 USHORT length)
+{
+    PUSB_CONFIGURATION_DESCRIPTOR descriptor = (PUSB_CONFIGURATION_DESCRIPTOR)config;
+
+    if (length < sizeof(USB_CONFIGURATION_DESCRIPTOR))
+    {
+        return;
+    }
+
+    write_setup_packet(ctx, URB_GET_DESCRIPTOR_FROM_DEVICE,
+                       deviceAddress, 0x80, 6,
+                       USB_CONFIGURATION_DESCRIPTOR_TYPE << 8, 0, length, FALSE);
+    write_complete_packet(ctx, URB_CONTROL_TRANSFER,
+                          deviceAddress, (void *)config, length, FALSE);
+
+    /* SET CONFIGURATION */
+    write_setup_packet(ctx, URB_SELECT_CONFIGURATION, deviceAddress,
+                       0x00, 9, descriptor->bConfigurationValue, 0, 0, TRUE);
+    write_complete_packet(ctx, URB_SELECT_CONFIGURATION, deviceAddress,
+                          NULL, 0, TRUE);
+}
+
+/* Only notes the device, descriptors are queried once enumeration is done */
 static void
-descriptor_callback(HANDLE hub, ULONG port, USHORT deviceAddress,
-                    PUSB_DEVICE_DESCRIPTOR desc, void *context)
+descriptor_callback(HANDLE hub, PCTSTR hub_name, ULONG port, const char *port_path,
+                    USHORT deviceAddress, PUSB_DEVICE_DESCRIPTOR desc, void *context)
 {
     descriptor_callback_context *ctx = (descriptor_callback_context *)context;
-    PUSB_DESCRIPTOR_REQUEST request;
+    connected_device *device;
 
     if (!USBPcapIsDeviceFiltered(ctx->addresses, deviceAddress))
     {
         return;
     }
 
-    write_setup_packet(ctx, URB_GET_DESCRIPTOR_FROM_DEVICE,
-                       deviceAddress, 0x80, 6,
-                       USB_DEVICE_DESCRIPTOR_TYPE << 8, 0, 18, FALSE);
-    write_device_descriptor_complete(ctx, deviceAddress, desc);
-
-    request = get_config_descriptor(hub, port, 0);
-    if (request)
-    {
-        PUSB_CONFIGURATION_DESCRIPTOR config;
-        config = (PUSB_CONFIGURATION_DESCRIPTOR)(request->Data);
-        write_setup_packet(ctx, URB_GET_DESCRIPTOR_FROM_DEVICE,
-                           deviceAddress,
-                           request->SetupPacket.bmRequest,
-                           request->SetupPacket.bRequest,
-                           request->SetupPacket.wValue,
-                           request->SetupPacket.wIndex,
-                           request->SetupPacket.wLength,
-                           FALSE);
-
-        write_complete_packet(ctx, URB_CONTROL_TRANSFER,
-                              deviceAddress, request->Data,
-                              request->SetupPacket.wLength, FALSE);
-
-        /* SET CONFIGURATION */
-        write_setup_packet(ctx, URB_SELECT_CONFIGURATION, deviceAddress,
-                           0x00, 9, config->bConfigurationValue, 0, 0, TRUE);
-        write_complete_packet(ctx, URB_SELECT_CONFIGURATION, deviceAddress,
-                              NULL, 0, TRUE);
-    }
-    free(request);
+    if (ctx->device_count == ctx->devices_size)
+    {
+        LONG size = ctx->devices_size ? ctx->devices_size * 2 : 16;
+        connected_device *devices;
+
+        devices = (connected_device *)realloc(ctx->devices, size * sizeof(connected_device));
+        if (devices == NULL)
+        {
+            return;
+        }
+        ctx->devices = devices;
+        ctx->devices_size = size;
+    }
+
+    device = &ctx->devices[ctx->device_count];
+    memset(device, 0, sizeof(connected_device));
+    strncpy_s(device->path, sizeof(device->path), port_path, _TRUNCATE);
+    device->address = deviceAddress;
+    device_descriptor_bytes(desc, device->device);
+    device->port = port;
+    device->cached = desccache_find(&ctx->cache, device->path, deviceAddress,
+                                    device->device);
+    if (device->cached == NULL)
+    {
+        /* Hub handle is closed once enumeration moves on */
+        device->hub_name = _tcsdup(hub_name);
+    }
+    ctx->device_count++;
+}
+
+static DWORD WINAPI query_thread(LPVOID param)
+{
+    descriptor_callback_context *ctx = (descriptor_callback_context *)param;
+    connected_device *device;
+    HANDLE hub;
+    LONG i;
+
+    while ((i = InterlockedIncrement(&ctx->next_query) - 1) < ctx->device_count)
+    {
+        device = &ctx->devices[i];
+        if (device->hub_name == NULL)
+        {
+            continue;
+        }
+
+        /* Every query uses its own handle, requests on one synchronous
+         * handle would be serialized.
+         */
+        hub = CreateFile(device->hub_name,
+                         GENERIC_WRITE,
+                         FILE_SHARE_WRITE,
+                         NULL,
+                         OPEN_EXISTING,
+                         0,
+                         NULL);
+        if (hub == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "Failed to open hub - %d\n", GetLastError());
+            continue;
+        }
+        device->request = get_config_descriptor(hub, device->port, 0);
+        CloseHandle(hub);
+    }
+
+    return 0;
+}
+
+/*
+ * Queries configuration descriptors of devices that are not cached. Every
+ * query waits for two control transfers, so devices are asked in parallel.
+ */
+static void query_config_descriptors(descriptor_callback_context *ctx)
+{
+    HANDLE threads[MAX_QUERY_THREADS];
+    DWORD thread_count = 0;
+    LONG queries = 0;
+    LONG i;
+
+    for (i = 0; i < ctx->device_count; i++)
+    {
+        if (ctx->devices[i].hub_name != NULL)
+        {
+            queries++;
+        }
+    }
+
+    ctx->next_query = 0;
+    for (i = 1; (i < queries) && (i < MAX_QUERY_THREADS); i++)
+    {
+        threads[thread_count] = CreateThread(NULL, /* default security attributes */
+                                             0,    /* use default stack size */
+                                             query_thread,
+                                             ctx,
+                                             0,    /* use default creation flag */
+                                             NULL);
+        if (threads[thread_count] != NULL)
+        {
+            thread_count++;
+        }
+    }
+
+    /* This thread takes part too, so queries finish even without threads */
+    query_thread(ctx);
+
+    if (thread_count > 0)
+    {
+        WaitForMultipleObjects(thread_count, threads, TRUE, INFINITE);
+        for (i = 0; i < (LONG)thread_count; i++)
+        {
+            CloseHandle(threads[i]);
+        }
+    }
+}
+
+static BOOL get_cache_file_name(USHORT roothub, char *name, DWORD size)
+{
+    DWORD len = GetTempPathA(size, name);
+
+    if ((len == 0) || (len >= size))
+    {
+        return FALSE;
+    }
+
+    return _snprintf_s(&name[len], size - len, _TRUNCATE,
+                       "USBPcap%u_descriptors.cache", roothub) > 0;
+}
+
+static void load_cache(struct desccache *cache, const char *name)
+{
+    HANDLE file;
+    DWORD size;
+    DWORD read;
+    unsigned char *data;
+
+    file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    size = GetFileSize(file, NULL);
+    if ((size != INVALID_FILE_SIZE) && (size <= MAX_CACHE_FILE_SIZE))
+    {
+        data = (unsigned char *)malloc(size ? size : 1);
+        if (data != NULL)
+        {
+            if (ReadFile(file, data, size, &read, NULL) && (read == size))
+            {
+                /* Anything that does not parse is simply not used */
+                desccache_parse(cache, data, size);
+            }
+            free(data);
+        }
+    }
+    CloseHandle(file);
+}
+
+/* Replaces cache file with descriptors of currently connected devices */
+static void save_cache(descriptor_callback_context *ctx, const char *name)
+{
+    struct desccache cache;
+    connected_device *device;
+    char tmp_name[MAX_PATH];
+    unsigned char *data;
+    size_t length;
+    HANDLE file;
+    DWORD written;
+    BOOL ok;
+    LONG i;
+
+    desccache_init(&cache);
+    for (i = 0; i < ctx->device_count; i++)
+    {
+        device = &ctx->devices[i];
+        if (device->cached != NULL)
+        {
+            desccache_add(&cache, device->path, device->address, device->device,
+                          device->cached->config, device->cached->config_len);
+        }
+        else if (device->request != NULL)
+        {
+            desccache_add(&cache, device->path, device->address, device->device,
+                          device->request->Data, device->request->SetupPacket.wLength);
+        }
+    }
+
+    data = desccache_serialize(&cache, &length);
+    desccache_free(&cache);
+    if (data == NULL)
+    {
+        return;
+    }
+
+    /* Readers never see partially written cache */
+    if (_snprintf_s(tmp_name, sizeof(tmp_name), _TRUNCATE, "%s.tmp", name) > 0)
+    {
+        file = CreateFileA(tmp_name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            ok = WriteFile(file, data, (DWORD)length, &written, NULL) &&
+                 (written == length);
+            CloseHandle(file);
+            if (!ok || !MoveFileExA(tmp_name, name, MOVEFILE_REPLACE_EXISTING))
+            {
+                DeleteFileA(tmp_name);
+            }
+        }
+    }
+    free(data);
 }
 
 void *generate_pcap_packets(list_entry *head, int *out_len)
@@ -363,6 +594,10 @@ void *descriptors_generate_pcap(const char *filter, int *pcap_length, PUSBPCAP_A
     void *pcap_packets;
     int pcap_packets_length;
     descriptor_callback_context ctx;
+    char cache_name[MAX_PATH];
+    BOOL have_cache;
+    LONG misses = 0;
+    LONG i;
     const char *tmp;
     for (tmp = filter; *tmp; ++tmp) { /* Nothing to do here */ }
     --tmp;
@@ -378,11 +613,58 @@ void *descriptors_generate_pcap(const char *filter, int *pcap_length, PUSBPCAP_A
             break;
         }
     }
+    memset(&ctx, 0, sizeof(ctx));
     ctx.roothub = (USHORT)atoi(tmp);
     ctx.addresses = addresses;
     ctx.head = NULL;
     ctx.tail = NULL;
+
+    /* Devices that have not changed since last capture are not asked
+     * for configuration descriptor again.
+     */
+    desccache_init(&ctx.cache);
+    have_cache = get_cache_file_name(ctx.roothub, cache_name, sizeof(cache_name));
+    if (have_cache)
+    {
+        load_cache(&ctx.cache, cache_name);
+    }
+
     enumerate_all_connected_devices(filter, descriptor_callback, &ctx);
+    query_config_descriptors(&ctx);
+
+    for (i = 0; i < ctx.device_count; i++)
+    {
+        connected_device *device = &ctx.devices[i];
+
+        write_device_packets(&ctx, device);
+        if (device->cached != NULL)
+        {
+            write_config_packets(&ctx, device->address,
+                                 device->cached->config, device->cached->config_len);
+        }
+        else
+        {
+            misses++;
+            if (device->request != NULL)
+            {
+                write_config_packets(&ctx, device->address, device->request->Data,
+                                     device->request->SetupPacket.wLength);
+            }
+        }
+    }
+
+    if (have_cache && ((misses > 0) || (ctx.device_count != (LONG)ctx.cache.count)))
+    {
+        save_cache(&ctx, cache_name);
+    }
+
+    for (i = 0; i < ctx.device_count; i++)
+    {
+        free(ctx.devices[i].hub_name);
+        free(ctx.devices[i].request);
+    }
+    free(ctx.devices);
+    desccache_free(&ctx.cache);
 
     pcap_packets = generate_pcap_packets(ctx.head, &pcap_packets_length);
     free_list(ctx.head);
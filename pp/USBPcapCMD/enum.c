@@ -20,6 +20,7 @@
 #include <tchar.h>
 #include "USBPcap.h"
 #include "enum.h"
+#include "topocache.h"
 
 /*
  * level - Tree depth level
@@ -31,13 +32,17 @@
  *        are being enumerated. They are enumerated to make it easy for user to determine what
  *        the parent "USB Composite Device" is.
  * parentNode - 0 if the node is directly under deviceAddress, otherwise a index of parent node
+ * ctx - context passed to EnumerateHub()
  */
 typedef void (*EnumDeviceInfoCallback)(ULONG level, ULONG port, TCHAR display[MAX_DEVICE_ID_LEN],
                                        USHORT deviceAddress, USHORT parentAddress,
-                                       ULONG node, ULONG parentNode);
+                                       ULONG node, ULONG parentNode, void *ctx);
 
 #define IOCTL_OUTPUT_BUFFER_SIZE 1024
 
+/* Topology snapshot file is small, anything larger is not a snapshot */
+#define MAX_TOPOLOGY_FILE_SIZE   (1024*1024)
+
 #if DBG
 #define OOPS() fprintf(stderr, "Oops in file %s line %d\n", __FILE__, __LINE__);
 #else
@@ -131,8 +136,9 @@ fallback:
 static void EnumerateHub(PTSTR hub,
                          PUSB_NODE_CONNECTION_INFORMATION connection_info,
                          ULONG level,
+                         const char *path,
                          EnumDeviceInfoCallback callback,
-                         EnumConnectedPortCallback port_callback, void *port_ctx);
+                         EnumConnectedPortCallback port_callback, void *ctx);
 
 static void print_indent(ULONG level)
 {
@@ -239,12 +245,13 @@ static PTSTR WideStrToMultiStr(__in LPCWSTR WideStr)
 
 void print_usbpcapcmd(ULONG level, ULONG port, TCHAR display[MAX_DEVICE_ID_LEN],
                       USHORT deviceAddress, USHORT parentAddress,
-                      ULONG node, ULONG parentNode)
+                      ULONG node, ULONG parentNode, void *ctx)
 {
     (void)deviceAddress;
     (void)parentAddress;
     (void)node;
     (void)parentNode;
+    (void)ctx;
     print_indent(level + 2);
     if (port)
     {
@@ -254,36 +261,54 @@ void print_usbpcapcmd(ULONG level, ULONG port, TCHAR display[MAX_DEVICE_ID_LEN],
     printf("\n");
 }
 
-void print_extcap_config(ULONG level, ULONG port, TCHAR display[MAX_DEVICE_ID_LEN],
-                         USHORT deviceAddress, USHORT parentAddress,
-                         ULONG node, ULONG parentNode)
+/* Records device in topology snapshot passed as ctx */
+static void record_topology_node(ULONG level, ULONG port, TCHAR display[MAX_DEVICE_ID_LEN],
+                                 USHORT deviceAddress, USHORT parentAddress,
+                                 ULONG node, ULONG parentNode, void *ctx)
 {
-    PTSTR str = WideStrToUTF8((LPCWSTR)display);
+    PSTR str = WideStrToUTF8((LPCWSTR)display);
 
-    if (node)
+    if (str != NULL)
     {
-        printf("value {arg=%d}{value=%d_%d}{display=%s}{enabled=false}",
-               EXTCAP_ARGNUM_MULTICHECK, deviceAddress, node, str);
-        if (parentNode)
+        topocache_add((struct topocache *)ctx, level, port,
+                      deviceAddress, parentAddress,
+                      (unsigned short)node, (unsigned short)parentNode, str);
+        GlobalFree(str);
+    }
+}
+
+static void print_extcap_config(const struct topocache *topology)
+{
+    const struct topocache_node *n;
+    unsigned int i;
+
+    for (i = 0; i < topology->count; i++)
+    {
+        n = &topology->nodes[i];
+        if (n->node)
         {
-            printf("{parent=%d_%d}", deviceAddress, parentNode);
+            printf("value {arg=%d}{value=%d_%d}{display=%s}{enabled=false}",
+                   EXTCAP_ARGNUM_MULTICHECK, n->address, n->node, n->display);
+            if (n->parent_node)
+            {
+                printf("{parent=%d_%d}", n->address, n->parent_node);
+            }
+            else
+            {
+                printf("{parent=%d}", n->address);
+            }
         }
         else
         {
-            printf("{parent=%d}", deviceAddress);
-        }
-    }
-    else
-    {
-        printf("value {arg=%d}{value=%d}{display=[%d] %s}{enabled=true}",
-               EXTCAP_ARGNUM_MULTICHECK, deviceAddress, deviceAddress, str);
-        if (parentAddress)
-        {
-            printf("{parent=%d}", parentAddress);
+            printf("value {arg=%d}{value=%d}{display=[%d] %s}{enabled=true}",
+                   EXTCAP_ARGNUM_MULTICHECK, n->address, n->address, n->display);
+            if (n->parent_address)
+            {
+                printf("{parent=%d}", n->parent_address);
+            }
         }
+        printf("\n");
     }
-    printf("\n");
-    GlobalFree(str);
 }
 
 static PTSTR GetDriverKeyName(HANDLE Hub, ULONG ConnectionIndex)
@@ -525,7 +550,8 @@ static BOOL stack_push(Stack **stack, USHORT value)
 
 
 static VOID PrintDevinstChildren(DEVINST parent, ULONG indent,
-                                 USHORT deviceAddress, EnumDeviceInfoCallback callback)
+                                 USHORT deviceAddress, EnumDeviceInfoCallback callback,
+                                 void *ctx)
 {
     DEVINST    current;
     DEVINST    next;
@@ -586,7 +612,7 @@ static VOID PrintDevinstChildren(DEVINST parent, ULONG indent,
             {
                 parentNode = 0;
             }
-            callback(level, 0, buf, deviceAddress, deviceAddress, nextNode, parentNode);
+            callback(level, 0, buf, deviceAddress, deviceAddress, nextNode, parentNode, ctx);
         }
 
         // Go down a level to the first next.
@@ -649,7 +675,7 @@ static VOID PrintDevinstChildren(DEVINST parent, ULONG indent,
 VOID PrintDeviceDesc(__in PCTSTR DriverName, ULONG Index,
                      ULONG Level, BOOLEAN PrintAllChildren,
                      USHORT deviceAddress, USHORT parentAddress,
-                     EnumDeviceInfoCallback callback)
+                     EnumDeviceInfoCallback callback, void *ctx)
 {
     DEVINST    devInst;
     DEVINST    devInstNext;
@@ -705,10 +731,10 @@ VOID PrintDeviceDesc(__in PCTSTR DriverName, ULONG Index,
 
                 if (cr == CR_SUCCESS)
                 {
-                    callback(Level, Index, buf, deviceAddress, parentAddress, 0, 0);
+                    callback(Level, Index, buf, deviceAddress, parentAddress, 0, 0, ctx);
                     if (PrintAllChildren)
                     {
-                        PrintDevinstChildren(devInst, Level, deviceAddress, callback);
+                        PrintDevinstChildren(devInst, Level, deviceAddress, callback, ctx);
                     }
                 }
 
@@ -780,12 +806,14 @@ VOID PrintDeviceDesc(__in PCTSTR DriverName, ULONG Index,
 }
 
 static VOID
-EnumerateHubPorts(HANDLE hHubDevice, UCHAR NumPorts, ULONG level,
+EnumerateHubPorts(HANDLE hHubDevice, PCTSTR hubName, UCHAR NumPorts, ULONG level,
+                  const char *path,
                   USHORT hubAddress, EnumDeviceInfoCallback print_callback,
-                  EnumConnectedPortCallback port_callback, void *port_ctx)
+                  EnumConnectedPortCallback port_callback, void *ctx)
 {
     ULONG       index;
     BOOL        success;
+    char        portPath[ENUM_MAX_PORT_PATH];
 
     PTSTR driverKeyName;
 
@@ -817,6 +845,9 @@ EnumerateHubPorts(HANDLE hHubDevice, UCHAR NumPorts, ULONG level,
         // If there is a device connected, get the Device Description
         if (connectionInfo.ConnectionStatus != NoDeviceConnected)
         {
+            _snprintf_s(portPath, sizeof(portPath), _TRUNCATE, "%s%s%u",
+                        path, (path[0] != '\0') ? "." : "", index);
+
             if (print_callback)
             {
                 driverKeyName = GetDriverKeyName(hHubDevice,
@@ -828,7 +859,7 @@ EnumerateHubPorts(HANDLE hHubDevice, UCHAR NumPorts, ULONG level,
                                     !connectionInfo.DeviceIsHub,
                                     connectionInfo.DeviceAddress,
                                     hubAddress,
-                                    print_callback);
+                                    print_callback, ctx);
 
                     GlobalFree(driverKeyName);
                 }
@@ -836,8 +867,9 @@ EnumerateHubPorts(HANDLE hHubDevice, UCHAR NumPorts, ULONG level,
 
             if ((connectionInfo.ConnectionStatus == DeviceConnected) && port_callback)
             {
-                port_callback(hHubDevice, index, connectionInfo.DeviceAddress,
-                              &connectionInfo.DeviceDescriptor, port_ctx);
+                port_callback(hHubDevice, hubName, index, portPath,
+                              connectionInfo.DeviceAddress,
+                              &connectionInfo.DeviceDescriptor, ctx);
             }
 
             // If the device connected to the port is an external hub, get the
@@ -854,9 +886,10 @@ EnumerateHubPorts(HANDLE hHubDevice, UCHAR NumPorts, ULONG level,
                     EnumerateHub(extHubName,
                                  &connectionInfo,
                                  level+1,
+                                 portPath,
                                  print_callback,
                                  port_callback,
-                                 port_ctx);
+                                 ctx);
                     GlobalFree(extHubName);
                 }
             }
@@ -868,8 +901,9 @@ EnumerateHubPorts(HANDLE hHubDevice, UCHAR NumPorts, ULONG level,
 static void EnumerateHub(PTSTR hub,
                          PUSB_NODE_CONNECTION_INFORMATION connection_info,
                          ULONG level,
+                         const char *path,
                          EnumDeviceInfoCallback print_callback,
-                         EnumConnectedPortCallback port_callback, void *port_ctx)
+                         EnumConnectedPortCallback port_callback, void *ctx)
 {
     PUSB_NODE_INFORMATION   hubInfo;
     HANDLE                  hHubDevice;
@@ -882,6 +916,7 @@ static void EnumerateHub(PTSTR hub,
     // only tries to cleanup things that were successfully allocated.
     hubInfo     = NULL;
     hHubDevice  = INVALID_HANDLE_VALUE;
+    deviceName  = NULL;
 
     // Allocate some space for a USB_NODE_INFORMATION structure for this Hub
     hubInfo = (PUSB_NODE_INFORMATION)GlobalAlloc(GPTR, sizeof(USB_NODE_INFORMATION));
@@ -927,8 +962,6 @@ static void EnumerateHub(PTSTR hub,
                             0,
                             NULL);
 
-    GlobalFree(deviceName);
-
     if (hHubDevice == INVALID_HANDLE_VALUE)
     {
         fprintf(stderr, "unable to open %s\n", hub);
@@ -956,10 +989,12 @@ static void EnumerateHub(PTSTR hub,
 
     // Now recursively enumrate the ports of this hub.
     EnumerateHubPorts(hHubDevice,
+                      deviceName,
                       hubInfo->u.HubInformation.HubDescriptor.bNumberOfPorts,
                       level,
+                      path,
                       (connection_info == NULL) ? 0 : connection_info->DeviceAddress,
-                      print_callback, port_callback, port_ctx);
+                      print_callback, port_callback, ctx);
 
 EnumerateHubError:
     // Clean up any stuff that got allocated
@@ -970,6 +1005,11 @@ EnumerateHubError:
         hHubDevice = INVALID_HANDLE_VALUE;
     }
 
+    if (deviceName)
+    {
+        GlobalFree(deviceName);
+    }
+
     if (hubInfo)
     {
         GlobalFree(hubInfo);
@@ -1038,15 +1078,171 @@ void enumerate_print_usbpcap_interactive(const char *filter)
         printf("\n");
 
         str = WideStrToMultiStr(outBuf);
-        EnumerateHub(str, NULL, 0, print_usbpcapcmd, NULL, NULL);
+        EnumerateHub(str, NULL, 0, "", print_usbpcapcmd, NULL, NULL);
         GlobalFree(str);
     }
 }
 
+/**
+ * @brief Gets topology generation of the root hub
+ *
+ * @param[in] filter USBPcap filter name, eg. \\.\USBPcap1
+ * @param[out] topology Topology epoch and generation
+ *
+ * @return TRUE on success, FALSE if driver does not support it.
+ */
+static BOOL
+get_usbpcap_filter_topology(const char *filter,
+                            PUSBPCAP_IOCTL_TOPOLOGY topology)
+{
+    HANDLE filter_handle;
+    DWORD  bytes_ret = 0;
+    BOOL   success;
+
+    filter_handle = CreateFileA(filter,
+                                0,
+                                0,
+                                0,
+                                OPEN_EXISTING,
+                                0,
+                                0);
+
+    if (filter_handle == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    success = DeviceIoControl(filter_handle,
+                              IOCTL_USBPCAP_GET_TOPOLOGY,
+                              NULL,
+                              0,
+                              topology,
+                              sizeof(USBPCAP_IOCTL_TOPOLOGY),
+                              &bytes_ret,
+                              0);
+
+    CloseHandle(filter_handle);
+    return success && (bytes_ret == sizeof(USBPCAP_IOCTL_TOPOLOGY)) &&
+           (topology->epoch != 0);
+}
+
+static BOOL get_topology_file_name(const char *filter, char *name, DWORD size)
+{
+    const char *tmp = filter + strlen(filter);
+    DWORD len;
+
+    /* Root hub number is at the end of filter name */
+    while ((tmp > filter) && (tmp[-1] >= '0') && (tmp[-1] <= '9'))
+    {
+        tmp--;
+    }
+
+    len = GetTempPathA(size, name);
+    if ((len == 0) || (len >= size) || (*tmp == '\0'))
+    {
+        return FALSE;
+    }
+
+    return _snprintf_s(&name[len], size - len, _TRUNCATE,
+                       "USBPcap%u_topology.cache", atoi(tmp)) > 0;
+}
+
+static void load_topology(struct topocache *topology, const char *name)
+{
+    HANDLE file;
+    DWORD size;
+    DWORD read;
+    unsigned char *data;
+
+    file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    size = GetFileSize(file, NULL);
+    if ((size != INVALID_FILE_SIZE) && (size <= MAX_TOPOLOGY_FILE_SIZE))
+    {
+        data = (unsigned char *)malloc(size ? size : 1);
+        if (data != NULL)
+        {
+            if (ReadFile(file, data, size, &read, NULL) && (read == size))
+            {
+                /* Anything that does not parse is simply not used */
+                topocache_parse(topology, data, size);
+            }
+            free(data);
+        }
+    }
+    CloseHandle(file);
+}
+
+static void save_topology(const struct topocache *topology, const char *name)
+{
+    char tmp_name[MAX_PATH];
+    unsigned char *data;
+    size_t length;
+    HANDLE file;
+    DWORD written;
+    BOOL ok;
+
+    data = topocache_serialize(topology, &length);
+    if (data == NULL)
+    {
+        return;
+    }
+
+    /* Wireshark may run several extcap instances at once, readers must
+     * never see partially written snapshot.
+     */
+    if (_snprintf_s(tmp_name, sizeof(tmp_name), _TRUNCATE, "%s.%u.tmp",
+                    name, GetCurrentProcessId()) > 0)
+    {
+        file = CreateFileA(tmp_name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            ok = WriteFile(file, data, (DWORD)length, &written, NULL) &&
+                 (written == length);
+            CloseHandle(file);
+            if (!ok || !MoveFileExA(tmp_name, name, MOVEFILE_REPLACE_EXISTING))
+            {
+                DeleteFileA(tmp_name);
+            }
+        }
+    }
+    free(data);
+}
+
 void enumerate_print_extcap_config(const char *filter)
 {
     WCHAR  outBuf[IOCTL_OUTPUT_BUFFER_SIZE];
     DWORD  bytes_ret;
+    USBPCAP_IOCTL_TOPOLOGY generation;
+    struct topocache previous;
+    struct topocache current;
+    char   cache_name[MAX_PATH];
+    BOOL   have_cache;
+
+    topocache_init(&previous);
+    topocache_init(&current);
+
+    /* Hub tree is walked only if something changed since the snapshot
+     * was taken. Older driver without generation counter always walks.
+     */
+    have_cache = get_usbpcap_filter_topology(filter, &generation) &&
+                 get_topology_file_name(filter, cache_name, sizeof(cache_name));
+    if (have_cache)
+    {
+        load_topology(&previous, cache_name);
+        if (topocache_is_current(&previous, generation.epoch, generation.generation))
+        {
+            print_extcap_config(&previous);
+            topocache_free(&previous);
+            return;
+        }
+    }
 
     bytes_ret = get_usbpcap_filter_hub_symlink(filter, &outBuf[0], sizeof(outBuf)/sizeof(outBuf[0]));
     if (bytes_ret > 0)
@@ -1054,9 +1250,24 @@ void enumerate_print_extcap_config(const char *filter)
         PTSTR str;
 
         str = WideStrToMultiStr(outBuf);
-        EnumerateHub(str, NULL, 0, print_extcap_config, NULL, NULL);
+        EnumerateHub(str, NULL, 0, "", record_topology_node, NULL, &current);
         GlobalFree(str);
+
+        print_extcap_config(&current);
+
+        if (have_cache)
+        {
+            /* Generation read before the walk, any change during the walk
+             * makes the snapshot out of date on next call.
+             */
+            current.epoch = generation.epoch;
+            current.generation = generation.generation;
+            save_topology(&current, cache_name);
+        }
     }
+
+    topocache_free(&previous);
+    topocache_free(&current);
 }
 
 void enumerate_all_connected_devices(const char *filter, EnumConnectedPortCallback cb, void *ctx)
@@ -1070,7 +1281,7 @@ void enumerate_all_connected_devices(const char *filter, EnumConnectedPortCallba
         PTSTR str;
 
         str = WideStrToMultiStr(outBuf);
-        EnumerateHub(str, NULL, 0, NULL, cb, ctx);
+        EnumerateHub(str, NULL, 0, "", NULL, cb, ctx);
         GlobalFree(str);
     }
 }
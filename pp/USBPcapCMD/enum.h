@@ -12,7 +12,18 @@
 
 #define EXTCAP_ARGNUM_MULTICHECK 99
 
-typedef void (*EnumConnectedPortCallback)(HANDLE hub, ULONG port, USHORT deviceAddress, PUSB_DEVICE_DESCRIPTOR desc, void *ctx);
+/* Longest port path, e.g. "3.1.4", including NULL terminator */
+#define ENUM_MAX_PORT_PATH 32
+
+/*
+ * hub - HANDLE to the hub, only valid during the callback
+ * hub_name - name the hub can be opened with
+ * port - hub port number the device is connected to
+ * port_path - port numbers from root hub to the device separated by dots
+ */
+typedef void (*EnumConnectedPortCallback)(HANDLE hub, PCTSTR hub_name, ULONG port,
+                                          const char *port_path, USHORT deviceAddress,
+                                          PUSB_DEVICE_DESCRIPTOR desc, void *ctx);
 
 void enumerate_print_usbpcap_interactive(const char *filter);
 void enumerate_print_extcap_config(const char *filter);
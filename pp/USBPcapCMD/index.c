@@ -0,0 +1,714 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "index.h"
+#include "bytes.h"
+
+#define BLOCK_SHB              0x0A0D0D0A
+#define BLOCK_IDB              0x00000001
+#define BLOCK_EPB              0x00000006
+#define BLOCK_HDR_LEN          8
+#define EPB_HDR_LEN            28
+
+#define DLT_USBPCAP            249
+
+/* USBPcap packet header fields, see USBPCAP_BUFFER_PACKET_HEADER */
+#define USBPCAP_BUS_OFFSET     17
+#define USBPCAP_DEVICE_OFFSET  19
+#define USBPCAP_ENDPOINT_OFFSET 21
+#define USBPCAP_MIN_HDR_LEN    22
+
+#define CHECKPOINT_LEN         24
+#define CHECKPOINTS_HDR_LEN    (BLOCK_HDR_LEN + 8)
+#define ENDPOINT_HDR_LEN       (BLOCK_HDR_LEN + 36)
+
+#define OUT_BUFFER_SIZE        (64*1024)
+
+unsigned int index_key(unsigned int bus, unsigned int device,
+                       unsigned int endpoint)
+{
+    return ((bus & 0xFFFF) << 16) | ((device & 0xFF) << 8) | (endpoint & 0xFF);
+}
+
+static void write_out(struct index_writer *ix)
+{
+    if ((ix->out_len > 0) && !ix->failed &&
+        !ix->write(ix->ctx, ix->out, ix->out_len))
+    {
+        ix->failed = 1;
+    }
+    ix->out_len = 0;
+}
+
+/* Returns space for block of given length in output buffer */
+static unsigned char *out_space(struct index_writer *ix, size_t length)
+{
+    unsigned char *p;
+
+    if (ix->out_len + length > ix->out_size)
+    {
+        write_out(ix);
+    }
+
+    p = &ix->out[ix->out_len];
+    ix->out_len += length;
+    return p;
+}
+
+static void write_header(struct index_writer *ix)
+{
+    unsigned char *p = out_space(ix, INDEX_HEADER_LEN);
+
+    p = put32(p, INDEX_MAGIC);
+    p = put16(p, INDEX_VERSION);
+    p = put16(p, ix->flags);
+    p = put32(p, ix->checkpoint_interval);
+    put32(p, 0);
+}
+
+static void write_checkpoints(struct index_writer *ix)
+{
+    unsigned char *p;
+    unsigned int i;
+    size_t length;
+
+    if (ix->checkpoint_count == 0)
+    {
+        return;
+    }
+
+    length = CHECKPOINTS_HDR_LEN + ix->checkpoint_count * CHECKPOINT_LEN;
+    p = out_space(ix, length);
+    p = put32(p, INDEX_BLOCK_CHECKPOINTS);
+    p = put32(p, (unsigned int)length);
+    p = put32(p, ix->checkpoint_count);
+    p = put32(p, 0);
+    for (i = 0; i < ix->checkpoint_count; i++)
+    {
+        p = put64(p, ix->checkpoints[i].timestamp);
+        p = put64(p, ix->checkpoints[i].offset);
+        p = put64(p, ix->checkpoints[i].packet);
+    }
+    ix->checkpoint_count = 0;
+}
+
+static void write_endpoint(struct index_writer *ix, struct index_endpoint *ep)
+{
+    unsigned char *p;
+    size_t length;
+
+    if (ep->count == 0)
+    {
+        return;
+    }
+
+    length = ENDPOINT_HDR_LEN + ep->count * sizeof(unsigned int);
+    p = out_space(ix, length);
+    p = put32(p, INDEX_BLOCK_ENDPOINT);
+    p = put32(p, (unsigned int)length);
+    p = put16(p, ep->key >> 16);
+    p = put16(p, (ep->key >> 8) & 0xFF);
+    *p++ = (unsigned char)(ep->key & 0xFF);
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 0;
+    p = put32(p, ep->count);
+    p = put64(p, ep->base);
+    p = put64(p, ep->first_ts);
+    p = put64(p, ep->last_ts);
+    memcpy(p, ep->deltas, ep->count * sizeof(unsigned int));
+    ep->count = 0;
+}
+
+static void write_all_endpoints(struct index_writer *ix)
+{
+    unsigned int i;
+
+    for (i = 0; i < INDEX_ENDPOINT_SLOTS; i++)
+    {
+        if (ix->endpoints[i].used)
+        {
+            write_endpoint(ix, &ix->endpoints[i]);
+        }
+    }
+}
+
+static void clear_endpoints(struct index_writer *ix)
+{
+    unsigned int i;
+
+    for (i = 0; i < INDEX_ENDPOINT_SLOTS; i++)
+    {
+        ix->endpoints[i].used = 0;
+        ix->endpoints[i].count = 0;
+    }
+    ix->endpoint_count = 0;
+}
+
+static struct index_endpoint *find_endpoint(struct index_writer *ix,
+                                            unsigned int key)
+{
+    unsigned int slot = (key * 2654435761U) >> 25; /* 7 bits, 128 slots */
+    struct index_endpoint *ep;
+
+    for (;;)
+    {
+        ep = &ix->endpoints[slot];
+        if (!ep->used || (ep->key == key))
+        {
+            break;
+        }
+        slot = (slot + 1) % INDEX_ENDPOINT_SLOTS;
+    }
+
+    if (!ep->used)
+    {
+        if (ix->endpoint_count == INDEX_MAX_ENDPOINTS)
+        {
+            /* Too many endpoints, start over keeping memory bounded */
+            write_all_endpoints(ix);
+            clear_endpoints(ix);
+            return find_endpoint(ix, key);
+        }
+        ep->used = 1;
+        ep->key = key;
+        ep->count = 0;
+        ep->deltas = &ix->deltas[(ep - ix->endpoints) * INDEX_ENDPOINT_BATCH];
+        ix->endpoint_count++;
+    }
+
+    return ep;
+}
+
+static void add_packet(struct index_writer *ix, unsigned long long ts,
+                       int have_key, unsigned int key)
+{
+    struct index_endpoint *ep;
+
+    if (ix->record >= ix->next_checkpoint)
+    {
+        if (ix->checkpoint_count == INDEX_CHECKPOINT_BATCH)
+        {
+            write_checkpoints(ix);
+        }
+        ix->checkpoints[ix->checkpoint_count].timestamp = ts;
+        ix->checkpoints[ix->checkpoint_count].offset = ix->record;
+        ix->checkpoints[ix->checkpoint_count].packet = ix->packets;
+        ix->checkpoint_count++;
+        ix->next_checkpoint = ix->record + ix->checkpoint_interval;
+    }
+    ix->packets++;
+
+    if (!have_key)
+    {
+        return;
+    }
+
+    ep = find_endpoint(ix, key);
+    if ((ep->count == INDEX_ENDPOINT_BATCH) ||
+        ((ep->count > 0) && (ix->record - ep->base > 0xFFFFFFFFULL)))
+    {
+        write_endpoint(ix, ep);
+    }
+    if (ep->count == 0)
+    {
+        ep->base = ix->record;
+        ep->first_ts = ts;
+    }
+    ep->deltas[ep->count++] = (unsigned int)(ix->record - ep->base);
+    ep->last_ts = ts;
+}
+
+/* Handles USBPcap header of packet, data has available bytes of it */
+static void add_usbpcap_packet(struct index_writer *ix, unsigned long long ts,
+                               const unsigned char *data, size_t available)
+{
+    unsigned int key = 0;
+    int have_key = 0;
+
+    if (ix->usbpcap && (available >= USBPCAP_MIN_HDR_LEN))
+    {
+        key = index_key(get16(&data[USBPCAP_BUS_OFFSET]),
+                        get16(&data[USBPCAP_DEVICE_OFFSET]),
+                        data[USBPCAP_ENDPOINT_OFFSET]);
+        have_key = 1;
+    }
+    add_packet(ix, ts, have_key, key);
+}
+
+/* Called once peek buffer has peek_want bytes */
+static void parse_peek(struct index_writer *ix)
+{
+    const unsigned char *p = ix->peek;
+    unsigned long long ts;
+    size_t header;
+    size_t want;
+    unsigned int magic;
+
+    if (ix->in_header)
+    {
+        magic = get32(p);
+        if ((magic == PCAP_MAGIC) || (magic == PCAP_MAGIC_NANOSECOND))
+        {
+            /* Rest of the global header is read as if it was a record */
+            ix->nanosecond = (magic == PCAP_MAGIC_NANOSECOND);
+            ix->peek_want = PCAP_HDR_LEN;
+            ix->record_len = PCAP_HDR_LEN;
+        }
+        else if (magic == BLOCK_SHB)
+        {
+            ix->flags |= INDEX_FLAG_PCAPNG;
+            ix->peek_want = BLOCK_HDR_LEN;
+        }
+        else
+        {
+            /* Not a capture we can follow */
+            ix->failed = 1;
+            return;
+        }
+        ix->in_header = 0;
+        write_header(ix);
+        return;
+    }
+
+    header = (ix->flags & INDEX_FLAG_PCAPNG) ? EPB_HDR_LEN : PCAP_REC_HDR_LEN;
+
+    if (ix->record_len == 0)
+    {
+        if (ix->flags & INDEX_FLAG_PCAPNG)
+        {
+            ix->record_len = get32(&p[4]);
+            if ((ix->record_len < 12) || (ix->record_len & 3))
+            {
+                ix->failed = 1;
+                return;
+            }
+        }
+        else
+        {
+            ix->record_len = PCAP_REC_HDR_LEN + (unsigned long long)get32(&p[8]);
+        }
+
+        want = header + USBPCAP_MIN_HDR_LEN;
+        if (want > ix->record_len)
+        {
+            want = (size_t)ix->record_len;
+        }
+        if (want > ix->peek_fill)
+        {
+            ix->peek_want = (unsigned int)want;
+            return;
+        }
+    }
+
+    if (ix->record == 0)
+    {
+        /* pcap global header */
+        if (!(ix->flags & INDEX_FLAG_PCAPNG))
+        {
+            ix->usbpcap = (get32(&p[20]) == DLT_USBPCAP);
+        }
+        else if (get32(p) == BLOCK_IDB)
+        {
+            ix->usbpcap = (get16(&p[8]) == DLT_USBPCAP);
+        }
+    }
+    else if (!(ix->flags & INDEX_FLAG_PCAPNG))
+    {
+        ts = (unsigned long long)get32(p) * 1000000000ULL;
+        ts += ix->nanosecond ? get32(&p[4]) : get32(&p[4]) * 1000ULL;
+        add_usbpcap_packet(ix, ts, &p[header], ix->peek_fill - header);
+    }
+    else if (get32(p) == BLOCK_IDB)
+    {
+        ix->usbpcap = (ix->peek_fill >= 10) && (get16(&p[8]) == DLT_USBPCAP);
+    }
+    else if ((get32(p) == BLOCK_EPB) && (ix->peek_fill >= header))
+    {
+        ts = ((unsigned long long)get32(&p[12]) << 32) | get32(&p[16]);
+        add_usbpcap_packet(ix, ts, &p[header], ix->peek_fill - header);
+    }
+
+    ix->skip = ix->record_len - ix->peek_fill;
+    ix->record_len = 0;
+    ix->peek_fill = 0;
+    ix->peek_want = (ix->flags & INDEX_FLAG_PCAPNG) ? BLOCK_HDR_LEN :
+                                                      PCAP_REC_HDR_LEN;
+}
+
+static void reset_stream(struct index_writer *ix)
+{
+    ix->flags &= ~INDEX_FLAG_PCAPNG;
+    ix->in_header = 1;
+    ix->usbpcap = 0;
+    ix->nanosecond = 0;
+    ix->offset = 0;
+    ix->record = 0;
+    ix->record_len = 0;
+    ix->peek_fill = 0;
+    ix->peek_want = 4;
+    ix->skip = 0;
+    ix->packets = 0;
+    ix->next_checkpoint = 0;
+    ix->checkpoint_count = 0;
+    clear_endpoints(ix);
+}
+
+int index_init(struct index_writer *ix, index_write_fn write, void *ctx,
+               unsigned int flags)
+{
+    memset(ix, 0, sizeof(struct index_writer));
+    ix->write = write;
+    ix->ctx = ctx;
+    ix->flags = flags & ~INDEX_FLAG_PCAPNG;
+    ix->checkpoint_interval = INDEX_CHECKPOINT_INTERVAL;
+
+    ix->out_size = OUT_BUFFER_SIZE;
+    ix->out = malloc(ix->out_size);
+    ix->deltas = malloc(INDEX_ENDPOINT_SLOTS * INDEX_ENDPOINT_BATCH *
+                        sizeof(unsigned int));
+    if ((ix->out == NULL) || (ix->deltas == NULL))
+    {
+        index_destroy(ix);
+        return 0;
+    }
+
+    reset_stream(ix);
+    return 1;
+}
+
+void index_destroy(struct index_writer *ix)
+{
+    free(ix->out);
+    free(ix->deltas);
+    ix->out = NULL;
+    ix->deltas = NULL;
+}
+
+void index_feed(struct index_writer *ix, const unsigned char *data,
+                size_t length)
+{
+    size_t n;
+
+    while ((length > 0) && !ix->failed)
+    {
+        if (ix->skip > 0)
+        {
+            n = (length < ix->skip) ? length : (size_t)ix->skip;
+            ix->skip -= n;
+        }
+        else
+        {
+            if (ix->peek_fill == 0)
+            {
+                ix->record = ix->offset;
+            }
+            n = ix->peek_want - ix->peek_fill;
+            if (n > length)
+            {
+                n = length;
+            }
+            memcpy(&ix->peek[ix->peek_fill], data, n);
+            ix->peek_fill += (unsigned int)n;
+            if (ix->peek_fill == ix->peek_want)
+            {
+                ix->offset += n;
+                data += n;
+                length -= n;
+                parse_peek(ix);
+                continue;
+            }
+        }
+
+        ix->offset += n;
+        data += n;
+        length -= n;
+    }
+}
+
+int index_flush(struct index_writer *ix)
+{
+    write_checkpoints(ix);
+    write_all_endpoints(ix);
+    write_out(ix);
+    return !ix->failed;
+}
+
+void index_restart(struct index_writer *ix)
+{
+    ix->out_len = 0;
+    ix->failed = 0;
+    reset_stream(ix);
+}
+
+static int compare_checkpoints(const void *a, const void *b)
+{
+    const struct index_checkpoint *ca = a;
+    const struct index_checkpoint *cb = b;
+
+    if (ca->offset != cb->offset)
+    {
+        return (ca->offset < cb->offset) ? -1 : 1;
+    }
+    return 0;
+}
+
+static int compare_lists(const void *a, const void *b)
+{
+    const struct index_list *la = a;
+    const struct index_list *lb = b;
+
+    if (la->key != lb->key)
+    {
+        return (la->key < lb->key) ? -1 : 1;
+    }
+    if (la->base != lb->base)
+    {
+        return (la->base < lb->base) ? -1 : 1;
+    }
+    return 0;
+}
+
+int index_read(struct index_reader *r, const unsigned char *data,
+               size_t length)
+{
+    size_t checkpoints = 0;
+    size_t lists = 0;
+    size_t deltas = 0;
+    size_t pos;
+    size_t block;
+    unsigned int count;
+    unsigned int pass;
+    unsigned int i;
+
+    memset(r, 0, sizeof(struct index_reader));
+
+    if ((length < INDEX_HEADER_LEN) || (get32(data) != INDEX_MAGIC) ||
+        (get16(&data[4]) != INDEX_VERSION))
+    {
+        return INDEX_ERROR_FORMAT;
+    }
+    r->flags = get16(&data[6]);
+    r->checkpoint_interval = get32(&data[8]);
+
+    /* First pass counts entries, second one fills them in */
+    for (pass = 0; pass < 2; pass++)
+    {
+        unsigned int cp = 0;
+        unsigned int list = 0;
+        size_t delta = 0;
+
+        pos = INDEX_HEADER_LEN;
+        while (length - pos >= BLOCK_HDR_LEN)
+        {
+            block = get32(&data[pos + 4]);
+            if ((block < BLOCK_HDR_LEN) || (block > length - pos))
+            {
+                /* Block is still being written */
+                break;
+            }
+
+            if (get32(&data[pos]) == INDEX_BLOCK_CHECKPOINTS)
+            {
+                if (block < CHECKPOINTS_HDR_LEN)
+                {
+                    return INDEX_ERROR_FORMAT;
+                }
+                count = get32(&data[pos + 8]);
+                if (count > (block - CHECKPOINTS_HDR_LEN) / CHECKPOINT_LEN)
+                {
+                    return INDEX_ERROR_FORMAT;
+                }
+                for (i = 0; (pass == 1) && (i < count); i++)
+                {
+                    const unsigned char *p = &data[pos + CHECKPOINTS_HDR_LEN +
+                                                   i * CHECKPOINT_LEN];
+
+                    r->checkpoints[cp + i].timestamp = get64(p);
+                    r->checkpoints[cp + i].offset = get64(&p[8]);
+                    r->checkpoints[cp + i].packet = get64(&p[16]);
+                }
+                cp += count;
+            }
+            else if (get32(&data[pos]) == INDEX_BLOCK_ENDPOINT)
+            {
+                const unsigned char *p = &data[pos + BLOCK_HDR_LEN];
+
+                if (block < ENDPOINT_HDR_LEN)
+                {
+                    return INDEX_ERROR_FORMAT;
+                }
+                count = get32(&p[8]);
+                if (count > (block - ENDPOINT_HDR_LEN) / sizeof(unsigned int))
+                {
+                    return INDEX_ERROR_FORMAT;
+                }
+                if (pass == 1)
+                {
+                    struct index_list *l = &r->lists[list];
+
+                    l->key = index_key(get16(p), get16(&p[2]), p[4]);
+                    l->count = count;
+                    l->base = get64(&p[12]);
+                    l->first_ts = get64(&p[20]);
+                    l->last_ts = get64(&p[28]);
+                    memcpy(&r->deltas[delta], &data[pos + ENDPOINT_HDR_LEN],
+                           count * sizeof(unsigned int));
+                    l->deltas = &r->deltas[delta];
+                }
+                list++;
+                delta += count;
+            }
+            /* Other blocks are skipped */
+
+            pos += block;
+        }
+
+        if (pass == 0)
+        {
+            checkpoints = cp;
+            lists = list;
+            deltas = delta;
+
+            r->checkpoints = malloc((checkpoints + 1) * sizeof(struct index_checkpoint));
+            r->lists = malloc((lists + 1) * sizeof(struct index_list));
+            r->deltas = malloc((deltas + 1) * sizeof(unsigned int));
+            if ((r->checkpoints == NULL) || (r->lists == NULL) ||
+                (r->deltas == NULL))
+            {
+                index_reader_free(r);
+                return INDEX_ERROR_MEMORY;
+            }
+        }
+    }
+
+    r->checkpoint_count = (unsigned int)checkpoints;
+    r->list_count = (unsigned int)lists;
+    r->complete_length = pos;
+
+    qsort(r->checkpoints, checkpoints, sizeof(struct index_checkpoint),
+          compare_checkpoints);
+    qsort(r->lists, lists, sizeof(struct index_list), compare_lists);
+    return INDEX_OK;
+}
+
+void index_reader_free(struct index_reader *r)
+{
+    free(r->checkpoints);
+    free(r->lists);
+    free(r->deltas);
+    memset(r, 0, sizeof(struct index_reader));
+}
+
+const struct index_checkpoint *index_seek_time(const struct index_reader *r,
+                                               unsigned long long timestamp)
+{
+    unsigned int lo = 0;
+    unsigned int hi = r->checkpoint_count;
+    unsigned int mid;
+
+    /* Packets are expected in timestamp order */
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (r->checkpoints[mid].timestamp <= timestamp)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return (lo == 0) ? NULL : &r->checkpoints[lo - 1];
+}
+
+int index_seek_endpoint(const struct index_reader *r, unsigned int key,
+                        unsigned long long offset, struct index_cursor *cur)
+{
+    const struct index_list *l;
+    unsigned int lo = 0;
+    unsigned int hi = r->list_count;
+    unsigned int mid;
+
+    /* Last list of the key with base at or before offset */
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        l = &r->lists[mid];
+        if ((l->key < key) || ((l->key == key) && (l->base <= offset)))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if ((lo > 0) && (r->lists[lo - 1].key == key))
+    {
+        lo--;
+    }
+
+    cur->r = r;
+    cur->key = key;
+    cur->list = lo;
+    cur->pos = 0;
+
+    if ((lo < r->list_count) && (r->lists[lo].key == key) &&
+        (r->lists[lo].base < offset))
+    {
+        /* First packet at or after offset within the list */
+        l = &r->lists[lo];
+        offset -= l->base;
+        lo = 0;
+        hi = l->count;
+        while (lo < hi)
+        {
+            mid = lo + (hi - lo) / 2;
+            if (l->deltas[mid] < offset)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        cur->pos = lo;
+        if (cur->pos == l->count)
+        {
+            cur->list++;
+            cur->pos = 0;
+        }
+    }
+
+    return (cur->list < r->list_count) && (r->lists[cur->list].key == key);
+}
+
+int index_next(struct index_cursor *cur, unsigned long long *offset)
+{
+    const struct index_list *l;
+
+    if ((cur->list >= cur->r->list_count) ||
+        (cur->r->lists[cur->list].key != cur->key))
+    {
+        return 0;
+    }
+
+    l = &cur->r->lists[cur->list];
+    *offset = l->base + l->deltas[cur->pos];
+    cur->pos++;
+    if (cur->pos == l->count)
+    {
+        cur->list++;
+        cur->pos = 0;
+    }
+    return 1;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Sidecar capture index.
+ *
+ * The index writer follows the pcap or pcapng stream as it is written,
+ * passed in arbitrary pieces, and produces index blocks with bounded
+ * memory. The reader loads complete blocks of an index file (which may
+ * still be growing) and finds packets by time or by endpoint in
+ * O(log n).
+ *
+ * Offsets are positions in the (uncompressed) capture stream. pcapng
+ * timestamps are assumed to be in nanoseconds as USBPcapCMD writes them.
+ *
+ * Index file starts with header:
+ *   u32 INDEX_MAGIC
+ *   u16 INDEX_VERSION
+ *   u16 flags (INDEX_FLAG_xxx)
+ *   u32 checkpoint interval in bytes
+ *   u32 reserved, 0
+ * followed by blocks:
+ *   u32 block type (INDEX_BLOCK_xxx)
+ *   u32 total block length, including these 8 bytes
+ *   INDEX_BLOCK_CHECKPOINTS:
+ *     u32 count, u32 reserved
+ *     count times: u64 timestamp (ns), u64 offset, u64 packet number
+ *   INDEX_BLOCK_ENDPOINT (packets of one endpoint in stream order):
+ *     u16 bus, u16 device, u8 endpoint, u8 reserved[3]
+ *     u32 count
+ *     u64 offset of first packet, u64 first timestamp, u64 last timestamp
+ *     count times: u32 packet offset - offset of first packet
+ *   INDEX_BLOCK_REGION (packets starting in [offset, end), written by
+ *   offline indexer in USBPcapHost):
+ *     u64 offset, u64 end, u64 first packet number
+ *     u64 lowest timestamp, u64 highest timestamp
+ *     u32 count, u32 bloom bits, u32 bloom hashes, u32 IRP slots
+ *     u32 IRP list length, u32 reserved
+ *     bloom bits / 8 bytes: bloom filter of device and endpoint keys
+ *     IRP slots times: u32 IRP id tag, u32 position of the id's list
+ *     (INDEX_IRP_EMPTY if slot is unused)
+ *     IRP list length times u32: for every distinct IRP id u32 count
+ *     followed by count times u32 packet offset - offset
+ * All fields are little endian. Readers skip unknown blocks.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_INDEX_H
+#define USBPCAP_CMD_INDEX_H
+
+#include <stddef.h>
+
+#define INDEX_MAGIC               0x58495055 /* "UPIX" */
+#define INDEX_VERSION             1
+#define INDEX_HEADER_LEN          16
+
+#define INDEX_FLAG_PCAPNG         0x0001 /* Indexed stream is pcapng */
+#define INDEX_FLAG_COMPRESSED     0x0002 /* Stream is stored compressed */
+
+#define INDEX_BLOCK_CHECKPOINTS   1
+#define INDEX_BLOCK_ENDPOINT      2
+#define INDEX_BLOCK_REGION        3
+
+#define INDEX_IRP_EMPTY           0xFFFFFFFF
+
+/* Default distance between time checkpoints */
+#define INDEX_CHECKPOINT_INTERVAL (64*1024)
+
+/* Entries collected in memory before a block is written */
+#define INDEX_CHECKPOINT_BATCH    128
+#define INDEX_ENDPOINT_BATCH      256
+
+/* Endpoints tracked at once, all lists are written when more show up */
+#define INDEX_MAX_ENDPOINTS       96
+#define INDEX_ENDPOINT_SLOTS      128
+
+/* Record header plus USBPcap header up to the endpoint field */
+#define INDEX_PEEK_LEN            64
+
+struct index_checkpoint
+{
+    unsigned long long timestamp;
+    unsigned long long offset;
+    unsigned long long packet;
+};
+
+struct index_endpoint
+{
+    unsigned int key;          /* bus << 16 | device << 8 | endpoint */
+    int used;
+    unsigned int count;
+    unsigned long long base;   /* Offset of first packet in the list */
+    unsigned long long first_ts;
+    unsigned long long last_ts;
+    unsigned int *deltas;      /* INDEX_ENDPOINT_BATCH entries */
+};
+
+/* Returns 0 if data could not be written */
+typedef int (*index_write_fn)(void *ctx, const void *data, size_t length);
+
+struct index_writer
+{
+    index_write_fn write;
+    void *ctx;
+    int failed;
+    unsigned int flags;
+    unsigned int checkpoint_interval;
+
+    /* Stream parser */
+    int in_header;             /* File header not yet passed */
+    int nanosecond;
+    int usbpcap;               /* Non-zero if link type is DLT_USBPCAP */
+    unsigned long long offset; /* Stream bytes seen */
+    unsigned long long record; /* Offset of current record */
+    unsigned long long record_len; /* Length of current record, 0 if unknown */
+    unsigned char peek[INDEX_PEEK_LEN];
+    unsigned int peek_fill;
+    unsigned int peek_want;
+    unsigned long long skip;   /* Bytes of current record left to skip */
+    unsigned long long packets;
+    unsigned long long next_checkpoint;
+
+    struct index_checkpoint checkpoints[INDEX_CHECKPOINT_BATCH];
+    unsigned int checkpoint_count;
+
+    struct index_endpoint endpoints[INDEX_ENDPOINT_SLOTS];
+    unsigned int endpoint_count;
+    unsigned int *deltas;
+
+    unsigned char *out;
+    size_t out_len;
+    size_t out_size;
+};
+
+/*
+ * Prepares writer for a new stream. Index data is passed to write
+ * callback in pieces as blocks are completed.
+ *
+ * Returns non-zero on success, 0 if memory could not be allocated.
+ */
+int index_init(struct index_writer *ix, index_write_fn write, void *ctx,
+               unsigned int flags);
+
+/* Frees memory allocated by index_init() */
+void index_destroy(struct index_writer *ix);
+
+/* Follows length bytes of capture stream */
+void index_feed(struct index_writer *ix, const unsigned char *data,
+                size_t length);
+
+/* Writes everything collected so far, returns 0 if write failed */
+int index_flush(struct index_writer *ix);
+
+/*
+ * Starts a new stream (for a new file). Anything not written with
+ * index_flush() is dropped. The index header is written again.
+ */
+void index_restart(struct index_writer *ix);
+
+struct index_list
+{
+    unsigned int key;
+    unsigned int count;
+    unsigned long long base;
+    unsigned long long first_ts;
+    unsigned long long last_ts;
+    const unsigned int *deltas;
+};
+
+struct index_reader
+{
+    unsigned int flags;
+    unsigned int checkpoint_interval;
+
+    struct index_checkpoint *checkpoints; /* Sorted by offset */
+    unsigned int checkpoint_count;
+
+    struct index_list *lists;  /* Sorted by key, then by base */
+    unsigned int list_count;
+
+    unsigned int *deltas;
+    size_t complete_length;    /* Index bytes in complete blocks */
+};
+
+struct index_cursor
+{
+    const struct index_reader *r;
+    unsigned int list;
+    unsigned int pos;
+    unsigned int key;
+};
+
+/* index_read() results */
+#define INDEX_OK                  0
+#define INDEX_ERROR_FORMAT       -1
+#define INDEX_ERROR_MEMORY       -2
+
+/*
+ * Loads index file contents. Incomplete block at the end, from index
+ * that is still being written, is ignored.
+ *
+ * Returns INDEX_OK or error.
+ */
+int index_read(struct index_reader *r, const unsigned char *data,
+               size_t length);
+
+/* Frees memory allocated by index_read() */
+void index_reader_free(struct index_reader *r);
+
+/* Returns endpoint key used by index lists */
+unsigned int index_key(unsigned int bus, unsigned int device,
+                       unsigned int endpoint);
+
+/*
+ * Finds last checkpoint with timestamp at or before timestamp. Returns
+ * NULL if timestamp is before the first checkpoint (or there is none).
+ */
+const struct index_checkpoint *index_seek_time(const struct index_reader *r,
+                                               unsigned long long timestamp);
+
+/*
+ * Positions cursor at first packet of endpoint at or after offset.
+ * Returns 0 if endpoint has no such packet.
+ */
+int index_seek_endpoint(const struct index_reader *r, unsigned int key,
+                        unsigned long long offset, struct index_cursor *cur);
+
+/* Sets *offset to packet at cursor and advances it, returns 0 at end */
+int index_next(struct index_cursor *cur, unsigned long long *offset);
+
+#endif /* USBPCAP_CMD_INDEX_H */
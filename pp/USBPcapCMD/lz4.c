@@ -0,0 +1,575 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+#include "lz4.h"
+#include "bytes.h"
+
+#define MINMATCH        4
+#define LASTLITERALS    5  /* Block always ends with this many literals */
+#define MFLIMIT         12 /* Last match must start this far from the end */
+#define MAX_DISTANCE    65535
+
+#define BLOCK_MAX_SIZE  (4*1024*1024)
+#define BLOCK_UNCOMPRESSED 0x80000000
+
+/* Frame descriptor flags */
+#define FLG_VERSION_MASK      0xC0
+#define FLG_VERSION           0x40
+#define FLG_BLOCK_INDEPENDENT 0x20
+#define FLG_BLOCK_CHECKSUM    0x10
+#define FLG_CONTENT_SIZE      0x08
+#define FLG_CONTENT_CHECKSUM  0x04
+#define FLG_DICT_ID           0x01
+#define BD_BLOCK_MAX_4MB      0x70
+
+#define PRIME32_1  2654435761U
+#define PRIME32_2  2246822519U
+#define PRIME32_3  3266489917U
+#define PRIME32_4  668265263U
+#define PRIME32_5  374761393U
+
+static unsigned int rotl32(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+/* xxHash32, used for frame header checksum */
+static unsigned int xxh32(const unsigned char *p, size_t len, unsigned int seed)
+{
+    const unsigned char *end = p + len;
+    unsigned int h;
+
+    if (len >= 16)
+    {
+        unsigned int v1 = seed + PRIME32_1 + PRIME32_2;
+        unsigned int v2 = seed + PRIME32_2;
+        unsigned int v3 = seed;
+        unsigned int v4 = seed - PRIME32_1;
+
+        do
+        {
+            v1 = rotl32(v1 + get32(p) * PRIME32_2, 13) * PRIME32_1;
+            v2 = rotl32(v2 + get32(p + 4) * PRIME32_2, 13) * PRIME32_1;
+            v3 = rotl32(v3 + get32(p + 8) * PRIME32_2, 13) * PRIME32_1;
+            v4 = rotl32(v4 + get32(p + 12) * PRIME32_2, 13) * PRIME32_1;
+            p += 16;
+        } while (end - p >= 16);
+
+        h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+    }
+    else
+    {
+        h = seed + PRIME32_5;
+    }
+
+    h += (unsigned int)len;
+
+    while (end - p >= 4)
+    {
+        h = rotl32(h + get32(p) * PRIME32_3, 17) * PRIME32_4;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h = rotl32(h + (*p) * PRIME32_5, 11) * PRIME32_1;
+        p++;
+    }
+
+    h ^= h >> 15;
+    h *= PRIME32_2;
+    h ^= h >> 13;
+    h *= PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+static unsigned int hash4(unsigned int sequence)
+{
+    return (sequence * PRIME32_1) >> (32 - LZ4_HASH_LOG);
+}
+
+static unsigned char *put_length(unsigned char *op, size_t length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+static unsigned char *put_literals(unsigned char *op, unsigned char *token,
+                                   const unsigned char *anchor, size_t length)
+{
+    if (length >= 15)
+    {
+        *token = 15 << 4;
+        op = put_length(op, length - 15);
+    }
+    else
+    {
+        *token = (unsigned char)(length << 4);
+    }
+    memcpy(op, anchor, length);
+    return op + length;
+}
+
+static size_t block_bound(size_t length)
+{
+    return length + length / 255 + 16;
+}
+
+/* Greedy single pass compressor, output buffer must hold block_bound() */
+static size_t compress_block(const unsigned char *src, size_t length,
+                             unsigned char *dst, unsigned int *table)
+{
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *iend = src + length;
+    const unsigned char *mflimit = iend - MFLIMIT;
+    const unsigned char *matchlimit = iend - LASTLITERALS;
+    unsigned char *op = dst;
+    unsigned char *token;
+
+    if (length < MFLIMIT + 1)
+    {
+        goto last_literals;
+    }
+
+    memset(table, 0, sizeof(unsigned int) * LZ4_HASH_SIZE);
+    ip++;
+
+    for (;;)
+    {
+        const unsigned char *match;
+        const unsigned char *start;
+        unsigned int attempts = 1 << 6;
+        unsigned int step = 1;
+        unsigned int h;
+        size_t match_len;
+
+        /* Find match, moving faster through data that does not compress */
+        for (;;)
+        {
+            h = hash4(get32(ip));
+            match = src + table[h];
+            table[h] = (unsigned int)(ip - src);
+            if ((match < ip) && (ip - match <= MAX_DISTANCE) &&
+                (get32(match) == get32(ip)))
+            {
+                break;
+            }
+
+            ip += step;
+            step = attempts++ >> 6;
+            if (ip > mflimit)
+            {
+                goto last_literals;
+            }
+        }
+
+        while ((ip > anchor) && (match > src) && (ip[-1] == match[-1]))
+        {
+            ip--;
+            match--;
+        }
+
+        token = op++;
+        op = put_literals(op, token, anchor, (size_t)(ip - anchor));
+
+        *op++ = (unsigned char)(ip - match);
+        *op++ = (unsigned char)((ip - match) >> 8);
+
+        start = ip;
+        ip += MINMATCH;
+        match += MINMATCH;
+        while ((ip <= matchlimit - 4) && (get32(ip) == get32(match)))
+        {
+            ip += 4;
+            match += 4;
+        }
+        while ((ip < matchlimit) && (*ip == *match))
+        {
+            ip++;
+            match++;
+        }
+
+        match_len = (size_t)(ip - start) - MINMATCH;
+        if (match_len >= 15)
+        {
+            *token |= 15;
+            op = put_length(op, match_len - 15);
+        }
+        else
+        {
+            *token |= (unsigned char)match_len;
+        }
+
+        anchor = ip;
+        if (ip > mflimit)
+        {
+            break;
+        }
+
+        table[hash4(get32(ip - 2))] = (unsigned int)(ip - 2 - src);
+    }
+
+last_literals:
+    token = op++;
+    op = put_literals(op, token, anchor, (size_t)(iend - anchor));
+    return (size_t)(op - dst);
+}
+
+static int decompress_block(const unsigned char *ip, size_t length,
+                            unsigned char *dst, unsigned char *op,
+                            unsigned char *oend, unsigned char **out)
+{
+    const unsigned char *iend = ip + length;
+
+    while (ip < iend)
+    {
+        unsigned int token = *ip++;
+        size_t run = token >> 4;
+        size_t offset;
+        const unsigned char *match;
+
+        if (run == 15)
+        {
+            unsigned int s;
+            do
+            {
+                if (ip >= iend)
+                {
+                    return LZ4_ERROR_CORRUPT;
+                }
+                s = *ip++;
+                run += s;
+            } while (s == 255);
+        }
+
+        if ((size_t)(iend - ip) < run)
+        {
+            return LZ4_ERROR_CORRUPT;
+        }
+        if ((size_t)(oend - op) < run)
+        {
+            return LZ4_ERROR_OUTPUT;
+        }
+        memcpy(op, ip, run);
+        op += run;
+        ip += run;
+
+        if (ip == iend)
+        {
+            /* Last sequence has literals only */
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return LZ4_ERROR_CORRUPT;
+        }
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > (size_t)(op - dst)))
+        {
+            return LZ4_ERROR_CORRUPT;
+        }
+
+        run = token & 15;
+        if (run == 15)
+        {
+            unsigned int s;
+            do
+            {
+                if (ip >= iend)
+                {
+                    return LZ4_ERROR_CORRUPT;
+                }
+                s = *ip++;
+                run += s;
+            } while (s == 255);
+        }
+        run += MINMATCH;
+
+        if ((size_t)(oend - op) < run)
+        {
+            return LZ4_ERROR_OUTPUT;
+        }
+
+        match = op - offset;
+        if (offset >= run)
+        {
+            memcpy(op, match, run);
+            op += run;
+        }
+        else
+        {
+            /* Overlapping copy repeats the last offset bytes */
+            while (run-- > 0)
+            {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    *out = op;
+    return LZ4_OK;
+}
+
+size_t lz4_frame_bound(size_t length)
+{
+    size_t blocks = length / BLOCK_MAX_SIZE + 1;
+
+    /* Header, block sizes and end mark */
+    return LZ4_MAX_HEADER_LEN + blocks * 4 + 4 + length +
+           blocks * (block_bound(BLOCK_MAX_SIZE) - BLOCK_MAX_SIZE);
+}
+
+size_t lz4_compress_frame(const unsigned char *in, size_t in_len,
+                          unsigned char *out, size_t out_size,
+                          unsigned int *hash_table)
+{
+    unsigned char *op = out;
+    unsigned char *descriptor;
+    unsigned long long content = in_len;
+    size_t n;
+    size_t compressed;
+    int i;
+
+    if (out_size < lz4_frame_bound(in_len))
+    {
+        return 0;
+    }
+
+    op = put32(op, LZ4_FRAME_MAGIC);
+    descriptor = op;
+    *op++ = FLG_VERSION | FLG_BLOCK_INDEPENDENT | FLG_CONTENT_SIZE;
+    *op++ = BD_BLOCK_MAX_4MB;
+    for (i = 0; i < 8; i++)
+    {
+        *op++ = (unsigned char)(content >> (8 * i));
+    }
+    *op = (unsigned char)(xxh32(descriptor, (size_t)(op - descriptor), 0) >> 8);
+    op++;
+
+    while (in_len > 0)
+    {
+        n = (in_len > BLOCK_MAX_SIZE) ? BLOCK_MAX_SIZE : in_len;
+        compressed = compress_block(in, n, op + 4, hash_table);
+        if (compressed >= n)
+        {
+            /* Store data that does not compress as is */
+            op = put32(op, (unsigned int)n | BLOCK_UNCOMPRESSED);
+            memcpy(op, in, n);
+            op += n;
+        }
+        else
+        {
+            op = put32(op, (unsigned int)compressed);
+            op += compressed;
+        }
+        in += n;
+        in_len -= n;
+    }
+
+    op = put32(op, 0); /* End mark */
+    return (size_t)(op - out);
+}
+
+/* Parses frame header, returns its length or error (negative) */
+static int parse_header(const unsigned char *in, size_t in_len,
+                        unsigned int *flags, long long *content_size)
+{
+    unsigned int magic;
+    size_t length = 7;
+    int i;
+
+    if (in_len < 4)
+    {
+        return LZ4_ERROR_TRUNCATED;
+    }
+
+    magic = get32(in);
+    if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC)
+    {
+        *flags = 0;
+        *content_size = 0;
+        return 0;
+    }
+    if (magic != LZ4_FRAME_MAGIC)
+    {
+        return LZ4_ERROR_CORRUPT;
+    }
+
+    if (in_len < length)
+    {
+        return LZ4_ERROR_TRUNCATED;
+    }
+
+    *flags = in[4];
+    if ((*flags & FLG_VERSION_MASK) != FLG_VERSION)
+    {
+        return LZ4_ERROR_CORRUPT;
+    }
+    if (*flags & FLG_CONTENT_SIZE)
+    {
+        length += 8;
+    }
+    if (*flags & FLG_DICT_ID)
+    {
+        length += 4;
+    }
+    if (in_len < length)
+    {
+        return LZ4_ERROR_TRUNCATED;
+    }
+
+    if (in[length - 1] != (unsigned char)(xxh32(&in[4], length - 5, 0) >> 8))
+    {
+        return LZ4_ERROR_CORRUPT;
+    }
+    if (*flags & FLG_DICT_ID)
+    {
+        return LZ4_ERROR_UNSUPPORTED;
+    }
+
+    *content_size = -1;
+    if (*flags & FLG_CONTENT_SIZE)
+    {
+        unsigned long long value = 0;
+        for (i = 7; i >= 0; i--)
+        {
+            value = (value << 8) | in[6 + i];
+        }
+        *content_size = (long long)value;
+    }
+
+    return (int)length;
+}
+
+int lz4_frame_info(const unsigned char *in, size_t in_len,
+                   long long *content_size)
+{
+    unsigned int flags;
+    int ret = parse_header(in, in_len, &flags, content_size);
+
+    return (ret < 0) ? ret : LZ4_OK;
+}
+
+int lz4_decompress_frame(const unsigned char *in, size_t in_len,
+                         size_t *consumed,
+                         unsigned char *out, size_t out_size,
+                         size_t *out_len)
+{
+    const unsigned char *ip = in;
+    const unsigned char *iend = in + in_len;
+    unsigned char *op = out;
+    unsigned int flags;
+    long long content_size;
+    int ret;
+
+    *out_len = 0;
+
+    ret = parse_header(in, in_len, &flags, &content_size);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    if (ret == 0)
+    {
+        /* Skippable frame */
+        if (in_len < 8)
+        {
+            return LZ4_ERROR_TRUNCATED;
+        }
+        if ((size_t)get32(&in[4]) > in_len - 8)
+        {
+            return LZ4_ERROR_TRUNCATED;
+        }
+        *consumed = 8 + (size_t)get32(&in[4]);
+        return LZ4_OK;
+    }
+    ip += ret;
+
+    for (;;)
+    {
+        unsigned int block;
+        size_t length;
+
+        if (iend - ip < 4)
+        {
+            return LZ4_ERROR_TRUNCATED;
+        }
+        block = get32(ip);
+        ip += 4;
+        if (block == 0)
+        {
+            break;
+        }
+
+        length = block & ~BLOCK_UNCOMPRESSED;
+        if ((size_t)(iend - ip) < length)
+        {
+            return LZ4_ERROR_TRUNCATED;
+        }
+
+        if (block & BLOCK_UNCOMPRESSED)
+        {
+            if (out_size - (size_t)(op - out) < length)
+            {
+                return LZ4_ERROR_OUTPUT;
+            }
+            memcpy(op, ip, length);
+            op += length;
+        }
+        else
+        {
+            /* Blocks can only be independent when they start with no history */
+            ret = decompress_block(ip, length,
+                                   (flags & FLG_BLOCK_INDEPENDENT) ? op : out,
+                                   op, out + out_size, &op);
+            if (ret != LZ4_OK)
+            {
+                return ret;
+            }
+        }
+        ip += length;
+
+        if (flags & FLG_BLOCK_CHECKSUM)
+        {
+            if (iend - ip < 4)
+            {
+                return LZ4_ERROR_TRUNCATED;
+            }
+            ip += 4;
+        }
+    }
+
+    if (flags & FLG_CONTENT_CHECKSUM)
+    {
+        if (iend - ip < 4)
+        {
+            return LZ4_ERROR_TRUNCATED;
+        }
+        if (get32(ip) != xxh32(out, (size_t)(op - out), 0))
+        {
+            return LZ4_ERROR_CORRUPT;
+        }
+        ip += 4;
+    }
+
+    if ((content_size >= 0) && ((unsigned long long)content_size != (unsigned long long)(op - out)))
+    {
+        return LZ4_ERROR_CORRUPT;
+    }
+
+    *consumed = (size_t)(ip - in);
+    *out_len = (size_t)(op - out);
+    return LZ4_OK;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Minimal LZ4 frame format encoder and decoder.
+ *
+ * Frames written by lz4_compress_frame() follow the LZ4 frame format
+ * specification (independent blocks, content size present, no
+ * checksums) so standard LZ4 tools can decompress them. The decoder
+ * accepts any frame without preset dictionary and skips skippable
+ * frames.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_LZ4_H
+#define USBPCAP_CMD_LZ4_H
+
+#include <stddef.h>
+
+#define LZ4_FRAME_MAGIC           0x184D2204
+#define LZ4_SKIPPABLE_MAGIC       0x184D2A50 /* Low 4 bits are free */
+#define LZ4_SKIPPABLE_MASK        0xFFFFFFF0
+
+/* Number of entries in hash table passed to lz4_compress_frame() */
+#define LZ4_HASH_LOG              14
+#define LZ4_HASH_SIZE             (1 << LZ4_HASH_LOG)
+
+/* Largest frame header lz4_frame_info() may need */
+#define LZ4_MAX_HEADER_LEN        19
+
+/* lz4_decompress_frame() results */
+#define LZ4_OK                    0
+#define LZ4_ERROR_TRUNCATED      -1 /* Input ends inside the frame */
+#define LZ4_ERROR_CORRUPT        -2 /* Not a valid frame */
+#define LZ4_ERROR_UNSUPPORTED    -3 /* Frame uses preset dictionary */
+#define LZ4_ERROR_OUTPUT         -4 /* Output buffer is too small */
+
+/* Returns the largest possible size of frame holding length bytes */
+size_t lz4_frame_bound(size_t length);
+
+/*
+ * Compresses in_len bytes into a single frame. hash_table must have
+ * LZ4_HASH_SIZE entries, its contents do not matter.
+ *
+ * Returns frame length or 0 if out_size is less than lz4_frame_bound().
+ */
+size_t lz4_compress_frame(const unsigned char *in, size_t in_len,
+                          unsigned char *out, size_t out_size,
+                          unsigned int *hash_table);
+
+/*
+ * Reads frame header. Sets *content_size to decompressed length of the
+ * frame or to -1 if frame header does not specify it. Skippable frames
+ * have content size 0.
+ *
+ * Returns LZ4_OK or error.
+ */
+int lz4_frame_info(const unsigned char *in, size_t in_len,
+                   long long *content_size);
+
+/*
+ * Decompresses single frame starting at in. Sets *consumed to the frame
+ * length and *out_len to number of bytes written to out.
+ *
+ * Returns LZ4_OK or error.
+ */
+int lz4_decompress_frame(const unsigned char *in, size_t in_len,
+                         size_t *consumed,
+                         unsigned char *out, size_t out_size,
+                         size_t *out_len);
+
+#endif /* USBPCAP_CMD_LZ4_H */
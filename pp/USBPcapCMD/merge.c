@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "merge.h"
+
+/* Initial per stream buffer, grows as needed */
+#define MERGE_INITIAL_SIZE     (64*1024)
+
+int merge_init(struct merge *m, unsigned int count, size_t limit)
+{
+    memset(m, 0, sizeof(struct merge));
+    m->streams = calloc(count, sizeof(struct merge_stream));
+    if (m->streams == NULL)
+    {
+        return 0;
+    }
+    m->count = count;
+    m->limit = limit;
+    return 1;
+}
+
+void merge_destroy(struct merge *m)
+{
+    unsigned int i;
+
+    for (i = 0; i < m->count; i++)
+    {
+        free(m->streams[i].buf);
+    }
+    free(m->streams);
+    m->streams = NULL;
+    m->count = 0;
+}
+
+/* Drops everything buffered in stream */
+static void discard(struct merge *m, struct merge_stream *s)
+{
+    if (s->have_header)
+    {
+        m->buffered -= s->end - s->start;
+    }
+    s->start = 0;
+    s->end = 0;
+    s->head_len = 0;
+}
+
+static int stream_has_ts(const struct merge_stream *s)
+{
+    return s->have_header &&
+           (s->end - s->start >= PCAP_REC_HDR_LEN);
+}
+
+/* Consumes global header and looks at first buffered record */
+static void parse_stream(struct merge *m, struct merge_stream *s)
+{
+    const unsigned char *p;
+    unsigned int incl_len;
+
+    if (s->failed)
+    {
+        return;
+    }
+
+    if (!s->have_header)
+    {
+        unsigned int magic;
+
+        if (s->end - s->start < PCAP_HDR_LEN)
+        {
+            return;
+        }
+
+        p = &s->buf[s->start];
+        magic = get32(p);
+        if (((magic != PCAP_MAGIC) && (magic != PCAP_MAGIC_NANOSECOND)) ||
+            (m->have_header && (get32(&p[20]) != get32(&m->header[20]))))
+        {
+            /* Not pcap or different link type, cannot be merged */
+            s->failed = 1;
+            discard(m, s);
+            return;
+        }
+
+        s->nanosecond = (magic == PCAP_MAGIC_NANOSECOND);
+        s->snaplen = get32(&p[16]);
+        if (!m->have_header)
+        {
+            memcpy(m->header, p, PCAP_HDR_LEN);
+            m->nanosecond = s->nanosecond;
+            m->have_header = 1;
+        }
+        s->start += PCAP_HDR_LEN;
+        s->have_header = 1;
+        m->buffered += s->end - s->start;
+    }
+
+    s->head_len = 0;
+    if (!stream_has_ts(s))
+    {
+        return;
+    }
+
+    p = &s->buf[s->start];
+    incl_len = get32(&p[8]);
+    if (incl_len > s->snaplen)
+    {
+        /* Lost track of records */
+        s->failed = 1;
+        discard(m, s);
+        return;
+    }
+
+    s->head_ts = (unsigned long long)get32(&p[0]) * 1000000000ULL;
+    s->head_ts += s->nanosecond ? get32(&p[4]) :
+                                  (unsigned long long)get32(&p[4]) * 1000ULL;
+    if (s->end - s->start >= PCAP_REC_HDR_LEN + (size_t)incl_len)
+    {
+        s->head_len = PCAP_REC_HDR_LEN + incl_len;
+    }
+}
+
+int merge_push(struct merge *m, unsigned int stream,
+               const unsigned char *data, size_t length)
+{
+    struct merge_stream *s = &m->streams[stream];
+
+    if (s->failed || s->ended)
+    {
+        return 1;
+    }
+
+    if (s->end + length > s->size)
+    {
+        /* Move remaining data to front first, grow only if needed */
+        if (s->start > 0)
+        {
+            memmove(s->buf, &s->buf[s->start], s->end - s->start);
+            s->end -= s->start;
+            s->start = 0;
+        }
+        if (s->end + length > s->size)
+        {
+            size_t size = (s->size == 0) ? MERGE_INITIAL_SIZE : s->size;
+            unsigned char *buf;
+
+            while (size < s->end + length)
+            {
+                size *= 2;
+            }
+            buf = realloc(s->buf, size);
+            if (buf == NULL)
+            {
+                return 0;
+            }
+            s->buf = buf;
+            s->size = size;
+        }
+    }
+
+    memcpy(&s->buf[s->end], data, length);
+    s->end += length;
+    if (s->have_header)
+    {
+        m->buffered += length;
+    }
+    if (s->head_len == 0)
+    {
+        parse_stream(m, s);
+    }
+    return 1;
+}
+
+void merge_end(struct merge *m, unsigned int stream)
+{
+    struct merge_stream *s = &m->streams[stream];
+
+    s->ended = 1;
+    if (s->head_len == 0)
+    {
+        /* Record cut short, it will never complete */
+        discard(m, s);
+    }
+}
+
+int merge_done(const struct merge *m)
+{
+    unsigned int i;
+
+    for (i = 0; i < m->count; i++)
+    {
+        const struct merge_stream *s = &m->streams[i];
+
+        if ((!s->ended && !s->failed) || (s->end > s->start))
+        {
+            return 0;
+        }
+    }
+    return !m->have_header || m->header_written;
+}
+
+size_t merge_pop(struct merge *m, unsigned long long horizon,
+                 unsigned char *out, size_t out_size)
+{
+    unsigned char *p = out;
+    unsigned char *out_end = out + out_size;
+
+    if (!m->header_written)
+    {
+        if (!m->have_header || (out_size < PCAP_HDR_LEN))
+        {
+            return 0;
+        }
+        memcpy(p, m->header, PCAP_HDR_LEN);
+        p += PCAP_HDR_LEN;
+        m->header_written = 1;
+    }
+
+    for (;;)
+    {
+        struct merge_stream *best = NULL;  /* Oldest complete record */
+        struct merge_stream *first = NULL; /* Oldest known timestamp */
+        int waiting = 0;
+        unsigned int i;
+
+        for (i = 0; i < m->count; i++)
+        {
+            struct merge_stream *s = &m->streams[i];
+
+            if (!stream_has_ts(s))
+            {
+                if (!s->ended && !s->failed)
+                {
+                    waiting = 1;
+                }
+                continue;
+            }
+            if ((first == NULL) || (s->head_ts < first->head_ts))
+            {
+                first = s;
+            }
+            if ((s->head_len > 0) &&
+                ((best == NULL) || (s->head_ts < best->head_ts)))
+            {
+                best = s;
+            }
+        }
+
+        if (best == NULL)
+        {
+            break;
+        }
+
+        if (m->buffered <= m->limit)
+        {
+            if (first != best)
+            {
+                /* Older record is still being read */
+                break;
+            }
+            if (waiting && (best->head_ts > horizon))
+            {
+                break;
+            }
+        }
+
+        if (best->head_len > (size_t)(out_end - p))
+        {
+            break;
+        }
+
+        memcpy(p, &best->buf[best->start], best->head_len);
+        if (best->nanosecond != m->nanosecond)
+        {
+            unsigned int frac = get32(&p[4]);
+            put32(&p[4], m->nanosecond ? frac * 1000 : frac / 1000);
+        }
+        p += best->head_len;
+
+        if (best->head_ts < m->last_ts)
+        {
+            m->late++;
+        }
+        else
+        {
+            m->last_ts = best->head_ts;
+        }
+        m->records++;
+        m->buffered -= best->head_len;
+        best->start += best->head_len;
+        if (best->start == best->end)
+        {
+            best->start = 0;
+            best->end = 0;
+        }
+        parse_stream(m, best);
+        if (best->ended && (best->head_len == 0))
+        {
+            discard(m, best);
+        }
+    }
+
+    return (size_t)(p - out);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Timestamp merge of several classic pcap streams.
+ *
+ * Every stream (one per root hub) is pushed in arbitrary pieces as the
+ * reads complete, starting with its pcap global header. The merged
+ * output is a single pcap stream: the header of the first stream that
+ * delivered one, followed by records of all streams in timestamp order.
+ * Output buffers always end at record boundary.
+ *
+ * A record is only emitted once it is known that no older record can
+ * show up. That is when every stream either has a record buffered or
+ * has ended, or when the record is not newer than the horizon given by
+ * caller (typically current time minus the time the driver may hold
+ * data), so hubs without traffic do not stall the output. If more than
+ * limit bytes are buffered the oldest records are emitted regardless.
+ *
+ * Streams are few so the oldest record is found by a linear scan over
+ * stream heads, which is cheaper than keeping a heap at this size.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_MERGE_H
+#define USBPCAP_CMD_MERGE_H
+
+#include <stddef.h>
+#include "bytes.h"
+
+/* Horizon that lets every buffered record out */
+#define MERGE_FLUSH             (~0ULL)
+
+struct merge_stream
+{
+    unsigned char *buf;
+    size_t start;              /* First byte not yet consumed */
+    size_t end;                /* End of buffered data */
+    size_t size;               /* Allocated size of buf */
+    int have_header;           /* Global header was consumed */
+    int nanosecond;            /* Stream timestamps are in ns */
+    unsigned int snaplen;
+    int ended;                 /* No more data will be pushed */
+    int failed;                /* Stream did not parse, data dropped */
+    size_t head_len;           /* Length of first buffered record, 0 if incomplete */
+    unsigned long long head_ts; /* Its timestamp in nanoseconds */
+};
+
+struct merge
+{
+    struct merge_stream *streams;
+    unsigned int count;
+    size_t limit;              /* Buffered bytes that force output */
+    size_t buffered;           /* Record bytes buffered in all streams */
+
+    unsigned char header[PCAP_HDR_LEN];
+    int have_header;           /* header is valid */
+    int header_written;        /* header was returned by merge_pop() */
+    int nanosecond;            /* Output timestamps are in ns */
+
+    /* Statistics */
+    unsigned long long records;
+    unsigned long long late;   /* Records older than one already emitted */
+    unsigned long long last_ts;
+};
+
+/*
+ * Prepares merge of count streams. At most limit bytes of records are
+ * held back waiting for other streams.
+ *
+ * Returns non-zero on success, 0 if memory could not be allocated.
+ */
+int merge_init(struct merge *m, unsigned int count, size_t limit);
+
+/* Frees memory allocated by merge_init() */
+void merge_destroy(struct merge *m);
+
+/*
+ * Appends length bytes to stream. Returns 0 if memory could not be
+ * allocated, data is not buffered then.
+ */
+int merge_push(struct merge *m, unsigned int stream,
+               const unsigned char *data, size_t length);
+
+/* Marks stream as finished so it does not hold back other streams */
+void merge_end(struct merge *m, unsigned int stream);
+
+/* Returns non-zero once every stream has ended and all data was returned */
+int merge_done(const struct merge *m);
+
+/*
+ * Writes merged output, records newer than horizon (in nanoseconds
+ * since epoch) only when they are certainly next. Output always ends
+ * at record boundary.
+ *
+ * Returns number of bytes written to out, 0 if nothing can be output.
+ */
+size_t merge_pop(struct merge *m, unsigned long long horizon,
+                 unsigned char *out, size_t out_size);
+
+#endif /* USBPCAP_CMD_MERGE_H */
@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "monitor.h"
+#include "bytes.h"
+
+#define DLT_USBPCAP               249
+
+#define USBPCAP_INFO_PDO_TO_FDO   0x01
+#define USBPCAP_TRANSFER_CONTROL  2
+#define USBPCAP_TRANSFER_IRP_INFO 0xFE
+#define USBPCAP_CONTROL_STAGE_DATA 1
+
+/* Values below this have a bucket each */
+#define LATENCY_EXACT             4
+
+static unsigned int latency_bucket(unsigned long long us)
+{
+    unsigned int bits = 0;
+    unsigned int index;
+
+    if (us < LATENCY_EXACT)
+    {
+        return (unsigned int)us;
+    }
+
+    while ((us >> bits) > 1)
+    {
+        bits++;
+    }
+    index = 4 * (bits - 1) + (unsigned int)((us >> (bits - 2)) & 3);
+    return (index < MONITOR_LATENCY_BUCKETS) ? index : MONITOR_LATENCY_BUCKETS - 1;
+}
+
+/* Lowest latency that falls into bucket */
+static unsigned long long latency_bucket_start(unsigned int index)
+{
+    if (index < LATENCY_EXACT)
+    {
+        return index;
+    }
+    return (4ULL + (index & 3)) << (index / 4 - 1);
+}
+
+/* Latency that pct percent of URBs of the interval did not exceed */
+static unsigned long long percentile(const struct monitor_endpoint *ep,
+                                     unsigned int pct)
+{
+    unsigned long long target;
+    unsigned long long seen = 0;
+    unsigned int i;
+
+    if (ep->latency_count == 0)
+    {
+        return 0;
+    }
+
+    target = ((unsigned long long)ep->latency_count * pct + 99) / 100;
+    for (i = 0; i < MONITOR_LATENCY_BUCKETS; i++)
+    {
+        seen += ep->latency[i];
+        if (seen >= target)
+        {
+            break;
+        }
+    }
+    if (i >= MONITOR_LATENCY_BUCKETS - 1)
+    {
+        return latency_bucket_start(MONITOR_LATENCY_BUCKETS - 1);
+    }
+    return latency_bucket_start(i + 1) - 1;
+}
+
+static struct monitor_endpoint *find_endpoint(struct monitor *m,
+                                              unsigned int bus,
+                                              unsigned int device,
+                                              unsigned int endpoint)
+{
+    struct monitor_endpoint *ep;
+    unsigned int slot;
+    unsigned int i;
+
+    slot = ((bus * 131 + device) * 257 + endpoint) & (MONITOR_ENDPOINT_SLOTS - 1);
+    for (i = 0; i < MONITOR_ENDPOINT_SLOTS; i++)
+    {
+        if (m->slots[slot] == 0)
+        {
+            break;
+        }
+        ep = &m->endpoints[m->slots[slot] - 1];
+        if ((ep->bus == bus) && (ep->device == device) && (ep->endpoint == endpoint))
+        {
+            return ep;
+        }
+        slot = (slot + 1) & (MONITOR_ENDPOINT_SLOTS - 1);
+    }
+
+    if ((i == MONITOR_ENDPOINT_SLOTS) || (m->endpoint_count == MONITOR_MAX_ENDPOINTS))
+    {
+        return NULL;
+    }
+
+    ep = &m->endpoints[m->endpoint_count];
+    m->endpoint_count++;
+    m->slots[slot] = (unsigned short)m->endpoint_count;
+    memset(ep, 0, sizeof(struct monitor_endpoint));
+    ep->bus = (unsigned short)bus;
+    ep->device = (unsigned short)device;
+    ep->endpoint = (unsigned char)endpoint;
+    return ep;
+}
+
+static struct monitor_pending *pending_set(struct monitor *m, unsigned long long irp)
+{
+    unsigned int h = (unsigned int)((irp >> 4) ^ (irp >> 32)) * 2654435761U;
+
+    return &m->pending[(h >> 12) & (MONITOR_PENDING_SLOTS - MONITOR_PENDING_WAYS)];
+}
+
+static void pending_add(struct monitor *m, unsigned long long irp,
+                        unsigned long long timestamp)
+{
+    struct monitor_pending *set = pending_set(m, irp);
+    struct monitor_pending *victim = &set[0];
+    unsigned int i;
+
+    for (i = 0; i < MONITOR_PENDING_WAYS; i++)
+    {
+        if (!set[i].used || (set[i].irp == irp))
+        {
+            victim = &set[i];
+            break;
+        }
+        if (set[i].timestamp < victim->timestamp)
+        {
+            victim = &set[i];
+        }
+    }
+
+    victim->irp = irp;
+    victim->timestamp = timestamp;
+    victim->used = 1;
+}
+
+static int pending_take(struct monitor *m, unsigned long long irp,
+                        unsigned long long *timestamp)
+{
+    struct monitor_pending *set = pending_set(m, irp);
+    unsigned int i;
+
+    for (i = 0; i < MONITOR_PENDING_WAYS; i++)
+    {
+        if (set[i].used && (set[i].irp == irp))
+        {
+            *timestamp = set[i].timestamp;
+            set[i].used = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void add_packet(struct monitor *m, unsigned long long ts,
+                       const unsigned char *h, unsigned int length)
+{
+    struct monitor_endpoint *ep;
+    unsigned long long irp;
+    unsigned long long submitted;
+    unsigned int transfer;
+    unsigned int data_len;
+    int data_stage;
+
+    if (length < USBPCAP_HDR_LEN)
+    {
+        return;
+    }
+
+    m->records++;
+    if (m->first_ts == 0)
+    {
+        m->first_ts = ts;
+    }
+    m->last_ts = ts;
+
+    ep = find_endpoint(m, get16(&h[17]), get16(&h[19]), h[21]);
+    if (ep == NULL)
+    {
+        m->untracked++;
+        return;
+    }
+
+    irp = get64(&h[2]);
+    transfer = h[22];
+    data_len = get32(&h[23]);
+    data_stage = (transfer == USBPCAP_TRANSFER_CONTROL) &&
+                 (get16(h) >= USBPCAP_CONTROL_HDR_LEN) &&
+                 (length >= USBPCAP_CONTROL_HDR_LEN) &&
+                 (h[27] == USBPCAP_CONTROL_STAGE_DATA);
+
+    ep->transfer = (unsigned char)transfer;
+    ep->bytes += data_len;
+    ep->interval_bytes += data_len;
+
+    if ((transfer == USBPCAP_TRANSFER_IRP_INFO) || data_stage)
+    {
+        return;
+    }
+
+    if (!(h[16] & USBPCAP_INFO_PDO_TO_FDO))
+    {
+        pending_add(m, irp, ts);
+        return;
+    }
+
+    ep->urbs++;
+    ep->interval_urbs++;
+    if (get32(&h[10]) != 0)
+    {
+        ep->errors++;
+        ep->interval_errors++;
+    }
+
+    if (pending_take(m, irp, &submitted))
+    {
+        ep->latency[latency_bucket((ts > submitted) ? ts - submitted : 0)]++;
+        ep->latency_count++;
+    }
+    else
+    {
+        m->unmatched++;
+    }
+}
+
+static void parse_peek(struct monitor *m)
+{
+    const unsigned char *p = m->peek;
+    unsigned long long ts;
+    unsigned long long want;
+    unsigned int magic;
+
+    if (m->in_header == 1)
+    {
+        magic = get32(p);
+        if ((magic != PCAP_MAGIC) && (magic != PCAP_MAGIC_NANOSECOND))
+        {
+            /* pcapng or anything else is not followed */
+            m->failed = 1;
+            return;
+        }
+        m->nanosecond = (magic == PCAP_MAGIC_NANOSECOND);
+        m->in_header = 2;
+        m->peek_want = PCAP_HDR_LEN;
+        return;
+    }
+
+    if (m->in_header == 2)
+    {
+        m->usbpcap = (get32(&p[20]) == DLT_USBPCAP);
+        m->in_header = 0;
+        m->peek_fill = 0;
+        m->peek_want = PCAP_REC_HDR_LEN;
+        return;
+    }
+
+    if (m->record_len == 0)
+    {
+        m->record_len = PCAP_REC_HDR_LEN + (unsigned long long)get32(&p[8]);
+
+        want = PCAP_REC_HDR_LEN + USBPCAP_CONTROL_HDR_LEN;
+        if (want > m->record_len)
+        {
+            want = m->record_len;
+        }
+        if (want > m->peek_fill)
+        {
+            m->peek_want = (unsigned int)want;
+            return;
+        }
+    }
+
+    if (m->usbpcap)
+    {
+        ts = (unsigned long long)get32(p) * 1000000ULL;
+        ts += m->nanosecond ? get32(&p[4]) / 1000 : get32(&p[4]);
+        add_packet(m, ts, &p[PCAP_REC_HDR_LEN], m->peek_fill - PCAP_REC_HDR_LEN);
+    }
+
+    m->skip = m->record_len - m->peek_fill;
+    m->record_len = 0;
+    m->peek_fill = 0;
+    m->peek_want = PCAP_REC_HDR_LEN;
+}
+
+int monitor_init(struct monitor *m)
+{
+    memset(m, 0, sizeof(struct monitor));
+    m->in_header = 1;
+    m->peek_want = 4;
+
+    m->endpoints = (struct monitor_endpoint *)malloc(MONITOR_MAX_ENDPOINTS *
+                                                     sizeof(struct monitor_endpoint));
+    m->slots = (unsigned short *)calloc(MONITOR_ENDPOINT_SLOTS, sizeof(unsigned short));
+    m->pending = (struct monitor_pending *)calloc(MONITOR_PENDING_SLOTS,
+                                                  sizeof(struct monitor_pending));
+    m->rates = (struct monitor_rate *)malloc(MONITOR_MAX_ENDPOINTS *
+                                             sizeof(struct monitor_rate));
+    if ((m->endpoints == NULL) || (m->slots == NULL) ||
+        (m->pending == NULL) || (m->rates == NULL))
+    {
+        monitor_destroy(m);
+        return 0;
+    }
+    return 1;
+}
+
+void monitor_destroy(struct monitor *m)
+{
+    free(m->endpoints);
+    free(m->slots);
+    free(m->pending);
+    free(m->rates);
+    m->endpoints = NULL;
+    m->slots = NULL;
+    m->pending = NULL;
+    m->rates = NULL;
+}
+
+void monitor_feed(struct monitor *m, const unsigned char *data, size_t length)
+{
+    size_t n;
+
+    while ((length > 0) && !m->failed)
+    {
+        if (m->skip > 0)
+        {
+            n = (length < m->skip) ? length : (size_t)m->skip;
+            m->skip -= n;
+        }
+        else
+        {
+            n = m->peek_want - m->peek_fill;
+            if (n > length)
+            {
+                n = length;
+            }
+            memcpy(&m->peek[m->peek_fill], data, n);
+            m->peek_fill += (unsigned int)n;
+            if (m->peek_fill == m->peek_want)
+            {
+                data += n;
+                length -= n;
+                parse_peek(m);
+                continue;
+            }
+        }
+
+        data += n;
+        length -= n;
+    }
+}
+
+static int compare_rates(const void *a, const void *b)
+{
+    const struct monitor_rate *ra = a;
+    const struct monitor_rate *rb = b;
+
+    if (ra->bytes_per_s != rb->bytes_per_s)
+    {
+        return (ra->bytes_per_s > rb->bytes_per_s) ? -1 : 1;
+    }
+    if (ra->urbs_per_s != rb->urbs_per_s)
+    {
+        return (ra->urbs_per_s > rb->urbs_per_s) ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Fills m->rates with every active endpoint and starts new interval */
+static unsigned int collect_all(struct monitor *m, unsigned long long elapsed_us)
+{
+    double seconds = (elapsed_us > 0) ? (double)elapsed_us / 1e6 : 1.0;
+    struct monitor_endpoint *ep;
+    struct monitor_rate *rate;
+    unsigned int count = 0;
+    unsigned int i;
+
+    for (i = 0; i < m->endpoint_count; i++)
+    {
+        ep = &m->endpoints[i];
+        if ((ep->interval_bytes == 0) && (ep->interval_urbs == 0))
+        {
+            continue;
+        }
+
+        rate = &m->rates[count];
+        count++;
+        rate->endpoint = ep;
+        rate->bytes_per_s = (double)ep->interval_bytes / seconds;
+        rate->urbs_per_s = (double)ep->interval_urbs / seconds;
+        rate->errors = ep->interval_errors;
+        rate->p50_us = percentile(ep, 50);
+        rate->p90_us = percentile(ep, 90);
+        rate->p99_us = percentile(ep, 99);
+
+        ep->interval_bytes = 0;
+        ep->interval_urbs = 0;
+        ep->interval_errors = 0;
+        memset(ep->latency, 0, sizeof(ep->latency));
+        ep->latency_count = 0;
+    }
+
+    qsort(m->rates, count, sizeof(struct monitor_rate), compare_rates);
+    return count;
+}
+
+unsigned int monitor_collect(struct monitor *m, unsigned long long elapsed_us,
+                             struct monitor_rate *rates, unsigned int max_rates)
+{
+    unsigned int count = collect_all(m, elapsed_us);
+
+    if (count > max_rates)
+    {
+        count = max_rates;
+    }
+    memcpy(rates, m->rates, count * sizeof(struct monitor_rate));
+    return count;
+}
+
+static const char *transfer_name(unsigned int transfer)
+{
+    switch (transfer)
+    {
+        case 0:  return "isoch";
+        case 1:  return "intr";
+        case 2:  return "ctrl";
+        case 3:  return "bulk";
+        default: return "other";
+    }
+}
+
+void monitor_report(struct monitor *m, FILE *out,
+                    unsigned long long elapsed_us, unsigned int max_rows)
+{
+    double bytes_per_s = 0.0;
+    double urbs_per_s = 0.0;
+    unsigned long long errors = 0;
+    unsigned int count;
+    unsigned int i;
+
+    count = collect_all(m, elapsed_us);
+    for (i = 0; i < count; i++)
+    {
+        bytes_per_s += m->rates[i].bytes_per_s;
+        urbs_per_s += m->rates[i].urbs_per_s;
+        errors += m->rates[i].errors;
+    }
+
+    fprintf(out, "\n%u active endpoints, %.1f kB/s, %.0f URB/s, %llu errors\n",
+            count, bytes_per_s / 1000.0, urbs_per_s, errors);
+    if (count == 0)
+    {
+        return;
+    }
+
+    fprintf(out, "  Bus  Dev  Endp  Type         kB/s     URB/s  Errors"
+                 "   p50 us   p90 us   p99 us\n");
+    for (i = 0; (i < count) && (i < max_rows); i++)
+    {
+        const struct monitor_rate *rate = &m->rates[i];
+
+        fprintf(out, "%5u %4u  0x%02X  %-5s %11.1f %9.0f %7llu %8llu %8llu %8llu\n",
+                rate->endpoint->bus, rate->endpoint->device,
+                rate->endpoint->endpoint, transfer_name(rate->endpoint->transfer),
+                rate->bytes_per_s / 1000.0, rate->urbs_per_s, rate->errors,
+                rate->p50_us, rate->p90_us, rate->p99_us);
+    }
+    if (count > max_rows)
+    {
+        fprintf(out, "  ... %u more\n", count - max_rows);
+    }
+    fflush(out);
+}
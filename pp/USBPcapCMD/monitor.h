@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Live traffic monitor.
+ *
+ * Follows the pcap stream passed in arbitrary pieces and keeps counters
+ * for every bus, device and endpoint seen. Nothing is written anywhere,
+ * only packet headers are looked at.
+ *
+ * An URB is counted on completion (USBPCAP_INFO_PDO_TO_FDO set). Control
+ * transfers captured by USBPcap versions before 1.5.0.0 also have DATA
+ * stage completion, it is counted as data only. URB latency is the time
+ * between submit and completion with the same IRP ID, kept in histogram
+ * with four buckets per power of two microseconds.
+ *
+ * Counters are updated and reported by the same thread so there is no
+ * locking at all.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_MONITOR_H
+#define USBPCAP_CMD_MONITOR_H
+
+#include <stdio.h>
+
+/* Endpoints tracked, records of any other endpoint are only counted */
+#define MONITOR_MAX_ENDPOINTS     256
+#define MONITOR_ENDPOINT_SLOTS    512
+
+/* Submitted URBs waiting for completion, oldest get overwritten */
+#define MONITOR_PENDING_SLOTS     4096
+#define MONITOR_PENDING_WAYS      4
+
+#define MONITOR_LATENCY_BUCKETS   128
+
+/* pcap record header plus USBPcap header with control stage */
+#define MONITOR_PEEK_LEN          44
+
+struct monitor_endpoint
+{
+    unsigned short bus;
+    unsigned short device;
+    unsigned char endpoint;
+    unsigned char transfer;
+
+    /* Since capture start */
+    unsigned long long bytes;
+    unsigned long long urbs;
+    unsigned long long errors;
+
+    /* Since last report */
+    unsigned long long interval_bytes;
+    unsigned long long interval_urbs;
+    unsigned long long interval_errors;
+    unsigned int latency[MONITOR_LATENCY_BUCKETS];
+    unsigned int latency_count;
+};
+
+/* Snapshot of one endpoint, as reported */
+struct monitor_rate
+{
+    const struct monitor_endpoint *endpoint;
+    double bytes_per_s;
+    double urbs_per_s;
+    unsigned long long errors;
+    unsigned long long p50_us; /* Latency percentiles, 0 if no URB */
+    unsigned long long p90_us;
+    unsigned long long p99_us;
+};
+
+struct monitor_pending
+{
+    unsigned long long irp;
+    unsigned long long timestamp; /* Submit time in microseconds */
+    int used;
+};
+
+struct monitor
+{
+    /* Stream parser */
+    int in_header;             /* File header not yet passed */
+    int failed;                /* Stream is not a pcap we can follow */
+    int nanosecond;
+    int usbpcap;               /* Non-zero if link type is DLT_USBPCAP */
+    unsigned char peek[MONITOR_PEEK_LEN];
+    unsigned int peek_fill;
+    unsigned int peek_want;
+    unsigned long long record_len; /* Length of current record, 0 if unknown */
+    unsigned long long skip;   /* Bytes of current record left to skip */
+
+    unsigned long long records;
+    unsigned long long untracked; /* Records of endpoints that did not fit */
+    unsigned long long unmatched; /* Completions without submit */
+    unsigned long long first_ts;  /* Microseconds, 0 before first record */
+    unsigned long long last_ts;
+
+    struct monitor_endpoint *endpoints;
+    unsigned int endpoint_count;
+    unsigned short *slots;     /* Endpoint index + 1, 0 if slot is free */
+    struct monitor_pending *pending;
+    struct monitor_rate *rates; /* MONITOR_MAX_ENDPOINTS, for reports */
+};
+
+/* Returns non-zero on success, 0 if memory could not be allocated */
+int monitor_init(struct monitor *m);
+
+/* Frees memory allocated by monitor_init() */
+void monitor_destroy(struct monitor *m);
+
+/* Follows length bytes of capture stream */
+void monitor_feed(struct monitor *m, const unsigned char *data, size_t length);
+
+/*
+ * Fills rates with endpoints active since last report, busiest first,
+ * and starts new interval. elapsed_us is interval length. Returns number
+ * of entries written, at most max_rates.
+ */
+unsigned int monitor_collect(struct monitor *m, unsigned long long elapsed_us,
+                             struct monitor_rate *rates, unsigned int max_rates);
+
+/*
+ * Prints table of endpoints active since last report (at most max_rows)
+ * and starts new interval.
+ */
+void monitor_report(struct monitor *m, FILE *out,
+                    unsigned long long elapsed_us, unsigned int max_rows);
+
+#endif /* USBPCAP_CMD_MONITOR_H */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "outname.h"
+
+#define INDEX_MIN_DIGITS  5
+#define INDEX_MAX_DIGITS  10
+
+int outname_is_stream(const char *filename)
+{
+    return (strcmp(filename, "-") == 0) ||
+           (strncmp(filename, OUTNAME_PIPE_PREFIX, sizeof(OUTNAME_PIPE_PREFIX) - 1) == 0);
+}
+
+char *outname_rotated(const char *filename, unsigned int index, int rotate)
+{
+    size_t len = strlen(filename);
+    size_t base_len = len;
+    char digits[INDEX_MAX_DIGITS];
+    size_t digit_count = 0;
+    size_t i;
+    char *name;
+
+    if (!rotate || outname_is_stream(filename))
+    {
+        name = malloc(len + 1);
+        if (name != NULL)
+        {
+            memcpy(name, filename, len + 1);
+        }
+        return name;
+    }
+
+    /* Insert index before extension: capture.pcap -> capture_00001.pcap */
+    for (i = len; i > 0; i--)
+    {
+        if (filename[i - 1] == '.')
+        {
+            base_len = i - 1;
+            break;
+        }
+        else if ((filename[i - 1] == '\\') || (filename[i - 1] == '/'))
+        {
+            break;
+        }
+    }
+
+    do
+    {
+        digits[digit_count++] = (char)('0' + index % 10);
+        index /= 10;
+    } while ((index != 0) || (digit_count < INDEX_MIN_DIGITS));
+
+    name = malloc(len + 1 + digit_count + 1);
+    if (name != NULL)
+    {
+        char *p = name;
+
+        memcpy(p, filename, base_len);
+        p += base_len;
+        *p++ = '_';
+        while (digit_count > 0)
+        {
+            *p++ = digits[--digit_count];
+        }
+        memcpy(p, &filename[base_len], len - base_len + 1);
+    }
+    return name;
+}
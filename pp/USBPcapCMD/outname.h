@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Output file names.
+ *
+ * Rotated output files get their number inserted before the extension,
+ * capture.pcap becomes capture_00001.pcap. Standard output ("-") and
+ * named pipes (the relay pipe of elevated worker) are streams that are
+ * never rotated, so their names are always kept as they are.
+ */
+
+#ifndef USBPCAP_CMD_OUTNAME_H
+#define USBPCAP_CMD_OUTNAME_H
+
+#define OUTNAME_PIPE_PREFIX "\\\\.\\pipe\\"
+
+/* Returns nonzero if filename is standard output or named pipe */
+int outname_is_stream(const char *filename);
+
+/*
+ * Returns newly allocated name of output file with given index, or NULL
+ * if out of memory. Without rotation filename is copied unchanged.
+ */
+char *outname_rotated(const char *filename, unsigned int index, int rotate);
+
+#endif /* USBPCAP_CMD_OUTNAME_H */
@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+#include "pcapng.h"
+
+#define BLOCK_SHB  0x0A0D0D0A
+#define BLOCK_IDB  0x00000001
+#define BLOCK_ISB  0x00000005
+#define BLOCK_EPB  0x00000006
+
+#define BYTE_ORDER_MAGIC  0x1A2B3C4D
+
+#define OPT_ENDOFOPT      0
+#define OPT_COMMENT       1
+#define OPT_SHB_USERAPPL  4
+#define OPT_IF_NAME       2
+#define OPT_IF_TSRESOL    9
+#define OPT_ISB_ENDTIME   3
+#define OPT_ISB_IFRECV    4
+#define OPT_ISB_IFDROP    5
+
+/* Block type, block total length ... block total length */
+#define BLOCK_OVERHEAD    12
+/* Interface ID, timestamp (high), timestamp (low), captured and original length */
+#define EPB_FIXED_LEN     20
+
+#define PAD4(x) ((4 - ((x) & 3)) & 3)
+
+static unsigned char *put_option(unsigned char *p, unsigned short code,
+                                 const void *value, size_t length)
+{
+    p = put16(p, code);
+    p = put16(p, (unsigned short)length);
+    if (length > 0)
+    {
+        memcpy(p, value, length);
+        p += length;
+        memset(p, 0, PAD4(length));
+        p += PAD4(length);
+    }
+    return p;
+}
+
+static size_t option_len(size_t length)
+{
+    return 4 + length + PAD4(length);
+}
+
+/* Options are limited by 16-bit length field */
+static size_t string_len(const char *s)
+{
+    size_t length = (s == NULL) ? 0 : strlen(s);
+    return (length > 0xFFFF) ? 0xFFFF : length;
+}
+
+static size_t comment_options_len(const char *comment)
+{
+    size_t length = string_len(comment);
+    return (length == 0) ? 0 : option_len(length) + option_len(0);
+}
+
+int pcapng_init(struct pcapng_converter *c, const unsigned char *pcap_hdr)
+{
+    unsigned int magic = get32(pcap_hdr);
+
+    if ((magic != PCAP_MAGIC) && (magic != PCAP_MAGIC_NANOSECOND))
+    {
+        return 0;
+    }
+
+    memset(c, 0, sizeof(struct pcapng_converter));
+    c->nanosecond = (magic == PCAP_MAGIC_NANOSECOND);
+    return 1;
+}
+
+size_t pcapng_write_header(const unsigned char *pcap_hdr,
+                           const char *application, const char *if_name,
+                           unsigned char *out, size_t out_size)
+{
+    size_t app_len = string_len(application);
+    size_t shb_len;
+    size_t idb_len;
+    unsigned int section_length = 0xFFFFFFFF; /* Not specified */
+    unsigned char *p = out;
+
+    shb_len = BLOCK_OVERHEAD + 16;
+    if (app_len > 0)
+    {
+        shb_len += option_len(app_len) + option_len(0);
+    }
+
+    if (out_size < shb_len)
+    {
+        return 0;
+    }
+
+    /* Section Header Block */
+    p = put32(p, BLOCK_SHB);
+    p = put32(p, (unsigned int)shb_len);
+    p = put32(p, BYTE_ORDER_MAGIC);
+    p = put16(p, 1); /* Major version */
+    p = put16(p, 0); /* Minor version */
+    p = put32(p, section_length);
+    p = put32(p, section_length);
+    if (app_len > 0)
+    {
+        p = put_option(p, OPT_SHB_USERAPPL, application, app_len);
+        p = put_option(p, OPT_ENDOFOPT, NULL, 0);
+    }
+    p = put32(p, (unsigned int)shb_len);
+
+    idb_len = pcapng_write_interface(pcap_hdr, if_name, p, out_size - shb_len);
+    if (idb_len == 0)
+    {
+        return 0;
+    }
+
+    return shb_len + idb_len;
+}
+
+size_t pcapng_write_interface(const unsigned char *pcap_hdr,
+                              const char *if_name,
+                              unsigned char *out, size_t out_size)
+{
+    size_t name_len = string_len(if_name);
+    size_t idb_len;
+    unsigned char tsresol = 9; /* Nanoseconds */
+    unsigned char *p = out;
+
+    idb_len = BLOCK_OVERHEAD + 8 + option_len(1) + option_len(0);
+    if (name_len > 0)
+    {
+        idb_len += option_len(name_len);
+    }
+
+    if (out_size < idb_len)
+    {
+        return 0;
+    }
+
+    p = put32(p, BLOCK_IDB);
+    p = put32(p, (unsigned int)idb_len);
+    p = put16(p, (unsigned short)get32(&pcap_hdr[20])); /* Link type */
+    p = put16(p, 0); /* Reserved */
+    p = put32(p, get32(&pcap_hdr[16])); /* Snaplen */
+    if (name_len > 0)
+    {
+        p = put_option(p, OPT_IF_NAME, if_name, name_len);
+    }
+    p = put_option(p, OPT_IF_TSRESOL, &tsresol, 1);
+    p = put_option(p, OPT_ENDOFOPT, NULL, 0);
+    p = put32(p, (unsigned int)idb_len);
+
+    return (size_t)(p - out);
+}
+
+/* Returns interface of packet which starts with length bytes of data */
+static unsigned int packet_interface(const struct pcapng_converter *c,
+                                     const unsigned char *data,
+                                     unsigned int length)
+{
+    unsigned short bus;
+    unsigned int i;
+
+    if ((c->bus_count == 0) || (length < PCAPNG_BUS_PEEK_LEN))
+    {
+        return c->interface_id;
+    }
+
+    bus = get16(&data[PCAPNG_BUS_PEEK_LEN - 2]);
+    for (i = 0; i < c->bus_count; i++)
+    {
+        if (c->buses[i] == bus)
+        {
+            return i;
+        }
+    }
+    return c->interface_id;
+}
+
+/* Record bytes needed before block header can be written */
+static unsigned int record_peek_len(const struct pcapng_converter *c)
+{
+    unsigned int incl_len;
+
+    if ((c->bus_count == 0) || (c->rec_hdr_fill < PCAP_REC_HDR_LEN))
+    {
+        return PCAP_REC_HDR_LEN;
+    }
+
+    incl_len = get32(&c->rec_hdr[8]);
+    if (incl_len > PCAPNG_BUS_PEEK_LEN)
+    {
+        incl_len = PCAPNG_BUS_PEEK_LEN;
+    }
+    return PCAP_REC_HDR_LEN + incl_len;
+}
+
+/* Writes everything that goes after packet data */
+static unsigned char *write_epb_tail(struct pcapng_converter *c,
+                                     unsigned char *p, unsigned int total_len)
+{
+    size_t comment_len = string_len(c->comment);
+
+    memset(p, 0, c->pad);
+    p += c->pad;
+    if (comment_len > 0)
+    {
+        p = put_option(p, OPT_COMMENT, c->comment, comment_len);
+        p = put_option(p, OPT_ENDOFOPT, NULL, 0);
+    }
+    return put32(p, total_len);
+}
+
+size_t pcapng_convert(struct pcapng_converter *c,
+                      const unsigned char *in, size_t in_len,
+                      size_t *consumed,
+                      unsigned char *out, size_t out_size)
+{
+    const unsigned char *in_end = in + in_len;
+    const unsigned char *in_start = in;
+    unsigned char *p = out;
+    unsigned char *out_end = out + out_size;
+
+    for (;;)
+    {
+        /* Fast path for records that fit completely in both buffers */
+        if ((c->in_packet == 0) && (c->rec_hdr_fill == 0) &&
+            ((size_t)(in_end - in) >= PCAP_REC_HDR_LEN))
+        {
+            unsigned int incl_len = get32(&in[8]);
+            unsigned int pad = PAD4(incl_len);
+            size_t comment_len = comment_options_len(c->comment);
+            unsigned long long ts;
+            unsigned int total_len;
+
+            total_len = BLOCK_OVERHEAD + EPB_FIXED_LEN + incl_len + pad +
+                        (unsigned int)comment_len;
+            if (((size_t)(in_end - in) - PCAP_REC_HDR_LEN >= incl_len) &&
+                ((size_t)(out_end - p) >= total_len))
+            {
+                ts = (unsigned long long)get32(&in[0]) * 1000000000ULL;
+                ts += c->nanosecond ? get32(&in[4]) :
+                                      (unsigned long long)get32(&in[4]) * 1000ULL;
+                c->last_timestamp = ts;
+                c->pad = pad;
+
+                p = put32(p, BLOCK_EPB);
+                p = put32(p, total_len);
+                p = put32(p, packet_interface(c, &in[PCAP_REC_HDR_LEN],
+                                              incl_len));
+                p = put32(p, (unsigned int)(ts >> 32));
+                p = put32(p, (unsigned int)(ts & 0xFFFFFFFF));
+                memcpy(p, &in[8], 8); /* Captured and original length */
+                p += 8;
+                memcpy(p, &in[PCAP_REC_HDR_LEN], incl_len);
+                p += incl_len;
+                in += PCAP_REC_HDR_LEN + incl_len;
+                p = write_epb_tail(c, p, total_len);
+                c->packets++;
+                continue;
+            }
+        }
+
+        if (c->in_packet)
+        {
+            size_t n = c->data_left;
+            size_t tail_len;
+
+            if (n > (size_t)(in_end - in))
+            {
+                n = (size_t)(in_end - in);
+            }
+            if (n > (size_t)(out_end - p))
+            {
+                n = (size_t)(out_end - p);
+            }
+            memcpy(p, in, n);
+            p += n;
+            in += n;
+            c->data_left -= (unsigned int)n;
+
+            if (c->data_left > 0)
+            {
+                /* Out of input or output space */
+                break;
+            }
+
+            tail_len = c->pad + comment_options_len(c->comment) + 4;
+            if ((size_t)(out_end - p) < tail_len)
+            {
+                break;
+            }
+            p = write_epb_tail(c, p, get32(&c->rec_hdr[12]));
+            c->in_packet = 0;
+            c->packets++;
+        }
+        else if (c->rec_hdr_fill < record_peek_len(c))
+        {
+            size_t n = record_peek_len(c) - c->rec_hdr_fill;
+
+            if (in == in_end)
+            {
+                break;
+            }
+            if (n > (size_t)(in_end - in))
+            {
+                n = (size_t)(in_end - in);
+            }
+            memcpy(&c->rec_hdr[c->rec_hdr_fill], in, n);
+            c->rec_hdr_fill += (unsigned int)n;
+            in += n;
+        }
+        else
+        {
+            unsigned int ts_sec = get32(&c->rec_hdr[0]);
+            unsigned int ts_frac = get32(&c->rec_hdr[4]);
+            unsigned int incl_len = get32(&c->rec_hdr[8]);
+            unsigned int orig_len = get32(&c->rec_hdr[12]);
+            unsigned int peeked = c->rec_hdr_fill - PCAP_REC_HDR_LEN;
+            unsigned long long ts;
+            unsigned int total_len;
+
+            if ((size_t)(out_end - p) < BLOCK_OVERHEAD - 4 + EPB_FIXED_LEN + peeked)
+            {
+                break;
+            }
+
+            ts = (unsigned long long)ts_sec * 1000000000ULL;
+            ts += c->nanosecond ? ts_frac : (unsigned long long)ts_frac * 1000ULL;
+            c->last_timestamp = ts;
+
+            c->pad = PAD4(incl_len);
+            total_len = BLOCK_OVERHEAD + EPB_FIXED_LEN + incl_len + c->pad +
+                        (unsigned int)comment_options_len(c->comment);
+
+            p = put32(p, BLOCK_EPB);
+            p = put32(p, total_len);
+            p = put32(p, packet_interface(c, &c->rec_hdr[PCAP_REC_HDR_LEN],
+                                          peeked));
+            p = put32(p, (unsigned int)(ts >> 32));
+            p = put32(p, (unsigned int)(ts & 0xFFFFFFFF));
+            p = put32(p, incl_len);
+            p = put32(p, orig_len);
+            memcpy(p, &c->rec_hdr[PCAP_REC_HDR_LEN], peeked);
+            p += peeked;
+
+            /* Keep total length for the trailer in place of orig_len */
+            put32(&c->rec_hdr[12], total_len);
+            c->data_left = incl_len - peeked;
+            c->rec_hdr_fill = 0;
+            c->in_packet = 1;
+        }
+    }
+
+    *consumed = (size_t)(in - in_start);
+    return (size_t)(p - out);
+}
+
+int pcapng_at_boundary(const struct pcapng_converter *c)
+{
+    return (c->in_packet == 0) && (c->rec_hdr_fill == 0);
+}
+
+size_t pcapng_write_statistics(const struct pcapng_converter *c,
+                               int have_counters,
+                               unsigned long long received,
+                               unsigned long long dropped,
+                               unsigned char *out, size_t out_size)
+{
+    size_t isb_len;
+    unsigned int ts[2];
+    unsigned char *p = out;
+
+    isb_len = BLOCK_OVERHEAD + 12 + option_len(8) + option_len(0);
+    if (have_counters)
+    {
+        isb_len += 2 * option_len(8);
+    }
+
+    if (out_size < isb_len)
+    {
+        return 0;
+    }
+
+    /* Statistics are as of the last packet */
+    ts[0] = (unsigned int)(c->last_timestamp >> 32);
+    ts[1] = (unsigned int)(c->last_timestamp & 0xFFFFFFFF);
+
+    p = put32(p, BLOCK_ISB);
+    p = put32(p, (unsigned int)isb_len);
+    p = put32(p, c->interface_id);
+    p = put32(p, ts[0]);
+    p = put32(p, ts[1]);
+    p = put_option(p, OPT_ISB_ENDTIME, ts, 8);
+    if (have_counters)
+    {
+        p = put_option(p, OPT_ISB_IFRECV, &received, 8);
+        p = put_option(p, OPT_ISB_IFDROP, &dropped, 8);
+    }
+    p = put_option(p, OPT_ENDOFOPT, NULL, 0);
+    p = put32(p, (unsigned int)isb_len);
+
+    return (size_t)(p - out);
+}
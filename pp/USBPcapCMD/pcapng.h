@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Streaming pcap to pcapng converter.
+ *
+ * The converter never allocates memory. Caller passes pcap data in
+ * arbitrary pieces together with output buffer and gets pcapng blocks
+ * back. Packet data is copied directly from input to output so a record
+ * may be split between any number of calls.
+ *
+ * All blocks are written in host byte order. Input must be in host byte
+ * order too (USBPcapDriver always writes little endian).
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_PCAPNG_H
+#define USBPCAP_CMD_PCAPNG_H
+
+#include <stddef.h>
+#include "bytes.h"
+
+/* Smallest output buffer pcapng_convert() is guaranteed to progress with */
+#define PCAPNG_MIN_OUTPUT       64
+
+/* Maximum number of bytes a record without comment grows by when converted */
+#define PCAPNG_RECORD_GROWTH    15
+
+/* USBPcap packet header bytes up to and including bus number */
+#define PCAPNG_BUS_PEEK_LEN     19
+
+struct pcapng_converter
+{
+    unsigned int interface_id; /* Interface of produced packets */
+    int nanosecond;            /* Non-zero if input timestamps are in ns */
+    const char *comment;       /* Added to every produced packet, can be NULL */
+
+    /* When set, packets go to interface n where buses[n] is the bus
+     * number in their USBPcap header. Packets from other buses go to
+     * interface_id.
+     */
+    const unsigned short *buses;
+    unsigned int bus_count;
+
+    /* Record being converted, with start of packet data if buses is set */
+    unsigned char rec_hdr[PCAP_REC_HDR_LEN + PCAPNG_BUS_PEEK_LEN];
+    unsigned int rec_hdr_fill;
+    unsigned int data_left;    /* Packet bytes still to be copied */
+    unsigned int pad;          /* Padding after packet data */
+    int in_packet;             /* Non-zero once block header was written */
+
+    /* Statistics */
+    unsigned long long packets;
+    unsigned long long last_timestamp; /* In nanoseconds */
+};
+
+/*
+ * Checks classic pcap global header and prepares converter for packets
+ * that follow it.
+ *
+ * Returns non-zero on success, 0 if header is not supported.
+ */
+int pcapng_init(struct pcapng_converter *c, const unsigned char *pcap_hdr);
+
+/*
+ * Writes Section Header Block followed by Interface Description Block
+ * for the interface described by classic pcap global header.
+ *
+ * Returns number of bytes written or 0 if out_size is too small.
+ */
+size_t pcapng_write_header(const unsigned char *pcap_hdr,
+                           const char *application, const char *if_name,
+                           unsigned char *out, size_t out_size);
+
+/*
+ * Writes another Interface Description Block. Interfaces are numbered
+ * in order of their blocks, the one written by pcapng_write_header() is
+ * interface 0.
+ *
+ * Returns number of bytes written or 0 if out_size is too small.
+ */
+size_t pcapng_write_interface(const unsigned char *pcap_hdr,
+                              const char *if_name,
+                              unsigned char *out, size_t out_size);
+
+/*
+ * Converts classic pcap records (without global header) to Enhanced
+ * Packet Blocks.
+ *
+ * Sets *consumed to number of input bytes used and returns number of
+ * bytes written to out. Stops when either input is used up or output
+ * buffer is full.
+ */
+size_t pcapng_convert(struct pcapng_converter *c,
+                      const unsigned char *in, size_t in_len,
+                      size_t *consumed,
+                      unsigned char *out, size_t out_size);
+
+/* Returns non-zero if converter is between packets */
+int pcapng_at_boundary(const struct pcapng_converter *c);
+
+/*
+ * Writes Interface Statistics Block. Packet counters are only written
+ * when have_counters is non-zero.
+ *
+ * Returns number of bytes written or 0 if out_size is too small.
+ */
+size_t pcapng_write_statistics(const struct pcapng_converter *c,
+                               int have_counters,
+                               unsigned long long received,
+                               unsigned long long dropped,
+                               unsigned char *out, size_t out_size);
+
+#endif /* USBPCAP_CMD_PCAPNG_H */
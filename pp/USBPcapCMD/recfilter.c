@@ -0,0 +1,680 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "recfilter.h"
+#include "bytes.h"
+
+#define USBPCAP_INFO_PDO_TO_FDO   0x01
+#define USBPCAP_TRANSFER_CONTROL  2
+
+enum
+{
+    OP_TEST,   /* acc = field <cmp> value */
+    OP_BYTES,  /* acc = data slice <cmp> bytes */
+    OP_NOT,    /* acc = !acc */
+    OP_JTRUE,  /* if (acc) jump to target */
+    OP_JFALSE  /* if (!acc) jump to target */
+};
+
+enum
+{
+    FIELD_BUS,
+    FIELD_DEVICE,
+    FIELD_ENDPOINT,
+    FIELD_TRANSFER,
+    FIELD_FUNCTION,
+    FIELD_STATUS,
+    FIELD_INFO,
+    FIELD_IRP,
+    FIELD_LENGTH,
+    FIELD_STAGE,
+    FIELD_IN,
+    FIELD_COMPLETION,
+    FIELD_DATA
+};
+
+enum
+{
+    CMP_EQ,
+    CMP_NE,
+    CMP_LT,
+    CMP_LE,
+    CMP_GT,
+    CMP_GE
+};
+
+struct name_value
+{
+    const char *name;
+    unsigned long long value;
+};
+
+static const struct name_value fields[] =
+{
+    {"bus", FIELD_BUS},
+    {"device", FIELD_DEVICE},
+    {"endpoint", FIELD_ENDPOINT},
+    {"transfer", FIELD_TRANSFER},
+    {"function", FIELD_FUNCTION},
+    {"status", FIELD_STATUS},
+    {"info", FIELD_INFO},
+    {"irp", FIELD_IRP},
+    {"length", FIELD_LENGTH},
+    {"stage", FIELD_STAGE},
+    {"in", FIELD_IN},
+    {"completion", FIELD_COMPLETION},
+    {"data", FIELD_DATA},
+    {NULL, 0}
+};
+
+static const struct name_value constants[] =
+{
+    {"isochronous", 0},
+    {"interrupt", 1},
+    {"control", 2},
+    {"bulk", 3},
+    {"irp_info", 0xFE},
+    {"success", 0},
+    {"stall", 0xC0000004},
+    {NULL, 0}
+};
+
+/* Longer operators first */
+static const struct name_value comparisons[] =
+{
+    {"==", CMP_EQ},
+    {"!=", CMP_NE},
+    {"<=", CMP_LE},
+    {">=", CMP_GE},
+    {"<", CMP_LT},
+    {">", CMP_GT},
+    {NULL, 0}
+};
+
+struct parser
+{
+    struct recfilter *f;
+    const char *p;
+    const char *error;
+    const char *error_at;
+};
+
+static int fail(struct parser *ps, const char *error)
+{
+    if (ps->error == NULL)
+    {
+        ps->error = error;
+        ps->error_at = ps->p;
+    }
+    return 0;
+}
+
+static void skip_space(struct parser *ps)
+{
+    while (isspace((unsigned char)*ps->p))
+    {
+        ps->p++;
+    }
+}
+
+static int is_word_char(char c)
+{
+    return isalnum((unsigned char)c) || (c == '_');
+}
+
+/* Consumes token, words must not be followed by other word characters */
+static int accept(struct parser *ps, const char *token)
+{
+    size_t len = strlen(token);
+
+    skip_space(ps);
+    if (strncmp(ps->p, token, len) != 0)
+    {
+        return 0;
+    }
+    if (is_word_char(token[0]) && is_word_char(ps->p[len]))
+    {
+        return 0;
+    }
+    ps->p += len;
+    return 1;
+}
+
+/* Reads identifier into name, returns its length or 0 */
+static size_t read_word(struct parser *ps, char *name, size_t size)
+{
+    size_t len = 0;
+
+    skip_space(ps);
+    while (is_word_char(ps->p[len]))
+    {
+        len++;
+    }
+    if ((len == 0) || (len >= size) || isdigit((unsigned char)ps->p[0]))
+    {
+        return 0;
+    }
+    memcpy(name, ps->p, len);
+    name[len] = '\0';
+    ps->p += len;
+    return len;
+}
+
+static int lookup(const struct name_value *table, const char *name,
+                  unsigned long long *value)
+{
+    for (; table->name != NULL; table++)
+    {
+        if (strcmp(table->name, name) == 0)
+        {
+            *value = table->value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int read_number(struct parser *ps, unsigned long long *value)
+{
+    char *end;
+
+    skip_space(ps);
+    if (!isdigit((unsigned char)*ps->p))
+    {
+        return 0;
+    }
+    *value = strtoull(ps->p, &end, 0);
+    ps->p = end;
+    return 1;
+}
+
+static int hex_digit(char c)
+{
+    if ((c >= '0') && (c <= '9'))
+    {
+        return c - '0';
+    }
+    c = (char)tolower((unsigned char)c);
+    if ((c >= 'a') && (c <= 'f'))
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Reads hex bytes separated by ':', e.g. 01:02:ff */
+static int read_bytes(struct parser *ps, unsigned char *bytes, unsigned int length)
+{
+    unsigned int i;
+    int hi;
+    int lo;
+
+    skip_space(ps);
+    for (i = 0; i < length; i++)
+    {
+        if ((i > 0) && (*ps->p++ != ':'))
+        {
+            return 0;
+        }
+        hi = hex_digit(ps->p[0]);
+        lo = (hi < 0) ? -1 : hex_digit(ps->p[1]);
+        if (lo < 0)
+        {
+            return 0;
+        }
+        bytes[i] = (unsigned char)((hi << 4) | lo);
+        ps->p += 2;
+    }
+    return !is_word_char(*ps->p) && (*ps->p != ':');
+}
+
+static struct recfilter_insn *emit(struct parser *ps, unsigned char op)
+{
+    struct recfilter_insn *insn;
+
+    if (ps->f->count == RECFILTER_MAX_INSNS)
+    {
+        fail(ps, "expression is too long");
+        return NULL;
+    }
+    insn = &ps->f->insns[ps->f->count];
+    ps->f->count++;
+    memset(insn, 0, sizeof(struct recfilter_insn));
+    insn->op = op;
+    return insn;
+}
+
+static int parse_or(struct parser *ps);
+
+static int parse_comparison(struct parser *ps)
+{
+    struct recfilter_insn *insn;
+    unsigned long long field;
+    unsigned long long cmp;
+    unsigned long long value;
+    unsigned long long offset = 0;
+    unsigned long long length = 0;
+    const struct name_value *c;
+    char name[32];
+
+    if (!read_word(ps, name, sizeof(name)) || !lookup(fields, name, &field))
+    {
+        return fail(ps, "field name expected");
+    }
+
+    if (field == FIELD_DATA)
+    {
+        if (!accept(ps, "[") || !read_number(ps, &offset) || (offset > 0xFFFFFF))
+        {
+            return fail(ps, "expected data[<offset>] or data[<offset>:<length>]");
+        }
+        if (accept(ps, ":") &&
+            (!read_number(ps, &length) || (length == 0) ||
+             (length > RECFILTER_MAX_BYTES)))
+        {
+            return fail(ps, "data slice length must be 1 to 16");
+        }
+        if (!accept(ps, "]"))
+        {
+            return fail(ps, "']' expected");
+        }
+    }
+
+    cmp = CMP_NE;
+    value = 0;
+    for (c = comparisons; c->name != NULL; c++)
+    {
+        if (accept(ps, c->name))
+        {
+            cmp = c->value;
+            break;
+        }
+    }
+
+    insn = emit(ps, (length > 0) ? OP_BYTES : OP_TEST);
+    if (insn == NULL)
+    {
+        return 0;
+    }
+    insn->field = (unsigned char)field;
+    insn->offset = (unsigned int)offset;
+    insn->length = (unsigned char)length;
+
+    if (length > 0)
+    {
+        if ((c->name == NULL) || ((cmp != CMP_EQ) && (cmp != CMP_NE)))
+        {
+            return fail(ps, "data slice can only be compared with == or !=");
+        }
+        if (!read_bytes(ps, insn->bytes, (unsigned int)length))
+        {
+            return fail(ps, "expected as many hex bytes as slice length, e.g. 01:02");
+        }
+    }
+    else if (c->name != NULL)
+    {
+        if (!read_number(ps, &value) &&
+            !(read_word(ps, name, sizeof(name)) && lookup(constants, name, &value)))
+        {
+            return fail(ps, "number or value name expected");
+        }
+    }
+
+    insn->cmp = (unsigned char)cmp;
+    insn->value = value;
+    return 1;
+}
+
+static int parse_primary(struct parser *ps)
+{
+    if (accept(ps, "("))
+    {
+        if (!parse_or(ps))
+        {
+            return 0;
+        }
+        if (!accept(ps, ")"))
+        {
+            return fail(ps, "')' expected");
+        }
+        return 1;
+    }
+    return parse_comparison(ps);
+}
+
+static int parse_not(struct parser *ps)
+{
+    skip_space(ps);
+    if (((ps->p[0] == '!') && (ps->p[1] != '=') && accept(ps, "!")) ||
+        accept(ps, "not"))
+    {
+        return parse_not(ps) && (emit(ps, OP_NOT) != NULL);
+    }
+    return parse_primary(ps);
+}
+
+/* Operands are joined by jumps past the rest once result is known */
+static int parse_binary(struct parser *ps, const char *op, const char *word,
+                        unsigned char jump, int (*operand)(struct parser *))
+{
+    struct recfilter_insn *insn;
+
+    if (!operand(ps))
+    {
+        return 0;
+    }
+    while (accept(ps, op) || accept(ps, word))
+    {
+        insn = emit(ps, jump);
+        if ((insn == NULL) || !operand(ps))
+        {
+            return 0;
+        }
+        insn->target = ps->f->count;
+    }
+    return 1;
+}
+
+static int parse_and(struct parser *ps)
+{
+    return parse_binary(ps, "&&", "and", OP_JFALSE, parse_not);
+}
+
+static int parse_or(struct parser *ps)
+{
+    return parse_binary(ps, "||", "or", OP_JTRUE, parse_and);
+}
+
+int recfilter_compile(struct recfilter *f, const char *text,
+                      const char **error, size_t *error_pos)
+{
+    struct parser ps;
+
+    memset(f, 0, sizeof(struct recfilter));
+    ps.f = f;
+    ps.p = text;
+    ps.error = NULL;
+    ps.error_at = text;
+
+    if (parse_or(&ps))
+    {
+        skip_space(&ps);
+        if (*ps.p == '\0')
+        {
+            return 1;
+        }
+        fail(&ps, "unexpected text after expression");
+    }
+
+    *error = ps.error;
+    *error_pos = (size_t)(ps.error_at - text);
+    f->count = 0;
+    return 0;
+}
+
+/* Returns 0 if field is not present in packet */
+static int load_field(const struct recfilter_insn *insn, const unsigned char *packet,
+                      size_t header_len, size_t length, unsigned long long *value)
+{
+    switch (insn->field)
+    {
+        case FIELD_BUS:        *value = get16(&packet[17]); return 1;
+        case FIELD_DEVICE:     *value = get16(&packet[19]); return 1;
+        case FIELD_ENDPOINT:   *value = packet[21]; return 1;
+        case FIELD_TRANSFER:   *value = packet[22]; return 1;
+        case FIELD_FUNCTION:   *value = get16(&packet[14]); return 1;
+        case FIELD_STATUS:     *value = get32(&packet[10]); return 1;
+        case FIELD_INFO:       *value = packet[16]; return 1;
+        case FIELD_IRP:        *value = get64(&packet[2]); return 1;
+        case FIELD_LENGTH:     *value = get32(&packet[23]); return 1;
+        case FIELD_IN:         *value = (packet[21] & 0x80) ? 1 : 0; return 1;
+        case FIELD_COMPLETION: *value = packet[16] & USBPCAP_INFO_PDO_TO_FDO; return 1;
+        case FIELD_STAGE:
+            if ((packet[22] != USBPCAP_TRANSFER_CONTROL) ||
+                (header_len < USBPCAP_CONTROL_HDR_LEN))
+            {
+                return 0;
+            }
+            *value = packet[27];
+            return 1;
+        case FIELD_DATA:
+            if (header_len + insn->offset >= length)
+            {
+                return 0;
+            }
+            *value = packet[header_len + insn->offset];
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int compare(unsigned int cmp, unsigned long long a, unsigned long long b)
+{
+    switch (cmp)
+    {
+        case CMP_EQ: return a == b;
+        case CMP_NE: return a != b;
+        case CMP_LT: return a < b;
+        case CMP_LE: return a <= b;
+        case CMP_GT: return a > b;
+        case CMP_GE: return a >= b;
+        default:     return 0;
+    }
+}
+
+int recfilter_match(const struct recfilter *f, const unsigned char *packet,
+                    size_t length)
+{
+    const struct recfilter_insn *insn;
+    unsigned long long value;
+    size_t header_len;
+    unsigned int pc = 0;
+    int acc = 0;
+
+    if (length < USBPCAP_HDR_LEN)
+    {
+        return 0;
+    }
+    header_len = get16(packet);
+    if ((header_len < USBPCAP_HDR_LEN) || (header_len > length))
+    {
+        return 0;
+    }
+
+    while (pc < f->count)
+    {
+        insn = &f->insns[pc];
+        pc++;
+        switch (insn->op)
+        {
+            case OP_TEST:
+                acc = load_field(insn, packet, header_len, length, &value) &&
+                      compare(insn->cmp, value, insn->value);
+                break;
+            case OP_BYTES:
+                if (header_len + insn->offset + insn->length > length)
+                {
+                    acc = 0;
+                }
+                else
+                {
+                    acc = memcmp(&packet[header_len + insn->offset],
+                                 insn->bytes, insn->length) == 0;
+                    acc = (insn->cmp == CMP_EQ) ? acc : !acc;
+                }
+                break;
+            case OP_NOT:
+                acc = !acc;
+                break;
+            case OP_JTRUE:
+                if (acc)
+                {
+                    pc = insn->target;
+                }
+                break;
+            case OP_JFALSE:
+                if (!acc)
+                {
+                    pc = insn->target;
+                }
+                break;
+        }
+    }
+    return acc;
+}
+
+int recfilter_stream_init(struct recfilter_stream *s, const struct recfilter *f,
+                          size_t max_record)
+{
+    memset(s, 0, sizeof(struct recfilter_stream));
+    s->filter = f;
+    s->carry_size = (max_record > PCAP_REC_HDR_LEN) ? max_record : PCAP_REC_HDR_LEN;
+    s->carry = (unsigned char *)malloc(s->carry_size);
+    s->done = (unsigned char *)malloc(s->carry_size);
+    if ((s->carry == NULL) || (s->done == NULL))
+    {
+        recfilter_stream_destroy(s);
+        return 0;
+    }
+    return 1;
+}
+
+void recfilter_stream_destroy(struct recfilter_stream *s)
+{
+    free(s->carry);
+    free(s->done);
+    s->carry = NULL;
+    s->done = NULL;
+}
+
+/* Continues record split between pieces, returns bytes of data used */
+static size_t continue_carry(struct recfilter_stream *s, const unsigned char *data,
+                             size_t length, const unsigned char **carry,
+                             size_t *carry_len)
+{
+    unsigned char *done;
+    size_t want;
+    size_t n;
+
+    want = (s->carry_len == 0) ? PCAP_REC_HDR_LEN : (size_t)s->carry_len;
+    n = want - s->carry_fill;
+    if (n > length)
+    {
+        n = length;
+    }
+    memcpy(&s->carry[s->carry_fill], data, n);
+    s->carry_fill += n;
+    if (s->carry_fill < want)
+    {
+        return n;
+    }
+
+    if (s->carry_len == 0)
+    {
+        s->carry_len = PCAP_REC_HDR_LEN + (unsigned long long)get32(&s->carry[8]);
+        if (s->carry_len > s->carry_size)
+        {
+            /* Cannot be kept, dropped */
+            s->records++;
+            s->skip = s->carry_len - s->carry_fill;
+            s->carry_fill = 0;
+            s->carry_len = 0;
+        }
+        return n;
+    }
+
+    s->records++;
+    if (recfilter_match(s->filter, &s->carry[PCAP_REC_HDR_LEN],
+                        s->carry_fill - PCAP_REC_HDR_LEN))
+    {
+        s->kept++;
+        *carry = s->carry;
+        *carry_len = s->carry_fill;
+
+        /* Returned record stays valid while next one is stored */
+        done = s->done;
+        s->done = s->carry;
+        s->carry = done;
+    }
+    s->carry_fill = 0;
+    s->carry_len = 0;
+    return n;
+}
+
+size_t recfilter_stream_feed(struct recfilter_stream *s, unsigned char *data,
+                             size_t length, const unsigned char **carry,
+                             size_t *carry_len)
+{
+    unsigned long long record_len;
+    size_t out = 0;
+    size_t pos = 0;
+    size_t n;
+
+    *carry = NULL;
+    *carry_len = 0;
+
+    while ((pos < length) && ((s->skip > 0) || (s->carry_fill > 0)))
+    {
+        if (s->skip > 0)
+        {
+            n = length - pos;
+            if (n > s->skip)
+            {
+                n = (size_t)s->skip;
+            }
+            s->skip -= n;
+            pos += n;
+        }
+        else
+        {
+            pos += continue_carry(s, &data[pos], length - pos, carry, carry_len);
+        }
+    }
+
+    /* Whole records are compacted in place */
+    while (length - pos >= PCAP_REC_HDR_LEN)
+    {
+        record_len = PCAP_REC_HDR_LEN + (unsigned long long)get32(&data[pos + 8]);
+        if (record_len > length - pos)
+        {
+            break;
+        }
+
+        s->records++;
+        if (recfilter_match(s->filter, &data[pos + PCAP_REC_HDR_LEN],
+                            (size_t)record_len - PCAP_REC_HDR_LEN))
+        {
+            if (out != pos)
+            {
+                memmove(&data[out], &data[pos], (size_t)record_len);
+            }
+            out += (size_t)record_len;
+            s->kept++;
+        }
+        pos += (size_t)record_len;
+    }
+
+    while (pos < length)
+    {
+        pos += continue_carry(s, &data[pos], length - pos, carry, carry_len);
+        if (s->skip > 0)
+        {
+            n = length - pos;
+            if (n > s->skip)
+            {
+                n = (size_t)s->skip;
+            }
+            s->skip -= n;
+            pos += n;
+        }
+    }
+
+    return out;
+}
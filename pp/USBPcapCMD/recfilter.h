@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Record filter.
+ *
+ * Decides per captured packet if it is written, using expression similar
+ * to Wireshark display filters:
+ *   device == 5 && endpoint == 0x81
+ *   transfer == bulk && !(status == 0)
+ *   bus == 1 && (data[0] == 0x55 || data[2:3] == 01:02:03)
+ *
+ * Fields are taken from USBPcap packet header:
+ *   bus, device, endpoint, transfer, function, status, info, irp,
+ *   length (data length), stage (control transfers only),
+ *   in (endpoint direction bit set), completion (info PDO to FDO bit set)
+ * and from data following the header:
+ *   data[<offset>]            one byte, compared as number
+ *   data[<offset>:<length>]   up to RECFILTER_MAX_BYTES bytes, compared
+ *                             with == or != to hex bytes like 01:02:03
+ * Numbers are compared with ==, !=, <, <=, > and >=. Field on its own is
+ * true if it is not zero. Transfer and status can be compared with names
+ * isochronous, interrupt, control, bulk, irp_info, success and stall.
+ * Comparison with data that was not captured is false. Expressions are
+ * combined with !, &&, || (or not, and, or) and parentheses.
+ *
+ * Expression is compiled to a short program of comparisons and jumps, so
+ * matching a record does not walk any tree.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_RECFILTER_H
+#define USBPCAP_CMD_RECFILTER_H
+
+#include <stddef.h>
+
+#define RECFILTER_MAX_INSNS      64
+#define RECFILTER_MAX_BYTES      16
+
+struct recfilter_insn
+{
+    unsigned char op;
+    unsigned char field;
+    unsigned char cmp;
+    unsigned char length;     /* Bytes compared, data slices only */
+    unsigned int offset;      /* Data offset */
+    unsigned int target;      /* Jump target */
+    unsigned long long value;
+    unsigned char bytes[RECFILTER_MAX_BYTES];
+};
+
+struct recfilter
+{
+    struct recfilter_insn insns[RECFILTER_MAX_INSNS];
+    unsigned int count;
+};
+
+/* Filters pcap records (without file header) passed in arbitrary pieces */
+struct recfilter_stream
+{
+    const struct recfilter *filter;
+    unsigned char *carry;       /* Record split between pieces */
+    unsigned char *done;        /* Split record completed by last call */
+    size_t carry_size;
+    size_t carry_fill;
+    unsigned long long carry_len; /* Length of split record, 0 if not known yet */
+    unsigned long long skip;    /* Bytes of oversized record left to skip */
+
+    unsigned long long records;
+    unsigned long long kept;
+};
+
+/*
+ * Compiles expression. Returns 0 if it is not valid, error describes
+ * the problem and error_pos is offset in text where it was found then.
+ */
+int recfilter_compile(struct recfilter *f, const char *text,
+                      const char **error, size_t *error_pos);
+
+/* Returns non-zero if packet (USBPcap header and data) matches */
+int recfilter_match(const struct recfilter *f, const unsigned char *packet,
+                    size_t length);
+
+/*
+ * Sets up stream filtering records of at most max_record bytes (record
+ * header included). Returns 0 if memory could not be allocated.
+ */
+int recfilter_stream_init(struct recfilter_stream *s, const struct recfilter *f,
+                          size_t max_record);
+
+void recfilter_stream_destroy(struct recfilter_stream *s);
+
+/*
+ * Moves records of data that match to its start and returns their length.
+ * Record at the end that is not complete is kept until next call. If a
+ * record kept from previous call is completed and matches, *carry points
+ * to it (valid until next call) and it goes before data, otherwise
+ * *carry_len is 0.
+ */
+size_t recfilter_stream_feed(struct recfilter_stream *s, unsigned char *data,
+                             size_t length, const unsigned char **carry,
+                             size_t *carry_len);
+
+#endif /* USBPCAP_CMD_RECFILTER_H */
@@ -0,0 +1,502 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <time.h>
+#endif
+#include "shmring.h"
+
+#ifdef _WIN32
+/* Interlocked functions are full barriers */
+static __inline LONG shmring_load(shmring_atomic *p)
+{
+    return InterlockedCompareExchange(p, 0, 0);
+}
+
+static __inline void shmring_store(shmring_atomic *p, LONG value)
+{
+    InterlockedExchange(p, value);
+}
+
+static __inline void shmring_fence(void)
+{
+    MemoryBarrier();
+}
+#else
+static __inline int shmring_load(shmring_atomic *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static __inline void shmring_store(shmring_atomic *p, int value)
+{
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+static __inline void shmring_fence(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+#endif
+
+#ifdef _WIN32
+static struct shmring_event *data_event(struct shmring *r)
+{
+    return &r->data_event;
+}
+
+static struct shmring_event *space_event(struct shmring *r)
+{
+    return &r->space_event;
+}
+#else
+static struct shmring_event *data_event(struct shmring *r)
+{
+    return &r->shared->data_event;
+}
+
+static struct shmring_event *space_event(struct shmring *r)
+{
+    return &r->shared->space_event;
+}
+
+static int event_init(struct shmring_event *event)
+{
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+    int ok;
+
+    event->signalled = 0;
+
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    ok = (pthread_mutex_init(&event->mutex, &mutex_attr) == 0);
+    pthread_mutexattr_destroy(&mutex_attr);
+    if (!ok)
+    {
+        return 0;
+    }
+
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    ok = (pthread_cond_init(&event->cond, &cond_attr) == 0);
+    pthread_condattr_destroy(&cond_attr);
+    if (!ok)
+    {
+        pthread_mutex_destroy(&event->mutex);
+        return 0;
+    }
+    return 1;
+}
+
+static void event_destroy(struct shmring_event *event)
+{
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->mutex);
+}
+#endif
+
+static void event_set(struct shmring_event *event)
+{
+#ifdef _WIN32
+    SetEvent(event->handle);
+#else
+    pthread_mutex_lock(&event->mutex);
+    event->signalled = 1;
+    pthread_cond_signal(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+#endif
+}
+
+/* Returns non-zero if event was signalled before timeout expired */
+static int event_wait(struct shmring_event *event, int timeout_ms)
+{
+#ifdef _WIN32
+    DWORD timeout = (timeout_ms < 0) ? INFINITE : (DWORD)timeout_ms;
+    return (WaitForSingleObject(event->handle, timeout) == WAIT_OBJECT_0);
+#else
+    struct timespec deadline;
+    int signalled;
+
+    if (timeout_ms >= 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&event->mutex);
+    while (!event->signalled)
+    {
+        if (timeout_ms < 0)
+        {
+            pthread_cond_wait(&event->cond, &event->mutex);
+        }
+        else if (pthread_cond_timedwait(&event->cond, &event->mutex,
+                                        &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    signalled = event->signalled;
+    event->signalled = 0;
+    pthread_mutex_unlock(&event->mutex);
+    return signalled;
+#endif
+}
+
+static unsigned int ring_size(unsigned int capacity)
+{
+    unsigned int size = 4096;
+
+    while ((size < capacity) && (size < 0x40000000))
+    {
+        size <<= 1;
+    }
+    return size;
+}
+
+size_t shmring_region_size(unsigned int capacity)
+{
+    return SHMRING_HEADER_SIZE + (size_t)ring_size(capacity);
+}
+
+/* Sets up process view of initialized region */
+static int attach(struct shmring *r, void *region)
+{
+    struct shmring_shared *shared = (struct shmring_shared *)region;
+
+    if ((shared->magic != SHMRING_MAGIC) ||
+        (shared->size & (shared->size - 1)))
+    {
+        return 0;
+    }
+    r->shared = shared;
+    r->data = (unsigned char *)region + SHMRING_HEADER_SIZE;
+    r->mask = shared->size - 1;
+    return 1;
+}
+
+static void init_shared(struct shmring_shared *shared, unsigned int capacity)
+{
+    memset(shared, 0, sizeof(struct shmring_shared));
+    shared->size = ring_size(capacity);
+    shared->magic = SHMRING_MAGIC;
+}
+
+#ifdef _WIN32
+/* Opens (or creates) named event belonging to the ring */
+static HANDLE named_event(const char *name, const char *suffix, BOOL create)
+{
+    char event_name[MAX_PATH];
+    HANDLE handle;
+
+    sprintf_s(event_name, sizeof(event_name), "%s_%s", name, suffix);
+    if (create)
+    {
+        handle = CreateEventA(NULL, FALSE /* Auto Reset */, FALSE, event_name);
+    }
+    else
+    {
+        handle = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, event_name);
+    }
+    return handle;
+}
+
+static int map_ring(struct shmring *r, const char *name, unsigned int capacity,
+                    BOOL create)
+{
+    size_t size = shmring_region_size(capacity);
+    void *region;
+
+    memset(r, 0, sizeof(struct shmring));
+
+    if (create)
+    {
+        r->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                        (DWORD)((ULONGLONG)size >> 32),
+                                        (DWORD)(size & 0xFFFFFFFF), name);
+    }
+    else
+    {
+        r->mapping = OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name);
+    }
+    if (r->mapping == NULL)
+    {
+        return 0;
+    }
+
+    region = MapViewOfFile(r->mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0,
+                           create ? size : 0);
+    if (region == NULL)
+    {
+        shmring_destroy(r);
+        return 0;
+    }
+    if (create)
+    {
+        init_shared((struct shmring_shared *)region, capacity);
+    }
+    if (!attach(r, region))
+    {
+        UnmapViewOfFile(region);
+        shmring_destroy(r);
+        return 0;
+    }
+
+    r->data_event.handle = named_event(name, "data", create);
+    r->space_event.handle = named_event(name, "space", create);
+    if ((r->data_event.handle == NULL) || (r->space_event.handle == NULL))
+    {
+        shmring_destroy(r);
+        return 0;
+    }
+    return 1;
+}
+
+int shmring_create(struct shmring *r, const char *name, unsigned int capacity)
+{
+    return map_ring(r, name, capacity, TRUE);
+}
+
+int shmring_open(struct shmring *r, const char *name)
+{
+    return map_ring(r, name, 0, FALSE);
+}
+
+void shmring_destroy(struct shmring *r)
+{
+    if (r->data_event.handle != NULL)
+    {
+        CloseHandle(r->data_event.handle);
+    }
+    if (r->space_event.handle != NULL)
+    {
+        CloseHandle(r->space_event.handle);
+    }
+    if (r->shared != NULL)
+    {
+        UnmapViewOfFile(r->shared);
+    }
+    if (r->mapping != NULL)
+    {
+        CloseHandle(r->mapping);
+    }
+    memset(r, 0, sizeof(struct shmring));
+}
+
+HANDLE shmring_data_handle(struct shmring *r)
+{
+    return r->data_event.handle;
+}
+#else
+int shmring_init(struct shmring *r, void *region, unsigned int capacity)
+{
+    struct shmring_shared *shared = (struct shmring_shared *)region;
+
+    init_shared(shared, capacity);
+    if (!event_init(&shared->data_event))
+    {
+        return 0;
+    }
+    if (!event_init(&shared->space_event))
+    {
+        event_destroy(&shared->data_event);
+        return 0;
+    }
+    return attach(r, region);
+}
+
+void shmring_destroy(struct shmring *r)
+{
+    event_destroy(&r->shared->data_event);
+    event_destroy(&r->shared->space_event);
+    r->shared = NULL;
+}
+#endif
+
+unsigned int shmring_write(struct shmring *r, const void *data,
+                           unsigned int length, int timeout_ms)
+{
+    struct shmring_shared *s = r->shared;
+    unsigned int tail = (unsigned int)s->tail; /* Only writer writes tail */
+    unsigned int space;
+    unsigned int offset;
+    unsigned int first;
+
+    for (;;)
+    {
+        if (shmring_load(&s->reader_closed))
+        {
+            return 0;
+        }
+
+        space = s->size - (tail - (unsigned int)shmring_load(&s->head));
+        if ((space > 0) || (timeout_ms == 0))
+        {
+            break;
+        }
+
+        /* Pairs with the fence in shmring_read(). Either the reader sees
+         * us waiting or we see the space it made.
+         */
+        shmring_store(&s->writer_waiting, 1);
+        shmring_fence();
+        space = s->size - (tail - (unsigned int)shmring_load(&s->head));
+        if ((space == 0) && !shmring_load(&s->reader_closed))
+        {
+            if (!event_wait(space_event(r), timeout_ms))
+            {
+                shmring_store(&s->writer_waiting, 0);
+                return 0;
+            }
+        }
+        shmring_store(&s->writer_waiting, 0);
+    }
+
+    if (length > space)
+    {
+        length = space;
+    }
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    /* Copy in at most two pieces, the second one wraps around */
+    offset = tail & r->mask;
+    first = s->size - offset;
+    if (first > length)
+    {
+        first = length;
+    }
+    memcpy(&r->data[offset], data, first);
+    memcpy(r->data, (const unsigned char *)data + first, length - first);
+    shmring_store(&s->tail, tail + length);
+
+    shmring_fence();
+    if (shmring_load(&s->reader_waiting))
+    {
+        event_set(data_event(r));
+    }
+    return length;
+}
+
+void shmring_close(struct shmring *r)
+{
+    shmring_store(&r->shared->writer_closed, 1);
+    shmring_fence();
+    event_set(data_event(r));
+}
+
+int shmring_reader_closed(struct shmring *r)
+{
+    return shmring_load(&r->shared->reader_closed);
+}
+
+/* Returns number of bytes available to the reader */
+static unsigned int available(struct shmring *r, unsigned int head)
+{
+    return (unsigned int)shmring_load(&r->shared->tail) - head;
+}
+
+unsigned int shmring_read(struct shmring *r, void *out, unsigned int size,
+                          int timeout_ms)
+{
+    struct shmring_shared *s = r->shared;
+    unsigned int head = (unsigned int)s->head; /* Only reader writes head */
+    unsigned int length;
+    unsigned int offset;
+    unsigned int first;
+
+    shmring_store(&s->reader_waiting, 0);
+    for (;;)
+    {
+        length = available(r, head);
+        if ((length > 0) || (timeout_ms == 0) ||
+            shmring_load(&s->writer_closed))
+        {
+            break;
+        }
+
+        /* Pairs with the fence in shmring_write() */
+        shmring_store(&s->reader_waiting, 1);
+        shmring_fence();
+        length = available(r, head);
+        if ((length == 0) && !shmring_load(&s->writer_closed))
+        {
+            if (!event_wait(data_event(r), timeout_ms))
+            {
+                shmring_store(&s->reader_waiting, 0);
+                return 0;
+            }
+        }
+        shmring_store(&s->reader_waiting, 0);
+    }
+
+    if (length > size)
+    {
+        length = size;
+    }
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    offset = head & r->mask;
+    first = s->size - offset;
+    if (first > length)
+    {
+        first = length;
+    }
+    memcpy(out, &r->data[offset], first);
+    memcpy((unsigned char *)out + first, r->data, length - first);
+    shmring_store(&s->head, head + length);
+
+    shmring_fence();
+    if (shmring_load(&s->writer_waiting))
+    {
+        event_set(space_event(r));
+    }
+    return length;
+}
+
+int shmring_is_drained(struct shmring *r)
+{
+    return shmring_load(&r->shared->writer_closed) &&
+           (available(r, (unsigned int)r->shared->head) == 0);
+}
+
+int shmring_prepare_wait(struct shmring *r)
+{
+    struct shmring_shared *s = r->shared;
+
+    shmring_store(&s->reader_waiting, 1);
+    shmring_fence();
+    if ((available(r, (unsigned int)s->head) > 0) ||
+        shmring_load(&s->writer_closed))
+    {
+        shmring_store(&s->reader_waiting, 0);
+        return 0;
+    }
+    return 1;
+}
+
+void shmring_reader_close(struct shmring *r)
+{
+    shmring_store(&r->shared->reader_closed, 1);
+    shmring_fence();
+    event_set(space_event(r));
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Byte ring in memory shared by two processes.
+ *
+ * Exactly one process writes and one reads. Like bufpool, moving data
+ * through the ring does not take any lock and a side only enters the
+ * kernel when it has to sleep (ring full or empty) or wake up its peer.
+ * The writer side closes the ring once all data is written, the reader
+ * side marks it closed when it does not want any more data.
+ *
+ * The region starts with SHMRING_HEADER_SIZE bytes of control data,
+ * followed by the ring data. On Windows the region is a named file
+ * mapping and wakeups use named events, elsewhere the caller maps the
+ * region (e.g. anonymous shared mapping inherited over fork()) and
+ * wakeups use process shared condition variables inside the header.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_SHMRING_H
+#define USBPCAP_CMD_SHMRING_H
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define SHMRING_MAGIC        0x47525055 /* "UPRG" */
+#define SHMRING_HEADER_SIZE  4096
+#define SHMRING_CACHE_LINE   64
+
+/* Timeout value that never expires */
+#define SHMRING_INFINITE     (-1)
+
+#ifdef _WIN32
+typedef volatile LONG shmring_atomic;
+#else
+typedef volatile int shmring_atomic;
+#endif
+
+/* Auto-reset event */
+struct shmring_event
+{
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int signalled;
+#endif
+};
+
+/* Control data at the start of shared region */
+struct shmring_shared
+{
+    unsigned int magic;
+    unsigned int size;             /* Data bytes, power of two */
+
+    /* Written by reader */
+    shmring_atomic head;           /* Total bytes read, modulo 2^32 */
+    shmring_atomic reader_waiting; /* Non-zero if reader sleeps on data_event */
+    shmring_atomic reader_closed;
+    unsigned char pad1[SHMRING_CACHE_LINE - 3 * sizeof(shmring_atomic)];
+
+    /* Written by writer */
+    shmring_atomic tail;           /* Total bytes written, modulo 2^32 */
+    shmring_atomic writer_waiting; /* Non-zero if writer sleeps on space_event */
+    shmring_atomic writer_closed;
+    unsigned char pad2[SHMRING_CACHE_LINE - 3 * sizeof(shmring_atomic)];
+
+#ifndef _WIN32
+    struct shmring_event data_event;  /* Writer -> reader */
+    struct shmring_event space_event; /* Reader -> writer */
+#endif
+};
+
+/* View of the ring in one process */
+struct shmring
+{
+    struct shmring_shared *shared;
+    unsigned char *data;
+    unsigned int mask;
+#ifdef _WIN32
+    HANDLE mapping;
+    struct shmring_event data_event;
+    struct shmring_event space_event;
+#endif
+};
+
+/* Returns size of region for ring of at least capacity bytes */
+size_t shmring_region_size(unsigned int capacity);
+
+#ifdef _WIN32
+/*
+ * Creates named ring of at least capacity bytes (writer and reader side
+ * may create it). Other process opens it with shmring_open().
+ *
+ * Returns non-zero on success.
+ */
+int shmring_create(struct shmring *r, const char *name, unsigned int capacity);
+int shmring_open(struct shmring *r, const char *name);
+void shmring_destroy(struct shmring *r);
+
+/* Event signalled when data is written or writer closes the ring */
+HANDLE shmring_data_handle(struct shmring *r);
+#else
+/*
+ * Initializes ring in region of shmring_region_size(capacity) bytes
+ * shared with the other process. Returns non-zero on success.
+ */
+int shmring_init(struct shmring *r, void *region, unsigned int capacity);
+void shmring_destroy(struct shmring *r);
+#endif
+
+/*
+ * Writer side.
+ *
+ * shmring_write() copies as much as fits, waiting up to timeout_ms for
+ * space if the ring is full. Returns number of bytes written, 0 on
+ * timeout or if reader has closed the ring.
+ */
+unsigned int shmring_write(struct shmring *r, const void *data,
+                           unsigned int length, int timeout_ms);
+/* No more data will be written. Wakes up the reader. */
+void shmring_close(struct shmring *r);
+int shmring_reader_closed(struct shmring *r);
+
+/*
+ * Reader side.
+ *
+ * shmring_read() waits up to timeout_ms for data and copies at most
+ * size bytes. Returns 0 on timeout or when writer closed the ring and
+ * all data has been read. Use shmring_is_drained() to tell these apart.
+ */
+unsigned int shmring_read(struct shmring *r, void *out, unsigned int size,
+                          int timeout_ms);
+int shmring_is_drained(struct shmring *r);
+
+/*
+ * Announces that the reader is about to sleep on its own, for example
+ * on the data event together with other handles. Returns 0 if there is
+ * data (or the ring was closed) so reader must not sleep.
+ */
+int shmring_prepare_wait(struct shmring *r);
+
+/* Reader does not want any more data. Wakes up the writer. */
+void shmring_reader_close(struct shmring *r);
+
+#endif /* USBPCAP_CMD_SHMRING_H */
@@ -12,8 +12,20 @@
 #include "thread.h"
 #include "iocontrol.h"
 #include "descriptors.h"
+#include "writer.h"
+#include "merge.h"
 
-HANDLE create_filter_read_handle(struct thread_data *data)
+/* Records are held back this long waiting for older records from other
+ * root hubs. Driver completes reads as soon as it has data, so this only
+ * has to cover the time a read takes to complete.
+ */
+#define MERGE_HOLD_MS    250
+/* Held back records are checked at least this often */
+#define MERGE_WAKEUP_MS  50
+/* Data below notification threshold is read at least this often */
+#define NOTIFY_POLL_MS   100
+
+HANDLE open_filter_device(struct thread_data *data, const char *device)
 {
     HANDLE filter_handle = INVALID_HANDLE_VALUE;
     char* inBuf = NULL;
@@ -25,7 +37,7 @@ HANDLE create_filter_read_handle(struct thread_data *data)
         USBPcapSetDeviceFiltered(&data->filter, 0);
     }
 
-    filter_handle = CreateFileA(data->device,
+    filter_handle = CreateFileA(device,
                                 GENERIC_READ|GENERIC_WRITE,
                                 0,
                                 0,
@@ -35,7 +47,7 @@ HANDLE create_filter_read_handle(struct thread_data *data)
 
     if (filter_handle == INVALID_HANDLE_VALUE)
     {
-        fprintf(stderr, "Couldn't open device - %d\n", GetLastError());
+        fprintf(stderr, "Couldn't open device %s - %d\n", device, GetLastError());
         goto finish;
     }
 
@@ -107,98 +119,211 @@ finish:
     return INVALID_HANDLE_VALUE;
 }
 
-static void write_data(struct thread_data* data, LPOVERLAPPED write_overlapped,
-                       void *buffer, DWORD bytes)
+HANDLE create_filter_read_handle(struct thread_data *data)
+{
+    return open_filter_device(data, data->devices[0]);
+}
+
+struct read_request
+{
+    OVERLAPPED overlapped;
+    struct bufpool_buffer *buffer;
+    BOOL issued; /* TRUE if ReadFile() was accepted and has to be waited for */
+};
+
+static void start_read(struct thread_data *data, struct read_request *request)
+{
+    request->issued = ReadFile(data->read_handle, (PVOID)request->buffer->data,
+                               data->bufferlen, NULL, &request->overlapped) ||
+                      (GetLastError() == ERROR_IO_PENDING);
+}
+
+/*
+ * Allocates count buffers of bufferlen bytes. Large pages are used if the
+ * account holds SeLockMemoryPrivilege, otherwise buffers are pre-faulted
+ * and locked so reads never wait for page faults. Reports what was used.
+ */
+static BOOL init_pool(struct thread_data *data, struct bufpool *pool,
+                      unsigned int count)
 {
-    /* Write data to the end of the file. */
-    write_overlapped->Offset = 0xFFFFFFFF;
-    write_overlapped->OffsetHigh = 0xFFFFFFFF;
-    if (!WriteFile(data->write_handle, buffer, bytes, NULL, write_overlapped))
+    const char *memory;
+
+    if (!bufpool_init_ex(pool, count, data->bufferlen,
+                         BUFPOOL_LARGE_PAGES | BUFPOOL_PREFAULT))
     {
-        DWORD err = GetLastError();
-        if (err == ERROR_IO_PENDING)
-        {
-            DWORD written;
-            if (!GetOverlappedResult(data->write_handle, write_overlapped, &written, TRUE))
-            {
-                fprintf(stderr, "GetOverlappedResult() on write handle failed: %d\n", GetLastError());
-            }
-            else if (written != bytes)
-            {
-                fprintf(stderr, "Wrote %d bytes instead of %d. Stopping capture.\n", written, bytes);
-                data->process = FALSE;
-            }
-        }
-        else
-        {
-            /* Failed to write to output. Quit. */
-            fprintf(stderr, "Write failed (%d). Stopping capture.\n", err);
-            data->process = FALSE;
-        }
+        fprintf(stderr, "Failed to allocate user-mode buffers (length %d)\n",
+                data->bufferlen);
+        return FALSE;
+    }
+
+    if (pool->memory & BUFPOOL_LARGE_PAGES)
+    {
+        memory = "large pages";
+    }
+    else if (pool->memory & BUFPOOL_LOCKED)
+    {
+        memory = "pre-faulted, locked";
+    }
+    else
+    {
+        memory = "pre-faulted, not locked";
+    }
+    fprintf(stderr, "Allocated %u buffers of %u bytes, %lu kB in %lu kB pages (%s)\n",
+            count, data->bufferlen, (unsigned long)(pool->region_size / 1024),
+            (unsigned long)(pool->page_size / 1024), memory);
+    return TRUE;
+}
+
+/*
+ * Fails if count buffers of capture buffer length, together with the
+ * buffers writer converts to pcapng in, would exceed MAX_BUFFER_MEMORY.
+ * Pool buffers are locked in memory, so this is checked before any of
+ * them is allocated.
+ */
+static BOOL check_buffer_memory(struct thread_data *data, unsigned int count)
+{
+    ULONGLONG total;
+
+    if (data->pcapng)
+    {
+        count += MAX_PENDING_WRITES;
+    }
+    total = (ULONGLONG)count * data->bufferlen;
+    if (total > MAX_BUFFER_MEMORY)
+    {
+        fprintf(stderr, "Capture buffers would take %llu MiB, limit is %llu MiB. "
+                        "Reduce -b or --reads.\n",
+                total / (1024 * 1024), MAX_BUFFER_MEMORY / (1024 * 1024));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Returns NULL only if capture is stopping */
+static struct bufpool_buffer *get_free_buffer(struct thread_data *data)
+{
+    struct bufpool_buffer *buffer;
+
+    /* Only blocks when writer cannot keep up with the capture */
+    do
+    {
+        buffer = bufpool_get(&data->pool, 100);
+    } while ((buffer == NULL) && (data->process == TRUE));
+
+    return buffer;
+}
+
+/*
+ * Asks driver to signal the returned event once notify_threshold bytes
+ * are buffered. Returns NULL if the notification could not be set, the
+ * reads are then kept pending as usual.
+ */
+static HANDLE enable_notification(struct thread_data *data)
+{
+    USBPCAP_IOCTL_NOTIFICATION notification;
+    HANDLE event;
+    DWORD bytes_ret;
+
+    event = CreateEvent(NULL,
+                        FALSE /* Auto Reset */,
+                        FALSE /* Default non signaled */,
+                        NULL /* No name */);
+    if (event == NULL)
+    {
+        fprintf(stderr, "Failed to create notification event - %d\n", GetLastError());
+        return NULL;
+    }
+
+    notification.event = (UINT64)(ULONG_PTR)event;
+    notification.threshold = data->notify_threshold;
+    if (!DeviceIoControl(data->read_handle,
+                         IOCTL_USBPCAP_SET_NOTIFICATION,
+                         &notification,
+                         sizeof(notification),
+                         NULL,
+                         0,
+                         &bytes_ret,
+                         0))
+    {
+        fprintf(stderr, "Failed to set notification - %d. Keeping reads pending.\n",
+                GetLastError());
+        CloseHandle(event);
+        return NULL;
     }
-    FlushFileBuffers(data->write_handle);
-    ResetEvent(write_overlapped->hEvent);
+    return event;
 }
 
-static void process_data(struct thread_data* data, LPOVERLAPPED write_overlapped,
-                         unsigned char *buffer, DWORD bytes)
+static void disable_notification(struct thread_data *data, HANDLE event)
 {
-    if (data->descriptors.buf_written < sizeof(pcap_hdr_t))
+    USBPCAP_IOCTL_NOTIFICATION notification;
+    DWORD bytes_ret;
+
+    notification.event = 0;
+    notification.threshold = 0;
+    DeviceIoControl(data->read_handle,
+                    IOCTL_USBPCAP_SET_NOTIFICATION,
+                    &notification,
+                    sizeof(notification),
+                    NULL,
+                    0,
+                    &bytes_ret,
+                    0);
+    CloseHandle(event);
+}
+
+/*
+ * Reads until the driver buffer is empty. With notification enabled the
+ * driver completes reads at once, with 0 bytes if there is nothing left.
+ */
+static void drain_notified(struct thread_data *data, struct read_request *request)
+{
+    DWORD read;
+
+    while ((data->process == TRUE) && (request->buffer != NULL))
     {
-        DWORD to_write = sizeof(pcap_hdr_t) - data->descriptors.buf_written;
-        if (to_write > bytes)
+        start_read(data, request);
+        if (!request->issued)
         {
-            to_write = bytes;
+            break;
         }
-        memcpy(&data->descriptors.buf[data->descriptors.buf_written], buffer, to_write);
-        data->descriptors.buf_written += to_write;
-
-        if (data->descriptors.buf_written == sizeof(pcap_hdr_t))
+        if (!GetOverlappedResult(data->read_handle, &request->overlapped, &read, TRUE))
         {
-            pcap_hdr_t *hdr = (pcap_hdr_t *)data->descriptors.buf;
-            write_data(data, write_overlapped, data->descriptors.buf, sizeof(pcap_hdr_t));
-            if ((hdr->magic_number == 0xA1B2C3D4) && (hdr->network == DLT_USBPCAP) && (data->descriptors.descriptors_len > 0))
-            {
-                write_data(data, write_overlapped, data->descriptors.descriptors, data->descriptors.descriptors_len);
-            }
+            read = 0;
         }
-        buffer += to_write;
-        bytes -= to_write;
-
-        if (bytes == 0)
+        ResetEvent(request->overlapped.hEvent);
+        request->issued = FALSE;
+        if (read == 0)
         {
-            /* Nothing more to write */
-            return;
+            break;
         }
+        request->buffer->length = read;
+        bufpool_submit(&data->pool, request->buffer);
+        request->buffer = get_free_buffer(data);
     }
-    write_data(data, write_overlapped, buffer, bytes);
 }
 
 DWORD WINAPI read_thread(LPVOID param)
 {
     struct thread_data* data = (struct thread_data*)param;
-    unsigned char* buffer;
+    struct read_request *reads = NULL;
+    DWORD read_depth = 0;
+    DWORD oldest_read = 0; /* Reads complete in the order they were issued */
+    BOOL pool_ready = FALSE;
+    BOOL write_to_pipe;
+    HANDLE writer = NULL;
+    HANDLE notify_event = NULL;
     DWORD dummy_read;
     unsigned char dummy_buf;
-    OVERLAPPED read_overlapped;
-    OVERLAPPED write_overlapped;
     OVERLAPPED connect_overlapped;
     OVERLAPPED write_handle_read_overlapped; /* Used to detect broken pipe. */
     DWORD read;
     DWORD err;
-    HANDLE table[5];
+    HANDLE table[4];
     int table_count = 0;
+    DWORD n;
 
     memset(&table, 0, sizeof(table));
 
-    buffer = malloc(data->bufferlen);
-    if (buffer == NULL)
-    {
-        fprintf(stderr, "Failed to allocate user-mode buffer (length %d)\n",
-                data->bufferlen);
-        goto finish;
-    }
-
     if (data->read_handle == INVALID_HANDLE_VALUE)
     {
         fprintf(stderr, "Thread started with invalid read handle!\n");
@@ -211,31 +336,79 @@ DWORD WINAPI read_thread(LPVOID param)
         goto finish;
     }
 
-    memset(&read_overlapped, 0, sizeof(read_overlapped));
+    /* Only the capture device benefits from multiple pending reads.
+     * When driver notifies about buffered data the reads never pend.
+     */
+    read_depth = data->read_depth;
+    if ((read_depth < 1) || (GetFileType(data->read_handle) == FILE_TYPE_PIPE) ||
+        (data->notify_threshold != 0))
+    {
+        read_depth = 1;
+    }
+
+    reads = calloc(read_depth, sizeof(struct read_request));
+    if (reads == NULL)
+    {
+        fprintf(stderr, "Failed to allocate read requests\n");
+        read_depth = 0;
+        goto finish;
+    }
+
+    /* Every pending read owns a buffer. The rest are filled buffers
+     * waiting for, or being written by, the writer thread.
+     */
+    if (!check_buffer_memory(data, read_depth + MAX_PENDING_WRITES) ||
+        !init_pool(data, &data->pool, read_depth + MAX_PENDING_WRITES))
+    {
+        read_depth = 0;
+        goto finish;
+    }
+    pool_ready = TRUE;
+
+    for (n = 0; n < read_depth; n++)
+    {
+        reads[n].buffer = bufpool_get(&data->pool, 0);
+    }
+
+    /* Writer may switch write_handle to another file once started */
+    write_to_pipe = (GetFileType(data->write_handle) == FILE_TYPE_PIPE);
+
+    writer = CreateThread(NULL, /* default security attributes */
+                          0,    /* use default stack size */
+                          write_thread,
+                          data,
+                          0,    /* use default creation flag */
+                          NULL);
+    if (writer == NULL)
+    {
+        fprintf(stderr, "Failed to create writer thread - %d\n", GetLastError());
+        read_depth = 0;
+        goto finish;
+    }
+
     memset(&connect_overlapped, 0, sizeof(connect_overlapped));
-    memset(&write_overlapped, 0, sizeof(write_overlapped));
     memset(&write_handle_read_overlapped, 0, sizeof(write_handle_read_overlapped));
-    read_overlapped.hEvent = CreateEvent(NULL,
-                                         TRUE /* Manual Reset */,
-                                         FALSE /* Default non signaled */,
-                                         NULL /* No name */);
+    for (n = 0; n < read_depth; n++)
+    {
+        reads[n].overlapped.hEvent = CreateEvent(NULL,
+                                                 TRUE /* Manual Reset */,
+                                                 FALSE /* Default non signaled */,
+                                                 NULL /* No name */);
+    }
     connect_overlapped.hEvent = CreateEvent(NULL,
                                             TRUE /* Manual Reset */,
                                             FALSE /* Default non signaled */,
                                             NULL /* No name */);
-    write_overlapped.hEvent = CreateEvent(NULL,
-                                          TRUE /* Manual Reset */,
-                                          FALSE /* Default non signaled */,
-                                          NULL /* No name */);
     write_handle_read_overlapped.hEvent = CreateEvent(NULL,
                                                       TRUE /* Manual Reset */,
                                                       FALSE /* Default non signaled */,
                                                       NULL /* No name */);
-    table[table_count] = read_overlapped.hEvent;
-    table_count++;
-    table[table_count] = write_overlapped.hEvent;
+    /* Only the oldest read is waited for. This entry is updated whenever
+     * the oldest read completes.
+     */
+    table[table_count] = reads[oldest_read].overlapped.hEvent;
     table_count++;
-    if (GetFileType(data->write_handle) == FILE_TYPE_PIPE)
+    if (write_to_pipe)
     {
         /* Setup dummy reads from write handle so we can detect broken pipe
          * even ifthere isn't any data read from read handle.
@@ -266,7 +439,22 @@ DWORD WINAPI read_thread(LPVOID param)
     }
     else
     {
-        ReadFile(data->read_handle, (PVOID)buffer, data->bufferlen, NULL, &read_overlapped);
+        if (data->notify_threshold != 0)
+        {
+            notify_event = enable_notification(data);
+        }
+        if (notify_event != NULL)
+        {
+            /* Wait for the driver to signal buffered data instead */
+            table[0] = notify_event;
+        }
+        else
+        {
+            for (n = 0; n < read_depth; n++)
+            {
+                start_read(data, &reads[n]);
+            }
+        }
     }
 
     for (; data->process == TRUE;)
@@ -276,22 +464,47 @@ DWORD WINAPI read_thread(LPVOID param)
         dw = WaitForMultipleObjects(table_count,
                                     table,
                                     FALSE,
-                                    INFINITE);
+                                    (notify_event != NULL) ? NOTIFY_POLL_MS : INFINITE);
 #pragma warning(default : 4296)
         if ((dw >= WAIT_OBJECT_0) && dw < (WAIT_OBJECT_0 + table_count))
         {
             int i = dw - WAIT_OBJECT_0;
-            if (table[i] == read_overlapped.hEvent)
+            if ((notify_event != NULL) && (table[i] == notify_event))
             {
-                GetOverlappedResult(data->read_handle, &read_overlapped, &read, TRUE);
-                ResetEvent(read_overlapped.hEvent);
-                process_data(data, &write_overlapped, buffer, read);
-                /* Start new read. */
-                ReadFile(data->read_handle, (PVOID)buffer, data->bufferlen, &read, &read_overlapped);
+                drain_notified(data, &reads[0]);
             }
-            else if (table[i] == write_overlapped.hEvent)
+            else if (table[i] == reads[oldest_read].overlapped.hEvent)
             {
-                ResetEvent(write_overlapped.hEvent);
+                /* Handle every read that has completed by now, oldest
+                 * first, so the driver gets the requests back as soon
+                 * as possible.
+                 */
+                do
+                {
+                    struct read_request *request = &reads[oldest_read];
+
+                    GetOverlappedResult(data->read_handle, &request->overlapped, &read, TRUE);
+                    ResetEvent(request->overlapped.hEvent);
+                    request->issued = FALSE;
+                    if (read > 0)
+                    {
+                        /* Hand the data over to writer and continue reading
+                         * into another buffer.
+                         */
+                        request->buffer->length = read;
+                        bufpool_submit(&data->pool, request->buffer);
+                        request->buffer = get_free_buffer(data);
+                    }
+                    if (request->buffer != NULL)
+                    {
+                        /* Start new read. It is now the newest one. */
+                        start_read(data, request);
+                    }
+                    oldest_read = (oldest_read + 1) % read_depth;
+                } while ((data->process == TRUE) &&
+                         reads[oldest_read].issued &&
+                         HasOverlappedIoCompleted(&reads[oldest_read].overlapped));
+                table[i] = reads[oldest_read].overlapped.hEvent;
             }
             else if (table[i] == write_handle_read_overlapped.hEvent)
             {
@@ -319,9 +532,14 @@ DWORD WINAPI read_thread(LPVOID param)
             {
                 ResetEvent(connect_overlapped.hEvent);
                 /* Start reading data. */
-                ReadFile(data->read_handle, (PVOID)buffer, data->bufferlen, &read, &read_overlapped);
+                start_read(data, &reads[oldest_read]);
             }
         }
+        else if (dw == WAIT_TIMEOUT)
+        {
+            /* Less than threshold may be buffered for long */
+            drain_notified(data, &reads[0]);
+        }
         else if (dw == WAIT_FAILED)
         {
             fprintf(stderr, "WaitForMultipleObjects failed in read_thread(): %d", GetLastError());
@@ -330,17 +548,52 @@ DWORD WINAPI read_thread(LPVOID param)
     }
 
     CancelIo(data->read_handle);
-    CancelIo(data->write_handle);
-    CloseHandle(read_overlapped.hEvent);
+    if (write_to_pipe)
+    {
+        CancelIo(data->write_handle);
+    }
+    for (n = 0; n < read_depth; n++)
+    {
+        /* Buffers must not be reused while the read is still in progress */
+        if (reads[n].issued)
+        {
+            GetOverlappedResult(data->read_handle, &reads[n].overlapped, &read, TRUE);
+        }
+        CloseHandle(reads[n].overlapped.hEvent);
+    }
     CloseHandle(connect_overlapped.hEvent);
-    CloseHandle(write_overlapped.hEvent);
+    if (notify_event != NULL)
+    {
+        disable_notification(data, notify_event);
+    }
+
+    /* Driver counters are only available when reading from filter device */
+    if (GetFileType(data->read_handle) != FILE_TYPE_PIPE)
+    {
+        data->have_statistics = DeviceIoControl(data->read_handle,
+                                                IOCTL_USBPCAP_GET_STATISTICS,
+                                                NULL,
+                                                0,
+                                                &data->statistics,
+                                                sizeof(data->statistics),
+                                                &read,
+                                                0);
+    }
     CloseHandle(write_handle_read_overlapped.hEvent);
 
 finish:
-    if (buffer != NULL)
+    if (writer != NULL)
     {
-        free(buffer);
+        /* Writer exits once everything submitted so far is written */
+        bufpool_close(&data->pool);
+        WaitForSingleObject(writer, INFINITE);
+        CloseHandle(writer);
     }
+    if (pool_ready)
+    {
+        bufpool_destroy(&data->pool);
+    }
+    free(reads);
 
     /* Notify main thread that we are done.
      * If we are exiting due to exit_event being set by another thread,
@@ -353,3 +606,529 @@ finish:
 
     return 0;
 }
+
+struct merge_request
+{
+    OVERLAPPED overlapped;
+    DWORD device;  /* Index into devices and read_handles */
+    unsigned char *buffer;
+    BOOL issued;   /* TRUE if ReadFile() was accepted and has to be waited for */
+};
+
+static void start_merge_read(struct thread_data *data, struct merge_request *request)
+{
+    request->issued = ReadFile(data->read_handles[request->device], request->buffer,
+                               data->bufferlen, NULL, &request->overlapped) ||
+                      (GetLastError() == ERROR_IO_PENDING);
+}
+
+/* Returns current time in nanoseconds since 1970, like capture timestamps */
+static unsigned long long merge_now(void)
+{
+    FILETIME ft;
+    ULARGE_INTEGER t;
+
+    GetSystemTimeAsFileTime(&ft);
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    return (t.QuadPart - 116444736000000000ULL) * 100ULL;
+}
+
+/*
+ * Hands merged records over to writer until there is nothing to output.
+ * Buffer that was taken but not needed is kept in *spare for next call.
+ */
+static void output_merged(struct thread_data *data, struct merge *m,
+                          unsigned long long horizon, BOOL final,
+                          struct bufpool_buffer **spare)
+{
+    size_t length;
+
+    for (;;)
+    {
+        if (*spare == NULL)
+        {
+            /* Writer takes every buffer until the pool is closed */
+            *spare = final ? bufpool_get(&data->pool, BUFPOOL_INFINITE) :
+                             get_free_buffer(data);
+            if (*spare == NULL)
+            {
+                return;
+            }
+        }
+
+        length = merge_pop(m, horizon, (*spare)->data, data->bufferlen);
+        if (length == 0)
+        {
+            return;
+        }
+        (*spare)->length = (unsigned int)length;
+        bufpool_submit(&data->pool, *spare);
+        *spare = NULL;
+    }
+}
+
+/*
+ * Captures from every device in data->read_handles and writes single
+ * stream with records in timestamp order. Reads of all devices complete
+ * to one I/O completion port so a single thread serves any number of
+ * root hubs.
+ */
+DWORD WINAPI merge_read_thread(LPVOID param)
+{
+    struct thread_data* data = (struct thread_data*)param;
+    struct merge_request *reads = NULL;
+    DWORD read_count = 0;
+    DWORD read_depth;
+    HANDLE port = NULL;
+    HANDLE writer = NULL;
+    BOOL pool_ready = FALSE;
+    BOOL merge_ready = FALSE;
+    struct bufpool read_pool;
+    BOOL read_pool_ready = FALSE;
+    struct merge m;
+    struct bufpool_buffer *spare = NULL;
+    BOOL ended[MAX_CAPTURE_DEVICES];
+    DWORD active;
+    DWORD read;
+    DWORD n;
+
+    read_depth = (data->read_depth < 1) ? 1 : data->read_depth;
+    memset(ended, 0, sizeof(ended));
+
+    for (n = 0; n < data->device_count; n++)
+    {
+        if (data->read_handles[n] == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "Thread started with invalid read handle!\n");
+            goto finish;
+        }
+
+        port = CreateIoCompletionPort(data->read_handles[n], port, (ULONG_PTR)n, 1);
+        if (port == NULL)
+        {
+            fprintf(stderr, "Failed to create completion port - %d\n", GetLastError());
+            goto finish;
+        }
+    }
+
+    /* Read buffers, as much held back data and the writer's buffers */
+    if (!check_buffer_memory(data, 2 * read_depth * data->device_count +
+                                   MAX_PENDING_WRITES + 1))
+    {
+        goto finish;
+    }
+
+    /* Hold back at most a few reads worth of data per device */
+    if (!merge_init(&m, data->device_count,
+                    (size_t)data->bufferlen * read_depth * data->device_count))
+    {
+        fprintf(stderr, "Failed to allocate merge buffers\n");
+        goto finish;
+    }
+    merge_ready = TRUE;
+
+    reads = calloc(read_depth * data->device_count, sizeof(struct merge_request));
+    if (reads == NULL)
+    {
+        fprintf(stderr, "Failed to allocate read requests\n");
+        goto finish;
+    }
+
+    /* Read buffers never reach the writer, pool only allocates them */
+    if (!init_pool(data, &read_pool, read_depth * data->device_count))
+    {
+        goto finish;
+    }
+    read_pool_ready = TRUE;
+    for (n = 0; n < read_depth * data->device_count; n++)
+    {
+        reads[n].device = n / read_depth;
+        reads[n].buffer = bufpool_get(&read_pool, 0)->data;
+        read_count++;
+    }
+
+    /* Buffers only carry merged output to the writer */
+    if (!init_pool(data, &data->pool, MAX_PENDING_WRITES + 1))
+    {
+        goto finish;
+    }
+    pool_ready = TRUE;
+
+    writer = CreateThread(NULL, /* default security attributes */
+                          0,    /* use default stack size */
+                          write_thread,
+                          data,
+                          0,    /* use default creation flag */
+                          NULL);
+    if (writer == NULL)
+    {
+        fprintf(stderr, "Failed to create writer thread - %d\n", GetLastError());
+        goto finish;
+    }
+
+    for (n = 0; n < read_count; n++)
+    {
+        start_merge_read(data, &reads[n]);
+    }
+    active = data->device_count;
+
+    while ((data->process == TRUE) && (active > 0))
+    {
+        OVERLAPPED *overlapped = NULL;
+        ULONG_PTR key;
+        BOOL ok;
+
+        ok = GetQueuedCompletionStatus(port, &read, &key, &overlapped, MERGE_WAKEUP_MS);
+        if (overlapped != NULL)
+        {
+            struct merge_request *request;
+
+            request = CONTAINING_RECORD(overlapped, struct merge_request, overlapped);
+            request->issued = FALSE;
+            if (!ok)
+            {
+                /* Device is gone, do not let it hold back the others */
+                fprintf(stderr, "Read from %s failed - %d\n",
+                        data->devices[request->device], GetLastError());
+                if (!ended[request->device])
+                {
+                    ended[request->device] = TRUE;
+                    merge_end(&m, request->device);
+                    active--;
+                }
+            }
+            else
+            {
+                if ((read > 0) &&
+                    !merge_push(&m, request->device, request->buffer, read))
+                {
+                    fprintf(stderr, "Failed to allocate merge buffers\n");
+                    data->process = FALSE;
+                    break;
+                }
+                start_merge_read(data, request);
+            }
+        }
+        else if (GetLastError() != WAIT_TIMEOUT)
+        {
+            fprintf(stderr, "GetQueuedCompletionStatus failed in merge_read_thread(): %d\n",
+                    GetLastError());
+            break;
+        }
+
+        if ((data->exit_event != INVALID_HANDLE_VALUE) &&
+            (WaitForSingleObject(data->exit_event, 0) == WAIT_OBJECT_0))
+        {
+            data->process = FALSE;
+        }
+
+        output_merged(data, &m, merge_now() - MERGE_HOLD_MS * 1000000ULL,
+                      FALSE, &spare);
+    }
+
+    for (n = 0; n < data->device_count; n++)
+    {
+        CancelIo(data->read_handles[n]);
+    }
+    for (n = 0; n < read_count; n++)
+    {
+        /* Buffers must not be freed while the read is still in progress */
+        if (reads[n].issued)
+        {
+            GetOverlappedResult(data->read_handles[reads[n].device],
+                                &reads[n].overlapped, &read, TRUE);
+        }
+    }
+
+    /* Everything read so far goes to output */
+    for (n = 0; n < data->device_count; n++)
+    {
+        merge_end(&m, n);
+    }
+    output_merged(data, &m, MERGE_FLUSH, TRUE, &spare);
+    if (m.late > 0)
+    {
+        fprintf(stderr, "%llu packets written out of order\n", m.late);
+    }
+
+    data->have_statistics = TRUE;
+    memset(&data->statistics, 0, sizeof(data->statistics));
+    for (n = 0; n < data->device_count; n++)
+    {
+        PUSBPCAP_IOCTL_STATISTICS stats = &data->device_statistics[n];
+
+        if (!DeviceIoControl(data->read_handles[n],
+                             IOCTL_USBPCAP_GET_STATISTICS,
+                             NULL,
+                             0,
+                             stats,
+                             sizeof(*stats),
+                             &read,
+                             0))
+        {
+            data->have_statistics = FALSE;
+            continue;
+        }
+        data->statistics.packets += stats->packets;
+        data->statistics.dropped += stats->dropped;
+    }
+
+finish:
+    if (writer != NULL)
+    {
+        /* Writer exits once everything submitted so far is written */
+        bufpool_close(&data->pool);
+        WaitForSingleObject(writer, INFINITE);
+        CloseHandle(writer);
+    }
+    if (pool_ready)
+    {
+        bufpool_destroy(&data->pool);
+    }
+    if (merge_ready)
+    {
+        merge_destroy(&m);
+    }
+    if (read_pool_ready)
+    {
+        bufpool_destroy(&read_pool);
+    }
+    free(reads);
+    if (port != NULL)
+    {
+        CloseHandle(port);
+    }
+
+    /* Notify main thread that we are done. */
+    if (data->exit_event != INVALID_HANDLE_VALUE)
+    {
+        SetEvent(data->exit_event);
+    }
+
+    return 0;
+}
+
+/*
+ * Hands data available in ring over to writer. Buffer that was taken but
+ * not needed is kept in *spare for next call.
+ */
+static void output_ring(struct thread_data *data, struct shmring *ring,
+                        BOOL final, struct bufpool_buffer **spare)
+{
+    unsigned int length;
+
+    for (;;)
+    {
+        if (*spare == NULL)
+        {
+            /* Writer takes every buffer until the pool is closed */
+            *spare = final ? bufpool_get(&data->pool, BUFPOOL_INFINITE) :
+                             get_free_buffer(data);
+            if (*spare == NULL)
+            {
+                return;
+            }
+        }
+
+        length = shmring_read(ring, (*spare)->data, data->bufferlen, 0);
+        if (length == 0)
+        {
+            return;
+        }
+        (*spare)->length = length;
+        bufpool_submit(&data->pool, *spare);
+        *spare = NULL;
+    }
+}
+
+/*
+ * Passes data written by elevated worker to data->input_ring to output.
+ *
+ * No data goes through the pipe (data->read_handle) but it is kept open
+ * for the whole capture. A read from it fails with ERROR_BROKEN_PIPE once
+ * the worker is gone, and the worker notices that we are gone the same
+ * way, exactly as when data is passed through the pipe.
+ */
+DWORD WINAPI ring_read_thread(LPVOID param)
+{
+    struct thread_data* data = (struct thread_data*)param;
+    struct shmring *ring = data->input_ring;
+    HANDLE writer = NULL;
+    BOOL pool_ready = FALSE;
+    struct bufpool_buffer *spare = NULL;
+    unsigned char dummy_buf;
+    DWORD dummy_read;
+    OVERLAPPED connect_overlapped;
+    OVERLAPPED pipe_overlapped; /* Used to detect broken pipe. */
+    BOOL pipe_read_pending = FALSE;
+    DWORD err;
+    HANDLE table[4];
+    int table_count = 0;
+
+    memset(&table, 0, sizeof(table));
+    memset(&connect_overlapped, 0, sizeof(connect_overlapped));
+    memset(&pipe_overlapped, 0, sizeof(pipe_overlapped));
+
+    if ((ring == NULL) || (data->read_handle == INVALID_HANDLE_VALUE))
+    {
+        fprintf(stderr, "Thread started with invalid read handle!\n");
+        goto finish;
+    }
+
+    if (data->write_handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Thread started with invalid write handle!\n");
+        goto finish;
+    }
+
+    /* Buffers only carry ring data to the writer */
+    if (!init_pool(data, &data->pool, MAX_PENDING_WRITES + 1))
+    {
+        goto finish;
+    }
+    pool_ready = TRUE;
+
+    writer = CreateThread(NULL, /* default security attributes */
+                          0,    /* use default stack size */
+                          write_thread,
+                          data,
+                          0,    /* use default creation flag */
+                          NULL);
+    if (writer == NULL)
+    {
+        fprintf(stderr, "Failed to create writer thread - %d\n", GetLastError());
+        goto finish;
+    }
+
+    connect_overlapped.hEvent = CreateEvent(NULL,
+                                            TRUE /* Manual Reset */,
+                                            FALSE /* Default non signaled */,
+                                            NULL /* No name */);
+    pipe_overlapped.hEvent = CreateEvent(NULL,
+                                         TRUE /* Manual Reset */,
+                                         FALSE /* Default non signaled */,
+                                         NULL /* No name */);
+
+    table[table_count] = shmring_data_handle(ring);
+    table_count++;
+    table[table_count] = connect_overlapped.hEvent;
+    table_count++;
+    table[table_count] = pipe_overlapped.hEvent;
+    table_count++;
+    if (data->exit_event != INVALID_HANDLE_VALUE)
+    {
+        table[table_count] = data->exit_event;
+        table_count++;
+    }
+
+    if (!ConnectNamedPipe(data->read_handle, &connect_overlapped))
+    {
+        err = GetLastError();
+        if (err == ERROR_PIPE_CONNECTED)
+        {
+            /* Worker opened the pipe already, event is not signalled */
+            SetEvent(connect_overlapped.hEvent);
+        }
+        else if (err != ERROR_IO_PENDING)
+        {
+            fprintf(stderr, "ConnectNamedPipe() failed with code %d\n", err);
+            data->process = FALSE;
+        }
+    }
+
+    while (data->process == TRUE)
+    {
+        DWORD dw;
+
+        output_ring(data, ring, FALSE, &spare);
+        if (shmring_is_drained(ring))
+        {
+            /* Worker has finished */
+            break;
+        }
+
+        if (!shmring_prepare_wait(ring))
+        {
+            continue;
+        }
+
+        dw = WaitForMultipleObjects(table_count,
+                                    table,
+                                    FALSE,
+                                    INFINITE);
+        if ((dw >= WAIT_OBJECT_0) && dw < (WAIT_OBJECT_0 + table_count))
+        {
+            int i = dw - WAIT_OBJECT_0;
+            if (table[i] == connect_overlapped.hEvent)
+            {
+                ResetEvent(connect_overlapped.hEvent);
+                pipe_read_pending = ReadFile(data->read_handle, &dummy_buf, sizeof(dummy_buf),
+                                             NULL, &pipe_overlapped) ||
+                                    (GetLastError() == ERROR_IO_PENDING);
+            }
+            else if (table[i] == pipe_overlapped.hEvent)
+            {
+                GetOverlappedResult(data->read_handle, &pipe_overlapped, &dummy_read, TRUE);
+                err = GetLastError();
+                ResetEvent(pipe_overlapped.hEvent);
+                pipe_read_pending = FALSE;
+                if (err == ERROR_BROKEN_PIPE)
+                {
+                    /* Worker is gone. Whatever it has written is still
+                     * in the ring and goes to output below.
+                     */
+                    break;
+                }
+                /* Don't care about result. Start read again. */
+                pipe_read_pending = ReadFile(data->read_handle, &dummy_buf, sizeof(dummy_buf),
+                                             NULL, &pipe_overlapped) ||
+                                    (GetLastError() == ERROR_IO_PENDING);
+            }
+            else if (table[i] == data->exit_event)
+            {
+                /* We should quit as exit_event is set. */
+                data->process = FALSE;
+            }
+            /* Data event needs no handling, ring is read on next iteration */
+        }
+        else if (dw == WAIT_FAILED)
+        {
+            fprintf(stderr, "WaitForMultipleObjects failed in ring_read_thread(): %d", GetLastError());
+            break;
+        }
+    }
+
+    /* Everything read so far goes to output */
+    output_ring(data, ring, TRUE, &spare);
+    shmring_reader_close(ring);
+
+    CancelIo(data->read_handle);
+    if (pipe_read_pending)
+    {
+        GetOverlappedResult(data->read_handle, &pipe_overlapped, &dummy_read, TRUE);
+    }
+    CloseHandle(connect_overlapped.hEvent);
+    CloseHandle(pipe_overlapped.hEvent);
+
+finish:
+    if (writer != NULL)
+    {
+        /* Writer exits once everything submitted so far is written */
+        bufpool_close(&data->pool);
+        WaitForSingleObject(writer, INFINITE);
+        CloseHandle(writer);
+    }
+    if (pool_ready)
+    {
+        bufpool_destroy(&data->pool);
+    }
+
+    /* Notify main thread that we are done. */
+    if (data->exit_event != INVALID_HANDLE_VALUE)
+    {
+        SetEvent(data->exit_event);
+    }
+
+    return 0;
+}
@@ -9,6 +9,17 @@
 
 #include <windows.h>
 #include "USBPcap.h"
+#include "bufpool.h"
+#include "shmring.h"
+
+/* Maximum number of overlapped reads kept pending on capture device */
+#define MAX_READ_DEPTH 64
+
+/* Maximum number of control devices captured at once */
+#define MAX_CAPTURE_DEVICES 16
+
+/* Maximum memory of all buffers of capture buffer length, in bytes */
+#define MAX_BUFFER_MEMORY (2048ULL * 1024 * 1024)
 
 struct inject_descriptors
 {
@@ -25,7 +36,11 @@ struct inject_descriptors
 
 struct thread_data
 {
-    char *device;   /* Filter device object name */
+    char *device;   /* Filter device object name, comma separated if more than one */
+    char *device_list; /* Copy of device split into devices */
+    char *devices[MAX_CAPTURE_DEVICES]; /* Filter device object names */
+    unsigned short buses[MAX_CAPTURE_DEVICES]; /* Root hub number of each device */
+    UINT32 device_count; /* Number of devices, captures from more than one are merged */
     char *filename; /* Output filename */
     char *address_list; /* Comma separated list with addresses of device to capture. */
     USBPCAP_ADDRESS_FILTER filter; /* Addresses that should be filtered */
@@ -33,8 +48,16 @@ struct thread_data
     BOOLEAN capture_new; /* TRUE if we should automatically capture from new devices. */
     UINT32 snaplen; /* Snapshot length */
     UINT32 bufferlen; /* Internal kernel-mode buffer size */
+    UINT32 read_depth; /* Number of overlapped reads kept pending */
+    UINT32 notify_threshold; /* Buffered bytes that wake up read thread, 0 - reads are kept pending */
+    UINT32 flush_size; /* Flush output after this many MiB, 0 - only at close */
+    UINT32 flush_interval; /* Flush output at least every this many ms, 0 - only at close */
+    UINT32 rotate_size; /* Switch to new file after this many MB (1000000 bytes), 0 - never */
+    UINT32 rotate_seconds; /* Switch to new file after this many seconds, 0 - never */
+    UINT32 rotate_files; /* Keep at most this many files when rotating, 0 - all */
     volatile BOOL process; /* FALSE if thread should stop */
     HANDLE read_handle; /* Handle to read data from. */
+    HANDLE read_handles[MAX_CAPTURE_DEVICES]; /* Handles to read from when merging devices. */
     HANDLE write_handle; /* Handle to write data to. */
     HANDLE job_handle; /* Handle to job object of worker process. */
     HANDLE worker_process_thread; /* Handle to breakaway worker process main thread. */
@@ -42,9 +65,39 @@ struct thread_data
 
     BOOLEAN inject_descriptors; /* TRUE if descriptors should be injected into capture. */
     struct inject_descriptors descriptors;
+
+    BOOLEAN pcapng; /* TRUE if output should be converted to pcapng. */
+    BOOL have_statistics; /* TRUE if statistics were read from driver. */
+    USBPCAP_IOCTL_STATISTICS statistics; /* Driver counters at capture end. */
+    USBPCAP_IOCTL_STATISTICS device_statistics[MAX_CAPTURE_DEVICES]; /* Counters of each merged device. */
+
+    BOOLEAN compress; /* TRUE if output should be LZ4 compressed. */
+    UINT32 compress_threads; /* Number of compression threads. */
+
+    BOOLEAN index; /* TRUE if sidecar index should be written. */
+    BOOLEAN direct_io; /* TRUE if output file bypasses file system cache. */
+
+    BOOLEAN monitor; /* TRUE if traffic is only summarized, nothing is written. */
+
+    char *record_filter; /* Record filter expression, NULL if all records are written. */
+
+    char *trigger; /* Trigger expression, NULL if all records are written. */
+    UINT32 trigger_buffer; /* MiB of records kept before trigger. */
+    UINT32 trigger_before; /* Seconds of records kept before trigger, 0 - limited by size only. */
+    UINT32 trigger_after; /* Seconds of records written after last trigger. */
+
+    BOOLEAN shmem; /* TRUE if worker should pass data through shared memory. */
+    struct shmring ring; /* Shared memory between worker and parent process */
+    struct shmring *input_ring; /* Ring to read data from (parent), NULL if not used. */
+    struct shmring *output_ring; /* Ring to write data to (worker), NULL if not used. */
+
+    struct bufpool pool; /* Buffers passed from read thread to write thread */
 };
 
+HANDLE open_filter_device(struct thread_data *data, const char *device);
 HANDLE create_filter_read_handle(struct thread_data *data);
 DWORD WINAPI read_thread(LPVOID param);
+DWORD WINAPI merge_read_thread(LPVOID param);
+DWORD WINAPI ring_read_thread(LPVOID param);
 
 #endif /* USBPCAP_CMD_THREAD_H */
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "topocache.h"
+#include "bytes.h"
+
+#define NODE_HDR_LEN   14
+
+#define FNV_OFFSET     0x811C9DC5
+#define FNV_PRIME      0x01000193
+
+static unsigned int hash(const unsigned char *data, size_t length)
+{
+    unsigned int h = FNV_OFFSET;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        h = (h ^ data[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+void topocache_init(struct topocache *c)
+{
+    memset(c, 0, sizeof(struct topocache));
+}
+
+void topocache_free(struct topocache *c)
+{
+    unsigned int i;
+
+    for (i = 0; i < c->count; i++)
+    {
+        free(c->nodes[i].display);
+    }
+    free(c->nodes);
+    memset(c, 0, sizeof(struct topocache));
+}
+
+static int add_node(struct topocache *c, unsigned int level, unsigned int port,
+                    unsigned short address, unsigned short parent_address,
+                    unsigned short node, unsigned short parent_node,
+                    const char *display, size_t display_len)
+{
+    struct topocache_node *entry;
+    char *copy;
+
+    copy = (char *)malloc(display_len + 1);
+    if (copy == NULL)
+    {
+        return 0;
+    }
+    memcpy(copy, display, display_len);
+    copy[display_len] = '\0';
+
+    if (c->count == c->size)
+    {
+        unsigned int size = c->size ? c->size * 2 : 32;
+        struct topocache_node *nodes;
+
+        nodes = (struct topocache_node *)realloc(c->nodes,
+                                                 size * sizeof(struct topocache_node));
+        if (nodes == NULL)
+        {
+            free(copy);
+            return 0;
+        }
+        c->nodes = nodes;
+        c->size = size;
+    }
+
+    entry = &c->nodes[c->count];
+    c->count++;
+    entry->level = level;
+    entry->port = port;
+    entry->address = address;
+    entry->parent_address = parent_address;
+    entry->node = node;
+    entry->parent_node = parent_node;
+    entry->display = copy;
+    return 1;
+}
+
+int topocache_add(struct topocache *c, unsigned int level, unsigned int port,
+                  unsigned short address, unsigned short parent_address,
+                  unsigned short node, unsigned short parent_node,
+                  const char *display)
+{
+    size_t display_len = strlen(display);
+
+    /* Serialized node has 8 bit level and 16 bit port and name length */
+    if ((level > 0xFF) || (port > 0xFFFF) || (display_len > 0xFFFF))
+    {
+        return 0;
+    }
+    return add_node(c, level, port, address, parent_address,
+                    node, parent_node, display, display_len);
+}
+
+int topocache_is_current(const struct topocache *c,
+                         unsigned long long epoch, unsigned int generation)
+{
+    /* Zero epoch means the snapshot was never taken */
+    return (c->epoch != 0) && (c->epoch == epoch) && (c->generation == generation);
+}
+
+int topocache_parse(struct topocache *c, const unsigned char *data, size_t length)
+{
+    const unsigned char *p;
+    const unsigned char *end = data + length;
+    unsigned int count;
+    unsigned int i;
+
+    topocache_free(c);
+
+    if ((length < TOPOCACHE_HEADER_LEN) ||
+        (get32(data) != TOPOCACHE_MAGIC) ||
+        (get16(&data[4]) != TOPOCACHE_VERSION) ||
+        (get32(&data[24]) != hash(&data[TOPOCACHE_HEADER_LEN],
+                                  length - TOPOCACHE_HEADER_LEN)))
+    {
+        return 0;
+    }
+
+    count = get32(&data[20]);
+    p = &data[TOPOCACHE_HEADER_LEN];
+    for (i = 0; i < count; i++)
+    {
+        unsigned int display_len;
+
+        if ((size_t)(end - p) < NODE_HDR_LEN)
+        {
+            break;
+        }
+        display_len = get16(&p[12]);
+        if ((size_t)(end - p) < NODE_HDR_LEN + display_len)
+        {
+            break;
+        }
+
+        if (!add_node(c, p[0], get16(&p[2]),
+                      (unsigned short)get16(&p[4]), (unsigned short)get16(&p[6]),
+                      (unsigned short)get16(&p[8]), (unsigned short)get16(&p[10]),
+                      (const char *)&p[NODE_HDR_LEN], display_len))
+        {
+            break;
+        }
+        p += NODE_HDR_LEN + display_len;
+    }
+
+    if ((i != count) || (p != end))
+    {
+        topocache_free(c);
+        return 0;
+    }
+
+    c->epoch = get64(&data[8]);
+    c->generation = get32(&data[16]);
+    return 1;
+}
+
+unsigned char *topocache_serialize(const struct topocache *c, size_t *length)
+{
+    const struct topocache_node *entry;
+    unsigned char *data;
+    unsigned char *p;
+    size_t total = TOPOCACHE_HEADER_LEN;
+    size_t display_len;
+    unsigned int i;
+
+    for (i = 0; i < c->count; i++)
+    {
+        total += NODE_HDR_LEN + strlen(c->nodes[i].display);
+    }
+
+    data = (unsigned char *)malloc(total);
+    if (data == NULL)
+    {
+        return NULL;
+    }
+
+    p = &data[TOPOCACHE_HEADER_LEN];
+    for (i = 0; i < c->count; i++)
+    {
+        entry = &c->nodes[i];
+        display_len = strlen(entry->display);
+        p[0] = (unsigned char)entry->level;
+        p[1] = 0;
+        put16(&p[2], entry->port);
+        put16(&p[4], entry->address);
+        put16(&p[6], entry->parent_address);
+        put16(&p[8], entry->node);
+        put16(&p[10], entry->parent_node);
+        put16(&p[12], (unsigned int)display_len);
+        memcpy(&p[NODE_HDR_LEN], entry->display, display_len);
+        p += NODE_HDR_LEN + display_len;
+    }
+
+    put32(data, TOPOCACHE_MAGIC);
+    put16(&data[4], TOPOCACHE_VERSION);
+    put16(&data[6], 0);
+    put64(&data[8], c->epoch);
+    put32(&data[16], c->generation);
+    put32(&data[20], c->count);
+    put32(&data[24], hash(&data[TOPOCACHE_HEADER_LEN], total - TOPOCACHE_HEADER_LEN));
+    put32(&data[28], 0);
+
+    *length = total;
+    return data;
+}
+
+static int node_equal(const struct topocache_node *a, const struct topocache_node *b)
+{
+    return (a->level == b->level) && (a->port == b->port) &&
+           (a->address == b->address) && (a->parent_address == b->parent_address) &&
+           (a->node == b->node) && (a->parent_node == b->parent_node) &&
+           (strcmp(a->display, b->display) == 0);
+}
+
+unsigned int topocache_diff(const struct topocache *old_snapshot,
+                            const struct topocache *new_snapshot,
+                            topocache_diff_callback cb, void *ctx)
+{
+    unsigned char *matched;
+    unsigned int differences = 0;
+    unsigned int i;
+    unsigned int j;
+
+    /* Which new nodes were found in old snapshot */
+    matched = (unsigned char *)calloc(new_snapshot->count + 1, 1);
+
+    /* Few devices are connected to a root hub, quadratic search is fine */
+    for (i = 0; i < old_snapshot->count; i++)
+    {
+        int found = 0;
+
+        for (j = 0; (matched != NULL) && (j < new_snapshot->count); j++)
+        {
+            if (!matched[j] &&
+                node_equal(&old_snapshot->nodes[i], &new_snapshot->nodes[j]))
+            {
+                matched[j] = 1;
+                found = 1;
+                break;
+            }
+        }
+
+        if (!found)
+        {
+            differences++;
+            if (cb != NULL)
+            {
+                cb(&old_snapshot->nodes[i], 0, ctx);
+            }
+        }
+    }
+
+    for (j = 0; j < new_snapshot->count; j++)
+    {
+        if ((matched == NULL) || !matched[j])
+        {
+            differences++;
+            if (cb != NULL)
+            {
+                cb(&new_snapshot->nodes[j], 1, ctx);
+            }
+        }
+    }
+
+    free(matched);
+    return differences;
+}
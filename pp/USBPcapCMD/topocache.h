@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Snapshot of devices connected to a root hub.
+ *
+ * Walking the hub tree and device nodes takes many IOCTLs and
+ * configuration manager calls, and Wireshark asks for --extcap-config
+ * every time interface list is refreshed. Driver counts topology changes
+ * below each root hub (see IOCTL_USBPCAP_GET_TOPOLOGY), so the snapshot
+ * taken by previous walk is used as long as epoch and generation match.
+ *
+ * Serialized snapshot starts with header:
+ *   u32 TOPOCACHE_MAGIC
+ *   u16 TOPOCACHE_VERSION
+ *   u16 reserved, 0
+ *   u64 epoch
+ *   u32 generation
+ *   u32 number of nodes
+ *   u32 FNV-1a hash of all bytes following the header
+ *   u32 reserved, 0
+ * followed by nodes, in the order they were found:
+ *   u8  tree level
+ *   u8  reserved, 0
+ *   u16 hub port, 0 for device node children
+ *   u16 device address
+ *   u16 parent hub address, 0 if attached to root hub
+ *   u16 node index, 0 for the device itself
+ *   u16 parent node index
+ *   u16 display name length
+ *   display name, UTF-8, not terminated
+ * All fields are in host byte order.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_TOPOCACHE_H
+#define USBPCAP_CMD_TOPOCACHE_H
+
+#include <stddef.h>
+
+#define TOPOCACHE_MAGIC       0x43545055 /* "UPTC" */
+#define TOPOCACHE_VERSION     1
+#define TOPOCACHE_HEADER_LEN  32
+
+struct topocache_node
+{
+    unsigned int level;
+    unsigned int port;
+    unsigned short address;
+    unsigned short parent_address;
+    unsigned short node;
+    unsigned short parent_node;
+    char *display;
+};
+
+struct topocache
+{
+    unsigned long long epoch;
+    unsigned int generation;
+    struct topocache_node *nodes;
+    unsigned int count;
+    unsigned int size;  /* Allocated nodes */
+};
+
+/* Called for every node that is only in one of compared snapshots */
+typedef void (*topocache_diff_callback)(const struct topocache_node *node,
+                                        int added, void *ctx);
+
+void topocache_init(struct topocache *c);
+
+/* Frees all nodes, snapshot can be reused afterwards */
+void topocache_free(struct topocache *c);
+
+/*
+ * Appends node, display name is copied. Returns 0 if memory could not
+ * be allocated.
+ */
+int topocache_add(struct topocache *c, unsigned int level, unsigned int port,
+                  unsigned short address, unsigned short parent_address,
+                  unsigned short node, unsigned short parent_node,
+                  const char *display);
+
+/* Returns non-zero if snapshot was taken at given topology generation */
+int topocache_is_current(const struct topocache *c,
+                         unsigned long long epoch, unsigned int generation);
+
+/*
+ * Replaces snapshot content with serialized snapshot. Returns 0 if data
+ * is not a valid snapshot, the snapshot is empty then.
+ */
+int topocache_parse(struct topocache *c, const unsigned char *data, size_t length);
+
+/*
+ * Returns newly allocated serialized snapshot, to be freed using free(),
+ * or NULL if memory could not be allocated.
+ */
+unsigned char *topocache_serialize(const struct topocache *c, size_t *length);
+
+/*
+ * Compares nodes of two snapshots, ignoring their order, epoch and
+ * generation. Calls cb (if not NULL) for nodes removed from old and
+ * added in new. Returns number of differences.
+ */
+unsigned int topocache_diff(const struct topocache *old_snapshot,
+                            const struct topocache *new_snapshot,
+                            topocache_diff_callback cb, void *ctx);
+
+#endif /* USBPCAP_CMD_TOPOCACHE_H */
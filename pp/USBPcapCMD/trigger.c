@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "trigger.h"
+#include "bytes.h"
+
+#define USBPCAP_INFO_PDO_TO_FDO     0x01
+
+#define USBD_STATUS_STALL_PID       0xC0000004
+#define USBD_STATUS_ENDPOINT_HALTED 0xC0000030
+
+/* Parses number not larger than max, advancing *p past it */
+static int parse_number(const char **p, unsigned long max, int *value)
+{
+    char *end;
+    unsigned long n;
+
+    n = strtoul(*p, &end, 0);
+    if ((end == *p) || (n > max))
+    {
+        return 0;
+    }
+    *value = (int)n;
+    *p = end;
+    return 1;
+}
+
+int trigger_parse(struct trigger_expr *expr, const char *text, const char **error)
+{
+    struct trigger_condition *cond;
+    const char *p = text;
+    char *end;
+
+    memset(expr, 0, sizeof(struct trigger_expr));
+    for (;;)
+    {
+        if (expr->count == TRIGGER_MAX_CONDITIONS)
+        {
+            *error = "too many conditions";
+            return 0;
+        }
+        cond = &expr->conditions[expr->count];
+
+        if (strncmp(p, "stall", 5) == 0)
+        {
+            cond->type = TRIGGER_STALL;
+            p += 5;
+        }
+        else if (strncmp(p, "error", 5) == 0)
+        {
+            cond->type = TRIGGER_ERROR;
+            p += 5;
+        }
+        else if (strncmp(p, "status=", 7) == 0)
+        {
+            cond->type = TRIGGER_STATUS;
+            p += 7;
+            cond->status = (unsigned int)strtoul(p, &end, 0);
+            if (end == p)
+            {
+                *error = "status code expected after status=";
+                return 0;
+            }
+            p = end;
+        }
+        else
+        {
+            *error = "expected stall, error or status=<code>";
+            return 0;
+        }
+
+        cond->bus = TRIGGER_ANY;
+        cond->device = TRIGGER_ANY;
+        cond->endpoint = TRIGGER_ANY;
+        if (*p == '@')
+        {
+            p++;
+            if (!parse_number(&p, 0xFFFF, &cond->bus) ||
+                ((*p == '.') && (p++, !parse_number(&p, 0xFFFF, &cond->device))) ||
+                ((*p == '.') && (p++, !parse_number(&p, 0xFF, &cond->endpoint))))
+            {
+                *error = "expected @<bus>[.<device>[.<endpoint>]]";
+                return 0;
+            }
+        }
+        expr->count++;
+
+        if (*p == '\0')
+        {
+            return 1;
+        }
+        if (*p != ',')
+        {
+            *error = "conditions must be separated with ','";
+            return 0;
+        }
+        p++;
+    }
+}
+
+static int condition_matches(const struct trigger_condition *cond,
+                             const unsigned char *h)
+{
+    unsigned int status = get32(&h[10]);
+    int completion = (h[16] & USBPCAP_INFO_PDO_TO_FDO) != 0;
+
+    if (((cond->bus != TRIGGER_ANY) && ((unsigned int)cond->bus != get16(&h[17]))) ||
+        ((cond->device != TRIGGER_ANY) && ((unsigned int)cond->device != get16(&h[19]))) ||
+        ((cond->endpoint != TRIGGER_ANY) && ((unsigned int)cond->endpoint != h[21])))
+    {
+        return 0;
+    }
+
+    switch (cond->type)
+    {
+        case TRIGGER_STALL:
+            return completion && ((status == USBD_STATUS_STALL_PID) ||
+                                  (status == USBD_STATUS_ENDPOINT_HALTED));
+        case TRIGGER_ERROR:
+            return completion && (status != 0);
+        case TRIGGER_STATUS:
+            return status == cond->status;
+        default:
+            return 0;
+    }
+}
+
+/* h is USBPcap packet header of length bytes */
+static int record_matches(const struct trigger_expr *expr,
+                          const unsigned char *h, unsigned long long length)
+{
+    unsigned int i;
+
+    if ((length < USBPCAP_HDR_LEN) || (get16(h) < USBPCAP_HDR_LEN))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < expr->count; i++)
+    {
+        if (condition_matches(&expr->conditions[i], h))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static unsigned long long record_timestamp(const struct trigger *t,
+                                           const unsigned char *hdr)
+{
+    unsigned long long ts = (unsigned long long)get32(hdr) * 1000000ULL;
+
+    return ts + (t->nanosecond ? get32(&hdr[4]) / 1000 : get32(&hdr[4]));
+}
+
+static void ring_write(struct trigger *t, unsigned long long pos,
+                       const unsigned char *data, size_t length)
+{
+    size_t offset = (size_t)(pos % t->size);
+    size_t first = t->size - offset;
+
+    if (first > length)
+    {
+        first = length;
+    }
+    memcpy(&t->ring[offset], data, first);
+    memcpy(t->ring, &data[first], length - first);
+}
+
+static void ring_read(const struct trigger *t, unsigned long long pos,
+                      unsigned char *data, size_t length)
+{
+    size_t offset = (size_t)(pos % t->size);
+    size_t first = t->size - offset;
+
+    if (first > length)
+    {
+        first = length;
+    }
+    memcpy(data, &t->ring[offset], first);
+    memcpy(&data[first], t->ring, length - first);
+}
+
+/* Writes all complete records in the ring */
+static void flush(struct trigger *t)
+{
+    size_t offset = (size_t)(t->head % t->size);
+    size_t length = (size_t)(t->tail - t->head);
+    size_t first = t->size - offset;
+
+    if (length == 0)
+    {
+        return;
+    }
+
+    if (first >= length)
+    {
+        t->output(t->ctx, &t->ring[offset], length);
+    }
+    else
+    {
+        t->output(t->ctx, &t->ring[offset], first);
+        t->output(t->ctx, t->ring, length - first);
+    }
+
+    t->written += t->ring_records;
+    t->ring_records = 0;
+    t->head = t->tail;
+}
+
+static void drop_oldest(struct trigger *t)
+{
+    unsigned char hdr[PCAP_REC_HDR_LEN];
+
+    ring_read(t, t->head, hdr, PCAP_REC_HDR_LEN);
+    t->head += PCAP_REC_HDR_LEN + (unsigned long long)get32(&hdr[8]);
+    t->ring_records--;
+    t->dropped++;
+}
+
+/* Drops records that are outside the pre-trigger window */
+static void trim(struct trigger *t, unsigned long long newest)
+{
+    unsigned char hdr[PCAP_REC_HDR_LEN];
+    unsigned long long ts;
+
+    while (t->ring_records > 1)
+    {
+        if (t->tail - t->head <= t->pre_bytes)
+        {
+            if (t->pre_us == 0)
+            {
+                break;
+            }
+
+            /* Merged root hubs are not strictly ordered */
+            ring_read(t, t->head, hdr, PCAP_REC_HDR_LEN);
+            ts = record_timestamp(t, hdr);
+            if ((newest <= ts) || (newest - ts <= t->pre_us))
+            {
+                break;
+            }
+        }
+        drop_oldest(t);
+    }
+}
+
+/* Frees ring space for length more bytes of current record */
+static int make_room(struct trigger *t, size_t length)
+{
+    while (t->size - (size_t)(t->fill - t->head) < length)
+    {
+        if (t->ring_records == 0)
+        {
+            return 0;
+        }
+
+        if (t->triggered)
+        {
+            flush(t);
+        }
+        else
+        {
+            drop_oldest(t);
+        }
+    }
+    return 1;
+}
+
+static void record_done(struct trigger *t)
+{
+    unsigned long long length = t->record_len - PCAP_REC_HDR_LEN;
+    unsigned long long ts = record_timestamp(t, t->peek);
+    int match;
+
+    if (length > TRIGGER_PEEK_LEN - PCAP_REC_HDR_LEN)
+    {
+        length = TRIGGER_PEEK_LEN - PCAP_REC_HDR_LEN;
+    }
+    match = record_matches(&t->expr, &t->peek[PCAP_REC_HDR_LEN], length);
+
+    t->records++;
+    if (match)
+    {
+        t->matches++;
+    }
+
+    if (t->triggered && !match && (ts > t->post_end))
+    {
+        /* Window closed, this record may be pre-trigger data already */
+        flush(t);
+        t->triggered = 0;
+    }
+
+    t->tail = t->fill;
+    t->ring_records++;
+
+    if (!t->triggered)
+    {
+        trim(t, ts);
+    }
+
+    if (match)
+    {
+        if (!t->triggered)
+        {
+            t->windows++;
+        }
+        t->triggered = 1;
+        t->post_end = ts + t->post_us;
+    }
+}
+
+int trigger_init(struct trigger *t, const struct trigger_expr *expr,
+                 size_t pre_bytes, size_t max_record,
+                 unsigned long long pre_us, unsigned long long post_us,
+                 int nanosecond, trigger_output output, void *ctx)
+{
+    memset(t, 0, sizeof(struct trigger));
+    t->expr = *expr;
+    t->pre_bytes = pre_bytes;
+    t->pre_us = pre_us;
+    t->post_us = post_us;
+    t->nanosecond = nanosecond;
+    t->output = output;
+    t->ctx = ctx;
+
+    t->size = pre_bytes + max_record + TRIGGER_PEEK_LEN;
+    t->ring = (unsigned char *)malloc(t->size);
+    return t->ring != NULL;
+}
+
+void trigger_destroy(struct trigger *t)
+{
+    free(t->ring);
+    t->ring = NULL;
+}
+
+void trigger_feed(struct trigger *t, const unsigned char *data, size_t length)
+{
+    unsigned long long stored;
+    size_t n;
+
+    while (length > 0)
+    {
+        if (t->skip > 0)
+        {
+            n = (length < t->skip) ? length : (size_t)t->skip;
+            t->skip -= n;
+            data += n;
+            length -= n;
+            continue;
+        }
+
+        stored = t->fill - t->tail;
+        if (t->record_len == 0)
+        {
+            n = (size_t)(PCAP_REC_HDR_LEN - stored);
+        }
+        else
+        {
+            n = (size_t)(t->record_len - stored);
+        }
+        if (n > length)
+        {
+            n = length;
+        }
+
+        /* Header always fits, record length is checked below */
+        make_room(t, n);
+        ring_write(t, t->fill, data, n);
+        if (stored < TRIGGER_PEEK_LEN)
+        {
+            memcpy(&t->peek[stored], data,
+                   (n < TRIGGER_PEEK_LEN - stored) ? n : (size_t)(TRIGGER_PEEK_LEN - stored));
+        }
+        t->fill += n;
+        stored += n;
+        data += n;
+        length -= n;
+
+        if ((t->record_len == 0) && (stored == PCAP_REC_HDR_LEN))
+        {
+            t->record_len = PCAP_REC_HDR_LEN + (unsigned long long)get32(&t->peek[8]);
+            if (t->record_len > t->size)
+            {
+                t->oversized++;
+                t->skip = t->record_len - stored;
+                t->fill = t->tail;
+                t->record_len = 0;
+                continue;
+            }
+        }
+
+        if ((t->record_len != 0) && (stored == t->record_len))
+        {
+            record_done(t);
+            t->record_len = 0;
+        }
+    }
+
+    if (t->triggered)
+    {
+        flush(t);
+    }
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Triggered capture.
+ *
+ * Captured pcap records (without file header) are kept in a ring holding
+ * the last pre_bytes bytes and pre_us microseconds of traffic. Nothing is
+ * written until a record matches the trigger expression. Then the ring
+ * content is written, followed by all records until post_us microseconds
+ * after the last matching record, and the trigger is armed again.
+ *
+ * Trigger expression is comma separated list of conditions, any of them
+ * fires the trigger:
+ *   stall          completion with USBD_STATUS_STALL_PID or
+ *                  USBD_STATUS_ENDPOINT_HALTED
+ *   error          completion with any status other than USBD_STATUS_SUCCESS
+ *   status=<code>  record with given USBD_STATUS, e.g. status=0xC0000011
+ * Each condition can be limited to bus, device and endpoint with
+ * @<bus>[.<device>[.<endpoint>]], e.g. stall@1.5.0x81.
+ *
+ * This file does not depend on Windows so it can be built and measured
+ * on other systems too.
+ */
+
+#ifndef USBPCAP_CMD_TRIGGER_H
+#define USBPCAP_CMD_TRIGGER_H
+
+#include <stddef.h>
+
+#define TRIGGER_MAX_CONDITIONS   16
+
+/* pcap record header plus USBPcap header */
+#define TRIGGER_PEEK_LEN         43
+
+#define TRIGGER_ANY              (-1)
+
+enum trigger_type
+{
+    TRIGGER_STALL,
+    TRIGGER_ERROR,
+    TRIGGER_STATUS
+};
+
+struct trigger_condition
+{
+    enum trigger_type type;
+    unsigned int status;  /* TRIGGER_STATUS only */
+    int bus;              /* TRIGGER_ANY matches all */
+    int device;
+    int endpoint;
+};
+
+struct trigger_expr
+{
+    struct trigger_condition conditions[TRIGGER_MAX_CONDITIONS];
+    unsigned int count;
+};
+
+/* Called with records to write, data is only valid during the call */
+typedef void (*trigger_output)(void *ctx, const unsigned char *data, size_t length);
+
+struct trigger
+{
+    struct trigger_expr expr;
+    size_t pre_bytes;
+    unsigned long long pre_us;  /* 0 if window is only limited by size */
+    unsigned long long post_us;
+    int nanosecond;             /* Record timestamps are in nanoseconds */
+    trigger_output output;
+    void *ctx;
+
+    /* Ring of records, positions only grow. Records in [head, tail) are
+     * complete, current record is being stored from tail on.
+     */
+    unsigned char *ring;
+    size_t size;
+    unsigned long long head;
+    unsigned long long tail;
+    unsigned long long fill;    /* End of data stored so far */
+    unsigned long long ring_records; /* Complete records in ring */
+
+    unsigned char peek[TRIGGER_PEEK_LEN];
+    unsigned long long record_len; /* Current record length, 0 if not known yet */
+    unsigned long long skip;    /* Bytes of oversized record left to skip */
+
+    int triggered;              /* Post-trigger window is open */
+    unsigned long long post_end; /* Timestamp where it closes */
+
+    unsigned long long records;
+    unsigned long long windows;   /* Times the trigger fired while armed */
+    unsigned long long matches;   /* Records that matched */
+    unsigned long long written;   /* Records written */
+    unsigned long long dropped;   /* Records that left the ring unwritten */
+    unsigned long long oversized; /* Records that did not fit the ring */
+};
+
+/*
+ * Parses trigger expression. Returns 0 if it is not valid, error
+ * describes the problem then.
+ */
+int trigger_parse(struct trigger_expr *expr, const char *text, const char **error);
+
+/*
+ * Sets up trigger with ring holding pre_bytes of records plus one record
+ * of at most max_record bytes. Returns 0 if ring could not be allocated.
+ */
+int trigger_init(struct trigger *t, const struct trigger_expr *expr,
+                 size_t pre_bytes, size_t max_record,
+                 unsigned long long pre_us, unsigned long long post_us,
+                 int nanosecond, trigger_output output, void *ctx);
+
+void trigger_destroy(struct trigger *t);
+
+/* Follows length bytes of records, calls output with records to write */
+void trigger_feed(struct trigger *t, const unsigned char *data, size_t length);
+
+#endif /* USBPCAP_CMD_TRIGGER_H */
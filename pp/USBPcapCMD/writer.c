@@ -0,0 +1,1404 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "USBPcap.h"
+#include "thread.h"
+#include "writer.h"
+#include "pcapng.h"
+#include "compress.h"
+#include "index.h"
+#include "monitor.h"
+#include "trigger.h"
+#include "recfilter.h"
+#include "blockpack.h"
+#include "outname.h"
+
+/* Room for a converted packet in addition to capture buffer length */
+#define MAX_PACKET_GROWTH 1024
+
+/* How long to wait for parent process to make room in shared memory
+ * before checking that it is still there.
+ */
+#define RING_WAIT_MS 100
+
+/* Unbuffered output is written in blocks of this size */
+#define DIRECT_BLOCK_SIZE (1024*1024)
+
+/* Monitor mode prints traffic summary this often */
+#define MONITOR_REPORT_MS 1000
+#define MONITOR_ROWS      20
+
+struct pending_write
+{
+    OVERLAPPED overlapped;
+    struct bufpool_buffer *buffer; /* Released once written, can be NULL */
+    DWORD bytes;
+    unsigned char *pcapng_data; /* Converted data buffer, NULL if not converting */
+    struct compress_frame *frame; /* Released once written, can be NULL */
+    struct bufpool_buffer *block; /* Packed block, released once written, can be NULL */
+};
+
+struct writer
+{
+    struct thread_data *data;
+    struct pending_write writes[MAX_PENDING_WRITES];
+    DWORD depth;  /* Number of writes allowed in flight */
+    DWORD oldest; /* Index of oldest pending write */
+    DWORD count;  /* Number of pending writes */
+
+    /* Writes to a file we have created go to explicit offsets so there
+     * can be more than one in flight. Anything else (pipes, standard
+     * output) is written one by one to the end like before.
+     */
+    BOOL explicit_offset;
+    ULONGLONG offset;
+
+    BOOL failed;         /* TRUE if output cannot be written anymore */
+    BOOL flushable;      /* FALSE if FlushFileBuffers() is pointless */
+    ULONGLONG unflushed; /* Bytes written since last flush */
+    DWORD last_flush;    /* GetTickCount() at last flush */
+
+    /* Output file rotation. Files (and compressed frames) are only
+     * switched between packets, so pcap record headers are followed
+     * through the data.
+     */
+    BOOL rotate;
+    UINT32 file_index;   /* Index of current output file */
+    DWORD file_start;    /* GetTickCount() when current file was created */
+    DWORD record_left;   /* Bytes until next record header */
+    unsigned char record_hdr[sizeof(pcaprec_hdr_t)];
+    DWORD record_hdr_fill;
+
+    BOOL nanosecond; /* TRUE if record timestamps are in nanoseconds */
+
+    BOOL pcapng; /* TRUE if captured data is converted to pcapng */
+    struct pcapng_converter converter;
+
+    BOOL compress; /* TRUE if output is compressed */
+    struct compress compressor;
+
+    BOOL index; /* TRUE if sidecar index is written */
+    HANDLE index_handle;
+    struct index_writer indexer;
+
+    BOOL monitor; /* TRUE if traffic is summarized instead of written */
+    struct monitor traffic;
+    DWORD last_report; /* GetTickCount() at last traffic summary */
+
+    BOOL trigger; /* TRUE if only records around trigger are written */
+    struct trigger window;
+
+    BOOL filter; /* TRUE if only records matching filter are written */
+    struct recfilter filter_expr;
+    struct recfilter_stream filter_stream;
+
+    /* Output file is opened without file system cache and only written
+     * in aligned blocks. offset is still the length of data written.
+     */
+    BOOL direct;
+    struct blockpack packer;
+};
+
+/* Returns newly allocated name of output file with given index */
+static char *output_file_name(struct thread_data *data, UINT32 index)
+{
+    return outname_rotated(data->filename, index,
+                           (data->rotate_size > 0) || (data->rotate_seconds > 0));
+}
+
+/* Returns newly allocated name of index file for output file */
+static char *index_file_name(struct thread_data *data, UINT32 index)
+{
+    char *output = output_file_name(data, index);
+    char *name = NULL;
+    size_t len;
+
+    if (output != NULL)
+    {
+        len = strlen(output) + sizeof(".idx");
+        name = malloc(len);
+        if (name != NULL)
+        {
+            sprintf_s(name, len, "%s.idx", output);
+        }
+        free(output);
+    }
+    return name;
+}
+
+static HANDLE open_output_file(struct thread_data *data, UINT32 index)
+{
+    DWORD flags = FILE_ATTRIBUTE_NORMAL|FILE_FLAG_OVERLAPPED;
+    HANDLE handle;
+    char *name;
+
+    name = output_file_name(data, index);
+    if (name == NULL)
+    {
+        fprintf(stderr, "Failed to allocate output file name\n");
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if (data->direct_io)
+    {
+        /* Only aligned writes of whole sectors, see write_direct() */
+        flags |= FILE_FLAG_NO_BUFFERING|FILE_FLAG_WRITE_THROUGH;
+    }
+
+    handle = CreateFileA(name,
+                         GENERIC_WRITE,
+                         0,
+                         NULL,
+                         CREATE_NEW,
+                         flags,
+                         NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Failed to create %s - %d\n", name, GetLastError());
+    }
+    else if (data->rotate_size > 0)
+    {
+        /* Extend the file to its expected size up front so the file system
+         * does not have to grow it (and fragment it) while capturing. It is
+         * truncated to the written size when done.
+         */
+        LARGE_INTEGER size;
+
+        size.QuadPart = (LONGLONG)data->rotate_size * 1000000;
+        if (SetFilePointerEx(handle, size, NULL, FILE_BEGIN))
+        {
+            SetEndOfFile(handle);
+        }
+    }
+
+    free(name);
+    return handle;
+}
+
+HANDLE create_output_file(struct thread_data *data)
+{
+    return open_output_file(data, 0);
+}
+
+static void stop_capture(struct writer *w)
+{
+    w->failed = TRUE;
+    w->data->process = FALSE;
+    if (w->data->exit_event != INVALID_HANDLE_VALUE)
+    {
+        SetEvent(w->data->exit_event);
+    }
+}
+
+/* Waits for the oldest pending write, does nothing if none is pending */
+static void complete_oldest_write(struct writer *w)
+{
+    struct pending_write *write = &w->writes[w->oldest];
+    DWORD written;
+
+    if (w->count == 0)
+    {
+        return;
+    }
+
+    if (!GetOverlappedResult(w->data->write_handle, &write->overlapped, &written, TRUE))
+    {
+        fprintf(stderr, "GetOverlappedResult() on write handle failed: %d\n", GetLastError());
+        stop_capture(w);
+    }
+    else if (written != write->bytes)
+    {
+        fprintf(stderr, "Wrote %d bytes instead of %d. Stopping capture.\n", written, write->bytes);
+        stop_capture(w);
+    }
+    ResetEvent(write->overlapped.hEvent);
+
+    if (write->buffer != NULL)
+    {
+        bufpool_release(&w->data->pool, write->buffer);
+        write->buffer = NULL;
+    }
+    if (write->frame != NULL)
+    {
+        compress_release(&w->compressor, write->frame);
+        write->frame = NULL;
+    }
+    if (write->block != NULL)
+    {
+        blockpack_release(&w->packer, write->block);
+        write->block = NULL;
+    }
+
+    w->oldest = (w->oldest + 1) % MAX_PENDING_WRITES;
+    w->count--;
+}
+
+static void complete_all_writes(struct writer *w)
+{
+    while (w->count > 0)
+    {
+        complete_oldest_write(w);
+    }
+}
+
+/* Returns entry for next write, waits for the oldest write if needed */
+static struct pending_write *next_write(struct writer *w)
+{
+    if (w->count == w->depth)
+    {
+        complete_oldest_write(w);
+    }
+
+    return &w->writes[(w->oldest + w->count) % MAX_PENDING_WRITES];
+}
+
+/* Copies data to shared memory read by parent process */
+static void write_ring(struct writer *w, const unsigned char *ptr, DWORD bytes)
+{
+    struct shmring *ring = w->data->output_ring;
+    DWORD written;
+
+    w->offset += bytes;
+    w->unflushed += bytes;
+    while (bytes > 0)
+    {
+        written = shmring_write(ring, ptr, bytes, RING_WAIT_MS);
+        if (written == 0)
+        {
+            /* Parent process may be gone without closing the ring */
+            if (shmring_reader_closed(ring) ||
+                !PeekNamedPipe(w->data->write_handle, NULL, 0, NULL, NULL, NULL))
+            {
+                fprintf(stderr, "Parent process stopped reading. Stopping capture.\n");
+                stop_capture(w);
+                return;
+            }
+            continue;
+        }
+        ptr += written;
+        bytes -= written;
+    }
+}
+
+/* Writes aligned block at offset. block is released once written,
+ * it is NULL for the partially filled block that stays in packer.
+ */
+static void write_block(struct writer *w, const unsigned char *data, DWORD bytes,
+                        ULONGLONG offset, struct bufpool_buffer *block)
+{
+    struct pending_write *write = next_write(w);
+
+    write->block = block;
+    write->bytes = bytes;
+    write->overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+    write->overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+    if (!WriteFile(w->data->write_handle, data, bytes, NULL, &write->overlapped))
+    {
+        DWORD err = GetLastError();
+        if (err != ERROR_IO_PENDING)
+        {
+            fprintf(stderr, "Write failed (%d). Stopping capture.\n", err);
+            stop_capture(w);
+            if (block != NULL)
+            {
+                blockpack_release(&w->packer, block);
+                write->block = NULL;
+            }
+            return;
+        }
+    }
+
+    w->count++;
+}
+
+/* Copies data into aligned blocks, writing every block that fills up */
+static void write_direct(struct writer *w, const unsigned char *data, DWORD bytes)
+{
+    struct bufpool_buffer *block;
+    ULONGLONG offset;
+    size_t n;
+
+    w->offset += bytes;
+    w->unflushed += bytes;
+    while ((bytes > 0) && (w->failed == FALSE))
+    {
+        n = blockpack_put(&w->packer, data, bytes);
+        data += n;
+        bytes -= (DWORD)n;
+
+        block = blockpack_take(&w->packer, &offset);
+        if (block != NULL)
+        {
+            write_block(w, block->data, block->length, offset, block);
+        }
+        else if (n == 0)
+        {
+            /* Every other block is still being written */
+            complete_oldest_write(w);
+        }
+    }
+}
+
+/* Writes partially filled block padded to whole sectors. It is written
+ * again, with more data, once filled up.
+ */
+static void write_tail(struct writer *w)
+{
+    struct bufpool_buffer *block;
+    ULONGLONG offset;
+    size_t length;
+
+    block = blockpack_tail(&w->packer, &offset, &length);
+    if ((block != NULL) && (w->failed == FALSE))
+    {
+        write_block(w, block->data, (DWORD)length, offset, NULL);
+    }
+
+    /* Tail block must not change until written */
+    complete_all_writes(w);
+}
+
+/* buffer is released once the write completes */
+static void write_data(struct writer *w, void *data, DWORD bytes,
+                       struct bufpool_buffer *buffer)
+{
+    struct pending_write *write;
+
+    if (w->failed)
+    {
+        /* Drop the data, output is broken */
+        if (buffer != NULL)
+        {
+            bufpool_release(&w->data->pool, buffer);
+        }
+        return;
+    }
+
+    if (w->data->output_ring != NULL)
+    {
+        /* Data is copied by the time this returns */
+        write_ring(w, (const unsigned char *)data, bytes);
+        if (buffer != NULL)
+        {
+            bufpool_release(&w->data->pool, buffer);
+        }
+        return;
+    }
+
+    if (w->direct)
+    {
+        /* Data is copied by the time this returns */
+        write_direct(w, (const unsigned char *)data, bytes);
+        if (buffer != NULL)
+        {
+            bufpool_release(&w->data->pool, buffer);
+        }
+        return;
+    }
+
+    write = next_write(w);
+    write->buffer = buffer;
+    write->bytes = bytes;
+    if (w->explicit_offset)
+    {
+        write->overlapped.Offset = (DWORD)(w->offset & 0xFFFFFFFF);
+        write->overlapped.OffsetHigh = (DWORD)(w->offset >> 32);
+    }
+    else
+    {
+        /* Write data to the end of the file. */
+        write->overlapped.Offset = 0xFFFFFFFF;
+        write->overlapped.OffsetHigh = 0xFFFFFFFF;
+    }
+
+    if (!WriteFile(w->data->write_handle, data, bytes, NULL, &write->overlapped))
+    {
+        DWORD err = GetLastError();
+        if (err != ERROR_IO_PENDING)
+        {
+            /* Failed to write to output. Quit. */
+            fprintf(stderr, "Write failed (%d). Stopping capture.\n", err);
+            stop_capture(w);
+            if (buffer != NULL)
+            {
+                bufpool_release(&w->data->pool, buffer);
+                write->buffer = NULL;
+            }
+            return;
+        }
+    }
+
+    w->count++;
+    w->offset += bytes;
+    w->unflushed += bytes;
+}
+
+static int write_index(void *ctx, const void *data, size_t length)
+{
+    struct writer *w = (struct writer *)ctx;
+    DWORD written;
+
+    if (!WriteFile(w->index_handle, data, (DWORD)length, &written, NULL) ||
+        (written != length))
+    {
+        fprintf(stderr, "Index write failed (%d). Index is incomplete.\n",
+                GetLastError());
+        return 0;
+    }
+    return 1;
+}
+
+static void open_index(struct writer *w)
+{
+    char *name;
+
+    name = index_file_name(w->data, w->file_index);
+    if (name == NULL)
+    {
+        fprintf(stderr, "Failed to allocate index file name\n");
+        return;
+    }
+
+    /* Others can read the index while it grows */
+    w->index_handle = CreateFileA(name,
+                                  GENERIC_WRITE,
+                                  FILE_SHARE_READ,
+                                  NULL,
+                                  CREATE_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL,
+                                  NULL);
+    if (w->index_handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Failed to create %s - %d\n", name, GetLastError());
+    }
+    free(name);
+}
+
+static void close_index(struct writer *w)
+{
+    if (w->index_handle != INVALID_HANDLE_VALUE)
+    {
+        index_flush(&w->indexer);
+        CloseHandle(w->index_handle);
+        w->index_handle = INVALID_HANDLE_VALUE;
+    }
+}
+
+static void flush_output(struct writer *w, BOOL force)
+{
+    struct thread_data *data = w->data;
+    DWORD now;
+
+    if ((w->flushable == FALSE) || (w->unflushed == 0))
+    {
+        return;
+    }
+
+    now = GetTickCount();
+    if ((force == FALSE) &&
+        ((data->flush_size == 0) || (w->unflushed < (ULONGLONG)data->flush_size * 1024 * 1024)) &&
+        ((data->flush_interval == 0) || (now - w->last_flush < data->flush_interval)))
+    {
+        return;
+    }
+
+    /* FlushFileBuffers() only covers writes that have already completed */
+    if (w->direct)
+    {
+        write_tail(w);
+    }
+    complete_all_writes(w);
+    FlushFileBuffers(data->write_handle);
+    w->unflushed = 0;
+    w->last_flush = now;
+
+    /* Index is written up to data that is on disk */
+    if (w->index_handle != INVALID_HANDLE_VALUE)
+    {
+        index_flush(&w->indexer);
+    }
+}
+
+/* Cuts off space preallocated by open_output_file() and padding of the
+ * last block written without file system cache.
+ */
+static void truncate_output(struct writer *w)
+{
+    LARGE_INTEGER size;
+
+    if (w->data->write_handle == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    if (w->direct)
+    {
+        /* Tail is usually written by flush_output() already */
+        if (w->unflushed > 0)
+        {
+            write_tail(w);
+        }
+    }
+    else if ((w->rotate == FALSE) || (w->data->rotate_size == 0))
+    {
+        return;
+    }
+
+    complete_all_writes(w);
+    size.QuadPart = (LONGLONG)w->offset;
+    if (SetFilePointerEx(w->data->write_handle, size, NULL, FILE_BEGIN))
+    {
+        SetEndOfFile(w->data->write_handle);
+    }
+}
+
+/* Writes compressed frames in order, returns FALSE if there was none */
+static BOOL write_frames(struct writer *w, BOOL wait)
+{
+    struct compress_frame *frame;
+    struct pending_write *write;
+    BOOL written = FALSE;
+
+    while ((frame = compress_output(&w->compressor, wait)) != NULL)
+    {
+        write = next_write(w);
+        write_data(w, frame->out, frame->out_len, NULL);
+        if (w->failed || w->direct || (w->data->output_ring != NULL))
+        {
+            compress_release(&w->compressor, frame);
+        }
+        else
+        {
+            write->frame = frame;
+        }
+        written = TRUE;
+        wait = FALSE;
+    }
+
+    return written;
+}
+
+/* Returns space in compressed frame being filled */
+static unsigned char *frame_space(struct writer *w, unsigned int *size)
+{
+    unsigned char *space;
+
+    while ((space = compress_space(&w->compressor, size)) == NULL)
+    {
+        /* Oldest frame is either still compressed or being written */
+        if (!write_frames(w, TRUE))
+        {
+            complete_oldest_write(w);
+        }
+    }
+
+    return space;
+}
+
+/* Writes data to output, compressing it if enabled */
+static void output_data(struct writer *w, unsigned char *ptr, DWORD bytes,
+                        struct bufpool_buffer *buffer)
+{
+    unsigned char *space;
+    unsigned int size;
+
+    if (w->index)
+    {
+        index_feed(&w->indexer, ptr, bytes);
+    }
+
+    if (w->compress == FALSE)
+    {
+        write_data(w, ptr, bytes, buffer);
+        return;
+    }
+
+    while ((bytes > 0) && (w->failed == FALSE))
+    {
+        space = frame_space(w, &size);
+        if (size > bytes)
+        {
+            size = bytes;
+        }
+        memcpy(space, ptr, size);
+        compress_commit(&w->compressor, size);
+        ptr += size;
+        bytes -= size;
+    }
+    write_frames(w, FALSE);
+
+    if (buffer != NULL)
+    {
+        bufpool_release(&w->data->pool, buffer);
+    }
+}
+
+/* Writes remaining compressed frames and seek table, ending the file */
+static void finish_compressed(struct writer *w)
+{
+    unsigned char *table;
+    unsigned int length;
+
+    if (w->compress == FALSE)
+    {
+        return;
+    }
+
+    compress_close(&w->compressor);
+    while (write_frames(w, TRUE))
+    {
+    }
+
+    table = compress_seek_table(&w->compressor, &length);
+    write_data(w, table, length, NULL);
+
+    /* Frames and table must not change until written */
+    complete_all_writes(w);
+    compress_reset(&w->compressor);
+}
+
+/* Writes pcap records, converted to pcapng if enabled */
+static void write_packets(struct writer *w, unsigned char *ptr, DWORD bytes,
+                          struct bufpool_buffer *buffer)
+{
+    struct pending_write *write;
+    unsigned char *out;
+    unsigned int size;
+    size_t consumed;
+    size_t converted;
+
+    if (w->pcapng == FALSE)
+    {
+        output_data(w, ptr, bytes, buffer);
+        return;
+    }
+
+    /* Data is converted directly into compressed frame or into buffer
+     * owned by the write that takes it.
+     */
+    while ((bytes > 0) && (w->failed == FALSE))
+    {
+        if (w->compress)
+        {
+            out = frame_space(w, &size);
+        }
+        else
+        {
+            write = next_write(w);
+            out = write->pcapng_data;
+            size = w->data->bufferlen;
+        }
+
+        converted = pcapng_convert(&w->converter, ptr, bytes, &consumed,
+                                   out, size);
+        ptr += consumed;
+        bytes -= (DWORD)consumed;
+
+        if (w->index && (converted > 0))
+        {
+            index_feed(&w->indexer, out, converted);
+        }
+
+        if (w->compress)
+        {
+            if ((converted == 0) && (consumed == 0))
+            {
+                /* Block does not fit, continue in next frame */
+                compress_cut(&w->compressor,
+                             !pcapng_at_boundary(&w->converter));
+            }
+            else
+            {
+                compress_commit(&w->compressor, (unsigned int)converted);
+            }
+        }
+        else if (converted > 0)
+        {
+            write_data(w, out, (DWORD)converted, NULL);
+        }
+    }
+
+    if (w->compress)
+    {
+        write_frames(w, FALSE);
+    }
+
+    if (buffer != NULL)
+    {
+        bufpool_release(&w->data->pool, buffer);
+    }
+}
+
+static void write_file_header(struct writer *w)
+{
+    struct thread_data *data = w->data;
+    pcap_hdr_t *hdr = (pcap_hdr_t *)data->descriptors.buf;
+    struct pending_write *write;
+    size_t length;
+
+    if (w->pcapng)
+    {
+        DWORD i;
+
+        write = next_write(w);
+        length = pcapng_write_header(data->descriptors.buf, "USBPcapCMD",
+                                     data->devices[0], write->pcapng_data,
+                                     data->bufferlen);
+        /* Merged capture has one interface per root hub */
+        for (i = 1; i < w->converter.bus_count; i++)
+        {
+            length += pcapng_write_interface(data->descriptors.buf,
+                                             data->devices[i],
+                                             &write->pcapng_data[length],
+                                             data->bufferlen - length);
+        }
+        output_data(w, write->pcapng_data, (DWORD)length, NULL);
+    }
+    else
+    {
+        output_data(w, data->descriptors.buf, sizeof(pcap_hdr_t), NULL);
+    }
+
+    if (w->compress)
+    {
+        compress_mark_header(&w->compressor);
+    }
+
+    if ((hdr->magic_number == 0xA1B2C3D4) && (hdr->network == DLT_USBPCAP) && (data->descriptors.descriptors_len > 0))
+    {
+        w->converter.comment = "Descriptors of devices connected when capture started";
+        write_packets(w, data->descriptors.descriptors, data->descriptors.descriptors_len, NULL);
+        w->converter.comment = NULL;
+    }
+}
+
+static void write_statistics(struct writer *w)
+{
+    struct thread_data *data = w->data;
+    struct pending_write *write;
+    size_t length;
+    DWORD i;
+
+    if ((w->pcapng == FALSE) || (w->failed) ||
+        !pcapng_at_boundary(&w->converter))
+    {
+        return;
+    }
+
+    write = next_write(w);
+    if (w->converter.bus_count == 0)
+    {
+        length = pcapng_write_statistics(&w->converter,
+                                         data->have_statistics,
+                                         data->statistics.packets,
+                                         data->statistics.dropped,
+                                         write->pcapng_data, data->bufferlen);
+    }
+    else
+    {
+        /* Counters of every root hub go to its own interface */
+        length = 0;
+        for (i = 0; i < w->converter.bus_count; i++)
+        {
+            w->converter.interface_id = i;
+            length += pcapng_write_statistics(&w->converter,
+                                              data->have_statistics,
+                                              data->device_statistics[i].packets,
+                                              data->device_statistics[i].dropped,
+                                              &write->pcapng_data[length],
+                                              data->bufferlen - length);
+        }
+        w->converter.interface_id = 0;
+    }
+    output_data(w, write->pcapng_data, (DWORD)length, NULL);
+}
+
+/* pending is number of bytes that are about to be written to current file */
+static BOOL rotation_due(struct writer *w, DWORD pending)
+{
+    struct thread_data *data = w->data;
+    ULONGLONG size = w->offset + pending;
+
+    if (w->compress)
+    {
+        /* Count data waiting for compression as it is */
+        size += compress_buffered(&w->compressor);
+    }
+
+    if ((data->rotate_size > 0) &&
+        (size >= (ULONGLONG)data->rotate_size * 1000000))
+    {
+        return TRUE;
+    }
+
+    if ((data->rotate_seconds > 0) &&
+        (GetTickCount() - w->file_start >= (ULONGLONG)data->rotate_seconds * 1000))
+    {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void rotate_output(struct writer *w)
+{
+    struct thread_data *data = w->data;
+
+    finish_compressed(w);
+    flush_output(w, TRUE);
+    truncate_output(w);
+    CloseHandle(data->write_handle);
+    close_index(w);
+
+    w->file_index++;
+    data->write_handle = open_output_file(data, w->file_index);
+    if (data->write_handle == INVALID_HANDLE_VALUE)
+    {
+        stop_capture(w);
+        return;
+    }
+
+    if ((data->rotate_files > 0) && (w->file_index >= data->rotate_files))
+    {
+        /* Keep at most rotate_files files */
+        char *name = output_file_name(data, w->file_index - data->rotate_files);
+        if (name != NULL)
+        {
+            DeleteFileA(name);
+            free(name);
+        }
+
+        name = index_file_name(data, w->file_index - data->rotate_files);
+        if (w->index && (name != NULL))
+        {
+            DeleteFileA(name);
+        }
+        free(name);
+    }
+
+    if (w->index)
+    {
+        index_restart(&w->indexer);
+        open_index(w);
+    }
+
+    w->offset = 0;
+    w->unflushed = 0;
+    w->file_start = GetTickCount();
+    if (w->direct)
+    {
+        blockpack_reset(&w->packer);
+    }
+    write_file_header(w);
+}
+
+static ULONGLONG record_timestamp(struct writer *w)
+{
+    pcaprec_hdr_t *hdr = (pcaprec_hdr_t *)w->record_hdr;
+    ULONGLONG ts = (ULONGLONG)hdr->ts_sec * 1000000000;
+
+    return ts + (w->nanosecond ? hdr->ts_usec : (ULONGLONG)hdr->ts_usec * 1000);
+}
+
+/* Writes captured data, switching to next file or compressed frame
+ * between packets if needed.
+ */
+static void write_records(struct writer *w, unsigned char *ptr, DWORD bytes,
+                          struct bufpool_buffer *buffer)
+{
+    unsigned char *chunk = ptr; /* Data not yet passed to write_packets() */
+    DWORD records = 0; /* Records started in chunk */
+    DWORD pending;
+    DWORD pos = 0;
+    DWORD n;
+
+    while (pos < bytes)
+    {
+        if (w->record_left > 0)
+        {
+            /* Skip record data */
+            n = bytes - pos;
+            if (n > w->record_left)
+            {
+                n = w->record_left;
+            }
+            w->record_left -= n;
+            pos += n;
+            continue;
+        }
+
+        if ((w->record_hdr_fill == 0) && (w->failed == FALSE))
+        {
+            /* Converted records take more space than the captured ones */
+            pending = (DWORD)(&ptr[pos] - chunk);
+            if (w->pcapng)
+            {
+                pending += records * PCAPNG_RECORD_GROWTH;
+            }
+
+            if (w->rotate && rotation_due(w, pending))
+            {
+                if (&ptr[pos] != chunk)
+                {
+                    write_packets(w, chunk, (DWORD)(&ptr[pos] - chunk), NULL);
+                }
+                rotate_output(w);
+                chunk = &ptr[pos];
+                records = 0;
+            }
+            else if (w->compress && compress_frame_due(&w->compressor, pending))
+            {
+                if (&ptr[pos] != chunk)
+                {
+                    write_packets(w, chunk, (DWORD)(&ptr[pos] - chunk), NULL);
+                }
+                compress_close(&w->compressor);
+                chunk = &ptr[pos];
+                records = 0;
+            }
+
+            records++;
+        }
+
+        /* Record header, can be split between buffers */
+        n = sizeof(pcaprec_hdr_t) - w->record_hdr_fill;
+        if (n > bytes - pos)
+        {
+            n = bytes - pos;
+        }
+        memcpy(&w->record_hdr[w->record_hdr_fill], &ptr[pos], n);
+        w->record_hdr_fill += n;
+        pos += n;
+        if (w->record_hdr_fill == sizeof(pcaprec_hdr_t))
+        {
+            w->record_left = ((pcaprec_hdr_t *)w->record_hdr)->incl_len;
+            w->record_hdr_fill = 0;
+            if (w->compress)
+            {
+                compress_packet(&w->compressor, record_timestamp(w));
+            }
+        }
+    }
+
+    if (&ptr[bytes] != chunk)
+    {
+        write_packets(w, chunk, (DWORD)(&ptr[bytes] - chunk), buffer);
+    }
+    else if (buffer != NULL)
+    {
+        bufpool_release(&w->data->pool, buffer);
+    }
+}
+
+/* Writes records passed by trigger, their ring space is reused afterwards */
+static void write_triggered(void *ctx, const unsigned char *data, size_t length)
+{
+    struct writer *w = (struct writer *)ctx;
+
+    if (w->rotate || w->compress)
+    {
+        write_records(w, (unsigned char *)data, (DWORD)length, NULL);
+    }
+    else
+    {
+        write_packets(w, (unsigned char *)data, (DWORD)length, NULL);
+    }
+    complete_all_writes(w);
+}
+
+static void start_filter(struct writer *w, BOOL pcap)
+{
+    struct thread_data *data = w->data;
+    const char *error;
+    size_t error_pos;
+
+    if (!pcap)
+    {
+        fprintf(stderr, "Filter needs pcap data, writing everything\n");
+        return;
+    }
+
+    if (!recfilter_compile(&w->filter_expr, data->record_filter, &error, &error_pos))
+    {
+        /* Checked when parsing command line */
+        fprintf(stderr, "Invalid filter: %s\n", error);
+        stop_capture(w);
+        return;
+    }
+
+    w->filter = recfilter_stream_init(&w->filter_stream, &w->filter_expr,
+                                      sizeof(pcaprec_hdr_t) + data->bufferlen);
+    if (w->filter == FALSE)
+    {
+        fprintf(stderr, "Failed to allocate filter buffer\n");
+        stop_capture(w);
+    }
+}
+
+static void start_trigger(struct writer *w, BOOL pcap)
+{
+    struct thread_data *data = w->data;
+    struct trigger_expr expr;
+    const char *error;
+
+    if (!pcap)
+    {
+        fprintf(stderr, "Trigger needs pcap data, writing everything\n");
+        return;
+    }
+
+    if (!trigger_parse(&expr, data->trigger, &error))
+    {
+        /* Checked when parsing command line */
+        fprintf(stderr, "Invalid trigger: %s\n", error);
+        stop_capture(w);
+        return;
+    }
+
+    w->trigger = trigger_init(&w->window, &expr,
+                              (size_t)data->trigger_buffer * 1024 * 1024,
+                              data->bufferlen,
+                              (unsigned long long)data->trigger_before * 1000000,
+                              (unsigned long long)data->trigger_after * 1000000,
+                              w->nanosecond, write_triggered, w);
+    if (w->trigger == FALSE)
+    {
+        fprintf(stderr, "Failed to allocate trigger buffer\n");
+        trigger_destroy(&w->window);
+        stop_capture(w);
+    }
+}
+
+/* Sets up conversion and compression once the pcap header is known */
+static void start_output(struct writer *w)
+{
+    struct thread_data *data = w->data;
+    pcap_hdr_t *hdr = (pcap_hdr_t *)data->descriptors.buf;
+    BOOL pcap;
+
+    /* Anything else, like pcapng from worker process, is passed as is */
+    w->nanosecond = (hdr->magic_number == 0xA1B23C4D);
+    pcap = w->nanosecond || (hdr->magic_number == 0xA1B2C3D4);
+
+    w->pcapng = data->pcapng &&
+                pcapng_init(&w->converter, data->descriptors.buf);
+    if (w->pcapng && (data->device_count > 1))
+    {
+        w->converter.buses = data->buses;
+        w->converter.bus_count = data->device_count;
+    }
+
+    if (data->compress && pcap)
+    {
+        w->compress = compress_init(&w->compressor, data->compress_threads,
+                                    COMPRESS_FRAME_SIZE,
+                                    data->bufferlen + MAX_PACKET_GROWTH);
+        if (w->compress == FALSE)
+        {
+            fprintf(stderr, "Failed to start compression\n");
+            stop_capture(w);
+            return;
+        }
+    }
+
+    if (data->index && !w->explicit_offset)
+    {
+        fprintf(stderr, "Index is only written next to output file\n");
+    }
+    else if (data->index)
+    {
+        w->index = index_init(&w->indexer, write_index, w,
+                              w->compress ? INDEX_FLAG_COMPRESSED : 0);
+        if (w->index == FALSE)
+        {
+            fprintf(stderr, "Failed to allocate index\n");
+        }
+        else
+        {
+            open_index(w);
+        }
+    }
+
+    write_file_header(w);
+
+    if (data->record_filter != NULL)
+    {
+        start_filter(w, pcap);
+    }
+
+    if (data->trigger != NULL)
+    {
+        start_trigger(w, pcap);
+    }
+}
+
+/* Writes records, through trigger if enabled */
+static void write_stream(struct writer *w, unsigned char *ptr, DWORD bytes,
+                         struct bufpool_buffer *buffer)
+{
+    if (w->trigger)
+    {
+        /* Records are copied to trigger ring */
+        trigger_feed(&w->window, ptr, bytes);
+        if (buffer != NULL)
+        {
+            bufpool_release(&w->data->pool, buffer);
+        }
+    }
+    else if (w->rotate || w->compress)
+    {
+        write_records(w, ptr, bytes, buffer);
+    }
+    else
+    {
+        write_packets(w, ptr, bytes, buffer);
+    }
+}
+
+static void process_data(struct writer *w, struct bufpool_buffer *buffer)
+{
+    struct thread_data *data = w->data;
+    unsigned char *ptr = buffer->data;
+    DWORD bytes = buffer->length;
+
+    if (w->monitor)
+    {
+        monitor_feed(&w->traffic, ptr, bytes);
+        bufpool_release(&data->pool, buffer);
+        return;
+    }
+
+    if (data->descriptors.buf_written < sizeof(pcap_hdr_t))
+    {
+        DWORD to_write = sizeof(pcap_hdr_t) - data->descriptors.buf_written;
+        if (to_write > bytes)
+        {
+            to_write = bytes;
+        }
+        memcpy(&data->descriptors.buf[data->descriptors.buf_written], ptr, to_write);
+        data->descriptors.buf_written += to_write;
+
+        if (data->descriptors.buf_written == sizeof(pcap_hdr_t))
+        {
+            start_output(w);
+        }
+        ptr += to_write;
+        bytes -= to_write;
+
+        if (bytes == 0)
+        {
+            /* Nothing more to write */
+            bufpool_release(&data->pool, buffer);
+            return;
+        }
+    }
+
+    if (w->filter)
+    {
+        const unsigned char *carry;
+        size_t carry_len;
+
+        /* Matching records are moved to the start of buffer */
+        bytes = (DWORD)recfilter_stream_feed(&w->filter_stream, ptr, bytes,
+                                             &carry, &carry_len);
+        if (carry_len > 0)
+        {
+            write_stream(w, (unsigned char *)carry, (DWORD)carry_len, NULL);
+            if (w->trigger == FALSE)
+            {
+                /* Carried record is overwritten by next call */
+                complete_all_writes(w);
+            }
+        }
+
+        if (bytes == 0)
+        {
+            bufpool_release(&data->pool, buffer);
+            return;
+        }
+    }
+
+    write_stream(w, ptr, bytes, buffer);
+}
+
+/* Prints traffic summary if it is due, or anyway if force is TRUE */
+static void report_traffic(struct writer *w, BOOL force)
+{
+    DWORD now = GetTickCount();
+    DWORD elapsed = now - w->last_report;
+
+    if ((force == FALSE) && (elapsed < MONITOR_REPORT_MS))
+    {
+        return;
+    }
+
+    if (w->traffic.failed)
+    {
+        if (w->failed == FALSE)
+        {
+            fprintf(stderr, "Captured data is not pcap, nothing to summarize\n");
+            stop_capture(w);
+        }
+        return;
+    }
+
+    monitor_report(&w->traffic, stdout, (ULONGLONG)elapsed * 1000, MONITOR_ROWS);
+    w->last_report = now;
+}
+
+DWORD WINAPI write_thread(LPVOID param)
+{
+    struct thread_data *data = (struct thread_data*)param;
+    struct bufpool_buffer *buffer;
+    struct writer w;
+    int timeout;
+    DWORD i;
+
+    memset(&w, 0, sizeof(w));
+    w.data = data;
+    w.flushable = (GetFileType(data->write_handle) == FILE_TYPE_DISK);
+    w.explicit_offset = w.flushable && (strncmp("-", data->filename, 2) != 0);
+    w.depth = w.explicit_offset ? MAX_PENDING_WRITES : 1;
+    w.last_flush = GetTickCount();
+    w.rotate = w.explicit_offset &&
+               ((data->rotate_size > 0) || (data->rotate_seconds > 0));
+    w.file_start = w.last_flush;
+    w.index_handle = INVALID_HANDLE_VALUE;
+
+    if (data->direct_io && !w.explicit_offset)
+    {
+        fprintf(stderr, "Direct I/O is only used when writing to a file\n");
+    }
+    else if (data->direct_io)
+    {
+        /* Every pending write holds a block, one more is being filled */
+        w.direct = blockpack_init(&w.packer, MAX_PENDING_WRITES + 1,
+                                  DIRECT_BLOCK_SIZE, BLOCKPACK_ALIGNMENT);
+        if (w.direct == FALSE)
+        {
+            fprintf(stderr, "Failed to allocate direct I/O blocks\n");
+            stop_capture(&w);
+        }
+    }
+
+    if (data->monitor)
+    {
+        w.monitor = monitor_init(&w.traffic);
+        if (w.monitor == FALSE)
+        {
+            fprintf(stderr, "Failed to allocate traffic monitor\n");
+            stop_capture(&w);
+        }
+        w.last_report = w.last_flush;
+    }
+
+    for (i = 0; i < MAX_PENDING_WRITES; i++)
+    {
+        w.writes[i].overlapped.hEvent = CreateEvent(NULL,
+                                                    TRUE /* Manual Reset */,
+                                                    FALSE /* Default non signaled */,
+                                                    NULL /* No name */);
+        if (data->pcapng)
+        {
+            w.writes[i].pcapng_data = malloc(data->bufferlen);
+            if (w.writes[i].pcapng_data == NULL)
+            {
+                fprintf(stderr, "Failed to allocate pcapng buffer (length %d)\n",
+                        data->bufferlen);
+                stop_capture(&w);
+            }
+        }
+    }
+
+    /* Wake up periodically if output has to be flushed on time */
+    timeout = (data->flush_interval != 0) ? (int)data->flush_interval : BUFPOOL_INFINITE;
+    if (w.monitor)
+    {
+        timeout = MONITOR_REPORT_MS;
+    }
+
+    for (;;)
+    {
+        buffer = bufpool_next(&data->pool, timeout);
+        if (buffer != NULL)
+        {
+            process_data(&w, buffer);
+        }
+        else if (bufpool_is_drained(&data->pool))
+        {
+            break;
+        }
+
+        flush_output(&w, FALSE);
+        if (w.monitor)
+        {
+            report_traffic(&w, FALSE);
+        }
+    }
+
+    if (w.monitor)
+    {
+        report_traffic(&w, TRUE);
+    }
+
+    write_statistics(&w);
+    finish_compressed(&w);
+    complete_all_writes(&w);
+    if (data->output_ring != NULL)
+    {
+        /* Parent stops reading once it has got everything */
+        shmring_close(data->output_ring);
+    }
+    flush_output(&w, TRUE);
+    truncate_output(&w);
+    close_index(&w);
+
+    for (i = 0; i < MAX_PENDING_WRITES; i++)
+    {
+        CloseHandle(w.writes[i].overlapped.hEvent);
+        free(w.writes[i].pcapng_data);
+    }
+
+    if (w.compress)
+    {
+        compress_destroy(&w.compressor);
+    }
+
+    if (w.index)
+    {
+        index_destroy(&w.indexer);
+    }
+
+    if (w.direct)
+    {
+        blockpack_destroy(&w.packer);
+    }
+
+    if (data->monitor)
+    {
+        monitor_destroy(&w.traffic);
+    }
+
+    if (w.trigger)
+    {
+        fprintf(stderr, "Trigger fired %llu times, wrote %llu of %llu records\n",
+                w.window.windows, w.window.written, w.window.records);
+        trigger_destroy(&w.window);
+    }
+
+    if (w.filter)
+    {
+        fprintf(stderr, "Filter kept %llu of %llu records\n",
+                w.filter_stream.kept, w.filter_stream.records);
+        recfilter_stream_destroy(&w.filter_stream);
+    }
+
+    return 0;
+}
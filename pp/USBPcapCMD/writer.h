@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_WRITER_H
+#define USBPCAP_CMD_WRITER_H
+
+#include <windows.h>
+#include "thread.h"
+
+/* Maximum number of overlapped writes in flight to output file */
+#define MAX_PENDING_WRITES 4
+
+/*
+ * Creates output file for data->filename. If output rotation is enabled,
+ * this is the first file of the set.
+ */
+HANDLE create_output_file(struct thread_data *data);
+
+/*
+ * Writes buffers submitted to data->pool to data->write_handle until the
+ * pool gets closed and drained. Output is flushed according to
+ * data->flush_size and data->flush_interval and always when done.
+ * When writing to a file, the output is switched to a new file according
+ * to data->rotate_size, data->rotate_seconds and data->rotate_files.
+ *
+ * param is struct thread_data.
+ */
+DWORD WINAPI write_thread(LPVOID param);
+
+#endif /* USBPCAP_CMD_WRITER_H */
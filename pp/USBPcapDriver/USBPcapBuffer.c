@@ -79,6 +79,67 @@ USBPcapGetBufferAllocated(PUSBPCAP_ROOTHUB_DATA pData)
     }
 }
 
+/*
+ * Arms the notification if reader drained the buffer below threshold.
+ * Caller must have acquired buffer spin lock.
+ */
+__inline static VOID
+USBPcapBufferRearmNotification(PUSBPCAP_ROOTHUB_DATA pData)
+{
+    if ((pData->notifyEvent != NULL) &&
+        (USBPcapGetBufferAllocated(pData) < pData->notifyThreshold))
+    {
+        pData->notifyArmed = TRUE;
+    }
+}
+
+/*
+ * Returns referenced notification event if it should be signalled,
+ * NULL otherwise. The event is disarmed, so it is not returned again
+ * until reader drains the buffer.
+ *
+ * Caller must have acquired buffer spin lock. The returned event must
+ * be signalled and dereferenced after releasing the lock.
+ */
+__inline static PKEVENT
+USBPcapBufferCheckNotification(PUSBPCAP_ROOTHUB_DATA pData,
+                               BOOLEAN bufferFull)
+{
+    PKEVENT event = pData->notifyEvent;
+
+    if ((event == NULL) || (pData->notifyArmed == FALSE))
+    {
+        return NULL;
+    }
+
+    /* Signal also when the buffer is full so the reader can make room
+     * even if threshold is larger than what fits in buffer.
+     */
+    if ((bufferFull == FALSE) &&
+        (USBPcapGetBufferAllocated(pData) < pData->notifyThreshold))
+    {
+        return NULL;
+    }
+
+    pData->notifyArmed = FALSE;
+    ObReferenceObject(event);
+    return event;
+}
+
+/*
+ * Signals and dereferences event returned by
+ * USBPcapBufferCheckNotification().
+ */
+__inline static VOID
+USBPcapBufferSignalNotification(PKEVENT event)
+{
+    if (event != NULL)
+    {
+        KeSetEvent(event, IO_NO_INCREMENT, FALSE);
+        ObDereferenceObject(event);
+    }
+}
+
 __inline static void
 USBPcapBufferWriteUnsafe(PUSBPCAP_ROOTHUB_DATA pData,
                          PVOID data,
@@ -274,6 +335,8 @@ NTSTATUS USBPcapSetUpBuffer(PUSBPCAP_ROOTHUB_DATA pData,
         pData->bufferSize = bytes;
         pData->readOffset = 0;
         pData->writeOffset = 0;
+        pData->packetsStored = 0;
+        pData->packetsDropped = 0;
         USBPcapWriteGlobalHeader(pData);
         DkDbgVal("Created new buffer", bytes);
     }
@@ -332,6 +395,55 @@ NTSTATUS USBPcapSetSnaplenSize(PUSBPCAP_ROOTHUB_DATA pData,
     return status;
 }
 
+/*
+ * Replaces the data notification event. On success the function takes
+ * over the event reference. NULL event disables the notification.
+ */
+NTSTATUS USBPcapBufferSetNotification(PUSBPCAP_ROOTHUB_DATA pData,
+                                      PKEVENT event,
+                                      UINT32 threshold)
+{
+    PKEVENT  oldEvent;
+    PKEVENT  signalEvent;
+    KIRQL    irql;
+
+    if ((event != NULL) && (threshold == 0))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    oldEvent = pData->notifyEvent;
+    pData->notifyEvent = event;
+    pData->notifyThreshold = threshold;
+    pData->notifyArmed = (event != NULL) ? TRUE : FALSE;
+    /* There might be enough data already */
+    signalEvent = USBPcapBufferCheckNotification(pData, FALSE);
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+
+    USBPcapBufferSignalNotification(signalEvent);
+
+    if (oldEvent != NULL)
+    {
+        ObDereferenceObject(oldEvent);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS USBPcapBufferGetStatistics(PUSBPCAP_ROOTHUB_DATA pData,
+                                    PUSBPCAP_IOCTL_STATISTICS pStats)
+{
+    KIRQL  irql;
+
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    pStats->packets = pData->packetsStored;
+    pStats->dropped = pData->packetsDropped;
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+
+    return STATUS_SUCCESS;
+}
+
 /*
  * If there is buffer allocated for given control device, frees all
  * memory allocated to it, otherwise does nothing.
@@ -347,6 +459,9 @@ VOID USBPcapBufferRemoveBuffer(PDEVICE_EXTENSION pDevExt)
     pRootExt = (PDEVICE_EXTENSION)pDevExt->context.control.pRootHubObject->DeviceExtension;
     pData = pRootExt->context.usb.pDeviceData->pRootData;
 
+    /* Notification event belongs to the process closing the handle */
+    USBPcapBufferSetNotification(pData, NULL, 0);
+
     if (pData->buffer == NULL)
     {
         return;
@@ -385,10 +500,14 @@ VOID USBPcapBufferInitializeBuffer(PDEVICE_EXTENSION pDevExt)
     KeAcquireSpinLock(&pData->bufferLock, &irql);
     pData->readOffset = 0;
     pData->writeOffset = 0;
+    pData->packetsStored = 0;
+    pData->packetsDropped = 0;
     USBPcapWriteGlobalHeader(pData);
     KeReleaseSpinLock(&pData->bufferLock, irql);
 }
 
+static void USBPcapBufferCompletePendedReadIrps(PUSBPCAP_ROOTHUB_DATA pRootData);
+
 NTSTATUS USBPcapBufferHandleReadIrp(PIRP pIrp,
                                     PDEVICE_EXTENSION pDevExt,
                                     PUINT32 pBytesRead)
@@ -398,6 +517,7 @@ NTSTATUS USBPcapBufferHandleReadIrp(PIRP pIrp,
     PVOID                  buffer;
     UINT32                 bufferLength;
     UINT32                 bytesRead;
+    BOOLEAN                notify;
     NTSTATUS               status;
     KIRQL                  irql;
     PIO_STACK_LOCATION     pStack = NULL;
@@ -438,40 +558,63 @@ NTSTATUS USBPcapBufferHandleReadIrp(PIRP pIrp,
     /* Get data from data queue, if there is no data we put
      * this IRP to Cancel-Safe queue and return status pending
      * otherwise complete this IRP then return SUCCESS
+     *
+     * When notification is enabled the reader waits on the event
+     * instead, so the IRP is completed even if there is no data.
      */
     KeAcquireSpinLock(&pRootData->bufferLock, &irql);
     bytesRead = USBPcapBufferRead(pRootData,
                                   buffer, bufferLength);
+    USBPcapBufferRearmNotification(pRootData);
+    notify = (pRootData->notifyEvent != NULL) ? TRUE : FALSE;
     KeReleaseSpinLock(&pRootData->bufferLock, irql);
 
     *pBytesRead = bytesRead;
-    if (bytesRead == 0)
+    if ((bytesRead == 0) && (notify == FALSE))
     {
         IoCsqInsertIrp(&pDevExt->context.control.ioCsq,
                        pIrp, NULL);
+        /* Packet might have been stored before the IRP got queued */
+        USBPcapBufferCompletePendedReadIrps(pRootData);
         return STATUS_PENDING;
     }
 
     return STATUS_SUCCESS;
 }
 
-static void USBPcapBufferCompletePendedReadIrp(PUSBPCAP_ROOTHUB_DATA pRootData)
+/*
+ * Completes as many pended read IRPs as there is data in the buffer.
+ *
+ * IRPs are filled in the order they were queued with a single buffer
+ * lock acquisition and completed after the lock is released.
+ */
+static void USBPcapBufferCompletePendedReadIrps(PUSBPCAP_ROOTHUB_DATA pRootData)
 {
     PDEVICE_EXTENSION  pControlExt;
     PIRP               pIrp = NULL;
+    LIST_ENTRY         completedIrps;
+    PLIST_ENTRY        entry;
+    KIRQL              irql;
 
     pControlExt = (PDEVICE_EXTENSION)pRootData->controlDevice->DeviceExtension;
 
     ASSERT(pControlExt->deviceMagic == USBPCAP_MAGIC_CONTROL);
 
-    pIrp = IoCsqRemoveNextIrp(&pControlExt->context.control.ioCsq,
-                                  NULL);
-    if (pIrp != NULL)
+    InitializeListHead(&completedIrps);
+
+    KeAcquireSpinLock(&pRootData->bufferLock, &irql);
+    while (USBPcapGetBufferAllocated(pRootData) > 0)
     {
         PVOID   buffer;
-        UINT32  bufferLength;
         UINT32  bytes;
 
+        pIrp = IoCsqRemoveNextIrp(&pControlExt->context.control.ioCsq,
+                                  NULL);
+        if (pIrp == NULL)
+        {
+            break;
+        }
+
         /*
          * Only IRPs with non-zero buffer are being queued.
          *
@@ -492,11 +635,8 @@ static void USBPcapBufferCompletePendedReadIrp(PUSBPCAP_ROOTHUB_DATA pRootData)
 
             if (bufferLength != 0)
             {
-                KIRQL  irql;
-                KeAcquireSpinLock(&pRootData->bufferLock, &irql);
                 bytes = USBPcapBufferRead(pRootData,
                                           buffer, bufferLength);
-                KeReleaseSpinLock(&pRootData->bufferLock, irql);
             }
             else
             {
@@ -507,6 +647,19 @@ static void USBPcapBufferCompletePendedReadIrp(PUSBPCAP_ROOTHUB_DATA pRootData)
         }
 
         pIrp->IoStatus.Information = (ULONG_PTR) bytes;
+
+        /* The IRP is no longer in Cancel-Safe queue, so the list entry
+         * can be used to keep track of it until it gets completed.
+         */
+        InsertTailList(&completedIrps, &pIrp->Tail.Overlay.ListEntry);
+    }
+    USBPcapBufferRearmNotification(pRootData);
+    KeReleaseSpinLock(&pRootData->bufferLock, irql);
+
+    while (!IsListEmpty(&completedIrps))
+    {
+        entry = RemoveHeadList(&completedIrps);
+        pIrp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
         IoCompleteRequest(pIrp, IO_NO_INCREMENT);
     }
 }
@@ -574,11 +727,17 @@ USBPcapBufferStorePacket(PUSBPCAP_ROOTHUB_DATA pRootData,
 
     bytesFree = USBPcapGetBufferFree(pRootData);
 
-    if ((pRootData->buffer == NULL) ||
-        (bytesFree < sizeof(pcaprec_hdr_t)) ||
+    if (pRootData->buffer == NULL)
+    {
+        DkDbgStr("No buffer.");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if ((bytesFree < sizeof(pcaprec_hdr_t)) ||
         ((bytesFree - sizeof(pcaprec_hdr_t)) < bytes))
     {
         DkDbgStr("No enough free space left.");
+        pRootData->packetsDropped++;
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
@@ -610,6 +769,7 @@ USBPcapBufferStorePacket(PUSBPCAP_ROOTHUB_DATA pRootData,
         bytes -= tmp;
     }
 
+    pRootData->packetsStored++;
     return STATUS_SUCCESS;
 }
 
@@ -620,14 +780,19 @@ NTSTATUS USBPcapBufferWriteTimestampedPayload(PUSBPCAP_ROOTHUB_DATA pRootData,
 {
     KIRQL                  irql;
     NTSTATUS               status;
+    PKEVENT                event;
 
     KeAcquireSpinLock(&pRootData->bufferLock, &irql);
     status = USBPcapBufferStorePacket(pRootData, timestamp, header, payload);
+    event = USBPcapBufferCheckNotification(pRootData,
+        (status == STATUS_INSUFFICIENT_RESOURCES) ? TRUE : FALSE);
     KeReleaseSpinLock(&pRootData->bufferLock, irql);
 
+    USBPcapBufferSignalNotification(event);
+
     if (NT_SUCCESS(status))
     {
-        USBPcapBufferCompletePendedReadIrp(pRootData);
+        USBPcapBufferCompletePendedReadIrps(pRootData);
     }
 
     return status;
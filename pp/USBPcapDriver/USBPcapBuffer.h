@@ -19,6 +19,11 @@ NTSTATUS USBPcapSetUpBuffer(PUSBPCAP_ROOTHUB_DATA pData,
                             UINT32 bytes);
 NTSTATUS USBPcapSetSnaplenSize(PUSBPCAP_ROOTHUB_DATA pData,
                                UINT32 bytes);
+NTSTATUS USBPcapBufferSetNotification(PUSBPCAP_ROOTHUB_DATA pData,
+                                      PKEVENT event,
+                                      UINT32 threshold);
+NTSTATUS USBPcapBufferGetStatistics(PUSBPCAP_ROOTHUB_DATA pData,
+                                    PUSBPCAP_IOCTL_STATISTICS pStats);
 
 VOID USBPcapBufferRemoveBuffer(PDEVICE_EXTENSION pDevExt);
 VOID USBPcapBufferInitializeBuffer(PDEVICE_EXTENSION pDevExt);
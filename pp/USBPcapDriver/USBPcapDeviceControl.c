@@ -5,7 +5,7 @@
  */
 
 #include "USBPcapMain.h"
-#include "include\USBPcap.h"
+#include "include/USBPcap.h"
 #include "USBPcapURB.h"
 #include "USBPcapRootHubControl.h"
 #include "USBPcapBuffer.h"
@@ -51,6 +51,26 @@ HandleUSBPcapControlIOCTL(PIRP pIrp, PIO_STACK_LOCATION pStack,
         return ntStat;
     }
 
+    if (pStack->Parameters.DeviceIoControl.IoControlCode == IOCTL_USBPCAP_GET_TOPOLOGY)
+    {
+        PUSBPCAP_IOCTL_TOPOLOGY pTopology;
+
+        DkDbgStr("IOCTL_USBPCAP_GET_TOPOLOGY");
+
+        if (pStack->Parameters.DeviceIoControl.OutputBufferLength <
+            sizeof(USBPCAP_IOCTL_TOPOLOGY))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        pTopology = (PUSBPCAP_IOCTL_TOPOLOGY)pIrp->AssociatedIrp.SystemBuffer;
+        pTopology->epoch = pRootData->topologyEpoch;
+        pTopology->generation =
+            (UINT32)InterlockedCompareExchange(&pRootData->topologyGeneration, 0, 0);
+        *outLength = sizeof(USBPCAP_IOCTL_TOPOLOGY);
+        return STATUS_SUCCESS;
+    }
+
     /* Other IOCTLs are allowed only for the capture handle (exclusive) */
     if (!allowCapture)
     {
@@ -125,6 +145,64 @@ HandleUSBPcapControlIOCTL(PIRP pIrp, PIO_STACK_LOCATION pStack,
             break;
         }
 
+        case IOCTL_USBPCAP_SET_NOTIFICATION:
+        {
+            PUSBPCAP_IOCTL_NOTIFICATION  pNotification;
+            PKEVENT                      event = NULL;
+
+            if (pStack->Parameters.DeviceIoControl.InputBufferLength !=
+                sizeof(USBPCAP_IOCTL_NOTIFICATION))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pNotification = (PUSBPCAP_IOCTL_NOTIFICATION)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_NOTIFICATION", pNotification->threshold);
+
+            if (pNotification->event != 0)
+            {
+                ntStat = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)pNotification->event,
+                                                   EVENT_MODIFY_STATE,
+                                                   *ExEventObjectType,
+                                                   pIrp->RequestorMode,
+                                                   (PVOID *)&event,
+                                                   NULL);
+                if (!NT_SUCCESS(ntStat))
+                {
+                    DkDbgVal("Invalid event handle", ntStat);
+                    break;
+                }
+            }
+
+            ntStat = USBPcapBufferSetNotification(pRootData, event,
+                                                  pNotification->threshold);
+            if (!NT_SUCCESS(ntStat) && (event != NULL))
+            {
+                ObDereferenceObject(event);
+            }
+            break;
+        }
+
+        case IOCTL_USBPCAP_GET_STATISTICS:
+        {
+            if (pStack->Parameters.DeviceIoControl.OutputBufferLength <
+                sizeof(USBPCAP_IOCTL_STATISTICS))
+            {
+                ntStat = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            DkDbgStr("IOCTL_USBPCAP_GET_STATISTICS");
+            ntStat = USBPcapBufferGetStatistics(pRootData,
+                                                (PUSBPCAP_IOCTL_STATISTICS)pIrp->AssociatedIrp.SystemBuffer);
+            if (NT_SUCCESS(ntStat))
+            {
+                *outLength = sizeof(USBPCAP_IOCTL_STATISTICS);
+            }
+            break;
+        }
+
         default:
         {
             ULONG ctlCode = IoGetFunctionCodeFromCtlCode(pStack->Parameters.DeviceIoControl.IoControlCode);
@@ -43,6 +43,10 @@ static void USBPcapFreeDeviceData(IN PDEVICE_EXTENSION pDevExt)
                 {
                     ExFreePool((PVOID)pDeviceData->pRootData->buffer);
                 }
+                if (pDeviceData->pRootData->notifyEvent != NULL)
+                {
+                    ObDereferenceObject(pDeviceData->pRootData->notifyEvent);
+                }
                 ExFreePool((PVOID)pDeviceData->pRootData);
                 pDeviceData->pRootData = NULL;
             }
@@ -86,6 +90,7 @@ static NTSTATUS USBPcapAllocateDeviceData(IN PDEVICE_EXTENSION pDevExt,
     PUSBPCAP_DEVICE_DATA  pDeviceData;
     NTSTATUS              status = STATUS_SUCCESS;
     BOOLEAN               allocRoothubData;
+    LARGE_INTEGER         systemTime;
 
     allocRoothubData = (pParentDevExt == NULL);
 
@@ -140,6 +145,19 @@ static NTSTATUS USBPcapAllocateDeviceData(IN PDEVICE_EXTENSION pDevExt,
                 pDeviceData->pRootData->writeOffset = 0;
                 pDeviceData->pRootData->bufferSize = 0;
 
+                /* Notification is disabled until requested */
+                pDeviceData->pRootData->notifyEvent = NULL;
+                pDeviceData->pRootData->notifyThreshold = 0;
+                pDeviceData->pRootData->notifyArmed = FALSE;
+
+                pDeviceData->pRootData->packetsStored = 0;
+                pDeviceData->pRootData->packetsDropped = 0;
+
+                /* Every new root hub data gets unique epoch */
+                KeQuerySystemTime(&systemTime);
+                pDeviceData->pRootData->topologyEpoch = (UINT64)systemTime.QuadPart;
+                pDeviceData->pRootData->topologyGeneration = 0L;
+
                 /* Initialize default snaplen size */
                 pDeviceData->pRootData->snaplen = USBPCAP_DEFAULT_SNAP_LEN;
 
@@ -64,7 +64,9 @@ NTSTATUS DkCreateClose(PDEVICE_OBJECT pDevObj, PIRP pIrp)
                 }
                 else
                 {
-                    /* Handle will be only able to call IOCTL_USBPCAP_GET_HUB_SYMLINK - allow it */
+                    /* Handle will be only able to call IOCTL_USBPCAP_GET_HUB_SYMLINK and
+                     * IOCTL_USBPCAP_GET_TOPOLOGY - allow it
+                     */
                 }
                 break;
 
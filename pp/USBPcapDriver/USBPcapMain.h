@@ -31,7 +31,7 @@
 #define DKPORT_MTAG         (ULONG)'dk3A' // To tag memory allocation if any
 
 #include "USBPcapQueue.h"
-#include "include\USBPcap.h"
+#include "include/USBPcap.h"
 
 #define USBPCAP_DEFAULT_SNAP_LEN  65535
 
@@ -44,6 +44,26 @@ typedef struct _USBPCAP_ROOTHUB_DATA
     UINT32                 readOffset;
     UINT32                 writeOffset;
 
+    /* Data notification. Protected by bufferLock.
+     * notifyEvent is referenced object, NULL if notification is disabled.
+     * notifyArmed is TRUE when event should be signalled as soon as
+     * there is at least notifyThreshold bytes to read.
+     */
+    PKEVENT                notifyEvent;
+    UINT32                 notifyThreshold;
+    BOOLEAN                notifyArmed;
+
+    /* Capture statistics. Protected by bufferLock. */
+    UINT64                 packetsStored;
+    UINT64                 packetsDropped;
+
+    /* Topology change counter, see IOCTL_USBPCAP_GET_TOPOLOGY.
+     * topologyEpoch is constant after the root hub data is allocated.
+     * topologyGeneration is to be used only with InterlockedXXX calls.
+     */
+    UINT64                 topologyEpoch;
+    volatile LONG          topologyGeneration;
+
     /* Snapshot length */
     UINT32                 snaplen;
 
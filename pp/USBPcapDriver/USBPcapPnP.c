@@ -160,6 +160,8 @@ NTSTATUS DkTgtPnP(PDEVICE_EXTENSION pDevExt, PIO_STACK_LOCATION pStack, PIRP pIr
             {
                 DkDbgStr("Failed to get info of started device");
             }
+            /* Address and description are known only now */
+            InterlockedIncrement(&pDeviceData->pRootData->topologyGeneration);
             IoReleaseRemoveLock(&pDevExt->removeLock, (PVOID) pIrp);
             return ntStat;
 
@@ -175,6 +177,18 @@ NTSTATUS DkTgtPnP(PDEVICE_EXTENSION pDevExt, PIO_STACK_LOCATION pStack, PIRP pIr
                 IoReleaseRemoveLock(&pDevExt->removeLock, (PVOID) pIrp);
                 return ntStat;
             }
+            else if (pStack->Parameters.QueryDeviceRelations.Type == BusRelations)
+            {
+                /* Composite device reports its children. They are not
+                 * filtered, but they are part of enumerated topology.
+                 */
+                ntStat = DkForwardAndWait(pDevExt->pNextDevObj, pIrp);
+                InterlockedIncrement(&pDeviceData->pRootData->topologyGeneration);
+                IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+                IoReleaseRemoveLock(&pDevExt->removeLock, (PVOID) pIrp);
+                return ntStat;
+            }
             else
             {
                 break;
@@ -183,6 +197,8 @@ NTSTATUS DkTgtPnP(PDEVICE_EXTENSION pDevExt, PIO_STACK_LOCATION pStack, PIRP pIr
         case IRP_MN_REMOVE_DEVICE:
             DkDbgStr("IRP_MN_REMOVE_DEVICE");
 
+            InterlockedIncrement(&pDeviceData->pRootData->topologyGeneration);
+
             IoSkipCurrentIrpStackLocation(pIrp);
             ntStat = IoCallDriver(pDevExt->pNextDevObj, pIrp);
 
@@ -221,6 +237,8 @@ NTSTATUS DkHubFltPnpHandleQryDevRels(PDEVICE_EXTENSION pDevExt, PIO_STACK_LOCATI
     PDEVICE_RELATIONS    pDevRel = NULL;
     PUSBPCAP_DEVICE_DATA pDeviceData = pDevExt->context.usb.pDeviceData;
     ULONG                i;
+    ULONG                previousCount;
+    BOOLEAN              changed;
 
     ntStat = IoAcquireRemoveLock(&pDevExt->removeLock, (PVOID) pIrp);
     if (!NT_SUCCESS(ntStat))
@@ -251,6 +269,16 @@ NTSTATUS DkHubFltPnpHandleQryDevRels(PDEVICE_EXTENSION pDevExt, PIO_STACK_LOCATI
 
                     DkDbgVal("Child(s) number", pDevRel->Count);
 
+                    previousCount = 0;
+                    if (pDeviceData->previousChildren != NULL)
+                    {
+                        while (pDeviceData->previousChildren[previousCount] != NULL)
+                        {
+                            previousCount++;
+                        }
+                    }
+                    changed = (previousCount != pDevRel->Count) ? TRUE : FALSE;
+
                     for (i = 0; i < pDevRel->Count; i++)
                     {
                         PDEVICE_OBJECT *child;
@@ -277,9 +305,15 @@ NTSTATUS DkHubFltPnpHandleQryDevRels(PDEVICE_EXTENSION pDevExt, PIO_STACK_LOCATI
                             /* New device attached */
                             DkCreateAndAttachTgt(pDevExt,
                                                  pDevRel->Objects[i]);
+                            changed = TRUE;
                         }
                     }
 
+                    if (changed)
+                    {
+                        InterlockedIncrement(&pDeviceData->pRootData->topologyGeneration);
+                    }
+
                     /* Free old children information */
                     if (pDeviceData->previousChildren != NULL)
                     {
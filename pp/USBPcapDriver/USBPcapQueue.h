@@ -8,7 +8,7 @@
 #define USBPCAP_QUEUE_H
 
 #include "Wdm.h"
-#include "include\USBPcap.h"
+#include "include/USBPcap.h"
 
 __drv_raisesIRQL(DISPATCH_LEVEL)
 __drv_maxIRQL(DISPATCH_LEVEL)
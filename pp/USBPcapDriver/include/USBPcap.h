@@ -41,6 +41,55 @@ typedef struct _USBPCAP_ADDRESS_FILTER
 } USBPCAP_ADDRESS_FILTER, *PUSBPCAP_ADDRESS_FILTER;
 #pragma pack(pop)
 
+/* USBPCAP_IOCTL_NOTIFICATION is parameter structure to
+ * IOCTL_USBPCAP_SET_NOTIFICATION.
+ *
+ * event is a HANDLE to an event object created by the capture process.
+ * It is passed as 64-bit value so the structure layout is the same for
+ * 32-bit and 64-bit processes. NULL event disables notifications.
+ *
+ * While notification is enabled the driver signals the event once the
+ * amount of unread data in buffer reaches threshold bytes. The event is
+ * not signalled again until reader drains the buffer below threshold.
+ * Read requests are completed immediately (possibly with 0 bytes) and
+ * never pended.
+ */
+typedef struct
+{
+    UINT64  event;
+    UINT32  threshold;
+} USBPCAP_IOCTL_NOTIFICATION, *PUSBPCAP_IOCTL_NOTIFICATION;
+
+/* USBPCAP_IOCTL_STATISTICS is output structure of
+ * IOCTL_USBPCAP_GET_STATISTICS. Counters start at zero when capture
+ * buffer is set up.
+ *
+ * packets is number of packets stored in buffer.
+ * dropped is number of packets that did not fit into buffer.
+ */
+typedef struct
+{
+    UINT64  packets;
+    UINT64  dropped;
+} USBPCAP_IOCTL_STATISTICS, *PUSBPCAP_IOCTL_STATISTICS;
+
+/* USBPCAP_IOCTL_TOPOLOGY is output structure of
+ * IOCTL_USBPCAP_GET_TOPOLOGY. It can be obtained without capture access.
+ *
+ * epoch is system time when the root hub filter was created. It changes
+ * whenever driver is reloaded, root hub is restarted or system reboots.
+ * generation is incremented every time device is attached to, started
+ * or removed from any hub below the root hub, and every time composite
+ * device reports its children.
+ *
+ * Enumerated topology is still valid if both values are unchanged.
+ */
+typedef struct
+{
+    UINT64  epoch;
+    UINT32  generation;
+} USBPCAP_IOCTL_TOPOLOGY, *PUSBPCAP_IOCTL_TOPOLOGY;
+
 #define IOCTL_USBPCAP_SETUP_BUFFER \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
 
@@ -56,6 +105,15 @@ typedef struct _USBPCAP_ADDRESS_FILTER
 #define IOCTL_USBPCAP_SET_SNAPLEN_SIZE \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_READ_ACCESS)
 
+#define IOCTL_USBPCAP_SET_NOTIFICATION \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_GET_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_GET_TOPOLOGY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
 /* USB packets, beginning with a USBPcap header */
 #define DLT_USBPCAP         249
 
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapMain.h"
+#include "USBPcapBuffer.h"
+#include "USBPcapQueue.h"
+#include "USBPcapTables.h"
+#include "HostCapture.h"
+
+#define HOST_CAPTURE_TAG  (ULONG)'tsoH'
+
+static VOID HostFreeDeviceData(PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    if (pDeviceData->endpointTable != NULL)
+    {
+        USBPcapFreeEndpointTable(pDeviceData->endpointTable);
+    }
+
+    if (pDeviceData->URBIrpTable != NULL)
+    {
+        USBPcapFreeURBIRPInfoTable(pDeviceData->URBIrpTable);
+    }
+
+    if (pDeviceData->descriptor != NULL)
+    {
+        ExFreePool((PVOID)pDeviceData->descriptor);
+    }
+
+    ExFreePool((PVOID)pDeviceData);
+}
+
+static NTSTATUS HostAllocateDeviceData(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                       USHORT deviceAddress,
+                                       BOOLEAN isHub,
+                                       PUSBPCAP_DEVICE_DATA *ppDeviceData)
+{
+    PUSBPCAP_DEVICE_DATA pDeviceData;
+
+    pDeviceData = ExAllocatePoolWithTag(NonPagedPool,
+                                        sizeof(USBPCAP_DEVICE_DATA),
+                                        HOST_CAPTURE_TAG);
+    if (pDeviceData == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(pDeviceData, sizeof(USBPCAP_DEVICE_DATA));
+    pDeviceData->properData = TRUE;
+    pDeviceData->isHub = isHub;
+    pDeviceData->deviceAddress = deviceAddress;
+    pDeviceData->pRootData = pRootData;
+
+    KeInitializeSpinLock(&pDeviceData->tablesSpinLock);
+    pDeviceData->endpointTable = USBPcapInitializeEndpointTable(NULL);
+    pDeviceData->URBIrpTable = USBPcapInitializeURBIRPInfoTable(NULL);
+    if (pDeviceData->endpointTable == NULL ||
+        pDeviceData->URBIrpTable == NULL)
+    {
+        HostFreeDeviceData(pDeviceData);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    InterlockedIncrement(&pRootData->refCount);
+
+    *ppDeviceData = pDeviceData;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS HostCreateRootHub(USHORT busId, PHOST_ROOT_HUB *ppRootHub)
+{
+    PHOST_ROOT_HUB         pRootHub;
+    PUSBPCAP_ROOTHUB_DATA  pRootData;
+    PDEVICE_EXTENSION      pRootExt;
+    PDEVICE_EXTENSION      pControlExt;
+    NTSTATUS               status;
+
+    pRootHub = ExAllocatePoolWithTag(NonPagedPool,
+                                     sizeof(HOST_ROOT_HUB),
+                                     HOST_CAPTURE_TAG);
+    if (pRootHub == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(pRootHub, sizeof(HOST_ROOT_HUB));
+
+    /* Same initial state as set by USBPcapAllocateDeviceData() */
+    pRootData = ExAllocatePoolWithTag(NonPagedPool,
+                                      sizeof(USBPCAP_ROOTHUB_DATA),
+                                      HOST_CAPTURE_TAG);
+    if (pRootData == NULL)
+    {
+        ExFreePool((PVOID)pRootHub);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(pRootData, sizeof(USBPCAP_ROOTHUB_DATA));
+    KeInitializeSpinLock(&pRootData->bufferLock);
+    pRootData->snaplen = USBPCAP_DEFAULT_SNAP_LEN;
+    pRootData->busId = busId;
+    pRootHub->pRootData = pRootData;
+
+    status = HostAllocateDeviceData(pRootData, 0, TRUE,
+                                    &pRootHub->pRootHubData);
+    if (!NT_SUCCESS(status))
+    {
+        ExFreePool((PVOID)pRootData);
+        ExFreePool((PVOID)pRootHub);
+        return status;
+    }
+
+    /* Root hub filter object */
+    status = IoCreateDevice(&pRootHub->driverObject,
+                            sizeof(DEVICE_EXTENSION),
+                            NULL,
+                            FILE_DEVICE_UNKNOWN,
+                            0,
+                            FALSE,
+                            &pRootHub->rootHubObject);
+    if (!NT_SUCCESS(status))
+    {
+        HostDestroyRootHub(pRootHub);
+        return status;
+    }
+
+    pRootExt = (PDEVICE_EXTENSION)pRootHub->rootHubObject->DeviceExtension;
+    pRootExt->deviceMagic = USBPCAP_MAGIC_ROOTHUB;
+    pRootExt->pThisDevObj = pRootHub->rootHubObject;
+    pRootExt->pDrvObj = &pRootHub->driverObject;
+    pRootExt->context.usb.pDeviceData = pRootHub->pRootHubData;
+
+    /* Control device, as created by USBPcapCreateRootHubControlDevice() */
+    status = IoCreateDevice(&pRootHub->driverObject,
+                            sizeof(DEVICE_EXTENSION),
+                            NULL,
+                            FILE_DEVICE_UNKNOWN,
+                            0,
+                            FALSE,
+                            &pRootHub->controlObject);
+    if (!NT_SUCCESS(status))
+    {
+        HostDestroyRootHub(pRootHub);
+        return status;
+    }
+
+    pRootHub->controlObject->Flags |= DO_DIRECT_IO;
+
+    pControlExt = (PDEVICE_EXTENSION)pRootHub->controlObject->DeviceExtension;
+    pControlExt->deviceMagic = USBPCAP_MAGIC_CONTROL;
+    pControlExt->pThisDevObj = pRootHub->controlObject;
+    pControlExt->pDrvObj = &pRootHub->driverObject;
+    pControlExt->context.control.id = busId;
+    pControlExt->context.control.pRootHubObject = pRootHub->rootHubObject;
+
+    KeInitializeSpinLock(&pControlExt->context.control.csqSpinLock);
+    InitializeListHead(&pControlExt->context.control.lePendIrp);
+    status = IoCsqInitialize(&pControlExt->context.control.ioCsq,
+                             DkCsqInsertIrp, DkCsqRemoveIrp,
+                             DkCsqPeekNextIrp, DkCsqAcquireLock,
+                             DkCsqReleaseLock, DkCsqCompleteCanceledIrp);
+    if (!NT_SUCCESS(status))
+    {
+        HostDestroyRootHub(pRootHub);
+        return status;
+    }
+
+    pRootHub->controlObject->Flags &= ~DO_DEVICE_INITIALIZING;
+    pRootData->controlDevice = pRootHub->controlObject;
+
+    *ppRootHub = pRootHub;
+    return STATUS_SUCCESS;
+}
+
+VOID HostDestroyRootHub(PHOST_ROOT_HUB pRootHub)
+{
+    if (pRootHub->controlObject != NULL)
+    {
+        HostCancelReads(pRootHub);
+        USBPcapBufferRemoveBuffer((PDEVICE_EXTENSION)pRootHub->controlObject->DeviceExtension);
+        IoDeleteDevice(pRootHub->controlObject);
+    }
+
+    if (pRootHub->rootHubObject != NULL)
+    {
+        IoDeleteDevice(pRootHub->rootHubObject);
+    }
+
+    if (pRootHub->pRootHubData != NULL)
+    {
+        HostFreeDeviceData(pRootHub->pRootHubData);
+    }
+
+    if (pRootHub->pRootData->buffer != NULL)
+    {
+        ExFreePool((PVOID)pRootHub->pRootData->buffer);
+    }
+
+    ExFreePool((PVOID)pRootHub->pRootData);
+    ExFreePool((PVOID)pRootHub);
+}
+
+NTSTATUS HostStartCapture(PHOST_ROOT_HUB pRootHub,
+                          UINT32 snaplen,
+                          UINT32 bufferSize,
+                          PUSBPCAP_ADDRESS_FILTER filter)
+{
+    NTSTATUS status;
+
+    status = USBPcapSetSnaplenSize(pRootHub->pRootData, snaplen);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    status = USBPcapSetUpBuffer(pRootHub->pRootData, bufferSize);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    if (filter != NULL)
+    {
+        memcpy(&pRootHub->pRootData->filter, filter,
+               sizeof(USBPCAP_ADDRESS_FILTER));
+    }
+    else
+    {
+        memset(&pRootHub->pRootData->filter, 0,
+               sizeof(USBPCAP_ADDRESS_FILTER));
+        pRootHub->pRootData->filter.filterAll = TRUE;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS HostSetNotification(PHOST_ROOT_HUB pRootHub,
+                             PKEVENT event,
+                             UINT32 threshold)
+{
+    PKEVENT   referenced = NULL;
+    NTSTATUS  status;
+
+    /* Same steps as IOCTL_USBPCAP_SET_NOTIFICATION handler */
+    if (event != NULL)
+    {
+        status = ObReferenceObjectByHandle((HANDLE)event,
+                                           EVENT_MODIFY_STATE,
+                                           *ExEventObjectType,
+                                           UserMode,
+                                           (PVOID *)&referenced,
+                                           NULL);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    status = USBPcapBufferSetNotification(pRootHub->pRootData,
+                                          referenced, threshold);
+    if (!NT_SUCCESS(status) && (referenced != NULL))
+    {
+        ObDereferenceObject(referenced);
+    }
+
+    return status;
+}
+
+NTSTATUS HostGetStatistics(PHOST_ROOT_HUB pRootHub,
+                           PUSBPCAP_IOCTL_STATISTICS pStats)
+{
+    return USBPcapBufferGetStatistics(pRootHub->pRootData, pStats);
+}
+
+NTSTATUS HostCreateDevice(PHOST_ROOT_HUB pRootHub,
+                          USHORT deviceAddress,
+                          PUSBPCAP_DEVICE_DATA *ppDeviceData)
+{
+    NTSTATUS status;
+
+    status = HostAllocateDeviceData(pRootHub->pRootData, deviceAddress,
+                                    FALSE, ppDeviceData);
+    if (NT_SUCCESS(status))
+    {
+        (*ppDeviceData)->pParentFlt = pRootHub->rootHubObject;
+    }
+
+    return status;
+}
+
+VOID HostDestroyDevice(PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    InterlockedDecrement(&pDeviceData->pRootData->refCount);
+    HostFreeDeviceData(pDeviceData);
+}
+
+NTSTATUS HostInitializeReadRequest(PHOST_READ_REQUEST pRequest,
+                                   UINT32 length)
+{
+    RtlZeroMemory(pRequest, sizeof(HOST_READ_REQUEST));
+
+    pRequest->buffer = ExAllocatePoolWithTag(NonPagedPool,
+                                             (SIZE_T)length,
+                                             HOST_CAPTURE_TAG);
+    if (pRequest->buffer == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    pRequest->length = length;
+
+    pRequest->pIrp = IoAllocateIrp(1, FALSE);
+    if (pRequest->pIrp == NULL)
+    {
+        HostFreeReadRequest(pRequest);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    pRequest->pMdl = IoAllocateMdl(pRequest->buffer, length,
+                                   FALSE, FALSE, pRequest->pIrp);
+    if (pRequest->pMdl == NULL)
+    {
+        HostFreeReadRequest(pRequest);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    MmBuildMdlForNonPagedPool(pRequest->pMdl);
+
+    KeInitializeEvent(&pRequest->event, NotificationEvent, FALSE);
+    pRequest->pIrp->UserIosb = &pRequest->iosb;
+    pRequest->pIrp->UserEvent = &pRequest->event;
+
+    /* The request is always delivered to the only stack location */
+    IoSetNextIrpStackLocation(pRequest->pIrp);
+
+    return STATUS_SUCCESS;
+}
+
+VOID HostFreeReadRequest(PHOST_READ_REQUEST pRequest)
+{
+    if (pRequest->pMdl != NULL)
+    {
+        IoFreeMdl(pRequest->pMdl);
+        pRequest->pMdl = NULL;
+    }
+
+    if (pRequest->pIrp != NULL)
+    {
+        IoFreeIrp(pRequest->pIrp);
+        pRequest->pIrp = NULL;
+    }
+
+    if (pRequest->buffer != NULL)
+    {
+        ExFreePool(pRequest->buffer);
+        pRequest->buffer = NULL;
+    }
+}
+
+/*
+ * Control device part of DkReadWrite() for IRP_MJ_READ.
+ */
+NTSTATUS HostSubmitRead(PHOST_ROOT_HUB pRootHub,
+                        PHOST_READ_REQUEST pRequest)
+{
+    PIRP                pIrp = pRequest->pIrp;
+    PIO_STACK_LOCATION  pStack;
+    PDEVICE_EXTENSION   pDevExt;
+    UINT32              bytesRead = 0;
+    NTSTATUS            ntStat;
+
+    pDevExt = (PDEVICE_EXTENSION)pRootHub->controlObject->DeviceExtension;
+
+    KeClearEvent(&pRequest->event);
+    pRequest->iosb.Status = STATUS_PENDING;
+    pRequest->iosb.Information = 0;
+    pIrp->IoStatus.Status = STATUS_PENDING;
+    pIrp->IoStatus.Information = 0;
+    pIrp->Cancel = FALSE;
+
+    pStack = IoGetCurrentIrpStackLocation(pIrp);
+    pStack->MajorFunction = IRP_MJ_READ;
+    pStack->DeviceObject = pRootHub->controlObject;
+    pStack->FileObject = NULL;
+    pStack->Parameters.Read.Length = pRequest->length;
+
+    ntStat = USBPcapBufferHandleReadIrp(pIrp, pDevExt, &bytesRead);
+
+    /* If the IRP was pended, do not call complete request */
+    if (ntStat != STATUS_PENDING)
+    {
+        pIrp->IoStatus.Status = ntStat;
+        pIrp->IoStatus.Information = (ULONG_PTR)bytesRead;
+        IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+    }
+
+    return ntStat;
+}
+
+NTSTATUS HostWaitRead(PHOST_READ_REQUEST pRequest,
+                      PLARGE_INTEGER timeout)
+{
+    return KeWaitForSingleObject(&pRequest->event, Executive,
+                                 KernelMode, FALSE, timeout);
+}
+
+VOID HostCancelReads(PHOST_ROOT_HUB pRootHub)
+{
+    PIRP                pIrp;
+    PIO_STACK_LOCATION  pStack;
+
+    /* Cleanup IRP without file object matches all pended requests */
+    pIrp = IoAllocateIrp(1, FALSE);
+    if (pIrp == NULL)
+    {
+        return;
+    }
+
+    IoSetNextIrpStackLocation(pIrp);
+    pStack = IoGetCurrentIrpStackLocation(pIrp);
+    pStack->MajorFunction = IRP_MJ_CLEANUP;
+    pStack->FileObject = NULL;
+
+    DkCsqCleanUpQueue(pRootHub->controlObject, pIrp);
+    IoFreeIrp(pIrp);
+}
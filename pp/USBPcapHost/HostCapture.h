@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Simulated root hub for driving the capture core from host programs.
+ *
+ * HostCreateRootHub() sets up the same objects the driver creates when
+ * it attaches to a root hub and the control device gets opened: root hub
+ * filter object, USBPCAP_ROOTHUB_DATA and control device with its
+ * Cancel-Safe queue. Devices created with HostCreateDevice() can be
+ * passed directly to USBPcapAnalyzeURB().
+ */
+
+#ifndef USBPCAP_HOST_CAPTURE_H
+#define USBPCAP_HOST_CAPTURE_H
+
+#include "USBPcapMain.h"
+
+typedef struct _HOST_ROOT_HUB
+{
+    DRIVER_OBJECT          driverObject;
+    PDEVICE_OBJECT         rootHubObject;  /* USBPCAP_MAGIC_ROOTHUB */
+    PDEVICE_OBJECT         controlObject;  /* USBPCAP_MAGIC_CONTROL */
+    PUSBPCAP_DEVICE_DATA   pRootHubData;
+    PUSBPCAP_ROOTHUB_DATA  pRootData;
+} HOST_ROOT_HUB, *PHOST_ROOT_HUB;
+
+/*
+ * Read request as issued by ReadFile() on the control device.
+ * Completion is signalled on event and the result stored in iosb.
+ */
+typedef struct _HOST_READ_REQUEST
+{
+    PIRP             pIrp;
+    PMDL             pMdl;
+    PVOID            buffer;
+    UINT32           length;
+    KEVENT           event;
+    IO_STATUS_BLOCK  iosb;
+} HOST_READ_REQUEST, *PHOST_READ_REQUEST;
+
+NTSTATUS HostCreateRootHub(USHORT busId, PHOST_ROOT_HUB *ppRootHub);
+VOID HostDestroyRootHub(PHOST_ROOT_HUB pRootHub);
+
+/*
+ * Equivalent of IOCTL_USBPCAP_SET_SNAPLEN_SIZE, IOCTL_USBPCAP_SETUP_BUFFER
+ * and IOCTL_USBPCAP_START_FILTERING issued in that order.
+ *
+ * If filter is NULL, all devices are captured.
+ */
+NTSTATUS HostStartCapture(PHOST_ROOT_HUB pRootHub,
+                          UINT32 snaplen,
+                          UINT32 bufferSize,
+                          PUSBPCAP_ADDRESS_FILTER filter);
+
+/*
+ * Equivalent of IOCTL_USBPCAP_SET_NOTIFICATION. Event is signalled once
+ * there is at least threshold bytes to read. NULL event disables
+ * notification.
+ *
+ * While notification is enabled HostSubmitRead() never returns
+ * STATUS_PENDING.
+ */
+NTSTATUS HostSetNotification(PHOST_ROOT_HUB pRootHub,
+                             PKEVENT event,
+                             UINT32 threshold);
+
+/*
+ * Equivalent of IOCTL_USBPCAP_GET_STATISTICS.
+ */
+NTSTATUS HostGetStatistics(PHOST_ROOT_HUB pRootHub,
+                           PUSBPCAP_IOCTL_STATISTICS pStats);
+
+/*
+ * Creates device data for device connected to the root hub.
+ * The device data is what the driver passes to USBPcapAnalyzeURB().
+ */
+NTSTATUS HostCreateDevice(PHOST_ROOT_HUB pRootHub,
+                          USHORT deviceAddress,
+                          PUSBPCAP_DEVICE_DATA *ppDeviceData);
+VOID HostDestroyDevice(PUSBPCAP_DEVICE_DATA pDeviceData);
+
+NTSTATUS HostInitializeReadRequest(PHOST_READ_REQUEST pRequest,
+                                   UINT32 length);
+VOID HostFreeReadRequest(PHOST_READ_REQUEST pRequest);
+
+/*
+ * Sends read request to the control device.
+ *
+ * Returns STATUS_PENDING if the request was queued, otherwise the request
+ * is already completed and pRequest->iosb contains the result.
+ */
+NTSTATUS HostSubmitRead(PHOST_ROOT_HUB pRootHub,
+                        PHOST_READ_REQUEST pRequest);
+
+/*
+ * Waits for pended read request to complete. Timeout has the same
+ * meaning as in KeWaitForSingleObject().
+ */
+NTSTATUS HostWaitRead(PHOST_READ_REQUEST pRequest,
+                      PLARGE_INTEGER timeout);
+
+/* Cancels all pended read requests, as IRP_MJ_CLEANUP would. */
+VOID HostCancelReads(PHOST_ROOT_HUB pRootHub);
+
+#endif /* USBPCAP_HOST_CAPTURE_H */
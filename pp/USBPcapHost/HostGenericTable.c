@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * RTL_GENERIC_TABLE implementation.
+ *
+ * Elements are kept in a top-down splay tree ordered by CompareRoutine
+ * and in a list in the insertion order. Each element is allocated with
+ * table AllocateRoutine as a header followed by the caller's buffer, and
+ * the pointer to the copied buffer is what the API returns. Parent links
+ * are not maintained as top-down splaying does not need them.
+ */
+
+#include "Wdm.h"
+
+typedef struct _HOST_TABLE_ENTRY
+{
+    RTL_SPLAY_LINKS  links;
+    LIST_ENTRY       entry;
+    LONGLONG         userData;
+} HOST_TABLE_ENTRY, *PHOST_TABLE_ENTRY;
+
+#define HOST_ENTRY_FROM_LINKS(l) CONTAINING_RECORD((l), HOST_TABLE_ENTRY, links)
+#define HOST_USER_DATA(l)        ((PVOID)&HOST_ENTRY_FROM_LINKS(l)->userData)
+
+__inline static RTL_GENERIC_COMPARE_RESULTS
+HostCompare(PRTL_GENERIC_TABLE Table, PVOID Buffer, PRTL_SPLAY_LINKS node)
+{
+    return Table->CompareRoutine(Table, Buffer, HOST_USER_DATA(node));
+}
+
+/*
+ * Splays the tree rooted at root around Buffer. On return, the root is
+ * either the element equal to Buffer or its predecessor or successor.
+ */
+static PRTL_SPLAY_LINKS HostSplay(PRTL_GENERIC_TABLE Table,
+                                  PRTL_SPLAY_LINKS root,
+                                  PVOID Buffer)
+{
+    RTL_SPLAY_LINKS   assembly;
+    PRTL_SPLAY_LINKS  left;
+    PRTL_SPLAY_LINKS  right;
+    PRTL_SPLAY_LINKS  tmp;
+
+    if (root == NULL)
+    {
+        return NULL;
+    }
+
+    assembly.LeftChild = NULL;
+    assembly.RightChild = NULL;
+    left = &assembly;
+    right = &assembly;
+
+    while (TRUE)
+    {
+        RTL_GENERIC_COMPARE_RESULTS result = HostCompare(Table, Buffer, root);
+
+        if (result == GenericLessThan)
+        {
+            if (root->LeftChild == NULL)
+            {
+                break;
+            }
+            if (HostCompare(Table, Buffer, root->LeftChild) == GenericLessThan)
+            {
+                /* Rotate right */
+                tmp = root->LeftChild;
+                root->LeftChild = tmp->RightChild;
+                tmp->RightChild = root;
+                root = tmp;
+                if (root->LeftChild == NULL)
+                {
+                    break;
+                }
+            }
+            /* Link right */
+            right->LeftChild = root;
+            right = root;
+            root = root->LeftChild;
+        }
+        else if (result == GenericGreaterThan)
+        {
+            if (root->RightChild == NULL)
+            {
+                break;
+            }
+            if (HostCompare(Table, Buffer, root->RightChild) == GenericGreaterThan)
+            {
+                /* Rotate left */
+                tmp = root->RightChild;
+                root->RightChild = tmp->LeftChild;
+                tmp->LeftChild = root;
+                root = tmp;
+                if (root->RightChild == NULL)
+                {
+                    break;
+                }
+            }
+            /* Link left */
+            left->RightChild = root;
+            left = root;
+            root = root->RightChild;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    /* Assemble */
+    left->RightChild = root->LeftChild;
+    right->LeftChild = root->RightChild;
+    root->LeftChild = assembly.RightChild;
+    root->RightChild = assembly.LeftChild;
+
+    return root;
+}
+
+VOID RtlInitializeGenericTable(PRTL_GENERIC_TABLE Table,
+                               PRTL_GENERIC_COMPARE_ROUTINE CompareRoutine,
+                               PRTL_GENERIC_ALLOCATE_ROUTINE AllocateRoutine,
+                               PRTL_GENERIC_FREE_ROUTINE FreeRoutine,
+                               PVOID TableContext)
+{
+    Table->TableRoot = NULL;
+    InitializeListHead(&Table->InsertOrderList);
+    Table->OrderedPointer = &Table->InsertOrderList;
+    Table->WhichOrderedElement = 0;
+    Table->NumberGenericTableElements = 0;
+    Table->CompareRoutine = CompareRoutine;
+    Table->AllocateRoutine = AllocateRoutine;
+    Table->FreeRoutine = FreeRoutine;
+    Table->TableContext = TableContext;
+}
+
+PVOID RtlInsertElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                   PVOID Buffer,
+                                   CLONG BufferSize,
+                                   PBOOLEAN NewElement)
+{
+    PRTL_SPLAY_LINKS             root;
+    PHOST_TABLE_ENTRY            element;
+    RTL_GENERIC_COMPARE_RESULTS  result = GenericEqual;
+
+    root = HostSplay(Table, Table->TableRoot, Buffer);
+    Table->TableRoot = root;
+
+    if (root != NULL)
+    {
+        result = HostCompare(Table, Buffer, root);
+        if (result == GenericEqual)
+        {
+            if (NewElement != NULL)
+            {
+                *NewElement = FALSE;
+            }
+            return HOST_USER_DATA(root);
+        }
+    }
+
+    element = Table->AllocateRoutine(Table,
+                                     (CLONG)(FIELD_OFFSET(HOST_TABLE_ENTRY, userData) +
+                                             BufferSize));
+    if (element == NULL)
+    {
+        if (NewElement != NULL)
+        {
+            *NewElement = FALSE;
+        }
+        return NULL;
+    }
+
+    RtlCopyMemory(&element->userData, Buffer, BufferSize);
+
+    if (root == NULL)
+    {
+        element->links.LeftChild = NULL;
+        element->links.RightChild = NULL;
+    }
+    else if (result == GenericLessThan)
+    {
+        element->links.LeftChild = root->LeftChild;
+        element->links.RightChild = root;
+        root->LeftChild = NULL;
+    }
+    else
+    {
+        element->links.RightChild = root->RightChild;
+        element->links.LeftChild = root;
+        root->RightChild = NULL;
+    }
+    element->links.Parent = NULL;
+    Table->TableRoot = &element->links;
+
+    InsertTailList(&Table->InsertOrderList, &element->entry);
+    Table->NumberGenericTableElements++;
+
+    /* Invalidate ordered element cache */
+    Table->OrderedPointer = &Table->InsertOrderList;
+    Table->WhichOrderedElement = 0;
+
+    if (NewElement != NULL)
+    {
+        *NewElement = TRUE;
+    }
+
+    return &element->userData;
+}
+
+BOOLEAN RtlDeleteElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                     PVOID Buffer)
+{
+    PRTL_SPLAY_LINKS   root;
+    PHOST_TABLE_ENTRY  element;
+
+    root = HostSplay(Table, Table->TableRoot, Buffer);
+    Table->TableRoot = root;
+
+    if (root == NULL || HostCompare(Table, Buffer, root) != GenericEqual)
+    {
+        return FALSE;
+    }
+
+    if (root->LeftChild == NULL)
+    {
+        Table->TableRoot = root->RightChild;
+    }
+    else
+    {
+        /* Every element in left subtree is smaller than Buffer, so the
+         * splay brings the maximum to the root which has no right child.
+         */
+        PRTL_SPLAY_LINKS newRoot = HostSplay(Table, root->LeftChild, Buffer);
+
+        newRoot->RightChild = root->RightChild;
+        Table->TableRoot = newRoot;
+    }
+
+    element = HOST_ENTRY_FROM_LINKS(root);
+    RemoveEntryList(&element->entry);
+    Table->NumberGenericTableElements--;
+
+    Table->OrderedPointer = &Table->InsertOrderList;
+    Table->WhichOrderedElement = 0;
+
+    Table->FreeRoutine(Table, element);
+    return TRUE;
+}
+
+PVOID RtlLookupElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                   PVOID Buffer)
+{
+    PRTL_SPLAY_LINKS root;
+
+    root = HostSplay(Table, Table->TableRoot, Buffer);
+    Table->TableRoot = root;
+
+    if (root == NULL || HostCompare(Table, Buffer, root) != GenericEqual)
+    {
+        return NULL;
+    }
+
+    return HOST_USER_DATA(root);
+}
+
+/*
+ * Returns I-th element in insertion order. Consecutive lookups continue
+ * from the cached position just like the Windows implementation does.
+ */
+PVOID RtlGetElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                ULONG I)
+{
+    PLIST_ENTRY  entry;
+    ULONG        current;
+    ULONG        wanted;
+
+    if (I >= Table->NumberGenericTableElements)
+    {
+        return NULL;
+    }
+
+    /* WhichOrderedElement is 1-based, 0 means the list head */
+    wanted = I + 1;
+    entry = Table->OrderedPointer;
+    current = Table->WhichOrderedElement;
+
+    if (wanted < current / 2 || current == 0)
+    {
+        entry = &Table->InsertOrderList;
+        current = 0;
+    }
+
+    while (current < wanted)
+    {
+        entry = entry->Flink;
+        current++;
+    }
+    while (current > wanted)
+    {
+        entry = entry->Blink;
+        current--;
+    }
+
+    Table->OrderedPointer = entry;
+    Table->WhichOrderedElement = current;
+
+    return &CONTAINING_RECORD(entry, HOST_TABLE_ENTRY, entry)->userData;
+}
+
+ULONG RtlNumberGenericTableElements(PRTL_GENERIC_TABLE Table)
+{
+    return Table->NumberGenericTableElements;
+}
+
+BOOLEAN RtlIsGenericTableEmpty(PRTL_GENERIC_TABLE Table)
+{
+    return (BOOLEAN)(Table->TableRoot == NULL);
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * USBD library routines declared in wdk/Usbdlib.h.
+ */
+
+#include "Wdm.h"
+#include "Usbdlib.h"
+
+PUSB_COMMON_DESCRIPTOR
+USBD_ParseDescriptors(PVOID DescriptorBuffer,
+                      ULONG TotalLength,
+                      PVOID StartPosition,
+                      LONG DescriptorType)
+{
+    PUCHAR  start = (PUCHAR)DescriptorBuffer;
+    PUCHAR  end = start + TotalLength;
+    PUCHAR  position = (PUCHAR)StartPosition;
+
+    while ((position >= start) &&
+           (position + sizeof(USB_COMMON_DESCRIPTOR) <= end))
+    {
+        PUSB_COMMON_DESCRIPTOR descriptor = (PUSB_COMMON_DESCRIPTOR)position;
+
+        if (descriptor->bLength < sizeof(USB_COMMON_DESCRIPTOR) ||
+            position + descriptor->bLength > end)
+        {
+            /* Malformed descriptor */
+            break;
+        }
+
+        if (descriptor->bDescriptorType == (UCHAR)DescriptorType)
+        {
+            return descriptor;
+        }
+
+        position += descriptor->bLength;
+    }
+
+    return NULL;
+}
+
+PUSB_INTERFACE_DESCRIPTOR
+USBD_ParseConfigurationDescriptorEx(PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor,
+                                    PVOID StartPosition,
+                                    LONG InterfaceNumber,
+                                    LONG AlternateSetting,
+                                    LONG InterfaceClass,
+                                    LONG InterfaceSubClass,
+                                    LONG InterfaceProtocol)
+{
+    PUCHAR  position = (PUCHAR)StartPosition;
+    ULONG   totalLength = ConfigurationDescriptor->wTotalLength;
+
+    while (TRUE)
+    {
+        PUSB_INTERFACE_DESCRIPTOR  descriptor;
+
+        descriptor = (PUSB_INTERFACE_DESCRIPTOR)
+            USBD_ParseDescriptors(ConfigurationDescriptor, totalLength,
+                                  position, USB_INTERFACE_DESCRIPTOR_TYPE);
+
+        if (descriptor == NULL)
+        {
+            return NULL;
+        }
+
+        if (descriptor->bLength >= sizeof(USB_INTERFACE_DESCRIPTOR) &&
+            (InterfaceNumber == -1 ||
+             descriptor->bInterfaceNumber == (UCHAR)InterfaceNumber) &&
+            (AlternateSetting == -1 ||
+             descriptor->bAlternateSetting == (UCHAR)AlternateSetting) &&
+            (InterfaceClass == -1 ||
+             descriptor->bInterfaceClass == (UCHAR)InterfaceClass) &&
+            (InterfaceSubClass == -1 ||
+             descriptor->bInterfaceSubClass == (UCHAR)InterfaceSubClass) &&
+            (InterfaceProtocol == -1 ||
+             descriptor->bInterfaceProtocol == (UCHAR)InterfaceProtocol))
+        {
+            return descriptor;
+        }
+
+        position = (PUCHAR)descriptor + descriptor->bLength;
+    }
+}
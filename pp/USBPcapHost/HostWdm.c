@@ -0,0 +1,835 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * User-mode implementation of the kernel routines declared in wdk/Wdm.h.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Wdm.h"
+#include "HostWdm.h"
+
+/* Difference between January 1, 1601 and January 1, 1970 in 100 ns units */
+#define HOST_EPOCH_DIFFERENCE  116444736000000000LL
+
+static __thread KIRQL hostCurrentIrql = PASSIVE_LEVEL;
+
+typedef struct _HOST_TRACKED_SPIN_LOCK
+{
+    PKSPIN_LOCK            lock;
+    PHOST_SPIN_LOCK_STATS  stats;
+} HOST_TRACKED_SPIN_LOCK;
+
+static HOST_TRACKED_SPIN_LOCK  hostTrackedLocks[HOST_MAX_TRACKED_SPIN_LOCKS];
+static ULONG                   hostTrackedLockCount = 0;
+
+ULONG DbgPrint(PCSTR Format, ...)
+{
+    va_list args;
+
+    va_start(args, Format);
+    vfprintf(stderr, Format, args);
+    va_end(args);
+    return 0;
+}
+
+int HostWcscmp(PCWSTR string1, PCWSTR string2)
+{
+    while (*string1 != UNICODE_NULL && *string1 == *string2)
+    {
+        string1++;
+        string2++;
+    }
+
+    return (int)*string1 - (int)*string2;
+}
+
+VOID RtlInitUnicodeString(PUNICODE_STRING DestinationString,
+                          PCWSTR SourceString)
+{
+    SIZE_T length = 0;
+
+    DestinationString->Buffer = (PWSTR)SourceString;
+    if (SourceString == NULL)
+    {
+        DestinationString->Length = 0;
+        DestinationString->MaximumLength = 0;
+        return;
+    }
+
+    while (SourceString[length] != UNICODE_NULL)
+    {
+        length++;
+    }
+
+    DestinationString->Length = (USHORT)(length * sizeof(WCHAR));
+    DestinationString->MaximumLength = (USHORT)((length + 1) * sizeof(WCHAR));
+}
+
+static WCHAR HostUpcase(WCHAR c)
+{
+    if (c >= 'a' && c <= 'z')
+    {
+        return (WCHAR)(c - 'a' + 'A');
+    }
+    return c;
+}
+
+BOOLEAN RtlEqualUnicodeString(PCUNICODE_STRING String1,
+                              PCUNICODE_STRING String2,
+                              BOOLEAN CaseInSensitive)
+{
+    USHORT i;
+
+    if (String1->Length != String2->Length)
+    {
+        return FALSE;
+    }
+
+    for (i = 0; i < String1->Length / sizeof(WCHAR); i++)
+    {
+        WCHAR a = String1->Buffer[i];
+        WCHAR b = String2->Buffer[i];
+
+        if (CaseInSensitive)
+        {
+            a = HostUpcase(a);
+            b = HostUpcase(b);
+        }
+
+        if (a != b)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+NTSTATUS RtlUnicodeStringToInteger(PCUNICODE_STRING String,
+                                   ULONG Base,
+                                   PULONG Value)
+{
+    USHORT  i;
+    USHORT  length = String->Length / sizeof(WCHAR);
+    ULONG   result = 0;
+
+    if (Base == 0)
+    {
+        Base = 10;
+    }
+
+    if (Base != 2 && Base != 8 && Base != 10 && Base != 16)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < length; i++)
+    {
+        WCHAR  c = HostUpcase(String->Buffer[i]);
+        ULONG  digit;
+
+        if (c >= '0' && c <= '9')
+        {
+            digit = c - '0';
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            digit = c - 'A' + 10;
+        }
+        else
+        {
+            break;
+        }
+
+        if (digit >= Base)
+        {
+            break;
+        }
+
+        result = result * Base + digit;
+    }
+
+    *Value = result;
+    return STATUS_SUCCESS;
+}
+
+KIRQL KeGetCurrentIrql(VOID)
+{
+    return hostCurrentIrql;
+}
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{
+    *SpinLock = 0;
+}
+
+ULONGLONG HostGetMonotonicNs(VOID)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 1000000000ULL + (ULONGLONG)ts.tv_nsec;
+}
+
+NTSTATUS HostTrackSpinLock(PKSPIN_LOCK SpinLock,
+                           PHOST_SPIN_LOCK_STATS Stats)
+{
+    if (hostTrackedLockCount >= HOST_MAX_TRACKED_SPIN_LOCKS)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    memset(Stats, 0, sizeof(HOST_SPIN_LOCK_STATS));
+    hostTrackedLocks[hostTrackedLockCount].lock = SpinLock;
+    hostTrackedLocks[hostTrackedLockCount].stats = Stats;
+    hostTrackedLockCount++;
+    return STATUS_SUCCESS;
+}
+
+VOID HostUntrackSpinLocks(VOID)
+{
+    hostTrackedLockCount = 0;
+}
+
+__inline static PHOST_SPIN_LOCK_STATS
+HostGetSpinLockStats(PKSPIN_LOCK SpinLock)
+{
+    ULONG i;
+
+    for (i = 0; i < hostTrackedLockCount; i++)
+    {
+        if (hostTrackedLocks[i].lock == SpinLock)
+        {
+            return hostTrackedLocks[i].stats;
+        }
+    }
+
+    return NULL;
+}
+
+VOID KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock)
+{
+    PHOST_SPIN_LOCK_STATS  stats = NULL;
+    ULONGLONG              start = 0;
+    BOOLEAN                contended = FALSE;
+
+    if (hostTrackedLockCount != 0)
+    {
+        stats = HostGetSpinLockStats(SpinLock);
+        if (stats != NULL)
+        {
+            start = HostGetMonotonicNs();
+        }
+    }
+
+    while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        contended = TRUE;
+        while (__atomic_load_n(SpinLock, __ATOMIC_RELAXED) != 0)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+
+    if (stats != NULL)
+    {
+        /* Lock is held, statistics can be updated without atomics */
+        ULONGLONG now = HostGetMonotonicNs();
+        ULONGLONG wait = now - start;
+
+        stats->acquisitions++;
+        if (contended)
+        {
+            stats->contentions++;
+        }
+        stats->waitNs += wait;
+        if (wait > stats->maxWaitNs)
+        {
+            stats->maxWaitNs = wait;
+        }
+        stats->acquiredAt = now;
+    }
+}
+
+VOID KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK SpinLock)
+{
+    if (hostTrackedLockCount != 0)
+    {
+        PHOST_SPIN_LOCK_STATS stats = HostGetSpinLockStats(SpinLock);
+
+        if (stats != NULL)
+        {
+            ULONGLONG hold = HostGetMonotonicNs() - stats->acquiredAt;
+
+            stats->holdNs += hold;
+            if (hold > stats->maxHoldNs)
+            {
+                stats->maxHoldNs = hold;
+            }
+        }
+    }
+
+    __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql)
+{
+    *OldIrql = hostCurrentIrql;
+    hostCurrentIrql = DISPATCH_LEVEL;
+    KeAcquireSpinLockAtDpcLevel(SpinLock);
+}
+
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql)
+{
+    KeReleaseSpinLockFromDpcLevel(SpinLock);
+    hostCurrentIrql = NewIrql;
+}
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Tag);
+
+    return malloc(NumberOfBytes);
+}
+
+PVOID ExAllocatePool(POOL_TYPE PoolType, SIZE_T NumberOfBytes)
+{
+    return ExAllocatePoolWithTag(PoolType, NumberOfBytes, 0);
+}
+
+VOID ExFreePool(PVOID P)
+{
+    free(P);
+}
+
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+
+    free(P);
+}
+
+VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    CurrentTime->QuadPart = (LONGLONG)ts.tv_sec * 10000000 +
+                            ts.tv_nsec / 100 + HOST_EPOCH_DIFFERENCE;
+}
+
+VOID KeQuerySystemTime(PLARGE_INTEGER CurrentTime)
+{
+    KeQuerySystemTimePrecise(CurrentTime);
+}
+
+VOID KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State)
+{
+    Event->Type = Type;
+    Event->SignalState = State ? 1 : 0;
+    pthread_mutex_init(&Event->HostMutex, NULL);
+    pthread_cond_init(&Event->HostCond, NULL);
+}
+
+LONG KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait)
+{
+    LONG previous;
+
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    pthread_mutex_lock(&Event->HostMutex);
+    previous = Event->SignalState;
+    Event->SignalState = 1;
+    if (Event->Type == NotificationEvent)
+    {
+        pthread_cond_broadcast(&Event->HostCond);
+    }
+    else
+    {
+        pthread_cond_signal(&Event->HostCond);
+    }
+    pthread_mutex_unlock(&Event->HostMutex);
+
+    return previous;
+}
+
+LONG KeResetEvent(PRKEVENT Event)
+{
+    LONG previous;
+
+    pthread_mutex_lock(&Event->HostMutex);
+    previous = Event->SignalState;
+    Event->SignalState = 0;
+    pthread_mutex_unlock(&Event->HostMutex);
+
+    return previous;
+}
+
+VOID KeClearEvent(PRKEVENT Event)
+{
+    KeResetEvent(Event);
+}
+
+LONG KeReadStateEvent(PRKEVENT Event)
+{
+    return __atomic_load_n(&Event->SignalState, __ATOMIC_ACQUIRE);
+}
+
+NTSTATUS KeWaitForSingleObject(PVOID Object,
+                               KWAIT_REASON WaitReason,
+                               KPROCESSOR_MODE WaitMode,
+                               BOOLEAN Alertable,
+                               PLARGE_INTEGER Timeout)
+{
+    PRKEVENT         Event = (PRKEVENT)Object;
+    NTSTATUS         status = STATUS_SUCCESS;
+    struct timespec  deadline;
+
+    UNREFERENCED_PARAMETER(WaitReason);
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+
+    if (Timeout != NULL)
+    {
+        LONGLONG interval;
+
+        if (Timeout->QuadPart < 0)
+        {
+            /* Relative timeout */
+            interval = -Timeout->QuadPart;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+        }
+        else
+        {
+            /* Absolute system time */
+            interval = Timeout->QuadPart - HOST_EPOCH_DIFFERENCE;
+            if (interval < 0)
+            {
+                interval = 0;
+            }
+            deadline.tv_sec = 0;
+            deadline.tv_nsec = 0;
+        }
+
+        deadline.tv_sec += interval / 10000000;
+        deadline.tv_nsec += (interval % 10000000) * 100;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&Event->HostMutex);
+    while (Event->SignalState == 0)
+    {
+        if (Timeout == NULL)
+        {
+            pthread_cond_wait(&Event->HostCond, &Event->HostMutex);
+        }
+        else if (pthread_cond_timedwait(&Event->HostCond, &Event->HostMutex,
+                                        &deadline) == ETIMEDOUT)
+        {
+            status = STATUS_TIMEOUT;
+            break;
+        }
+    }
+    if (status == STATUS_SUCCESS && Event->Type == SynchronizationEvent)
+    {
+        Event->SignalState = 0;
+    }
+    pthread_mutex_unlock(&Event->HostMutex);
+
+    return status;
+}
+
+VOID ObReferenceObject(PVOID Object)
+{
+    UNREFERENCED_PARAMETER(Object);
+}
+
+VOID ObDereferenceObject(PVOID Object)
+{
+    UNREFERENCED_PARAMETER(Object);
+}
+
+static struct _OBJECT_TYPE
+{
+    int unused;
+} hostEventObjectType;
+static POBJECT_TYPE hostEventObjectTypePointer = &hostEventObjectType;
+POBJECT_TYPE *ExEventObjectType = &hostEventObjectTypePointer;
+
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle,
+                                   ACCESS_MASK DesiredAccess,
+                                   POBJECT_TYPE ObjectType,
+                                   KPROCESSOR_MODE AccessMode,
+                                   PVOID *Object,
+                                   POBJECT_HANDLE_INFORMATION HandleInformation)
+{
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(HandleInformation);
+
+    if (Handle == NULL || ObjectType != *ExEventObjectType)
+    {
+        return STATUS_INVALID_HANDLE;
+    }
+
+    ObReferenceObject(Handle);
+    *Object = Handle;
+    return STATUS_SUCCESS;
+}
+
+PIRP IoAllocateIrp(CCHAR StackSize, BOOLEAN ChargeQuota)
+{
+    PIRP    irp;
+    SIZE_T  size;
+
+    UNREFERENCED_PARAMETER(ChargeQuota);
+
+    size = sizeof(IRP) + (SIZE_T)StackSize * sizeof(IO_STACK_LOCATION);
+    irp = (PIRP)calloc(1, size);
+    if (irp == NULL)
+    {
+        return NULL;
+    }
+
+    irp->Size = (USHORT)size;
+    irp->StackCount = StackSize;
+    irp->CurrentLocation = (CHAR)(StackSize + 1);
+    InitializeListHead(&irp->Tail.Overlay.ListEntry);
+    /* Stack locations follow the IRP, current points past the last one */
+    irp->Tail.Overlay.CurrentStackLocation =
+        ((PIO_STACK_LOCATION)(irp + 1)) + StackSize;
+
+    return irp;
+}
+
+VOID IoFreeIrp(PIRP Irp)
+{
+    free(Irp);
+}
+
+PMDL IoAllocateMdl(PVOID VirtualAddress,
+                   ULONG Length,
+                   BOOLEAN SecondaryBuffer,
+                   BOOLEAN ChargeQuota,
+                   PIRP Irp)
+{
+    PMDL mdl;
+
+    UNREFERENCED_PARAMETER(ChargeQuota);
+
+    mdl = (PMDL)calloc(1, sizeof(MDL));
+    if (mdl == NULL)
+    {
+        return NULL;
+    }
+
+    mdl->Size = (SHORT)sizeof(MDL);
+    mdl->StartVa = VirtualAddress;
+    mdl->MappedSystemVa = VirtualAddress;
+    mdl->ByteCount = Length;
+
+    if (Irp != NULL)
+    {
+        if (SecondaryBuffer && Irp->MdlAddress != NULL)
+        {
+            PMDL last = Irp->MdlAddress;
+
+            while (last->Next != NULL)
+            {
+                last = last->Next;
+            }
+            last->Next = mdl;
+        }
+        else
+        {
+            Irp->MdlAddress = mdl;
+        }
+    }
+
+    return mdl;
+}
+
+VOID IoFreeMdl(PMDL Mdl)
+{
+    free(Mdl);
+}
+
+VOID MmBuildMdlForNonPagedPool(PMDL MemoryDescriptorList)
+{
+    MemoryDescriptorList->MappedSystemVa = MemoryDescriptorList->StartVa;
+}
+
+VOID IoCompleteRequest(PIRP Irp, CCHAR PriorityBoost)
+{
+    UNREFERENCED_PARAMETER(PriorityBoost);
+
+    if (Irp->UserIosb != NULL)
+    {
+        *Irp->UserIosb = Irp->IoStatus;
+    }
+
+    if (Irp->UserEvent != NULL)
+    {
+        KeSetEvent(Irp->UserEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+NTSTATUS IoCallDriver(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+{
+    PIO_STACK_LOCATION  stack;
+    PDRIVER_DISPATCH    dispatch = NULL;
+
+    IoSetNextIrpStackLocation(Irp);
+    stack = IoGetCurrentIrpStackLocation(Irp);
+    stack->DeviceObject = DeviceObject;
+
+    if (DeviceObject->DriverObject != NULL &&
+        stack->MajorFunction <= IRP_MJ_MAXIMUM_FUNCTION)
+    {
+        dispatch = DeviceObject->DriverObject->MajorFunction[stack->MajorFunction];
+    }
+
+    if (dispatch == NULL)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    return dispatch(DeviceObject, Irp);
+}
+
+NTSTATUS IoCreateDevice(PDRIVER_OBJECT DriverObject,
+                        ULONG DeviceExtensionSize,
+                        PUNICODE_STRING DeviceName,
+                        ULONG DeviceType,
+                        ULONG DeviceCharacteristics,
+                        BOOLEAN Exclusive,
+                        PDEVICE_OBJECT *DeviceObject)
+{
+    PDEVICE_OBJECT device;
+
+    UNREFERENCED_PARAMETER(DeviceName);
+
+    /* Device extension directly follows the device object */
+    device = (PDEVICE_OBJECT)calloc(1, sizeof(DEVICE_OBJECT) +
+                                       DeviceExtensionSize);
+    if (device == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    device->Size = (USHORT)(sizeof(DEVICE_OBJECT) + DeviceExtensionSize);
+    device->ReferenceCount = 1;
+    device->DriverObject = DriverObject;
+    device->DeviceType = DeviceType;
+    device->Characteristics = DeviceCharacteristics;
+    device->Flags = DO_DEVICE_INITIALIZING;
+    if (Exclusive)
+    {
+        device->Flags |= DO_EXCLUSIVE;
+    }
+    device->StackSize = 1;
+    device->DeviceExtension = (DeviceExtensionSize > 0) ? (PVOID)(device + 1) : NULL;
+
+    if (DriverObject != NULL)
+    {
+        device->NextDevice = DriverObject->DeviceObject;
+        DriverObject->DeviceObject = device;
+    }
+
+    *DeviceObject = device;
+    return STATUS_SUCCESS;
+}
+
+VOID IoDeleteDevice(PDEVICE_OBJECT DeviceObject)
+{
+    PDRIVER_OBJECT driver = DeviceObject->DriverObject;
+
+    if (driver != NULL)
+    {
+        PDEVICE_OBJECT *link = &driver->DeviceObject;
+
+        while (*link != NULL && *link != DeviceObject)
+        {
+            link = &(*link)->NextDevice;
+        }
+        if (*link != NULL)
+        {
+            *link = DeviceObject->NextDevice;
+        }
+    }
+
+    free(DeviceObject);
+}
+
+PDEVICE_OBJECT IoGetAttachedDeviceReference(PDEVICE_OBJECT DeviceObject)
+{
+    while (DeviceObject->AttachedDevice != NULL)
+    {
+        DeviceObject = DeviceObject->AttachedDevice;
+    }
+
+    ObReferenceObject(DeviceObject);
+    return DeviceObject;
+}
+
+PIRP IoBuildSynchronousFsdRequest(ULONG MajorFunction,
+                                  PDEVICE_OBJECT DeviceObject,
+                                  PVOID Buffer,
+                                  ULONG Length,
+                                  PLARGE_INTEGER StartingOffset,
+                                  PKEVENT Event,
+                                  PIO_STATUS_BLOCK IoStatusBlock)
+{
+    UNREFERENCED_PARAMETER(MajorFunction);
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Length);
+    UNREFERENCED_PARAMETER(StartingOffset);
+    UNREFERENCED_PARAMETER(Event);
+    UNREFERENCED_PARAMETER(IoStatusBlock);
+
+    return NULL;
+}
+
+PIRP IoBuildDeviceIoControlRequest(ULONG IoControlCode,
+                                   PDEVICE_OBJECT DeviceObject,
+                                   PVOID InputBuffer,
+                                   ULONG InputBufferLength,
+                                   PVOID OutputBuffer,
+                                   ULONG OutputBufferLength,
+                                   BOOLEAN InternalDeviceIoControl,
+                                   PKEVENT Event,
+                                   PIO_STATUS_BLOCK IoStatusBlock)
+{
+    UNREFERENCED_PARAMETER(IoControlCode);
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(InputBuffer);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBuffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InternalDeviceIoControl);
+    UNREFERENCED_PARAMETER(Event);
+    UNREFERENCED_PARAMETER(IoStatusBlock);
+
+    return NULL;
+}
+
+NTSTATUS IoGetDeviceProperty(PDEVICE_OBJECT DeviceObject,
+                             DEVICE_REGISTRY_PROPERTY DeviceProperty,
+                             ULONG BufferLength,
+                             PVOID PropertyBuffer,
+                             PULONG ResultLength)
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(DeviceProperty);
+    UNREFERENCED_PARAMETER(BufferLength);
+    UNREFERENCED_PARAMETER(PropertyBuffer);
+
+    *ResultLength = 0;
+    return STATUS_INVALID_DEVICE_REQUEST;
+}
+
+NTSTATUS IoGetDeviceInterfaces(const GUID *InterfaceClassGuid,
+                               PDEVICE_OBJECT PhysicalDeviceObject,
+                               ULONG Flags,
+                               PWSTR *SymbolicLinkList)
+{
+    UNREFERENCED_PARAMETER(InterfaceClassGuid);
+    UNREFERENCED_PARAMETER(PhysicalDeviceObject);
+    UNREFERENCED_PARAMETER(Flags);
+
+    *SymbolicLinkList = NULL;
+    return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS RtlQueryRegistryValues(ULONG RelativeTo,
+                                PCWSTR Path,
+                                PRTL_QUERY_REGISTRY_TABLE QueryTable,
+                                PVOID Context,
+                                PVOID Environment)
+{
+    UNREFERENCED_PARAMETER(RelativeTo);
+    UNREFERENCED_PARAMETER(Path);
+    UNREFERENCED_PARAMETER(QueryTable);
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Environment);
+
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+NTSTATUS IoCsqInitialize(PIO_CSQ Csq,
+                         PIO_CSQ_INSERT_IRP CsqInsertIrp,
+                         PIO_CSQ_REMOVE_IRP CsqRemoveIrp,
+                         PIO_CSQ_PEEK_NEXT_IRP CsqPeekNextIrp,
+                         PIO_CSQ_ACQUIRE_LOCK CsqAcquireLock,
+                         PIO_CSQ_RELEASE_LOCK CsqReleaseLock,
+                         PIO_CSQ_COMPLETE_CANCELED_IRP CsqCompleteCanceledIrp)
+{
+    Csq->Type = 0;
+    Csq->CsqInsertIrp = CsqInsertIrp;
+    Csq->CsqRemoveIrp = CsqRemoveIrp;
+    Csq->CsqPeekNextIrp = CsqPeekNextIrp;
+    Csq->CsqAcquireLock = CsqAcquireLock;
+    Csq->CsqReleaseLock = CsqReleaseLock;
+    Csq->CsqCompleteCanceledIrp = CsqCompleteCanceledIrp;
+    Csq->ReservePointer = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Host IRPs cannot be cancelled asynchronously, so the queue only has to
+ * serialize the callbacks with the queue lock.
+ */
+VOID IoCsqInsertIrp(PIO_CSQ Csq, PIRP Irp, PIO_CSQ_IRP_CONTEXT Context)
+{
+    KIRQL irql;
+
+    if (Context != NULL)
+    {
+        Context->Irp = Irp;
+        Context->Csq = Csq;
+    }
+
+    Csq->CsqAcquireLock(Csq, &irql);
+    IoMarkIrpPending(Irp);
+    Csq->CsqInsertIrp(Csq, Irp);
+    Csq->CsqReleaseLock(Csq, irql);
+}
+
+PIRP IoCsqRemoveNextIrp(PIO_CSQ Csq, PVOID PeekContext)
+{
+    KIRQL  irql;
+    PIRP   irp;
+
+    Csq->CsqAcquireLock(Csq, &irql);
+    irp = Csq->CsqPeekNextIrp(Csq, NULL, PeekContext);
+    if (irp != NULL)
+    {
+        Csq->CsqRemoveIrp(Csq, irp);
+    }
+    Csq->CsqReleaseLock(Csq, irql);
+
+    return irp;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Host-only extensions of the kernel shim runtime. None of these have a
+ * WDK counterpart; they let host programs observe the shim from outside.
+ */
+
+#ifndef USBPCAP_HOST_HOSTWDM_H
+#define USBPCAP_HOST_HOSTWDM_H
+
+#include "Wdm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of spin locks that can be tracked at the same time */
+#define HOST_MAX_TRACKED_SPIN_LOCKS  64
+
+/*
+ * Per spin lock statistics. All fields are updated by the lock owner
+ * while the lock is held, so a single structure must not be shared by
+ * two different locks.
+ */
+typedef struct _HOST_SPIN_LOCK_STATS
+{
+    ULONGLONG  acquisitions;
+    ULONGLONG  contentions;  /* acquisitions that had to spin */
+    ULONGLONG  waitNs;       /* total time spent acquiring */
+    ULONGLONG  holdNs;       /* total time the lock was held */
+    ULONGLONG  maxWaitNs;
+    ULONGLONG  maxHoldNs;
+    ULONGLONG  acquiredAt;   /* internal, valid while lock is held */
+} HOST_SPIN_LOCK_STATS, *PHOST_SPIN_LOCK_STATS;
+
+/*
+ * Starts collecting statistics for SpinLock into Stats.
+ *
+ * Tracking adds two clock reads to every acquire/release pair of the
+ * tracked lock. Must not be called while any tracked or to be tracked
+ * lock is in use by other threads.
+ */
+NTSTATUS HostTrackSpinLock(PKSPIN_LOCK SpinLock,
+                           PHOST_SPIN_LOCK_STATS Stats);
+
+/* Stops collecting statistics for all tracked spin locks */
+VOID HostUntrackSpinLocks(VOID);
+
+/* Monotonic clock in nanoseconds */
+ULONGLONG HostGetMonotonicNs(VOID);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBPCAP_HOST_HOSTWDM_H */
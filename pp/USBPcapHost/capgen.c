@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include "capgen.h"
+
+static unsigned char *put_pcap16(unsigned char *p, unsigned int value,
+                                 unsigned int flags)
+{
+    if (flags & CAPGEN_SWAPPED)
+    {
+        value = ((value & 0xFF) << 8) | ((value >> 8) & 0xFF);
+    }
+    return put16(p, value);
+}
+
+static unsigned char *put_pcap32(unsigned char *p, unsigned int value,
+                                 unsigned int flags)
+{
+    if (flags & CAPGEN_SWAPPED)
+    {
+        value = (value << 24) | ((value & 0xFF00) << 8) |
+                ((value >> 8) & 0xFF00) | (value >> 24);
+    }
+    return put32(p, value);
+}
+
+void capgen_urb_init(struct capgen_urb *urb, unsigned int device,
+                     unsigned int endpoint, unsigned int transfer)
+{
+    memset(urb, 0, sizeof(struct capgen_urb));
+    urb->function = CAPGEN_FUNCTION_BULK;
+    urb->bus = 1;
+    urb->device = device;
+    urb->endpoint = endpoint;
+    urb->transfer = transfer;
+}
+
+unsigned char *capgen_file_header(unsigned char *p, unsigned int flags)
+{
+    p = put_pcap32(p, (flags & CAPGEN_NANOSECOND) ? PCAP_MAGIC_NANOSECOND : PCAP_MAGIC,
+                   flags);
+    p = put_pcap16(p, 2, flags);
+    p = put_pcap16(p, 4, flags);
+    p = put_pcap32(p, 0, flags);
+    p = put_pcap32(p, 0, flags);
+    p = put_pcap32(p, CAPGEN_SNAPLEN, flags);
+    return put_pcap32(p, DLT_USBPCAP, flags);
+}
+
+unsigned int capgen_record_len(const struct capgen_urb *urb, unsigned int payload_len)
+{
+    return PCAP_REC_HDR_LEN + USBPCAP_HDR_LEN + urb->extra_len + payload_len;
+}
+
+unsigned char *capgen_record(unsigned char *p, unsigned int flags,
+                             unsigned long long timestamp,
+                             const struct capgen_urb *urb,
+                             const void *payload, unsigned int payload_len)
+{
+    unsigned int header_len = USBPCAP_HDR_LEN + urb->extra_len;
+    unsigned int fraction = (unsigned int)(timestamp % 1000000000ULL);
+
+    p = put_pcap32(p, (unsigned int)(timestamp / 1000000000ULL), flags);
+    p = put_pcap32(p, (flags & CAPGEN_NANOSECOND) ? fraction : fraction / 1000, flags);
+    p = put_pcap32(p, header_len + payload_len, flags);
+    p = put_pcap32(p, header_len + payload_len, flags);
+
+    p = put16(p, header_len);
+    p = put64(p, urb->irp);
+    p = put32(p, urb->status);
+    p = put16(p, urb->function);
+    *p++ = (unsigned char)urb->info;
+    p = put16(p, urb->bus);
+    p = put16(p, urb->device);
+    *p++ = (unsigned char)urb->endpoint;
+    *p++ = (unsigned char)urb->transfer;
+    p = put32(p, payload_len);
+
+    if (urb->extra_len != 0)
+    {
+        memcpy(p, urb->extra, urb->extra_len);
+        p += urb->extra_len;
+    }
+    if (payload != NULL)
+    {
+        memcpy(p, payload, payload_len);
+    }
+    else
+    {
+        memset(p, 0, payload_len);
+    }
+    return p + payload_len;
+}
+
+int capgen_create(struct capgen_file *g, const char *path, unsigned int flags,
+                  size_t buffer_size)
+{
+    unsigned char header[PCAP_HDR_LEN];
+
+    memset(g, 0, sizeof(struct capgen_file));
+    g->flags = flags;
+    g->record = malloc(PCAP_REC_HDR_LEN + CAPGEN_SNAPLEN);
+    g->f = fopen(path, "wb");
+    if ((g->record == NULL) || (g->f == NULL))
+    {
+        free(g->record);
+        if (g->f != NULL)
+        {
+            fclose(g->f);
+        }
+        return 0;
+    }
+    setvbuf(g->f, NULL, _IOFBF, buffer_size);
+
+    capgen_file_header(header, flags);
+    if (fwrite(header, 1, sizeof(header), g->f) != sizeof(header))
+    {
+        g->failed = 1;
+    }
+    g->written = sizeof(header);
+    return 1;
+}
+
+void capgen_write(struct capgen_file *g, unsigned long long timestamp,
+                  const struct capgen_urb *urb,
+                  const void *payload, unsigned int payload_len)
+{
+    size_t length;
+
+    length = capgen_record(g->record, g->flags, timestamp, urb, payload, payload_len) -
+             g->record;
+    if (fwrite(g->record, 1, length, g->f) != length)
+    {
+        g->failed = 1;
+        return;
+    }
+    g->written += length;
+}
+
+int capgen_close(struct capgen_file *g)
+{
+    int ok = !g->failed;
+
+    free(g->record);
+    if (fclose(g->f) != 0)
+    {
+        ok = 0;
+    }
+    return ok;
+}
+
+unsigned char *capgen_load(const char *path, size_t *length)
+{
+    unsigned char *data;
+    long size;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(size > 0 ? (size_t)size : 1);
+    if ((data == NULL) || (fread(data, 1, (size_t)size, f) != (size_t)size))
+    {
+        fprintf(stderr, "Failed to read %s\n", path);
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *length = (size_t)size;
+    return data;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Synthetic DLT_USBPCAP captures for host tools.
+ *
+ * Benchmarks generate their own workload and check what the code under
+ * test finds in it against what was generated. Workloads differ, the
+ * records do not: capgen_record() builds one in memory, capgen_write()
+ * appends one to capture file created with capgen_create().
+ *
+ * pcap headers are written little endian, as USBPcapDriver writes them,
+ * or big endian with CAPGEN_SWAPPED. USBPcap headers are always little
+ * endian.
+ */
+
+#ifndef USBPCAP_HOST_CAPGEN_H
+#define USBPCAP_HOST_CAPGEN_H
+
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "include/USBPcap.h"
+#include "../USBPcapCMD/bytes.h"
+
+#define CAPGEN_NANOSECOND  0x01 /* Timestamp fraction is nanoseconds */
+#define CAPGEN_SWAPPED     0x02 /* Written as big endian host would */
+
+#define CAPGEN_SNAPLEN     65535
+
+/* URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER */
+#define CAPGEN_FUNCTION_BULK 0x0009
+
+struct capgen_urb
+{
+    unsigned long long   irp;
+    unsigned int         status;
+    unsigned int         function;
+    unsigned int         info;      /* USBPCAP_INFO_PDO_TO_FDO for completion */
+    unsigned int         bus;
+    unsigned int         device;
+    unsigned int         endpoint;
+    unsigned int         transfer;
+
+    /* Header following USBPCAP_BUFFER_PACKET_HEADER, e.g. control stage
+     * or isochronous packets. headerLen includes it.
+     */
+    const void          *extra;
+    unsigned int         extra_len;
+};
+
+struct capgen_file
+{
+    FILE                *f;
+    unsigned int         flags;
+    unsigned char       *record;    /* CAPGEN_SNAPLEN record being written */
+    unsigned long long   written;   /* Bytes, including file header */
+    int                  failed;
+};
+
+/* URB of bulk or interrupt endpoint on bus 1, other fields zero */
+void capgen_urb_init(struct capgen_urb *urb, unsigned int device,
+                     unsigned int endpoint, unsigned int transfer);
+
+/* Writes PCAP_HDR_LEN bytes, returns position following them */
+unsigned char *capgen_file_header(unsigned char *p, unsigned int flags);
+
+/* Length of record, including pcap record header */
+unsigned int capgen_record_len(const struct capgen_urb *urb, unsigned int payload_len);
+
+/*
+ * Writes record with timestamp in nanoseconds since epoch. NULL payload
+ * is written as zeros. Returns position following the record.
+ */
+unsigned char *capgen_record(unsigned char *p, unsigned int flags,
+                             unsigned long long timestamp,
+                             const struct capgen_urb *urb,
+                             const void *payload, unsigned int payload_len);
+
+/* Creates capture file with stdio buffer of given size. Returns 0 on failure. */
+int capgen_create(struct capgen_file *g, const char *path, unsigned int flags,
+                  size_t buffer_size);
+
+void capgen_write(struct capgen_file *g, unsigned long long timestamp,
+                  const struct capgen_urb *urb,
+                  const void *payload, unsigned int payload_len);
+
+/* Returns 0 if any record could not be written */
+int capgen_close(struct capgen_file *g);
+
+/* Reads whole file, returns NULL on failure. Must be freed using free(). */
+unsigned char *capgen_load(const char *path, size_t *length);
+
+#endif /* USBPCAP_HOST_CAPGEN_H */
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Descriptor cache benchmark.
+ *
+ * Builds cache of generated devices spread over a tree of hubs, then
+ * measures how long USBPcapCMD takes to load it (parse) and to look up
+ * every connected device, which is all --inject-descriptors does for
+ * devices that did not change since the previous capture. Round trip
+ * and rejection of corrupted cache are checked too.
+ *
+ * With --dump the given cache file (e.g. %TEMP%\USBPcap1_descriptors.cache
+ * copied from Windows) is listed instead.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../USBPcapCMD/desccache.h"
+
+#define DEFAULT_DEVICES      64
+#define DEFAULT_CONFIG_LEN   128
+#define DEFAULT_ROUNDS       10000
+
+/* Ports per generated hub */
+#define HUB_PORTS            7
+
+struct bench
+{
+    unsigned int devices;
+    unsigned int config_len;
+    unsigned int rounds;
+    int json;
+
+    struct desccache cache;
+    unsigned char *data;
+    size_t length;
+
+    unsigned long long parse_ns;
+    unsigned long long find_ns;
+    unsigned long long errors;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "       %s --dump FILE\n"
+        "  -n, --devices N        number of cached devices (default %d)\n"
+        "  -c, --config N         configuration descriptor length (default %d)\n"
+        "  -r, --rounds N         number of measured loads (default %d)\n"
+        "      --dump FILE        list entries of cache file\n"
+        "      --json             print results as JSON\n",
+        argv0, argv0, DEFAULT_DEVICES, DEFAULT_CONFIG_LEN, DEFAULT_ROUNDS);
+}
+
+/* Port path of n-th device, hubs fill up breadth first */
+static void device_path(unsigned int n, char *path, size_t size)
+{
+    unsigned int ports[DESCCACHE_MAX_PATH];
+    unsigned int depth = 0;
+    size_t len = 0;
+
+    for (;;)
+    {
+        ports[depth] = n % HUB_PORTS + 1;
+        depth++;
+        n /= HUB_PORTS;
+        if (n == 0)
+        {
+            break;
+        }
+        n--;
+    }
+
+    /* Port numbers were generated leaf first */
+    path[0] = '\0';
+    while ((depth > 0) && (len < size))
+    {
+        depth--;
+        len += (size_t)snprintf(&path[len], size - len, "%s%u",
+                                (len > 0) ? "." : "", ports[depth]);
+    }
+}
+
+static void device_descriptor(unsigned int n, unsigned char *device)
+{
+    unsigned int i;
+
+    for (i = 0; i < DESCCACHE_DEVICE_LEN; i++)
+    {
+        device[i] = (unsigned char)(n * 7 + i);
+    }
+    device[0] = DESCCACHE_DEVICE_LEN;
+    device[1] = 1; /* DEVICE */
+}
+
+static void config_descriptor(unsigned int n, unsigned char *config, unsigned int length)
+{
+    unsigned int i;
+
+    for (i = 0; i < length; i++)
+    {
+        config[i] = (unsigned char)(n + i * 3);
+    }
+}
+
+static int build(struct bench *bench)
+{
+    unsigned char device[DESCCACHE_DEVICE_LEN];
+    unsigned char *config = malloc(bench->config_len);
+    char path[DESCCACHE_MAX_PATH];
+    unsigned int n;
+
+    if (config == NULL)
+    {
+        return 0;
+    }
+
+    desccache_init(&bench->cache);
+    for (n = 0; n < bench->devices; n++)
+    {
+        device_path(n, path, sizeof(path));
+        device_descriptor(n, device);
+        config_descriptor(n, config, bench->config_len);
+        if (!desccache_add(&bench->cache, path, (unsigned short)(n + 1), device,
+                           config, (unsigned short)bench->config_len))
+        {
+            fprintf(stderr, "Failed to add device %u (%s)\n", n, path);
+            free(config);
+            return 0;
+        }
+    }
+    free(config);
+
+    bench->data = desccache_serialize(&bench->cache, &bench->length);
+    desccache_free(&bench->cache);
+    return bench->data != NULL;
+}
+
+/* Loads serialized cache and looks up every device like USBPcapCMD does */
+static void run(struct bench *bench)
+{
+    unsigned char device[DESCCACHE_DEVICE_LEN];
+    unsigned char *config = malloc(bench->config_len);
+    char path[DESCCACHE_MAX_PATH];
+    const struct desccache_entry *entry;
+    unsigned long long start;
+    unsigned int round;
+    unsigned int n;
+
+    for (round = 0; round < bench->rounds; round++)
+    {
+        start = now_ns();
+        if (!desccache_parse(&bench->cache, bench->data, bench->length))
+        {
+            bench->errors++;
+        }
+        bench->parse_ns += now_ns() - start;
+
+        for (n = 0; n < bench->devices; n++)
+        {
+            device_path(n, path, sizeof(path));
+            device_descriptor(n, device);
+
+            start = now_ns();
+            entry = desccache_find(&bench->cache, path, (unsigned short)(n + 1), device);
+            bench->find_ns += now_ns() - start;
+
+            if (round > 0)
+            {
+                continue;
+            }
+
+            /* Content is checked once */
+            config_descriptor(n, config, bench->config_len);
+            if ((entry == NULL) || (entry->config_len != bench->config_len) ||
+                (memcmp(entry->config, config, bench->config_len) != 0))
+            {
+                bench->errors++;
+            }
+
+            /* Re-enumerated device must not hit */
+            if (desccache_find(&bench->cache, path, (unsigned short)(n + 2), device) != NULL)
+            {
+                bench->errors++;
+            }
+        }
+    }
+    desccache_free(&bench->cache);
+    free(config);
+
+    /* Any corrupted byte makes the whole cache unused */
+    for (n = 0; n < bench->length; n += (bench->length / 97) + 1)
+    {
+        bench->data[n] ^= 0x40;
+        if (desccache_parse(&bench->cache, bench->data, bench->length))
+        {
+            fprintf(stderr, "Corrupted byte %u was not noticed\n", n);
+            bench->errors++;
+        }
+        bench->data[n] ^= 0x40;
+    }
+    if (bench->length > 0)
+    {
+        if (desccache_parse(&bench->cache, bench->data, bench->length - 1))
+        {
+            bench->errors++;
+        }
+    }
+    desccache_free(&bench->cache);
+}
+
+static int dump(const char *filename)
+{
+    struct desccache cache;
+    unsigned char *data;
+    long length;
+    FILE *f;
+    unsigned int i;
+    unsigned int j;
+
+    f = fopen(filename, "rb");
+    if (f == NULL)
+    {
+        perror(filename);
+        return EXIT_FAILURE;
+    }
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(length > 0 ? (size_t)length : 1);
+    if ((data == NULL) || (fread(data, 1, (size_t)length, f) != (size_t)length))
+    {
+        fprintf(stderr, "Failed to read %s\n", filename);
+        fclose(f);
+        free(data);
+        return EXIT_FAILURE;
+    }
+    fclose(f);
+
+    desccache_init(&cache);
+    if (!desccache_parse(&cache, data, (size_t)length))
+    {
+        fprintf(stderr, "%s is not a valid descriptor cache\n", filename);
+        free(data);
+        return EXIT_FAILURE;
+    }
+    free(data);
+
+    for (i = 0; i < cache.count; i++)
+    {
+        const struct desccache_entry *entry = &cache.entries[i];
+
+        printf("port %s address %u VID %02X%02X PID %02X%02X config %u bytes:",
+               entry->path, entry->address,
+               entry->device[9], entry->device[8],
+               entry->device[11], entry->device[10],
+               entry->config_len);
+        for (j = 0; j < entry->config_len; j++)
+        {
+            printf(" %02X", entry->config[j]);
+        }
+        printf("\n");
+    }
+    desccache_free(&cache);
+    return EXIT_SUCCESS;
+}
+
+static void print_results(struct bench *bench)
+{
+    double parse_us = (double)bench->parse_ns / bench->rounds / 1e3;
+    double find_ns = (double)bench->find_ns / bench->rounds / bench->devices;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"devices\": %u,\n", bench->devices);
+        printf("  \"config_bytes\": %u,\n", bench->config_len);
+        printf("  \"cache_bytes\": %zu,\n", bench->length);
+        printf("  \"rounds\": %u,\n", bench->rounds);
+        printf("  \"parse_us\": %.3f,\n", parse_us);
+        printf("  \"find_ns\": %.1f,\n", find_ns);
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+    }
+    else
+    {
+        printf("Cache of %u devices is %zu bytes\n", bench->devices, bench->length);
+        printf("Load: %.3f us, lookup: %.1f ns per device\n", parse_us, find_ns);
+        printf("Errors: %llu\n", bench->errors);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"devices", required_argument, NULL, 'n'},
+        {"config",  required_argument, NULL, 'c'},
+        {"rounds",  required_argument, NULL, 'r'},
+        {"dump",    required_argument, NULL, 'D'},
+        {"json",    no_argument,       NULL, 'J'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench bench;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.devices = DEFAULT_DEVICES;
+    bench.config_len = DEFAULT_CONFIG_LEN;
+    bench.rounds = DEFAULT_ROUNDS;
+
+    while ((c = getopt_long(argc, argv, "n:c:r:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                bench.devices = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                bench.config_len = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench.rounds = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'D':
+                return dump(optarg);
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((bench.devices == 0) || (bench.devices > 65534) ||
+        (bench.config_len < 9) || (bench.config_len > 65535) ||
+        (bench.rounds == 0))
+    {
+        fprintf(stderr, "Invalid number of devices, configuration length or rounds.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!build(&bench))
+    {
+        fprintf(stderr, "Failed to build cache.\n");
+        return EXIT_FAILURE;
+    }
+
+    run(&bench);
+    print_results(&bench);
+    free(bench.data);
+    return (bench.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Unbuffered output benchmark.
+ *
+ * Writes a capture sized stream, passed in pieces of varying length like
+ * USBPcapCMD writer passes records, once through the page cache and once
+ * with O_DIRECT (and O_DSYNC with --sync), the Linux counterparts of
+ * FILE_FLAG_NO_BUFFERING and FILE_FLAG_WRITE_THROUGH. Direct output is
+ * packed into aligned blocks by the same packer USBPcapCMD --direct-io
+ * uses, including tail writes on flush and truncation at the end.
+ *
+ * Both files are read back and every byte is checked. O_DIRECT is not
+ * supported on every file system (tmpfs for example), use -o to place
+ * the file on the disk to be measured.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../USBPcapCMD/blockpack.h"
+
+#define DEFAULT_TOTAL_MB     512
+#define DEFAULT_PIECE_SIZE   (64*1024)
+#define DEFAULT_BLOCK_SIZE   (1024*1024)
+#define DEFAULT_BLOCKS       5    /* MAX_PENDING_WRITES + 1 */
+#define DEFAULT_FILE         "directbench.tmp"
+
+struct result
+{
+    const char *mode;
+    unsigned long long write_ns;  /* Until last write returned */
+    unsigned long long total_ns;  /* Including fsync() and truncation */
+    unsigned long long flushes;
+    unsigned long long tails;     /* Partial blocks written */
+};
+
+struct bench
+{
+    unsigned long long total_bytes;
+    unsigned int piece_size;
+    unsigned int block_size;
+    unsigned int blocks;
+    unsigned int flush_mb;
+    const char *filename;
+    int sync;
+    int keep;
+    int json;
+
+    unsigned char *piece;
+    struct result results[2];
+    unsigned int count;
+
+    unsigned long long errors;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -n, --size MB          amount of data to write (default %d)\n"
+        "      --bytes N          amount of data to write in bytes\n"
+        "  -p, --piece N          largest piece passed at once (default %d)\n"
+        "  -B, --block N          direct I/O block size (default %d)\n"
+        "      --blocks N         blocks in packer pool (default %d)\n"
+        "  -f, --flush MB         write partial block every MB (default never)\n"
+        "  -o, --output FILE      file to write (default %s)\n"
+        "      --sync             open with O_DSYNC as well\n"
+        "      --keep             do not remove the file\n"
+        "      --json             print results as JSON\n",
+        argv0, DEFAULT_TOTAL_MB, DEFAULT_PIECE_SIZE, DEFAULT_BLOCK_SIZE,
+        DEFAULT_BLOCKS, DEFAULT_FILE);
+}
+
+/* Byte at given stream offset */
+static unsigned char pattern(unsigned long long offset)
+{
+    return (unsigned char)((offset * 131) ^ (offset >> 12));
+}
+
+/* Length of next piece, records vary a lot in size */
+static unsigned int piece_length(struct bench *bench, unsigned int *state,
+                                 unsigned long long offset)
+{
+    unsigned int length;
+
+    *state = *state * 1103515245 + 12345;
+    length = 1 + (*state >> 8) % bench->piece_size;
+    if (length > bench->total_bytes - offset)
+    {
+        length = (unsigned int)(bench->total_bytes - offset);
+    }
+    return length;
+}
+
+static void fill(unsigned char *p, unsigned int length, unsigned long long offset)
+{
+    unsigned int i;
+
+    for (i = 0; i < length; i++)
+    {
+        p[i] = pattern(offset + i);
+    }
+}
+
+static int write_all(int fd, const unsigned char *data, size_t length,
+                     unsigned long long offset)
+{
+    ssize_t written;
+
+    while (length > 0)
+    {
+        written = pwrite(fd, data, length, (off_t)offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+        data += written;
+        length -= (size_t)written;
+        offset += (unsigned long long)written;
+    }
+    return 1;
+}
+
+static int flush_due(struct bench *bench, unsigned long long before,
+                     unsigned long long after)
+{
+    unsigned long long interval = (unsigned long long)bench->flush_mb * 1024 * 1024;
+
+    return (interval > 0) && (before / interval != after / interval);
+}
+
+static int run_buffered(struct bench *bench, struct result *r)
+{
+    unsigned long long offset = 0;
+    unsigned long long start;
+    unsigned int state = 1;
+    unsigned int length;
+    int fd;
+
+    fd = open(bench->filename, O_WRONLY | O_CREAT | O_TRUNC |
+              (bench->sync ? O_DSYNC : 0), 0644);
+    if (fd < 0)
+    {
+        perror(bench->filename);
+        return 0;
+    }
+
+    start = now_ns();
+    while (offset < bench->total_bytes)
+    {
+        length = piece_length(bench, &state, offset);
+        fill(bench->piece, length, offset);
+        if (!write_all(fd, bench->piece, length, offset))
+        {
+            perror("write");
+            close(fd);
+            return 0;
+        }
+        if (flush_due(bench, offset, offset + length))
+        {
+            fdatasync(fd);
+            r->flushes++;
+        }
+        offset += length;
+    }
+    r->write_ns = now_ns() - start;
+    fsync(fd);
+    r->total_ns = now_ns() - start;
+    close(fd);
+    return 1;
+}
+
+static int write_tail(struct blockpack *bp, int fd, struct result *r)
+{
+    struct bufpool_buffer *block;
+    unsigned long long offset;
+    size_t length;
+
+    block = blockpack_tail(bp, &offset, &length);
+    if (block == NULL)
+    {
+        return 1;
+    }
+    r->tails++;
+    return write_all(fd, block->data, length, offset);
+}
+
+static int run_direct(struct bench *bench, struct result *r)
+{
+    struct bufpool_buffer *block;
+    struct blockpack bp;
+    unsigned long long offset = 0;
+    unsigned long long block_offset;
+    unsigned long long start;
+    unsigned int state = 1;
+    unsigned int length;
+    unsigned int pos;
+    size_t n;
+    int ok = 1;
+    int fd;
+
+    if (!blockpack_init(&bp, bench->blocks, bench->block_size, BLOCKPACK_ALIGNMENT))
+    {
+        fprintf(stderr, "Failed to allocate blocks\n");
+        return 0;
+    }
+
+    fd = open(bench->filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT |
+              (bench->sync ? O_DSYNC : 0), 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: %s%s\n", bench->filename, strerror(errno),
+                (errno == EINVAL) ? " (no O_DIRECT on this file system?)" : "");
+        blockpack_destroy(&bp);
+        return 0;
+    }
+
+    start = now_ns();
+    while (ok && (offset < bench->total_bytes))
+    {
+        length = piece_length(bench, &state, offset);
+        fill(bench->piece, length, offset);
+
+        /* Same loop as write_direct() in USBPcapCMD, writes are
+         * synchronous so a block is free again once written.
+         */
+        for (pos = 0; ok && (pos < length); pos += (unsigned int)n)
+        {
+            n = blockpack_put(&bp, &bench->piece[pos], length - pos);
+            block = blockpack_take(&bp, &block_offset);
+            if (block != NULL)
+            {
+                ok = write_all(fd, block->data, block->length, block_offset);
+                blockpack_release(&bp, block);
+            }
+            else if (n == 0)
+            {
+                fprintf(stderr, "Packer has no free block\n");
+                ok = 0;
+            }
+        }
+
+        if (ok && flush_due(bench, offset, offset + length))
+        {
+            ok = write_tail(&bp, fd, r);
+            r->flushes++;
+        }
+        offset += length;
+    }
+    r->write_ns = now_ns() - start;
+
+    if (ok)
+    {
+        ok = write_tail(&bp, fd, r) &&
+             (ftruncate(fd, (off_t)blockpack_length(&bp)) == 0);
+        if (!ok)
+        {
+            perror("write");
+        }
+        fsync(fd);
+    }
+    r->total_ns = now_ns() - start;
+
+    close(fd);
+    blockpack_destroy(&bp);
+    return ok;
+}
+
+/* Reads the file back, every byte has to match the stream */
+static void verify(struct bench *bench, struct result *r)
+{
+    unsigned long long offset = 0;
+    struct stat st;
+    ssize_t got;
+    ssize_t i;
+    int fd;
+
+    fd = open(bench->filename, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) != 0))
+    {
+        perror(bench->filename);
+        bench->errors++;
+        return;
+    }
+
+    if ((unsigned long long)st.st_size != bench->total_bytes)
+    {
+        fprintf(stderr, "%s file is %lld bytes instead of %llu\n", r->mode,
+                (long long)st.st_size, bench->total_bytes);
+        bench->errors++;
+    }
+
+    while ((got = read(fd, bench->piece, bench->piece_size)) > 0)
+    {
+        for (i = 0; i < got; i++)
+        {
+            if (bench->piece[i] != pattern(offset + i))
+            {
+                bench->errors++;
+            }
+        }
+        offset += (unsigned long long)got;
+    }
+    close(fd);
+}
+
+static void run(struct bench *bench, const char *mode,
+                int (*fn)(struct bench *, struct result *))
+{
+    struct result *r = &bench->results[bench->count++];
+
+    memset(r, 0, sizeof(struct result));
+    r->mode = mode;
+    if (!fn(bench, r))
+    {
+        bench->errors++;
+    }
+    else
+    {
+        verify(bench, r);
+    }
+
+    if (!bench->keep)
+    {
+        unlink(bench->filename);
+    }
+}
+
+static double mb_per_s(unsigned long long bytes, unsigned long long ns)
+{
+    return ns ? (double)bytes * 1e3 / ns : 0.0;
+}
+
+static void print_results(struct bench *bench)
+{
+    unsigned int i;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"bytes\": %llu,\n", bench->total_bytes);
+        printf("  \"block_size\": %u,\n", bench->block_size);
+        printf("  \"sync\": %s,\n", bench->sync ? "true" : "false");
+        printf("  \"modes\": [\n");
+        for (i = 0; i < bench->count; i++)
+        {
+            const struct result *r = &bench->results[i];
+
+            printf("    {\"mode\": \"%s\", \"write_mb_s\": %.1f, \"total_mb_s\": %.1f, "
+                   "\"flushes\": %llu, \"tail_writes\": %llu}%s\n",
+                   r->mode, mb_per_s(bench->total_bytes, r->write_ns),
+                   mb_per_s(bench->total_bytes, r->total_ns), r->flushes,
+                   r->tails, (i + 1 < bench->count) ? "," : "");
+        }
+        printf("  ],\n");
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%llu bytes in pieces up to %u bytes, %u byte blocks%s\n",
+               bench->total_bytes, bench->piece_size, bench->block_size,
+               bench->sync ? ", O_DSYNC" : "");
+        for (i = 0; i < bench->count; i++)
+        {
+            const struct result *r = &bench->results[i];
+
+            printf("%-9s %9.1f MB/s written, %9.1f MB/s on disk, %llu flushes, "
+                   "%llu tail writes\n", r->mode,
+                   mb_per_s(bench->total_bytes, r->write_ns),
+                   mb_per_s(bench->total_bytes, r->total_ns),
+                   r->flushes, r->tails);
+        }
+        printf("Errors: %llu\n", bench->errors);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"size",   required_argument, NULL, 'n'},
+        {"bytes",  required_argument, NULL, 'N'},
+        {"piece",  required_argument, NULL, 'p'},
+        {"block",  required_argument, NULL, 'B'},
+        {"blocks", required_argument, NULL, 'K'},
+        {"flush",  required_argument, NULL, 'f'},
+        {"output", required_argument, NULL, 'o'},
+        {"sync",   no_argument,       NULL, 'S'},
+        {"keep",   no_argument,       NULL, 'k'},
+        {"json",   no_argument,       NULL, 'J'},
+        {"help",   no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench bench;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.total_bytes = (unsigned long long)DEFAULT_TOTAL_MB * 1024 * 1024;
+    bench.piece_size = DEFAULT_PIECE_SIZE;
+    bench.block_size = DEFAULT_BLOCK_SIZE;
+    bench.blocks = DEFAULT_BLOCKS;
+    bench.filename = DEFAULT_FILE;
+
+    while ((c = getopt_long(argc, argv, "n:p:B:f:o:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                bench.total_bytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'N':
+                bench.total_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'p':
+                bench.piece_size = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                bench.block_size = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'K':
+                bench.blocks = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                bench.flush_mb = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                bench.filename = optarg;
+                break;
+            case 'S':
+                bench.sync = 1;
+                break;
+            case 'k':
+                bench.keep = 1;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((bench.piece_size == 0) || (bench.block_size == 0) || (bench.blocks == 0))
+    {
+        fprintf(stderr, "Piece size, block size and blocks must not be 0.\n");
+        return EXIT_FAILURE;
+    }
+
+    bench.piece = malloc(bench.piece_size);
+    if (bench.piece == NULL)
+    {
+        fprintf(stderr, "Failed to allocate piece buffer\n");
+        return EXIT_FAILURE;
+    }
+
+    run(&bench, "buffered", run_buffered);
+    run(&bench, "direct", run_direct);
+
+    print_results(&bench);
+    free(bench.piece);
+    return (bench.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Record filter benchmark.
+ *
+ * Compiles expressions USBPcapCMD --filter accepts and measures how many
+ * records per second are matched, when filtering capture buffers in
+ * place. Without -f a set of expressions is run on generated records and
+ * the records kept are compared with ones selected by plain C code.
+ *
+ * With -f the given expression is run on generated records or on pcap
+ * file, -o saves the records kept.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../USBPcapCMD/recfilter.h"
+#include "capgen.h"
+
+#define DEFAULT_RECORDS      1000000
+#define DEFAULT_CHUNK        (1024 * 1024)
+
+struct bench
+{
+    const char *filename;
+    const char *output_name;
+    const char *expression;
+    unsigned int records;
+    size_t chunk;
+    int json;
+
+    unsigned char *data;
+    size_t length;
+    unsigned char *scratch;
+
+    unsigned long long errors;
+};
+
+struct result
+{
+    const char *expression;
+    unsigned long long records;
+    unsigned long long kept;
+    unsigned long long ns;
+};
+
+/* Expressions checked against generated records */
+static const char *const tests[] =
+{
+    "device == 3",
+    "bus == 1 && endpoint == 0x81",
+    "!(transfer == bulk) || status != success",
+    "data[0] == 0x5a",
+    "data[1:2] == 11:12",
+    "in and completion and length >= 20",
+    "not (device < 2 or device > 3) && (status == stall || data[2] >= 0xf0)",
+    "data[30]",
+};
+
+#define TEST_COUNT (sizeof(tests) / sizeof(tests[0]))
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] [FILE.pcap]\n"
+        "  -n, --records N        number of generated records (default %d)\n"
+        "  -f, --filter EXPR      run only given expression\n"
+        "  -c, --chunk BYTES      bytes filtered at once (default %d)\n"
+        "  -o, --output FILE      save kept records as pcap (with -f)\n"
+        "      --json             print results as JSON\n",
+        argv0, DEFAULT_RECORDS, DEFAULT_CHUNK);
+}
+
+/* Generated record i */
+static unsigned int gen_bus(unsigned int i)      { return 1 + i % 2; }
+static unsigned int gen_device(unsigned int i)   { return 1 + (i / 2) % 4; }
+static unsigned int gen_endpoint(unsigned int i) { return ((i / 8) % 2) ? 0x81 : 0x02; }
+static unsigned int gen_transfer(unsigned int i) { return (i % 3 == 0) ? 3 : 1; }
+static unsigned int gen_info(unsigned int i)     { return i & 1; }
+static unsigned int gen_length(unsigned int i)   { return 8 + i % 24; }
+static unsigned int gen_byte(unsigned int i, unsigned int k) { return (i + k) & 0xFF; }
+
+static unsigned int gen_status(unsigned int i)
+{
+    return (gen_info(i) && (i % 100 == 99)) ? USBD_STATUS_STALL_PID : 0;
+}
+
+/* Same selection as tests[n] */
+static int reference(unsigned int n, unsigned int i)
+{
+    unsigned int len = gen_length(i);
+
+    switch (n)
+    {
+        case 0: return gen_device(i) == 3;
+        case 1: return (gen_bus(i) == 1) && (gen_endpoint(i) == 0x81);
+        case 2: return (gen_transfer(i) != 3) || (gen_status(i) != 0);
+        case 3: return gen_byte(i, 0) == 0x5A;
+        case 4: return (gen_byte(i, 1) == 0x11) && (gen_byte(i, 2) == 0x12);
+        case 5: return (gen_endpoint(i) & 0x80) && gen_info(i) && (len >= 20);
+        case 6: return (gen_device(i) >= 2) && (gen_device(i) <= 3) &&
+                       ((gen_status(i) == (unsigned int)USBD_STATUS_STALL_PID) ||
+                        (gen_byte(i, 2) >= 0xF0));
+        case 7: return (len > 30) && (gen_byte(i, 30) != 0);
+        default: return 0;
+    }
+}
+
+static int generate(struct bench *bench)
+{
+    unsigned char payload[32];
+    struct capgen_urb urb;
+    unsigned char *p;
+    unsigned int i;
+    unsigned int k;
+
+    bench->length = PCAP_HDR_LEN;
+    for (i = 0; i < bench->records; i++)
+    {
+        bench->length += PCAP_REC_HDR_LEN + USBPCAP_HDR_LEN + gen_length(i);
+    }
+    bench->data = malloc(bench->length);
+    if (bench->data == NULL)
+    {
+        return 0;
+    }
+
+    p = capgen_file_header(bench->data, 0);
+    for (i = 0; i < bench->records; i++)
+    {
+        capgen_urb_init(&urb, gen_device(i), gen_endpoint(i), gen_transfer(i));
+        urb.bus = gen_bus(i);
+        urb.irp = 0xFFFF800012340000ULL + (unsigned long long)i * 16;
+        urb.status = gen_status(i);
+        urb.info = gen_info(i);
+        for (k = 0; k < gen_length(i); k++)
+        {
+            payload[k] = (unsigned char)gen_byte(i, k);
+        }
+        p = capgen_record(p, 0, 1500000000ULL * 1000000000ULL + i * 1000000ULL,
+                          &urb, payload, gen_length(i));
+    }
+    return 1;
+}
+
+static int load(struct bench *bench)
+{
+    bench->data = capgen_load(bench->filename, &bench->length);
+    if (bench->data == NULL)
+    {
+        return 0;
+    }
+
+    if ((bench->length < PCAP_HDR_LEN) || (get32(bench->data) != PCAP_MAGIC))
+    {
+        fprintf(stderr, "%s is not a pcap file with microsecond timestamps\n",
+                bench->filename);
+        return 0;
+    }
+    return 1;
+}
+
+/* data may be NULL if length is 0 */
+static int save(FILE *out, const void *data, size_t length)
+{
+    return (out == NULL) || (length == 0) || (fwrite(data, 1, length, out) == length);
+}
+
+/* Filters capture in chunks like USBPcapCMD filters capture buffers.
+ * Kept records are compared with expected ones if expected is not NULL.
+ */
+static int run(struct bench *bench, const struct recfilter *filter,
+               const unsigned char *expected, size_t expected_len,
+               FILE *out, struct result *result)
+{
+    struct recfilter_stream stream;
+    const unsigned char *carry;
+    unsigned long long start;
+    size_t carry_len;
+    size_t checked = 0;
+    size_t offset;
+    size_t kept;
+    size_t n;
+    int ok = 1;
+
+    if (!recfilter_stream_init(&stream, filter, 65536 + PCAP_REC_HDR_LEN))
+    {
+        return 0;
+    }
+
+    for (offset = PCAP_HDR_LEN; offset < bench->length; offset += n)
+    {
+        n = bench->length - offset;
+        if (n > bench->chunk)
+        {
+            n = bench->chunk;
+        }
+        memcpy(bench->scratch, &bench->data[offset], n);
+
+        start = now_ns();
+        kept = recfilter_stream_feed(&stream, bench->scratch, n, &carry, &carry_len);
+        result->ns += now_ns() - start;
+
+        if (!save(out, carry, carry_len) || !save(out, bench->scratch, kept))
+        {
+            ok = 0;
+        }
+
+        if (expected != NULL)
+        {
+            if ((checked + carry_len + kept > expected_len) ||
+                ((carry_len != 0) && (memcmp(&expected[checked], carry, carry_len) != 0)) ||
+                (memcmp(&expected[checked + carry_len], bench->scratch, kept) != 0))
+            {
+                ok = 0;
+                expected = NULL;
+            }
+            checked += carry_len + kept;
+        }
+    }
+
+    if ((expected != NULL) && (checked != expected_len))
+    {
+        ok = 0;
+    }
+
+    result->records = stream.records;
+    result->kept = stream.kept;
+    recfilter_stream_destroy(&stream);
+    return ok;
+}
+
+/* Records of generated capture selected by reference(n) */
+static unsigned char *select_records(struct bench *bench, unsigned int n, size_t *length)
+{
+    const unsigned char *p = &bench->data[PCAP_HDR_LEN];
+    unsigned char *selected;
+    size_t record_len;
+    unsigned int i;
+
+    selected = malloc(bench->length);
+    if (selected == NULL)
+    {
+        return NULL;
+    }
+
+    *length = 0;
+    for (i = 0; i < bench->records; i++)
+    {
+        record_len = PCAP_REC_HDR_LEN + get32(&p[8]);
+        if (reference(n, i))
+        {
+            memcpy(&selected[*length], p, record_len);
+            *length += record_len;
+        }
+        p += record_len;
+    }
+    return selected;
+}
+
+static int compile(const char *expression, struct recfilter *filter)
+{
+    const char *error;
+    size_t error_pos;
+
+    if (!recfilter_compile(filter, expression, &error, &error_pos))
+    {
+        fprintf(stderr, "Invalid filter: %s\n  %s\n  %*s^\n",
+                error, expression, (int)error_pos, "");
+        return 0;
+    }
+    return 1;
+}
+
+static void print_results(struct bench *bench, const struct result *results,
+                          unsigned int count)
+{
+    unsigned int i;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"bytes\": %zu,\n", bench->length);
+        printf("  \"chunk\": %zu,\n", bench->chunk);
+        printf("  \"filters\": [\n");
+        for (i = 0; i < count; i++)
+        {
+            const struct result *r = &results[i];
+
+            printf("    {\"expression\": \"%s\", \"records\": %llu, \"kept\": %llu, "
+                   "\"records_per_s\": %.0f}%s\n", r->expression, r->records,
+                   r->kept, r->ns ? (double)r->records * 1e9 / r->ns : 0.0,
+                   (i + 1 < count) ? "," : "");
+        }
+        printf("  ],\n");
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%zu bytes in %zu byte chunks\n", bench->length, bench->chunk);
+        for (i = 0; i < count; i++)
+        {
+            const struct result *r = &results[i];
+
+            printf("%8.1f M records/s  kept %9llu of %9llu  %s\n",
+                   r->ns ? (double)r->records * 1e3 / r->ns : 0.0,
+                   r->kept, r->records, r->expression);
+        }
+        printf("Errors: %llu\n", bench->errors);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"records", required_argument, NULL, 'n'},
+        {"filter",  required_argument, NULL, 'f'},
+        {"chunk",   required_argument, NULL, 'c'},
+        {"output",  required_argument, NULL, 'o'},
+        {"json",    no_argument,       NULL, 'J'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct result results[TEST_COUNT];
+    struct recfilter filter;
+    struct bench bench;
+    unsigned char *expected;
+    size_t expected_len;
+    unsigned int count = 0;
+    unsigned int i;
+    FILE *out = NULL;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    memset(results, 0, sizeof(results));
+    bench.records = DEFAULT_RECORDS;
+    bench.chunk = DEFAULT_CHUNK;
+
+    while ((c = getopt_long(argc, argv, "n:f:c:o:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                bench.records = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                bench.expression = optarg;
+                break;
+            case 'c':
+                bench.chunk = (size_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                bench.output_name = optarg;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc)
+    {
+        bench.filename = argv[optind];
+    }
+
+    if ((bench.chunk == 0) || (bench.records == 0) ||
+        ((bench.filename != NULL) && (bench.expression == NULL)) ||
+        ((bench.output_name != NULL) && (bench.expression == NULL)))
+    {
+        fprintf(stderr, "Invalid chunk size or number of records, "
+                        "file and -o need -f.\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((bench.expression != NULL) && !compile(bench.expression, &filter))
+    {
+        return EXIT_FAILURE;
+    }
+
+    bench.scratch = malloc(bench.chunk);
+    if ((bench.scratch == NULL) ||
+        ((bench.filename != NULL) ? !load(&bench) : !generate(&bench)))
+    {
+        free(bench.scratch);
+        free(bench.data);
+        return EXIT_FAILURE;
+    }
+
+    if (bench.expression != NULL)
+    {
+        if (bench.output_name != NULL)
+        {
+            out = fopen(bench.output_name, "wb");
+            if ((out == NULL) || !save(out, bench.data, PCAP_HDR_LEN))
+            {
+                perror(bench.output_name);
+                bench.errors++;
+            }
+        }
+
+        results[0].expression = bench.expression;
+        if ((bench.errors == 0) && !run(&bench, &filter, NULL, 0, out, &results[0]))
+        {
+            bench.errors++;
+        }
+        count = 1;
+
+        if ((out != NULL) && (fclose(out) != 0))
+        {
+            perror(bench.output_name);
+            bench.errors++;
+        }
+    }
+    else
+    {
+        for (i = 0; i < TEST_COUNT; i++)
+        {
+            results[i].expression = tests[i];
+            expected = select_records(&bench, i, &expected_len);
+            if ((expected == NULL) || !compile(tests[i], &filter) ||
+                !run(&bench, &filter, expected, expected_len, NULL, &results[i]))
+            {
+                fprintf(stderr, "Records kept by '%s' differ\n", tests[i]);
+                bench.errors++;
+            }
+            free(expected);
+        }
+        count = TEST_COUNT;
+    }
+
+    print_results(&bench, results, count);
+    free(bench.scratch);
+    free(bench.data);
+    return (bench.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
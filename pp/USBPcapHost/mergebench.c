@@ -0,0 +1,480 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Multi root hub merge benchmark.
+ *
+ * Without file arguments every stream is a generated USBPcap capture of
+ * one root hub. Streams are cut into reads of random length and pushed
+ * in the order the reads would complete, with the horizon following
+ * the time of the last read like USBPcapCMD does with the wall clock.
+ *
+ * With file arguments the given pcap files are merged into one, which
+ * is handy for checking the merge against other tools.
+ *
+ * Merged output is checked to be in timestamp order and can be saved
+ * with -o.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../USBPcapCMD/merge.h"
+#include "capgen.h"
+
+#define DEFAULT_STREAMS      4
+#define DEFAULT_TOTAL_MB     256
+#define DEFAULT_BUFFER_SIZE  (1024*1024)
+#define DEFAULT_PACKET_LEN   64
+#define DEFAULT_HOLD_MS      250
+
+struct input
+{
+    unsigned char *data;
+    size_t length;
+    size_t pos;
+    unsigned long long next_ts; /* Timestamp of first record not yet pushed */
+};
+
+struct bench
+{
+    unsigned int streams;
+    unsigned long long total_bytes;
+    unsigned int buffer_size;
+    unsigned int packet_len;
+    unsigned int hold_ms;
+    const char *output;
+    int json;
+
+    struct input *inputs;
+    struct merge merge;
+    unsigned char *out;
+    FILE *out_file;
+
+    unsigned long long input_bytes;
+    unsigned long long output_bytes;
+    unsigned long long reads;
+    unsigned long long disorder;   /* Output records older than previous one */
+    unsigned long long last_ts;
+    size_t max_buffered;
+    unsigned long long merge_ns;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] [file.pcap...]\n"
+        "  -k, --streams N        number of generated root hub streams\n"
+        "                         (default %d)\n"
+        "  -n, --size MB          amount of generated data (default %d)\n"
+        "  -b, --bufferlen N      maximum read length (default %d)\n"
+        "      --packet N         generated packet data length (default %d)\n"
+        "      --hold MS          time records are held back (default %d)\n"
+        "  -o, --output FILE      write merged capture to FILE\n"
+        "      --json             print results as JSON\n",
+        argv0, DEFAULT_STREAMS, DEFAULT_TOTAL_MB, DEFAULT_BUFFER_SIZE,
+        DEFAULT_PACKET_LEN, DEFAULT_HOLD_MS);
+}
+
+static unsigned long long record_ts(const unsigned char *rec, int nanosecond)
+{
+    return (unsigned long long)get32(&rec[0]) * 1000000000ULL +
+           (unsigned long long)get32(&rec[4]) * (nanosecond ? 1ULL : 1000ULL);
+}
+
+/* Creates capture of one root hub, packets a few microseconds apart */
+static int generate_input(struct bench *bench, struct input *in,
+                          unsigned short bus, unsigned int seed)
+{
+    struct capgen_urb urb;
+    unsigned int rec_len;
+    size_t count;
+    unsigned long long ts = 1500000000ULL * 1000000ULL; /* In microseconds */
+    unsigned char *p;
+    size_t i;
+
+    capgen_urb_init(&urb, 0, 0, 0);
+    urb.bus = bus;
+    rec_len = capgen_record_len(&urb, bench->packet_len);
+    count = (size_t)(bench->total_bytes / bench->streams / rec_len);
+
+    in->length = PCAP_HDR_LEN + count * rec_len;
+    in->data = malloc(in->length);
+    if (in->data == NULL)
+    {
+        return 0;
+    }
+
+    p = capgen_file_header(in->data, 0);
+    srand(seed);
+    for (i = 0; i < count; i++)
+    {
+        ts += 1 + rand() % (4 * bench->streams);
+        p = capgen_record(p, 0, ts * 1000ULL, &urb, NULL, bench->packet_len);
+    }
+    return 1;
+}
+
+static int load_input(struct input *in, const char *name)
+{
+    in->data = capgen_load(name, &in->length);
+    return in->data != NULL;
+}
+
+/*
+ * Picks length of next read of input, ending at record boundary like
+ * the driver does. Returns 0 at end of input.
+ */
+static size_t next_read(struct bench *bench, struct input *in)
+{
+    size_t want = 1 + (size_t)rand() % bench->buffer_size;
+    size_t pos = in->pos;
+
+    if (pos == 0)
+    {
+        pos = PCAP_HDR_LEN;
+    }
+    while (pos + PCAP_REC_HDR_LEN <= in->length)
+    {
+        size_t rec_len = PCAP_REC_HDR_LEN + get32(&in->data[pos + 8]);
+
+        if ((pos + rec_len > in->length) ||
+            ((pos - in->pos + rec_len > want) && (pos > in->pos)))
+        {
+            break;
+        }
+        pos += rec_len;
+    }
+    if ((pos == in->pos) || (pos + PCAP_REC_HDR_LEN > in->length))
+    {
+        /* Rest of file, including any truncated record */
+        pos = in->length;
+    }
+    return pos - in->pos;
+}
+
+static void update_next_ts(struct input *in)
+{
+    size_t pos = (in->pos == 0) ? PCAP_HDR_LEN : in->pos;
+
+    in->next_ts = (pos + PCAP_REC_HDR_LEN <= in->length) ?
+                  record_ts(&in->data[pos], 0) : ~0ULL;
+}
+
+static int consume_output(struct bench *bench, size_t length)
+{
+    size_t pos = bench->output_bytes == 0 ? PCAP_HDR_LEN : 0;
+
+    for (; pos + PCAP_REC_HDR_LEN <= length;
+         pos += PCAP_REC_HDR_LEN + get32(&bench->out[pos + 8]))
+    {
+        unsigned long long ts = record_ts(&bench->out[pos],
+                                          bench->merge.nanosecond);
+
+        if (ts < bench->last_ts)
+        {
+            bench->disorder++;
+        }
+        bench->last_ts = ts;
+    }
+
+    bench->output_bytes += length;
+    if ((bench->out_file != NULL) &&
+        (fwrite(bench->out, 1, length, bench->out_file) != length))
+    {
+        fprintf(stderr, "Failed to write %s\n", bench->output);
+        return 0;
+    }
+    return 1;
+}
+
+static int drain(struct bench *bench, unsigned long long horizon)
+{
+    size_t length;
+
+    for (;;)
+    {
+        unsigned long long start = now_ns();
+
+        length = merge_pop(&bench->merge, horizon, bench->out,
+                           bench->buffer_size);
+        bench->merge_ns += now_ns() - start;
+        if (length == 0)
+        {
+            return 1;
+        }
+        if (!consume_output(bench, length))
+        {
+            return 0;
+        }
+    }
+}
+
+static int run(struct bench *bench, int files)
+{
+    unsigned long long hold = (unsigned long long)bench->hold_ms * 1000000ULL;
+    unsigned int i;
+
+    if (!merge_init(&bench->merge, bench->streams,
+                    (size_t)bench->buffer_size * 2 * bench->streams))
+    {
+        fprintf(stderr, "Failed to allocate merge.\n");
+        return 0;
+    }
+
+    bench->out = malloc(bench->buffer_size);
+    if (bench->out == NULL)
+    {
+        fprintf(stderr, "Failed to allocate buffer.\n");
+        return 0;
+    }
+
+    for (i = 0; i < bench->streams; i++)
+    {
+        update_next_ts(&bench->inputs[i]);
+    }
+
+    srand(1);
+    for (;;)
+    {
+        struct input *in = NULL;
+        unsigned int stream = 0;
+        unsigned long long clock;
+        unsigned long long start;
+        size_t length;
+        int ok;
+
+        /* Read with oldest data completes first */
+        for (i = 0; i < bench->streams; i++)
+        {
+            struct input *candidate = &bench->inputs[i];
+
+            if ((candidate->pos < candidate->length) &&
+                ((in == NULL) || (candidate->next_ts < in->next_ts)))
+            {
+                in = candidate;
+                stream = i;
+            }
+        }
+        if (in == NULL)
+        {
+            break;
+        }
+
+        /* Read completes about when its oldest record was captured */
+        clock = in->next_ts;
+        length = next_read(bench, in);
+        start = now_ns();
+        ok = merge_push(&bench->merge, stream, &in->data[in->pos], length);
+        bench->merge_ns += now_ns() - start;
+        if (!ok)
+        {
+            fprintf(stderr, "Failed to allocate merge buffers.\n");
+            return 0;
+        }
+        in->pos += length;
+        bench->input_bytes += length;
+        bench->reads++;
+        if (bench->merge.buffered > bench->max_buffered)
+        {
+            bench->max_buffered = bench->merge.buffered;
+        }
+
+        if (in->pos == in->length)
+        {
+            merge_end(&bench->merge, stream);
+        }
+        update_next_ts(in);
+
+        /* Files have no notion of wall clock, only wait for all streams */
+        if (!drain(bench, files ? 0 : clock - hold))
+        {
+            return 0;
+        }
+    }
+
+    if (!drain(bench, MERGE_FLUSH))
+    {
+        return 0;
+    }
+
+    if (!merge_done(&bench->merge))
+    {
+        fprintf(stderr, "Merge did not output everything.\n");
+        return 0;
+    }
+    return 1;
+}
+
+static void print_results(struct bench *bench)
+{
+    double elapsed = (double)bench->merge_ns / 1e9;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"streams\": %u,\n", bench->streams);
+        printf("  \"merge_s\": %.6f,\n", elapsed);
+        printf("  \"reads\": %llu,\n", bench->reads);
+        printf("  \"input_bytes\": %llu,\n", bench->input_bytes);
+        printf("  \"output_bytes\": %llu,\n", bench->output_bytes);
+        printf("  \"records\": %llu,\n", bench->merge.records);
+        printf("  \"records_per_s\": %.1f,\n", (double)bench->merge.records / elapsed);
+        printf("  \"bytes_per_s\": %.1f,\n", (double)bench->output_bytes / elapsed);
+        printf("  \"max_buffered\": %lu,\n", (unsigned long)bench->max_buffered);
+        printf("  \"late\": %llu,\n", bench->merge.late);
+        printf("  \"disorder\": %llu\n", bench->disorder);
+        printf("}\n");
+    }
+    else
+    {
+        printf("Merged %u streams: %llu reads, %llu bytes in, %llu bytes out\n",
+               bench->streams, bench->reads, bench->input_bytes,
+               bench->output_bytes);
+        printf("Records: %llu, %.3f s, %.1f Mrecords/s, %.1f MB/s\n",
+               bench->merge.records, elapsed,
+               (double)bench->merge.records / elapsed / 1e6,
+               (double)bench->output_bytes / elapsed / 1e6);
+        printf("Held back at most %lu bytes, %llu late, %llu out of order\n",
+               (unsigned long)bench->max_buffered, bench->merge.late,
+               bench->disorder);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"streams",   required_argument, NULL, 'k'},
+        {"size",      required_argument, NULL, 'n'},
+        {"bufferlen", required_argument, NULL, 'b'},
+        {"packet",    required_argument, NULL, 'P'},
+        {"hold",      required_argument, NULL, 'H'},
+        {"output",    required_argument, NULL, 'o'},
+        {"json",      no_argument,       NULL, 'J'},
+        {"help",      no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench bench;
+    int files;
+    int ok;
+    unsigned int i;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.streams = DEFAULT_STREAMS;
+    bench.total_bytes = DEFAULT_TOTAL_MB * 1000000ULL;
+    bench.buffer_size = DEFAULT_BUFFER_SIZE;
+    bench.packet_len = DEFAULT_PACKET_LEN;
+    bench.hold_ms = DEFAULT_HOLD_MS;
+
+    while ((c = getopt_long(argc, argv, "k:n:b:o:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'k':
+                bench.streams = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                bench.total_bytes = strtoull(optarg, NULL, 10) * 1000000ULL;
+                break;
+            case 'b':
+                bench.buffer_size = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                bench.packet_len = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'H':
+                bench.hold_ms = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                bench.output = optarg;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    files = (optind < argc);
+    if (files)
+    {
+        bench.streams = (unsigned int)(argc - optind);
+    }
+
+    if ((bench.streams == 0) || (bench.buffer_size < 65536))
+    {
+        fprintf(stderr, "Invalid number of streams or buffer length.\n");
+        return EXIT_FAILURE;
+    }
+
+    bench.inputs = calloc(bench.streams, sizeof(struct input));
+    if (bench.inputs == NULL)
+    {
+        fprintf(stderr, "Failed to allocate inputs.\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < bench.streams; i++)
+    {
+        ok = files ? load_input(&bench.inputs[i], argv[optind + i]) :
+                     generate_input(&bench, &bench.inputs[i],
+                                    (unsigned short)(i + 1), i + 1);
+        if (!ok)
+        {
+            fprintf(stderr, "Failed to prepare stream %u.\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (bench.output != NULL)
+    {
+        bench.out_file = fopen(bench.output, "wb");
+        if (bench.out_file == NULL)
+        {
+            fprintf(stderr, "Failed to open %s: %s\n", bench.output,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    ok = run(&bench, files);
+    if ((bench.out_file != NULL) && (fclose(bench.out_file) != 0))
+    {
+        fprintf(stderr, "Failed to write %s\n", bench.output);
+        ok = 0;
+    }
+    if (ok)
+    {
+        print_results(&bench);
+    }
+
+    merge_destroy(&bench.merge);
+    for (i = 0; i < bench.streams; i++)
+    {
+        free(bench.inputs[i].data);
+    }
+    free(bench.inputs);
+    free(bench.out);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Traffic monitor benchmark.
+ *
+ * Feeds capture to the monitor USBPcapCMD --monitor uses, in pieces the
+ * size of capture buffer, and measures how fast headers are followed.
+ * Without file a capture of bulk URBs with known latency on several
+ * endpoints is generated and the summary is checked against it.
+ *
+ * With --interval the summary is printed every given number of seconds
+ * of capture time, like USBPcapCMD does once a second.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../USBPcapCMD/monitor.h"
+#include "capgen.h"
+
+#define DEFAULT_URBS         1000000
+#define DEFAULT_ENDPOINTS    8
+#define DEFAULT_CHUNK        (1024 * 1024)
+#define DEFAULT_ROWS         20
+
+/* Generated URBs */
+#define GEN_PAYLOAD          64
+#define GEN_BASE_LATENCY     100 /* Endpoint n has n * 50 us more */
+#define GEN_ERROR_EVERY      100
+
+struct bench
+{
+    const char *filename;
+    unsigned int urbs;
+    unsigned int endpoints;
+    size_t chunk;
+    unsigned int interval;
+    unsigned int rows;
+    int json;
+
+    unsigned char *data;
+    size_t length;
+
+    struct monitor monitor;
+    unsigned long long feed_ns;
+    unsigned long long errors;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] [FILE.pcap]\n"
+        "  -n, --urbs N           number of generated URBs (default %d)\n"
+        "  -e, --endpoints N      number of generated endpoints (default %d)\n"
+        "  -c, --chunk BYTES      bytes fed at once (default %d)\n"
+        "  -i, --interval S       print summary every S seconds of capture\n"
+        "  -r, --rows N           endpoints listed in summary (default %d)\n"
+        "      --json             print results as JSON\n",
+        argv0, DEFAULT_URBS, DEFAULT_ENDPOINTS, DEFAULT_CHUNK, DEFAULT_ROWS);
+}
+
+static unsigned char *put_record(unsigned char *p, unsigned long long ts,
+                                 unsigned long long irp, unsigned int status,
+                                 unsigned int info, unsigned int endpoint,
+                                 const unsigned char *data, unsigned int payload)
+{
+    struct capgen_urb urb;
+
+    capgen_urb_init(&urb, 5, 0x81 + endpoint, USBPCAP_TRANSFER_BULK);
+    urb.irp = irp;
+    urb.status = status;
+    urb.info = info;
+    return capgen_record(p, 0, ts * 1000ULL, &urb, data, payload);
+}
+
+/* Every endpoint has one URB pending at a time, submitted 10 us after
+ * previous one completed.
+ */
+static int generate(struct bench *bench)
+{
+    unsigned char payload[GEN_PAYLOAD];
+    unsigned long long *next_ts;
+    unsigned char *p;
+    unsigned int i;
+    unsigned int ep;
+
+    bench->length = PCAP_HDR_LEN + (size_t)bench->urbs *
+                    (2 * (PCAP_REC_HDR_LEN + USBPCAP_HDR_LEN) + GEN_PAYLOAD);
+    bench->data = malloc(bench->length);
+    next_ts = calloc(bench->endpoints, sizeof(unsigned long long));
+    if ((bench->data == NULL) || (next_ts == NULL))
+    {
+        free(next_ts);
+        return 0;
+    }
+
+    p = capgen_file_header(bench->data, 0);
+    memset(payload, 0xA5, sizeof(payload));
+    for (ep = 0; ep < bench->endpoints; ep++)
+    {
+        next_ts[ep] = 1500000000000000ULL + ep;
+    }
+
+    /* Submits and completions of neighbouring URBs are not interleaved,
+     * timestamps are only ordered per endpoint.
+     */
+    for (i = 0; i < bench->urbs; i++)
+    {
+        unsigned long long irp = 0xFFFF800012340000ULL + (unsigned long long)i * 16;
+        unsigned int latency;
+
+        ep = i % bench->endpoints;
+        latency = GEN_BASE_LATENCY + ep * 50;
+        p = put_record(p, next_ts[ep], irp, 0, 0, ep, payload, 0);
+        next_ts[ep] += latency;
+        p = put_record(p, next_ts[ep], irp,
+                       ((i % GEN_ERROR_EVERY) == GEN_ERROR_EVERY - 1) ? 0xC0000001 : 0,
+                       1, ep, payload, GEN_PAYLOAD);
+        next_ts[ep] += 10;
+    }
+
+    free(next_ts);
+    return 1;
+}
+
+static int load(struct bench *bench)
+{
+    bench->data = capgen_load(bench->filename, &bench->length);
+    return bench->data != NULL;
+}
+
+static void run(struct bench *bench)
+{
+    unsigned long long interval_start = 0;
+    unsigned long long start;
+    size_t offset;
+    size_t n;
+
+    for (offset = 0; offset < bench->length; offset += n)
+    {
+        n = bench->length - offset;
+        if (n > bench->chunk)
+        {
+            n = bench->chunk;
+        }
+
+        start = now_ns();
+        monitor_feed(&bench->monitor, &bench->data[offset], n);
+        bench->feed_ns += now_ns() - start;
+
+        if (bench->interval == 0)
+        {
+            continue;
+        }
+        if (interval_start == 0)
+        {
+            interval_start = bench->monitor.first_ts;
+        }
+        if ((interval_start != 0) &&
+            (bench->monitor.last_ts - interval_start >= bench->interval * 1000000ULL))
+        {
+            monitor_report(&bench->monitor, stdout,
+                           bench->monitor.last_ts - interval_start, bench->rows);
+            interval_start = bench->monitor.last_ts;
+        }
+    }
+
+    if (bench->monitor.failed)
+    {
+        fprintf(stderr, "Not a pcap file\n");
+        bench->errors++;
+    }
+}
+
+/* Compares summary of generated capture with what was generated */
+static void check(struct bench *bench, const struct monitor_rate *rates,
+                  unsigned int count)
+{
+    unsigned long long urbs = 0;
+    unsigned long long errors = 0;
+    unsigned int i;
+
+    if (count != bench->endpoints)
+    {
+        fprintf(stderr, "%u endpoints reported, %u generated\n",
+                count, bench->endpoints);
+        bench->errors++;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        const struct monitor_endpoint *ep = rates[i].endpoint;
+        unsigned long long latency = GEN_BASE_LATENCY + (ep->endpoint - 0x81) * 50;
+
+        urbs += ep->urbs;
+        errors += ep->errors;
+
+        /* Bucket is at most a quarter of its lower bound wide */
+        if ((rates[i].p50_us < latency) || (rates[i].p99_us > latency + latency / 4))
+        {
+            fprintf(stderr, "Endpoint 0x%02X latency %llu..%llu us, generated %llu us\n",
+                    ep->endpoint, rates[i].p50_us, rates[i].p99_us, latency);
+            bench->errors++;
+        }
+    }
+
+    if ((urbs != bench->urbs) || (errors != bench->urbs / GEN_ERROR_EVERY) ||
+        (bench->monitor.unmatched != 0) ||
+        (bench->monitor.records != 2ULL * bench->urbs))
+    {
+        fprintf(stderr, "Counted %llu URBs, %llu errors, %llu unmatched\n",
+                urbs, errors, bench->monitor.unmatched);
+        bench->errors++;
+    }
+}
+
+static void print_results(struct bench *bench)
+{
+    double seconds = (double)bench->feed_ns / 1e9;
+    double mb_per_s = (seconds > 0) ? (double)bench->length / seconds / 1e6 : 0;
+    double records_per_s = (seconds > 0) ? (double)bench->monitor.records / seconds : 0;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"bytes\": %zu,\n", bench->length);
+        printf("  \"records\": %llu,\n", bench->monitor.records);
+        printf("  \"endpoints\": %u,\n", bench->monitor.endpoint_count);
+        printf("  \"chunk\": %zu,\n", bench->chunk);
+        printf("  \"mb_per_s\": %.1f,\n", mb_per_s);
+        printf("  \"records_per_s\": %.0f,\n", records_per_s);
+        printf("  \"unmatched\": %llu,\n", bench->monitor.unmatched);
+        printf("  \"untracked\": %llu,\n", bench->monitor.untracked);
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%llu records (%zu bytes) on %u endpoints in %zu byte chunks\n",
+               bench->monitor.records, bench->length,
+               bench->monitor.endpoint_count, bench->chunk);
+        printf("Throughput: %.1f MB/s, %.0f records/s\n", mb_per_s, records_per_s);
+        printf("Unmatched completions: %llu, untracked records: %llu\n",
+               bench->monitor.unmatched, bench->monitor.untracked);
+        printf("Errors: %llu\n", bench->errors);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"urbs",      required_argument, NULL, 'n'},
+        {"endpoints", required_argument, NULL, 'e'},
+        {"chunk",     required_argument, NULL, 'c'},
+        {"interval",  required_argument, NULL, 'i'},
+        {"rows",      required_argument, NULL, 'r'},
+        {"json",      no_argument,       NULL, 'J'},
+        {"help",      no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct monitor_rate *rates;
+    unsigned long long elapsed;
+    struct bench bench;
+    unsigned int count;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.urbs = DEFAULT_URBS;
+    bench.endpoints = DEFAULT_ENDPOINTS;
+    bench.chunk = DEFAULT_CHUNK;
+    bench.rows = DEFAULT_ROWS;
+
+    while ((c = getopt_long(argc, argv, "n:e:c:i:r:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                bench.urbs = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                bench.endpoints = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                bench.chunk = (size_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                bench.interval = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench.rows = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc)
+    {
+        bench.filename = argv[optind];
+    }
+
+    if ((bench.chunk == 0) || (bench.urbs == 0) ||
+        (bench.endpoints == 0) || (bench.endpoints > 15))
+    {
+        fprintf(stderr, "Invalid chunk size, number of URBs or endpoints.\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((bench.filename != NULL) ? !load(&bench) : !generate(&bench))
+    {
+        free(bench.data);
+        return EXIT_FAILURE;
+    }
+
+    rates = malloc(MONITOR_MAX_ENDPOINTS * sizeof(struct monitor_rate));
+    if ((rates == NULL) || !monitor_init(&bench.monitor))
+    {
+        fprintf(stderr, "Failed to allocate monitor.\n");
+        free(rates);
+        free(bench.data);
+        return EXIT_FAILURE;
+    }
+
+    run(&bench);
+
+    /* Summary of the whole capture, unless printed in intervals */
+    elapsed = bench.monitor.last_ts - bench.monitor.first_ts;
+    if (bench.filename == NULL)
+    {
+        count = monitor_collect(&bench.monitor, elapsed, rates, MONITOR_MAX_ENDPOINTS);
+        check(&bench, rates, count);
+    }
+    else if ((bench.interval == 0) && !bench.json)
+    {
+        monitor_report(&bench.monitor, stdout, elapsed, bench.rows);
+        printf("\n");
+    }
+
+    print_results(&bench);
+    monitor_destroy(&bench.monitor);
+    free(rates);
+    free(bench.data);
+    return (bench.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
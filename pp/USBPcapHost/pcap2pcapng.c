@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Converts classic pcap file to pcapng using the USBPcapCMD converter.
+ *
+ * Input is fed to the converter in --bufferlen sized pieces, the same
+ * way USBPcapCMD writer thread passes buffers read from the driver.
+ * Output buffer has the same size. With --repeat the whole input is
+ * converted that many times without writing anything and conversion
+ * throughput is reported.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../USBPcapCMD/pcapng.h"
+
+#define DEFAULT_BUFFER_SIZE      (1024*1024)
+#define MIN_BUFFER_SIZE          4096
+
+struct convert
+{
+    const char          *input;
+    const char          *output;
+    unsigned int         bufferSize;
+    unsigned int         repeat;
+    int                  json;
+
+    unsigned char       *in;
+    size_t               inLength;
+    unsigned char       *out;
+    FILE                *file;
+
+    unsigned long long   startNs;
+    unsigned long long   endNs;
+    unsigned long long   inBytes;
+    unsigned long long   outBytes;
+    unsigned long long   packets;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] INPUT\n"
+        "  -o, --output FILE      write converted capture to FILE\n"
+        "  -b, --bufferlen BYTES  input and output piece size (default: %u)\n"
+        "      --repeat COUNT     convert COUNT times without writing and\n"
+        "                         report throughput\n"
+        "      --json             print results as JSON\n",
+        argv0, DEFAULT_BUFFER_SIZE);
+}
+
+static int load_input(struct convert *conv)
+{
+    FILE  *f;
+    long   length;
+
+    f = fopen(conv->input, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", conv->input,
+                strerror(errno));
+        return 0;
+    }
+
+    if ((fseek(f, 0, SEEK_END) != 0) || ((length = ftell(f)) < 0) ||
+        (fseek(f, 0, SEEK_SET) != 0))
+    {
+        fprintf(stderr, "Failed to get size of %s.\n", conv->input);
+        fclose(f);
+        return 0;
+    }
+
+    conv->in = malloc(length > 0 ? (size_t)length : 1);
+    if (conv->in == NULL)
+    {
+        fprintf(stderr, "Failed to allocate %ld bytes.\n", length);
+        fclose(f);
+        return 0;
+    }
+
+    conv->inLength = fread(conv->in, 1, (size_t)length, f);
+    fclose(f);
+
+    if (conv->inLength < PCAP_HDR_LEN)
+    {
+        fprintf(stderr, "%s is too short.\n", conv->input);
+        return 0;
+    }
+    return 1;
+}
+
+static int emit(struct convert *conv, size_t length)
+{
+    conv->outBytes += length;
+    if ((conv->file != NULL) && (length > 0) &&
+        (fwrite(conv->out, 1, length, conv->file) != length))
+    {
+        fprintf(stderr, "Failed to write %s.\n", conv->output);
+        return 0;
+    }
+    return 1;
+}
+
+static int convert_once(struct convert *conv)
+{
+    struct pcapng_converter  converter;
+    size_t                   pos = PCAP_HDR_LEN;
+    size_t                   piece;
+    size_t                   consumed;
+    size_t                   length;
+
+    if (!pcapng_init(&converter, conv->in))
+    {
+        fprintf(stderr, "%s is not a supported pcap file.\n", conv->input);
+        return 0;
+    }
+
+    length = pcapng_write_header(conv->in, "pcap2pcapng", NULL,
+                                 conv->out, conv->bufferSize);
+    if (!emit(conv, length))
+    {
+        return 0;
+    }
+
+    while (pos < conv->inLength)
+    {
+        piece = conv->inLength - pos;
+        if (piece > conv->bufferSize)
+        {
+            piece = conv->bufferSize;
+        }
+
+        while (piece > 0)
+        {
+            length = pcapng_convert(&converter, &conv->in[pos], piece,
+                                    &consumed, conv->out, conv->bufferSize);
+            pos += consumed;
+            piece -= consumed;
+            if (!emit(conv, length))
+            {
+                return 0;
+            }
+        }
+    }
+
+    if (!pcapng_at_boundary(&converter))
+    {
+        fprintf(stderr, "%s ends with truncated packet.\n", conv->input);
+        return 0;
+    }
+
+    length = pcapng_write_statistics(&converter, 0, 0, 0,
+                                     conv->out, conv->bufferSize);
+    if (!emit(conv, length))
+    {
+        return 0;
+    }
+
+    conv->inBytes += conv->inLength;
+    conv->packets += converter.packets;
+    return 1;
+}
+
+static int run(struct convert *conv)
+{
+    unsigned int  i;
+
+    if (!load_input(conv))
+    {
+        return 0;
+    }
+
+    conv->out = malloc(conv->bufferSize);
+    if (conv->out == NULL)
+    {
+        fprintf(stderr, "Failed to allocate output buffer.\n");
+        return 0;
+    }
+
+    if (conv->output != NULL)
+    {
+        conv->file = fopen(conv->output, "wb");
+        if (conv->file == NULL)
+        {
+            fprintf(stderr, "Failed to open %s: %s\n", conv->output,
+                    strerror(errno));
+            return 0;
+        }
+        if (!convert_once(conv))
+        {
+            return 0;
+        }
+        fclose(conv->file);
+        conv->file = NULL;
+        conv->inBytes = 0;
+        conv->outBytes = 0;
+        conv->packets = 0;
+    }
+
+    conv->startNs = now_ns();
+    for (i = 0; i < conv->repeat; i++)
+    {
+        if (!convert_once(conv))
+        {
+            return 0;
+        }
+    }
+    conv->endNs = now_ns();
+    return 1;
+}
+
+static void cleanup(struct convert *conv)
+{
+    if (conv->file != NULL)
+    {
+        fclose(conv->file);
+    }
+    free(conv->out);
+    free(conv->in);
+}
+
+static void print_results(struct convert *conv)
+{
+    double elapsed = (double)(conv->endNs - conv->startNs) / 1e9;
+
+    if (conv->json)
+    {
+        printf("{\n");
+        printf("  \"elapsed_s\": %.6f,\n", elapsed);
+        printf("  \"buffer_bytes\": %u,\n", conv->bufferSize);
+        printf("  \"repeat\": %u,\n", conv->repeat);
+        printf("  \"packets\": %llu,\n", conv->packets);
+        printf("  \"input_bytes\": %llu,\n", conv->inBytes);
+        printf("  \"output_bytes\": %llu,\n", conv->outBytes);
+        printf("  \"input_bytes_per_s\": %.1f\n", (double)conv->inBytes / elapsed);
+        printf("}\n");
+    }
+    else
+    {
+        printf("Converted %u times: %llu packets, %llu -> %llu bytes\n",
+               conv->repeat, conv->packets, conv->inBytes, conv->outBytes);
+        printf("Elapsed: %.3f s, %.2f GB/s of input, %u bytes buffers\n",
+               elapsed, (double)conv->inBytes / elapsed / 1e9,
+               conv->bufferSize);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"output",    required_argument, NULL, 'o'},
+        {"bufferlen", required_argument, NULL, 'b'},
+        {"repeat",    required_argument, NULL, 'R'},
+        {"json",      no_argument,       NULL, 'J'},
+        {"help",      no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct convert  conv;
+    int             c;
+
+    memset(&conv, 0, sizeof(conv));
+    conv.bufferSize = DEFAULT_BUFFER_SIZE;
+
+    while ((c = getopt_long(argc, argv, "o:b:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'o':
+                conv.output = optarg;
+                break;
+            case 'b':
+                conv.bufferSize = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                conv.repeat = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                conv.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    conv.input = argv[optind];
+
+    /* Same lower limit as USBPcapCMD capture buffer */
+    if (conv.bufferSize < MIN_BUFFER_SIZE)
+    {
+        fprintf(stderr, "Buffer length must be at least %d bytes.\n",
+                MIN_BUFFER_SIZE);
+        return EXIT_FAILURE;
+    }
+
+    if ((conv.output == NULL) && (conv.repeat == 0))
+    {
+        fprintf(stderr, "Nothing to do, use --output or --repeat.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!run(&conv))
+    {
+        cleanup(&conv);
+        return EXIT_FAILURE;
+    }
+
+    if (conv.repeat > 0)
+    {
+        print_results(&conv);
+    }
+    cleanup(&conv);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,740 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Reads captures written by USBPcapCMD --compress.
+ *
+ * By default the whole capture is decompressed. With --from and --to
+ * only packets in given time range are written. The seek table at the
+ * end of the file is used to start decompressing at the last frame that
+ * begins before the range, so only frames covering the range are read.
+ * --list prints the seek table.
+ *
+ * With -z a pcap file is compressed instead, the same way USBPcapCMD
+ * does it, and compression throughput is reported.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../USBPcapCMD/bytes.h"
+#include "../USBPcapCMD/compress.h"
+#include "../USBPcapCMD/lz4.h"
+
+#define PCAPNG_EPB_TYPE          0x00000006
+
+/* Largest packet pcapcat -z expects, same as default capture buffer */
+#define MAX_PACKET_LEN           (1024*1024)
+
+struct seek_entry
+{
+    unsigned long long offset;
+    unsigned int comp_len;
+    unsigned int decomp_len;
+    unsigned long long first_ts;
+    unsigned long long last_ts;
+    unsigned int flags;
+};
+
+struct cat
+{
+    const char          *input;
+    const char          *output;
+    int                  list;
+    int                  compress;
+    unsigned int         threads;
+    int                  range;
+    unsigned long long   from;     /* ns */
+    unsigned long long   to;       /* ns */
+
+    unsigned char       *in;
+    size_t               inLength;
+    FILE                *file;
+
+    struct seek_entry   *entries;
+    unsigned int         count;
+    unsigned int         headerLength;
+
+    /* Decompressed data not yet parsed into packets */
+    unsigned char       *data;
+    size_t               dataLength;
+    size_t               dataSize;
+    int                  pcapng;
+    int                  nanosecond;
+    int                  done;
+
+    unsigned long long   frames;
+    unsigned long long   packets;
+    unsigned long long   outBytes;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] INPUT\n"
+        "  -o, --output FILE      write to FILE instead of standard output\n"
+        "      --from SECONDS     skip packets before SECONDS (Unix time)\n"
+        "      --to SECONDS       skip packets after SECONDS (Unix time)\n"
+        "      --list             print seek table\n"
+        "  -z, --compress         compress pcap INPUT and report throughput\n"
+        "      --threads COUNT    compression threads (default: %d)\n",
+        argv0, COMPRESS_DEFAULT_THREADS);
+}
+
+static int load_input(struct cat *cat)
+{
+    FILE  *f;
+    long   length;
+
+    f = fopen(cat->input, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", cat->input,
+                strerror(errno));
+        return 0;
+    }
+
+    if ((fseek(f, 0, SEEK_END) != 0) || ((length = ftell(f)) < 0) ||
+        (fseek(f, 0, SEEK_SET) != 0))
+    {
+        fprintf(stderr, "Failed to get size of %s.\n", cat->input);
+        fclose(f);
+        return 0;
+    }
+
+    cat->in = malloc(length > 0 ? (size_t)length : 1);
+    if (cat->in == NULL)
+    {
+        fprintf(stderr, "Failed to allocate %ld bytes.\n", length);
+        fclose(f);
+        return 0;
+    }
+
+    cat->inLength = fread(cat->in, 1, (size_t)length, f);
+    fclose(f);
+    return 1;
+}
+
+static int emit(struct cat *cat, const unsigned char *data, size_t length)
+{
+    cat->outBytes += length;
+    if ((cat->file != NULL) && (length > 0) &&
+        (fwrite(data, 1, length, cat->file) != length))
+    {
+        fprintf(stderr, "Failed to write output.\n");
+        return 0;
+    }
+    return 1;
+}
+
+/* Reads seek table, returns 0 if file does not end with one */
+static int read_seek_table(struct cat *cat)
+{
+    const unsigned char *footer;
+    const unsigned char *p;
+    unsigned long long offset = 0;
+    size_t table_len;
+    unsigned int i;
+
+    if (cat->inLength < 8 + COMPRESS_SEEK_FOOTER_LEN)
+    {
+        return 0;
+    }
+
+    footer = &cat->in[cat->inLength - COMPRESS_SEEK_FOOTER_LEN];
+    if ((get32(&footer[12]) != COMPRESS_SEEK_MAGIC) ||
+        (get32(&footer[8]) != COMPRESS_SEEK_VERSION))
+    {
+        return 0;
+    }
+
+    cat->headerLength = get32(&footer[0]);
+    cat->count = get32(&footer[4]);
+    table_len = (size_t)cat->count * COMPRESS_SEEK_ENTRY_LEN +
+                COMPRESS_SEEK_FOOTER_LEN;
+    if ((cat->count > cat->inLength / COMPRESS_SEEK_ENTRY_LEN) ||
+        (table_len + 8 > cat->inLength))
+    {
+        return 0;
+    }
+
+    p = &cat->in[cat->inLength - table_len - 8];
+    if ((get32(p) != COMPRESS_SEEK_FRAME_MAGIC) || (get32(&p[4]) != table_len))
+    {
+        return 0;
+    }
+    p += 8;
+
+    cat->entries = calloc(cat->count + 1, sizeof(struct seek_entry));
+    if (cat->entries == NULL)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < cat->count; i++, p += COMPRESS_SEEK_ENTRY_LEN)
+    {
+        cat->entries[i].offset = offset;
+        cat->entries[i].comp_len = get32(&p[0]);
+        cat->entries[i].decomp_len = get32(&p[4]);
+        cat->entries[i].first_ts = get64(&p[8]);
+        cat->entries[i].last_ts = get64(&p[16]);
+        cat->entries[i].flags = get32(&p[24]);
+        offset += cat->entries[i].comp_len;
+    }
+
+    if (offset + table_len + 8 != cat->inLength)
+    {
+        fprintf(stderr, "Seek table does not match frames, ignoring it.\n");
+        free(cat->entries);
+        cat->entries = NULL;
+        cat->count = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static void print_ts(unsigned long long ts)
+{
+    printf("%llu.%09llu", ts / 1000000000ULL, ts % 1000000000ULL);
+}
+
+static void list_frames(struct cat *cat)
+{
+    unsigned int i;
+
+    printf("header %u bytes, %u frames\n", cat->headerLength, cat->count);
+    for (i = 0; i < cat->count; i++)
+    {
+        struct seek_entry *e = &cat->entries[i];
+
+        printf("%6u offset %llu, %u -> %u bytes", i, e->offset,
+               e->comp_len, e->decomp_len);
+        if (e->flags & COMPRESS_SEEK_HAS_PACKETS)
+        {
+            printf(", packets ");
+            print_ts(e->first_ts);
+            printf(" - ");
+            print_ts(e->last_ts);
+        }
+        if (e->flags & COMPRESS_SEEK_CONTINUED)
+        {
+            printf(", continued");
+        }
+        printf("\n");
+    }
+}
+
+/* Decompresses frame at offset, appending it to cat->data */
+static int decompress_at(struct cat *cat, size_t offset, size_t *consumed)
+{
+    long long content_size;
+    size_t out_len;
+    size_t size;
+    int result;
+
+    result = lz4_frame_info(&cat->in[offset], cat->inLength - offset,
+                            &content_size);
+    if (result == LZ4_OK)
+    {
+        size = (content_size < 0) ? 4 * 1024 * 1024 : (size_t)content_size;
+        if (cat->dataLength + size > cat->dataSize)
+        {
+            unsigned char *data;
+
+            data = realloc(cat->data, cat->dataLength + size);
+            if (data == NULL)
+            {
+                fprintf(stderr, "Failed to allocate %lu bytes.\n",
+                        (unsigned long)(cat->dataLength + size));
+                return 0;
+            }
+            cat->data = data;
+            cat->dataSize = cat->dataLength + size;
+        }
+
+        result = lz4_decompress_frame(&cat->in[offset],
+                                      cat->inLength - offset, consumed,
+                                      &cat->data[cat->dataLength],
+                                      cat->dataSize - cat->dataLength,
+                                      &out_len);
+    }
+
+    if (result != LZ4_OK)
+    {
+        fprintf(stderr, "Failed to decompress frame at offset %lu (%d).\n",
+                (unsigned long)offset, result);
+        return 0;
+    }
+
+    cat->dataLength += out_len;
+    cat->frames++;
+    return 1;
+}
+
+/* Writes complete packets in range from cat->data, keeps the rest */
+static int filter_packets(struct cat *cat)
+{
+    size_t pos = 0;
+    size_t length;
+    unsigned long long ts;
+    int in_range;
+
+    while (!cat->done)
+    {
+        if (cat->pcapng)
+        {
+            if (cat->dataLength - pos < 12)
+            {
+                break;
+            }
+            length = get32(&cat->data[pos + 4]);
+            if (length < 12)
+            {
+                fprintf(stderr, "Invalid pcapng block.\n");
+                return 0;
+            }
+        }
+        else
+        {
+            if (cat->dataLength - pos < PCAP_REC_HDR_LEN)
+            {
+                break;
+            }
+            length = PCAP_REC_HDR_LEN + get32(&cat->data[pos + 8]);
+        }
+
+        if (cat->dataLength - pos < length)
+        {
+            break;
+        }
+
+        if (cat->pcapng && (get32(&cat->data[pos]) == PCAPNG_EPB_TYPE))
+        {
+            /* USBPcapCMD writes nanosecond timestamps */
+            ts = ((unsigned long long)get32(&cat->data[pos + 12]) << 32) |
+                 get32(&cat->data[pos + 16]);
+        }
+        else if (!cat->pcapng)
+        {
+            ts = (unsigned long long)get32(&cat->data[pos]) * 1000000000ULL;
+            ts += cat->nanosecond ? get32(&cat->data[pos + 4]) :
+                  get32(&cat->data[pos + 4]) * 1000ULL;
+        }
+        else
+        {
+            /* Other blocks, like statistics, are always written */
+            ts = cat->from;
+        }
+
+        if (ts > cat->to)
+        {
+            cat->done = 1;
+            break;
+        }
+        in_range = (ts >= cat->from);
+
+        if (in_range)
+        {
+            if (!emit(cat, &cat->data[pos], length))
+            {
+                return 0;
+            }
+            cat->packets++;
+        }
+        pos += length;
+    }
+
+    memmove(cat->data, &cat->data[pos], cat->dataLength - pos);
+    cat->dataLength -= pos;
+    return 1;
+}
+
+/* Writes file header and packets from frames covering the range */
+static int extract_range(struct cat *cat)
+{
+    unsigned int first = 0;
+    unsigned int i;
+    size_t consumed;
+    unsigned int magic;
+
+    if (cat->count == 0)
+    {
+        return 1;
+    }
+
+    /* Last frame starting with a packet that is not after the range */
+    for (i = 0; i < cat->count; i++)
+    {
+        struct seek_entry *e = &cat->entries[i];
+
+        if ((e->flags & COMPRESS_SEEK_HAS_PACKETS) && (e->first_ts > cat->from))
+        {
+            break;
+        }
+        if ((e->flags & COMPRESS_SEEK_CONTINUED) == 0)
+        {
+            first = i;
+        }
+    }
+
+    /* File header is at the start of first frame */
+    if (!decompress_at(cat, 0, &consumed))
+    {
+        return 0;
+    }
+    if ((cat->dataLength < cat->headerLength) || (cat->dataLength < 4))
+    {
+        fprintf(stderr, "First frame is shorter than file header.\n");
+        return 0;
+    }
+
+    magic = get32(cat->data);
+    cat->pcapng = (magic == 0x0A0D0D0A);
+    cat->nanosecond = (magic == PCAP_MAGIC_NANOSECOND);
+    if (!cat->pcapng && (magic != PCAP_MAGIC) && !cat->nanosecond)
+    {
+        fprintf(stderr, "Unsupported capture format.\n");
+        return 0;
+    }
+
+    if (!emit(cat, cat->data, cat->headerLength))
+    {
+        return 0;
+    }
+
+    if (first == 0)
+    {
+        memmove(cat->data, &cat->data[cat->headerLength],
+                cat->dataLength - cat->headerLength);
+        cat->dataLength -= cat->headerLength;
+    }
+    else
+    {
+        cat->dataLength = 0;
+    }
+
+    for (i = first; (i < cat->count) && !cat->done; i++)
+    {
+        if ((i != 0) &&
+            !decompress_at(cat, (size_t)cat->entries[i].offset, &consumed))
+        {
+            return 0;
+        }
+        if (!filter_packets(cat))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Decompresses every frame, works without seek table too */
+static int decompress_all(struct cat *cat)
+{
+    size_t offset = 0;
+    size_t consumed;
+
+    while (offset < cat->inLength)
+    {
+        if (!decompress_at(cat, offset, &consumed))
+        {
+            return 0;
+        }
+        offset += consumed;
+
+        if (!emit(cat, cat->data, cat->dataLength))
+        {
+            return 0;
+        }
+        cat->dataLength = 0;
+    }
+    return 1;
+}
+
+static int write_frames(struct cat *cat, struct compress *c, int wait)
+{
+    struct compress_frame *frame;
+
+    while ((frame = compress_output(c, wait)) != NULL)
+    {
+        if (!emit(cat, frame->out, frame->out_len))
+        {
+            compress_release(c, frame);
+            return 0;
+        }
+        compress_release(c, frame);
+        cat->frames++;
+    }
+    return 1;
+}
+
+static int add_data(struct cat *cat, struct compress *c,
+                    const unsigned char *data, size_t length)
+{
+    unsigned char *space;
+    unsigned int size;
+
+    while (length > 0)
+    {
+        while ((space = compress_space(c, &size)) == NULL)
+        {
+            if (!write_frames(cat, c, 1))
+            {
+                return 0;
+            }
+        }
+        if (size > length)
+        {
+            size = (unsigned int)length;
+        }
+        memcpy(space, data, size);
+        compress_commit(c, size);
+        data += size;
+        length -= size;
+    }
+    return write_frames(cat, c, 0);
+}
+
+/* Compresses pcap file cutting frames between packets like USBPcapCMD */
+static int compress_file(struct cat *cat)
+{
+    struct compress c;
+    unsigned long long start;
+    unsigned long long ts;
+    unsigned char *table;
+    unsigned int table_len;
+    unsigned int magic;
+    size_t pos = PCAP_HDR_LEN;
+    size_t length;
+    double elapsed;
+    int ok;
+
+    magic = (cat->inLength >= PCAP_HDR_LEN) ? get32(cat->in) : 0;
+    if ((magic != PCAP_MAGIC) && (magic != PCAP_MAGIC_NANOSECOND))
+    {
+        fprintf(stderr, "%s is not a supported pcap file.\n", cat->input);
+        return 0;
+    }
+    cat->nanosecond = (magic == PCAP_MAGIC_NANOSECOND);
+
+    if (!compress_init(&c, cat->threads, COMPRESS_FRAME_SIZE, MAX_PACKET_LEN))
+    {
+        fprintf(stderr, "Failed to start compression.\n");
+        return 0;
+    }
+
+    start = now_ns();
+    ok = add_data(cat, &c, cat->in, PCAP_HDR_LEN);
+    compress_mark_header(&c);
+
+    while (ok && (pos + PCAP_REC_HDR_LEN <= cat->inLength))
+    {
+        length = PCAP_REC_HDR_LEN + get32(&cat->in[pos + 8]);
+        if (length > cat->inLength - pos)
+        {
+            length = cat->inLength - pos;
+        }
+
+        if (compress_frame_due(&c, (unsigned int)length))
+        {
+            compress_close(&c);
+        }
+
+        ts = (unsigned long long)get32(&cat->in[pos]) * 1000000000ULL;
+        ts += cat->nanosecond ? get32(&cat->in[pos + 4]) :
+              get32(&cat->in[pos + 4]) * 1000ULL;
+        compress_packet(&c, ts);
+
+        ok = add_data(cat, &c, &cat->in[pos], length);
+        pos += length;
+        cat->packets++;
+    }
+
+    compress_close(&c);
+    ok = ok && write_frames(cat, &c, 1);
+    if (ok)
+    {
+        table = compress_seek_table(&c, &table_len);
+        ok = emit(cat, table, table_len);
+    }
+    elapsed = (double)(now_ns() - start) / 1e9;
+    compress_destroy(&c);
+
+    if (ok)
+    {
+        fprintf(stderr, "Compressed %llu packets, %lu -> %llu bytes (%.1f%%) "
+                "in %llu frames\n", cat->packets, (unsigned long)cat->inLength,
+                cat->outBytes, 100.0 * cat->outBytes / cat->inLength,
+                cat->frames);
+        fprintf(stderr, "Elapsed: %.3f s, %.1f MB/s with %u threads\n",
+                elapsed, cat->inLength / elapsed / 1e6, cat->threads);
+    }
+    return ok;
+}
+
+static void cleanup(struct cat *cat)
+{
+    if (cat->file != NULL)
+    {
+        fclose(cat->file);
+    }
+    free(cat->data);
+    free(cat->entries);
+    free(cat->in);
+}
+
+static unsigned long long parse_seconds(const char *arg)
+{
+    return (unsigned long long)(strtod(arg, NULL) * 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"output",   required_argument, NULL, 'o'},
+        {"from",     required_argument, NULL, 'F'},
+        {"to",       required_argument, NULL, 'T'},
+        {"list",     no_argument,       NULL, 'L'},
+        {"compress", no_argument,       NULL, 'z'},
+        {"threads",  required_argument, NULL, 't'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct cat  cat;
+    int         ok;
+    int         c;
+
+    memset(&cat, 0, sizeof(cat));
+    cat.threads = COMPRESS_DEFAULT_THREADS;
+    cat.to = ~0ULL;
+
+    while ((c = getopt_long(argc, argv, "o:zh", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'o':
+                cat.output = optarg;
+                break;
+            case 'F':
+                cat.from = parse_seconds(optarg);
+                cat.range = 1;
+                break;
+            case 'T':
+                cat.to = parse_seconds(optarg);
+                cat.range = 1;
+                break;
+            case 'L':
+                cat.list = 1;
+                break;
+            case 'z':
+                cat.compress = 1;
+                break;
+            case 't':
+                cat.threads = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    cat.input = argv[optind];
+
+    if ((cat.threads < 1) || (cat.threads > COMPRESS_MAX_THREADS))
+    {
+        fprintf(stderr, "Number of threads must be between 1 and %d.\n",
+                COMPRESS_MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+
+    if (!load_input(&cat))
+    {
+        cleanup(&cat);
+        return EXIT_FAILURE;
+    }
+
+    if (cat.list || cat.range)
+    {
+        if (!read_seek_table(&cat))
+        {
+            fprintf(stderr, "%s has no seek table.\n", cat.input);
+            cleanup(&cat);
+            return EXIT_FAILURE;
+        }
+        if (cat.list)
+        {
+            list_frames(&cat);
+            cleanup(&cat);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (cat.output != NULL)
+    {
+        cat.file = fopen(cat.output, "wb");
+        if (cat.file == NULL)
+        {
+            fprintf(stderr, "Failed to open %s: %s\n", cat.output,
+                    strerror(errno));
+            cleanup(&cat);
+            return EXIT_FAILURE;
+        }
+    }
+    else if (!cat.compress)
+    {
+        cat.file = stdout;
+    }
+
+    if (cat.compress)
+    {
+        ok = compress_file(&cat);
+    }
+    else if (cat.range)
+    {
+        ok = extract_range(&cat);
+    }
+    else
+    {
+        ok = decompress_all(&cat);
+    }
+
+    if ((cat.file != NULL) && (fclose(cat.file) != 0))
+    {
+        fprintf(stderr, "Failed to write output.\n");
+        ok = 0;
+    }
+    cat.file = NULL;
+
+    if (ok && cat.range)
+    {
+        fprintf(stderr, "%llu packets from %llu of %u frames\n",
+                cat.packets, cat.frames, cat.count);
+    }
+    cleanup(&cat);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
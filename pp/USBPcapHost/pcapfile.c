@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stddef.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "pcapfile.h"
+
+static UINT32 get32(const struct pcap_file *file, const void *p)
+{
+    UINT32 v;
+
+    memcpy(&v, p, sizeof(v));
+    return file->swapped ? pcap_swap32(v) : v;
+}
+
+static UINT16 get16(const struct pcap_file *file, const void *p)
+{
+    UINT16 v;
+
+    memcpy(&v, p, sizeof(v));
+    return file->swapped ? pcap_swap16(v) : v;
+}
+
+static int parse_header(struct pcap_file *file)
+{
+    UINT32 magic;
+
+    if (file->size < PCAP_FILE_HEADER_LEN)
+    {
+        return PCAP_FILE_ERROR_FORMAT;
+    }
+
+    memcpy(&magic, file->data, sizeof(magic));
+    switch (magic)
+    {
+        case PCAP_MAGIC_USEC:
+            file->swapped = 0;
+            file->nanosecond = 0;
+            break;
+        case PCAP_MAGIC_NSEC:
+            file->swapped = 0;
+            file->nanosecond = 1;
+            break;
+        case 0xD4C3B2A1: /* PCAP_MAGIC_USEC swapped */
+            file->swapped = 1;
+            file->nanosecond = 0;
+            break;
+        case 0x4D3CB2A1: /* PCAP_MAGIC_NSEC swapped */
+            file->swapped = 1;
+            file->nanosecond = 1;
+            break;
+        default:
+            return PCAP_FILE_ERROR_FORMAT;
+    }
+
+    if (get16(file, &file->data[offsetof(pcap_hdr_t, version_major)]) != 2)
+    {
+        return PCAP_FILE_ERROR_FORMAT;
+    }
+
+    file->snaplen = get32(file, &file->data[offsetof(pcap_hdr_t, snaplen)]);
+    file->network = get32(file, &file->data[offsetof(pcap_hdr_t, network)]);
+    if (file->snaplen == 0)
+    {
+        /* Some writers leave it unset, do not limit records then */
+        file->snaplen = 0xFFFFFFFF;
+    }
+    if (file->network != DLT_USBPCAP)
+    {
+        return PCAP_FILE_ERROR_LINKTYPE;
+    }
+    return PCAP_FILE_OK;
+}
+
+int pcap_file_init(struct pcap_file *file, const void *data,
+                   unsigned long long size)
+{
+    memset(file, 0, sizeof(struct pcap_file));
+    file->data = (const unsigned char *)data;
+    file->size = size;
+    return parse_header(file);
+}
+
+#ifdef _WIN32
+int pcap_file_open(struct pcap_file *file, const char *path, int flags)
+{
+    LARGE_INTEGER size;
+    DWORD attributes = FILE_ATTRIBUTE_NORMAL;
+    int error;
+
+    memset(file, 0, sizeof(struct pcap_file));
+
+    if (flags & PCAP_FILE_SEQUENTIAL)
+    {
+        attributes |= FILE_FLAG_SEQUENTIAL_SCAN;
+    }
+    file->handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                               NULL, OPEN_EXISTING, attributes, NULL);
+    if (file->handle == INVALID_HANDLE_VALUE)
+    {
+        return PCAP_FILE_ERROR_OPEN;
+    }
+    if (!GetFileSizeEx(file->handle, &size) || (size.QuadPart == 0) ||
+        ((unsigned long long)size.QuadPart > (SIZE_T)-1))
+    {
+        CloseHandle(file->handle);
+        return (size.QuadPart == 0) ? PCAP_FILE_ERROR_FORMAT : PCAP_FILE_ERROR_OPEN;
+    }
+
+    file->mapping = CreateFileMapping(file->handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (file->mapping == NULL)
+    {
+        CloseHandle(file->handle);
+        return PCAP_FILE_ERROR_OPEN;
+    }
+    file->data = (const unsigned char *)MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (file->data == NULL)
+    {
+        CloseHandle(file->mapping);
+        CloseHandle(file->handle);
+        return PCAP_FILE_ERROR_OPEN;
+    }
+    file->size = (unsigned long long)size.QuadPart;
+    file->mapped = 1;
+
+    if (flags & PCAP_FILE_POPULATE)
+    {
+        WIN32_MEMORY_RANGE_ENTRY range;
+
+        range.VirtualAddress = (PVOID)file->data;
+        range.NumberOfBytes = (SIZE_T)file->size;
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+
+    error = parse_header(file);
+    if (error != PCAP_FILE_OK)
+    {
+        pcap_file_close(file);
+    }
+    return error;
+}
+
+void pcap_file_close(struct pcap_file *file)
+{
+    if (file->mapped)
+    {
+        UnmapViewOfFile(file->data);
+        CloseHandle(file->mapping);
+        CloseHandle(file->handle);
+    }
+    memset(file, 0, sizeof(struct pcap_file));
+}
+#else
+int pcap_file_open(struct pcap_file *file, const char *path, int flags)
+{
+    struct stat st;
+    int mmap_flags = MAP_SHARED;
+    void *data;
+    int error;
+
+    memset(file, 0, sizeof(struct pcap_file));
+
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0)
+    {
+        return PCAP_FILE_ERROR_OPEN;
+    }
+    if ((fstat(file->fd, &st) != 0) || ((unsigned long long)st.st_size > (size_t)-1))
+    {
+        close(file->fd);
+        return PCAP_FILE_ERROR_OPEN;
+    }
+    if (st.st_size == 0)
+    {
+        close(file->fd);
+        return PCAP_FILE_ERROR_FORMAT;
+    }
+
+#ifdef MAP_POPULATE
+    if (flags & PCAP_FILE_POPULATE)
+    {
+        mmap_flags |= MAP_POPULATE;
+    }
+#endif
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, mmap_flags, file->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(file->fd);
+        return PCAP_FILE_ERROR_OPEN;
+    }
+    if (flags & PCAP_FILE_SEQUENTIAL)
+    {
+        /* Larger read-ahead, pages behind are dropped first */
+        madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    }
+
+    file->data = (const unsigned char *)data;
+    file->size = (unsigned long long)st.st_size;
+    file->mapped = 1;
+
+    error = parse_header(file);
+    if (error != PCAP_FILE_OK)
+    {
+        pcap_file_close(file);
+    }
+    return error;
+}
+
+void pcap_file_close(struct pcap_file *file)
+{
+    if (file->mapped)
+    {
+        munmap((void *)file->data, (size_t)file->size);
+        close(file->fd);
+    }
+    memset(file, 0, sizeof(struct pcap_file));
+}
+#endif
+
+const char *pcap_file_strerror(int error)
+{
+    switch (error)
+    {
+        case PCAP_FILE_OK:              return "no error";
+        case PCAP_FILE_ERROR_OPEN:      return "cannot open or map file";
+        case PCAP_FILE_ERROR_FORMAT:    return "not a pcap file";
+        case PCAP_FILE_ERROR_LINKTYPE:  return "link type is not DLT_USBPCAP";
+        case PCAP_FILE_ERROR_TRUNCATED: return "record truncated";
+        case PCAP_FILE_ERROR_LENGTH:    return "invalid record length";
+        case PCAP_FILE_ERROR_HEADER:    return "invalid USBPcap header length";
+        case PCAP_FILE_ERROR_TIMESTAMP: return "invalid timestamp";
+        default:                        return "unknown error";
+    }
+}
+
+void pcap_cursor_init(struct pcap_cursor *cursor, const struct pcap_file *file)
+{
+    pcap_cursor_range(cursor, file, PCAP_FILE_HEADER_LEN, file->size);
+}
+
+void pcap_cursor_range(struct pcap_cursor *cursor, const struct pcap_file *file,
+                       unsigned long long offset, unsigned long long end)
+{
+    cursor->file = file;
+    cursor->offset = offset;
+    cursor->end = (end < file->size) ? end : file->size;
+    cursor->error = PCAP_FILE_OK;
+}
+
+int pcap_cursor_next(struct pcap_cursor *cursor, struct pcap_record *record)
+{
+    const struct pcap_file *file = cursor->file;
+    const unsigned char *p;
+    unsigned long long left;
+    UINT32 hdr[4];
+    UINT32 fraction;
+    USHORT header_len;
+
+    if ((cursor->offset >= cursor->end) || (cursor->error != PCAP_FILE_OK))
+    {
+        return 0;
+    }
+
+    left = file->size - cursor->offset;
+    if (left < PCAP_RECORD_HEADER_LEN)
+    {
+        cursor->error = PCAP_FILE_ERROR_TRUNCATED;
+        return 0;
+    }
+
+    p = &file->data[cursor->offset];
+    memcpy(hdr, p, sizeof(hdr));
+    if (file->swapped)
+    {
+        hdr[0] = pcap_swap32(hdr[0]);
+        hdr[1] = pcap_swap32(hdr[1]);
+        hdr[2] = pcap_swap32(hdr[2]);
+        hdr[3] = pcap_swap32(hdr[3]);
+    }
+
+    /* hdr[] is ts_sec, ts_usec, incl_len, orig_len */
+    if ((hdr[2] > file->snaplen) || (hdr[2] > hdr[3]))
+    {
+        cursor->error = PCAP_FILE_ERROR_LENGTH;
+        return 0;
+    }
+    if (hdr[2] > left - PCAP_RECORD_HEADER_LEN)
+    {
+        cursor->error = PCAP_FILE_ERROR_TRUNCATED;
+        return 0;
+    }
+    if (hdr[2] < USBPCAP_MIN_HEADER_LEN)
+    {
+        cursor->error = PCAP_FILE_ERROR_HEADER;
+        return 0;
+    }
+
+    p += PCAP_RECORD_HEADER_LEN;
+    header_len = pcap_le16(p);
+    if ((header_len < USBPCAP_MIN_HEADER_LEN) || (header_len > hdr[2]))
+    {
+        cursor->error = PCAP_FILE_ERROR_HEADER;
+        return 0;
+    }
+
+    fraction = hdr[1];
+    if (fraction >= (file->nanosecond ? 1000000000 : 1000000))
+    {
+        cursor->error = PCAP_FILE_ERROR_TIMESTAMP;
+        return 0;
+    }
+
+    record->offset = cursor->offset;
+    record->timestamp = (unsigned long long)hdr[0] * 1000000000ULL +
+                        (file->nanosecond ? fraction : fraction * 1000ULL);
+    record->incl_len = hdr[2];
+    record->orig_len = hdr[3];
+    record->data = p;
+    record->usb = (const USBPCAP_BUFFER_PACKET_HEADER *)p;
+    record->header_len = header_len;
+    record->payload = p + header_len;
+    record->payload_len = hdr[2] - header_len;
+
+    cursor->offset += PCAP_RECORD_HEADER_LEN + hdr[2];
+    return 1;
+}
+
+const USBPCAP_BUFFER_CONTROL_HEADER *
+pcap_record_control(const struct pcap_record *record)
+{
+    if ((record->usb->transfer != USBPCAP_TRANSFER_CONTROL) ||
+        (record->header_len < sizeof(USBPCAP_BUFFER_CONTROL_HEADER)))
+    {
+        return NULL;
+    }
+    return (const USBPCAP_BUFFER_CONTROL_HEADER *)record->data;
+}
+
+const USBPCAP_BUFFER_ISOCH_HEADER *
+pcap_record_isoch(const struct pcap_record *record, ULONG *packets)
+{
+    const USBPCAP_BUFFER_ISOCH_HEADER *isoch;
+    ULONG count;
+
+    if ((record->usb->transfer != USBPCAP_TRANSFER_ISOCHRONOUS) ||
+        (record->header_len < USBPCAP_ISOCH_FIXED_LEN))
+    {
+        return NULL;
+    }
+
+    isoch = (const USBPCAP_BUFFER_ISOCH_HEADER *)record->data;
+    count = pcap_le32(&isoch->numberOfPackets);
+    if (count > (record->header_len - USBPCAP_ISOCH_FIXED_LEN) /
+                sizeof(USBPCAP_BUFFER_ISO_PACKET))
+    {
+        return NULL;
+    }
+
+    *packets = count;
+    return isoch;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Memory mapped DLT_USBPCAP capture reader.
+ *
+ * pcap_file_open() maps whole capture and checks the file header. The
+ * file may be written on host of either byte order, with microsecond or
+ * nanosecond timestamps. Records are then iterated with a cursor without
+ * copying: every record points into the mapping, with pcap record header
+ * fields converted to host order and USBPcap header available as the
+ * structures from include/USBPcap.h. Fields of USBPcap headers are always
+ * little endian, pcap_le16(), pcap_le32() and pcap_le64() read them on
+ * any host.
+ *
+ * Every record is validated before it is returned: it has to fit in the
+ * file, incl_len must not exceed snaplen nor orig_len and headerLen must
+ * cover USBPCAP_BUFFER_PACKET_HEADER without exceeding incl_len. Cursor
+ * stops at first invalid record and keeps the error and its offset.
+ *
+ * Cursors cover byte range of the file, so multiple cursors can walk
+ * different parts of one mapping at the same time.
+ */
+
+#ifndef USBPCAP_HOST_PCAPFILE_H
+#define USBPCAP_HOST_PCAPFILE_H
+
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "include/USBPcap.h"
+
+#define PCAP_MAGIC_USEC          0xA1B2C3D4
+#define PCAP_MAGIC_NSEC          0xA1B23C4D
+#define PCAP_FILE_HEADER_LEN     sizeof(pcap_hdr_t)
+#define PCAP_RECORD_HEADER_LEN   sizeof(pcaprec_hdr_t)
+
+/* Smallest headerLen of any USBPcap record */
+#define USBPCAP_MIN_HEADER_LEN   sizeof(USBPCAP_BUFFER_PACKET_HEADER)
+/* Isochronous header without packet descriptors */
+#define USBPCAP_ISOCH_FIXED_LEN  (sizeof(USBPCAP_BUFFER_ISOCH_HEADER) - \
+                                  sizeof(USBPCAP_BUFFER_ISO_PACKET))
+
+/* pcap_file_open() flags */
+#define PCAP_FILE_SEQUENTIAL     0x01 /* File is going to be read in order */
+#define PCAP_FILE_POPULATE       0x02 /* Read whole file in while mapping */
+
+#define PCAP_FILE_OK              0
+#define PCAP_FILE_ERROR_OPEN      1 /* File could not be opened or mapped */
+#define PCAP_FILE_ERROR_FORMAT    2 /* Not a pcap file */
+#define PCAP_FILE_ERROR_LINKTYPE  3 /* Link type other than DLT_USBPCAP */
+#define PCAP_FILE_ERROR_TRUNCATED 4 /* Record goes past end of file */
+#define PCAP_FILE_ERROR_LENGTH    5 /* incl_len larger than snaplen or orig_len */
+#define PCAP_FILE_ERROR_HEADER    6 /* headerLen invalid for incl_len */
+#define PCAP_FILE_ERROR_TIMESTAMP 7 /* Fraction of second out of range */
+
+struct pcap_file
+{
+    const unsigned char *data;   /* Whole file */
+    unsigned long long   size;
+    int                  swapped;    /* Written on host of other byte order */
+    int                  nanosecond; /* Timestamp fraction is nanoseconds */
+    UINT32               snaplen;
+    UINT32               network;
+
+    int                  mapped;
+#ifdef _WIN32
+    HANDLE               handle;
+    HANDLE               mapping;
+#else
+    int                  fd;
+#endif
+};
+
+struct pcap_record
+{
+    unsigned long long   offset;     /* Offset of pcap record header */
+    unsigned long long   timestamp;  /* Nanoseconds since epoch */
+    UINT32               incl_len;
+    UINT32               orig_len;
+    const unsigned char *data;       /* incl_len bytes, USBPcap header first */
+    const USBPCAP_BUFFER_PACKET_HEADER *usb; /* Same as data */
+    USHORT               header_len; /* usb->headerLen in host order */
+    const unsigned char *payload;    /* Data following USBPcap header */
+    UINT32               payload_len;
+};
+
+struct pcap_cursor
+{
+    const struct pcap_file *file;
+    unsigned long long   offset;     /* Next record */
+    unsigned long long   end;
+    int                  error;      /* PCAP_FILE_xxx, set when cursor stops */
+};
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define PCAP_HOST_BIG_ENDIAN 1
+#else
+#define PCAP_HOST_BIG_ENDIAN 0
+#endif
+
+static __inline UINT16 pcap_swap16(UINT16 v)
+{
+    return (UINT16)((v >> 8) | (v << 8));
+}
+
+static __inline UINT32 pcap_swap32(UINT32 v)
+{
+    return (v >> 24) | ((v >> 8) & 0xFF00) | ((v & 0xFF00) << 8) | (v << 24);
+}
+
+static __inline UINT64 pcap_swap64(UINT64 v)
+{
+    return ((UINT64)pcap_swap32((UINT32)v) << 32) | pcap_swap32((UINT32)(v >> 32));
+}
+
+/* Little endian field at any address, e.g. pcap_le32(&usb->dataLength) */
+static __inline UINT16 pcap_le16(const void *p)
+{
+    UINT16 v;
+    memcpy(&v, p, sizeof(v));
+    return PCAP_HOST_BIG_ENDIAN ? pcap_swap16(v) : v;
+}
+
+static __inline UINT32 pcap_le32(const void *p)
+{
+    UINT32 v;
+    memcpy(&v, p, sizeof(v));
+    return PCAP_HOST_BIG_ENDIAN ? pcap_swap32(v) : v;
+}
+
+static __inline UINT64 pcap_le64(const void *p)
+{
+    UINT64 v;
+    memcpy(&v, p, sizeof(v));
+    return PCAP_HOST_BIG_ENDIAN ? pcap_swap64(v) : v;
+}
+
+/*
+ * Maps the file and checks its header. flags are PCAP_FILE_xxx hints.
+ * Returns PCAP_FILE_OK, otherwise nothing has to be closed.
+ */
+int pcap_file_open(struct pcap_file *file, const char *path, int flags);
+
+/* Same as pcap_file_open() but for capture already in memory */
+int pcap_file_init(struct pcap_file *file, const void *data,
+                   unsigned long long size);
+
+void pcap_file_close(struct pcap_file *file);
+
+const char *pcap_file_strerror(int error);
+
+/* Cursor over all records of the file */
+void pcap_cursor_init(struct pcap_cursor *cursor, const struct pcap_file *file);
+
+/*
+ * Cursor over records starting at offset, which has to be a record
+ * boundary, up to the record that starts before end. The last record
+ * may extend past end.
+ */
+void pcap_cursor_range(struct pcap_cursor *cursor, const struct pcap_file *file,
+                       unsigned long long offset, unsigned long long end);
+
+/*
+ * Fills record with next record and returns 1. Returns 0 at the end of
+ * range or at invalid record, in which case cursor->error is set and
+ * cursor->offset is left at the invalid record.
+ */
+int pcap_cursor_next(struct pcap_cursor *cursor, struct pcap_record *record);
+
+/*
+ * Control transfer view, NULL if record is not a control transfer or
+ * its header is too short to contain stage.
+ */
+const USBPCAP_BUFFER_CONTROL_HEADER *
+pcap_record_control(const struct pcap_record *record);
+
+/*
+ * Isochronous transfer view, NULL if record is not isochronous or its
+ * header is too short for numberOfPackets descriptors. *packets is set
+ * to numberOfPackets in host order.
+ */
+const USBPCAP_BUFFER_ISOCH_HEADER *
+pcap_record_isoch(const struct pcap_record *record, ULONG *packets);
+
+#endif /* USBPCAP_HOST_PCAPFILE_H */
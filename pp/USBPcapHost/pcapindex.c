@@ -0,0 +1,812 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Builds region index of a capture in parallel and queries it.
+ *
+ * With --build the index of CAPTURE is written by pcap_index_build().
+ * Otherwise packets matching given time range, device, endpoint,
+ * direction, transfer type and IRP id are looked up with pcap_query_run()
+ * and counted or written to --output.
+ *
+ * Without CAPTURE a capture of bursty devices is generated, indexed, and
+ * a set of queries is timed against a parallel scan of the whole capture
+ * that has to find exactly the same packets.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capgen.h"
+#include "pcapquery.h"
+
+#define DEFAULT_SIZE_MB      1024
+#define DEFAULT_PASSES       3
+#define DEFAULT_FILE         "/tmp/pcapindex.pcap"
+#define STDIO_BUFFER_SIZE    (1024*1024)
+
+#define BENCH_DEVICES        16        /* Devices 2 .. 16 are bursty */
+#define BENCH_BURST          65536     /* Records with the same active devices */
+#define BENCH_IRPS           4096      /* IRP ids are reused */
+#define BENCH_HOT_IRP        0xFFFFB00000000000ULL
+#define BENCH_INTERVAL_NS    10000
+#define BENCH_QUERIES        6
+
+struct offsets
+{
+    unsigned long long *offsets;
+    unsigned long long  count;
+    unsigned long long  size;
+    int                 failed;
+};
+
+struct timing
+{
+    const char          *name;
+    struct pcap_query    query;
+    unsigned long long   matches;
+    unsigned long long   best_ns;
+    unsigned long long   scan_ns;
+    struct pcap_query_stats stats;
+};
+
+struct bench
+{
+    unsigned int         size_mb;
+    unsigned int         passes;
+    unsigned int         threads;
+    unsigned int         region_mb;
+    const char          *input;
+    const char          *index;
+    const char          *output;
+    int                  build;
+    int                  keep;
+    int                  json;
+
+    struct pcap_query    query;
+    int                  has_query;
+
+    unsigned long long   first_ts;
+    unsigned long long   last_ts;
+    unsigned long long   file_size;
+    unsigned long long   build_ns;
+    struct pcap_index_stats index_stats;
+    struct timing        timings[BENCH_QUERIES];
+    unsigned int         count;
+
+    unsigned long long   errors;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] [CAPTURE]\n"
+        "      --build            write index for CAPTURE\n"
+        "  -i, --index FILE       index file (default: CAPTURE.idx)\n"
+        "  -t, --threads N        build and query threads (default all CPUs)\n"
+        "  -r, --region MB        indexed region size (default %d)\n"
+        "      --from SECONDS     first packet time (Unix time)\n"
+        "      --to SECONDS       last packet time (Unix time)\n"
+        "      --device BUS.DEV[.EP]  only packets of device or endpoint\n"
+        "      --transfer TYPE    only isochronous, interrupt, control or bulk\n"
+        "      --in, --out        only packets of IN or OUT endpoints\n"
+        "      --irp ID           only packets of IRP id\n"
+        "  -o, --output FILE      write found packets to FILE\n"
+        "Without CAPTURE, benchmark on generated capture:\n"
+        "  -n, --size MB          size of generated capture (default %d)\n"
+        "  -p, --passes N         passes of every query, best counts (default %d)\n"
+        "      --keep             do not remove generated capture and index\n"
+        "      --json             print results as JSON\n",
+        argv0, PCAP_INDEX_REGION_SIZE / (1024*1024), DEFAULT_SIZE_MB,
+        DEFAULT_PASSES);
+}
+
+/*
+ * Device 1 sends interrupt transfers all the time, two of the others do
+ * bulk transfers in every burst so most regions lack most devices.
+ * Device 1 resubmits one IRP like polling drivers do, so one IRP id has
+ * thousands of packets in every region.
+ */
+static void generate_record(struct bench *bench, struct capgen_file *g,
+                            unsigned int *state, unsigned int *active,
+                            unsigned long long n)
+{
+    unsigned int completion = (unsigned int)(n & 1);
+    struct capgen_urb urb;
+    unsigned int payload;
+
+    if ((n % BENCH_BURST) == 0)
+    {
+        *state = *state * 1103515245 + 12345;
+        active[0] = 2 + (*state >> 8) % (BENCH_DEVICES - 1);
+        *state = *state * 1103515245 + 12345;
+        active[1] = 2 + (*state >> 8) % (BENCH_DEVICES - 1);
+    }
+    *state = *state * 1103515245 + 12345;
+
+    if ((n / 2) % 16 == 0)
+    {
+        capgen_urb_init(&urb, 1, 0x81, USBPCAP_TRANSFER_INTERRUPT);
+        payload = completion ? 8 : 0;
+    }
+    else
+    {
+        capgen_urb_init(&urb, active[(*state >> 16) & 1],
+                        ((*state >> 17) & 1) ? 0x81 : 0x02, USBPCAP_TRANSFER_BULK);
+        payload = (completion == (urb.endpoint >> 7)) ? (*state >> 8) % 1025 : 0;
+    }
+    if (urb.device == 1)
+    {
+        urb.irp = BENCH_HOT_IRP;
+    }
+    else
+    {
+        urb.irp = 0xFFFFA00000000000ULL + (((n / 2) % BENCH_IRPS) << 4);
+    }
+    urb.info = completion;
+
+    capgen_write(g, bench->first_ts + n * BENCH_INTERVAL_NS, &urb, NULL, payload);
+}
+
+static int generate(struct bench *bench)
+{
+    unsigned long long target = (unsigned long long)bench->size_mb * 1024 * 1024;
+    struct capgen_file g;
+    unsigned int active[2] = {2, 3};
+    unsigned int state = 1;
+    unsigned long long n = 0;
+
+    if (!capgen_create(&g, bench->input, 0, STDIO_BUFFER_SIZE))
+    {
+        fprintf(stderr, "Failed to create %s\n", bench->input);
+        return 0;
+    }
+
+    bench->first_ts = 1546300800ULL * 1000000000ULL;
+    while (!g.failed && (g.written < target))
+    {
+        generate_record(bench, &g, &state, active, n++);
+    }
+    bench->last_ts = bench->first_ts + (n - 1) * BENCH_INTERVAL_NS;
+
+    if (!capgen_close(&g) || (g.written < target))
+    {
+        fprintf(stderr, "Failed to write %s\n", bench->input);
+        return 0;
+    }
+    return 1;
+}
+
+static void add_offset(void *context, const struct pcap_record *record)
+{
+    struct offsets *o = (struct offsets *)context;
+    unsigned long long *p;
+
+    if (o->failed)
+    {
+        return;
+    }
+    if (o->count == o->size)
+    {
+        o->size = o->size ? o->size * 2 : 1024;
+        p = realloc(o->offsets, (size_t)o->size * sizeof(unsigned long long));
+        if (p == NULL)
+        {
+            o->failed = 1;
+            return;
+        }
+        o->offsets = p;
+    }
+    o->offsets[o->count++] = record->offset;
+}
+
+struct scan_chunk
+{
+    const struct pcap_query *query;
+    struct offsets           found;
+};
+
+static void scan_record(void *context, const struct pcap_record *record)
+{
+    struct scan_chunk *c = (struct scan_chunk *)context;
+
+    if (pcap_query_match(c->query, record))
+    {
+        add_offset(&c->found, record);
+    }
+}
+
+static void scan_reset(void *context)
+{
+    struct scan_chunk *c = (struct scan_chunk *)context;
+
+    c->found.count = 0;
+    c->found.failed = 0;
+}
+
+/* Finds matching packets the hard way, by parsing whole capture */
+static int scan_query(struct bench *bench, const struct pcap_file *file,
+                      const struct pcap_query *query, struct offsets *found)
+{
+    struct pcap_scan scan;
+    struct scan_chunk *chunks;
+    unsigned int i;
+    int ok;
+
+    if (!pcap_scan_init(&scan, file, bench->threads * 4, 0, scan_record, scan_reset))
+    {
+        return 0;
+    }
+    chunks = calloc(scan.count, sizeof(struct scan_chunk));
+    if (chunks == NULL)
+    {
+        pcap_scan_destroy(&scan);
+        return 0;
+    }
+    for (i = 0; i < scan.count; i++)
+    {
+        chunks[i].query = query;
+        scan.chunks[i].context = &chunks[i];
+    }
+
+    ok = (pcap_scan_run(&scan, bench->threads) == PCAP_FILE_OK);
+    for (i = 0; i < scan.count; i++)
+    {
+        struct pcap_record record;
+        unsigned long long j;
+
+        ok = ok && !chunks[i].found.failed;
+        for (j = 0; ok && (j < chunks[i].found.count); j++)
+        {
+            record.offset = chunks[i].found.offsets[j];
+            add_offset(found, &record);
+        }
+        free(chunks[i].found.offsets);
+    }
+
+    free(chunks);
+    pcap_scan_destroy(&scan);
+    return ok && !found->failed;
+}
+
+static void add_timing(struct bench *bench, const char *name,
+                       const struct pcap_query *query)
+{
+    struct timing *t = &bench->timings[bench->count++];
+
+    memset(t, 0, sizeof(struct timing));
+    t->name = name;
+    t->query = *query;
+}
+
+static void run_query(struct bench *bench, const struct pcap_index *index,
+                      const struct pcap_file *file, struct timing *t)
+{
+    struct offsets found, expected;
+    unsigned long long start, elapsed;
+    unsigned int pass;
+
+    memset(&expected, 0, sizeof(expected));
+    start = now_ns();
+    if (!scan_query(bench, file, &t->query, &expected))
+    {
+        fprintf(stderr, "%s: capture scan failed\n", t->name);
+        bench->errors++;
+        free(expected.offsets);
+        return;
+    }
+    t->scan_ns = now_ns() - start;
+
+    for (pass = 0; pass < bench->passes; pass++)
+    {
+        memset(&found, 0, sizeof(found));
+        start = now_ns();
+        t->matches = pcap_query_run(index, file, &t->query, bench->threads,
+                                    add_offset, &found, &t->stats);
+        elapsed = now_ns() - start;
+        if ((t->best_ns == 0) || (elapsed < t->best_ns))
+        {
+            t->best_ns = elapsed;
+        }
+
+        if (found.failed || (found.count != expected.count) ||
+            ((found.count != 0) &&
+             (memcmp(found.offsets, expected.offsets,
+                     (size_t)found.count * sizeof(unsigned long long)) != 0)))
+        {
+            fprintf(stderr, "%s: index found %llu packets, capture scan %llu\n",
+                    t->name, found.count, expected.count);
+            bench->errors++;
+            pass = bench->passes;
+        }
+        free(found.offsets);
+    }
+    if (expected.count == 0)
+    {
+        fprintf(stderr, "%s: query matches nothing\n", t->name);
+        bench->errors++;
+    }
+    free(expected.offsets);
+}
+
+static void print_results(struct bench *bench)
+{
+    const struct pcap_index_stats *s = &bench->index_stats;
+    double build_s = bench->build_ns / 1e9;
+    unsigned int i;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"file_size\": %llu,\n", bench->file_size);
+        printf("  \"packets\": %llu,\n", s->packets);
+        printf("  \"threads\": %u,\n", bench->threads);
+        printf("  \"regions\": %u,\n", s->regions);
+        printf("  \"index_size\": %llu,\n", s->index_size);
+        printf("  \"build_ms\": %.1f,\n", bench->build_ns / 1e6);
+        printf("  \"build_gb_s\": %.2f,\n",
+               build_s ? bench->file_size / build_s / 1e9 : 0.0);
+        printf("  \"queries\": [\n");
+        for (i = 0; i < bench->count; i++)
+        {
+            const struct timing *t = &bench->timings[i];
+
+            printf("    {\"query\": \"%s\", \"matches\": %llu, \"ms\": %.3f, "
+                   "\"scan_ms\": %.1f, \"regions\": %u, \"searched\": %u, "
+                   "\"candidates\": %llu}%s\n",
+                   t->name, t->matches, t->best_ns / 1e6, t->scan_ns / 1e6,
+                   t->stats.regions, t->stats.searched, t->stats.candidates,
+                   (i + 1 < bench->count) ? "," : "");
+        }
+        printf("  ],\n");
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%llu bytes, %llu packets, %u regions, index %llu bytes\n",
+               bench->file_size, s->packets, s->regions, s->index_size);
+        printf("Index built in %.1f ms on %u threads (%.2f GB/s)\n",
+               bench->build_ns / 1e6, bench->threads,
+               build_s ? bench->file_size / build_s / 1e9 : 0.0);
+        printf("%-10s %9s %10s %10s %9s %11s\n", "Query", "matches",
+               "index ms", "scan ms", "regions", "candidates");
+        for (i = 0; i < bench->count; i++)
+        {
+            const struct timing *t = &bench->timings[i];
+
+            printf("%-10s %9llu %10.3f %10.1f %4u/%-4u %11llu\n", t->name,
+                   t->matches, t->best_ns / 1e6, t->scan_ns / 1e6,
+                   t->stats.searched, s->regions, t->stats.candidates);
+        }
+        printf("Errors: %llu\n", bench->errors);
+    }
+}
+
+/* Device doing bulk transfers at given time, so queries find something */
+static int bulk_device(const struct pcap_index *index, const struct pcap_file *file,
+                       unsigned long long timestamp)
+{
+    const struct index_checkpoint *cp;
+    struct pcap_cursor cursor;
+    struct pcap_record record;
+
+    cp = index_seek_time(&index->reader, timestamp);
+    pcap_cursor_range(&cursor, file, cp ? cp->offset : PCAP_FILE_HEADER_LEN, file->size);
+    while (pcap_cursor_next(&cursor, &record))
+    {
+        if (record.usb->transfer == USBPCAP_TRANSFER_BULK)
+        {
+            return pcap_le16(&record.usb->device);
+        }
+    }
+    return 2;
+}
+
+static int benchmark(struct bench *bench)
+{
+    struct pcap_index index;
+    struct pcap_file file;
+    struct pcap_query q;
+    unsigned long long span;
+    unsigned long long start;
+    unsigned int i;
+    int error;
+
+    if (!generate(bench))
+    {
+        return 0;
+    }
+    error = pcap_file_open(&file, bench->input, 0);
+    if (error != PCAP_FILE_OK)
+    {
+        fprintf(stderr, "Failed to open capture: %s\n", pcap_file_strerror(error));
+        return 0;
+    }
+    bench->file_size = file.size;
+
+    start = now_ns();
+    error = pcap_index_build(&file, bench->index, bench->threads,
+                             bench->region_mb * 1024 * 1024, 0,
+                             &bench->index_stats);
+    bench->build_ns = now_ns() - start;
+    if ((error != PCAP_INDEX_OK) ||
+        (pcap_index_open(&index, bench->index) != PCAP_INDEX_OK))
+    {
+        fprintf(stderr, "Failed to build index (%d)\n", error);
+        pcap_file_close(&file);
+        return 0;
+    }
+
+    /* "Device 7 bulk IN between t1 and t2" and friends */
+    span = bench->last_ts - bench->first_ts;
+    pcap_query_init(&q);
+    q.from = bench->first_ts + span / 4;
+    q.to = bench->first_ts + span / 2;
+    q.bus = 1;
+    q.device = bulk_device(&index, &file, q.from + span / 8);
+    q.endpoint = 0x81;
+    add_timing(bench, "endpoint", &q);
+
+    q.endpoint = -1;
+    q.direction = 0x80;
+    q.transfer = USBPCAP_TRANSFER_BULK;
+    add_timing(bench, "device", &q);
+
+    pcap_query_init(&q);
+    q.from = bench->first_ts + span / 2;
+    q.to = q.from + span / 100;
+    add_timing(bench, "time", &q);
+
+    pcap_query_init(&q);
+    q.irp_set = 1;
+    q.irp = 0xFFFFA00000000000ULL + (123 << 4);
+    add_timing(bench, "irp", &q);
+
+    q.irp = BENCH_HOT_IRP;
+    add_timing(bench, "hot irp", &q);
+
+    pcap_query_init(&q);
+    q.transfer = USBPCAP_TRANSFER_INTERRUPT;
+    add_timing(bench, "transfer", &q);
+
+    for (i = 0; i < bench->count; i++)
+    {
+        run_query(bench, &index, &file, &bench->timings[i]);
+    }
+
+    pcap_index_close(&index);
+    pcap_file_close(&file);
+    return 1;
+}
+
+struct writer
+{
+    FILE *f;
+    int   failed;
+};
+
+static void write_record(void *context, const struct pcap_record *record)
+{
+    struct writer *w = (struct writer *)context;
+    size_t length = PCAP_RECORD_HEADER_LEN + record->incl_len;
+
+    if (!w->failed &&
+        (fwrite(record->data - PCAP_RECORD_HEADER_LEN, 1, length, w->f) != length))
+    {
+        w->failed = 1;
+    }
+}
+
+static void count_record(void *context, const struct pcap_record *record)
+{
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(record);
+}
+
+static int query(struct bench *bench, const struct pcap_file *file)
+{
+    struct pcap_query_stats stats;
+    struct pcap_index index;
+    struct writer w;
+    unsigned long long start;
+    int error;
+
+    error = pcap_index_open(&index, bench->index);
+    if (error != PCAP_INDEX_OK)
+    {
+        fprintf(stderr, "Failed to load index %s (%d), build it with --build.\n",
+                bench->index, error);
+        return 0;
+    }
+
+    w.f = NULL;
+    w.failed = 0;
+    if (bench->output != NULL)
+    {
+        w.f = fopen(bench->output, "wb");
+        if ((w.f == NULL) ||
+            (fwrite(file->data, 1, PCAP_FILE_HEADER_LEN, w.f) != PCAP_FILE_HEADER_LEN))
+        {
+            fprintf(stderr, "Failed to write %s.\n", bench->output);
+            if (w.f != NULL)
+            {
+                fclose(w.f);
+            }
+            pcap_index_close(&index);
+            return 0;
+        }
+        setvbuf(w.f, NULL, _IOFBF, STDIO_BUFFER_SIZE);
+    }
+
+    start = now_ns();
+    pcap_query_run(&index, file, &bench->query, bench->threads,
+                   w.f ? write_record : count_record, &w, &stats);
+    fprintf(stderr, "%llu packets found in %.3f ms, %u of %u regions searched, "
+            "%llu candidates\n", stats.matches, (now_ns() - start) / 1e6,
+            stats.searched, index.region_count, stats.candidates);
+
+    if ((w.f != NULL) && ((fclose(w.f) != 0) || w.failed))
+    {
+        fprintf(stderr, "Failed to write %s.\n", bench->output);
+        w.failed = 1;
+    }
+    pcap_index_close(&index);
+    return !w.failed;
+}
+
+static int build(struct bench *bench, const struct pcap_file *file)
+{
+    struct pcap_index_stats *s = &bench->index_stats;
+    unsigned long long start = now_ns();
+    double elapsed;
+    int error;
+
+    error = pcap_index_build(file, bench->index, bench->threads,
+                             bench->region_mb * 1024 * 1024, 0, s);
+    elapsed = (now_ns() - start) / 1e9;
+    if (error == PCAP_INDEX_ERROR_CAPTURE)
+    {
+        fprintf(stderr, "Record at %llu: %s\n", s->error_offset,
+                pcap_file_strerror(s->error));
+    }
+    if (error != PCAP_INDEX_OK)
+    {
+        fprintf(stderr, "Failed to index %s (%d).\n", bench->input, error);
+        return 0;
+    }
+    fprintf(stderr, "Indexed %llu packets in %u regions, %llu bytes index, "
+            "%.1f ms (%.2f GB/s)\n", s->packets, s->regions, s->index_size,
+            elapsed * 1e3, elapsed ? file->size / elapsed / 1e9 : 0.0);
+    return 1;
+}
+
+static unsigned long long parse_seconds(const char *arg)
+{
+    return (unsigned long long)(strtod(arg, NULL) * 1e9);
+}
+
+static int parse_device(struct pcap_query *q, const char *arg)
+{
+    int n = sscanf(arg, "%d.%d.%i", &q->bus, &q->device, &q->endpoint);
+
+    if ((n < 2) || (q->bus < 0) || (q->device < 0))
+    {
+        return 0;
+    }
+    if (n == 2)
+    {
+        q->endpoint = -1;
+    }
+    return 1;
+}
+
+static int parse_transfer(const char *arg)
+{
+    static const char *names[] = {"isochronous", "interrupt", "control", "bulk"};
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        if (strcmp(arg, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"build",     no_argument,       NULL, 'B'},
+        {"index",     required_argument, NULL, 'i'},
+        {"threads",   required_argument, NULL, 't'},
+        {"region",    required_argument, NULL, 'r'},
+        {"from",      required_argument, NULL, 'F'},
+        {"to",        required_argument, NULL, 'T'},
+        {"device",    required_argument, NULL, 'D'},
+        {"transfer",  required_argument, NULL, 'X'},
+        {"in",        no_argument,       NULL, 'I'},
+        {"out",       no_argument,       NULL, 'O'},
+        {"irp",       required_argument, NULL, 'R'},
+        {"output",    required_argument, NULL, 'o'},
+        {"size",      required_argument, NULL, 'n'},
+        {"passes",    required_argument, NULL, 'p'},
+        {"keep",      no_argument,       NULL, 'K'},
+        {"json",      no_argument,       NULL, 'J'},
+        {"help",      no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench bench;
+    struct pcap_file file;
+    char *index = NULL;
+    int ok;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.size_mb = DEFAULT_SIZE_MB;
+    bench.passes = DEFAULT_PASSES;
+    bench.threads = pcap_scan_cpus();
+    bench.region_mb = PCAP_INDEX_REGION_SIZE / (1024*1024);
+    pcap_query_init(&bench.query);
+
+    while ((c = getopt_long(argc, argv, "i:t:r:o:n:p:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'B':
+                bench.build = 1;
+                break;
+            case 'i':
+                bench.index = optarg;
+                break;
+            case 't':
+                bench.threads = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench.region_mb = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'F':
+                bench.query.from = parse_seconds(optarg);
+                bench.has_query = 1;
+                break;
+            case 'T':
+                bench.query.to = parse_seconds(optarg);
+                bench.has_query = 1;
+                break;
+            case 'D':
+                if (!parse_device(&bench.query, optarg))
+                {
+                    fprintf(stderr, "Invalid device %s, use BUS.DEV or "
+                            "BUS.DEV.EP\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                bench.has_query = 1;
+                break;
+            case 'X':
+                bench.query.transfer = parse_transfer(optarg);
+                if (bench.query.transfer < 0)
+                {
+                    fprintf(stderr, "Invalid transfer type %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                bench.has_query = 1;
+                break;
+            case 'I':
+                bench.query.direction = 0x80;
+                bench.has_query = 1;
+                break;
+            case 'O':
+                bench.query.direction = 0;
+                bench.has_query = 1;
+                break;
+            case 'R':
+                bench.query.irp = strtoull(optarg, NULL, 0);
+                bench.query.irp_set = 1;
+                bench.has_query = 1;
+                break;
+            case 'o':
+                bench.output = optarg;
+                break;
+            case 'n':
+                bench.size_mb = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                bench.passes = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'K':
+                bench.keep = 1;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc)
+    {
+        bench.input = argv[optind];
+    }
+
+    if ((bench.threads == 0) || (bench.region_mb == 0) || (bench.passes == 0) ||
+        ((bench.input == NULL) && (bench.size_mb == 0)))
+    {
+        fprintf(stderr, "Need at least one pass on one thread over at least 1 MB.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (bench.input == NULL)
+    {
+        bench.input = DEFAULT_FILE;
+    }
+    if (bench.index == NULL)
+    {
+        index = malloc(strlen(bench.input) + 5);
+        if (index == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        sprintf(index, "%s.idx", bench.input);
+        bench.index = index;
+    }
+
+    if (optind == argc)
+    {
+        ok = benchmark(&bench);
+        if (!bench.keep)
+        {
+            remove(bench.input);
+            remove(bench.index);
+        }
+        if (ok)
+        {
+            print_results(&bench);
+        }
+        free(index);
+        return (ok && (bench.errors == 0)) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (!bench.build && !bench.has_query)
+    {
+        usage(argv[0]);
+        free(index);
+        return EXIT_FAILURE;
+    }
+
+    c = pcap_file_open(&file, bench.input, bench.build ? PCAP_FILE_SEQUENTIAL : 0);
+    if (c != PCAP_FILE_OK)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", bench.input, pcap_file_strerror(c));
+        free(index);
+        return EXIT_FAILURE;
+    }
+
+    ok = bench.build ? build(&bench, &file) : query(&bench, &file);
+
+    pcap_file_close(&file);
+    free(index);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
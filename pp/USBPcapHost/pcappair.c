@@ -0,0 +1,820 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Pairs URB submits with completions and reports per endpoint latency,
+ * throughput and queue depth.
+ *
+ * The capture is read in file order by the streaming engine of
+ * urbpair.h. Paired URBs can be written as CSV (--pairs), statistics
+ * are printed for the whole capture and with --interval also for every
+ * interval of capture time.
+ *
+ * Without capture, one with URBs of known latency and queue depth on
+ * several endpoints is generated together with orphan submits, reused
+ * IRP ids, completions without submit and control transfers with DATA
+ * stage. Parsing alone and parsing with pairing are timed and the
+ * engine has to find exactly what was generated.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capgen.h"
+#include "urbpair.h"
+
+#define DEFAULT_SIZE_MB      1024
+#define DEFAULT_PASSES       3
+#define DEFAULT_FILE         "/tmp/pcappair.pcap"
+#define STDIO_BUFFER_SIZE    (1024*1024)
+
+#define GEN_ENDPOINTS        8         /* Endpoint i keeps i + 1 URBs in flight */
+#define GEN_PAYLOAD          64
+#define GEN_RECORD_NS        1000
+#define GEN_ERROR_EVERY      97        /* Completions with error status */
+#define GEN_CONTROL_EVERY    5003
+#define GEN_ORPHAN_EVERY     10007
+#define GEN_REUSE_EVERY      10009
+#define GEN_UNMATCHED_EVERY  10037
+#define GEN_FREE_IRPS        1024      /* Completed IRP ids waiting for reuse */
+#define GEN_ORPHAN_DEVICE    9
+
+struct gen_endpoint
+{
+    unsigned long long irps[GEN_ENDPOINTS];
+    unsigned long long submitted[GEN_ENDPOINTS];
+    unsigned int       first;
+    unsigned int       count;
+
+    /* Expected */
+    unsigned long long urbs;
+    unsigned long long errors;
+    unsigned long long latency_sum;
+};
+
+struct generator
+{
+    struct capgen_file  file;
+    unsigned long long  n;            /* Records written */
+    unsigned long long  next_irp;
+    unsigned long long  free_irps[GEN_FREE_IRPS];
+    unsigned int        free_first;
+    unsigned int        free_count;
+    struct gen_endpoint endpoints[GEN_ENDPOINTS];
+
+    /* Expected */
+    unsigned long long  pairs;
+    unsigned long long  orphans;      /* Never completed, not reused */
+    unsigned long long  reused;
+    unsigned long long  unmatched;
+};
+
+struct bench
+{
+    unsigned int         size_mb;
+    unsigned int         passes;
+    unsigned int         slots;
+    unsigned long long   timeout;
+    unsigned long long   interval;
+    const char          *input;
+    const char          *output;
+    const char          *pairs_path;
+    int                  histograms;
+    int                  keep;
+    int                  json;
+
+    struct generator     gen;
+    int                  generated;
+    unsigned long long   file_size;
+    unsigned long long   parse_ns;
+    unsigned long long   pair_ns;
+
+    FILE                *pairs;
+    struct urb_endpoint *snapshot;    /* Endpoints at start of interval */
+    unsigned int         snapshot_count;
+    unsigned long long   interval_start;
+
+    unsigned long long   errors;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] [CAPTURE]\n"
+        "      --pairs FILE       write paired URBs as CSV to FILE (- for stdout)\n"
+        "      --interval SECONDS also report every interval of capture time\n"
+        "      --histograms       print latency and queue depth histograms\n"
+        "      --slots N          URBs in flight kept (default %d)\n"
+        "      --timeout SECONDS  evict submits not completed in time (default %llu,\n"
+        "                         0 to keep them until the table fills up)\n"
+        "      --json             print results as JSON\n"
+        "Without CAPTURE, benchmark on generated capture:\n"
+        "  -n, --size MB          size of generated capture (default %d)\n"
+        "  -p, --passes N         passes, best counts (default %d)\n"
+        "  -o, --output FILE      generated capture (default %s)\n"
+        "      --keep             do not remove generated capture\n",
+        argv0, URB_PAIR_DEFAULT_SLOTS, URB_PAIR_DEFAULT_TIMEOUT / 1000000000ULL,
+        DEFAULT_SIZE_MB, DEFAULT_PASSES, DEFAULT_FILE);
+}
+
+static unsigned long long gen_timestamp(unsigned long long n)
+{
+    return 1546300800ULL * 1000000000ULL + n * GEN_RECORD_NS;
+}
+
+/* Writes one record, stage < 0 for non-control transfers */
+static void emit(struct generator *g, unsigned int device, unsigned int endpoint,
+                 unsigned int transfer, unsigned long long irp, int completion,
+                 unsigned int status, int stage, unsigned int payload)
+{
+    unsigned char stage_byte = (unsigned char)stage;
+    struct capgen_urb urb;
+
+    capgen_urb_init(&urb, device, endpoint, transfer);
+    urb.irp = irp;
+    urb.status = status;
+    urb.info = completion ? USBPCAP_INFO_PDO_TO_FDO : 0;
+    if (stage >= 0)
+    {
+        urb.extra = &stage_byte;
+        urb.extra_len = 1;
+    }
+    capgen_write(&g->file, gen_timestamp(g->n), &urb, NULL, payload);
+    g->n++;
+}
+
+static unsigned long long take_irp(struct generator *g)
+{
+    unsigned long long irp;
+
+    /* Completed IRPs are reused once enough of them pile up */
+    if (g->free_count > GEN_FREE_IRPS / 2)
+    {
+        irp = g->free_irps[g->free_first];
+        g->free_first = (g->free_first + 1) % GEN_FREE_IRPS;
+        g->free_count--;
+        return irp;
+    }
+    return 0xFFFFA00000000000ULL + (g->next_irp++ << 4);
+}
+
+static void free_irp(struct generator *g, unsigned long long irp)
+{
+    if (g->free_count < GEN_FREE_IRPS)
+    {
+        g->free_irps[(g->free_first + g->free_count) % GEN_FREE_IRPS] = irp;
+        g->free_count++;
+    }
+}
+
+/* Completes the oldest URB of full queue, then submits a new one */
+static void gen_step(struct generator *g, unsigned int i)
+{
+    struct gen_endpoint *e = &g->endpoints[i];
+    unsigned int device = 2 + i / 2;
+    unsigned int endpoint = (i & 1) ? 0x02 : 0x81;
+    unsigned int transfer = (i == GEN_ENDPOINTS - 1) ? USBPCAP_TRANSFER_INTERRUPT :
+                                                       USBPCAP_TRANSFER_BULK;
+    unsigned int status = 0;
+    unsigned long long irp;
+
+    if (e->count == i + 1)
+    {
+        irp = e->irps[e->first];
+        if ((e->urbs + 1) % GEN_ERROR_EVERY == 0)
+        {
+            status = 0xC0000004;
+            e->errors++;
+        }
+        e->latency_sum += gen_timestamp(g->n) - e->submitted[e->first];
+        e->urbs++;
+        g->pairs++;
+        emit(g, device, endpoint, transfer, irp, 1, status, -1,
+             (endpoint & 0x80) ? GEN_PAYLOAD : 0);
+        e->first = (e->first + 1) % GEN_ENDPOINTS;
+        e->count--;
+        free_irp(g, irp);
+    }
+
+    irp = take_irp(g);
+    e->irps[(e->first + e->count) % GEN_ENDPOINTS] = irp;
+    e->submitted[(e->first + e->count) % GEN_ENDPOINTS] = gen_timestamp(g->n);
+    e->count++;
+    emit(g, device, endpoint, transfer, irp, 0, 0, -1,
+         (endpoint & 0x80) ? 0 : GEN_PAYLOAD);
+}
+
+static void gen_anomalies(struct generator *g, unsigned long long step)
+{
+    unsigned long long irp;
+
+    if (step % GEN_CONTROL_EVERY == 0)
+    {
+        /* SET_REPORT like control OUT with DATA stage */
+        irp = 0xFFFFB00000000000ULL + (step << 4);
+        emit(g, 2, 0x00, USBPCAP_TRANSFER_CONTROL, irp, 0, 0,
+             USBPCAP_CONTROL_STAGE_SETUP, 8);
+        emit(g, 2, 0x00, USBPCAP_TRANSFER_CONTROL, irp, 0, 0,
+             USBPCAP_CONTROL_STAGE_DATA, 16);
+        emit(g, 2, 0x00, USBPCAP_TRANSFER_CONTROL, irp, 1, 0,
+             USBPCAP_CONTROL_STAGE_COMPLETE, 0);
+        g->pairs++;
+    }
+    if (step % GEN_ORPHAN_EVERY == 0)
+    {
+        irp = 0xFFFF900000000000ULL + (step << 4);
+        emit(g, GEN_ORPHAN_DEVICE, 0x83, USBPCAP_TRANSFER_BULK, irp, 0, 0, -1, 0);
+        g->orphans++;
+    }
+    if (step % GEN_REUSE_EVERY == 0)
+    {
+        /* Completion of the first submit was not captured */
+        irp = 0xFFFF800000000000ULL + (step << 4);
+        emit(g, GEN_ORPHAN_DEVICE, 0x84, USBPCAP_TRANSFER_BULK, irp, 0, 0, -1, 0);
+        emit(g, GEN_ORPHAN_DEVICE, 0x84, USBPCAP_TRANSFER_BULK, irp, 0, 0, -1, 0);
+        emit(g, GEN_ORPHAN_DEVICE, 0x84, USBPCAP_TRANSFER_BULK, irp, 1, 0, -1, 0);
+        g->reused++;
+        g->pairs++;
+    }
+    if (step % GEN_UNMATCHED_EVERY == 0)
+    {
+        irp = 0xFFFF700000000000ULL + (step << 4);
+        emit(g, GEN_ORPHAN_DEVICE, 0x85, USBPCAP_TRANSFER_BULK, irp, 1, 0, -1, 0);
+        g->unmatched++;
+    }
+}
+
+static int generate(struct bench *bench)
+{
+    struct generator *g = &bench->gen;
+    unsigned long long target = (unsigned long long)bench->size_mb * 1024 * 1024;
+    unsigned long long step;
+    unsigned int i;
+
+    memset(g, 0, sizeof(struct generator));
+    if (!capgen_create(&g->file, bench->output, 0, STDIO_BUFFER_SIZE))
+    {
+        fprintf(stderr, "Failed to create %s\n", bench->output);
+        return 0;
+    }
+
+    for (step = 1; !g->file.failed && (g->file.written < target); step++)
+    {
+        gen_step(g, (unsigned int)(step % GEN_ENDPOINTS));
+        gen_anomalies(g, step);
+    }
+    for (i = 0; i < GEN_ENDPOINTS; i++)
+    {
+        g->orphans += g->endpoints[i].count;
+    }
+
+    if (!capgen_close(&g->file) || (g->file.written < target))
+    {
+        fprintf(stderr, "Failed to write %s\n", bench->output);
+        return 0;
+    }
+    bench->generated = 1;
+    return 1;
+}
+
+static const char *transfer_name(unsigned int transfer)
+{
+    switch (transfer)
+    {
+        case USBPCAP_TRANSFER_ISOCHRONOUS: return "isoch";
+        case USBPCAP_TRANSFER_INTERRUPT:   return "intr";
+        case USBPCAP_TRANSFER_CONTROL:     return "ctrl";
+        case USBPCAP_TRANSFER_BULK:        return "bulk";
+        default:                           return "other";
+    }
+}
+
+static void write_pair(void *context, const struct urb_pair *pair)
+{
+    struct bench *bench = (struct bench *)context;
+    const struct urb_endpoint *ep = pair->endpoint;
+
+    fprintf(bench->pairs, "0x%016llX,%llu,%llu,%llu,%llu,%llu,%u,%u,0x%02X,%s,0x%08X,%u\n",
+            pair->irp, pair->submit_offset, pair->complete_offset,
+            pair->submit_ts, pair->complete_ts,
+            pair->complete_ts - pair->submit_ts,
+            ep->bus, ep->device, ep->endpoint, transfer_name(ep->transfer),
+            pair->status, pair->bytes);
+}
+
+/* Prints endpoints that did something since snapshot, which becomes now */
+static void report_interval(struct bench *bench, struct urb_pairer *p,
+                            unsigned long long end)
+{
+    double seconds = (double)(end - bench->interval_start) / 1e9;
+    struct urb_endpoint *snapshot;
+    unsigned long long latency[URB_LATENCY_BUCKETS];
+    unsigned int i, j;
+
+    urb_pair_advance(p, end);
+    for (i = 0; i < p->endpoint_count; i++)
+    {
+        const struct urb_endpoint *ep = &p->endpoints[i];
+        struct urb_endpoint zero;
+        const struct urb_endpoint *old = &zero;
+
+        if (i < bench->snapshot_count)
+        {
+            old = &bench->snapshot[i];
+        }
+        else
+        {
+            memset(&zero, 0, sizeof(zero));
+        }
+        if ((ep->urbs == old->urbs) && (ep->bytes == old->bytes) &&
+            (ep->depth_area == old->depth_area))
+        {
+            continue;
+        }
+        for (j = 0; j < URB_LATENCY_BUCKETS; j++)
+        {
+            latency[j] = ep->latency[j] - old->latency[j];
+        }
+        printf("%10.3f %4u %4u  0x%02X  %-5s %11.1f %9.0f %7llu %9.1f %9.1f %7.2f\n",
+               (double)(bench->interval_start - p->first_ts) / 1e9,
+               ep->bus, ep->device, ep->endpoint, transfer_name(ep->transfer),
+               (ep->bytes - old->bytes) / seconds / 1000.0,
+               (ep->urbs - old->urbs) / seconds, ep->errors - old->errors,
+               urb_latency_percentile(latency, ep->latency_max, 50) / 1e3,
+               urb_latency_percentile(latency, ep->latency_max, 99) / 1e3,
+               (ep->depth_area - old->depth_area) / (seconds * 1e9));
+    }
+
+    snapshot = realloc(bench->snapshot, (p->endpoint_count + 1) * sizeof(struct urb_endpoint));
+    if (snapshot != NULL)
+    {
+        memcpy(snapshot, p->endpoints, p->endpoint_count * sizeof(struct urb_endpoint));
+        bench->snapshot = snapshot;
+        bench->snapshot_count = p->endpoint_count;
+    }
+    bench->interval_start = end;
+}
+
+/* Reads the whole capture, with p NULL only parses it */
+static int run(struct bench *bench, const struct pcap_file *file,
+               struct urb_pairer *p, unsigned long long *records)
+{
+    struct pcap_cursor cursor;
+    struct pcap_record record;
+
+    *records = 0;
+    pcap_cursor_init(&cursor, file);
+    while (pcap_cursor_next(&cursor, &record))
+    {
+        (*records)++;
+        if (p == NULL)
+        {
+            continue;
+        }
+        if (bench->interval != 0)
+        {
+            if (*records == 1)
+            {
+                bench->interval_start = record.timestamp;
+                printf("%10s %4s %4s  %4s  %-5s %11s %9s %7s %9s %9s %7s\n",
+                       "Time s", "Bus", "Dev", "Endp", "Type", "kB/s", "URB/s",
+                       "Errors", "p50 us", "p99 us", "Depth");
+            }
+            while (record.timestamp >= bench->interval_start + bench->interval)
+            {
+                report_interval(bench, p, bench->interval_start + bench->interval);
+            }
+        }
+        urb_pair_record(p, &record);
+    }
+    if (cursor.error != PCAP_FILE_OK)
+    {
+        fprintf(stderr, "Record at %llu: %s\n", cursor.offset,
+                pcap_file_strerror(cursor.error));
+        return 0;
+    }
+    if (p != NULL)
+    {
+        if ((bench->interval != 0) && (*records != 0))
+        {
+            report_interval(bench, p, p->last_ts + 1);
+        }
+        urb_pair_finish(p);
+        if (p->failed)
+        {
+            fprintf(stderr, "Out of memory for endpoints\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Percentiles of histogram of count latencies first, first + step, ...
+ * must be ordered, in the bucket of the exact ones and not above maximum
+ */
+static void check_percentiles(struct bench *bench, unsigned long long first,
+                              unsigned long long step, unsigned int count)
+{
+    unsigned long long latency[URB_LATENCY_BUCKETS];
+    unsigned long long max = first + step * (count - 1);
+    unsigned long long p50, p99;
+    unsigned long long exact50 = first + step * ((count * 50 + 99) / 100 - 1);
+    unsigned long long exact99 = first + step * ((count * 99 + 99) / 100 - 1);
+    unsigned int i;
+
+    memset(latency, 0, sizeof(latency));
+    for (i = 0; i < count; i++)
+    {
+        latency[urb_latency_bucket(first + step * i)]++;
+    }
+    p50 = urb_latency_percentile(latency, max, 50);
+    p99 = urb_latency_percentile(latency, max, 99);
+    if ((p50 > p99) || (p99 > max) ||
+        (urb_latency_bucket(p50) != urb_latency_bucket(exact50)) ||
+        (urb_latency_bucket(p99) != urb_latency_bucket(exact99)) ||
+        (urb_latency_percentile(latency, max, 100) != max))
+    {
+        fprintf(stderr, "Latencies %llu + %llu * <0,%u>: p50 %llu, p99 %llu\n",
+                first, step, count - 1, p50, p99);
+        bench->errors++;
+    }
+}
+
+static void check(struct bench *bench, const struct urb_pairer *p)
+{
+    const struct generator *g = &bench->gen;
+    unsigned int i, j;
+
+    check_percentiles(bench, 1000, 0, 100);
+    check_percentiles(bench, 1000, 1000, 100);
+    check_percentiles(bench, 3, 1, 2);
+    check_percentiles(bench, 10000000000ULL, 0, 1);
+    check_percentiles(bench, 1000000, 1000000000, 20);
+
+    if ((p->pairs != g->pairs) || (p->reused != g->reused) ||
+        (p->unmatched != g->unmatched) ||
+        (p->timed_out + p->overflowed + p->in_flight != g->orphans))
+    {
+        fprintf(stderr, "Found %llu pairs, %llu reused, %llu unmatched, %llu orphans; "
+                "generated %llu, %llu, %llu, %llu\n", p->pairs, p->reused,
+                p->unmatched, p->timed_out + p->overflowed + p->in_flight,
+                g->pairs, g->reused, g->unmatched, g->orphans);
+        bench->errors++;
+    }
+
+    for (i = 0; i < GEN_ENDPOINTS; i++)
+    {
+        const struct gen_endpoint *e = &g->endpoints[i];
+        const struct urb_endpoint *ep = NULL;
+
+        for (j = 0; j < p->endpoint_count; j++)
+        {
+            if ((p->endpoints[j].device == 2 + i / 2) &&
+                (p->endpoints[j].endpoint == ((i & 1) ? 0x02 : 0x81)))
+            {
+                ep = &p->endpoints[j];
+            }
+        }
+        if ((ep == NULL) || (ep->urbs != e->urbs) || (ep->errors != e->errors) ||
+            (ep->latency_sum != e->latency_sum) || (ep->depth_max != i + 1) ||
+            (urb_latency_percentile(ep->latency, ep->latency_max, 99) > ep->latency_max))
+        {
+            fprintf(stderr, "Endpoint %u statistics differ from generated\n", i);
+            bench->errors++;
+        }
+    }
+}
+
+static void print_histograms(const struct urb_endpoint *ep)
+{
+    unsigned int i;
+
+    printf("  %u.%u 0x%02X latency:", ep->bus, ep->device, ep->endpoint);
+    for (i = 0; i < URB_LATENCY_BUCKETS; i++)
+    {
+        if (ep->latency[i] != 0)
+        {
+            printf(" %llu+:%llu", urb_latency_bucket_start(i), ep->latency[i]);
+        }
+    }
+    printf("\n  %u.%u 0x%02X depth:", ep->bus, ep->device, ep->endpoint);
+    for (i = 0; i < URB_DEPTH_BUCKETS; i++)
+    {
+        if (ep->depth_hist[i] != 0)
+        {
+            printf(" %u%s:%llu", i, (i == URB_DEPTH_BUCKETS - 1) ? "+" : "",
+                   ep->depth_hist[i]);
+        }
+    }
+    printf("\n");
+}
+
+static void print_results(struct bench *bench, const struct urb_pairer *p,
+                          unsigned long long records)
+{
+    double seconds = (p->last_ts > p->first_ts) ? (p->last_ts - p->first_ts) / 1e9 : 1.0;
+    unsigned int i, j;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"file_size\": %llu,\n", bench->file_size);
+        printf("  \"records\": %llu,\n", records);
+        printf("  \"pairs\": %llu,\n", p->pairs);
+        printf("  \"unmatched\": %llu,\n", p->unmatched);
+        printf("  \"reused\": %llu,\n", p->reused);
+        printf("  \"timed_out\": %llu,\n", p->timed_out);
+        printf("  \"overflowed\": %llu,\n", p->overflowed);
+        printf("  \"in_flight\": %llu,\n", p->in_flight);
+        if (bench->generated)
+        {
+            printf("  \"parse_gb_s\": %.2f,\n",
+                   bench->parse_ns ? (double)bench->file_size / bench->parse_ns : 0.0);
+            printf("  \"pair_gb_s\": %.2f,\n",
+                   bench->pair_ns ? (double)bench->file_size / bench->pair_ns : 0.0);
+            printf("  \"pair_mrecords_s\": %.1f,\n",
+                   bench->pair_ns ? records * 1e3 / bench->pair_ns : 0.0);
+        }
+        printf("  \"endpoints\": [\n");
+        for (i = 0; i < p->endpoint_count; i++)
+        {
+            const struct urb_endpoint *ep = &p->endpoints[i];
+
+            printf("    {\"bus\": %u, \"device\": %u, \"endpoint\": %u, "
+                   "\"transfer\": \"%s\", \"urbs\": %llu, \"errors\": %llu, "
+                   "\"orphans\": %llu, \"bytes_s\": %.0f, \"p50_ns\": %llu, "
+                   "\"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, "
+                   "\"mean_depth\": %.3f, \"max_depth\": %u, \"depth\": [",
+                   ep->bus, ep->device, ep->endpoint, transfer_name(ep->transfer),
+                   ep->urbs, ep->errors, ep->orphans, ep->bytes / seconds,
+                   urb_latency_percentile(ep->latency, ep->latency_max, 50),
+                   urb_latency_percentile(ep->latency, ep->latency_max, 90),
+                   urb_latency_percentile(ep->latency, ep->latency_max, 99),
+                   ep->latency_max,
+                   ep->depth_area / (seconds * 1e9), ep->depth_max);
+            for (j = 0; j < URB_DEPTH_BUCKETS; j++)
+            {
+                printf("%s%llu", j ? ", " : "", ep->depth_hist[j]);
+            }
+            printf("]}%s\n", (i + 1 < p->endpoint_count) ? "," : "");
+        }
+        printf("  ],\n");
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+        return;
+    }
+
+    printf("%llu records, %llu URBs paired, %llu completions without submit, "
+           "%llu reused IRPs, %llu timed out, %llu evicted, %llu in flight at end\n",
+           records, p->pairs, p->unmatched, p->reused, p->timed_out,
+           p->overflowed, p->in_flight);
+    if (bench->generated)
+    {
+        printf("Parse %.1f ms (%.2f GB/s), parse and pair %.1f ms (%.2f GB/s, "
+               "%.1f Mrecords/s)\n", bench->parse_ns / 1e6,
+               bench->parse_ns ? (double)bench->file_size / bench->parse_ns : 0.0,
+               bench->pair_ns / 1e6,
+               bench->pair_ns ? (double)bench->file_size / bench->pair_ns : 0.0,
+               bench->pair_ns ? records * 1e3 / bench->pair_ns : 0.0);
+    }
+    printf("  Bus  Dev  Endp  Type         URBs  Errors Orphans        kB/s"
+           "   p50 us   p99 us   max us  Depth  Max\n");
+    for (i = 0; i < p->endpoint_count; i++)
+    {
+        const struct urb_endpoint *ep = &p->endpoints[i];
+
+        printf("%5u %4u  0x%02X  %-5s %10llu %7llu %7llu %11.1f %8.1f %8.1f %8.1f %6.2f %4u\n",
+               ep->bus, ep->device, ep->endpoint, transfer_name(ep->transfer),
+               ep->urbs, ep->errors, ep->orphans, ep->bytes / seconds / 1000.0,
+               urb_latency_percentile(ep->latency, ep->latency_max, 50) / 1e3,
+               urb_latency_percentile(ep->latency, ep->latency_max, 99) / 1e3,
+               ep->latency_max / 1e3, ep->depth_area / (seconds * 1e9),
+               ep->depth_max);
+    }
+    if (bench->histograms)
+    {
+        for (i = 0; i < p->endpoint_count; i++)
+        {
+            print_histograms(&p->endpoints[i]);
+        }
+    }
+    if (bench->generated)
+    {
+        printf("Errors: %llu\n", bench->errors);
+    }
+}
+
+static double parse_seconds(const char *arg)
+{
+    return strtod(arg, NULL) * 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"pairs",      required_argument, NULL, 'P'},
+        {"interval",   required_argument, NULL, 'I'},
+        {"histograms", no_argument,       NULL, 'H'},
+        {"slots",      required_argument, NULL, 'S'},
+        {"timeout",    required_argument, NULL, 'T'},
+        {"size",       required_argument, NULL, 'n'},
+        {"passes",     required_argument, NULL, 'p'},
+        {"output",     required_argument, NULL, 'o'},
+        {"keep",       no_argument,       NULL, 'K'},
+        {"json",       no_argument,       NULL, 'J'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench bench;
+    struct pcap_file file;
+    struct urb_pairer p;
+    unsigned long long records = 0;
+    unsigned long long start, elapsed;
+    unsigned int pass;
+    int error;
+    int ok = 1;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.size_mb = DEFAULT_SIZE_MB;
+    bench.passes = DEFAULT_PASSES;
+    bench.slots = URB_PAIR_DEFAULT_SLOTS;
+    bench.timeout = URB_PAIR_DEFAULT_TIMEOUT;
+    bench.output = DEFAULT_FILE;
+
+    while ((c = getopt_long(argc, argv, "n:p:o:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'P':
+                bench.pairs_path = optarg;
+                break;
+            case 'I':
+                bench.interval = (unsigned long long)parse_seconds(optarg);
+                break;
+            case 'H':
+                bench.histograms = 1;
+                break;
+            case 'S':
+                bench.slots = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                bench.timeout = (unsigned long long)parse_seconds(optarg);
+                break;
+            case 'n':
+                bench.size_mb = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                bench.passes = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                bench.output = optarg;
+                break;
+            case 'K':
+                bench.keep = 1;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc)
+    {
+        bench.input = argv[optind];
+    }
+
+    if ((bench.passes == 0) || (bench.slots == 0) ||
+        ((bench.input == NULL) && (bench.size_mb == 0)))
+    {
+        fprintf(stderr, "Need at least one pass with one slot over at least 1 MB.\n");
+        return EXIT_FAILURE;
+    }
+    if ((bench.input != NULL) || (bench.pairs_path != NULL) || (bench.interval != 0))
+    {
+        /* Output of every pass would be the same */
+        bench.passes = 1;
+    }
+
+    if ((bench.input == NULL) && !generate(&bench))
+    {
+        remove(bench.output);
+        return EXIT_FAILURE;
+    }
+
+    error = pcap_file_open(&file, bench.input ? bench.input : bench.output,
+                           PCAP_FILE_SEQUENTIAL);
+    if (error != PCAP_FILE_OK)
+    {
+        fprintf(stderr, "Failed to open capture: %s\n", pcap_file_strerror(error));
+        if ((bench.input == NULL) && !bench.keep)
+        {
+            remove(bench.output);
+        }
+        return EXIT_FAILURE;
+    }
+    bench.file_size = file.size;
+
+    if (bench.pairs_path != NULL)
+    {
+        bench.pairs = (strcmp(bench.pairs_path, "-") == 0) ? stdout :
+                      fopen(bench.pairs_path, "w");
+        if (bench.pairs == NULL)
+        {
+            fprintf(stderr, "Failed to create %s\n", bench.pairs_path);
+            ok = 0;
+        }
+        else
+        {
+            setvbuf(bench.pairs, NULL, _IOFBF, STDIO_BUFFER_SIZE);
+            fprintf(bench.pairs, "irp,submit_offset,complete_offset,submit_ns,"
+                    "complete_ns,latency_ns,bus,device,endpoint,transfer,status,bytes\n");
+        }
+    }
+
+    memset(&p, 0, sizeof(p));
+    for (pass = 0; ok && (pass < bench.passes); pass++)
+    {
+        if (bench.generated)
+        {
+            start = now_ns();
+            ok = run(&bench, &file, NULL, &records);
+            elapsed = now_ns() - start;
+            if ((bench.parse_ns == 0) || (elapsed < bench.parse_ns))
+            {
+                bench.parse_ns = elapsed;
+            }
+        }
+
+        urb_pair_destroy(&p);
+        if (ok && !urb_pair_init(&p, bench.slots, bench.timeout,
+                                 bench.pairs ? write_pair : NULL, &bench))
+        {
+            fprintf(stderr, "Failed to allocate %u slots\n", bench.slots);
+            ok = 0;
+        }
+        if (ok)
+        {
+            start = now_ns();
+            ok = run(&bench, &file, &p, &records);
+            elapsed = now_ns() - start;
+            if ((bench.pair_ns == 0) || (elapsed < bench.pair_ns))
+            {
+                bench.pair_ns = elapsed;
+            }
+        }
+        if (ok && bench.generated && (pass == 0))
+        {
+            check(&bench, &p);
+        }
+    }
+
+    if ((bench.pairs != NULL) && (bench.pairs != stdout) && (fclose(bench.pairs) != 0))
+    {
+        fprintf(stderr, "Failed to write %s\n", bench.pairs_path);
+        ok = 0;
+    }
+    if (ok)
+    {
+        if (bench.pairs == stdout)
+        {
+            fflush(stdout);
+        }
+        else
+        {
+            print_results(&bench, &p, records);
+        }
+    }
+
+    urb_pair_destroy(&p);
+    free(bench.snapshot);
+    pcap_file_close(&file);
+    if ((bench.input == NULL) && !bench.keep)
+    {
+        remove(bench.output);
+    }
+    return (ok && (bench.errors == 0)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1061 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcapquery.h"
+#include "../USBPcapCMD/bytes.h"
+
+#define BLOCK_HDR_LEN          8
+#define CHECKPOINT_LEN         24
+#define CHECKPOINTS_HDR_LEN    (BLOCK_HDR_LEN + 8)
+#define ENDPOINT_HDR_LEN       (BLOCK_HDR_LEN + 36)
+#define REGION_HDR_LEN         (BLOCK_HDR_LEN + 64)
+#define IRP_SLOT_LEN           8
+
+#define MAX_REGION_SIZE        (1024*1024*1024)
+#define MIN_KEY_SLOTS          64
+#define MIN_BLOOM_BITS         256
+#define BLOOM_BITS_PER_KEY     16
+#define MIN_IRP_SLOTS          16
+#define NO_HIT                 0xFFFFFFFF
+
+struct build_list
+{
+    unsigned int        key;
+    unsigned int        count;
+    unsigned int        size;
+    unsigned long long  base;
+    unsigned long long  first_ts;
+    unsigned long long  last_ts;
+    unsigned int       *deltas;
+};
+
+/* Distinct IRP id, its packets are chained through hits */
+struct build_irp
+{
+    unsigned long long  irp;
+    unsigned int        count;
+    unsigned int        first;
+    unsigned int        last;
+};
+
+struct build_hit
+{
+    unsigned int        delta;        /* Packet offset - region offset */
+    unsigned int        next;         /* Next hit of the same IRP id or NO_HIT */
+};
+
+/* Everything collected for one region, context of one scan chunk */
+struct build_chunk
+{
+    const struct build *b;
+    int                 failed;
+    unsigned long long  offset;       /* First packet */
+    unsigned long long  end;          /* After last packet */
+    unsigned long long  packets;
+    unsigned long long  packet;       /* Number of first packet */
+    unsigned long long  min_ts;
+    unsigned long long  max_ts;
+    unsigned long long  next_checkpoint;
+
+    struct index_checkpoint *checkpoints;
+    unsigned int        checkpoint_count;
+    unsigned int        checkpoint_size;
+
+    struct build_list  *lists;
+    unsigned int        list_count;
+    unsigned int        list_size;
+    int                *slots;        /* Key hash table, list index or -1 */
+    unsigned int        slot_count;
+
+    struct build_irp   *irps;
+    unsigned int        irp_count;
+    unsigned int        irp_size;
+    int                *irp_slots;    /* IRP id hash table, irps index or -1 */
+    unsigned int        irp_slot_count;
+
+    struct build_hit   *hits;
+    unsigned int        hit_count;
+    unsigned int        hit_size;
+
+    unsigned char      *out;          /* Serialised blocks */
+    size_t              out_len;
+};
+
+struct build
+{
+    const struct pcap_file *file;
+    unsigned int        checkpoint_interval;
+    struct build_chunk *chunks;
+};
+
+unsigned long long pcap_index_hash(unsigned long long key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static unsigned int next_pow2(unsigned long long n, unsigned int min)
+{
+    unsigned int v = min;
+
+    while ((v < n) && (v < 0x80000000U))
+    {
+        v <<= 1;
+    }
+    return v;
+}
+
+/* Makes room for one more item, returns 0 if memory ran out */
+static int grow(void **array, unsigned int *size, unsigned int count,
+                size_t item)
+{
+    unsigned int new_size;
+    void *p;
+
+    if (count < *size)
+    {
+        return 1;
+    }
+    new_size = (*size != 0) ? *size * 2 : 64;
+    p = realloc(*array, (size_t)new_size * item);
+    if (p == NULL)
+    {
+        return 0;
+    }
+    *array = p;
+    *size = new_size;
+    return 1;
+}
+
+static int rehash_lists(struct build_chunk *c)
+{
+    unsigned int count = (c->slot_count != 0) ? c->slot_count * 2 : MIN_KEY_SLOTS;
+    unsigned int mask = count - 1;
+    unsigned int slot;
+    unsigned int i;
+    int *slots;
+
+    slots = malloc(count * sizeof(int));
+    if (slots == NULL)
+    {
+        return 0;
+    }
+    memset(slots, 0xFF, count * sizeof(int));
+    for (i = 0; i < c->list_count; i++)
+    {
+        slot = (unsigned int)pcap_index_hash(c->lists[i].key) & mask;
+        while (slots[slot] >= 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = (int)i;
+    }
+
+    free(c->slots);
+    c->slots = slots;
+    c->slot_count = count;
+    return 1;
+}
+
+static struct build_list *find_list(struct build_chunk *c, unsigned int key)
+{
+    struct build_list *l;
+    unsigned int mask;
+    unsigned int slot;
+
+    if ((c->list_count + 1) * 2 > c->slot_count)
+    {
+        if (!rehash_lists(c))
+        {
+            return NULL;
+        }
+    }
+
+    mask = c->slot_count - 1;
+    slot = (unsigned int)pcap_index_hash(key) & mask;
+    while (c->slots[slot] >= 0)
+    {
+        l = &c->lists[c->slots[slot]];
+        if (l->key == key)
+        {
+            return l;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (!grow((void **)&c->lists, &c->list_size, c->list_count,
+              sizeof(struct build_list)))
+    {
+        return NULL;
+    }
+    l = &c->lists[c->list_count];
+    memset(l, 0, sizeof(struct build_list));
+    l->key = key;
+    c->slots[slot] = (int)c->list_count++;
+    return l;
+}
+
+static int rehash_irps(struct build_chunk *c)
+{
+    unsigned int count = (c->irp_slot_count != 0) ? c->irp_slot_count * 2 : MIN_IRP_SLOTS;
+    unsigned int mask = count - 1;
+    unsigned int slot;
+    unsigned int i;
+    int *slots;
+
+    slots = malloc(count * sizeof(int));
+    if (slots == NULL)
+    {
+        return 0;
+    }
+    memset(slots, 0xFF, count * sizeof(int));
+    for (i = 0; i < c->irp_count; i++)
+    {
+        slot = (unsigned int)pcap_index_hash(c->irps[i].irp) & mask;
+        while (slots[slot] >= 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = (int)i;
+    }
+
+    free(c->irp_slots);
+    c->irp_slots = slots;
+    c->irp_slot_count = count;
+    return 1;
+}
+
+/* Adds packet at delta to the chain of its IRP id, returns 0 if out of memory */
+static int add_irp(struct build_chunk *c, unsigned long long irp, unsigned int delta)
+{
+    struct build_irp *id = NULL;
+    unsigned int mask;
+    unsigned int slot;
+
+    if (((c->irp_count + 1) * 2 > c->irp_slot_count) && !rehash_irps(c))
+    {
+        return 0;
+    }
+    if (!grow((void **)&c->hits, &c->hit_size, c->hit_count, sizeof(struct build_hit)))
+    {
+        return 0;
+    }
+
+    mask = c->irp_slot_count - 1;
+    slot = (unsigned int)pcap_index_hash(irp) & mask;
+    while (c->irp_slots[slot] >= 0)
+    {
+        if (c->irps[c->irp_slots[slot]].irp == irp)
+        {
+            id = &c->irps[c->irp_slots[slot]];
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (id == NULL)
+    {
+        if (!grow((void **)&c->irps, &c->irp_size, c->irp_count,
+                  sizeof(struct build_irp)))
+        {
+            return 0;
+        }
+        id = &c->irps[c->irp_count];
+        id->irp = irp;
+        id->count = 0;
+        id->first = c->hit_count;
+        c->irp_slots[slot] = (int)c->irp_count++;
+    }
+    else
+    {
+        c->hits[id->last].next = c->hit_count;
+    }
+    id->last = c->hit_count;
+    id->count++;
+
+    c->hits[c->hit_count].delta = delta;
+    c->hits[c->hit_count].next = NO_HIT;
+    c->hit_count++;
+    return 1;
+}
+
+static void build_reset(void *context)
+{
+    struct build_chunk *c = (struct build_chunk *)context;
+    unsigned int i;
+
+    for (i = 0; i < c->list_count; i++)
+    {
+        free(c->lists[i].deltas);
+    }
+    if (c->slots != NULL)
+    {
+        memset(c->slots, 0xFF, c->slot_count * sizeof(int));
+    }
+    if (c->irp_slots != NULL)
+    {
+        memset(c->irp_slots, 0xFF, c->irp_slot_count * sizeof(int));
+    }
+    c->list_count = 0;
+    c->checkpoint_count = 0;
+    c->irp_count = 0;
+    c->hit_count = 0;
+    c->packets = 0;
+    c->failed = 0;
+}
+
+static void build_record(void *context, const struct pcap_record *record)
+{
+    struct build_chunk *c = (struct build_chunk *)context;
+    const USBPCAP_BUFFER_PACKET_HEADER *usb = record->usb;
+    struct index_checkpoint *cp;
+    struct build_list *l;
+    unsigned int key;
+
+    if (c->failed)
+    {
+        return;
+    }
+
+    if (c->packets == 0)
+    {
+        c->offset = record->offset;
+        c->min_ts = record->timestamp;
+        c->max_ts = record->timestamp;
+        c->next_checkpoint = record->offset;
+    }
+    c->end = record->offset + PCAP_RECORD_HEADER_LEN + record->incl_len;
+    if (record->timestamp < c->min_ts)
+    {
+        c->min_ts = record->timestamp;
+    }
+    if (record->timestamp > c->max_ts)
+    {
+        c->max_ts = record->timestamp;
+    }
+
+    if (record->offset >= c->next_checkpoint)
+    {
+        if (!grow((void **)&c->checkpoints, &c->checkpoint_size,
+                  c->checkpoint_count, sizeof(struct index_checkpoint)))
+        {
+            c->failed = 1;
+            return;
+        }
+        cp = &c->checkpoints[c->checkpoint_count++];
+        cp->timestamp = record->timestamp;
+        cp->offset = record->offset;
+        cp->packet = c->packets;   /* Made absolute once counts are known */
+        c->next_checkpoint = record->offset + c->b->checkpoint_interval;
+    }
+
+    key = index_key(pcap_le16(&usb->bus), pcap_le16(&usb->device), usb->endpoint);
+    l = find_list(c, key);
+    if ((l == NULL) ||
+        !grow((void **)&l->deltas, &l->size, l->count, sizeof(unsigned int)) ||
+        !add_irp(c, pcap_le64(&usb->irpId), (unsigned int)(record->offset - c->offset)))
+    {
+        c->failed = 1;
+        return;
+    }
+    if (l->count == 0)
+    {
+        l->base = record->offset;
+        l->first_ts = record->timestamp;
+    }
+    l->deltas[l->count++] = (unsigned int)(record->offset - l->base);
+    l->last_ts = record->timestamp;
+    c->packets++;
+}
+
+static void bloom_add(unsigned char *bloom, unsigned int bits,
+                      unsigned long long key)
+{
+    unsigned long long h = pcap_index_hash(key);
+    unsigned int step = (unsigned int)(h >> 32) | 1;
+    unsigned int bit;
+    unsigned int i;
+
+    for (i = 0; i < PCAP_INDEX_BLOOM_HASHES; i++)
+    {
+        bit = ((unsigned int)h + i * step) & (bits - 1);
+        bloom[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+    }
+}
+
+static int bloom_test(const struct pcap_region *r, unsigned long long key)
+{
+    unsigned long long h = pcap_index_hash(key);
+    unsigned int step = (unsigned int)(h >> 32) | 1;
+    unsigned int bit;
+    unsigned int i;
+
+    for (i = 0; i < r->bloom_hashes; i++)
+    {
+        bit = ((unsigned int)h + i * step) & (r->bloom_bits - 1);
+        if (!(r->bloom[bit >> 3] & (1 << (bit & 7))))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Writes checkpoint, endpoint and region blocks of chunk to c->out */
+static void serialise_chunk(void *context, unsigned int i)
+{
+    struct build *b = (struct build *)context;
+    struct build_chunk *c = &b->chunks[i];
+    unsigned int bloom_bits, irp_slots, irp_list_len, mask, slot, pos, hit;
+    unsigned long long h;
+    unsigned char *p, *bloom, *irp, *lists;
+    size_t length;
+    unsigned int n;
+
+    if (c->packets == 0)
+    {
+        return;
+    }
+
+    bloom_bits = next_pow2((unsigned long long)c->list_count * 2 * BLOOM_BITS_PER_KEY,
+                           MIN_BLOOM_BITS);
+    irp_slots = next_pow2((unsigned long long)c->irp_count * 2, MIN_IRP_SLOTS);
+    irp_list_len = c->irp_count + c->hit_count;
+
+    length = CHECKPOINTS_HDR_LEN + c->checkpoint_count * CHECKPOINT_LEN;
+    for (n = 0; n < c->list_count; n++)
+    {
+        length += ENDPOINT_HDR_LEN + c->lists[n].count * sizeof(unsigned int);
+    }
+    length += REGION_HDR_LEN + bloom_bits / 8 + (size_t)irp_slots * IRP_SLOT_LEN +
+              (size_t)irp_list_len * sizeof(unsigned int);
+
+    c->out = malloc(length);
+    if (c->out == NULL)
+    {
+        return;
+    }
+    c->out_len = length;
+
+    p = put32(c->out, INDEX_BLOCK_CHECKPOINTS);
+    p = put32(p, (unsigned int)(CHECKPOINTS_HDR_LEN + c->checkpoint_count * CHECKPOINT_LEN));
+    p = put32(p, c->checkpoint_count);
+    p = put32(p, 0);
+    for (n = 0; n < c->checkpoint_count; n++)
+    {
+        p = put64(p, c->checkpoints[n].timestamp);
+        p = put64(p, c->checkpoints[n].offset);
+        p = put64(p, c->packet + c->checkpoints[n].packet);
+    }
+
+    for (n = 0; n < c->list_count; n++)
+    {
+        const struct build_list *l = &c->lists[n];
+
+        p = put32(p, INDEX_BLOCK_ENDPOINT);
+        p = put32(p, (unsigned int)(ENDPOINT_HDR_LEN + l->count * sizeof(unsigned int)));
+        p = put16(p, l->key >> 16);
+        p = put16(p, (l->key >> 8) & 0xFF);
+        *p++ = (unsigned char)(l->key & 0xFF);
+        *p++ = 0;
+        *p++ = 0;
+        *p++ = 0;
+        p = put32(p, l->count);
+        p = put64(p, l->base);
+        p = put64(p, l->first_ts);
+        p = put64(p, l->last_ts);
+        memcpy(p, l->deltas, l->count * sizeof(unsigned int));
+        p += l->count * sizeof(unsigned int);
+    }
+
+    p = put32(p, INDEX_BLOCK_REGION);
+    p = put32(p, (unsigned int)(REGION_HDR_LEN + bloom_bits / 8 +
+                                (size_t)irp_slots * IRP_SLOT_LEN +
+                                (size_t)irp_list_len * sizeof(unsigned int)));
+    p = put64(p, c->offset);
+    p = put64(p, c->end);
+    p = put64(p, c->packet);
+    p = put64(p, c->min_ts);
+    p = put64(p, c->max_ts);
+    p = put32(p, (unsigned int)c->packets);
+    p = put32(p, bloom_bits);
+    p = put32(p, PCAP_INDEX_BLOOM_HASHES);
+    p = put32(p, irp_slots);
+    p = put32(p, irp_list_len);
+    p = put32(p, 0);
+
+    bloom = p;
+    memset(bloom, 0, bloom_bits / 8);
+    for (n = 0; n < c->list_count; n++)
+    {
+        bloom_add(bloom, bloom_bits, c->lists[n].key);
+        bloom_add(bloom, bloom_bits, (c->lists[n].key & ~0xFFU) | PCAP_INDEX_DEVICE_KEY);
+    }
+
+    /* Every IRP id is stored once, pointing to list of its packets */
+    irp = bloom + bloom_bits / 8;
+    lists = irp + (size_t)irp_slots * IRP_SLOT_LEN;
+    memset(irp, 0xFF, (size_t)irp_slots * IRP_SLOT_LEN);
+    mask = irp_slots - 1;
+    pos = 0;
+    for (n = 0; n < c->irp_count; n++)
+    {
+        h = pcap_index_hash(c->irps[n].irp);
+        slot = (unsigned int)h & mask;
+        while (get32(&irp[slot * IRP_SLOT_LEN + 4]) != INDEX_IRP_EMPTY)
+        {
+            slot = (slot + 1) & mask;
+        }
+        put32(&irp[slot * IRP_SLOT_LEN], (unsigned int)(h >> 32));
+        put32(&irp[slot * IRP_SLOT_LEN + 4], pos);
+
+        p = put32(&lists[(size_t)pos * 4], c->irps[n].count);
+        for (hit = c->irps[n].first; hit != NO_HIT; hit = c->hits[hit].next)
+        {
+            p = put32(p, c->hits[hit].delta);
+        }
+        pos += 1 + c->irps[n].count;
+    }
+}
+
+static void free_chunk(struct build_chunk *c)
+{
+    build_reset(c);
+    free(c->lists);
+    free(c->slots);
+    free(c->checkpoints);
+    free(c->irps);
+    free(c->irp_slots);
+    free(c->hits);
+    free(c->out);
+}
+
+static int write_index(struct build *b, unsigned int count, const char *path,
+                       unsigned long long *size)
+{
+    unsigned char header[INDEX_HEADER_LEN];
+    unsigned char *p;
+    unsigned int i;
+    int ok;
+    FILE *f;
+
+    f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        return 0;
+    }
+
+    p = put32(header, INDEX_MAGIC);
+    p = put16(p, INDEX_VERSION);
+    p = put16(p, 0);
+    p = put32(p, b->checkpoint_interval);
+    put32(p, 0);
+    ok = (fwrite(header, 1, sizeof(header), f) == sizeof(header));
+    *size = sizeof(header);
+
+    for (i = 0; ok && (i < count); i++)
+    {
+        if (b->chunks[i].out_len != 0)
+        {
+            ok = (fwrite(b->chunks[i].out, 1, b->chunks[i].out_len, f) ==
+                  b->chunks[i].out_len);
+            *size += b->chunks[i].out_len;
+        }
+    }
+
+    if (fclose(f) != 0)
+    {
+        ok = 0;
+    }
+    return ok;
+}
+
+int pcap_index_build(const struct pcap_file *file, const char *path,
+                     unsigned int threads, unsigned int region_size,
+                     unsigned int checkpoint_interval,
+                     struct pcap_index_stats *stats)
+{
+    struct pcap_scan scan;
+    struct build b;
+    unsigned long long packet = 0;
+    unsigned int count;
+    unsigned int i;
+    int result = PCAP_INDEX_OK;
+
+    memset(stats, 0, sizeof(struct pcap_index_stats));
+    if (region_size == 0)
+    {
+        region_size = PCAP_INDEX_REGION_SIZE;
+    }
+    if (region_size > MAX_REGION_SIZE)
+    {
+        /* Packet offsets within region have to fit in 32 bits */
+        region_size = MAX_REGION_SIZE;
+    }
+
+    b.file = file;
+    b.checkpoint_interval = checkpoint_interval ? checkpoint_interval :
+                                                  INDEX_CHECKPOINT_INTERVAL;
+
+    count = (unsigned int)((file->size - PCAP_FILE_HEADER_LEN) / region_size);
+    if (!pcap_scan_init(&scan, file, count ? count : 1, 0, build_record, build_reset))
+    {
+        return PCAP_INDEX_ERROR_MEMORY;
+    }
+    b.chunks = calloc(scan.count, sizeof(struct build_chunk));
+    if (b.chunks == NULL)
+    {
+        pcap_scan_destroy(&scan);
+        return PCAP_INDEX_ERROR_MEMORY;
+    }
+    for (i = 0; i < scan.count; i++)
+    {
+        b.chunks[i].b = &b;
+        scan.chunks[i].context = &b.chunks[i];
+    }
+
+    stats->error = pcap_scan_run(&scan, threads);
+    stats->error_offset = scan.error_offset;
+    stats->reparsed = scan.reparsed;
+    if (stats->error != PCAP_FILE_OK)
+    {
+        result = PCAP_INDEX_ERROR_CAPTURE;
+    }
+
+    for (i = 0; (result == PCAP_INDEX_OK) && (i < scan.count); i++)
+    {
+        if (b.chunks[i].failed)
+        {
+            result = PCAP_INDEX_ERROR_MEMORY;
+        }
+        b.chunks[i].packet = packet;
+        packet += b.chunks[i].packets;
+        if (b.chunks[i].packets != 0)
+        {
+            stats->regions++;
+        }
+    }
+    stats->packets = packet;
+
+    if (result == PCAP_INDEX_OK)
+    {
+        pcap_parallel(scan.count, threads, serialise_chunk, &b);
+        for (i = 0; i < scan.count; i++)
+        {
+            if ((b.chunks[i].packets != 0) && (b.chunks[i].out == NULL))
+            {
+                result = PCAP_INDEX_ERROR_MEMORY;
+            }
+        }
+    }
+
+    if ((result == PCAP_INDEX_OK) &&
+        !write_index(&b, scan.count, path, &stats->index_size))
+    {
+        result = PCAP_INDEX_ERROR_WRITE;
+    }
+
+    for (i = 0; i < scan.count; i++)
+    {
+        free_chunk(&b.chunks[i]);
+    }
+    free(b.chunks);
+    pcap_scan_destroy(&scan);
+    return result;
+}
+
+static int is_pow2(unsigned int v)
+{
+    return (v != 0) && ((v & (v - 1)) == 0);
+}
+
+int pcap_index_open(struct pcap_index *index, const char *path)
+{
+    unsigned long long size;
+    unsigned int count = 0;
+    unsigned int pass;
+    size_t pos, block;
+    FILE *f;
+    int error;
+
+    memset(index, 0, sizeof(struct pcap_index));
+
+    f = fopen(path, "rb");
+    if ((f == NULL) || (fseeko(f, 0, SEEK_END) != 0))
+    {
+        if (f != NULL)
+        {
+            fclose(f);
+        }
+        return PCAP_INDEX_ERROR_OPEN;
+    }
+    size = (unsigned long long)ftello(f);
+    rewind(f);
+    index->data = malloc(size ? (size_t)size : 1);
+    if (index->data == NULL)
+    {
+        fclose(f);
+        return PCAP_INDEX_ERROR_MEMORY;
+    }
+    if (fread(index->data, 1, (size_t)size, f) != size)
+    {
+        fclose(f);
+        pcap_index_close(index);
+        return PCAP_INDEX_ERROR_OPEN;
+    }
+    fclose(f);
+    index->size = (size_t)size;
+
+    error = index_read(&index->reader, index->data, index->size);
+    if (error != INDEX_OK)
+    {
+        pcap_index_close(index);
+        return (error == INDEX_ERROR_MEMORY) ? PCAP_INDEX_ERROR_MEMORY :
+                                               PCAP_INDEX_ERROR_FORMAT;
+    }
+
+    /* Region blocks point into the file contents, count them first */
+    for (pass = 0; pass < 2; pass++)
+    {
+        count = 0;
+        pos = INDEX_HEADER_LEN;
+        while (index->size - pos >= BLOCK_HDR_LEN)
+        {
+            const unsigned char *p = &index->data[pos];
+
+            block = get32(&p[4]);
+            if ((block < BLOCK_HDR_LEN) || (block > index->size - pos))
+            {
+                break;
+            }
+            if (get32(p) == INDEX_BLOCK_REGION)
+            {
+                struct pcap_region r;
+
+                if (block < REGION_HDR_LEN)
+                {
+                    pcap_index_close(index);
+                    return PCAP_INDEX_ERROR_FORMAT;
+                }
+                r.offset = get64(&p[8]);
+                r.end = get64(&p[16]);
+                r.packet = get64(&p[24]);
+                r.min_ts = get64(&p[32]);
+                r.max_ts = get64(&p[40]);
+                r.count = get32(&p[48]);
+                r.bloom_bits = get32(&p[52]);
+                r.bloom_hashes = get32(&p[56]);
+                r.irp_slots = get32(&p[60]);
+                r.irp_list_len = get32(&p[64]);
+                r.bloom = &p[REGION_HDR_LEN];
+                r.irp = r.bloom + r.bloom_bits / 8;
+                r.irp_lists = r.irp + (size_t)r.irp_slots * IRP_SLOT_LEN;
+                if (!is_pow2(r.bloom_bits) || (r.bloom_bits < 8) ||
+                    !is_pow2(r.irp_slots) || (r.end < r.offset) ||
+                    (r.end - r.offset > 0xFFFFFFFFULL) ||
+                    (REGION_HDR_LEN + r.bloom_bits / 8 +
+                     (unsigned long long)r.irp_slots * IRP_SLOT_LEN +
+                     (unsigned long long)r.irp_list_len * 4 > block))
+                {
+                    pcap_index_close(index);
+                    return PCAP_INDEX_ERROR_FORMAT;
+                }
+                if (pass == 1)
+                {
+                    index->regions[count] = r;
+                }
+                count++;
+            }
+            pos += block;
+        }
+
+        if (pass == 0)
+        {
+            index->regions = malloc((count + 1) * sizeof(struct pcap_region));
+            if (index->regions == NULL)
+            {
+                pcap_index_close(index);
+                return PCAP_INDEX_ERROR_MEMORY;
+            }
+        }
+    }
+    index->region_count = count;
+    return PCAP_INDEX_OK;
+}
+
+void pcap_index_close(struct pcap_index *index)
+{
+    index_reader_free(&index->reader);
+    free(index->regions);
+    free(index->data);
+    memset(index, 0, sizeof(struct pcap_index));
+}
+
+void pcap_query_init(struct pcap_query *query)
+{
+    memset(query, 0, sizeof(struct pcap_query));
+    query->to = ~0ULL;
+    query->bus = -1;
+    query->device = -1;
+    query->endpoint = -1;
+    query->direction = -1;
+    query->transfer = -1;
+}
+
+int pcap_query_match(const struct pcap_query *query,
+                     const struct pcap_record *record)
+{
+    const USBPCAP_BUFFER_PACKET_HEADER *usb = record->usb;
+
+    if ((record->timestamp < query->from) || (record->timestamp > query->to))
+    {
+        return 0;
+    }
+    if (((query->bus >= 0) && (pcap_le16(&usb->bus) != query->bus)) ||
+        ((query->device >= 0) && (pcap_le16(&usb->device) != query->device)) ||
+        ((query->endpoint >= 0) && (usb->endpoint != query->endpoint)) ||
+        ((query->direction >= 0) && ((usb->endpoint & 0x80) != query->direction)) ||
+        ((query->transfer >= 0) && (usb->transfer != query->transfer)))
+    {
+        return 0;
+    }
+    if (query->irp_set && (pcap_le64(&usb->irpId) != query->irp))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+struct query_region
+{
+    const struct pcap_region *region;
+    unsigned long long *matches;      /* Packet offsets */
+    unsigned int        count;
+    unsigned int        size;
+    unsigned long long  candidates;
+    int                 failed;
+};
+
+struct query
+{
+    const struct pcap_index *index;
+    const struct pcap_file  *file;
+    const struct pcap_query *query;
+    struct query_region     *regions;
+};
+
+static void add_match(struct query_region *qr, unsigned long long offset)
+{
+    if (!grow((void **)&qr->matches, &qr->size, qr->count,
+              sizeof(unsigned long long)))
+    {
+        qr->failed = 1;
+        return;
+    }
+    qr->matches[qr->count++] = offset;
+}
+
+/* Reads packet at offset given by index and checks it */
+static void check_packet(struct query *q, struct query_region *qr,
+                         unsigned long long offset)
+{
+    struct pcap_cursor cursor;
+    struct pcap_record record;
+
+    qr->candidates++;
+    pcap_cursor_range(&cursor, q->file, offset, offset + 1);
+    if (pcap_cursor_next(&cursor, &record) && pcap_query_match(q->query, &record))
+    {
+        add_match(qr, offset);
+    }
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    unsigned long long oa = *(const unsigned long long *)a;
+    unsigned long long ob = *(const unsigned long long *)b;
+
+    return (oa < ob) ? -1 : (oa > ob);
+}
+
+static void search_region(void *context, unsigned int i)
+{
+    struct query *q = (struct query *)context;
+    struct query_region *qr = &q->regions[i];
+    const struct pcap_region *r = qr->region;
+    const struct pcap_query *query = q->query;
+    const struct index_checkpoint *cp;
+    unsigned long long start = r->offset;
+
+    /* Packets before last checkpoint preceding the range are too early */
+    cp = index_seek_time(&q->index->reader, query->from);
+    if ((cp != NULL) && (cp->offset > start) && (cp->offset < r->end))
+    {
+        start = cp->offset;
+    }
+
+    if (query->irp_set)
+    {
+        unsigned long long h = pcap_index_hash(query->irp);
+        unsigned int mask = r->irp_slots - 1;
+        unsigned int slot = (unsigned int)h & mask;
+        unsigned int pos, count, j;
+        unsigned int probes;
+
+        for (probes = 0; probes < r->irp_slots; probes++)
+        {
+            pos = get32(&r->irp[slot * IRP_SLOT_LEN + 4]);
+            if (pos == INDEX_IRP_EMPTY)
+            {
+                break;
+            }
+            if ((get32(&r->irp[slot * IRP_SLOT_LEN]) == (unsigned int)(h >> 32)) &&
+                (pos < r->irp_list_len))
+            {
+                count = get32(&r->irp_lists[(size_t)pos * 4]);
+                if (count > r->irp_list_len - pos - 1)
+                {
+                    count = r->irp_list_len - pos - 1;
+                }
+                for (j = 0; j < count; j++)
+                {
+                    check_packet(q, qr, r->offset +
+                                 get32(&r->irp_lists[((size_t)pos + 1 + j) * 4]));
+                }
+            }
+            slot = (slot + 1) & mask;
+        }
+        /* Lists of ids with the same tag are not ordered with each other */
+        qsort(qr->matches, qr->count, sizeof(unsigned long long), compare_offsets);
+    }
+    else if ((query->bus >= 0) && (query->device >= 0) && (query->endpoint >= 0))
+    {
+        struct index_cursor cur;
+        unsigned long long offset;
+
+        if (index_seek_endpoint(&q->index->reader,
+                                index_key(query->bus, query->device, query->endpoint),
+                                start, &cur))
+        {
+            while (index_next(&cur, &offset) && (offset < r->end))
+            {
+                check_packet(q, qr, offset);
+            }
+        }
+    }
+    else
+    {
+        struct pcap_cursor cursor;
+        struct pcap_record record;
+
+        pcap_cursor_range(&cursor, q->file, start, r->end);
+        while (pcap_cursor_next(&cursor, &record))
+        {
+            qr->candidates++;
+            if (pcap_query_match(query, &record))
+            {
+                add_match(qr, record.offset);
+            }
+        }
+    }
+}
+
+/* Non-zero if region may contain packets of queried device or endpoint */
+static int region_may_match(const struct pcap_query *query,
+                            const struct pcap_region *r)
+{
+    if ((r->max_ts < query->from) || (r->min_ts > query->to))
+    {
+        return 0;
+    }
+    if ((query->bus < 0) || (query->device < 0))
+    {
+        return 1;
+    }
+    if (query->endpoint >= 0)
+    {
+        return bloom_test(r, index_key(query->bus, query->device, query->endpoint));
+    }
+    return bloom_test(r, index_key(query->bus, query->device, 0) | PCAP_INDEX_DEVICE_KEY);
+}
+
+unsigned long long pcap_query_run(const struct pcap_index *index,
+                                  const struct pcap_file *file,
+                                  const struct pcap_query *query,
+                                  unsigned int threads,
+                                  pcap_query_fn fn, void *context,
+                                  struct pcap_query_stats *stats)
+{
+    struct pcap_query_stats local;
+    struct pcap_cursor cursor;
+    struct pcap_record record;
+    struct query q;
+    unsigned int count = 0;
+    unsigned int i, j;
+
+    if (stats == NULL)
+    {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(struct pcap_query_stats));
+
+    q.index = index;
+    q.file = file;
+    q.query = query;
+    q.regions = calloc(index->region_count + 1, sizeof(struct query_region));
+    if (q.regions == NULL)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < index->region_count; i++)
+    {
+        const struct pcap_region *r = &index->regions[i];
+
+        if ((r->max_ts < query->from) || (r->min_ts > query->to))
+        {
+            continue;
+        }
+        stats->regions++;
+        if (region_may_match(query, r))
+        {
+            q.regions[count++].region = r;
+        }
+    }
+    stats->searched = count;
+
+    pcap_parallel(count, threads, search_region, &q);
+
+    for (i = 0; i < count; i++)
+    {
+        struct query_region *qr = &q.regions[i];
+
+        stats->candidates += qr->candidates;
+        for (j = 0; j < qr->count; j++)
+        {
+            pcap_cursor_range(&cursor, file, qr->matches[j], qr->matches[j] + 1);
+            if (pcap_cursor_next(&cursor, &record))
+            {
+                fn(context, &record);
+                stats->matches++;
+            }
+        }
+        free(qr->matches);
+    }
+
+    free(q.regions);
+    return stats->matches;
+}
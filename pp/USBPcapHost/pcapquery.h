@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Offline capture index with parallel build and queries.
+ *
+ * pcap_index_build() scans a DLT_USBPCAP capture with pcap_scan_run(),
+ * one region per chunk, and writes index in the format described in
+ * USBPcapCMD/index.h. Every region gets time checkpoints and endpoint
+ * lists, the same as USBPcapCMD --index writes so index_read() and
+ * pcapseek understand it, followed by INDEX_BLOCK_REGION with lowest and
+ * highest timestamp, bloom filter of device and endpoint keys and hash
+ * table of IRP ids of the region. Captures reuse few IRP ids a lot, so
+ * every distinct id is stored once and points to list of its packets.
+ *
+ * Queries select packets by time, bus, device, endpoint, direction,
+ * transfer type and IRP id. Only regions overlapping the time range
+ * whose bloom filter may contain the device (or endpoint) are looked at,
+ * in parallel:
+ *   - with IRP id, the region hash table is probed
+ *   - with bus, device and endpoint, the endpoint list is followed
+ *   - otherwise packets of the region are scanned
+ * Endpoint lists and scans start at the last checkpoint before the time
+ * range, so like pcapseek timestamps are assumed not to go backwards.
+ * Candidates are read from the capture and checked against the whole
+ * query, so hash and bloom filter collisions are never returned.
+ *
+ * Bloom filter bit i (i < bloom hashes) of key k is
+ *   (h + i * ((h >> 32) | 1)) & (bits - 1), h = pcap_index_hash(k)
+ * where k is index_key(bus, device, endpoint) for endpoints and
+ * index_key(bus, device, 0) | PCAP_INDEX_DEVICE_KEY for devices. IRP id
+ * x is stored in slot pcap_index_hash(x) & (slots - 1), or the next free
+ * one, with tag pcap_index_hash(x) >> 32 and position of its packet list.
+ */
+
+#ifndef USBPCAP_HOST_PCAPQUERY_H
+#define USBPCAP_HOST_PCAPQUERY_H
+
+#include "pcapscan.h"
+#include "../USBPcapCMD/index.h"
+
+#define PCAP_INDEX_REGION_SIZE   (16*1024*1024)
+#define PCAP_INDEX_DEVICE_KEY    (1ULL << 32)
+#define PCAP_INDEX_BLOOM_HASHES  4
+
+#define PCAP_INDEX_OK             0
+#define PCAP_INDEX_ERROR_CAPTURE  1 /* Invalid record in capture */
+#define PCAP_INDEX_ERROR_MEMORY   2
+#define PCAP_INDEX_ERROR_WRITE    3
+#define PCAP_INDEX_ERROR_OPEN     4
+#define PCAP_INDEX_ERROR_FORMAT   5
+
+struct pcap_index_stats
+{
+    unsigned long long packets;
+    unsigned long long index_size;
+    unsigned int       regions;
+    unsigned int       reparsed;     /* Chunks parsed again when stitching */
+    int                error;        /* PCAP_FILE_xxx of invalid record */
+    unsigned long long error_offset;
+};
+
+struct pcap_region
+{
+    unsigned long long   offset;     /* First packet */
+    unsigned long long   end;        /* After last packet */
+    unsigned long long   packet;     /* Number of first packet */
+    unsigned long long   min_ts;
+    unsigned long long   max_ts;
+    unsigned int         count;
+    unsigned int         bloom_bits;
+    unsigned int         bloom_hashes;
+    unsigned int         irp_slots;
+    unsigned int         irp_list_len;
+    const unsigned char *bloom;
+    const unsigned char *irp;        /* irp_slots times u32 tag, u32 list */
+    const unsigned char *irp_lists;  /* irp_list_len times u32 */
+};
+
+struct pcap_index
+{
+    unsigned char       *data;       /* Index file contents */
+    size_t               size;
+    struct index_reader  reader;     /* Checkpoints and endpoint lists */
+    struct pcap_region  *regions;    /* Sorted by offset */
+    unsigned int         region_count;
+};
+
+struct pcap_query
+{
+    unsigned long long from;         /* Timestamps in ns, inclusive */
+    unsigned long long to;
+    int                bus;          /* -1 for any */
+    int                device;       /* -1 for any */
+    int                endpoint;     /* -1 for any, with direction bit */
+    int                direction;    /* -1 for any, 0 OUT, 0x80 IN */
+    int                transfer;     /* -1 for any, USBPCAP_TRANSFER_xxx */
+    int                irp_set;
+    unsigned long long irp;
+};
+
+struct pcap_query_stats
+{
+    unsigned int       regions;      /* Regions overlapping time range */
+    unsigned int       searched;     /* ...that passed bloom filter */
+    unsigned long long candidates;   /* Packets read and checked */
+    unsigned long long matches;
+};
+
+typedef void (*pcap_query_fn)(void *context, const struct pcap_record *record);
+
+unsigned long long pcap_index_hash(unsigned long long key);
+
+/*
+ * Writes index of file to path using given number of threads. Regions
+ * are region_size bytes (0 for PCAP_INDEX_REGION_SIZE), checkpoints are
+ * every checkpoint_interval bytes (0 for INDEX_CHECKPOINT_INTERVAL).
+ * Returns PCAP_INDEX_OK or error, stats are filled in either way.
+ */
+int pcap_index_build(const struct pcap_file *file, const char *path,
+                     unsigned int threads, unsigned int region_size,
+                     unsigned int checkpoint_interval,
+                     struct pcap_index_stats *stats);
+
+/* Loads index file. Returns PCAP_INDEX_OK or error. */
+int pcap_index_open(struct pcap_index *index, const char *path);
+void pcap_index_close(struct pcap_index *index);
+
+/* Query matching every packet */
+void pcap_query_init(struct pcap_query *query);
+
+/* Non-zero if record matches query */
+int pcap_query_match(const struct pcap_query *query,
+                     const struct pcap_record *record);
+
+/*
+ * Calls fn for every packet of file matching query, in file order, and
+ * returns number of them. Regions are searched on given number of
+ * threads. stats may be NULL.
+ */
+unsigned long long pcap_query_run(const struct pcap_index *index,
+                                  const struct pcap_file *file,
+                                  const struct pcap_query *query,
+                                  unsigned int threads,
+                                  pcap_query_fn fn, void *context,
+                                  struct pcap_query_stats *stats);
+
+#endif /* USBPCAP_HOST_PCAPQUERY_H */
@@ -0,0 +1,480 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "pcapscan.h"
+
+/* Smallest chunk, larger than the largest record with 16-bit snaplen */
+#define PCAP_SCAN_MIN_CHUNK   (1024*1024)
+
+#define MAX_THREADS           256
+
+unsigned int pcap_scan_cpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 0) ? info.dwNumberOfProcessors : 1;
+#else
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (cpus > 0) ? (unsigned int)cpus : 1;
+#endif
+}
+
+static UINT32 get32(const struct pcap_file *file, const unsigned char *p)
+{
+    UINT32 v;
+
+    memcpy(&v, p, sizeof(v));
+    return file->swapped ? pcap_swap32(v) : v;
+}
+
+/*
+ * Checks record at offset more thoroughly than pcap_cursor_next() does,
+ * as offset is only a guess. Returns 1 and offset of next record if it
+ * looks valid.
+ */
+static int check_candidate(const struct pcap_file *file,
+                           unsigned long long offset,
+                           unsigned long long *next)
+{
+    const unsigned char *p = &file->data[offset];
+    UINT32 incl_len, orig_len, fraction, data_length, packets;
+    USHORT header_len;
+    UCHAR transfer;
+
+    if (file->size - offset < PCAP_RECORD_HEADER_LEN + USBPCAP_MIN_HEADER_LEN)
+    {
+        return 0;
+    }
+
+    incl_len = get32(file, &p[8]);
+    orig_len = get32(file, &p[12]);
+    if ((incl_len < USBPCAP_MIN_HEADER_LEN) || (incl_len > file->snaplen) ||
+        (incl_len > orig_len) ||
+        (incl_len > file->size - offset - PCAP_RECORD_HEADER_LEN))
+    {
+        return 0;
+    }
+
+    fraction = get32(file, &p[4]);
+    if (fraction >= (file->nanosecond ? 1000000000 : 1000000))
+    {
+        return 0;
+    }
+
+    p += PCAP_RECORD_HEADER_LEN;
+    header_len = pcap_le16(p);
+    if ((header_len < USBPCAP_MIN_HEADER_LEN) || (header_len > incl_len))
+    {
+        return 0;
+    }
+
+    /* Only the direction bit is defined */
+    if (p[offsetof(USBPCAP_BUFFER_PACKET_HEADER, info)] & ~USBPCAP_INFO_PDO_TO_FDO)
+    {
+        return 0;
+    }
+
+    /* Payload is cut to snaplen, never longer than the transfer */
+    data_length = pcap_le32(&p[offsetof(USBPCAP_BUFFER_PACKET_HEADER, dataLength)]);
+    if (incl_len - header_len > data_length)
+    {
+        return 0;
+    }
+
+    transfer = p[offsetof(USBPCAP_BUFFER_PACKET_HEADER, transfer)];
+    switch (transfer)
+    {
+        case USBPCAP_TRANSFER_ISOCHRONOUS:
+            if (header_len < USBPCAP_ISOCH_FIXED_LEN)
+            {
+                return 0;
+            }
+            packets = pcap_le32(&p[offsetof(USBPCAP_BUFFER_ISOCH_HEADER, numberOfPackets)]);
+            if ((packets == 0) ||
+                (header_len != USBPCAP_ISOCH_FIXED_LEN +
+                               (unsigned long long)packets * sizeof(USBPCAP_BUFFER_ISO_PACKET)))
+            {
+                return 0;
+            }
+            break;
+        case USBPCAP_TRANSFER_CONTROL:
+            if ((header_len != sizeof(USBPCAP_BUFFER_CONTROL_HEADER)) ||
+                (p[offsetof(USBPCAP_BUFFER_CONTROL_HEADER, stage)] > USBPCAP_CONTROL_STAGE_COMPLETE))
+            {
+                return 0;
+            }
+            break;
+        case USBPCAP_TRANSFER_INTERRUPT:
+        case USBPCAP_TRANSFER_BULK:
+        case USBPCAP_TRANSFER_IRP_INFO:
+        case USBPCAP_TRANSFER_UNKNOWN:
+            if (header_len != USBPCAP_MIN_HEADER_LEN)
+            {
+                return 0;
+            }
+            break;
+        default:
+            return 0;
+    }
+
+    *next = offset + PCAP_RECORD_HEADER_LEN + incl_len;
+    return 1;
+}
+
+int pcap_file_sync(const struct pcap_file *file, unsigned long long offset,
+                   unsigned long long end, unsigned long long *boundary)
+{
+    unsigned long long next;
+    unsigned int i;
+
+    if (offset < PCAP_FILE_HEADER_LEN)
+    {
+        offset = PCAP_FILE_HEADER_LEN;
+    }
+    if (end > file->size)
+    {
+        end = file->size;
+    }
+
+    for (; offset < end; offset++)
+    {
+        if (!check_candidate(file, offset, &next))
+        {
+            continue;
+        }
+        for (i = 0; (i < PCAP_SYNC_RECORDS) && (next < file->size); i++)
+        {
+            if (!check_candidate(file, next, &next))
+            {
+                break;
+            }
+        }
+        if ((i == PCAP_SYNC_RECORDS) || (next == file->size))
+        {
+            *boundary = offset;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int pcap_scan_init(struct pcap_scan *scan, const struct pcap_file *file,
+                   unsigned int count, int flags,
+                   pcap_scan_record_fn record, pcap_scan_reset_fn reset)
+{
+    unsigned long long data = file->size - PCAP_FILE_HEADER_LEN;
+    unsigned long long size;
+    unsigned int i;
+
+    memset(scan, 0, sizeof(struct pcap_scan));
+    scan->file = file;
+    scan->flags = flags;
+    scan->record = record;
+    scan->reset = reset;
+
+    if ((count == 0) || (data / count < PCAP_SCAN_MIN_CHUNK))
+    {
+        count = (unsigned int)(data / PCAP_SCAN_MIN_CHUNK);
+    }
+    if (count == 0)
+    {
+        count = 1;
+    }
+
+    scan->chunks = calloc(count, sizeof(struct pcap_scan_chunk));
+    if (scan->chunks == NULL)
+    {
+        return 0;
+    }
+    scan->count = count;
+
+    size = data / count;
+    for (i = 0; i < count; i++)
+    {
+        scan->chunks[i].start = PCAP_FILE_HEADER_LEN + i * size;
+        scan->chunks[i].end = (i + 1 < count) ? scan->chunks[i].start + size : file->size;
+    }
+    return 1;
+}
+
+void pcap_scan_destroy(struct pcap_scan *scan)
+{
+    free(scan->chunks);
+    memset(scan, 0, sizeof(struct pcap_scan));
+}
+
+static void clear_chunk(struct pcap_scan *scan, struct pcap_scan_chunk *chunk)
+{
+    if (scan->reset != NULL)
+    {
+        scan->reset(chunk->context);
+    }
+    chunk->records = 0;
+    chunk->skipped = 0;
+    chunk->resyncs = 0;
+    chunk->error = PCAP_FILE_OK;
+    chunk->error_offset = 0;
+    chunk->unsynced = 0;
+}
+
+/* Parses records of chunk from given record boundary */
+static void parse_chunk(struct pcap_scan *scan, struct pcap_scan_chunk *chunk,
+                        unsigned long long from)
+{
+    const struct pcap_file *file = scan->file;
+    struct pcap_cursor cursor;
+    struct pcap_record record;
+    unsigned long long boundary;
+
+    chunk->first = from;
+    pcap_cursor_range(&cursor, file, from, chunk->end);
+    for (;;)
+    {
+        while (pcap_cursor_next(&cursor, &record))
+        {
+            chunk->records++;
+            scan->record(chunk->context, &record);
+        }
+        if (cursor.error == PCAP_FILE_OK)
+        {
+            break;
+        }
+
+        if (chunk->error == PCAP_FILE_OK)
+        {
+            chunk->error = cursor.error;
+            chunk->error_offset = cursor.offset;
+        }
+        if (!(scan->flags & PCAP_SCAN_RESYNC))
+        {
+            break;
+        }
+
+        if (!pcap_file_sync(file, cursor.offset + 1, chunk->end, &boundary))
+        {
+            /* Next chunk finds the boundary on its own */
+            chunk->skipped += chunk->end - cursor.offset;
+            chunk->stop = chunk->end;
+            chunk->unsynced = 1;
+            return;
+        }
+        chunk->skipped += boundary - cursor.offset;
+        chunk->resyncs++;
+        pcap_cursor_range(&cursor, file, boundary, chunk->end);
+    }
+    chunk->stop = cursor.offset;
+}
+
+static void scan_chunk(struct pcap_scan *scan, unsigned int i)
+{
+    struct pcap_scan_chunk *chunk = &scan->chunks[i];
+    unsigned long long boundary;
+
+    if (i == 0)
+    {
+        parse_chunk(scan, chunk, chunk->start);
+    }
+    else if (pcap_file_sync(scan->file, chunk->start, chunk->end, &boundary))
+    {
+        parse_chunk(scan, chunk, boundary);
+    }
+    else
+    {
+        /* Covered by a record of previous chunk, or by garbage */
+        chunk->first = chunk->end;
+        chunk->stop = chunk->end;
+        chunk->unsynced = 1;
+    }
+}
+
+struct parallel
+{
+    unsigned int        count;
+    pcap_parallel_fn    work;
+    void               *context;
+    volatile long       next;    /* Next item to be taken by a worker */
+};
+
+static long take_item(struct parallel *p)
+{
+#ifdef _WIN32
+    return InterlockedIncrement(&p->next) - 1;
+#else
+    return __sync_fetch_and_add(&p->next, 1);
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI parallel_thread(LPVOID param)
+#else
+static void *parallel_thread(void *param)
+#endif
+{
+    struct parallel *p = (struct parallel *)param;
+    long i;
+
+    while ((i = take_item(p)) < (long)p->count)
+    {
+        p->work(p->context, (unsigned int)i);
+    }
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+void pcap_parallel(unsigned int count, unsigned int threads,
+                   pcap_parallel_fn work, void *context)
+{
+#ifdef _WIN32
+    HANDLE handles[MAX_THREADS];
+#else
+    pthread_t handles[MAX_THREADS];
+#endif
+    struct parallel p;
+    unsigned int started = 0;
+    unsigned int i;
+
+    p.count = count;
+    p.work = work;
+    p.context = context;
+    p.next = 0;
+
+    if (threads > count)
+    {
+        threads = count;
+    }
+    if (threads > MAX_THREADS)
+    {
+        threads = MAX_THREADS;
+    }
+
+    /* Calling thread is a worker too */
+    for (i = 1; i < threads; i++)
+    {
+#ifdef _WIN32
+        handles[started] = CreateThread(NULL, 0, parallel_thread, &p, 0, NULL);
+        if (handles[started] == NULL)
+        {
+            break;
+        }
+#else
+        if (pthread_create(&handles[started], NULL, parallel_thread, &p) != 0)
+        {
+            break;
+        }
+#endif
+        started++;
+    }
+    parallel_thread(&p);
+    for (i = 0; i < started; i++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(handles[i], INFINITE);
+        CloseHandle(handles[i]);
+#else
+        pthread_join(handles[i], NULL);
+#endif
+    }
+}
+
+static void scan_work(void *context, unsigned int i)
+{
+    scan_chunk((struct pcap_scan *)context, i);
+}
+
+/* Makes every chunk start where previous one stopped, see pcapscan.h */
+static void stitch(struct pcap_scan *scan)
+{
+    struct pcap_scan_chunk *chunk;
+    unsigned long long carry;
+    int unsynced;
+    unsigned int i;
+
+    carry = scan->chunks[0].stop;
+    unsynced = scan->chunks[0].unsynced;
+    for (i = 1; i < scan->count; i++)
+    {
+        chunk = &scan->chunks[i];
+
+        if ((scan->chunks[i - 1].error != PCAP_FILE_OK) &&
+            !(scan->flags & PCAP_SCAN_RESYNC))
+        {
+            /* Serial scan would have stopped before this chunk */
+            clear_chunk(scan, chunk);
+            chunk->error = scan->chunks[i - 1].error;
+            chunk->error_offset = scan->chunks[i - 1].error_offset;
+            chunk->first = chunk->stop = carry;
+            continue;
+        }
+
+        if (unsynced)
+        {
+            /* Previous chunk ended in garbage, first boundary found is it */
+            chunk->skipped += chunk->first - carry;
+            if (chunk->first < chunk->end)
+            {
+                chunk->resyncs++;
+            }
+        }
+        else if (carry >= chunk->end)
+        {
+            /* Previous chunk's last record covers this one */
+            clear_chunk(scan, chunk);
+            chunk->first = chunk->stop = carry;
+            scan->reparsed++;
+        }
+        else if (chunk->first != carry)
+        {
+            clear_chunk(scan, chunk);
+            parse_chunk(scan, chunk, carry);
+            scan->reparsed++;
+        }
+
+        carry = chunk->stop;
+        unsynced = chunk->unsynced;
+    }
+}
+
+int pcap_scan_run(struct pcap_scan *scan, unsigned int threads)
+{
+    unsigned int i;
+
+    scan->reparsed = 0;
+    scan->error = PCAP_FILE_OK;
+    scan->error_offset = 0;
+    for (i = 0; i < scan->count; i++)
+    {
+        clear_chunk(scan, &scan->chunks[i]);
+    }
+
+    pcap_parallel(scan->count, threads, scan_work, scan);
+    stitch(scan);
+
+    for (i = 0; i < scan->count; i++)
+    {
+        if (scan->chunks[i].error != PCAP_FILE_OK)
+        {
+            scan->error = scan->chunks[i].error;
+            scan->error_offset = scan->chunks[i].error_offset;
+            break;
+        }
+    }
+    return scan->error;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Parallel scanner for memory mapped DLT_USBPCAP captures.
+ *
+ * pcap has no sync markers, so the capture is split into chunks of equal
+ * size and every chunk looks for its first record boundary on its own.
+ * Candidate offset is accepted when pcap record header and USBPcap header
+ * there are consistent (incl_len within snaplen and orig_len, headerLen
+ * matching transfer type and within incl_len, payload not longer than
+ * dataLength) and the following PCAP_SYNC_RECORDS records are too, or the
+ * file ends exactly after them.
+ *
+ * Chunks are parsed by worker threads and every record starting within
+ * a chunk is passed to the record callback with that chunk's context.
+ * Afterwards chunks are stitched in order: when a chunk does not start
+ * where the previous one stopped, its context is reset and it is parsed
+ * again from there, so the result is always the same as of a serial scan.
+ *
+ * Without PCAP_SCAN_RESYNC the scan stops at first invalid record like
+ * pcap_cursor_next() does and chunks after it are reset. With it, the
+ * invalid bytes are skipped until next record boundary and counted.
+ */
+
+#ifndef USBPCAP_HOST_PCAPSCAN_H
+#define USBPCAP_HOST_PCAPSCAN_H
+
+#include "pcapfile.h"
+
+/* Records after candidate boundary that have to be valid too */
+#define PCAP_SYNC_RECORDS     3
+
+/* pcap_scan_init() flags */
+#define PCAP_SCAN_RESYNC      0x01 /* Skip invalid records */
+
+/* Called for every record of the chunk, in file order */
+typedef void (*pcap_scan_record_fn)(void *context, const struct pcap_record *record);
+/* Discards everything collected for the chunk so far */
+typedef void (*pcap_scan_reset_fn)(void *context);
+
+struct pcap_scan_chunk
+{
+    unsigned long long start;    /* Records starting at or after start... */
+    unsigned long long end;      /* ...and before end belong to the chunk */
+    unsigned long long first;    /* First record boundary found */
+    unsigned long long stop;     /* Offset after last record */
+    unsigned long long records;
+    unsigned long long skipped;  /* Bytes skipped to resynchronise */
+    unsigned int       resyncs;
+    int                error;    /* First invalid record, PCAP_FILE_xxx */
+    unsigned long long error_offset;
+    int                unsynced; /* Chunk ends in bytes that are not records */
+    void              *context;  /* Passed to callbacks, set by caller */
+};
+
+struct pcap_scan
+{
+    const struct pcap_file *file;
+    int                     flags;
+    pcap_scan_record_fn     record;
+    pcap_scan_reset_fn      reset;   /* May be NULL */
+
+    struct pcap_scan_chunk *chunks;
+    unsigned int            count;
+
+    unsigned int            reparsed; /* Chunks parsed again when stitching */
+    int                     error;
+    unsigned long long      error_offset;
+};
+
+/* Number of online processors, at least 1 */
+unsigned int pcap_scan_cpus(void);
+
+typedef void (*pcap_parallel_fn)(void *context, unsigned int item);
+
+/*
+ * Calls work for items 0 .. count - 1 on up to threads threads, the
+ * calling one included, and returns when all are done.
+ */
+void pcap_parallel(unsigned int count, unsigned int threads,
+                   pcap_parallel_fn work, void *context);
+
+/*
+ * Finds first record boundary at or after offset and before end, see
+ * above. Returns 1 and sets *boundary, 0 if there is none.
+ */
+int pcap_file_sync(const struct pcap_file *file, unsigned long long offset,
+                   unsigned long long end, unsigned long long *boundary);
+
+/*
+ * Splits file into count chunks of at least 1 MB. Contexts of
+ * scan->chunks[0 .. scan->count - 1] can be set afterwards. Returns 0 if
+ * memory could not be allocated.
+ */
+int pcap_scan_init(struct pcap_scan *scan, const struct pcap_file *file,
+                   unsigned int count, int flags,
+                   pcap_scan_record_fn record, pcap_scan_reset_fn reset);
+
+/*
+ * Parses chunks on given number of threads and stitches them. Returns
+ * PCAP_FILE_OK, otherwise error of first invalid record (scan->error_offset)
+ * which without PCAP_SCAN_RESYNC is where the scan stopped.
+ */
+int pcap_scan_run(struct pcap_scan *scan, unsigned int threads);
+
+void pcap_scan_destroy(struct pcap_scan *scan);
+
+#endif /* USBPCAP_HOST_PCAPSCAN_H */
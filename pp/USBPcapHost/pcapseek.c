@@ -0,0 +1,543 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Builds and queries sidecar capture index written by USBPcapCMD --index.
+ *
+ * With --build the capture is passed to the index writer in --bufferlen
+ * sized pieces, the same way USBPcapCMD writer thread does it, and the
+ * index is written next to the capture. Otherwise packets in given time
+ * range, optionally only of one device or endpoint, are looked up in the
+ * index and read from the capture without scanning it.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../USBPcapCMD/bytes.h"
+#include "../USBPcapCMD/index.h"
+#include "../USBPcapCMD/lz4.h"
+
+#define DEFAULT_BUFFER_SIZE      (1024*1024)
+#define PCAPNG_BLOCK_HDR_LEN     8
+#define PCAPNG_EPB_TYPE          0x00000006
+
+/* Endpoint cursors merged when whole device is queried */
+#define MAX_CURSORS              256
+
+struct seek
+{
+    const char          *input;
+    const char          *index;
+    const char          *output;
+    int                  build;
+    unsigned int         bufferSize;
+    unsigned long long   from;
+    unsigned long long   to;
+    int                  device;   /* -1 for any */
+    unsigned int         bus;
+    int                  endpoint; /* -1 for any */
+
+    FILE                *capture;
+    FILE                *file;
+    struct index_reader  reader;
+    int                  pcapng;
+    int                  nanosecond;
+    unsigned char       *record;
+    size_t               recordSize;
+
+    unsigned long long   packets;
+    unsigned long long   visited;
+    unsigned long long   bytes;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] CAPTURE\n"
+        "      --build            write index for CAPTURE\n"
+        "  -b, --bufferlen BYTES  piece size passed to index writer (default: %u)\n"
+        "  -i, --index FILE       index file (default: CAPTURE.idx)\n"
+        "      --from SECONDS     first packet time (Unix time)\n"
+        "      --to SECONDS       last packet time (Unix time)\n"
+        "      --device BUS.DEV[.EP]  only packets of device or endpoint\n"
+        "  -o, --output FILE      write found packets to FILE\n",
+        argv0, DEFAULT_BUFFER_SIZE);
+}
+
+static int write_index(void *ctx, const void *data, size_t length)
+{
+    return fwrite(data, 1, length, (FILE *)ctx) == length;
+}
+
+static int build_index(struct seek *s)
+{
+    struct index_writer ix;
+    unsigned char *buffer;
+    unsigned long long start;
+    unsigned long long total = 0;
+    double elapsed;
+    size_t length;
+    FILE *out;
+    int ok;
+
+    buffer = malloc(s->bufferSize);
+    out = fopen(s->index, "wb");
+    if ((buffer == NULL) || (out == NULL))
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", s->index, strerror(errno));
+        return 0;
+    }
+
+    if (!index_init(&ix, write_index, out, 0))
+    {
+        fprintf(stderr, "Failed to allocate index writer.\n");
+        return 0;
+    }
+
+    start = now_ns();
+    while ((length = fread(buffer, 1, s->bufferSize, s->capture)) > 0)
+    {
+        index_feed(&ix, buffer, length);
+        total += length;
+    }
+    ok = index_flush(&ix);
+    elapsed = (double)(now_ns() - start) / 1e9;
+
+    if (fclose(out) != 0)
+    {
+        ok = 0;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to index %s.\n", s->input);
+    }
+    else
+    {
+        fprintf(stderr, "Indexed %llu packets, %llu bytes in %.3f s "
+                "(%.1f MB/s)\n", ix.packets, total, elapsed,
+                total / elapsed / 1e6);
+    }
+
+    index_destroy(&ix);
+    free(buffer);
+    return ok;
+}
+
+static int load_index(struct seek *s)
+{
+    unsigned char *data;
+    long length;
+    FILE *f;
+    int result;
+
+    f = fopen(s->index, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", s->index, strerror(errno));
+        return 0;
+    }
+
+    if ((fseek(f, 0, SEEK_END) != 0) || ((length = ftell(f)) < 0) ||
+        (fseek(f, 0, SEEK_SET) != 0))
+    {
+        fclose(f);
+        return 0;
+    }
+
+    data = malloc(length > 0 ? (size_t)length : 1);
+    if (data == NULL)
+    {
+        fclose(f);
+        return 0;
+    }
+    length = (long)fread(data, 1, (size_t)length, f);
+    fclose(f);
+
+    result = index_read(&s->reader, data, (size_t)length);
+    free(data);
+    if (result != INDEX_OK)
+    {
+        fprintf(stderr, "%s is not a valid index (%d).\n", s->index, result);
+        return 0;
+    }
+
+    s->pcapng = (s->reader.flags & INDEX_FLAG_PCAPNG) != 0;
+    return 1;
+}
+
+/* Reads record at offset, returns its length or 0 */
+static size_t read_record(struct seek *s, unsigned long long offset,
+                          unsigned long long *ts)
+{
+    size_t header = s->pcapng ? PCAPNG_BLOCK_HDR_LEN : PCAP_REC_HDR_LEN;
+    size_t length;
+
+    if ((fseeko(s->capture, (off_t)offset, SEEK_SET) != 0) ||
+        (fread(s->record, 1, header, s->capture) != header))
+    {
+        return 0;
+    }
+
+    length = s->pcapng ? get32(&s->record[4]) :
+                         PCAP_REC_HDR_LEN + get32(&s->record[8]);
+    if (length < header)
+    {
+        return 0;
+    }
+    if (length > s->recordSize)
+    {
+        unsigned char *record = realloc(s->record, length);
+
+        if (record == NULL)
+        {
+            return 0;
+        }
+        s->record = record;
+        s->recordSize = length;
+    }
+    if (fread(&s->record[header], 1, length - header, s->capture) !=
+        length - header)
+    {
+        return 0;
+    }
+
+    if (s->pcapng)
+    {
+        /* Blocks other than packets are treated as being in range */
+        *ts = (get32(s->record) != PCAPNG_EPB_TYPE) ? s->from :
+              ((unsigned long long)get32(&s->record[12]) << 32) |
+              get32(&s->record[16]);
+    }
+    else
+    {
+        *ts = (unsigned long long)get32(s->record) * 1000000000ULL +
+              (s->nanosecond ? get32(&s->record[4]) :
+                               get32(&s->record[4]) * 1000ULL);
+    }
+
+    s->visited++;
+    s->bytes += length;
+    return length;
+}
+
+static int emit(struct seek *s, size_t length)
+{
+    s->packets++;
+    if ((s->file != NULL) && (fwrite(s->record, 1, length, s->file) != length))
+    {
+        fprintf(stderr, "Failed to write %s.\n", s->output);
+        return 0;
+    }
+    return 1;
+}
+
+/* Copies file header, everything before first packet */
+static int copy_header(struct seek *s)
+{
+    unsigned long long length;
+    unsigned char magic[4];
+
+    if (s->reader.checkpoint_count == 0)
+    {
+        fprintf(stderr, "Index has no packets.\n");
+        return 0;
+    }
+    length = s->reader.checkpoints[0].offset;
+
+    if (s->recordSize < length)
+    {
+        free(s->record);
+        s->record = malloc((size_t)length);
+        s->recordSize = (size_t)length;
+    }
+    if ((s->record == NULL) || (length < sizeof(magic)) ||
+        (fseeko(s->capture, 0, SEEK_SET) != 0) ||
+        (fread(s->record, 1, (size_t)length, s->capture) != length))
+    {
+        fprintf(stderr, "Failed to read header of %s.\n", s->input);
+        return 0;
+    }
+
+    memcpy(magic, s->record, sizeof(magic));
+    if (get32(magic) == LZ4_FRAME_MAGIC)
+    {
+        /* Index offsets are valid in decompressed capture */
+        fprintf(stderr, "Capture is compressed, decompress it with pcapcat "
+                "first and pass this index with -i.\n");
+        return 0;
+    }
+    s->nanosecond = (get32(magic) == PCAP_MAGIC_NANOSECOND);
+    if ((s->file != NULL) &&
+        (fwrite(s->record, 1, (size_t)length, s->file) != length))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/* Reads packets one by one starting at offset */
+static int scan_range(struct seek *s, unsigned long long offset)
+{
+    unsigned long long ts;
+    size_t length;
+
+    while ((length = read_record(s, offset, &ts)) > 0)
+    {
+        if (ts > s->to)
+        {
+            break;
+        }
+        if ((ts >= s->from) && !emit(s, length))
+        {
+            return 0;
+        }
+        offset += length;
+    }
+    return 1;
+}
+
+/* Reads packets of selected endpoints listed in index from offset */
+static int scan_endpoints(struct seek *s, unsigned long long offset)
+{
+    struct index_cursor cursors[MAX_CURSORS];
+    unsigned long long next[MAX_CURSORS];
+    unsigned int count = 0;
+    unsigned long long ts;
+    unsigned int best;
+    unsigned int i;
+    size_t length;
+
+    /* Lists are sorted by key, open one cursor per matching key */
+    for (i = 0; (i < s->reader.list_count) && (count < MAX_CURSORS); i++)
+    {
+        unsigned int key = s->reader.lists[i].key;
+
+        if (((i > 0) && (key == s->reader.lists[i - 1].key)) ||
+            ((key >> 16) != s->bus) ||
+            (((key >> 8) & 0xFF) != (unsigned int)s->device) ||
+            ((s->endpoint >= 0) && ((key & 0xFF) != (unsigned int)s->endpoint)))
+        {
+            continue;
+        }
+
+        if (index_seek_endpoint(&s->reader, key, offset, &cursors[count]) &&
+            index_next(&cursors[count], &next[count]))
+        {
+            count++;
+        }
+    }
+
+    while (count > 0)
+    {
+        best = 0;
+        for (i = 1; i < count; i++)
+        {
+            if (next[i] < next[best])
+            {
+                best = i;
+            }
+        }
+
+        length = read_record(s, next[best], &ts);
+        if ((length == 0) || (ts > s->to))
+        {
+            break;
+        }
+        if ((ts >= s->from) && !emit(s, length))
+        {
+            return 0;
+        }
+
+        if (!index_next(&cursors[best], &next[best]))
+        {
+            cursors[best] = cursors[count - 1];
+            next[best] = next[count - 1];
+            count--;
+        }
+    }
+    return 1;
+}
+
+static int query(struct seek *s)
+{
+    const struct index_checkpoint *cp;
+    unsigned long long start;
+    unsigned long long offset;
+    int ok;
+
+    if (!load_index(s))
+    {
+        return 0;
+    }
+
+    if (s->output != NULL)
+    {
+        s->file = fopen(s->output, "wb");
+        if (s->file == NULL)
+        {
+            fprintf(stderr, "Failed to open %s: %s\n", s->output,
+                    strerror(errno));
+            return 0;
+        }
+    }
+
+    start = now_ns();
+    if (!copy_header(s))
+    {
+        return 0;
+    }
+
+    cp = index_seek_time(&s->reader, s->from);
+    offset = (cp != NULL) ? cp->offset : s->reader.checkpoints[0].offset;
+
+    ok = (s->device < 0) ? scan_range(s, offset) : scan_endpoints(s, offset);
+
+    if ((s->file != NULL) && (fclose(s->file) != 0))
+    {
+        ok = 0;
+    }
+
+    if (ok)
+    {
+        fprintf(stderr, "%llu packets found, %llu read (%llu bytes) in "
+                "%.3f ms\n", s->packets, s->visited, s->bytes,
+                (double)(now_ns() - start) / 1e6);
+    }
+    return ok;
+}
+
+static unsigned long long parse_seconds(const char *arg)
+{
+    return (unsigned long long)(strtod(arg, NULL) * 1e9);
+}
+
+static int parse_device(struct seek *s, const char *arg)
+{
+    int n = sscanf(arg, "%u.%d.%d", &s->bus, &s->device, &s->endpoint);
+
+    if (n < 2)
+    {
+        return 0;
+    }
+    if (n == 2)
+    {
+        s->endpoint = -1;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"build",     no_argument,       NULL, 'B'},
+        {"bufferlen", required_argument, NULL, 'b'},
+        {"index",     required_argument, NULL, 'i'},
+        {"from",      required_argument, NULL, 'F'},
+        {"to",        required_argument, NULL, 'T'},
+        {"device",    required_argument, NULL, 'D'},
+        {"output",    required_argument, NULL, 'o'},
+        {"help",      no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct seek  s;
+    char        *index = NULL;
+    int          ok;
+    int          c;
+
+    memset(&s, 0, sizeof(s));
+    s.bufferSize = DEFAULT_BUFFER_SIZE;
+    s.to = ~0ULL;
+    s.device = -1;
+    s.endpoint = -1;
+
+    while ((c = getopt_long(argc, argv, "b:i:o:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'B':
+                s.build = 1;
+                break;
+            case 'b':
+                s.bufferSize = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                s.index = optarg;
+                break;
+            case 'F':
+                s.from = parse_seconds(optarg);
+                break;
+            case 'T':
+                s.to = parse_seconds(optarg);
+                break;
+            case 'D':
+                if (!parse_device(&s, optarg))
+                {
+                    fprintf(stderr, "Invalid device %s, use BUS.DEV or "
+                            "BUS.DEV.EP.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o':
+                s.output = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((optind != argc - 1) || (s.bufferSize == 0))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    s.input = argv[optind];
+
+    if (s.index == NULL)
+    {
+        index = malloc(strlen(s.input) + 5);
+        if (index == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        sprintf(index, "%s.idx", s.input);
+        s.index = index;
+    }
+
+    s.capture = fopen(s.input, "rb");
+    if (s.capture == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", s.input, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    ok = s.build ? build_index(&s) : query(&s);
+
+    fclose(s.capture);
+    index_reader_free(&s.reader);
+    free(s.record);
+    free(index);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
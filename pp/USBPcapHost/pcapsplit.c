@@ -0,0 +1,938 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Splits capture into one file per bus, device, endpoint or transfer type.
+ *
+ * The capture is parsed once, in chunks on all CPUs like readbench
+ * does, and every chunk notes runs of records of every output. Outputs
+ * are then written on the same threads, each through its own stdio
+ * buffer, by copying the runs from the mapped capture in file order.
+ *
+ * Every output begins with descriptor records of its devices the way
+ * USBPcapCMD captures begin with descriptors_generate_pcap() records:
+ * GET DESCRIPTOR of device and configuration descriptor and SET
+ * CONFIGURATION, the first successful ones found in the capture with all
+ * their stages. Those records are not repeated later in the output.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pcapscan.h"
+#include "../USBPcapCMD/index.h"
+
+#define SPLIT_BUS            0
+#define SPLIT_DEVICE         1
+#define SPLIT_ENDPOINT       2
+#define SPLIT_TRANSFER       3
+
+#define DESC_DEVICE          0
+#define DESC_CONFIG          1
+#define DESC_SET_CONFIG      2
+#define DESC_KINDS           3
+#define DESC_RECORDS         4   /* Setup, data, status and complete */
+
+#define MAX_PENDING          64  /* Descriptor requests waiting for completion */
+#define MIN_KEY_SLOTS        64
+#define DEFAULT_BUFFER_KB    1024
+
+static const char *split_names[] = {"bus", "device", "endpoint", "transfer"};
+static const char *transfer_names[] = {"isochronous", "interrupt", "control", "bulk"};
+
+struct run
+{
+    unsigned long long  offset;
+    unsigned long long  length;
+};
+
+/* Records of one output within a chunk */
+struct list
+{
+    unsigned int        key;
+    struct run         *runs;
+    unsigned int        count;
+    unsigned int        size;
+    unsigned long long  records;
+    unsigned int       *devices;    /* index_key(bus, device, 0) */
+    unsigned int        device_count;
+    unsigned int        device_size;
+};
+
+/* Control transfer record on default pipe */
+struct control
+{
+    unsigned long long  offset;
+    unsigned long long  irp;
+    unsigned int        device;
+    int                 kind;       /* DESC_xxx of setup, -1 for others */
+    unsigned int        status;
+    UCHAR               stage;
+};
+
+struct chunk
+{
+    const struct split *s;
+    int                 failed;
+    struct list        *lists;
+    unsigned int        list_count;
+    unsigned int        list_size;
+    int                *slots;      /* Key hash table, list index or -1 */
+    unsigned int        slot_count;
+    struct control     *controls;
+    unsigned int        control_count;
+    unsigned int        control_size;
+};
+
+struct device_desc
+{
+    unsigned int        device;
+    unsigned long long  offsets[DESC_KINDS][DESC_RECORDS];
+    unsigned int        counts[DESC_KINDS];
+};
+
+struct pending
+{
+    unsigned long long  irp;
+    unsigned int        device;
+    int                 kind;
+    unsigned long long  offsets[DESC_RECORDS];
+    unsigned int        count;
+};
+
+struct output
+{
+    unsigned int        key;
+    unsigned long long  records;
+    unsigned long long  bytes;
+    unsigned int       *devices;
+    unsigned int        device_count;
+    unsigned int        descriptors;   /* Records put at the start */
+    int                 failed;
+};
+
+struct split
+{
+    const char         *input;
+    const char         *prefix;
+    int                 by;
+    unsigned int        threads;
+    unsigned int        buffer_size;
+    int                 flags;
+
+    const struct pcap_file *file;
+    struct chunk       *chunks;
+    unsigned int        chunk_count;
+    struct device_desc *descs;
+    unsigned int        desc_count;
+    unsigned int        desc_size;
+    struct output      *outputs;
+    unsigned int        output_count;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] CAPTURE\n"
+        "  -b, --by KEY           bus, device, endpoint or transfer (default: device)\n"
+        "  -o, --prefix PREFIX    output files PREFIX-KEY.pcap (default: CAPTURE\n"
+        "                         without .pcap)\n"
+        "  -t, --threads N        parse and write threads (default all CPUs)\n"
+        "      --buffer KB        write buffer of every output (default %d)\n"
+        "      --resync           skip damaged records instead of stopping\n",
+        argv0, DEFAULT_BUFFER_KB);
+}
+
+static unsigned int hash_key(unsigned int key)
+{
+    key ^= key >> 16;
+    key *= 0x7FEB352D;
+    key ^= key >> 15;
+    key *= 0x846CA68B;
+    key ^= key >> 16;
+    return key;
+}
+
+/* Makes room for one more item, returns 0 if memory ran out */
+static int grow(void **array, unsigned int *size, unsigned int count,
+                size_t item)
+{
+    unsigned int new_size;
+    void *p;
+
+    if (count < *size)
+    {
+        return 1;
+    }
+    new_size = (*size != 0) ? *size * 2 : 16;
+    p = realloc(*array, (size_t)new_size * item);
+    if (p == NULL)
+    {
+        return 0;
+    }
+    *array = p;
+    *size = new_size;
+    return 1;
+}
+
+static int rehash_lists(struct chunk *c)
+{
+    unsigned int count = (c->slot_count != 0) ? c->slot_count * 2 : MIN_KEY_SLOTS;
+    unsigned int mask = count - 1;
+    unsigned int slot;
+    unsigned int i;
+    int *slots;
+
+    slots = malloc(count * sizeof(int));
+    if (slots == NULL)
+    {
+        return 0;
+    }
+    memset(slots, 0xFF, count * sizeof(int));
+    for (i = 0; i < c->list_count; i++)
+    {
+        slot = hash_key(c->lists[i].key) & mask;
+        while (slots[slot] >= 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = (int)i;
+    }
+
+    free(c->slots);
+    c->slots = slots;
+    c->slot_count = count;
+    return 1;
+}
+
+/* Returns list of key, adds it if create is set */
+static struct list *find_list(struct chunk *c, unsigned int key, int create)
+{
+    struct list *l;
+    unsigned int mask;
+    unsigned int slot;
+
+    if (create && ((c->list_count + 1) * 2 > c->slot_count))
+    {
+        if (!rehash_lists(c))
+        {
+            return NULL;
+        }
+    }
+    if (c->slot_count == 0)
+    {
+        return NULL;
+    }
+
+    mask = c->slot_count - 1;
+    slot = hash_key(key) & mask;
+    while (c->slots[slot] >= 0)
+    {
+        l = &c->lists[c->slots[slot]];
+        if (l->key == key)
+        {
+            return l;
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (!create ||
+        !grow((void **)&c->lists, &c->list_size, c->list_count, sizeof(struct list)))
+    {
+        return NULL;
+    }
+
+    l = &c->lists[c->list_count];
+    memset(l, 0, sizeof(struct list));
+    l->key = key;
+    c->slots[slot] = (int)c->list_count++;
+    return l;
+}
+
+static int add_device(unsigned int **devices, unsigned int *count,
+                      unsigned int *size, unsigned int device)
+{
+    unsigned int i;
+
+    for (i = *count; i > 0; i--)
+    {
+        if ((*devices)[i - 1] == device)
+        {
+            return 1;
+        }
+    }
+    if (!grow((void **)devices, size, *count, sizeof(unsigned int)))
+    {
+        return 0;
+    }
+    (*devices)[(*count)++] = device;
+    return 1;
+}
+
+static unsigned int record_key(int by, const USBPCAP_BUFFER_PACKET_HEADER *usb)
+{
+    switch (by)
+    {
+        case SPLIT_BUS:
+            return pcap_le16(&usb->bus);
+        case SPLIT_DEVICE:
+            return index_key(pcap_le16(&usb->bus), pcap_le16(&usb->device), 0);
+        case SPLIT_ENDPOINT:
+            return index_key(pcap_le16(&usb->bus), pcap_le16(&usb->device), usb->endpoint);
+        default:
+            return usb->transfer;
+    }
+}
+
+/* Notes control transfers of default pipe to find descriptor requests later */
+static int add_control(struct chunk *c, const struct pcap_record *record,
+                       unsigned int device)
+{
+    const USBPCAP_BUFFER_CONTROL_HEADER *control = pcap_record_control(record);
+    const unsigned char *setup = record->payload;
+    struct control *ctl;
+
+    if ((control == NULL) || ((record->usb->endpoint & 0x7F) != 0))
+    {
+        return 1;
+    }
+    if (!grow((void **)&c->controls, &c->control_size, c->control_count,
+              sizeof(struct control)))
+    {
+        return 0;
+    }
+
+    ctl = &c->controls[c->control_count++];
+    ctl->offset = record->offset;
+    ctl->irp = pcap_le64(&record->usb->irpId);
+    ctl->device = device;
+    ctl->status = pcap_le32(&record->usb->status);
+    ctl->stage = control->stage;
+    ctl->kind = -1;
+    if ((control->stage == USBPCAP_CONTROL_STAGE_SETUP) && (record->payload_len >= 8))
+    {
+        if ((setup[0] == 0x80) && (setup[1] == 6) && (setup[3] == 1))
+        {
+            ctl->kind = DESC_DEVICE;
+        }
+        else if ((setup[0] == 0x80) && (setup[1] == 6) && (setup[3] == 2))
+        {
+            ctl->kind = DESC_CONFIG;
+        }
+        else if ((setup[0] == 0x00) && (setup[1] == 9))
+        {
+            ctl->kind = DESC_SET_CONFIG;
+        }
+    }
+    return 1;
+}
+
+static void split_record(void *context, const struct pcap_record *record)
+{
+    struct chunk *c = (struct chunk *)context;
+    const USBPCAP_BUFFER_PACKET_HEADER *usb = record->usb;
+    unsigned long long length = PCAP_RECORD_HEADER_LEN + record->incl_len;
+    unsigned int device;
+    struct list *l;
+    struct run *r;
+
+    if (c->failed)
+    {
+        return;
+    }
+
+    device = index_key(pcap_le16(&usb->bus), pcap_le16(&usb->device), 0);
+    l = find_list(c, record_key(c->s->by, usb), 1);
+    if (l == NULL)
+    {
+        c->failed = 1;
+        return;
+    }
+
+    r = l->count ? &l->runs[l->count - 1] : NULL;
+    if ((r != NULL) && (r->offset + r->length == record->offset))
+    {
+        r->length += length;
+    }
+    else
+    {
+        if (!grow((void **)&l->runs, &l->size, l->count, sizeof(struct run)))
+        {
+            c->failed = 1;
+            return;
+        }
+        r = &l->runs[l->count++];
+        r->offset = record->offset;
+        r->length = length;
+    }
+    l->records++;
+
+    if (((l->device_count == 0) || (l->devices[l->device_count - 1] != device)) &&
+        !add_device(&l->devices, &l->device_count, &l->device_size, device))
+    {
+        c->failed = 1;
+        return;
+    }
+
+    if ((usb->transfer == USBPCAP_TRANSFER_CONTROL) && !add_control(c, record, device))
+    {
+        c->failed = 1;
+    }
+}
+
+static void split_reset(void *context)
+{
+    struct chunk *c = (struct chunk *)context;
+    unsigned int i;
+
+    for (i = 0; i < c->list_count; i++)
+    {
+        free(c->lists[i].runs);
+        free(c->lists[i].devices);
+    }
+    if (c->slots != NULL)
+    {
+        memset(c->slots, 0xFF, c->slot_count * sizeof(int));
+    }
+    c->list_count = 0;
+    c->control_count = 0;
+    c->failed = 0;
+}
+
+static struct device_desc *find_desc(struct split *s, unsigned int device, int create)
+{
+    struct device_desc *d;
+    unsigned int i;
+
+    for (i = 0; i < s->desc_count; i++)
+    {
+        if (s->descs[i].device == device)
+        {
+            return &s->descs[i];
+        }
+    }
+    if (!create ||
+        !grow((void **)&s->descs, &s->desc_size, s->desc_count, sizeof(struct device_desc)))
+    {
+        return NULL;
+    }
+    d = &s->descs[s->desc_count++];
+    memset(d, 0, sizeof(struct device_desc));
+    d->device = device;
+    return d;
+}
+
+/*
+ * Pairs descriptor requests with their completion on IRP id and bus.
+ * Setup of a new request with the same IRP id drops the earlier one as
+ * the IRP was reused.
+ */
+static int collect_descriptors(struct split *s)
+{
+    struct pending pending[MAX_PENDING];
+    unsigned int count = 0;
+    unsigned int i, j, k;
+
+    for (i = 0; i < s->chunk_count; i++)
+    {
+        const struct chunk *c = &s->chunks[i];
+
+        for (j = 0; j < c->control_count; j++)
+        {
+            const struct control *ctl = &c->controls[j];
+            struct pending *p = NULL;
+            struct device_desc *d;
+
+            for (k = 0; k < count; k++)
+            {
+                if ((pending[k].irp == ctl->irp) &&
+                    ((pending[k].device >> 16) == (ctl->device >> 16)))
+                {
+                    p = &pending[k];
+                    break;
+                }
+            }
+
+            if (ctl->stage == USBPCAP_CONTROL_STAGE_SETUP)
+            {
+                if (p != NULL)
+                {
+                    *p = pending[--count];
+                }
+                if (ctl->kind < 0)
+                {
+                    continue;
+                }
+                d = find_desc(s, ctl->device, 0);
+                if ((d != NULL) && (d->counts[ctl->kind] != 0))
+                {
+                    continue;
+                }
+                if (count == MAX_PENDING)
+                {
+                    /* Oldest request never completed */
+                    memmove(&pending[0], &pending[1], (MAX_PENDING - 1) * sizeof(struct pending));
+                    count--;
+                }
+                p = &pending[count++];
+                p->irp = ctl->irp;
+                p->device = ctl->device;
+                p->kind = ctl->kind;
+                p->offsets[0] = ctl->offset;
+                p->count = 1;
+            }
+            else if (p != NULL)
+            {
+                if (p->count < DESC_RECORDS)
+                {
+                    p->offsets[p->count++] = ctl->offset;
+                }
+                if (ctl->stage == USBPCAP_CONTROL_STAGE_COMPLETE)
+                {
+                    if (ctl->status == 0)
+                    {
+                        d = find_desc(s, p->device, 1);
+                        if (d == NULL)
+                        {
+                            return 0;
+                        }
+                        if (d->counts[p->kind] == 0)
+                        {
+                            memcpy(d->offsets[p->kind], p->offsets,
+                                   p->count * sizeof(unsigned long long));
+                            d->counts[p->kind] = p->count;
+                        }
+                    }
+                    *p = pending[--count];
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    unsigned int ka = *(const unsigned int *)a;
+    unsigned int kb = *(const unsigned int *)b;
+
+    return (ka < kb) ? -1 : (ka > kb);
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    unsigned long long oa = *(const unsigned long long *)a;
+    unsigned long long ob = *(const unsigned long long *)b;
+
+    return (oa < ob) ? -1 : (oa > ob);
+}
+
+/* One output for every key seen, sorted by key */
+static int collect_outputs(struct split *s)
+{
+    unsigned int *keys = NULL;
+    unsigned int count = 0, size = 0;
+    unsigned int i, j, k;
+
+    for (i = 0; i < s->chunk_count; i++)
+    {
+        for (j = 0; j < s->chunks[i].list_count; j++)
+        {
+            if (!grow((void **)&keys, &size, count, sizeof(unsigned int)))
+            {
+                free(keys);
+                return 0;
+            }
+            keys[count++] = s->chunks[i].lists[j].key;
+        }
+    }
+    qsort(keys, count, sizeof(unsigned int), compare_keys);
+
+    s->outputs = calloc(count + 1, sizeof(struct output));
+    if (s->outputs == NULL)
+    {
+        free(keys);
+        return 0;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if ((i == 0) || (keys[i] != keys[i - 1]))
+        {
+            s->outputs[s->output_count++].key = keys[i];
+        }
+    }
+    free(keys);
+
+    for (i = 0; i < s->output_count; i++)
+    {
+        struct output *o = &s->outputs[i];
+        unsigned int device_size = 0;
+
+        for (j = 0; j < s->chunk_count; j++)
+        {
+            const struct list *l = find_list(&s->chunks[j], o->key, 0);
+
+            if (l == NULL)
+            {
+                continue;
+            }
+            o->records += l->records;
+            for (k = 0; k < l->device_count; k++)
+            {
+                if (!add_device(&o->devices, &o->device_count, &device_size,
+                                l->devices[k]))
+                {
+                    return 0;
+                }
+            }
+        }
+        qsort(o->devices, o->device_count, sizeof(unsigned int), compare_keys);
+    }
+    return 1;
+}
+
+static char *output_name(const struct split *s, unsigned int key)
+{
+    char *path = malloc(strlen(s->prefix) + 32);
+
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    switch (s->by)
+    {
+        case SPLIT_BUS:
+            sprintf(path, "%s-%u.pcap", s->prefix, key);
+            break;
+        case SPLIT_DEVICE:
+            sprintf(path, "%s-%u.%u.pcap", s->prefix, key >> 16, (key >> 8) & 0xFF);
+            break;
+        case SPLIT_ENDPOINT:
+            sprintf(path, "%s-%u.%u.%u.pcap", s->prefix, key >> 16,
+                    (key >> 8) & 0xFF, key & 0xFF);
+            break;
+        default:
+            if (key < 4)
+            {
+                sprintf(path, "%s-%s.pcap", s->prefix, transfer_names[key]);
+            }
+            else
+            {
+                sprintf(path, "%s-transfer%u.pcap", s->prefix, key);
+            }
+            break;
+    }
+    return path;
+}
+
+static unsigned long long record_length(const struct pcap_file *file,
+                                        unsigned long long offset)
+{
+    struct pcap_cursor cursor;
+    struct pcap_record record;
+
+    pcap_cursor_range(&cursor, file, offset, offset + 1);
+    if (!pcap_cursor_next(&cursor, &record))
+    {
+        return 0;
+    }
+    return PCAP_RECORD_HEADER_LEN + record.incl_len;
+}
+
+static int write_bytes(FILE *f, struct output *o, const unsigned char *data,
+                       unsigned long long length)
+{
+    o->bytes += length;
+    return fwrite(data, 1, (size_t)length, f) == length;
+}
+
+/* Writes output i: file header, descriptor records, then its runs */
+static void write_output(void *context, unsigned int i)
+{
+    struct split *s = (struct split *)context;
+    struct output *o = &s->outputs[i];
+    const unsigned char *data = s->file->data;
+    unsigned long long *skip;
+    unsigned long long length, start, end;
+    unsigned int skip_count = 0;
+    unsigned int j, k, n;
+    char *path;
+    FILE *f;
+    int ok;
+
+    skip = malloc((o->device_count + 1) * DESC_KINDS * DESC_RECORDS *
+                  sizeof(unsigned long long));
+    path = output_name(s, o->key);
+    f = (path && skip) ? fopen(path, "wb") : NULL;
+    free(path);
+    if (f == NULL)
+    {
+        free(skip);
+        o->failed = 1;
+        return;
+    }
+    setvbuf(f, NULL, _IOFBF, s->buffer_size);
+    ok = write_bytes(f, o, data, PCAP_FILE_HEADER_LEN);
+
+    for (j = 0; j < o->device_count; j++)
+    {
+        const struct device_desc *d = find_desc(s, o->devices[j], 0);
+
+        for (k = 0; (d != NULL) && (k < DESC_KINDS); k++)
+        {
+            for (n = 0; n < d->counts[k]; n++)
+            {
+                skip[skip_count++] = d->offsets[k][n];
+            }
+        }
+    }
+    for (j = 0; ok && (j < skip_count); j++)
+    {
+        length = record_length(s->file, skip[j]);
+        ok = write_bytes(f, o, &data[skip[j]], length);
+    }
+    o->descriptors = skip_count;
+    qsort(skip, skip_count, sizeof(unsigned long long), compare_offsets);
+
+    k = 0;
+    for (j = 0; ok && (j < s->chunk_count); j++)
+    {
+        const struct list *l = find_list(&s->chunks[j], o->key, 0);
+
+        for (n = 0; ok && (l != NULL) && (n < l->count); n++)
+        {
+            start = l->runs[n].offset;
+            end = start + l->runs[n].length;
+            while (ok && (k < skip_count) && (skip[k] < end))
+            {
+                if (skip[k] >= start)
+                {
+                    ok = write_bytes(f, o, &data[start], skip[k] - start);
+                    start = skip[k] + record_length(s->file, skip[k]);
+                }
+                k++;
+            }
+            if (ok && (start < end))
+            {
+                ok = write_bytes(f, o, &data[start], end - start);
+            }
+        }
+    }
+
+    if ((fclose(f) != 0) || !ok)
+    {
+        o->failed = 1;
+    }
+    free(skip);
+}
+
+static int split(struct split *s)
+{
+    struct pcap_scan scan;
+    unsigned long long start = now_ns();
+    unsigned long long parsed, written = 0;
+    unsigned int failed = 0;
+    unsigned int i;
+    int error;
+    int ok = 1;
+
+    if (!pcap_scan_init(&scan, s->file, s->threads * 4, s->flags,
+                        split_record, split_reset))
+    {
+        fprintf(stderr, "Failed to allocate chunks.\n");
+        return 0;
+    }
+    s->chunks = calloc(scan.count, sizeof(struct chunk));
+    if (s->chunks == NULL)
+    {
+        pcap_scan_destroy(&scan);
+        fprintf(stderr, "Failed to allocate chunks.\n");
+        return 0;
+    }
+    s->chunk_count = scan.count;
+    for (i = 0; i < scan.count; i++)
+    {
+        s->chunks[i].s = s;
+        scan.chunks[i].context = &s->chunks[i];
+    }
+
+    error = pcap_scan_run(&scan, s->threads);
+    if (error != PCAP_FILE_OK)
+    {
+        fprintf(stderr, "Record at %llu: %s%s\n", scan.error_offset,
+                pcap_file_strerror(error),
+                (s->flags & PCAP_SCAN_RESYNC) ? ", skipped" : "");
+        ok = (s->flags & PCAP_SCAN_RESYNC) != 0;
+    }
+    for (i = 0; i < scan.count; i++)
+    {
+        if (s->chunks[i].failed)
+        {
+            ok = 0;
+        }
+    }
+    if (ok && (!collect_descriptors(s) || !collect_outputs(s)))
+    {
+        fprintf(stderr, "Out of memory.\n");
+        ok = 0;
+    }
+    parsed = now_ns() - start;
+
+    if (ok)
+    {
+        pcap_parallel(s->output_count, s->threads, write_output, s);
+        for (i = 0; i < s->output_count; i++)
+        {
+            const struct output *o = &s->outputs[i];
+            char *path = output_name(s, o->key);
+
+            printf("%s: %llu records, %u descriptor records, %llu bytes%s\n",
+                   path ? path : "?", o->records, o->descriptors, o->bytes,
+                   o->failed ? ", failed to write" : "");
+            free(path);
+            written += o->bytes;
+            failed += o->failed;
+        }
+        fprintf(stderr, "Split %llu bytes into %u files by %s in %.1f ms "
+                "(parsed in %.1f ms, %u descriptor sets, %.2f GB/s)\n",
+                s->file->size, s->output_count, split_names[s->by],
+                (now_ns() - start) / 1e6, parsed / 1e6, s->desc_count,
+                (double)s->file->size / (now_ns() - start));
+        ok = (failed == 0);
+    }
+
+    for (i = 0; i < s->chunk_count; i++)
+    {
+        split_reset(&s->chunks[i]);
+        free(s->chunks[i].lists);
+        free(s->chunks[i].slots);
+        free(s->chunks[i].controls);
+    }
+    for (i = 0; i < s->output_count; i++)
+    {
+        free(s->outputs[i].devices);
+    }
+    free(s->outputs);
+    free(s->chunks);
+    free(s->descs);
+    pcap_scan_destroy(&scan);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"by",        required_argument, NULL, 'b'},
+        {"prefix",    required_argument, NULL, 'o'},
+        {"threads",   required_argument, NULL, 't'},
+        {"buffer",    required_argument, NULL, 'B'},
+        {"resync",    no_argument,       NULL, 'R'},
+        {"help",      no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct split s;
+    struct pcap_file file;
+    char *prefix = NULL;
+    size_t length;
+    int error;
+    int ok;
+    int c;
+
+    memset(&s, 0, sizeof(s));
+    s.by = SPLIT_DEVICE;
+    s.threads = pcap_scan_cpus();
+    s.buffer_size = DEFAULT_BUFFER_KB * 1024;
+
+    while ((c = getopt_long(argc, argv, "b:o:t:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'b':
+                for (s.by = 0; s.by < 4; s.by++)
+                {
+                    if (strcmp(optarg, split_names[s.by]) == 0)
+                    {
+                        break;
+                    }
+                }
+                if (s.by == 4)
+                {
+                    fprintf(stderr, "Invalid key %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o':
+                s.prefix = optarg;
+                break;
+            case 't':
+                s.threads = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                s.buffer_size = (unsigned int)strtoul(optarg, NULL, 10) * 1024;
+                break;
+            case 'R':
+                s.flags |= PCAP_SCAN_RESYNC;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((optind != argc - 1) || (s.threads == 0) || (s.buffer_size == 0))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    s.input = argv[optind];
+
+    if (s.prefix == NULL)
+    {
+        length = strlen(s.input);
+        prefix = malloc(length + 1);
+        if (prefix == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        strcpy(prefix, s.input);
+        if ((length > 5) && (strcmp(&prefix[length - 5], ".pcap") == 0))
+        {
+            prefix[length - 5] = '\0';
+        }
+        s.prefix = prefix;
+    }
+
+    error = pcap_file_open(&file, s.input, PCAP_FILE_SEQUENTIAL);
+    if (error != PCAP_FILE_OK)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", s.input, pcap_file_strerror(error));
+        free(prefix);
+        return EXIT_FAILURE;
+    }
+    s.file = &file;
+
+    ok = split(&s);
+
+    pcap_file_close(&file);
+    free(prefix);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Capture buffer pool memory benchmark.
+ *
+ * Allocates the pool USBPcapCMD reads capture into with plain malloc(),
+ * pre-faulted pages and huge pages (the Linux analogue of Windows large
+ * pages) and measures how long the first and later passes of copying
+ * capture data into every buffer take, together with page faults taken
+ * and the cost of random reads across the pool, which is dominated by
+ * TLB misses.
+ *
+ * Huge pages are only used if they were reserved, e.g.
+ *   echo 512 > /proc/sys/vm/nr_hugepages
+ * otherwise the pool falls back to normal pages and says so.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "../USBPcapCMD/bufpool.h"
+
+#define DEFAULT_BUFFERS      6   /* Default read depth + MAX_PENDING_WRITES */
+#define DEFAULT_BUFFER_SIZE  (8 * 1024 * 1024)
+#define DEFAULT_PASSES       10
+#define DEFAULT_PROBES       (4 * 1024 * 1024)
+
+struct mode
+{
+    const char *name;
+    int options;
+};
+
+static const struct mode modes[] =
+{
+    {"malloc",        0},
+    {"prefault",      BUFPOOL_PREFAULT},
+    {"huge",          BUFPOOL_LARGE_PAGES},
+    {"huge-prefault", BUFPOOL_LARGE_PAGES | BUFPOOL_PREFAULT},
+};
+
+#define MODE_COUNT (sizeof(modes) / sizeof(modes[0]))
+
+struct result
+{
+    const struct mode *mode;
+    int memory;               /* What bufpool actually got */
+    size_t page_size;
+    unsigned long long init_ns;
+    unsigned long long first_ns;
+    long first_faults;
+    unsigned long long steady_ns; /* All passes but the first */
+    unsigned long long probe_ns;
+    unsigned long long checksum;
+};
+
+struct bench
+{
+    unsigned int buffers;
+    unsigned int buffer_size;
+    unsigned int passes;
+    unsigned int probes;
+    const char *only;
+    int json;
+
+    unsigned char *source;
+    struct result results[MODE_COUNT];
+    unsigned int count;
+
+    unsigned long long errors;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long minor_faults(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -n, --buffers N        buffers in pool (default %d)\n"
+        "  -b, --bufferlen N      buffer size in bytes (default %d)\n"
+        "  -p, --passes N         copy passes over the pool (default %d)\n"
+        "  -r, --probes N         random reads across the pool (default %d)\n"
+        "  -m, --mode NAME        only malloc, prefault, huge or huge-prefault\n"
+        "      --json             print results as JSON\n",
+        argv0, DEFAULT_BUFFERS, DEFAULT_BUFFER_SIZE, DEFAULT_PASSES,
+        DEFAULT_PROBES);
+}
+
+/* Copies capture into every buffer like completed reads do */
+static void copy_pass(struct bench *bench, struct bufpool *pool)
+{
+    struct bufpool_buffer *buffer;
+    unsigned int i;
+
+    for (i = 0; i < bench->buffers; i++)
+    {
+        buffer = bufpool_get(pool, 0);
+        memcpy(buffer->data, bench->source, bench->buffer_size);
+        buffer->length = bench->buffer_size;
+        bufpool_submit(pool, buffer);
+    }
+
+    for (i = 0; i < bench->buffers; i++)
+    {
+        buffer = bufpool_next(pool, 0);
+        if ((buffer == NULL) || (buffer->length != bench->buffer_size) ||
+            (memcmp(&buffer->data[buffer->length - 64],
+                    &bench->source[bench->buffer_size - 64], 64) != 0))
+        {
+            bench->errors++;
+        }
+        if (buffer != NULL)
+        {
+            bufpool_release(pool, buffer);
+        }
+    }
+}
+
+/* Reads one byte at random offsets of random buffers */
+static unsigned long long probe(struct bench *bench, struct bufpool *pool)
+{
+    unsigned long long sum = 0;
+    unsigned int state = 12345;
+    unsigned int i;
+    struct bufpool_buffer *buffer;
+
+    for (i = 0; i < bench->probes; i++)
+    {
+        state = state * 1103515245 + 12345;
+        buffer = &pool->buffers[(state >> 8) % bench->buffers];
+        state = state * 1103515245 + 12345;
+        sum += buffer->data[((state >> 4) ^ (i << 12)) % bench->buffer_size];
+    }
+    return sum;
+}
+
+static void run(struct bench *bench, const struct mode *mode)
+{
+    struct result *r = &bench->results[bench->count++];
+    struct bufpool pool;
+    unsigned long long start;
+    unsigned int pass;
+    long faults;
+
+    memset(r, 0, sizeof(struct result));
+    r->mode = mode;
+
+    start = now_ns();
+    if (!bufpool_init_ex(&pool, bench->buffers, bench->buffer_size, mode->options))
+    {
+        fprintf(stderr, "Failed to allocate %s pool\n", mode->name);
+        bench->errors++;
+        return;
+    }
+    r->init_ns = now_ns() - start;
+    r->memory = pool.memory;
+    r->page_size = pool.page_size;
+
+    faults = minor_faults();
+    start = now_ns();
+    copy_pass(bench, &pool);
+    r->first_ns = now_ns() - start;
+    r->first_faults = minor_faults() - faults;
+
+    start = now_ns();
+    for (pass = 1; pass < bench->passes; pass++)
+    {
+        copy_pass(bench, &pool);
+    }
+    r->steady_ns = now_ns() - start;
+
+    start = now_ns();
+    r->checksum = probe(bench, &pool);
+    r->probe_ns = now_ns() - start;
+
+    bufpool_destroy(&pool);
+}
+
+static const char *memory_name(int memory)
+{
+    if (memory & BUFPOOL_LARGE_PAGES)
+    {
+        return (memory & BUFPOOL_LOCKED) ? "huge pages, locked" : "huge pages";
+    }
+    if (memory & BUFPOOL_PREFAULT)
+    {
+        return (memory & BUFPOOL_LOCKED) ? "pre-faulted, locked" : "pre-faulted";
+    }
+    return (memory & BUFPOOL_LOCKED) ? "locked" : "demand paged";
+}
+
+static double mb_per_s(unsigned long long bytes, unsigned long long ns)
+{
+    return ns ? (double)bytes * 1e3 / ns : 0.0;
+}
+
+static void print_results(struct bench *bench)
+{
+    unsigned long long pass_bytes = (unsigned long long)bench->buffers * bench->buffer_size;
+    unsigned int i;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"buffers\": %u,\n", bench->buffers);
+        printf("  \"bufferlen\": %u,\n", bench->buffer_size);
+        printf("  \"passes\": %u,\n", bench->passes);
+        printf("  \"modes\": [\n");
+        for (i = 0; i < bench->count; i++)
+        {
+            const struct result *r = &bench->results[i];
+
+            printf("    {\"mode\": \"%s\", \"memory\": \"%s\", \"page_size\": %zu, "
+                   "\"init_ms\": %.3f, \"first_pass_mb_s\": %.1f, "
+                   "\"first_pass_faults\": %ld, \"steady_mb_s\": %.1f, "
+                   "\"probe_ns\": %.2f}%s\n",
+                   r->mode->name, memory_name(r->memory), r->page_size,
+                   r->init_ns / 1e6, mb_per_s(pass_bytes, r->first_ns),
+                   r->first_faults,
+                   mb_per_s(pass_bytes * (bench->passes - 1), r->steady_ns),
+                   bench->probes ? (double)r->probe_ns / bench->probes : 0.0,
+                   (i + 1 < bench->count) ? "," : "");
+        }
+        printf("  ],\n");
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%u buffers of %u bytes, %u passes\n",
+               bench->buffers, bench->buffer_size, bench->passes);
+        printf("%-14s %-20s %8s %9s %10s %8s %10s %9s\n", "Mode", "Memory",
+               "Page kB", "Init ms", "1st MB/s", "Faults", "MB/s", "Probe ns");
+        for (i = 0; i < bench->count; i++)
+        {
+            const struct result *r = &bench->results[i];
+
+            printf("%-14s %-20s %8zu %9.2f %10.1f %8ld %10.1f %9.2f\n",
+                   r->mode->name, memory_name(r->memory), r->page_size / 1024,
+                   r->init_ns / 1e6, mb_per_s(pass_bytes, r->first_ns),
+                   r->first_faults,
+                   mb_per_s(pass_bytes * (bench->passes - 1), r->steady_ns),
+                   bench->probes ? (double)r->probe_ns / bench->probes : 0.0);
+        }
+        printf("Errors: %llu\n", bench->errors);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"buffers",   required_argument, NULL, 'n'},
+        {"bufferlen", required_argument, NULL, 'b'},
+        {"passes",    required_argument, NULL, 'p'},
+        {"probes",    required_argument, NULL, 'r'},
+        {"mode",      required_argument, NULL, 'm'},
+        {"json",      no_argument,       NULL, 'J'},
+        {"help",      no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench bench;
+    unsigned int i;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.buffers = DEFAULT_BUFFERS;
+    bench.buffer_size = DEFAULT_BUFFER_SIZE;
+    bench.passes = DEFAULT_PASSES;
+    bench.probes = DEFAULT_PROBES;
+
+    while ((c = getopt_long(argc, argv, "n:b:p:r:m:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                bench.buffers = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                bench.buffer_size = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                bench.passes = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench.probes = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                bench.only = optarg;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((bench.buffers == 0) || (bench.buffer_size < 64) || (bench.passes < 2))
+    {
+        fprintf(stderr, "Need at least one buffer of 64 bytes and two passes.\n");
+        return EXIT_FAILURE;
+    }
+
+    bench.source = malloc(bench.buffer_size);
+    if (bench.source == NULL)
+    {
+        fprintf(stderr, "Failed to allocate source buffer\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < bench.buffer_size; i++)
+    {
+        bench.source[i] = (unsigned char)(i * 7 + (i >> 12));
+    }
+
+    for (i = 0; i < MODE_COUNT; i++)
+    {
+        if ((bench.only == NULL) || (strcmp(bench.only, modes[i].name) == 0))
+        {
+            run(&bench, &modes[i]);
+        }
+    }
+    if (bench.count == 0)
+    {
+        fprintf(stderr, "Unknown mode %s\n", bench.only);
+        free(bench.source);
+        return EXIT_FAILURE;
+    }
+
+    print_results(&bench);
+    free(bench.source);
+    return (bench.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,822 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * DLT_USBPCAP reader benchmark.
+ *
+ * Generates a capture of bulk, interrupt, control and isochronous
+ * records (or takes an existing one) and reads it in several ways:
+ *   memory - sums every 64-bit word of the mapped file, the upper bound
+ *   cursor - walks records with pcap_cursor_next() and the typed views
+ *   scan   - the same and sums every payload byte too
+ *   stdio  - fread() of record header and data, parsed by hand
+ *   parallel - chunks parsed by pcap_scan_run() on --threads threads
+ * The file should fit in page cache so memory bandwidth is measured
+ * rather than the disk. Results of every reader are compared with each
+ * other and, for generated file, with what was written.
+ *
+ * With --corrupt the generated file gets damaged in given number of
+ * places and is only read by pcap_scan_run() with PCAP_SCAN_RESYNC, on
+ * one thread in one chunk (resync) and in parallel. Both have to skip
+ * the same bytes and find the same records.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capgen.h"
+#include "pcapscan.h"
+
+#define DEFAULT_SIZE_MB      2048
+#define DEFAULT_PASSES       3
+#define DEFAULT_FILE         "/tmp/readbench.pcap"
+#define ISO_PACKET_SIZE      192
+#define ISO_MAX_PACKETS      8
+#define STDIO_BUFFER_SIZE    (1024*1024)
+#define CORRUPT_LEN          64
+
+#define READ_MEMORY          0
+#define READ_CURSOR          1
+#define READ_SCAN            2
+#define READ_STDIO           3
+#define READ_PARALLEL        4
+#define READ_RESYNC          5 /* Serial, skipping damaged records */
+#define READ_PARALLEL_RESYNC 6
+
+struct stats
+{
+    unsigned long long records;
+    unsigned long long transfers[5];   /* USBPCAP_TRANSFER_xxx, 4 for others */
+    unsigned long long payload;
+    unsigned long long stages[4];      /* USBPCAP_CONTROL_STAGE_xxx */
+    unsigned long long iso_packets;
+    unsigned long long iso_length;
+    unsigned long long irp_sum;
+    unsigned long long last_timestamp;
+    unsigned long long checksum;       /* Payload bytes, scan only */
+};
+
+struct result
+{
+    const char *name;
+    unsigned long long best_ns;
+    struct stats stats;
+    unsigned long long skipped;
+    unsigned int resyncs;
+    unsigned int reparsed;
+};
+
+struct bench
+{
+    unsigned int size_mb;
+    unsigned int passes;
+    unsigned int threads;
+    unsigned int chunks;     /* 0 for 4 per thread */
+    unsigned int corrupt;
+    const char *input;
+    const char *output;
+    int swapped;
+    int nanosecond;
+    int populate;
+    int keep;
+    int json;
+
+    struct stats expected;
+    int generated;
+    unsigned long long file_size;
+    struct result results[5];
+    unsigned int count;
+
+    unsigned long long errors;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] [capture.pcap]\n"
+        "  -n, --size MB          size of generated capture (default %d)\n"
+        "  -p, --passes N         passes of every reader, best counts (default %d)\n"
+        "  -t, --threads N        parallel reader threads (default all CPUs)\n"
+        "  -c, --chunks N         parallel reader chunks (default 4 per thread)\n"
+        "      --corrupt N        damage generated capture in N places\n"
+        "  -o, --output FILE      generated capture (default %s)\n"
+        "      --swapped          generate capture of other byte order host\n"
+        "      --nanosecond       generate capture with nanosecond timestamps\n"
+        "      --populate         map file with MAP_POPULATE\n"
+        "      --keep             do not remove generated capture\n"
+        "      --json             print results as JSON\n",
+        argv0, DEFAULT_SIZE_MB, DEFAULT_PASSES, DEFAULT_FILE);
+}
+
+/* Writes record n of pseudo-random transfer type, counting it as expected */
+static void generate_record(struct bench *bench, struct capgen_file *g,
+                            unsigned char *payload, unsigned int *state,
+                            unsigned long long n)
+{
+    struct stats *e = &bench->expected;
+    unsigned long long timestamp = 1546300800ULL * 1000000000ULL + n * 12345ULL;
+    unsigned char extra[12 + ISO_MAX_PACKETS * sizeof(USBPCAP_BUFFER_ISO_PACKET)];
+    unsigned int length = 0;
+    struct capgen_urb urb;
+    unsigned int kind;
+    unsigned int i;
+
+    *state = *state * 1103515245 + 12345;
+    kind = (*state >> 8) % 20;
+    *state = *state * 1103515245 + 12345;
+
+    capgen_urb_init(&urb, 2 + (unsigned int)(n % 5), (n & 1) ? 0x81 : 0x02, 0);
+    urb.irp = 0xFFFFA00000000000ULL + ((n / 2) << 4);
+    urb.info = (unsigned int)(n & 1);
+    urb.extra = extra;
+
+    if (kind < 10)
+    {
+        urb.transfer = USBPCAP_TRANSFER_BULK;
+        length = (*state >> 8) % 1025;
+    }
+    else if (kind < 15)
+    {
+        urb.transfer = USBPCAP_TRANSFER_INTERRUPT;
+        length = 8;
+    }
+    else if (kind < 18)
+    {
+        unsigned int stage = (n & 1) ? USBPCAP_CONTROL_STAGE_COMPLETE : USBPCAP_CONTROL_STAGE_SETUP;
+
+        urb.transfer = USBPCAP_TRANSFER_CONTROL;
+        urb.extra_len = 1;
+        length = (stage == USBPCAP_CONTROL_STAGE_SETUP) ? 8 : (*state >> 8) % 65;
+        extra[0] = (unsigned char)stage;
+        e->stages[stage]++;
+    }
+    else
+    {
+        unsigned int packets = 1 + (*state >> 8) % ISO_MAX_PACKETS;
+
+        urb.transfer = USBPCAP_TRANSFER_ISOCHRONOUS;
+        urb.extra_len = 12 + packets * sizeof(USBPCAP_BUFFER_ISO_PACKET);
+        length = packets * ISO_PACKET_SIZE;
+        put32(&extra[0], (unsigned int)n);  /* startFrame */
+        put32(&extra[4], packets);
+        put32(&extra[8], 0);                /* errorCount */
+        for (i = 0; i < packets; i++)
+        {
+            unsigned char *packet = &extra[12 + i * sizeof(USBPCAP_BUFFER_ISO_PACKET)];
+
+            put32(&packet[0], i * ISO_PACKET_SIZE);
+            put32(&packet[4], ISO_PACKET_SIZE - i);
+            put32(&packet[8], 0);
+            e->iso_length += ISO_PACKET_SIZE - i;
+        }
+        e->iso_packets += packets;
+    }
+
+    for (i = 0; i < length; i++)
+    {
+        payload[i] = (unsigned char)(n + i * 7);
+    }
+    capgen_write(g, timestamp, &urb, payload, length);
+
+    e->records++;
+    e->transfers[urb.transfer]++;
+    e->payload += length;
+    e->irp_sum += urb.irp;
+    e->last_timestamp = bench->nanosecond ? timestamp : timestamp / 1000 * 1000;
+}
+
+static int generate(struct bench *bench)
+{
+    unsigned long long target = (unsigned long long)bench->size_mb * 1024 * 1024;
+    struct capgen_file g;
+    unsigned char *payload;
+    unsigned int state = 1;
+    unsigned long long n = 0;
+    int ok;
+
+    payload = malloc(CAPGEN_SNAPLEN);
+    if ((payload == NULL) ||
+        !capgen_create(&g, bench->output,
+                       (bench->swapped ? CAPGEN_SWAPPED : 0) |
+                       (bench->nanosecond ? CAPGEN_NANOSECOND : 0),
+                       STDIO_BUFFER_SIZE))
+    {
+        fprintf(stderr, "Failed to create %s\n", bench->output);
+        free(payload);
+        return 0;
+    }
+
+    memset(&bench->expected, 0, sizeof(struct stats));
+    while (!g.failed && (g.written < target))
+    {
+        generate_record(bench, &g, payload, &state, n++);
+    }
+
+    free(payload);
+    ok = capgen_close(&g);
+    if (!ok || (g.written < target))
+    {
+        fprintf(stderr, "Failed to write %s\n", bench->output);
+        return 0;
+    }
+    bench->generated = 1;
+    return 1;
+}
+
+/* Overwrites CORRUPT_LEN bytes at pseudo-random places with 0xFF */
+static int corrupt(struct bench *bench)
+{
+    unsigned char garbage[CORRUPT_LEN];
+    unsigned long long offset;
+    unsigned long long size;
+    unsigned int state = 777;
+    unsigned int i;
+    FILE *f;
+
+    f = fopen(bench->output, "r+b");
+    if ((f == NULL) || (fseeko(f, 0, SEEK_END) != 0))
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", bench->output);
+        if (f != NULL)
+        {
+            fclose(f);
+        }
+        return 0;
+    }
+    size = (unsigned long long)ftello(f);
+
+    memset(garbage, 0xFF, sizeof(garbage));
+    for (i = 0; i < bench->corrupt; i++)
+    {
+        state = state * 1103515245 + 12345;
+        offset = ((unsigned long long)state << 16) ^ (state >> 8);
+        offset = PCAP_FILE_HEADER_LEN + offset % (size - PCAP_FILE_HEADER_LEN - CORRUPT_LEN);
+        if ((fseeko(f, (off_t)offset, SEEK_SET) != 0) ||
+            (fwrite(garbage, 1, sizeof(garbage), f) != sizeof(garbage)))
+        {
+            break;
+        }
+    }
+
+    if ((fclose(f) != 0) || (i < bench->corrupt))
+    {
+        fprintf(stderr, "Failed to damage %s\n", bench->output);
+        return 0;
+    }
+    return 1;
+}
+
+static void count_record(struct stats *s, const struct pcap_record *record)
+{
+    const USBPCAP_BUFFER_CONTROL_HEADER *control;
+    const USBPCAP_BUFFER_ISOCH_HEADER *isoch;
+    UCHAR transfer = record->usb->transfer;
+    ULONG packets;
+    ULONG i;
+
+    s->records++;
+    s->transfers[(transfer <= USBPCAP_TRANSFER_BULK) ? transfer : 4]++;
+    s->payload += record->payload_len;
+    s->irp_sum += pcap_le64(&record->usb->irpId);
+    s->last_timestamp = record->timestamp;
+
+    control = pcap_record_control(record);
+    if (control != NULL)
+    {
+        s->stages[control->stage & 3]++;
+    }
+
+    isoch = pcap_record_isoch(record, &packets);
+    if (isoch != NULL)
+    {
+        s->iso_packets += packets;
+        for (i = 0; i < packets; i++)
+        {
+            s->iso_length += pcap_le32(&isoch->packet[i].length);
+        }
+    }
+}
+
+static unsigned long long sum_bytes(const unsigned char *p, size_t length)
+{
+    unsigned long long sum = 0;
+    unsigned long long word;
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8)
+    {
+        memcpy(&word, &p[i], 8);
+        sum += word;
+    }
+    for (; i < length; i++)
+    {
+        sum += p[i];
+    }
+    return sum;
+}
+
+static int run_memory(const struct pcap_file *file, struct stats *s)
+{
+    s->checksum = sum_bytes(file->data, (size_t)file->size);
+    return 1;
+}
+
+static int run_cursor(const struct pcap_file *file, struct stats *s, int scan)
+{
+    struct pcap_cursor cursor;
+    struct pcap_record record;
+
+    pcap_cursor_init(&cursor, file);
+    while (pcap_cursor_next(&cursor, &record))
+    {
+        count_record(s, &record);
+        if (scan)
+        {
+            s->checksum += sum_bytes(record.payload, record.payload_len);
+        }
+    }
+    if (cursor.error != PCAP_FILE_OK)
+    {
+        fprintf(stderr, "Record at %llu: %s\n", cursor.offset,
+                pcap_file_strerror(cursor.error));
+        return 0;
+    }
+    return 1;
+}
+
+static void scan_record(void *context, const struct pcap_record *record)
+{
+    count_record((struct stats *)context, record);
+}
+
+static void scan_reset(void *context)
+{
+    memset(context, 0, sizeof(struct stats));
+}
+
+static int run_parallel(const struct pcap_file *file, struct result *r,
+                        unsigned int threads, unsigned int chunks, int flags)
+{
+    struct pcap_scan scan;
+    struct stats *stats;
+    unsigned int i, j;
+    int error;
+
+    if (!pcap_scan_init(&scan, file, chunks, flags, scan_record, scan_reset))
+    {
+        return 0;
+    }
+    stats = calloc(scan.count, sizeof(struct stats));
+    if (stats == NULL)
+    {
+        pcap_scan_destroy(&scan);
+        return 0;
+    }
+    for (i = 0; i < scan.count; i++)
+    {
+        scan.chunks[i].context = &stats[i];
+    }
+
+    error = pcap_scan_run(&scan, threads);
+    if ((error != PCAP_FILE_OK) && !(flags & PCAP_SCAN_RESYNC))
+    {
+        fprintf(stderr, "Record at %llu: %s\n", scan.error_offset,
+                pcap_file_strerror(error));
+    }
+
+    r->skipped = 0;
+    r->resyncs = 0;
+    r->reparsed = scan.reparsed;
+    for (i = 0; i < scan.count; i++)
+    {
+        struct stats *s = &stats[i];
+
+        r->stats.records += s->records;
+        for (j = 0; j < 5; j++)
+        {
+            r->stats.transfers[j] += s->transfers[j];
+        }
+        r->stats.payload += s->payload;
+        for (j = 0; j < 4; j++)
+        {
+            r->stats.stages[j] += s->stages[j];
+        }
+        r->stats.iso_packets += s->iso_packets;
+        r->stats.iso_length += s->iso_length;
+        r->stats.irp_sum += s->irp_sum;
+        if (s->records != 0)
+        {
+            r->stats.last_timestamp = s->last_timestamp;
+        }
+        r->skipped += scan.chunks[i].skipped;
+        r->resyncs += scan.chunks[i].resyncs;
+    }
+
+    free(stats);
+    pcap_scan_destroy(&scan);
+    return (error == PCAP_FILE_OK) || (flags & PCAP_SCAN_RESYNC);
+}
+
+/* The way tools parsed captures before, one fread() per header and data */
+static int run_stdio(struct bench *bench, const struct pcap_file *file,
+                     struct stats *s)
+{
+    const char *path = bench->input ? bench->input : bench->output;
+    unsigned char header[PCAP_FILE_HEADER_LEN];
+    unsigned char *data;
+    unsigned int hdr[4];
+    unsigned int i;
+    FILE *f;
+    int ok = 1;
+
+    f = fopen(path, "rb");
+    data = malloc(CAPGEN_SNAPLEN + 1);
+    if ((f == NULL) || (data == NULL) || (fread(header, 1, sizeof(header), f) != sizeof(header)))
+    {
+        if (f != NULL)
+        {
+            fclose(f);
+        }
+        free(data);
+        return 0;
+    }
+    setvbuf(f, NULL, _IOFBF, STDIO_BUFFER_SIZE);
+
+    while (fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr))
+    {
+        USBPCAP_BUFFER_PACKET_HEADER usb;
+        struct pcap_record record;
+
+        if (file->swapped)
+        {
+            for (i = 0; i < 4; i++)
+            {
+                hdr[i] = pcap_swap32(hdr[i]);
+            }
+        }
+        if ((hdr[2] > CAPGEN_SNAPLEN) || (hdr[2] < sizeof(usb)) ||
+            (fread(data, 1, hdr[2], f) != hdr[2]))
+        {
+            ok = 0;
+            break;
+        }
+        memcpy(&usb, data, sizeof(usb));
+        if ((usb.headerLen < sizeof(usb)) || (usb.headerLen > hdr[2]))
+        {
+            ok = 0;
+            break;
+        }
+
+        /* Reuse the counting so only the way of reading differs */
+        record.timestamp = (unsigned long long)hdr[0] * 1000000000ULL +
+                           (file->nanosecond ? hdr[1] : hdr[1] * 1000ULL);
+        record.incl_len = hdr[2];
+        record.orig_len = hdr[3];
+        record.data = data;
+        record.usb = (const USBPCAP_BUFFER_PACKET_HEADER *)data;
+        record.header_len = usb.headerLen;
+        record.payload = &data[usb.headerLen];
+        record.payload_len = hdr[2] - usb.headerLen;
+        count_record(s, &record);
+    }
+
+    fclose(f);
+    free(data);
+    return ok;
+}
+
+static void run(struct bench *bench, const struct pcap_file *file,
+                const char *name, int method)
+{
+    struct result *r = &bench->results[bench->count++];
+    unsigned long long start, elapsed;
+    unsigned int pass;
+    int ok = 0;
+
+    r->name = name;
+    r->best_ns = 0;
+    for (pass = 0; pass < bench->passes; pass++)
+    {
+        memset(&r->stats, 0, sizeof(struct stats));
+        start = now_ns();
+        switch (method)
+        {
+            case READ_MEMORY:
+                ok = run_memory(file, &r->stats);
+                break;
+            case READ_CURSOR:
+                ok = run_cursor(file, &r->stats, 0);
+                break;
+            case READ_SCAN:
+                ok = run_cursor(file, &r->stats, 1);
+                break;
+            case READ_STDIO:
+                ok = run_stdio(bench, file, &r->stats);
+                break;
+            case READ_PARALLEL:
+                ok = run_parallel(file, r, bench->threads, bench->chunks, 0);
+                break;
+            case READ_RESYNC:
+                ok = run_parallel(file, r, 1, 1, PCAP_SCAN_RESYNC);
+                break;
+            default:
+                ok = run_parallel(file, r, bench->threads, bench->chunks,
+                                  PCAP_SCAN_RESYNC);
+                break;
+        }
+        elapsed = now_ns() - start;
+        if (!ok)
+        {
+            fprintf(stderr, "%s reader failed\n", name);
+            bench->errors++;
+            return;
+        }
+        if ((r->best_ns == 0) || (elapsed < r->best_ns))
+        {
+            r->best_ns = elapsed;
+        }
+    }
+}
+
+static int same_records(const struct stats *a, const struct stats *b)
+{
+    return (a->records == b->records) &&
+           (memcmp(a->transfers, b->transfers, sizeof(a->transfers)) == 0) &&
+           (a->payload == b->payload) &&
+           (memcmp(a->stages, b->stages, sizeof(a->stages)) == 0) &&
+           (a->iso_packets == b->iso_packets) &&
+           (a->iso_length == b->iso_length) &&
+           (a->irp_sum == b->irp_sum) &&
+           (a->last_timestamp == b->last_timestamp);
+}
+
+static void check(struct bench *bench)
+{
+    const struct stats *reference;
+    unsigned int i;
+
+    /* results[0] is memory, the rest are record readers */
+    reference = (bench->generated && !bench->corrupt) ?
+                &bench->expected : &bench->results[1].stats;
+    for (i = 1; i < bench->count; i++)
+    {
+        if (!same_records(reference, &bench->results[i].stats) ||
+            (bench->results[i].skipped != bench->results[1].skipped))
+        {
+            fprintf(stderr, "%s reader counted different records\n",
+                    bench->results[i].name);
+            bench->errors++;
+        }
+        if ((strcmp(bench->results[i].name, "scan") == 0) &&
+            (bench->results[i].stats.checksum == 0))
+        {
+            fprintf(stderr, "scan reader did not touch payload\n");
+            bench->errors++;
+        }
+    }
+    if (bench->corrupt && (bench->results[1].skipped == 0))
+    {
+        fprintf(stderr, "Damaged records were not skipped\n");
+        bench->errors++;
+    }
+}
+
+static double gb_per_s(unsigned long long bytes, unsigned long long ns)
+{
+    return ns ? (double)bytes / ns : 0.0;
+}
+
+static void print_results(struct bench *bench)
+{
+    double memory = gb_per_s(bench->file_size, bench->results[0].best_ns);
+    const struct stats *s = &bench->results[1].stats;
+    unsigned int i;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"file_size\": %llu,\n", bench->file_size);
+        printf("  \"records\": %llu,\n", s->records);
+        printf("  \"swapped\": %s,\n", bench->swapped ? "true" : "false");
+        printf("  \"nanosecond\": %s,\n", bench->nanosecond ? "true" : "false");
+        printf("  \"threads\": %u,\n", bench->threads);
+        printf("  \"readers\": [\n");
+        for (i = 0; i < bench->count; i++)
+        {
+            const struct result *r = &bench->results[i];
+            double rate = gb_per_s(bench->file_size, r->best_ns);
+
+            printf("    {\"reader\": \"%s\", \"ms\": %.1f, \"gb_s\": %.2f, "
+                   "\"mrecords_s\": %.1f, \"of_memory\": %.3f, "
+                   "\"skipped\": %llu, \"resyncs\": %u, \"reparsed\": %u}%s\n",
+                   r->name, r->best_ns / 1e6, rate,
+                   r->best_ns ? s->records * 1e3 / r->best_ns : 0.0,
+                   memory ? rate / memory : 0.0,
+                   r->skipped, r->resyncs, r->reparsed,
+                   (i + 1 < bench->count) ? "," : "");
+        }
+        printf("  ],\n");
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%llu bytes, %llu records (%llu isochronous, %llu interrupt, "
+               "%llu control, %llu bulk)\n", bench->file_size, s->records,
+               s->transfers[USBPCAP_TRANSFER_ISOCHRONOUS],
+               s->transfers[USBPCAP_TRANSFER_INTERRUPT],
+               s->transfers[USBPCAP_TRANSFER_CONTROL],
+               s->transfers[USBPCAP_TRANSFER_BULK]);
+        printf("%-8s %10s %8s %12s %10s\n", "Reader", "ms", "GB/s", "Mrecords/s", "of memory");
+        for (i = 0; i < bench->count; i++)
+        {
+            const struct result *r = &bench->results[i];
+            double rate = gb_per_s(bench->file_size, r->best_ns);
+
+            printf("%-8s %10.1f %8.2f %12.1f %9.0f%%\n", r->name,
+                   r->best_ns / 1e6, rate,
+                   r->best_ns ? s->records * 1e3 / r->best_ns : 0.0,
+                   memory ? rate * 100 / memory : 0.0);
+        }
+        for (i = 0; i < bench->count; i++)
+        {
+            const struct result *r = &bench->results[i];
+
+            if (strncmp(r->name, "parallel", 8) == 0)
+            {
+                printf("%s: %u threads, %u chunks parsed again\n",
+                       r->name, bench->threads, r->reparsed);
+            }
+            if (r->resyncs != 0)
+            {
+                printf("%s: %llu bytes skipped in %u places\n",
+                       r->name, r->skipped, r->resyncs);
+            }
+        }
+        printf("Errors: %llu\n", bench->errors);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"size",       required_argument, NULL, 'n'},
+        {"passes",     required_argument, NULL, 'p'},
+        {"threads",    required_argument, NULL, 't'},
+        {"chunks",     required_argument, NULL, 'c'},
+        {"corrupt",    required_argument, NULL, 'C'},
+        {"output",     required_argument, NULL, 'o'},
+        {"swapped",    no_argument,       NULL, 'S'},
+        {"nanosecond", no_argument,       NULL, 'N'},
+        {"populate",   no_argument,       NULL, 'P'},
+        {"keep",       no_argument,       NULL, 'K'},
+        {"json",       no_argument,       NULL, 'J'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench bench;
+    struct pcap_file file;
+    int flags = PCAP_FILE_SEQUENTIAL;
+    int error;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.size_mb = DEFAULT_SIZE_MB;
+    bench.passes = DEFAULT_PASSES;
+    bench.output = DEFAULT_FILE;
+    bench.threads = pcap_scan_cpus();
+
+    while ((c = getopt_long(argc, argv, "n:p:t:c:o:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                bench.size_mb = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                bench.passes = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                bench.threads = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                bench.chunks = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                bench.corrupt = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                bench.output = optarg;
+                break;
+            case 'S':
+                bench.swapped = 1;
+                break;
+            case 'N':
+                bench.nanosecond = 1;
+                break;
+            case 'P':
+                bench.populate = 1;
+                break;
+            case 'K':
+                bench.keep = 1;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc)
+    {
+        bench.input = argv[optind];
+    }
+
+    if ((bench.passes == 0) || (bench.threads == 0) ||
+        ((bench.input == NULL) && (bench.size_mb == 0)))
+    {
+        fprintf(stderr, "Need at least one pass on one thread over at least 1 MB.\n");
+        return EXIT_FAILURE;
+    }
+    if (bench.corrupt && (bench.input != NULL))
+    {
+        fprintf(stderr, "Only generated capture can be damaged.\n");
+        return EXIT_FAILURE;
+    }
+    if (bench.chunks == 0)
+    {
+        bench.chunks = bench.threads * 4;
+    }
+
+    if ((bench.input == NULL) && (!generate(&bench) || (bench.corrupt && !corrupt(&bench))))
+    {
+        remove(bench.output);
+        return EXIT_FAILURE;
+    }
+
+    if (bench.populate)
+    {
+        flags |= PCAP_FILE_POPULATE;
+    }
+    error = pcap_file_open(&file, bench.input ? bench.input : bench.output, flags);
+    if (error != PCAP_FILE_OK)
+    {
+        fprintf(stderr, "Failed to open capture: %s\n", pcap_file_strerror(error));
+        if ((bench.input == NULL) && !bench.keep)
+        {
+            remove(bench.output);
+        }
+        return EXIT_FAILURE;
+    }
+    bench.file_size = file.size;
+    bench.swapped = file.swapped;
+    bench.nanosecond = file.nanosecond;
+
+    run(&bench, &file, "memory", READ_MEMORY);
+    if (bench.corrupt)
+    {
+        run(&bench, &file, "resync", READ_RESYNC);
+        run(&bench, &file, "parallel", READ_PARALLEL_RESYNC);
+    }
+    else
+    {
+        run(&bench, &file, "cursor", READ_CURSOR);
+        run(&bench, &file, "scan", READ_SCAN);
+        run(&bench, &file, "stdio", READ_STDIO);
+        run(&bench, &file, "parallel", READ_PARALLEL);
+    }
+    if (bench.errors == 0)
+    {
+        check(&bench);
+    }
+
+    pcap_file_close(&file);
+    if ((bench.input == NULL) && !bench.keep)
+    {
+        remove(bench.output);
+    }
+
+    print_results(&bench);
+    return (bench.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1722 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Capture replay.
+ *
+ * Reconstructs the URBs recorded in a USBPcap capture file and passes
+ * them through USBPcapAnalyzeURB() on a simulated root hub, in the order
+ * the packets appear in the file. Reader thread drains the capture
+ * buffer and compares every produced packet with the original one.
+ *
+ * Produced capture is expected to be identical to the original one
+ * apart from the timestamps. IRP IDs in the produced capture are the
+ * addresses of IRPs allocated by replay, so these are translated back
+ * to the original values before the comparison.
+ *
+ * Only packets from single root hub (the one of first packet in file)
+ * are replayed.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "USBPcapMain.h"
+#include "USBPcapURB.h"
+#include "USBPcapTables.h"
+#include "HostCapture.h"
+#include "HostWdm.h"
+
+#define DEFAULT_BUFFER_SIZE      (16*1024*1024)
+#define DEFAULT_READ_SIZE        (1024*1024)
+#define MAX_DEVICES              128
+#define MAX_ISO_PACKETS          1024
+#define MAX_REPORTED_MISMATCHES  10
+
+/* Reader wakes up this often to check if the replay has ended */
+#define READER_POLL_INTERVAL_MS  50
+
+/* Replay waits for the reader when the buffer is more than half full */
+#define BACKPRESSURE_SLEEP_NS    50000
+
+/* Index of the pipe handle for given endpoint address */
+#define PIPE_INDEX(endpoint)     ((((endpoint) & 0x80) >> 3) | ((endpoint) & 0x0F))
+#define PIPE_SLOTS               32
+#define PIPE_TYPES               4
+
+struct record
+{
+    const pcaprec_hdr_t                 *pcap;
+    const USBPCAP_BUFFER_PACKET_HEADER  *header;
+    UINT32                               irp;   /* index to irps */
+    BOOLEAN                              skip;
+};
+
+struct replay_irp
+{
+    UINT64   originalId;
+    PIRP     irp;
+    /* Setup packet of last control transfer submitted with this IRP */
+    UCHAR    setup[8];
+    BOOLEAN  hasSetup;
+};
+
+struct replay_device
+{
+    PUSBPCAP_DEVICE_DATA  data;
+    /* Addresses of these bytes serve as pipe handles */
+    UCHAR                 pipes[PIPE_SLOTS][PIPE_TYPES];
+    BOOLEAN               registered[PIPE_SLOTS][PIPE_TYPES];
+    /* Last complete configuration descriptor returned by the device */
+    PUCHAR                config;
+    USHORT                configLength;
+    /* Descriptor passed in URB_FUNCTION_SELECT_CONFIGURATION */
+    PUCHAR                selected;
+};
+
+/* Open addressing hash map from 64-bit ID to index */
+struct id_map
+{
+    UINT64  *keys;
+    UINT32  *values;    /* 0 marks empty slot, otherwise index + 1 */
+    UINT32   mask;
+    UINT32   count;
+};
+
+/* Packet being replayed */
+struct packet
+{
+    const USBPCAP_BUFFER_PACKET_HEADER  *header;
+    BOOLEAN                              post;
+    PUCHAR                               data;  /* zero-filled if truncated */
+    UINT32                               dataLength;
+    struct replay_irp                   *irp;
+    struct replay_device                *device;
+};
+
+struct replay
+{
+    const char            *inputName;
+    const char            *outputName;
+    UINT32                 bufferSize;
+    UINT32                 readSize;
+    UINT64                 loops;
+    BOOLEAN                fast;
+    BOOLEAN                json;
+
+    PUCHAR                 file;
+    size_t                 fileSize;
+    pcap_hdr_t             globalHeader;
+    struct record         *records;
+    UINT32                 numRecords;
+    UINT32                *expected;    /* indices of records to replay */
+    UINT32                 numExpected;
+    USHORT                 bus;
+
+    struct replay_irp     *irps;
+    UINT32                 numIrps;
+    struct id_map          byOriginalId;
+    struct id_map          byHostId;
+
+    BOOLEAN                devicePresent[MAX_DEVICES];
+    struct replay_device  *devices[MAX_DEVICES];
+    /* Address of this byte is never registered in endpoint table */
+    UCHAR                  unknownPipe;
+
+    PHOST_ROOT_HUB         rootHub;
+    PURB                   urb;
+    PUCHAR                 scratch;
+    UINT32                 scratchSize;
+
+    volatile int           running;
+    UINT64                 startNs;
+    UINT64                 endNs;
+    UINT64                 sleptNs;
+    UINT64                 calls;
+
+    /* Reader state */
+    FILE                  *output;
+    PUCHAR                 packet;
+    UINT32                 packetSize;
+    UINT32                 fill;
+    UINT32                 need;
+    BOOLEAN                globalHeaderDone;
+    BOOLEAN                inRecordHeader;
+    UINT64                 produced;
+    UINT64                 mismatches;
+    UINT64                 readBytes;
+    UINT64                 reads;
+};
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] FILE\n"
+        "  -f, --fast           replay as fast as possible instead of\n"
+        "                       preserving original packet timing\n"
+        "  -n, --loops N        replay the capture N times (default 1)\n"
+        "  -o, --output FILE    write replayed capture to FILE\n"
+        "  -b, --bufferlen N    capture buffer size in bytes (default %d)\n"
+        "  -r, --readlen N      read request size in bytes (default %d)\n"
+        "      --json           print results as JSON\n",
+        argv0, DEFAULT_BUFFER_SIZE, DEFAULT_READ_SIZE);
+}
+
+static UINT32 id_map_hash(UINT64 key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    return (UINT32)key;
+}
+
+static BOOLEAN id_map_find(const struct id_map *map, UINT64 key,
+                           UINT32 *value)
+{
+    UINT32 i;
+
+    if (map->values == NULL)
+    {
+        return FALSE;
+    }
+
+    i = id_map_hash(key) & map->mask;
+    while (map->values[i] != 0)
+    {
+        if (map->keys[i] == key)
+        {
+            *value = map->values[i] - 1;
+            return TRUE;
+        }
+        i = (i + 1) & map->mask;
+    }
+
+    return FALSE;
+}
+
+static BOOLEAN id_map_insert(struct id_map *map, UINT64 key, UINT32 value)
+{
+    UINT32 i;
+
+    if (map->values == NULL || (map->count + 1) * 2 > map->mask + 1)
+    {
+        struct id_map  grown;
+        UINT32         capacity;
+
+        capacity = (map->values == NULL) ? 256 : (map->mask + 1) * 2;
+        grown.keys = calloc(capacity, sizeof(UINT64));
+        grown.values = calloc(capacity, sizeof(UINT32));
+        grown.mask = capacity - 1;
+        grown.count = 0;
+        if (grown.keys == NULL || grown.values == NULL)
+        {
+            free(grown.keys);
+            free(grown.values);
+            return FALSE;
+        }
+
+        if (map->values != NULL)
+        {
+            for (i = 0; i <= map->mask; i++)
+            {
+                if (map->values[i] != 0)
+                {
+                    id_map_insert(&grown, map->keys[i], map->values[i] - 1);
+                }
+            }
+            free(map->keys);
+            free(map->values);
+        }
+        *map = grown;
+    }
+
+    i = id_map_hash(key) & map->mask;
+    while (map->values[i] != 0)
+    {
+        i = (i + 1) & map->mask;
+    }
+    map->keys[i] = key;
+    map->values[i] = value + 1;
+    map->count++;
+    return TRUE;
+}
+
+static void id_map_free(struct id_map *map)
+{
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(struct id_map));
+}
+
+static void sleep_until(UINT64 deadlineNs)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(deadlineNs / 1000000000ULL);
+    ts.tv_nsec = (long)(deadlineNs % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+static BOOLEAN is_known_function(USHORT function)
+{
+    switch (function)
+    {
+        case URB_FUNCTION_SELECT_CONFIGURATION:
+        case URB_FUNCTION_SELECT_INTERFACE:
+        case URB_FUNCTION_CONTROL_TRANSFER:
+        case URB_FUNCTION_CONTROL_TRANSFER_EX:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE:
+        case URB_FUNCTION_GET_STATUS_FROM_DEVICE:
+        case URB_FUNCTION_GET_STATUS_FROM_INTERFACE:
+        case URB_FUNCTION_GET_STATUS_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_STATUS_FROM_OTHER:
+        case URB_FUNCTION_VENDOR_DEVICE:
+        case URB_FUNCTION_VENDOR_INTERFACE:
+        case URB_FUNCTION_VENDOR_ENDPOINT:
+        case URB_FUNCTION_VENDOR_OTHER:
+        case URB_FUNCTION_CLASS_DEVICE:
+        case URB_FUNCTION_CLASS_INTERFACE:
+        case URB_FUNCTION_CLASS_ENDPOINT:
+        case URB_FUNCTION_CLASS_OTHER:
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+        case URB_FUNCTION_ISOCH_TRANSFER:
+        case URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL:
+        case URB_FUNCTION_SYNC_RESET_PIPE:
+        case URB_FUNCTION_SYNC_CLEAR_STALL:
+        case URB_FUNCTION_ABORT_PIPE:
+        case URB_FUNCTION_CLOSE_STATIC_STREAMS:
+        case URB_FUNCTION_GET_CURRENT_FRAME_NUMBER:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+/*
+ * Checks if the packet could have been written by the driver.
+ * Packets that fail the check cannot be reconstructed.
+ */
+static BOOLEAN is_replayable(const struct record *rec)
+{
+    const USBPCAP_BUFFER_PACKET_HEADER  *header = rec->header;
+    UINT32                               inclLen = rec->pcap->incl_len;
+    UINT32                               expectedLen;
+
+    if (inclLen < sizeof(USBPCAP_BUFFER_PACKET_HEADER) ||
+        header->headerLen < sizeof(USBPCAP_BUFFER_PACKET_HEADER) ||
+        inclLen < header->headerLen)
+    {
+        return FALSE;
+    }
+
+    if ((UINT64)header->headerLen + header->dataLength != rec->pcap->orig_len)
+    {
+        return FALSE;
+    }
+
+    if (header->function == URB_FUNCTION_ISOCH_TRANSFER)
+    {
+        const USBPCAP_BUFFER_ISOCH_HEADER *isoch;
+
+        if (header->headerLen < sizeof(USBPCAP_BUFFER_ISOCH_HEADER))
+        {
+            return FALSE;
+        }
+
+        isoch = (const USBPCAP_BUFFER_ISOCH_HEADER *)header;
+        if (isoch->numberOfPackets == 0 ||
+            isoch->numberOfPackets > MAX_ISO_PACKETS)
+        {
+            return FALSE;
+        }
+
+        expectedLen = sizeof(USBPCAP_BUFFER_ISOCH_HEADER) +
+                      sizeof(USBPCAP_BUFFER_ISO_PACKET) * (isoch->numberOfPackets - 1);
+        return (header->headerLen == expectedLen) ? TRUE : FALSE;
+    }
+
+    if (header->transfer == USBPCAP_TRANSFER_CONTROL &&
+        is_known_function(header->function))
+    {
+        if (header->headerLen != sizeof(USBPCAP_BUFFER_CONTROL_HEADER))
+        {
+            return FALSE;
+        }
+
+        /* Setup stage always begins with the 8 byte setup packet */
+        if (!(header->info & USBPCAP_INFO_PDO_TO_FDO) && header->dataLength < 8)
+        {
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    return (header->headerLen == sizeof(USBPCAP_BUFFER_PACKET_HEADER)) ? TRUE : FALSE;
+}
+
+static BOOLEAN add_irp(struct replay *r, UINT64 originalId, UINT32 *index)
+{
+    struct replay_irp *irps;
+
+    if (id_map_find(&r->byOriginalId, originalId, index))
+    {
+        return TRUE;
+    }
+
+    irps = realloc(r->irps, (r->numIrps + 1) * sizeof(struct replay_irp));
+    if (irps == NULL)
+    {
+        return FALSE;
+    }
+    r->irps = irps;
+
+    memset(&irps[r->numIrps], 0, sizeof(struct replay_irp));
+    irps[r->numIrps].originalId = originalId;
+    irps[r->numIrps].irp = IoAllocateIrp(1, FALSE);
+    if (irps[r->numIrps].irp == NULL)
+    {
+        return FALSE;
+    }
+
+    *index = r->numIrps++;
+    return id_map_insert(&r->byOriginalId, originalId, *index) &&
+           id_map_insert(&r->byHostId, (UINT64)(ULONG_PTR)irps[*index].irp, *index);
+}
+
+static BOOLEAN load_capture(struct replay *r)
+{
+    FILE    *f;
+    long     size;
+    size_t   offset;
+    UINT32   capacity = 0;
+    UINT32   skipped = 0;
+    BOOLEAN  busSet = FALSE;
+
+    f = fopen(r->inputName, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", r->inputName, strerror(errno));
+        return FALSE;
+    }
+
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+        fseek(f, 0, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "Failed to determine size of %s\n", r->inputName);
+        fclose(f);
+        return FALSE;
+    }
+
+    r->fileSize = (size_t)size;
+    r->file = malloc(r->fileSize + 1);
+    if (r->file == NULL ||
+        fread(r->file, 1, r->fileSize, f) != r->fileSize)
+    {
+        fprintf(stderr, "Failed to read %s\n", r->inputName);
+        fclose(f);
+        return FALSE;
+    }
+    fclose(f);
+
+    if (r->fileSize < sizeof(pcap_hdr_t))
+    {
+        fprintf(stderr, "%s is not a pcap file\n", r->inputName);
+        return FALSE;
+    }
+
+    memcpy(&r->globalHeader, r->file, sizeof(pcap_hdr_t));
+    if (r->globalHeader.magic_number != 0xA1B2C3D4)
+    {
+        /* USBPcap always writes native (little endian) microsecond pcap */
+        fprintf(stderr, "%s was not written by USBPcap\n", r->inputName);
+        return FALSE;
+    }
+
+    if (r->globalHeader.network != DLT_USBPCAP)
+    {
+        fprintf(stderr, "%s link type is %u, expected DLT_USBPCAP\n",
+                r->inputName, r->globalHeader.network);
+        return FALSE;
+    }
+
+    offset = sizeof(pcap_hdr_t);
+    while (offset + sizeof(pcaprec_hdr_t) <= r->fileSize)
+    {
+        const pcaprec_hdr_t  *pcap = (const pcaprec_hdr_t *)&r->file[offset];
+        struct record        *rec;
+
+        if (pcap->incl_len > r->fileSize - offset - sizeof(pcaprec_hdr_t))
+        {
+            fprintf(stderr, "Last packet is truncated, ignoring it.\n");
+            break;
+        }
+
+        if (r->numRecords == capacity)
+        {
+            struct record *records;
+
+            capacity = (capacity == 0) ? 4096 : capacity * 2;
+            records = realloc(r->records, capacity * sizeof(struct record));
+            if (records == NULL)
+            {
+                return FALSE;
+            }
+            r->records = records;
+        }
+
+        rec = &r->records[r->numRecords++];
+        rec->pcap = pcap;
+        rec->header = (const USBPCAP_BUFFER_PACKET_HEADER *)&pcap[1];
+        rec->irp = 0;
+        rec->skip = !is_replayable(rec);
+        offset += sizeof(pcaprec_hdr_t) + pcap->incl_len;
+
+        if (rec->skip)
+        {
+            skipped++;
+            continue;
+        }
+
+        if (!busSet)
+        {
+            r->bus = rec->header->bus;
+            busSet = TRUE;
+        }
+
+        if (rec->header->bus != r->bus || rec->header->device >= MAX_DEVICES)
+        {
+            rec->skip = TRUE;
+            skipped++;
+            continue;
+        }
+
+        r->devicePresent[rec->header->device] = TRUE;
+        if (!add_irp(r, rec->header->irpId, &rec->irp))
+        {
+            fprintf(stderr, "Failed to allocate IRP.\n");
+            return FALSE;
+        }
+    }
+
+    if (skipped != 0)
+    {
+        fprintf(stderr, "Skipping %u packet(s) that cannot be replayed "
+                "or are not from bus %u.\n", skipped, r->bus);
+    }
+
+    r->expected = malloc((r->numRecords + 1) * sizeof(UINT32));
+    if (r->expected == NULL)
+    {
+        return FALSE;
+    }
+
+    for (offset = 0; offset < r->numRecords; offset++)
+    {
+        if (!r->records[offset].skip)
+        {
+            r->expected[r->numExpected++] = (UINT32)offset;
+        }
+    }
+
+    if (r->numExpected == 0)
+    {
+        fprintf(stderr, "%s contains no packets to replay.\n", r->inputName);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN setup_devices(struct replay *r)
+{
+    int i;
+
+    for (i = 0; i < MAX_DEVICES; i++)
+    {
+        if (!r->devicePresent[i])
+        {
+            continue;
+        }
+
+        r->devices[i] = calloc(1, sizeof(struct replay_device));
+        if (r->devices[i] == NULL ||
+            !NT_SUCCESS(HostCreateDevice(r->rootHub, (USHORT)i,
+                                         &r->devices[i]->data)))
+        {
+            return FALSE;
+        }
+    }
+
+    /* Large enough for every URB, including isochronous ones */
+    r->urb = calloc(1, sizeof(struct _URB_ISOCH_TRANSFER) +
+                       (MAX_ISO_PACKETS - 1) * sizeof(USBD_ISO_PACKET_DESCRIPTOR));
+    return (r->urb != NULL) ? TRUE : FALSE;
+}
+
+static void cleanup(struct replay *r)
+{
+    UINT32 i;
+
+    for (i = 0; i < MAX_DEVICES; i++)
+    {
+        struct replay_device *dev = r->devices[i];
+
+        if (dev != NULL)
+        {
+            if (dev->data != NULL)
+            {
+                HostDestroyDevice(dev->data);
+            }
+            free(dev->config);
+            free(dev->selected);
+            free(dev);
+        }
+    }
+
+    for (i = 0; i < r->numIrps; i++)
+    {
+        IoFreeIrp(r->irps[i].irp);
+    }
+
+    id_map_free(&r->byOriginalId);
+    id_map_free(&r->byHostId);
+    free(r->irps);
+    free(r->records);
+    free(r->expected);
+    free(r->file);
+    free(r->urb);
+    free(r->scratch);
+    free(r->packet);
+}
+
+/*
+ * Returns pipe handle for given endpoint. The pipe is added to device
+ * endpoint table on first use, just like the driver does when it sees
+ * the pipe in URB_FUNCTION_SELECT_CONFIGURATION.
+ */
+static USBD_PIPE_HANDLE get_pipe(struct replay_device *dev, UCHAR endpoint,
+                                 USBD_PIPE_TYPE type)
+{
+    UCHAR  slot = PIPE_INDEX(endpoint);
+
+    if (!dev->registered[slot][type])
+    {
+        USBD_PIPE_INFORMATION  pipe;
+        KIRQL                  irql;
+
+        memset(&pipe, 0, sizeof(pipe));
+        pipe.EndpointAddress = endpoint;
+        pipe.PipeType = type;
+        pipe.PipeHandle = (USBD_PIPE_HANDLE)&dev->pipes[slot][type];
+
+        KeAcquireSpinLock(&dev->data->tablesSpinLock, &irql);
+        USBPcapAddEndpointInfo(dev->data->endpointTable, &pipe,
+                               dev->data->deviceAddress);
+        KeReleaseSpinLock(&dev->data->tablesSpinLock, irql);
+
+        dev->registered[slot][type] = TRUE;
+    }
+
+    return (USBD_PIPE_HANDLE)&dev->pipes[slot][type];
+}
+
+/* Pipe requests do not reveal pipe type, any registered pipe will do */
+static USBD_PIPE_HANDLE get_any_pipe(struct replay_device *dev, UCHAR endpoint)
+{
+    int type;
+
+    for (type = 0; type < PIPE_TYPES; type++)
+    {
+        if (dev->registered[PIPE_INDEX(endpoint)][type])
+        {
+            return (USBD_PIPE_HANDLE)&dev->pipes[PIPE_INDEX(endpoint)][type];
+        }
+    }
+
+    return get_pipe(dev, endpoint, UsbdPipeTypeBulk);
+}
+
+static PUCHAR get_payload(struct replay *r, const struct record *rec)
+{
+    const USBPCAP_BUFFER_PACKET_HEADER  *header = rec->header;
+    PUCHAR                               data;
+    UINT32                               available;
+
+    data = (PUCHAR)header + header->headerLen;
+    available = rec->pcap->incl_len - header->headerLen;
+    if (available >= header->dataLength)
+    {
+        return data;
+    }
+
+    /* Packet was truncated to snaplen, data that is missing won't be
+     * captured either so its contents does not matter.
+     */
+    if (r->scratchSize < header->dataLength)
+    {
+        PUCHAR scratch = realloc(r->scratch, header->dataLength);
+
+        if (scratch == NULL)
+        {
+            return NULL;
+        }
+        r->scratch = scratch;
+        r->scratchSize = header->dataLength;
+    }
+
+    memcpy(r->scratch, data, available);
+    memset(&r->scratch[available], 0, header->dataLength - available);
+    return r->scratch;
+}
+
+static void remember_setup(struct packet *p)
+{
+    if (!p->post)
+    {
+        memcpy(p->irp->setup, p->data, 8);
+        p->irp->hasSetup = TRUE;
+    }
+}
+
+/* Keeps the last complete configuration descriptor read from device */
+static void remember_configuration(struct packet *p)
+{
+    const UCHAR           *setup = p->irp->setup;
+    struct replay_device  *dev = p->device;
+    USHORT                 totalLength;
+
+    if (!p->irp->hasSetup || setup[0] != 0x80 || setup[1] != 0x06 ||
+        setup[3] != USB_CONFIGURATION_DESCRIPTOR_TYPE ||
+        p->dataLength < sizeof(USB_CONFIGURATION_DESCRIPTOR) ||
+        p->data[1] != USB_CONFIGURATION_DESCRIPTOR_TYPE)
+    {
+        return;
+    }
+
+    totalLength = (USHORT)(p->data[2] | (p->data[3] << 8));
+    if (totalLength != p->dataLength)
+    {
+        return;
+    }
+
+    free(dev->config);
+    dev->config = malloc(totalLength);
+    if (dev->config != NULL)
+    {
+        memcpy(dev->config, p->data, totalLength);
+        dev->configLength = totalLength;
+    }
+}
+
+/*
+ * Sets transfer buffer of control transfer so that the driver logs the
+ * same data as found in the packet.
+ */
+static void control_buffer(struct packet *p, BOOLEAN in,
+                           ULONG *length, PVOID *buffer)
+{
+    if (p->post == FALSE)
+    {
+        if (in)
+        {
+            /* Data is not logged, but wLength is derived from length */
+            *length = (ULONG)(p->data[6] | (p->data[7] << 8));
+            *buffer = p->data;
+        }
+        else
+        {
+            *length = p->dataLength - 8;
+            *buffer = &p->data[8];
+        }
+    }
+    else
+    {
+        *length = in ? p->dataLength : 0;
+        *buffer = p->data;
+    }
+
+    if (*length == 0)
+    {
+        *buffer = NULL;
+    }
+}
+
+static void build_control_transfer(struct replay *r, struct packet *p)
+{
+    struct _URB_CONTROL_TRANSFER  *transfer;
+    UCHAR                          endpoint = p->header->endpoint;
+    BOOLEAN                        in = (endpoint & 0x80) ? TRUE : FALSE;
+    USBD_PIPE_HANDLE               pipe = NULL;
+    ULONG                          length;
+    PVOID                          buffer;
+
+    if (endpoint & 0x7F)
+    {
+        pipe = get_pipe(p->device, endpoint, UsbdPipeTypeControl);
+    }
+    control_buffer(p, in, &length, &buffer);
+
+    if (p->header->function == URB_FUNCTION_CONTROL_TRANSFER_EX)
+    {
+        struct _URB_CONTROL_TRANSFER_EX *ex = &r->urb->UrbControlTransferEx;
+
+        memset(ex, 0, sizeof(struct _URB_CONTROL_TRANSFER_EX));
+        ex->Hdr.Length = sizeof(struct _URB_CONTROL_TRANSFER_EX);
+        ex->PipeHandle = pipe;
+        ex->TransferFlags = in ? USBD_TRANSFER_DIRECTION_IN :
+                                 USBD_TRANSFER_DIRECTION_OUT;
+        ex->TransferBufferLength = length;
+        ex->TransferBuffer = buffer;
+        if (p->post == FALSE)
+        {
+            memcpy(ex->SetupPacket, p->data, 8);
+        }
+        return;
+    }
+
+    transfer = &r->urb->UrbControlTransfer;
+    memset(transfer, 0, sizeof(struct _URB_CONTROL_TRANSFER));
+    transfer->Hdr.Length = sizeof(struct _URB_CONTROL_TRANSFER);
+    transfer->PipeHandle = pipe;
+    transfer->TransferFlags = in ? USBD_TRANSFER_DIRECTION_IN :
+                                   USBD_TRANSFER_DIRECTION_OUT;
+    transfer->TransferBufferLength = length;
+    transfer->TransferBuffer = buffer;
+    if (p->post == FALSE)
+    {
+        memcpy(transfer->SetupPacket, p->data, 8);
+    }
+}
+
+static void build_descriptor_request(struct replay *r, struct packet *p)
+{
+    struct _URB_CONTROL_DESCRIPTOR_REQUEST  *request;
+    BOOLEAN                                  in;
+    ULONG                                    length;
+    PVOID                                    buffer;
+
+    switch (p->header->function)
+    {
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE:
+            in = FALSE;
+            break;
+        default:
+            in = TRUE;
+            break;
+    }
+    control_buffer(p, in, &length, &buffer);
+
+    request = &r->urb->UrbControlDescriptorRequest;
+    memset(request, 0, sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST));
+    request->Hdr.Length = sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST);
+    request->TransferBufferLength = length;
+    request->TransferBuffer = buffer;
+    if (p->post == FALSE)
+    {
+        request->Index = p->data[2];
+        request->DescriptorType = p->data[3];
+        request->LanguageId = (USHORT)(p->data[4] | (p->data[5] << 8));
+    }
+}
+
+static void build_get_status(struct replay *r, struct packet *p)
+{
+    struct _URB_CONTROL_GET_STATUS_REQUEST  *request;
+    ULONG                                    length;
+    PVOID                                    buffer;
+
+    control_buffer(p, TRUE, &length, &buffer);
+
+    request = &r->urb->UrbControlGetStatusRequest;
+    memset(request, 0, sizeof(struct _URB_CONTROL_GET_STATUS_REQUEST));
+    request->Hdr.Length = sizeof(struct _URB_CONTROL_GET_STATUS_REQUEST);
+    request->TransferBufferLength = length;
+    request->TransferBuffer = buffer;
+    if (p->post == FALSE)
+    {
+        request->Index = (USHORT)(p->data[4] | (p->data[5] << 8));
+    }
+}
+
+static void build_vendor_or_class(struct replay *r, struct packet *p)
+{
+    struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST  *request;
+    BOOLEAN                                       in;
+    ULONG                                         length;
+    PVOID                                         buffer;
+
+    if (p->post == FALSE)
+    {
+        in = (p->data[0] & 0x80) ? TRUE : FALSE;
+    }
+    else
+    {
+        in = (p->header->endpoint & 0x80) ? TRUE : FALSE;
+    }
+    control_buffer(p, in, &length, &buffer);
+
+    request = &r->urb->UrbControlVendorClassRequest;
+    memset(request, 0, sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST));
+    request->Hdr.Length = sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST);
+    request->TransferFlags = in ? USBD_TRANSFER_DIRECTION_IN :
+                                  USBD_TRANSFER_DIRECTION_OUT;
+    request->TransferBufferLength = length;
+    request->TransferBuffer = buffer;
+    if (p->post == FALSE)
+    {
+        request->Request = p->data[1];
+        request->Value = (USHORT)(p->data[2] | (p->data[3] << 8));
+        request->Index = (USHORT)(p->data[4] | (p->data[5] << 8));
+    }
+}
+
+/*
+ * Returns configuration descriptor with given bConfigurationValue.
+ * The last configuration descriptor read from device is used if there
+ * was any, otherwise descriptor without interfaces is made up.
+ */
+static PUSB_CONFIGURATION_DESCRIPTOR
+get_configuration(struct replay_device *dev, UCHAR value)
+{
+    PUSB_CONFIGURATION_DESCRIPTOR  config;
+    USHORT                         length;
+
+    length = (dev->config != NULL) ? dev->configLength :
+                                     sizeof(USB_CONFIGURATION_DESCRIPTOR);
+
+    free(dev->selected);
+    dev->selected = calloc(1, length);
+    if (dev->selected == NULL)
+    {
+        return NULL;
+    }
+
+    config = (PUSB_CONFIGURATION_DESCRIPTOR)dev->selected;
+    if (dev->config != NULL)
+    {
+        memcpy(dev->selected, dev->config, length);
+    }
+    else
+    {
+        config->bLength = sizeof(USB_CONFIGURATION_DESCRIPTOR);
+        config->bDescriptorType = USB_CONFIGURATION_DESCRIPTOR_TYPE;
+        config->wTotalLength = length;
+        config->bmAttributes = 0x80;
+    }
+    config->bConfigurationValue = value;
+
+    return config;
+}
+
+static void build_select_configuration(struct replay *r, struct packet *p)
+{
+    struct _URB_SELECT_CONFIGURATION  *select;
+    UCHAR                              value;
+
+    remember_setup(p);
+    if (p->irp->hasSetup && p->irp->setup[1] == 0x09)
+    {
+        value = p->irp->setup[2];
+    }
+    else
+    {
+        value = 1;
+    }
+
+    select = &r->urb->UrbSelectConfiguration;
+    memset(select, 0, sizeof(struct _URB_SELECT_CONFIGURATION));
+    /* No interface information, pipes are registered on first use */
+    select->Hdr.Length = offsetof(struct _URB_SELECT_CONFIGURATION, Interface);
+    select->ConfigurationDescriptor = (value != 0) ?
+        get_configuration(p->device, value) : NULL;
+}
+
+/*
+ * Driver logs URB_FUNCTION_SELECT_INTERFACE only if the interface is
+ * present in the active configuration descriptor. Add the interface
+ * to the descriptor if it is missing.
+ */
+static void ensure_interface(struct replay_device *dev, UCHAR number,
+                             UCHAR alternate)
+{
+    PUSB_CONFIGURATION_DESCRIPTOR  current = dev->data->descriptor;
+    PUSB_CONFIGURATION_DESCRIPTOR  config;
+    PUSB_INTERFACE_DESCRIPTOR      intf;
+    USHORT                         length;
+
+    if (current != NULL &&
+        USBD_ParseConfigurationDescriptorEx(current, current, number,
+                                            alternate, -1, -1, -1) != NULL)
+    {
+        return;
+    }
+
+    length = (current != NULL) ? current->wTotalLength :
+                                 sizeof(USB_CONFIGURATION_DESCRIPTOR);
+
+    config = ExAllocatePoolWithTag(NonPagedPool,
+                                   length + sizeof(USB_INTERFACE_DESCRIPTOR),
+                                   (ULONG)'CSED');
+    if (config == NULL)
+    {
+        return;
+    }
+
+    if (current != NULL)
+    {
+        RtlCopyMemory(config, current, length);
+        ExFreePool((PVOID)current);
+    }
+    else
+    {
+        RtlZeroMemory(config, length);
+        config->bLength = sizeof(USB_CONFIGURATION_DESCRIPTOR);
+        config->bDescriptorType = USB_CONFIGURATION_DESCRIPTOR_TYPE;
+        config->bConfigurationValue = 1;
+        config->bmAttributes = 0x80;
+    }
+
+    intf = (PUSB_INTERFACE_DESCRIPTOR)((PUCHAR)config + length);
+    RtlZeroMemory(intf, sizeof(USB_INTERFACE_DESCRIPTOR));
+    intf->bLength = sizeof(USB_INTERFACE_DESCRIPTOR);
+    intf->bDescriptorType = USB_INTERFACE_DESCRIPTOR_TYPE;
+    intf->bInterfaceNumber = number;
+    intf->bAlternateSetting = alternate;
+    intf->bInterfaceClass = 0xFF;
+
+    config->wTotalLength = length + sizeof(USB_INTERFACE_DESCRIPTOR);
+    config->bNumInterfaces++;
+    dev->data->descriptor = config;
+}
+
+static void build_select_interface(struct replay *r, struct packet *p)
+{
+    struct _URB_SELECT_INTERFACE  *select;
+    UCHAR                          number = 0;
+    UCHAR                          alternate = 0;
+
+    remember_setup(p);
+    if (p->irp->hasSetup && p->irp->setup[1] == 0x0B)
+    {
+        alternate = p->irp->setup[2];
+        number = p->irp->setup[4];
+    }
+    ensure_interface(p->device, number, alternate);
+
+    select = &r->urb->UrbSelectInterface;
+    memset(select, 0, sizeof(struct _URB_SELECT_INTERFACE));
+    select->Hdr.Length = offsetof(struct _URB_SELECT_INTERFACE, Interface);
+    select->Interface.InterfaceNumber = number;
+    select->Interface.AlternateSetting = alternate;
+}
+
+static void build_bulk_or_interrupt(struct replay *r, struct packet *p)
+{
+    struct _URB_BULK_OR_INTERRUPT_TRANSFER  *transfer;
+    UCHAR                                    endpoint = p->header->endpoint;
+    USBD_PIPE_TYPE                           type;
+
+    type = (p->header->transfer == USBPCAP_TRANSFER_INTERRUPT) ?
+           UsbdPipeTypeInterrupt : UsbdPipeTypeBulk;
+
+    transfer = &r->urb->UrbBulkOrInterruptTransfer;
+    memset(transfer, 0, sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER));
+    transfer->Hdr.Length = sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER);
+    transfer->PipeHandle = (endpoint == 0xFF) ?
+        (USBD_PIPE_HANDLE)&r->unknownPipe : get_pipe(p->device, endpoint, type);
+    transfer->TransferFlags = (endpoint & 0x80) ? USBD_TRANSFER_DIRECTION_IN :
+                                                  USBD_TRANSFER_DIRECTION_OUT;
+    transfer->TransferBufferLength = p->dataLength;
+    transfer->TransferBuffer = (p->dataLength != 0) ? p->data : NULL;
+}
+
+static void build_isoch(struct replay *r, struct packet *p)
+{
+    const USBPCAP_BUFFER_ISOCH_HEADER  *header;
+    struct _URB_ISOCH_TRANSFER         *transfer;
+    UCHAR                               endpoint = p->header->endpoint;
+    BOOLEAN                             in;
+    ULONG                               i;
+
+    header = (const USBPCAP_BUFFER_ISOCH_HEADER *)p->header;
+
+    if (endpoint != 0xFF)
+    {
+        in = (endpoint & 0x80) ? TRUE : FALSE;
+    }
+    else
+    {
+        /* Only OUT transfers have data attached on submission */
+        in = (p->post || p->dataLength == 0) ? TRUE : FALSE;
+    }
+
+    transfer = &r->urb->UrbIsochronousTransfer;
+    memset(transfer, 0, sizeof(struct _URB_ISOCH_TRANSFER));
+    transfer->Hdr.Length = (USHORT)(sizeof(struct _URB_ISOCH_TRANSFER) +
+        (header->numberOfPackets - 1) * sizeof(USBD_ISO_PACKET_DESCRIPTOR));
+    transfer->PipeHandle = (endpoint == 0xFF) ?
+        (USBD_PIPE_HANDLE)&r->unknownPipe :
+        get_pipe(p->device, endpoint, UsbdPipeTypeIsochronous);
+    transfer->TransferFlags = in ? USBD_TRANSFER_DIRECTION_IN :
+                                   USBD_TRANSFER_DIRECTION_OUT;
+    /* Data of IN transfers is already compacted, so are the offsets */
+    transfer->TransferBufferLength = p->dataLength;
+    transfer->TransferBuffer = (p->dataLength != 0) ? p->data : NULL;
+    transfer->StartFrame = header->startFrame;
+    transfer->NumberOfPackets = header->numberOfPackets;
+    transfer->ErrorCount = header->errorCount;
+    for (i = 0; i < header->numberOfPackets; i++)
+    {
+        transfer->IsoPacket[i].Offset = header->packet[i].offset;
+        transfer->IsoPacket[i].Length = header->packet[i].length;
+        transfer->IsoPacket[i].Status = header->packet[i].status;
+    }
+}
+
+static void build_pipe_request(struct replay *r, struct packet *p)
+{
+    struct _URB_PIPE_REQUEST  *request;
+    UCHAR                      endpoint = p->header->endpoint;
+
+    request = &r->urb->UrbPipeRequest;
+    memset(request, 0, sizeof(struct _URB_PIPE_REQUEST));
+    request->Hdr.Length = sizeof(struct _URB_PIPE_REQUEST);
+    request->PipeHandle = (endpoint == 0xFF) ?
+        (USBD_PIPE_HANDLE)&r->unknownPipe : get_any_pipe(p->device, endpoint);
+}
+
+static void build_get_frame_number(struct replay *r, struct packet *p)
+{
+    struct _URB_GET_CURRENT_FRAME_NUMBER  *request;
+
+    request = &r->urb->UrbGetCurrentFrameNumber;
+    memset(request, 0, sizeof(struct _URB_GET_CURRENT_FRAME_NUMBER));
+    request->Hdr.Length = sizeof(struct _URB_GET_CURRENT_FRAME_NUMBER);
+    if (p->post && p->dataLength >= sizeof(ULONG))
+    {
+        request->FrameNumber = (ULONG)p->data[0] | ((ULONG)p->data[1] << 8) |
+                               ((ULONG)p->data[2] << 16) | ((ULONG)p->data[3] << 24);
+    }
+}
+
+/*
+ * Issues the USBPcapAnalyzeURB() call that resulted in given packet.
+ *
+ * URBs with function unknown to the driver are special. On submission
+ * the driver stores the URB and logs nothing. On completion it logs the
+ * stored submission followed by the completion. Therefore the packet
+ * with submission is found right before the completion, and replaying
+ * the packets in file order results in the same output.
+ */
+static BOOLEAN replay_packet(struct replay *r, const struct record *rec)
+{
+    const USBPCAP_BUFFER_PACKET_HEADER  *header = rec->header;
+    struct packet                        p;
+
+    p.header = header;
+    p.post = (header->info & USBPCAP_INFO_PDO_TO_FDO) ? TRUE : FALSE;
+    p.data = get_payload(r, rec);
+    p.dataLength = header->dataLength;
+    p.irp = &r->irps[rec->irp];
+    p.device = r->devices[header->device];
+    if (p.data == NULL)
+    {
+        return FALSE;
+    }
+
+    switch (header->function)
+    {
+        case URB_FUNCTION_SELECT_CONFIGURATION:
+            build_select_configuration(r, &p);
+            break;
+
+        case URB_FUNCTION_SELECT_INTERFACE:
+            build_select_interface(r, &p);
+            break;
+
+        case URB_FUNCTION_CONTROL_TRANSFER:
+        case URB_FUNCTION_CONTROL_TRANSFER_EX:
+            build_control_transfer(r, &p);
+            break;
+
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE:
+            build_descriptor_request(r, &p);
+            break;
+
+        case URB_FUNCTION_GET_STATUS_FROM_DEVICE:
+        case URB_FUNCTION_GET_STATUS_FROM_INTERFACE:
+        case URB_FUNCTION_GET_STATUS_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_STATUS_FROM_OTHER:
+            build_get_status(r, &p);
+            break;
+
+        case URB_FUNCTION_VENDOR_DEVICE:
+        case URB_FUNCTION_VENDOR_INTERFACE:
+        case URB_FUNCTION_VENDOR_ENDPOINT:
+        case URB_FUNCTION_VENDOR_OTHER:
+        case URB_FUNCTION_CLASS_DEVICE:
+        case URB_FUNCTION_CLASS_INTERFACE:
+        case URB_FUNCTION_CLASS_ENDPOINT:
+        case URB_FUNCTION_CLASS_OTHER:
+            build_vendor_or_class(r, &p);
+            break;
+
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+            build_bulk_or_interrupt(r, &p);
+            break;
+
+        case URB_FUNCTION_ISOCH_TRANSFER:
+            build_isoch(r, &p);
+            break;
+
+        case URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL:
+        case URB_FUNCTION_SYNC_RESET_PIPE:
+        case URB_FUNCTION_SYNC_CLEAR_STALL:
+        case URB_FUNCTION_ABORT_PIPE:
+        case URB_FUNCTION_CLOSE_STATIC_STREAMS:
+            build_pipe_request(r, &p);
+            break;
+
+        case URB_FUNCTION_GET_CURRENT_FRAME_NUMBER:
+            build_get_frame_number(r, &p);
+            break;
+
+        default:
+            memset(&r->urb->UrbHeader, 0, sizeof(struct _URB_HEADER));
+            r->urb->UrbHeader.Length = sizeof(struct _URB_HEADER);
+            break;
+    }
+
+    if (header->transfer == USBPCAP_TRANSFER_CONTROL)
+    {
+        if (p.post)
+        {
+            remember_configuration(&p);
+        }
+        else
+        {
+            remember_setup(&p);
+        }
+    }
+
+    r->urb->UrbHeader.Function = header->function;
+    r->urb->UrbHeader.Status = header->status;
+    USBPcapAnalyzeURB(p.irp->irp, r->urb, p.post, p.device->data);
+    r->calls++;
+    return TRUE;
+}
+
+/* Waits until the reader makes room, so no packet gets dropped */
+static void wait_for_buffer(struct replay *r)
+{
+    PUSBPCAP_ROOTHUB_DATA  pData = r->rootHub->pRootData;
+    UINT32                 used;
+    KIRQL                  irql;
+
+    for (;;)
+    {
+        KeAcquireSpinLock(&pData->bufferLock, &irql);
+        used = (pData->writeOffset + pData->bufferSize - pData->readOffset) %
+               pData->bufferSize;
+        KeReleaseSpinLock(&pData->bufferLock, irql);
+
+        if (used < pData->bufferSize / 2)
+        {
+            return;
+        }
+
+        {
+            UINT64 before = HostGetMonotonicNs();
+
+            sleep_until(before + BACKPRESSURE_SLEEP_NS);
+            r->sleptNs += HostGetMonotonicNs() - before;
+        }
+    }
+}
+
+static UINT64 packet_time_us(const struct record *rec)
+{
+    return (UINT64)rec->pcap->ts_sec * 1000000ULL + rec->pcap->ts_usec;
+}
+
+static BOOLEAN replay_capture(struct replay *r)
+{
+    UINT64  firstUs = packet_time_us(&r->records[r->expected[0]]);
+    UINT64  loop;
+    UINT32  i;
+
+    for (loop = 0; loop < r->loops; loop++)
+    {
+        UINT64 loopStartNs = HostGetMonotonicNs();
+
+        for (i = 0; i < r->numExpected; i++)
+        {
+            const struct record *rec = &r->records[r->expected[i]];
+
+            if (!r->fast)
+            {
+                UINT64 us = packet_time_us(rec);
+
+                /* Submissions of unknown URBs are older than the
+                 * packets before them, don't wait for these.
+                 */
+                if (us > firstUs)
+                {
+                    UINT64 deadline = loopStartNs + (us - firstUs) * 1000ULL;
+                    UINT64 now = HostGetMonotonicNs();
+
+                    if (deadline > now)
+                    {
+                        sleep_until(deadline);
+                        r->sleptNs += HostGetMonotonicNs() - now;
+                    }
+                }
+            }
+
+            wait_for_buffer(r);
+            if (!replay_packet(r, rec))
+            {
+                fprintf(stderr, "Out of memory.\n");
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+static void report_mismatch(struct replay *r, UINT64 n, const char *fmt, ...)
+{
+    va_list args;
+
+    r->mismatches++;
+    if (r->mismatches > MAX_REPORTED_MISMATCHES)
+    {
+        return;
+    }
+
+    fprintf(stderr, "Packet %llu: ", (unsigned long long)(n + 1));
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+static void restore_irp_id(struct replay *r, PUCHAR data, UINT32 length)
+{
+    const size_t  offset = offsetof(USBPCAP_BUFFER_PACKET_HEADER, irpId);
+    UINT64        irpId;
+    UINT32        index;
+
+    if (length < offset + sizeof(UINT64))
+    {
+        return;
+    }
+
+    memcpy(&irpId, &data[offset], sizeof(UINT64));
+    if (id_map_find(&r->byHostId, irpId, &index))
+    {
+        memcpy(&data[offset], &r->irps[index].originalId, sizeof(UINT64));
+    }
+}
+
+static void check_packet(struct replay *r)
+{
+    pcaprec_hdr_t        *pcap = (pcaprec_hdr_t *)r->packet;
+    PUCHAR                data = &r->packet[sizeof(pcaprec_hdr_t)];
+    const struct record  *rec;
+    UINT64                n = r->produced++;
+    UINT32                i;
+
+    restore_irp_id(r, data, pcap->incl_len);
+    if (r->output != NULL)
+    {
+        fwrite(r->packet, 1, sizeof(pcaprec_hdr_t) + pcap->incl_len, r->output);
+    }
+
+    if (n >= (UINT64)r->numExpected * r->loops)
+    {
+        report_mismatch(r, n, "unexpected packet (%u bytes)",
+                        pcap->incl_len);
+        return;
+    }
+
+    rec = &r->records[r->expected[n % r->numExpected]];
+    if (pcap->incl_len != rec->pcap->incl_len ||
+        pcap->orig_len != rec->pcap->orig_len)
+    {
+        report_mismatch(r, n, "length %u, expected %u",
+                        pcap->orig_len, rec->pcap->orig_len);
+        return;
+    }
+
+    if (memcmp(data, rec->header, pcap->incl_len) != 0)
+    {
+        for (i = 0; data[i] == ((const UCHAR *)rec->header)[i]; i++)
+        {
+        }
+        report_mismatch(r, n, "differs from input packet %u at offset %u",
+                        r->expected[n % r->numExpected] + 1, i);
+    }
+}
+
+/* Parses pcap stream returned by read requests */
+static void reader_feed(struct replay *r, const UCHAR *data, UINT32 length)
+{
+    while (length > 0)
+    {
+        UINT32 chunk = min(r->need - r->fill, length);
+
+        memcpy(&r->packet[r->fill], data, chunk);
+        r->fill += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (r->fill < r->need)
+        {
+            break;
+        }
+
+        if (!r->globalHeaderDone)
+        {
+            if (r->output != NULL)
+            {
+                fwrite(r->packet, 1, sizeof(pcap_hdr_t), r->output);
+            }
+            if (memcmp(r->packet, &r->globalHeader, sizeof(pcap_hdr_t)) != 0)
+            {
+                r->mismatches++;
+                fprintf(stderr, "Global header differs\n");
+            }
+            r->globalHeaderDone = TRUE;
+        }
+        else if (r->inRecordHeader)
+        {
+            pcaprec_hdr_t  *pcap = (pcaprec_hdr_t *)r->packet;
+            UINT32          size = sizeof(pcaprec_hdr_t) + pcap->incl_len;
+
+            if (size > r->packetSize)
+            {
+                PUCHAR packet = realloc(r->packet, size);
+
+                if (packet == NULL)
+                {
+                    fprintf(stderr, "Out of memory.\n");
+                    exit(EXIT_FAILURE);
+                }
+                r->packet = packet;
+                r->packetSize = size;
+            }
+
+            r->need = size;
+            r->inRecordHeader = FALSE;
+            if (r->fill < r->need)
+            {
+                continue;
+            }
+            check_packet(r);
+        }
+        else
+        {
+            check_packet(r);
+        }
+
+        r->fill = 0;
+        r->need = sizeof(pcaprec_hdr_t);
+        r->inRecordHeader = TRUE;
+    }
+}
+
+static void *reader_thread(void *arg)
+{
+    struct replay      *r = (struct replay *)arg;
+    HOST_READ_REQUEST   request;
+    LARGE_INTEGER       timeout;
+    NTSTATUS            status;
+    BOOLEAN             cancelled = FALSE;
+
+    if (!NT_SUCCESS(HostInitializeReadRequest(&request, r->readSize)))
+    {
+        fprintf(stderr, "Failed to allocate read request.\n");
+        return NULL;
+    }
+
+    timeout.QuadPart = -10000LL * READER_POLL_INTERVAL_MS;
+
+    for (;;)
+    {
+        status = HostSubmitRead(r->rootHub, &request);
+        r->reads++;
+        if (status == STATUS_PENDING)
+        {
+            while (HostWaitRead(&request, &timeout) == STATUS_TIMEOUT)
+            {
+                if (__atomic_load_n(&r->running, __ATOMIC_ACQUIRE) == 0)
+                {
+                    /* Buffer is empty and nothing more will be written */
+                    HostCancelReads(r->rootHub);
+                    cancelled = TRUE;
+                }
+            }
+        }
+
+        if (!NT_SUCCESS(request.iosb.Status))
+        {
+            if (!cancelled)
+            {
+                fprintf(stderr, "Read failed, status 0x%08X\n",
+                        (unsigned int)request.iosb.Status);
+            }
+            break;
+        }
+
+        r->readBytes += request.iosb.Information;
+        reader_feed(r, (const UCHAR *)request.buffer,
+                    (UINT32)request.iosb.Information);
+    }
+
+    HostFreeReadRequest(&request);
+    return NULL;
+}
+
+static double per(UINT64 value, UINT64 count)
+{
+    return (count == 0) ? 0.0 : (double)value / (double)count;
+}
+
+static void print_results(struct replay *r)
+{
+    UINT64  expected = (UINT64)r->numExpected * r->loops;
+    UINT64  busyNs = r->endNs - r->startNs - r->sleptNs;
+    double  elapsed = (double)(r->endNs - r->startNs) / 1e9;
+
+    if (r->json)
+    {
+        printf("{\n");
+        printf("  \"mode\": \"%s\",\n", r->fast ? "fast" : "timed");
+        printf("  \"loops\": %llu,\n", (unsigned long long)r->loops);
+        printf("  \"elapsed_s\": %.6f,\n", elapsed);
+        printf("  \"buffer_bytes\": %u,\n", r->bufferSize);
+        printf("  \"read_bytes\": %u,\n", r->readSize);
+        printf("  \"packets_input\": %u,\n", r->numRecords);
+        printf("  \"packets_skipped\": %u,\n", r->numRecords - r->numExpected);
+        printf("  \"calls\": %llu,\n", (unsigned long long)r->calls);
+        printf("  \"ns_per_call\": %.1f,\n", per(busyNs, r->calls));
+        printf("  \"calls_per_s\": %.1f,\n", (double)r->calls / elapsed);
+        printf("  \"packets_expected\": %llu,\n", (unsigned long long)expected);
+        printf("  \"packets_produced\": %llu,\n", (unsigned long long)r->produced);
+        printf("  \"ring_bytes\": %llu,\n", (unsigned long long)r->readBytes);
+        printf("  \"reads\": %llu,\n", (unsigned long long)r->reads);
+        printf("  \"mismatches\": %llu\n", (unsigned long long)r->mismatches);
+        printf("}\n");
+    }
+    else
+    {
+        printf("Replayed %u of %u packets %llu time(s) %s in %.3f s\n",
+               r->numExpected, r->numRecords, (unsigned long long)r->loops,
+               r->fast ? "as fast as possible" : "with original timing",
+               elapsed);
+        printf("  %llu USBPcapAnalyzeURB() calls, %.1f ns/call, %.1f calls/s\n",
+               (unsigned long long)r->calls, per(busyNs, r->calls),
+               (double)r->calls / elapsed);
+        printf("  %llu packets produced (%llu expected), %llu bytes in %llu reads\n",
+               (unsigned long long)r->produced, (unsigned long long)expected,
+               (unsigned long long)r->readBytes, (unsigned long long)r->reads);
+        if (r->mismatches == 0)
+        {
+            printf("Replayed capture is identical to the original.\n");
+        }
+        else
+        {
+            printf("Replayed capture differs from the original: "
+                   "%llu mismatch(es).\n", (unsigned long long)r->mismatches);
+        }
+    }
+}
+
+static BOOLEAN run(struct replay *r)
+{
+    pthread_t  reader;
+    BOOLEAN    ok;
+
+    r->packetSize = sizeof(pcaprec_hdr_t) + 65536;
+    r->packet = malloc(r->packetSize);
+    if (r->packet == NULL)
+    {
+        return FALSE;
+    }
+    r->need = sizeof(pcap_hdr_t);
+    r->inRecordHeader = TRUE;
+
+    if (r->outputName != NULL)
+    {
+        r->output = fopen(r->outputName, "wb");
+        if (r->output == NULL)
+        {
+            fprintf(stderr, "Failed to open %s: %s\n", r->outputName,
+                    strerror(errno));
+            return FALSE;
+        }
+    }
+
+    r->running = 1;
+    r->startNs = HostGetMonotonicNs();
+    if (pthread_create(&reader, NULL, reader_thread, r) != 0)
+    {
+        fprintf(stderr, "Failed to create reader thread.\n");
+        return FALSE;
+    }
+
+    ok = replay_capture(r);
+    r->endNs = HostGetMonotonicNs();
+    __atomic_store_n(&r->running, 0, __ATOMIC_RELEASE);
+    pthread_join(reader, NULL);
+
+    if (r->output != NULL)
+    {
+        fclose(r->output);
+    }
+
+    if (!ok)
+    {
+        return FALSE;
+    }
+
+    if (r->produced < (UINT64)r->numExpected * r->loops)
+    {
+        r->mismatches++;
+        fprintf(stderr, "Missing %llu packet(s)\n",
+                (unsigned long long)((UINT64)r->numExpected * r->loops - r->produced));
+    }
+
+    print_results(r);
+    return (r->mismatches == 0) ? TRUE : FALSE;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"fast",       no_argument,       NULL, 'f'},
+        {"loops",      required_argument, NULL, 'n'},
+        {"output",     required_argument, NULL, 'o'},
+        {"bufferlen",  required_argument, NULL, 'b'},
+        {"readlen",    required_argument, NULL, 'r'},
+        {"json",       no_argument,       NULL, 'J'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct replay  r;
+    NTSTATUS       status;
+    BOOLEAN        ok = FALSE;
+    int            c;
+
+    memset(&r, 0, sizeof(r));
+    r.bufferSize = DEFAULT_BUFFER_SIZE;
+    r.readSize = DEFAULT_READ_SIZE;
+    r.loops = 1;
+
+    while ((c = getopt_long(argc, argv, "fn:o:b:r:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'f':
+                r.fast = TRUE;
+                break;
+            case 'n':
+                r.loops = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                r.outputName = optarg;
+                break;
+            case 'b':
+                r.bufferSize = (UINT32)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                r.readSize = (UINT32)strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                r.json = TRUE;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind + 1 != argc)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    r.inputName = argv[optind];
+
+    if (r.loops == 0 || r.readSize == 0)
+    {
+        fprintf(stderr, "Invalid loop count or read size.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!load_capture(&r))
+    {
+        cleanup(&r);
+        return EXIT_FAILURE;
+    }
+
+    status = HostCreateRootHub(r.bus, &r.rootHub);
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "Failed to create root hub, status 0x%08X\n",
+                (unsigned int)status);
+        cleanup(&r);
+        return EXIT_FAILURE;
+    }
+
+    status = HostStartCapture(r.rootHub, r.globalHeader.snaplen,
+                              r.bufferSize, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "Failed to start capture, status 0x%08X\n",
+                (unsigned int)status);
+    }
+    else if (!setup_devices(&r))
+    {
+        fprintf(stderr, "Failed to set up devices.\n");
+    }
+    else
+    {
+        ok = run(&r);
+    }
+
+    cleanup(&r);
+    HostDestroyRootHub(r.rootHub);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Worker to parent transport benchmark.
+ *
+ * Child process plays the elevated worker and writes capture sized
+ * chunks, parent process reads them like USBPcapCMD read thread does
+ * when it is not elevated. Data goes either through the shared memory
+ * ring or, with --pipe, through a pipe as before.
+ *
+ * Every byte is checked on arrival so a broken ring cannot go unnoticed.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../USBPcapCMD/shmring.h"
+
+#define DEFAULT_CHUNK_SIZE   (64*1024)
+#define DEFAULT_READ_SIZE    (1024*1024)
+#define DEFAULT_RING_SIZE    (4*1024*1024)
+#define DEFAULT_TOTAL_MB     1024
+
+struct bench
+{
+    unsigned int chunk_size;  /* Worker write length */
+    unsigned int read_size;   /* Parent read length */
+    unsigned int ring_size;
+    unsigned long long total_bytes;
+    int use_pipe;
+    int json;
+
+    struct shmring ring;
+    void *region;
+    size_t region_size;
+    int fds[2];
+
+    unsigned long long received;
+    unsigned long long reads;
+    unsigned long long errors;
+    unsigned long long start_ns;
+    unsigned long long end_ns;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -n, --size MB          amount of data to pass (default %d)\n"
+        "  -c, --chunk N          worker write length (default %d)\n"
+        "  -r, --read N           parent read length (default %d)\n"
+        "      --ring N           ring size in bytes (default %d)\n"
+        "      --pipe             pass data through pipe instead\n"
+        "      --json             print results as JSON\n",
+        argv0, DEFAULT_TOTAL_MB, DEFAULT_CHUNK_SIZE, DEFAULT_READ_SIZE,
+        DEFAULT_RING_SIZE);
+}
+
+/* Byte at given stream offset */
+static unsigned char pattern(unsigned long long offset)
+{
+    return (unsigned char)((offset * 131) ^ (offset >> 12));
+}
+
+static void fill(unsigned char *p, unsigned int length, unsigned long long offset)
+{
+    unsigned int i;
+
+    for (i = 0; i < length; i++)
+    {
+        p[i] = pattern(offset + i);
+    }
+}
+
+static void check(struct bench *bench, const unsigned char *p, unsigned int length)
+{
+    unsigned int i;
+
+    for (i = 0; i < length; i++)
+    {
+        if (p[i] != pattern(bench->received + i))
+        {
+            bench->errors++;
+        }
+    }
+}
+
+static int run_worker(struct bench *bench)
+{
+    unsigned char *chunk = malloc(bench->chunk_size);
+    unsigned long long sent = 0;
+
+    if (chunk == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    while (sent < bench->total_bytes)
+    {
+        unsigned int length = bench->chunk_size;
+        unsigned int pos = 0;
+
+        if (length > bench->total_bytes - sent)
+        {
+            length = (unsigned int)(bench->total_bytes - sent);
+        }
+        fill(chunk, length, sent);
+
+        while (pos < length)
+        {
+            if (bench->use_pipe)
+            {
+                ssize_t written = write(bench->fds[1], &chunk[pos], length - pos);
+                if (written < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    return EXIT_FAILURE;
+                }
+                pos += (unsigned int)written;
+            }
+            else
+            {
+                unsigned int written = shmring_write(&bench->ring, &chunk[pos],
+                                                     length - pos, 100);
+                if ((written == 0) && shmring_reader_closed(&bench->ring))
+                {
+                    return EXIT_FAILURE;
+                }
+                pos += written;
+            }
+        }
+        sent += length;
+    }
+
+    if (bench->use_pipe)
+    {
+        close(bench->fds[1]);
+    }
+    else
+    {
+        shmring_close(&bench->ring);
+    }
+    free(chunk);
+    return EXIT_SUCCESS;
+}
+
+static int run_parent(struct bench *bench)
+{
+    unsigned char *buffer = malloc(bench->read_size);
+
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Failed to allocate buffer.\n");
+        return 0;
+    }
+
+    for (;;)
+    {
+        unsigned int length;
+
+        if (bench->use_pipe)
+        {
+            ssize_t n = read(bench->fds[0], buffer, bench->read_size);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fprintf(stderr, "read() failed: %s\n", strerror(errno));
+                break;
+            }
+            length = (unsigned int)n;
+            if (length == 0)
+            {
+                break;
+            }
+        }
+        else
+        {
+            length = shmring_read(&bench->ring, buffer, bench->read_size,
+                                  SHMRING_INFINITE);
+            if ((length == 0) && shmring_is_drained(&bench->ring))
+            {
+                break;
+            }
+        }
+
+        check(bench, buffer, length);
+        bench->received += length;
+        bench->reads++;
+    }
+
+    free(buffer);
+    return 1;
+}
+
+static int run(struct bench *bench)
+{
+    pid_t child;
+    int status;
+    int ok;
+
+    if (bench->use_pipe)
+    {
+        if (pipe(bench->fds) != 0)
+        {
+            fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+            return 0;
+        }
+    }
+    else
+    {
+        bench->region_size = shmring_region_size(bench->ring_size);
+        bench->region = mmap(NULL, bench->region_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if ((bench->region == MAP_FAILED) ||
+            !shmring_init(&bench->ring, bench->region, bench->ring_size))
+        {
+            fprintf(stderr, "Failed to create ring.\n");
+            return 0;
+        }
+    }
+
+    bench->start_ns = now_ns();
+    child = fork();
+    if (child < 0)
+    {
+        fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+        return 0;
+    }
+    if (child == 0)
+    {
+        if (bench->use_pipe)
+        {
+            close(bench->fds[0]);
+        }
+        _exit(run_worker(bench));
+    }
+
+    if (bench->use_pipe)
+    {
+        close(bench->fds[1]);
+    }
+    ok = run_parent(bench);
+    bench->end_ns = now_ns();
+
+    if (!bench->use_pipe)
+    {
+        shmring_reader_close(&bench->ring);
+    }
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != EXIT_SUCCESS))
+    {
+        fprintf(stderr, "Worker failed.\n");
+        ok = 0;
+    }
+
+    if (bench->use_pipe)
+    {
+        close(bench->fds[0]);
+    }
+    else
+    {
+        shmring_destroy(&bench->ring);
+        munmap(bench->region, bench->region_size);
+    }
+    return ok;
+}
+
+static void print_results(struct bench *bench)
+{
+    double elapsed = (double)(bench->end_ns - bench->start_ns) / 1e9;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"transport\": \"%s\",\n", bench->use_pipe ? "pipe" : "ring");
+        printf("  \"elapsed_s\": %.6f,\n", elapsed);
+        printf("  \"chunk_bytes\": %u,\n", bench->chunk_size);
+        printf("  \"read_bytes\": %u,\n", bench->read_size);
+        printf("  \"ring_bytes\": %u,\n", bench->use_pipe ? 0 : bench->ring.mask + 1);
+        printf("  \"received_bytes\": %llu,\n", bench->received);
+        printf("  \"bytes_per_s\": %.1f,\n", (double)bench->received / elapsed);
+        printf("  \"reads\": %llu,\n", bench->reads);
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%s: %llu bytes in %.3f s, %.1f MB/s, %llu reads (%.0f bytes each)\n",
+               bench->use_pipe ? "Pipe" : "Ring", bench->received, elapsed,
+               (double)bench->received / elapsed / 1e6, bench->reads,
+               bench->reads ? (double)bench->received / (double)bench->reads : 0.0);
+        printf("Corrupted bytes: %llu\n", bench->errors);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"size",  required_argument, NULL, 'n'},
+        {"chunk", required_argument, NULL, 'c'},
+        {"read",  required_argument, NULL, 'r'},
+        {"ring",  required_argument, NULL, 'R'},
+        {"pipe",  no_argument,       NULL, 'P'},
+        {"json",  no_argument,       NULL, 'J'},
+        {"help",  no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench bench;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.chunk_size = DEFAULT_CHUNK_SIZE;
+    bench.read_size = DEFAULT_READ_SIZE;
+    bench.ring_size = DEFAULT_RING_SIZE;
+    bench.total_bytes = DEFAULT_TOTAL_MB * 1000000ULL;
+
+    while ((c = getopt_long(argc, argv, "n:c:r:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                bench.total_bytes = strtoull(optarg, NULL, 10) * 1000000ULL;
+                break;
+            case 'c':
+                bench.chunk_size = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench.read_size = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                bench.ring_size = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                bench.use_pipe = 1;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((bench.chunk_size == 0) || (bench.read_size == 0))
+    {
+        fprintf(stderr, "Invalid chunk or read length.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!run(&bench))
+    {
+        return EXIT_FAILURE;
+    }
+
+    print_results(&bench);
+    return (bench.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
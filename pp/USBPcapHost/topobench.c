@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Topology snapshot benchmark.
+ *
+ * Builds snapshot of generated devices spread over a tree of hubs, every
+ * device with a few device node children, then measures how long
+ * USBPcapCMD --extcap-config takes to load it when topology generation
+ * did not change. Round trip, change detection and rejection of
+ * corrupted snapshot are checked too.
+ *
+ * With --dump the given snapshot file (e.g.
+ * %TEMP%\USBPcap1_topology.cache copied from Windows) is listed instead,
+ * with --diff the nodes that differ between two snapshots are listed.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../USBPcapCMD/topocache.h"
+
+#define DEFAULT_DEVICES      32
+#define DEFAULT_CHILDREN     3
+#define DEFAULT_ROUNDS       10000
+
+/* Ports per generated hub */
+#define HUB_PORTS            7
+
+struct bench
+{
+    unsigned int devices;
+    unsigned int children;
+    unsigned int rounds;
+    int json;
+
+    struct topocache topology;
+    unsigned char *data;
+    size_t length;
+
+    unsigned long long parse_ns;
+    unsigned long long errors;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "       %s --dump FILE\n"
+        "       %s --diff OLD NEW\n"
+        "  -n, --devices N        number of devices (default %d)\n"
+        "  -c, --children N       device node children per device (default %d)\n"
+        "  -r, --rounds N         number of measured loads (default %d)\n"
+        "      --dump FILE        list nodes of snapshot file\n"
+        "      --diff OLD NEW     list nodes that differ between snapshot files\n"
+        "      --json             print results as JSON\n",
+        argv0, argv0, argv0, DEFAULT_DEVICES, DEFAULT_CHILDREN, DEFAULT_ROUNDS);
+}
+
+/* Devices fill up hubs breadth first, device n is on port n % HUB_PORTS + 1
+ * of hub that is device (n / HUB_PORTS) - 1, or root hub.
+ */
+static int build_topology(struct topocache *topology, unsigned int devices,
+                          unsigned int children)
+{
+    char display[64];
+    unsigned int n;
+    unsigned int i;
+    unsigned int level;
+    unsigned int hub;
+
+    topocache_init(topology);
+    for (n = 0; n < devices; n++)
+    {
+        level = 0;
+        for (hub = n / HUB_PORTS; hub > 0; hub = hub / HUB_PORTS)
+        {
+            level++;
+            hub--;
+        }
+
+        sprintf(display, "USB Composite Device %u", n + 1);
+        if (!topocache_add(topology, level, n % HUB_PORTS + 1,
+                           (unsigned short)(n + 1),
+                           (unsigned short)((n < HUB_PORTS) ? 0 : n / HUB_PORTS),
+                           0, 0, display))
+        {
+            return 0;
+        }
+
+        for (i = 1; i <= children; i++)
+        {
+            sprintf(display, "USB Input Device %u.%u", n + 1, i);
+            if (!topocache_add(topology, level + 1, 0, (unsigned short)(n + 1),
+                               (unsigned short)(n + 1), (unsigned short)i,
+                               (unsigned short)((i > 1) ? 1 : 0), display))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static int build(struct bench *bench)
+{
+    if (!build_topology(&bench->topology, bench->devices, bench->children))
+    {
+        topocache_free(&bench->topology);
+        return 0;
+    }
+
+    bench->topology.epoch = 0x01D5A1B2C3D4E5F6ULL;
+    bench->topology.generation = 42;
+    bench->data = topocache_serialize(&bench->topology, &bench->length);
+    return bench->data != NULL;
+}
+
+/* Loads serialized snapshot like USBPcapCMD does when nothing changed */
+static void run(struct bench *bench)
+{
+    struct topocache loaded;
+    unsigned long long start;
+    unsigned int round;
+    unsigned int n;
+
+    topocache_init(&loaded);
+    for (round = 0; round < bench->rounds; round++)
+    {
+        start = now_ns();
+        if (!topocache_parse(&loaded, bench->data, bench->length) ||
+            !topocache_is_current(&loaded, bench->topology.epoch,
+                                  bench->topology.generation))
+        {
+            bench->errors++;
+        }
+        bench->parse_ns += now_ns() - start;
+    }
+
+    /* Loaded snapshot must be the same as the one that was saved */
+    if ((loaded.count != bench->topology.count) ||
+        (topocache_diff(&bench->topology, &loaded, NULL, NULL) != 0))
+    {
+        fprintf(stderr, "Loaded snapshot differs\n");
+        bench->errors++;
+    }
+
+    /* Any change of generation or epoch means full walk */
+    if (topocache_is_current(&loaded, bench->topology.epoch,
+                             bench->topology.generation + 1) ||
+        topocache_is_current(&loaded, bench->topology.epoch + 1,
+                             bench->topology.generation))
+    {
+        bench->errors++;
+    }
+
+    /* Renamed device is one removed and one added node */
+    if (loaded.count > 0)
+    {
+        loaded.nodes[0].display[0] ^= 0x20;
+        if (topocache_diff(&bench->topology, &loaded, NULL, NULL) != 2)
+        {
+            fprintf(stderr, "Changed node was not noticed\n");
+            bench->errors++;
+        }
+    }
+    topocache_free(&loaded);
+
+    /* Any corrupted byte makes the whole snapshot unused */
+    for (n = 0; n < bench->length; n += (bench->length / 97) + 1)
+    {
+        bench->data[n] ^= 0x40;
+        /* Epoch and generation are not covered by hash, but then the
+         * snapshot simply does not match current topology.
+         */
+        if (topocache_parse(&loaded, bench->data, bench->length) &&
+            topocache_is_current(&loaded, bench->topology.epoch,
+                                 bench->topology.generation) &&
+            (topocache_diff(&bench->topology, &loaded, NULL, NULL) != 0))
+        {
+            fprintf(stderr, "Corrupted byte %u was not noticed\n", n);
+            bench->errors++;
+        }
+        bench->data[n] ^= 0x40;
+    }
+    if (bench->length > 0)
+    {
+        if (topocache_parse(&loaded, bench->data, bench->length - 1))
+        {
+            bench->errors++;
+        }
+    }
+    topocache_free(&loaded);
+}
+
+static int load(const char *filename, struct topocache *topology)
+{
+    unsigned char *data;
+    long length;
+    FILE *f;
+    int ok;
+
+    f = fopen(filename, "rb");
+    if (f == NULL)
+    {
+        perror(filename);
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(length > 0 ? (size_t)length : 1);
+    if ((data == NULL) || (fread(data, 1, (size_t)length, f) != (size_t)length))
+    {
+        fprintf(stderr, "Failed to read %s\n", filename);
+        fclose(f);
+        free(data);
+        return 0;
+    }
+    fclose(f);
+
+    topocache_init(topology);
+    ok = topocache_parse(topology, data, (size_t)length);
+    if (!ok)
+    {
+        fprintf(stderr, "%s is not a valid topology snapshot\n", filename);
+    }
+    free(data);
+    return ok;
+}
+
+static void print_node(const struct topocache_node *node, const char *prefix)
+{
+    printf("%s%*s", prefix, (int)node->level * 2, "");
+    if (node->node)
+    {
+        printf("address %u node %u (parent %u) %s\n", node->address,
+               node->node, node->parent_node, node->display);
+    }
+    else
+    {
+        printf("[Port %u] address %u (hub %u) %s\n", node->port,
+               node->address, node->parent_address, node->display);
+    }
+}
+
+static void print_diff(const struct topocache_node *node, int added, void *ctx)
+{
+    (void)ctx;
+    print_node(node, added ? "+ " : "- ");
+}
+
+static int dump(const char *filename)
+{
+    struct topocache topology;
+    unsigned int i;
+
+    if (!load(filename, &topology))
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf("Epoch %llu, generation %u, %u nodes\n",
+           topology.epoch, topology.generation, topology.count);
+    for (i = 0; i < topology.count; i++)
+    {
+        print_node(&topology.nodes[i], "");
+    }
+    topocache_free(&topology);
+    return EXIT_SUCCESS;
+}
+
+static int diff(const char *old_name, const char *new_name)
+{
+    struct topocache old_topology;
+    struct topocache new_topology;
+    unsigned int differences;
+
+    if (!load(old_name, &old_topology))
+    {
+        return EXIT_FAILURE;
+    }
+    if (!load(new_name, &new_topology))
+    {
+        topocache_free(&old_topology);
+        return EXIT_FAILURE;
+    }
+
+    differences = topocache_diff(&old_topology, &new_topology, print_diff, NULL);
+    printf("%u nodes differ, generation %u -> %u\n", differences,
+           old_topology.generation, new_topology.generation);
+
+    topocache_free(&old_topology);
+    topocache_free(&new_topology);
+    return (differences == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void print_results(struct bench *bench)
+{
+    double parse_us = (double)bench->parse_ns / bench->rounds / 1e3;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"devices\": %u,\n", bench->devices);
+        printf("  \"nodes\": %u,\n", bench->topology.count);
+        printf("  \"snapshot_bytes\": %zu,\n", bench->length);
+        printf("  \"rounds\": %u,\n", bench->rounds);
+        printf("  \"load_us\": %.3f,\n", parse_us);
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+    }
+    else
+    {
+        printf("Snapshot of %u devices (%u nodes) is %zu bytes\n",
+               bench->devices, bench->topology.count, bench->length);
+        printf("Load: %.3f us\n", parse_us);
+        printf("Errors: %llu\n", bench->errors);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"devices",  required_argument, NULL, 'n'},
+        {"children", required_argument, NULL, 'c'},
+        {"rounds",   required_argument, NULL, 'r'},
+        {"dump",     required_argument, NULL, 'D'},
+        {"diff",     no_argument,       NULL, 'F'},
+        {"json",     no_argument,       NULL, 'J'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench bench;
+    int do_diff = 0;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.devices = DEFAULT_DEVICES;
+    bench.children = DEFAULT_CHILDREN;
+    bench.rounds = DEFAULT_ROUNDS;
+
+    while ((c = getopt_long(argc, argv, "n:c:r:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                bench.devices = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                bench.children = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench.rounds = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'D':
+                return dump(optarg);
+            case 'F':
+                do_diff = 1;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (do_diff)
+    {
+        if (argc - optind != 2)
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        return diff(argv[optind], argv[optind + 1]);
+    }
+
+    if ((bench.devices == 0) || (bench.devices > 127) ||
+        (bench.children > 255) || (bench.rounds == 0))
+    {
+        fprintf(stderr, "Invalid number of devices, children or rounds.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!build(&bench))
+    {
+        fprintf(stderr, "Failed to build snapshot.\n");
+        return EXIT_FAILURE;
+    }
+
+    run(&bench);
+    print_results(&bench);
+    topocache_free(&bench.topology);
+    free(bench.data);
+    return (bench.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
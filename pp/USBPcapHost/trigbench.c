@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Triggered capture benchmark.
+ *
+ * Replays capture through the trigger USBPcapCMD --trigger uses, in
+ * pieces the size of capture buffer, and measures how fast records are
+ * kept and dropped. Without file one record per millisecond with STALL
+ * every --every records is generated and the written windows are checked
+ * to be exactly the records around each STALL.
+ *
+ * With -o the written records are saved as pcap file.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../USBPcapCMD/trigger.h"
+#include "capgen.h"
+
+#define DEFAULT_RECORDS      1000000
+#define DEFAULT_EVERY        60000
+#define DEFAULT_BUFFER       64
+#define DEFAULT_BEFORE       10
+#define DEFAULT_AFTER        10
+#define DEFAULT_CHUNK        (1024 * 1024)
+#define DEFAULT_EXPRESSION   "stall"
+
+/* Generated records */
+#define GEN_PAYLOAD          32
+#define GEN_RECORD_LEN       (PCAP_REC_HDR_LEN + USBPCAP_HDR_LEN + GEN_PAYLOAD)
+#define GEN_INTERVAL_US      1000
+
+struct bench
+{
+    const char *filename;
+    const char *output_name;
+    const char *expression;
+    unsigned int records;
+    unsigned int every;
+    unsigned int buffer;
+    unsigned int before;
+    unsigned int after;
+    size_t chunk;
+    int json;
+
+    unsigned char *data;
+    size_t length;
+
+    /* Written records */
+    FILE *output;
+    unsigned char *written;
+    size_t written_len;
+    size_t written_size;
+
+    struct trigger trigger;
+    unsigned long long feed_ns;
+    unsigned long long errors;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options] [FILE.pcap]\n"
+        "  -n, --records N        number of generated records (default %d)\n"
+        "  -e, --every N          generated STALL every N records (default %d)\n"
+        "  -t, --trigger EXPR     trigger expression (default %s)\n"
+        "  -b, --buffer MIB       memory for records before trigger (default %d)\n"
+        "      --before S         seconds kept before trigger (default %d)\n"
+        "      --after S          seconds written after trigger (default %d)\n"
+        "  -c, --chunk BYTES      bytes fed at once (default %d)\n"
+        "  -o, --output FILE      save written records as pcap\n"
+        "      --json             print results as JSON\n",
+        argv0, DEFAULT_RECORDS, DEFAULT_EVERY, DEFAULT_EXPRESSION, DEFAULT_BUFFER,
+        DEFAULT_BEFORE, DEFAULT_AFTER, DEFAULT_CHUNK);
+}
+
+/* Record i is bulk IN completion, STALL if it is one of every */
+static int is_stall(const struct bench *bench, unsigned int i)
+{
+    return (i % bench->every) == bench->every / 2;
+}
+
+static int generate(struct bench *bench)
+{
+    unsigned long long ts = 1500000000ULL * 1000000000ULL;
+    unsigned char payload[GEN_PAYLOAD];
+    struct capgen_urb urb;
+    unsigned char *p;
+    unsigned int i;
+
+    bench->length = PCAP_HDR_LEN + (size_t)bench->records * GEN_RECORD_LEN;
+    bench->data = malloc(bench->length);
+    if (bench->data == NULL)
+    {
+        return 0;
+    }
+
+    p = capgen_file_header(bench->data, 0);
+    capgen_urb_init(&urb, 5, 0x81, USBPCAP_TRANSFER_BULK);
+    urb.info = USBPCAP_INFO_PDO_TO_FDO;
+    for (i = 0; i < bench->records; i++)
+    {
+        urb.irp = 0xFFFF800012340000ULL + (unsigned long long)i * 16;
+        urb.status = is_stall(bench, i) ? USBD_STATUS_STALL_PID : 0;
+        memset(payload, (unsigned char)i, GEN_PAYLOAD);
+        p = capgen_record(p, 0, ts, &urb, payload, GEN_PAYLOAD);
+        ts += GEN_INTERVAL_US * 1000ULL;
+    }
+    return 1;
+}
+
+static int load(struct bench *bench)
+{
+    bench->data = capgen_load(bench->filename, &bench->length);
+    if (bench->data == NULL)
+    {
+        return 0;
+    }
+
+    if ((bench->length < PCAP_HDR_LEN) ||
+        ((get32(bench->data) != PCAP_MAGIC) && (get32(bench->data) != PCAP_MAGIC_NANOSECOND)))
+    {
+        fprintf(stderr, "%s is not a pcap file\n", bench->filename);
+        return 0;
+    }
+    return 1;
+}
+
+static void output(void *ctx, const unsigned char *data, size_t length)
+{
+    struct bench *bench = (struct bench *)ctx;
+
+    if ((bench->output != NULL) && (fwrite(data, 1, length, bench->output) != length))
+    {
+        bench->errors++;
+    }
+
+    if (bench->filename != NULL)
+    {
+        return;
+    }
+
+    /* Kept to be checked */
+    if (bench->written_len + length > bench->written_size)
+    {
+        size_t size = (bench->written_size + length) * 2;
+        unsigned char *written = realloc(bench->written, size);
+
+        if (written == NULL)
+        {
+            bench->errors++;
+            return;
+        }
+        bench->written = written;
+        bench->written_size = size;
+    }
+    memcpy(&bench->written[bench->written_len], data, length);
+    bench->written_len += length;
+}
+
+static void run(struct bench *bench)
+{
+    unsigned long long start;
+    size_t offset;
+    size_t n;
+
+    for (offset = PCAP_HDR_LEN; offset < bench->length; offset += n)
+    {
+        n = bench->length - offset;
+        if (n > bench->chunk)
+        {
+            n = bench->chunk;
+        }
+
+        start = now_ns();
+        trigger_feed(&bench->trigger, &bench->data[offset], n);
+        bench->feed_ns += now_ns() - start;
+    }
+}
+
+/* Written data must be the generated records from before seconds before
+ * each STALL until after seconds after it, windows closer than that
+ * merged together.
+ */
+static void check(struct bench *bench)
+{
+    unsigned int before = bench->before * 1000000 / GEN_INTERVAL_US;
+    unsigned int after = bench->after * 1000000 / GEN_INTERVAL_US;
+    unsigned long long max_before = (unsigned long long)bench->buffer * 1024 * 1024 /
+                                    GEN_RECORD_LEN;
+    const unsigned char *records = &bench->data[PCAP_HDR_LEN];
+    size_t expected = 0;
+    unsigned int windows = 0;
+    unsigned int end = 0; /* First record not written yet */
+    unsigned int first;
+    unsigned int last;
+    unsigned int i;
+    size_t length;
+
+    if ((before == 0) || (before > max_before - 1))
+    {
+        before = (unsigned int)(max_before - 1);
+    }
+
+    for (i = 0; i < bench->records; i++)
+    {
+        if (!is_stall(bench, i))
+        {
+            continue;
+        }
+
+        /* Trigger is armed again once post-trigger window is written */
+        if (i >= end)
+        {
+            windows++;
+        }
+
+        first = (i > before) ? i - before : 0;
+        if (first < end)
+        {
+            first = end;
+        }
+        last = (i + after < bench->records) ? i + after : bench->records - 1;
+        length = (size_t)(last + 1 - first) * GEN_RECORD_LEN;
+
+        if ((expected + length > bench->written_len) ||
+            (memcmp(&bench->written[expected],
+                    &records[(size_t)first * GEN_RECORD_LEN], length) != 0))
+        {
+            fprintf(stderr, "Window around record %u differs\n", i);
+            bench->errors++;
+            return;
+        }
+        expected += length;
+        end = last + 1;
+    }
+
+    if ((expected != bench->written_len) || (windows != bench->trigger.windows))
+    {
+        fprintf(stderr, "Written %zu bytes in %llu windows, expected %zu in %u\n",
+                bench->written_len, bench->trigger.windows, expected, windows);
+        bench->errors++;
+    }
+}
+
+static void print_results(struct bench *bench)
+{
+    double seconds = (double)bench->feed_ns / 1e9;
+    double mb_per_s = (seconds > 0) ? (double)bench->length / seconds / 1e6 : 0;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"bytes\": %zu,\n", bench->length);
+        printf("  \"records\": %llu,\n", bench->trigger.records);
+        printf("  \"chunk\": %zu,\n", bench->chunk);
+        printf("  \"windows\": %llu,\n", bench->trigger.windows);
+        printf("  \"matches\": %llu,\n", bench->trigger.matches);
+        printf("  \"written\": %llu,\n", bench->trigger.written);
+        printf("  \"dropped\": %llu,\n", bench->trigger.dropped);
+        printf("  \"oversized\": %llu,\n", bench->trigger.oversized);
+        printf("  \"mb_per_s\": %.1f,\n", mb_per_s);
+        printf("  \"errors\": %llu\n", bench->errors);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%llu records (%zu bytes) in %zu byte chunks\n",
+               bench->trigger.records, bench->length, bench->chunk);
+        printf("Trigger fired %llu times (%llu matches), wrote %llu records, "
+               "dropped %llu\n", bench->trigger.windows, bench->trigger.matches,
+               bench->trigger.written, bench->trigger.dropped);
+        if (bench->trigger.oversized > 0)
+        {
+            printf("Records larger than buffer: %llu\n", bench->trigger.oversized);
+        }
+        printf("Throughput: %.1f MB/s\n", mb_per_s);
+        printf("Errors: %llu\n", bench->errors);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"records", required_argument, NULL, 'n'},
+        {"every",   required_argument, NULL, 'e'},
+        {"trigger", required_argument, NULL, 't'},
+        {"buffer",  required_argument, NULL, 'b'},
+        {"before",  required_argument, NULL, 'B'},
+        {"after",   required_argument, NULL, 'A'},
+        {"chunk",   required_argument, NULL, 'c'},
+        {"output",  required_argument, NULL, 'o'},
+        {"json",    no_argument,       NULL, 'J'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct trigger_expr expr;
+    struct bench bench;
+    const char *error;
+    int c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.records = DEFAULT_RECORDS;
+    bench.every = DEFAULT_EVERY;
+    bench.expression = DEFAULT_EXPRESSION;
+    bench.buffer = DEFAULT_BUFFER;
+    bench.before = DEFAULT_BEFORE;
+    bench.after = DEFAULT_AFTER;
+    bench.chunk = DEFAULT_CHUNK;
+
+    while ((c = getopt_long(argc, argv, "n:e:t:b:c:o:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                bench.records = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                bench.every = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                bench.expression = optarg;
+                break;
+            case 'b':
+                bench.buffer = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                bench.before = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'A':
+                bench.after = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                bench.chunk = (size_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                bench.output_name = optarg;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc)
+    {
+        bench.filename = argv[optind];
+    }
+
+    if ((bench.chunk == 0) || (bench.records == 0) || (bench.every == 0) ||
+        (bench.buffer == 0) || (bench.buffer > 4096))
+    {
+        fprintf(stderr, "Invalid chunk size, number of records or buffer size.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!trigger_parse(&expr, bench.expression, &error))
+    {
+        fprintf(stderr, "Invalid trigger '%s': %s\n", bench.expression, error);
+        return EXIT_FAILURE;
+    }
+
+    if ((bench.filename != NULL) ? !load(&bench) : !generate(&bench))
+    {
+        free(bench.data);
+        return EXIT_FAILURE;
+    }
+
+    if (bench.output_name != NULL)
+    {
+        bench.output = fopen(bench.output_name, "wb");
+        if ((bench.output == NULL) ||
+            (fwrite(bench.data, 1, PCAP_HDR_LEN, bench.output) != PCAP_HDR_LEN))
+        {
+            perror(bench.output_name);
+            free(bench.data);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Records are at most snapshot length long */
+    if (!trigger_init(&bench.trigger, &expr, (size_t)bench.buffer * 1024 * 1024,
+                      PCAP_REC_HDR_LEN + get32(&bench.data[16]),
+                      (unsigned long long)bench.before * 1000000,
+                      (unsigned long long)bench.after * 1000000,
+                      get32(bench.data) == PCAP_MAGIC_NANOSECOND, output, &bench))
+    {
+        fprintf(stderr, "Failed to allocate trigger buffer.\n");
+        free(bench.data);
+        return EXIT_FAILURE;
+    }
+
+    run(&bench);
+    if (bench.filename == NULL)
+    {
+        check(&bench);
+    }
+    print_results(&bench);
+
+    if ((bench.output != NULL) && (fclose(bench.output) != 0))
+    {
+        perror(bench.output_name);
+        bench.errors++;
+    }
+    trigger_destroy(&bench.trigger);
+    free(bench.written);
+    free(bench.data);
+    return (bench.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1299 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Synthetic URB workload benchmark.
+ *
+ * Producer threads submit and complete URBs through USBPcapAnalyzeURB()
+ * on a simulated root hub while a reader thread drains the capture
+ * buffer with read requests, just like USBPcapCMD does with ReadFile().
+ * With --notify the reader instead waits on a notification event and
+ * drains the buffer with reads that never pend.
+ *
+ * Every USBPcapAnalyzeURB() call issued by the workloads results in
+ * exactly one captured packet, so the number of packets that did not
+ * make it into the buffer (dropped because the buffer was full) is the
+ * difference between the calls made and the packets read.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "USBPcapMain.h"
+#include "USBPcapURB.h"
+#include "HostCapture.h"
+#include "HostWdm.h"
+
+#define DEFAULT_BUFFER_SIZE      (1024*1024)
+#define DEFAULT_READ_SIZE        (1024*1024)
+#define MAX_READ_DEPTH           64
+#define DEFAULT_DURATION_MS      2000
+#define DEFAULT_ISO_PACKET_SIZE  192
+#define ISO_PACKETS              1024
+#define BULK_TRANSFER_SIZE       (64*1024)
+#define MAX_WORKLOADS            16
+#define MAX_PRODUCERS            126
+
+/* Reader wakes up this often to check if the benchmark has ended */
+#define READER_POLL_INTERVAL_MS  50
+
+typedef enum
+{
+    WORKLOAD_HID,
+    WORKLOAD_BULK,
+    WORKLOAD_ISOCH,
+    WORKLOAD_CONTROL,
+    WORKLOAD_TYPES
+} workload_type;
+
+static const char *workload_names[WORKLOAD_TYPES] =
+{
+    "hid",
+    "bulk",
+    "isoch",
+    "control",
+};
+
+struct endpoint_profile
+{
+    UCHAR   address;
+    UCHAR   attributes;
+    USHORT  maxPacketSize;
+    UCHAR   interval;
+};
+
+/* Device each workload thread pretends to be */
+struct device_profile
+{
+    UCHAR                    interfaceClass;
+    UCHAR                    interfaceSubClass;
+    UCHAR                    interfaceProtocol;
+    int                      numEndpoints;
+    struct endpoint_profile  endpoints[2];
+};
+
+static const struct device_profile device_profiles[WORKLOAD_TYPES] =
+{
+    /* HID mouse, interrupt IN */
+    { 0x03, 0x01, 0x02, 1, { { 0x81, 0x03, 8, 10 } } },
+    /* Mass storage Bulk-Only Transport */
+    { 0x08, 0x06, 0x50, 2, { { 0x81, 0x02, 512, 0 }, { 0x02, 0x02, 512, 0 } } },
+    /* Audio/video streaming, isochronous IN */
+    { 0x01, 0x02, 0x00, 1, { { 0x83, 0x05, 1024, 1 } } },
+    /* Control storm is generated against HID device */
+    { 0x03, 0x01, 0x02, 1, { { 0x81, 0x03, 8, 10 } } },
+};
+
+struct workload
+{
+    workload_type  type;
+    int            threads;
+    double         rate;       /* URBs per second per thread, 0 - unlimited */
+
+    /* Results, summed over all threads */
+    UINT64         urbs;
+    UINT64         packets;
+    UINT64         payloadBytes;
+    UINT64         busyNs;
+};
+
+struct producer
+{
+    pthread_t             thread;
+    struct bench         *bench;
+    struct workload      *workload;
+    PUSBPCAP_DEVICE_DATA  device;
+    PIRP                  irp;
+    PURB                  urb;
+    PUCHAR                data;
+    /* Addresses of these bytes serve as pipe handles */
+    UCHAR                 pipes[2];
+    UINT64                sequence;
+
+    UINT64                urbs;
+    UINT64                packets;
+    UINT64                payloadBytes;
+    UINT64                busyNs;
+
+    HOST_SPIN_LOCK_STATS  tablesLockStats;
+};
+
+/* Incremental parser of the pcap stream returned by read requests */
+struct pcap_stream
+{
+    BOOLEAN  globalHeaderDone;
+    UCHAR    header[sizeof(pcap_hdr_t)];
+    UINT32   headerFill;
+    UINT32   skip;
+    UINT64   packets;
+};
+
+struct bench
+{
+    struct workload       workloads[MAX_WORKLOADS];
+    int                   numWorkloads;
+    UINT32                bufferSize;
+    UINT32                readSize;
+    UINT32                readDepth;       /* read requests kept queued */
+    UINT32                snaplen;
+    UINT32                isoPacketSize;
+    UINT64                durationNs;
+    UINT64                count;       /* URBs per thread, 0 - use duration */
+    UINT32                notifyThreshold; /* 0 - pend read requests */
+    BOOLEAN               reader;
+    BOOLEAN               lockStats;
+    BOOLEAN               json;
+
+    PHOST_ROOT_HUB        rootHub;
+    struct producer      *producers;
+    int                   numProducers;
+
+    volatile int          producersRunning;
+    UINT64                startNs;
+    UINT64                endNs;
+
+    /* Reader results */
+    UINT64                readBytes;
+    UINT64                reads;
+    UINT64                pendedReads;
+    UINT64                notifications;
+    KEVENT                notifyEvent;
+    USBPCAP_IOCTL_STATISTICS driverStats;
+    struct pcap_stream    stream;
+
+    HOST_SPIN_LOCK_STATS  bufferLockStats;
+    HOST_SPIN_LOCK_STATS  csqLockStats;
+};
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -w, --workload TYPE[:THREADS[:RATE]]\n"
+        "                       add workload, can be given multiple times\n"
+        "                       TYPE is hid, bulk, isoch or control\n"
+        "                       RATE is URBs/s per thread, 0 is unlimited\n"
+        "  -d, --duration MS    run for MS milliseconds (default %d)\n"
+        "  -n, --count N        submit at least N URBs per thread instead\n"
+        "  -b, --bufferlen N    capture buffer size in bytes (default %d)\n"
+        "  -r, --readlen N      read request size in bytes (default %d)\n"
+        "      --reads N        number of read requests kept queued (default 1)\n"
+        "  -s, --snaplen N      snapshot length (default %d)\n"
+        "      --iso-packet N   isochronous packet size (default %d)\n"
+        "      --notify N       wait for notification event signalled when\n"
+        "                       N bytes are buffered instead of pending reads\n"
+        "      --no-reader      do not drain the capture buffer\n"
+        "      --lock-stats     collect spin lock hold and wait times\n"
+        "      --json           print results as JSON\n",
+        argv0, DEFAULT_DURATION_MS, DEFAULT_BUFFER_SIZE, DEFAULT_READ_SIZE,
+        USBPCAP_DEFAULT_SNAP_LEN, DEFAULT_ISO_PACKET_SIZE);
+}
+
+static BOOLEAN parse_workload(struct bench *bench, const char *arg)
+{
+    struct workload  *workload;
+    char              name[16];
+    const char       *sep;
+    size_t            len;
+    int               i;
+
+    if (bench->numWorkloads == MAX_WORKLOADS)
+    {
+        fprintf(stderr, "Too many workloads.\n");
+        return FALSE;
+    }
+
+    workload = &bench->workloads[bench->numWorkloads];
+    memset(workload, 0, sizeof(struct workload));
+    workload->threads = 1;
+
+    sep = strchr(arg, ':');
+    len = (sep != NULL) ? (size_t)(sep - arg) : strlen(arg);
+    if (len >= sizeof(name))
+    {
+        len = sizeof(name) - 1;
+    }
+    memcpy(name, arg, len);
+    name[len] = '\0';
+
+    for (i = 0; i < WORKLOAD_TYPES; i++)
+    {
+        if (strcmp(name, workload_names[i]) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == WORKLOAD_TYPES)
+    {
+        fprintf(stderr, "Unknown workload type '%s'.\n", name);
+        return FALSE;
+    }
+    workload->type = (workload_type)i;
+
+    if (sep != NULL)
+    {
+        char *end;
+
+        workload->threads = (int)strtol(sep + 1, &end, 10);
+        if (end == sep + 1 || workload->threads <= 0)
+        {
+            fprintf(stderr, "Invalid thread count in '%s'.\n", arg);
+            return FALSE;
+        }
+
+        if (*end == ':')
+        {
+            const char *rate = end + 1;
+
+            workload->rate = strtod(rate, &end);
+            if (end == rate || workload->rate < 0)
+            {
+                fprintf(stderr, "Invalid rate in '%s'.\n", arg);
+                return FALSE;
+            }
+        }
+
+        if (*end != '\0')
+        {
+            fprintf(stderr, "Invalid workload '%s'.\n", arg);
+            return FALSE;
+        }
+    }
+
+    bench->numWorkloads++;
+    return TRUE;
+}
+
+static void sleep_until(UINT64 deadlineNs)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(deadlineNs / 1000000000ULL);
+    ts.tv_nsec = (long)(deadlineNs % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+/*
+ * Builds configuration descriptor with single interface for given profile.
+ * Returns total length.
+ */
+static USHORT build_configuration_descriptor(const struct device_profile *profile,
+                                             PUCHAR buffer)
+{
+    PUSB_CONFIGURATION_DESCRIPTOR  config;
+    PUSB_INTERFACE_DESCRIPTOR      intf;
+    USHORT                         length;
+    int                            i;
+
+    config = (PUSB_CONFIGURATION_DESCRIPTOR)buffer;
+    config->bLength = sizeof(USB_CONFIGURATION_DESCRIPTOR);
+    config->bDescriptorType = USB_CONFIGURATION_DESCRIPTOR_TYPE;
+    config->bNumInterfaces = 1;
+    config->bConfigurationValue = 1;
+    config->iConfiguration = 0;
+    config->bmAttributes = 0x80;
+    config->MaxPower = 50;
+    length = sizeof(USB_CONFIGURATION_DESCRIPTOR);
+
+    intf = (PUSB_INTERFACE_DESCRIPTOR)&buffer[length];
+    intf->bLength = sizeof(USB_INTERFACE_DESCRIPTOR);
+    intf->bDescriptorType = USB_INTERFACE_DESCRIPTOR_TYPE;
+    intf->bInterfaceNumber = 0;
+    intf->bAlternateSetting = 0;
+    intf->bNumEndpoints = (UCHAR)profile->numEndpoints;
+    intf->bInterfaceClass = profile->interfaceClass;
+    intf->bInterfaceSubClass = profile->interfaceSubClass;
+    intf->bInterfaceProtocol = profile->interfaceProtocol;
+    intf->iInterface = 0;
+    length += sizeof(USB_INTERFACE_DESCRIPTOR);
+
+    for (i = 0; i < profile->numEndpoints; i++)
+    {
+        PUSB_ENDPOINT_DESCRIPTOR ep = (PUSB_ENDPOINT_DESCRIPTOR)&buffer[length];
+
+        ep->bLength = sizeof(USB_ENDPOINT_DESCRIPTOR);
+        ep->bDescriptorType = USB_ENDPOINT_DESCRIPTOR_TYPE;
+        ep->bEndpointAddress = profile->endpoints[i].address;
+        ep->bmAttributes = profile->endpoints[i].attributes;
+        ep->wMaxPacketSize = profile->endpoints[i].maxPacketSize;
+        ep->bInterval = profile->endpoints[i].interval;
+        length += sizeof(USB_ENDPOINT_DESCRIPTOR);
+    }
+
+    config->wTotalLength = length;
+    return length;
+}
+
+static void analyze(struct producer *p, BOOLEAN post)
+{
+    USBPcapAnalyzeURB(p->irp, p->urb, post, p->device);
+    p->packets++;
+}
+
+/* Passes the URB down, "completes" it with given status and passes it up */
+static void transfer(struct producer *p, USBD_STATUS status)
+{
+    analyze(p, FALSE);
+    p->urb->UrbHeader.Status = status;
+    analyze(p, TRUE);
+    p->urbs++;
+}
+
+static void fill_data(struct producer *p, ULONG length)
+{
+    /* Touch the data like a host controller would, cheaply */
+    memset(p->data, (int)(p->sequence & 0xFF), length);
+    p->sequence++;
+}
+
+/*
+ * Issues URB_FUNCTION_SELECT_CONFIGURATION. This registers the pipe
+ * handles in the device endpoint table.
+ */
+static void select_configuration(struct producer *p)
+{
+    const struct device_profile       *profile;
+    struct _URB_SELECT_CONFIGURATION  *select;
+    UCHAR                              descriptor[64];
+    USHORT                             urbLength;
+    ULONG                              i;
+
+    profile = &device_profiles[p->workload->type];
+    build_configuration_descriptor(profile, descriptor);
+
+    urbLength = (USHORT)(sizeof(struct _URB_SELECT_CONFIGURATION) +
+                         (profile->numEndpoints - 1) * sizeof(USBD_PIPE_INFORMATION));
+
+    memset(p->urb, 0, urbLength);
+    select = &p->urb->UrbSelectConfiguration;
+    select->Hdr.Length = urbLength;
+    select->Hdr.Function = URB_FUNCTION_SELECT_CONFIGURATION;
+    select->ConfigurationDescriptor = (PUSB_CONFIGURATION_DESCRIPTOR)descriptor;
+    select->Interface.Length = (USHORT)(urbLength -
+        offsetof(struct _URB_SELECT_CONFIGURATION, Interface));
+    select->Interface.Class = profile->interfaceClass;
+    select->Interface.SubClass = profile->interfaceSubClass;
+    select->Interface.Protocol = profile->interfaceProtocol;
+    select->Interface.NumberOfPipes = (ULONG)profile->numEndpoints;
+
+    for (i = 0; i < select->Interface.NumberOfPipes; i++)
+    {
+        PUSBD_PIPE_INFORMATION           pipe = &select->Interface.Pipes[i];
+        const struct endpoint_profile   *ep = &profile->endpoints[i];
+
+        pipe->MaximumPacketSize = ep->maxPacketSize;
+        pipe->EndpointAddress = ep->address;
+        pipe->Interval = ep->interval;
+        switch (ep->attributes & 0x03)
+        {
+            case 0x01:
+                pipe->PipeType = UsbdPipeTypeIsochronous;
+                break;
+            case 0x02:
+                pipe->PipeType = UsbdPipeTypeBulk;
+                break;
+            case 0x03:
+                pipe->PipeType = UsbdPipeTypeInterrupt;
+                break;
+            default:
+                pipe->PipeType = UsbdPipeTypeControl;
+                break;
+        }
+        pipe->PipeHandle = (USBD_PIPE_HANDLE)&p->pipes[i];
+        pipe->MaximumTransferSize = BULK_TRANSFER_SIZE;
+    }
+
+    transfer(p, USBD_STATUS_SUCCESS);
+}
+
+static void bulk_or_interrupt(struct producer *p, int pipe,
+                              ULONG length, BOOLEAN in)
+{
+    struct _URB_BULK_OR_INTERRUPT_TRANSFER *bulk;
+
+    bulk = &p->urb->UrbBulkOrInterruptTransfer;
+    memset(bulk, 0, sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER));
+    bulk->Hdr.Length = sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER);
+    bulk->Hdr.Function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+    bulk->PipeHandle = (USBD_PIPE_HANDLE)&p->pipes[pipe];
+    bulk->TransferFlags = in ? (USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK) :
+                               USBD_TRANSFER_DIRECTION_OUT;
+    bulk->TransferBufferLength = length;
+    bulk->TransferBuffer = p->data;
+
+    if (in)
+    {
+        analyze(p, FALSE);
+        fill_data(p, length);
+        bulk->Hdr.Status = USBD_STATUS_SUCCESS;
+        analyze(p, TRUE);
+        p->urbs++;
+    }
+    else
+    {
+        fill_data(p, length);
+        transfer(p, USBD_STATUS_SUCCESS);
+    }
+    p->payloadBytes += length;
+}
+
+static void produce_hid(struct producer *p)
+{
+    bulk_or_interrupt(p, 0, 8, TRUE);
+}
+
+/* One Bulk-Only Transport command: CBW, 64 KiB data stage, CSW */
+static void produce_bulk(struct producer *p)
+{
+    BOOLEAN read = (p->sequence & 1) ? TRUE : FALSE;
+
+    bulk_or_interrupt(p, 1, 31, FALSE);
+    bulk_or_interrupt(p, read ? 0 : 1, BULK_TRANSFER_SIZE, read);
+    bulk_or_interrupt(p, 0, 13, TRUE);
+}
+
+static void produce_isoch(struct producer *p)
+{
+    struct _URB_ISOCH_TRANSFER  *isoch;
+    ULONG                        packetSize = p->bench->isoPacketSize;
+    ULONG                        i;
+
+    isoch = &p->urb->UrbIsochronousTransfer;
+    memset(isoch, 0, sizeof(struct _URB_ISOCH_TRANSFER));
+    isoch->Hdr.Length = (USHORT)(sizeof(struct _URB_ISOCH_TRANSFER) +
+                                 (ISO_PACKETS - 1) * sizeof(USBD_ISO_PACKET_DESCRIPTOR));
+    isoch->Hdr.Function = URB_FUNCTION_ISOCH_TRANSFER;
+    isoch->PipeHandle = (USBD_PIPE_HANDLE)&p->pipes[0];
+    isoch->TransferFlags = USBD_TRANSFER_DIRECTION_IN | USBD_START_ISO_TRANSFER_ASAP;
+    isoch->TransferBufferLength = packetSize * ISO_PACKETS;
+    isoch->TransferBuffer = p->data;
+    isoch->StartFrame = (ULONG)p->sequence * ISO_PACKETS;
+    isoch->NumberOfPackets = ISO_PACKETS;
+    for (i = 0; i < ISO_PACKETS; i++)
+    {
+        isoch->IsoPacket[i].Offset = i * packetSize;
+        isoch->IsoPacket[i].Length = 0;
+        isoch->IsoPacket[i].Status = USBD_STATUS_SUCCESS;
+    }
+
+    analyze(p, FALSE);
+
+    fill_data(p, isoch->TransferBufferLength);
+    for (i = 0; i < ISO_PACKETS; i++)
+    {
+        isoch->IsoPacket[i].Length = packetSize;
+    }
+    isoch->Hdr.Status = USBD_STATUS_SUCCESS;
+    analyze(p, TRUE);
+
+    p->urbs++;
+    p->payloadBytes += isoch->TransferBufferLength;
+}
+
+static void get_descriptor(struct producer *p, UCHAR type, UCHAR index,
+                           USHORT languageId, ULONG length)
+{
+    struct _URB_CONTROL_DESCRIPTOR_REQUEST *request;
+
+    request = &p->urb->UrbControlDescriptorRequest;
+    memset(request, 0, sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST));
+    request->Hdr.Length = sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST);
+    request->Hdr.Function = URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE;
+    request->TransferBufferLength = length;
+    request->TransferBuffer = p->data;
+    request->Index = index;
+    request->DescriptorType = type;
+    request->LanguageId = languageId;
+
+    analyze(p, FALSE);
+    fill_data(p, length);
+    request->Hdr.Status = USBD_STATUS_SUCCESS;
+    analyze(p, TRUE);
+
+    p->urbs++;
+    p->payloadBytes += length;
+}
+
+static void class_request(struct producer *p, UCHAR request, USHORT value,
+                          USBD_STATUS status)
+{
+    struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST *vc;
+
+    vc = &p->urb->UrbControlVendorClassRequest;
+    memset(vc, 0, sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST));
+    vc->Hdr.Length = sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST);
+    vc->Hdr.Function = URB_FUNCTION_CLASS_INTERFACE;
+    vc->TransferFlags = USBD_TRANSFER_DIRECTION_OUT;
+    vc->Request = request;
+    vc->Value = value;
+    vc->Index = 0;
+
+    transfer(p, status);
+}
+
+/* Enumeration as done by Windows for every (re)connected HID device */
+static void produce_control(struct producer *p)
+{
+    USBD_STATUS setIdleStatus;
+
+    get_descriptor(p, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, 18);
+    get_descriptor(p, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, 9);
+    get_descriptor(p, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, 25);
+    get_descriptor(p, USB_STRING_DESCRIPTOR_TYPE, 0, 0, 4);
+    get_descriptor(p, USB_STRING_DESCRIPTOR_TYPE, 2, 0x0409, 64);
+    select_configuration(p);
+
+    /* SET_IDLE, every fourth device rejects it with STALL */
+    setIdleStatus = ((p->sequence & 3) == 0) ? USBD_STATUS_STALL_PID :
+                                                USBD_STATUS_SUCCESS;
+    class_request(p, 0x0A, 0, setIdleStatus);
+}
+
+static void produce(struct producer *p)
+{
+    switch (p->workload->type)
+    {
+        case WORKLOAD_HID:
+            produce_hid(p);
+            break;
+        case WORKLOAD_BULK:
+            produce_bulk(p);
+            break;
+        case WORKLOAD_ISOCH:
+            produce_isoch(p);
+            break;
+        case WORKLOAD_CONTROL:
+        default:
+            produce_control(p);
+            break;
+    }
+}
+
+static void *producer_thread(void *arg)
+{
+    struct producer  *p = (struct producer *)arg;
+    struct bench     *bench = p->bench;
+    UINT64            start;
+    UINT64            now;
+    UINT64            sleptNs = 0;
+    UINT64            intervalNs = 0;
+    UINT64            next;
+    UINT64            iterations = 0;
+
+    if (p->workload->rate > 0)
+    {
+        intervalNs = (UINT64)(1000000000.0 / p->workload->rate);
+    }
+
+    start = HostGetMonotonicNs();
+    next = start;
+    now = start;
+
+    for (;;)
+    {
+        if (bench->count != 0)
+        {
+            if (p->urbs >= bench->count)
+            {
+                break;
+            }
+        }
+        else if ((iterations & 15) == 0 || intervalNs != 0)
+        {
+            now = HostGetMonotonicNs();
+            if (now - bench->startNs >= bench->durationNs)
+            {
+                break;
+            }
+        }
+
+        if (intervalNs != 0)
+        {
+            if (bench->count != 0)
+            {
+                now = HostGetMonotonicNs();
+            }
+
+            if (next > now)
+            {
+                UINT64 before = now;
+
+                sleep_until(next);
+                now = HostGetMonotonicNs();
+                sleptNs += now - before;
+            }
+            next += intervalNs;
+        }
+
+        produce(p);
+        iterations++;
+    }
+
+    p->busyNs = HostGetMonotonicNs() - start - sleptNs;
+    __atomic_sub_fetch(&bench->producersRunning, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void pcap_stream_feed(struct pcap_stream *stream,
+                             const UCHAR *data, UINT32 length)
+{
+    while (length > 0)
+    {
+        UINT32 chunk;
+
+        if (stream->skip > 0)
+        {
+            chunk = min(stream->skip, length);
+            stream->skip -= chunk;
+            data += chunk;
+            length -= chunk;
+            continue;
+        }
+
+        if (!stream->globalHeaderDone)
+        {
+            /* Global header carries no information we need */
+            stream->globalHeaderDone = TRUE;
+            stream->skip = sizeof(pcap_hdr_t);
+            continue;
+        }
+
+        chunk = min(sizeof(pcaprec_hdr_t) - stream->headerFill, length);
+        memcpy(&stream->header[stream->headerFill], data, chunk);
+        stream->headerFill += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (stream->headerFill == sizeof(pcaprec_hdr_t))
+        {
+            pcaprec_hdr_t *hdr = (pcaprec_hdr_t *)stream->header;
+
+            stream->skip = hdr->incl_len;
+            stream->headerFill = 0;
+            stream->packets++;
+        }
+    }
+}
+
+static void *reader_thread(void *arg)
+{
+    struct bench       *bench = (struct bench *)arg;
+    HOST_READ_REQUEST  *requests;
+    PHOST_READ_REQUEST  request;
+    LARGE_INTEGER       timeout;
+    NTSTATUS            status;
+    BOOLEAN             cancelled = FALSE;
+    UINT32              next = 0;
+    UINT32              i;
+
+    requests = calloc(bench->readDepth, sizeof(HOST_READ_REQUEST));
+    if (requests == NULL)
+    {
+        fprintf(stderr, "Failed to allocate read requests.\n");
+        return NULL;
+    }
+
+    for (i = 0; i < bench->readDepth; i++)
+    {
+        if (!NT_SUCCESS(HostInitializeReadRequest(&requests[i], bench->readSize)))
+        {
+            fprintf(stderr, "Failed to allocate read request.\n");
+            goto finish;
+        }
+    }
+
+    timeout.QuadPart = -10000LL * READER_POLL_INTERVAL_MS;
+
+    /* Keep readDepth requests queued, they complete in submission order */
+    for (i = 1; i < bench->readDepth; i++)
+    {
+        if (HostSubmitRead(bench->rootHub, &requests[i]) == STATUS_PENDING)
+        {
+            bench->pendedReads++;
+        }
+        bench->reads++;
+    }
+
+    for (;;)
+    {
+        int running;
+
+        request = &requests[next];
+
+        running = __atomic_load_n(&bench->producersRunning, __ATOMIC_ACQUIRE);
+        status = HostSubmitRead(bench->rootHub, request);
+        bench->reads++;
+        if (status == STATUS_PENDING)
+        {
+            bench->pendedReads++;
+        }
+
+        /* Wait for the oldest request */
+        next = (next + 1) % bench->readDepth;
+        request = &requests[next];
+        while (HostWaitRead(request, &timeout) == STATUS_TIMEOUT)
+        {
+            if (__atomic_load_n(&bench->producersRunning, __ATOMIC_ACQUIRE) == 0)
+            {
+                /* Buffer is empty and nothing more will be written */
+                HostCancelReads(bench->rootHub);
+                cancelled = TRUE;
+            }
+        }
+
+        if (!NT_SUCCESS(request->iosb.Status))
+        {
+            if (!cancelled)
+            {
+                fprintf(stderr, "Read failed, status 0x%08X\n",
+                        (unsigned int)request->iosb.Status);
+            }
+            break;
+        }
+
+        bench->readBytes += request->iosb.Information;
+        pcap_stream_feed(&bench->stream, (const UCHAR *)request->buffer,
+                         (UINT32)request->iosb.Information);
+
+        if (bench->notifyThreshold != 0 &&
+            request->iosb.Information < request->length)
+        {
+            /* Short read drained the buffer */
+            if (running == 0)
+            {
+                break;
+            }
+
+            if (KeWaitForSingleObject(&bench->notifyEvent, Executive,
+                                      KernelMode, FALSE,
+                                      &timeout) == STATUS_SUCCESS)
+            {
+                bench->notifications++;
+            }
+        }
+    }
+
+    /* Requests still queued are completed by the cancel above */
+    if (bench->readDepth > 1 && !cancelled)
+    {
+        HostCancelReads(bench->rootHub);
+    }
+
+finish:
+    for (i = 0; i < bench->readDepth; i++)
+    {
+        HostFreeReadRequest(&requests[i]);
+    }
+    free(requests);
+    return NULL;
+}
+
+static BOOLEAN setup_producers(struct bench *bench)
+{
+    int i, j, n;
+
+    bench->numProducers = 0;
+    for (i = 0; i < bench->numWorkloads; i++)
+    {
+        bench->numProducers += bench->workloads[i].threads;
+    }
+
+    if (bench->numProducers > MAX_PRODUCERS)
+    {
+        fprintf(stderr, "At most %d producer threads are supported.\n",
+                MAX_PRODUCERS);
+        return FALSE;
+    }
+
+    bench->producers = calloc((size_t)bench->numProducers,
+                              sizeof(struct producer));
+    if (bench->producers == NULL)
+    {
+        return FALSE;
+    }
+
+    n = 0;
+    for (i = 0; i < bench->numWorkloads; i++)
+    {
+        for (j = 0; j < bench->workloads[i].threads; j++, n++)
+        {
+            struct producer  *p = &bench->producers[n];
+            size_t            urbSize;
+            size_t            dataSize;
+
+            p->bench = bench;
+            p->workload = &bench->workloads[i];
+
+            /* Device addresses start at 1, each thread is separate device */
+            if (!NT_SUCCESS(HostCreateDevice(bench->rootHub, (USHORT)(n + 1),
+                                             &p->device)))
+            {
+                return FALSE;
+            }
+
+            p->irp = IoAllocateIrp(1, FALSE);
+
+            urbSize = sizeof(struct _URB_ISOCH_TRANSFER) +
+                      (ISO_PACKETS - 1) * sizeof(USBD_ISO_PACKET_DESCRIPTOR);
+            p->urb = calloc(1, urbSize);
+
+            dataSize = BULK_TRANSFER_SIZE;
+            if ((size_t)bench->isoPacketSize * ISO_PACKETS > dataSize)
+            {
+                dataSize = (size_t)bench->isoPacketSize * ISO_PACKETS;
+            }
+            p->data = malloc(dataSize);
+
+            if (p->irp == NULL || p->urb == NULL || p->data == NULL)
+            {
+                return FALSE;
+            }
+
+            if (bench->lockStats)
+            {
+                HostTrackSpinLock(&p->device->tablesSpinLock,
+                                  &p->tablesLockStats);
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+static void cleanup_producers(struct bench *bench)
+{
+    int i;
+
+    if (bench->producers == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < bench->numProducers; i++)
+    {
+        struct producer *p = &bench->producers[i];
+
+        if (p->device != NULL)
+        {
+            HostDestroyDevice(p->device);
+        }
+        if (p->irp != NULL)
+        {
+            IoFreeIrp(p->irp);
+        }
+        free(p->urb);
+        free(p->data);
+    }
+
+    free(bench->producers);
+    bench->producers = NULL;
+}
+
+static void add_lock_stats(PHOST_SPIN_LOCK_STATS total,
+                           const HOST_SPIN_LOCK_STATS *stats)
+{
+    total->acquisitions += stats->acquisitions;
+    total->contentions += stats->contentions;
+    total->waitNs += stats->waitNs;
+    total->holdNs += stats->holdNs;
+    total->maxWaitNs = max(total->maxWaitNs, stats->maxWaitNs);
+    total->maxHoldNs = max(total->maxHoldNs, stats->maxHoldNs);
+}
+
+static double per(UINT64 value, UINT64 count)
+{
+    return (count == 0) ? 0.0 : (double)value / (double)count;
+}
+
+static void print_lock_stats(const struct bench *bench, const char *name,
+                             const HOST_SPIN_LOCK_STATS *stats, BOOLEAN last)
+{
+    if (bench->json)
+    {
+        printf("    \"%s\": {\"acquisitions\": %llu, \"contentions\": %llu, "
+               "\"wait_ns_avg\": %.1f, \"wait_ns_max\": %llu, "
+               "\"hold_ns_avg\": %.1f, \"hold_ns_max\": %llu}%s\n",
+               name,
+               (unsigned long long)stats->acquisitions,
+               (unsigned long long)stats->contentions,
+               per(stats->waitNs, stats->acquisitions),
+               (unsigned long long)stats->maxWaitNs,
+               per(stats->holdNs, stats->acquisitions),
+               (unsigned long long)stats->maxHoldNs,
+               last ? "" : ",");
+    }
+    else
+    {
+        printf("  %-8s %12llu acquisitions, %5.2f%% contended, "
+               "wait avg %.1f ns max %llu ns, hold avg %.1f ns max %llu ns\n",
+               name,
+               (unsigned long long)stats->acquisitions,
+               100.0 * per(stats->contentions, stats->acquisitions),
+               per(stats->waitNs, stats->acquisitions),
+               (unsigned long long)stats->maxWaitNs,
+               per(stats->holdNs, stats->acquisitions),
+               (unsigned long long)stats->maxHoldNs);
+    }
+}
+
+static void print_results(struct bench *bench)
+{
+    double                elapsed;
+    UINT64                urbs = 0;
+    UINT64                packets = 0;
+    UINT64                captured;
+    UINT64                dropped;
+    HOST_SPIN_LOCK_STATS  tables;
+    int                   i;
+
+    elapsed = (double)(bench->endNs - bench->startNs) / 1e9;
+
+    memset(&tables, 0, sizeof(tables));
+    for (i = 0; i < bench->numProducers; i++)
+    {
+        struct producer *p = &bench->producers[i];
+
+        p->workload->urbs += p->urbs;
+        p->workload->packets += p->packets;
+        p->workload->payloadBytes += p->payloadBytes;
+        p->workload->busyNs += p->busyNs;
+        urbs += p->urbs;
+        packets += p->packets;
+        add_lock_stats(&tables, &p->tablesLockStats);
+    }
+
+    captured = bench->stream.packets;
+    dropped = (packets > captured) ? packets - captured : 0;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"elapsed_s\": %.6f,\n", elapsed);
+        printf("  \"buffer_bytes\": %u,\n", bench->bufferSize);
+        printf("  \"read_bytes\": %u,\n", bench->readSize);
+        printf("  \"read_depth\": %u,\n", bench->readDepth);
+        printf("  \"snaplen\": %u,\n", bench->snaplen);
+        printf("  \"workloads\": [\n");
+        for (i = 0; i < bench->numWorkloads; i++)
+        {
+            struct workload *w = &bench->workloads[i];
+
+            printf("    {\"type\": \"%s\", \"threads\": %d, \"rate\": %.1f, "
+                   "\"urbs\": %llu, \"packets\": %llu, \"payload_bytes\": %llu, "
+                   "\"ns_per_urb\": %.1f, \"urbs_per_s\": %.1f}%s\n",
+                   workload_names[w->type], w->threads, w->rate,
+                   (unsigned long long)w->urbs,
+                   (unsigned long long)w->packets,
+                   (unsigned long long)w->payloadBytes,
+                   per(w->busyNs, w->urbs),
+                   (double)w->urbs / elapsed,
+                   (i + 1 == bench->numWorkloads) ? "" : ",");
+        }
+        printf("  ],\n");
+        printf("  \"urbs\": %llu,\n", (unsigned long long)urbs);
+        printf("  \"packets\": %llu,\n", (unsigned long long)packets);
+        printf("  \"packets_captured\": %llu,\n", (unsigned long long)captured);
+        printf("  \"packets_dropped\": %llu,\n", (unsigned long long)dropped);
+        printf("  \"drop_rate\": %.6f,\n", per(dropped, packets));
+        printf("  \"driver_packets\": %llu,\n", (unsigned long long)bench->driverStats.packets);
+        printf("  \"driver_dropped\": %llu,\n", (unsigned long long)bench->driverStats.dropped);
+        printf("  \"ring_bytes\": %llu,\n", (unsigned long long)bench->readBytes);
+        printf("  \"ring_bytes_per_s\": %.1f,\n", (double)bench->readBytes / elapsed);
+        printf("  \"reads\": %llu,\n", (unsigned long long)bench->reads);
+        printf("  \"pended_reads\": %llu,\n", (unsigned long long)bench->pendedReads);
+        printf("  \"notify_threshold\": %u,\n", bench->notifyThreshold);
+        printf("  \"notifications\": %llu%s\n", (unsigned long long)bench->notifications,
+               bench->lockStats ? "," : "");
+        if (bench->lockStats)
+        {
+            printf("  \"locks\": {\n");
+            print_lock_stats(bench, "buffer", &bench->bufferLockStats, FALSE);
+            print_lock_stats(bench, "csq", &bench->csqLockStats, FALSE);
+            print_lock_stats(bench, "tables", &tables, TRUE);
+            printf("  }\n");
+        }
+        printf("}\n");
+    }
+    else
+    {
+        printf("Elapsed: %.3f s, buffer %u bytes, %u x reads of %u bytes, snaplen %u\n",
+               elapsed, bench->bufferSize, bench->readDepth, bench->readSize,
+               bench->snaplen);
+        for (i = 0; i < bench->numWorkloads; i++)
+        {
+            struct workload *w = &bench->workloads[i];
+
+            printf("  %-8s %3d thread(s) %12llu URBs %10.1f ns/URB %12.1f URB/s\n",
+                   workload_names[w->type], w->threads,
+                   (unsigned long long)w->urbs,
+                   per(w->busyNs, w->urbs),
+                   (double)w->urbs / elapsed);
+        }
+        printf("Packets: %llu written, %llu captured, %llu dropped (%.4f%%)\n",
+               (unsigned long long)packets,
+               (unsigned long long)captured,
+               (unsigned long long)dropped,
+               100.0 * per(dropped, packets));
+        printf("Driver: %llu packets stored, %llu dropped\n",
+               (unsigned long long)bench->driverStats.packets,
+               (unsigned long long)bench->driverStats.dropped);
+        printf("Ring: %llu bytes read, %.1f MB/s, %llu reads (%llu pended)\n",
+               (unsigned long long)bench->readBytes,
+               (double)bench->readBytes / elapsed / 1e6,
+               (unsigned long long)bench->reads,
+               (unsigned long long)bench->pendedReads);
+        if (bench->notifyThreshold != 0)
+        {
+            printf("Notify: threshold %u bytes, %llu notifications\n",
+                   bench->notifyThreshold,
+                   (unsigned long long)bench->notifications);
+        }
+        if (bench->lockStats)
+        {
+            printf("Locks:\n");
+            print_lock_stats(bench, "buffer", &bench->bufferLockStats, FALSE);
+            print_lock_stats(bench, "csq", &bench->csqLockStats, FALSE);
+            print_lock_stats(bench, "tables", &tables, TRUE);
+        }
+    }
+}
+
+static BOOLEAN run(struct bench *bench)
+{
+    pthread_t          reader;
+    PDEVICE_EXTENSION  pControlExt;
+    int                i;
+
+    if (!setup_producers(bench))
+    {
+        fprintf(stderr, "Failed to set up producers.\n");
+        return FALSE;
+    }
+
+    if (bench->lockStats)
+    {
+        pControlExt = (PDEVICE_EXTENSION)bench->rootHub->controlObject->DeviceExtension;
+        HostTrackSpinLock(&bench->rootHub->pRootData->bufferLock,
+                          &bench->bufferLockStats);
+        HostTrackSpinLock(&pControlExt->context.control.csqSpinLock,
+                          &bench->csqLockStats);
+    }
+
+    /* Register pipes before the clock starts */
+    for (i = 0; i < bench->numProducers; i++)
+    {
+        select_configuration(&bench->producers[i]);
+        bench->producers[i].urbs = 0;
+    }
+
+    bench->producersRunning = bench->numProducers;
+    bench->startNs = HostGetMonotonicNs();
+
+    if (bench->reader)
+    {
+        if (pthread_create(&reader, NULL, reader_thread, bench) != 0)
+        {
+            fprintf(stderr, "Failed to create reader thread.\n");
+            return FALSE;
+        }
+    }
+
+    for (i = 0; i < bench->numProducers; i++)
+    {
+        if (pthread_create(&bench->producers[i].thread, NULL,
+                           producer_thread, &bench->producers[i]) != 0)
+        {
+            fprintf(stderr, "Failed to create producer thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < bench->numProducers; i++)
+    {
+        pthread_join(bench->producers[i].thread, NULL);
+    }
+    bench->endNs = HostGetMonotonicNs();
+
+    if (bench->reader)
+    {
+        pthread_join(reader, NULL);
+    }
+    else
+    {
+        /* Collect whatever managed to fit into the buffer */
+        reader_thread(bench);
+    }
+
+    HostGetStatistics(bench->rootHub, &bench->driverStats);
+
+    print_results(bench);
+    HostUntrackSpinLocks();
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"workload",   required_argument, NULL, 'w'},
+        {"duration",   required_argument, NULL, 'd'},
+        {"count",      required_argument, NULL, 'n'},
+        {"bufferlen",  required_argument, NULL, 'b'},
+        {"readlen",    required_argument, NULL, 'r'},
+        {"snaplen",    required_argument, NULL, 's'},
+        {"iso-packet", required_argument, NULL, 'I'},
+        {"reads",      required_argument, NULL, 'Q'},
+        {"notify",     required_argument, NULL, 'N'},
+        {"no-reader",  no_argument,       NULL, 'R'},
+        {"lock-stats", no_argument,       NULL, 'L'},
+        {"json",       no_argument,       NULL, 'J'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench  bench;
+    NTSTATUS      status;
+    BOOLEAN       ok;
+    int           c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.bufferSize = DEFAULT_BUFFER_SIZE;
+    bench.readSize = DEFAULT_READ_SIZE;
+    bench.readDepth = 1;
+    bench.snaplen = USBPCAP_DEFAULT_SNAP_LEN;
+    bench.isoPacketSize = DEFAULT_ISO_PACKET_SIZE;
+    bench.durationNs = DEFAULT_DURATION_MS * 1000000ULL;
+    bench.reader = TRUE;
+
+    while ((c = getopt_long(argc, argv, "w:d:n:b:r:s:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'w':
+                if (!parse_workload(&bench, optarg))
+                {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                bench.durationNs = strtoull(optarg, NULL, 10) * 1000000ULL;
+                break;
+            case 'n':
+                bench.count = strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                bench.bufferSize = (UINT32)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench.readSize = (UINT32)strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                bench.snaplen = (UINT32)strtoul(optarg, NULL, 10);
+                break;
+            case 'I':
+                bench.isoPacketSize = (UINT32)strtoul(optarg, NULL, 10);
+                break;
+            case 'Q':
+                bench.readDepth = (UINT32)strtoul(optarg, NULL, 10);
+                break;
+            case 'N':
+                bench.notifyThreshold = (UINT32)strtoul(optarg, NULL, 10);
+                if (bench.notifyThreshold == 0)
+                {
+                    fprintf(stderr, "Invalid notification threshold.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'R':
+                bench.reader = FALSE;
+                break;
+            case 'L':
+                bench.lockStats = TRUE;
+                break;
+            case 'J':
+                bench.json = TRUE;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (bench.numWorkloads == 0)
+    {
+        parse_workload(&bench, "hid");
+    }
+
+    if (bench.readDepth == 0 || bench.readDepth > MAX_READ_DEPTH)
+    {
+        fprintf(stderr, "Invalid number of read requests.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (bench.readDepth > 1 && bench.notifyThreshold != 0)
+    {
+        /* Reads never pend with notification, queueing them is pointless */
+        fprintf(stderr, "--reads and --notify cannot be used together.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (bench.readSize == 0 || bench.isoPacketSize == 0 ||
+        bench.isoPacketSize > 3072)
+    {
+        fprintf(stderr, "Invalid read or isochronous packet size.\n");
+        return EXIT_FAILURE;
+    }
+
+    status = HostCreateRootHub(1, &bench.rootHub);
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "Failed to create root hub, status 0x%08X\n",
+                (unsigned int)status);
+        return EXIT_FAILURE;
+    }
+
+    status = HostStartCapture(bench.rootHub, bench.snaplen,
+                              bench.bufferSize, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        fprintf(stderr, "Failed to start capture, status 0x%08X\n",
+                (unsigned int)status);
+        HostDestroyRootHub(bench.rootHub);
+        return EXIT_FAILURE;
+    }
+
+    if (bench.notifyThreshold != 0)
+    {
+        KeInitializeEvent(&bench.notifyEvent, SynchronizationEvent, FALSE);
+        status = HostSetNotification(bench.rootHub, &bench.notifyEvent,
+                                     bench.notifyThreshold);
+        if (!NT_SUCCESS(status))
+        {
+            fprintf(stderr, "Failed to set notification, status 0x%08X\n",
+                    (unsigned int)status);
+            HostDestroyRootHub(bench.rootHub);
+            return EXIT_FAILURE;
+        }
+    }
+
+    ok = run(&bench);
+
+    cleanup_producers(&bench);
+    HostDestroyRootHub(bench.rootHub);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
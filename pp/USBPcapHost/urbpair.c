@@ -0,0 +1,519 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "urbpair.h"
+
+#define MIN_SLOTS                 64
+#define MIN_ENDPOINT_SLOTS        64
+
+/* Values below this have a bucket each */
+#define LATENCY_EXACT             4
+
+struct urb_slot
+{
+    unsigned long long irp;
+    unsigned long long timestamp;     /* Submit */
+    unsigned long long offset;        /* Submit record */
+    unsigned int       endpoint;      /* Index in endpoints */
+    unsigned int       bytes;
+    unsigned short     bus;
+    unsigned char      used;
+};
+
+unsigned int urb_latency_bucket(unsigned long long ns)
+{
+    unsigned int bits = 0;
+    unsigned int index;
+
+    if (ns < LATENCY_EXACT)
+    {
+        return (unsigned int)ns;
+    }
+
+    while ((ns >> bits) > 1)
+    {
+        bits++;
+    }
+    index = 4 * (bits - 1) + (unsigned int)((ns >> (bits - 2)) & 3);
+    return (index < URB_LATENCY_BUCKETS) ? index : URB_LATENCY_BUCKETS - 1;
+}
+
+unsigned long long urb_latency_bucket_start(unsigned int index)
+{
+    if (index < LATENCY_EXACT)
+    {
+        return index;
+    }
+    return (4ULL + (index & 3)) << (index / 4 - 1);
+}
+
+unsigned long long urb_latency_percentile(const unsigned long long *latency,
+                                          unsigned long long max,
+                                          unsigned int pct)
+{
+    unsigned long long count = 0;
+    unsigned long long target;
+    unsigned long long seen = 0;
+    unsigned long long low, high, value;
+    unsigned int i;
+
+    for (i = 0; i < URB_LATENCY_BUCKETS; i++)
+    {
+        count += latency[i];
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    target = (count * pct + 99) / 100;
+    for (i = 0; i < URB_LATENCY_BUCKETS; i++)
+    {
+        seen += latency[i];
+        if (seen >= target)
+        {
+            break;
+        }
+    }
+    if (i >= URB_LATENCY_BUCKETS)
+    {
+        return max;
+    }
+
+    /* Last bucket has no upper bound but the maximum itself */
+    low = urb_latency_bucket_start(i);
+    high = (i < URB_LATENCY_BUCKETS - 1) ? urb_latency_bucket_start(i + 1) - 1 : max;
+    if (high <= low)
+    {
+        value = low;
+    }
+    else
+    {
+        value = low + (unsigned long long)((double)(high - low) *
+                                           (target - (seen - latency[i])) / latency[i]);
+    }
+    return (value < max) ? value : max;
+}
+
+static unsigned int home_slot(const struct urb_pairer *p, unsigned long long irp,
+                              unsigned int bus)
+{
+    unsigned long long h = (irp ^ ((unsigned long long)bus << 48)) * 0x9E3779B97F4A7C15ULL;
+
+    return (unsigned int)(h >> 32) & (p->slot_count - 1);
+}
+
+/* Slot of IRP id, or the free slot where it would go */
+static struct urb_slot *probe(struct urb_slot *slots, const struct urb_pairer *p,
+                              unsigned long long irp, unsigned int bus)
+{
+    unsigned int mask = p->slot_count - 1;
+    unsigned int i = home_slot(p, irp, bus);
+
+    while (slots[i].used && ((slots[i].irp != irp) || (slots[i].bus != bus)))
+    {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+/* Backward shift deletion, keeps probe sequences without tombstones */
+static void remove_slot(struct urb_pairer *p, struct urb_slot *slot)
+{
+    unsigned int mask = p->slot_count - 1;
+    unsigned int i = (unsigned int)(slot - p->slots);
+    unsigned int j = i;
+    unsigned int k;
+
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (!p->slots[j].used)
+        {
+            break;
+        }
+        k = home_slot(p, p->slots[j].irp, p->slots[j].bus);
+        if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+        {
+            continue;
+        }
+        p->slots[i] = p->slots[j];
+        i = j;
+    }
+    p->slots[i].used = 0;
+    p->count--;
+}
+
+static struct urb_endpoint *find_endpoint(struct urb_pairer *p, unsigned int bus,
+                                          unsigned int device, unsigned int endpoint,
+                                          unsigned long long ts, unsigned int *index)
+{
+    unsigned long long key = ((unsigned long long)bus << 24) | (device << 8) | endpoint;
+    unsigned int mask = p->endpoint_slot_count - 1;
+    unsigned int slot = (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 40) & mask;
+    struct urb_endpoint *ep;
+    unsigned int *slots;
+    unsigned int count;
+    unsigned int i;
+
+    while (p->endpoint_slots[slot] != 0)
+    {
+        ep = &p->endpoints[p->endpoint_slots[slot] - 1];
+        if ((ep->bus == bus) && (ep->device == device) && (ep->endpoint == endpoint))
+        {
+            *index = p->endpoint_slots[slot] - 1;
+            return ep;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (p->endpoint_count == p->endpoint_size)
+    {
+        unsigned int size = p->endpoint_size ? p->endpoint_size * 2 : 16;
+
+        ep = realloc(p->endpoints, size * sizeof(struct urb_endpoint));
+        if (ep == NULL)
+        {
+            return NULL;
+        }
+        p->endpoints = ep;
+        p->endpoint_size = size;
+    }
+
+    ep = &p->endpoints[p->endpoint_count];
+    memset(ep, 0, sizeof(struct urb_endpoint));
+    ep->bus = (unsigned short)bus;
+    ep->device = (unsigned short)device;
+    ep->endpoint = (unsigned char)endpoint;
+    ep->depth_ts = ts;
+    *index = p->endpoint_count++;
+    p->endpoint_slots[slot] = p->endpoint_count;
+
+    if (p->endpoint_count * 2 > p->endpoint_slot_count)
+    {
+        count = p->endpoint_slot_count * 2;
+        slots = calloc(count, sizeof(unsigned int));
+        if (slots == NULL)
+        {
+            return NULL;
+        }
+        for (i = 0; i < p->endpoint_count; i++)
+        {
+            const struct urb_endpoint *e = &p->endpoints[i];
+
+            key = ((unsigned long long)e->bus << 24) | (e->device << 8) | e->endpoint;
+            slot = (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 40) & (count - 1);
+            while (slots[slot] != 0)
+            {
+                slot = (slot + 1) & (count - 1);
+            }
+            slots[slot] = i + 1;
+        }
+        free(p->endpoint_slots);
+        p->endpoint_slots = slots;
+        p->endpoint_slot_count = count;
+    }
+    return &p->endpoints[*index];
+}
+
+static void depth_change(struct urb_endpoint *ep, unsigned long long ts, int delta)
+{
+    if (ts > ep->depth_ts)
+    {
+        ep->depth_area += ep->depth * (ts - ep->depth_ts);
+        ep->depth_ts = ts;
+    }
+    ep->depth += delta;
+}
+
+/*
+ * Evicts URBs submitted before cutoff, counting them in *evicted. Kept
+ * ones are moved to the spare table which then becomes the table.
+ */
+static void sweep(struct urb_pairer *p, unsigned long long cutoff,
+                  unsigned long long now, unsigned long long *evicted)
+{
+    struct urb_slot *slots = p->spare;
+    unsigned int i;
+
+    memset(slots, 0, p->slot_count * sizeof(struct urb_slot));
+    for (i = 0; i < p->slot_count; i++)
+    {
+        const struct urb_slot *s = &p->slots[i];
+
+        if (!s->used)
+        {
+            continue;
+        }
+        if (s->timestamp < cutoff)
+        {
+            struct urb_endpoint *ep = &p->endpoints[s->endpoint];
+
+            ep->orphans++;
+            depth_change(ep, now, -1);
+            p->count--;
+            (*evicted)++;
+        }
+        else
+        {
+            *probe(slots, p, s->irp, s->bus) = *s;
+        }
+    }
+
+    p->spare = p->slots;
+    p->slots = slots;
+}
+
+/* Evicts the oldest URBs until table is at most half full */
+static void evict_oldest(struct urb_pairer *p, unsigned long long now)
+{
+    unsigned long long oldest;
+    unsigned int i;
+
+    while (p->count > p->slot_count / 2)
+    {
+        oldest = now;
+        for (i = 0; i < p->slot_count; i++)
+        {
+            if (p->slots[i].used && (p->slots[i].timestamp < oldest))
+            {
+                oldest = p->slots[i].timestamp;
+            }
+        }
+        sweep(p, oldest + (now - oldest) / 2 + 1, now, &p->overflowed);
+    }
+}
+
+static void submit(struct urb_pairer *p, unsigned int index,
+                   const struct pcap_record *record, unsigned long long irp,
+                   unsigned int bus, unsigned int length)
+{
+    unsigned long long ts = record->timestamp;
+    struct urb_endpoint *ep;
+    struct urb_slot *s;
+
+    if ((p->timeout != 0) && (ts >= p->next_sweep))
+    {
+        if (ts > p->timeout)
+        {
+            sweep(p, ts - p->timeout, ts, &p->timed_out);
+        }
+        p->next_sweep = ts + p->timeout / 4;
+    }
+
+    s = probe(p->slots, p, irp, bus);
+    if (s->used)
+    {
+        /* Completion was not captured and the IRP got reused */
+        ep = &p->endpoints[s->endpoint];
+        ep->orphans++;
+        depth_change(ep, ts, -1);
+        p->reused++;
+    }
+    else
+    {
+        if (p->count + 1 > p->slot_count / 4 * 3)
+        {
+            evict_oldest(p, ts);
+            s = probe(p->slots, p, irp, bus);
+        }
+        p->count++;
+    }
+
+    s->irp = irp;
+    s->timestamp = ts;
+    s->offset = record->offset;
+    s->endpoint = index;
+    s->bytes = length;
+    s->bus = (unsigned short)bus;
+    s->used = 1;
+
+    ep = &p->endpoints[index];
+    depth_change(ep, ts, 1);
+    ep->depth_hist[(ep->depth < URB_DEPTH_BUCKETS) ? ep->depth : URB_DEPTH_BUCKETS - 1]++;
+    if (ep->depth > ep->depth_max)
+    {
+        ep->depth_max = ep->depth;
+    }
+}
+
+static void complete(struct urb_pairer *p, const struct pcap_record *record,
+                     unsigned long long irp, unsigned int bus, unsigned int length)
+{
+    unsigned long long ts = record->timestamp;
+    unsigned long long latency;
+    struct urb_endpoint *ep;
+    struct urb_pair pair;
+    struct urb_slot *s;
+
+    s = probe(p->slots, p, irp, bus);
+    if (!s->used)
+    {
+        p->unmatched++;
+        return;
+    }
+
+    ep = &p->endpoints[s->endpoint];
+    pair.irp = irp;
+    pair.submit_offset = s->offset;
+    pair.complete_offset = record->offset;
+    pair.submit_ts = s->timestamp;
+    pair.complete_ts = ts;
+    pair.status = pcap_le32(&record->usb->status);
+    pair.bytes = s->bytes + length;
+    pair.endpoint = ep;
+    remove_slot(p, s);
+
+    latency = (ts > pair.submit_ts) ? ts - pair.submit_ts : 0;
+    ep->urbs++;
+    if (pair.status != 0)
+    {
+        ep->errors++;
+    }
+    ep->latency_sum += latency;
+    if (latency > ep->latency_max)
+    {
+        ep->latency_max = latency;
+    }
+    ep->latency[urb_latency_bucket(latency)]++;
+    depth_change(ep, ts, -1);
+
+    p->pairs++;
+    if (p->fn != NULL)
+    {
+        p->fn(p->context, &pair);
+    }
+}
+
+int urb_pair_init(struct urb_pairer *p, unsigned int slot_count,
+                  unsigned long long timeout, urb_pair_fn fn, void *context)
+{
+    unsigned int count = MIN_SLOTS;
+
+    memset(p, 0, sizeof(struct urb_pairer));
+    if (slot_count == 0)
+    {
+        slot_count = URB_PAIR_DEFAULT_SLOTS;
+    }
+    while ((count < slot_count) && (count < 0x40000000U))
+    {
+        count <<= 1;
+    }
+
+    p->slot_count = count;
+    p->timeout = timeout;
+    p->fn = fn;
+    p->context = context;
+    p->slots = calloc(count, sizeof(struct urb_slot));
+    p->spare = calloc(count, sizeof(struct urb_slot));
+    p->endpoint_slot_count = MIN_ENDPOINT_SLOTS;
+    p->endpoint_slots = calloc(MIN_ENDPOINT_SLOTS, sizeof(unsigned int));
+    if ((p->slots == NULL) || (p->spare == NULL) || (p->endpoint_slots == NULL))
+    {
+        urb_pair_destroy(p);
+        return 0;
+    }
+    return 1;
+}
+
+void urb_pair_record(struct urb_pairer *p, const struct pcap_record *record)
+{
+    const USBPCAP_BUFFER_PACKET_HEADER *usb = record->usb;
+    const USBPCAP_BUFFER_CONTROL_HEADER *control;
+    unsigned long long irp = pcap_le64(&usb->irpId);
+    unsigned int bus = pcap_le16(&usb->bus);
+    unsigned int length = pcap_le32(&usb->dataLength);
+    struct urb_endpoint *ep;
+    struct urb_slot *s;
+    unsigned int index;
+
+    if (p->records++ == 0)
+    {
+        p->first_ts = record->timestamp;
+    }
+    p->last_ts = record->timestamp;
+
+    if (usb->transfer == USBPCAP_TRANSFER_IRP_INFO)
+    {
+        return;
+    }
+
+    ep = find_endpoint(p, bus, pcap_le16(&usb->device), usb->endpoint,
+                       record->timestamp, &index);
+    if (ep == NULL)
+    {
+        p->failed = 1;
+        return;
+    }
+    ep->transfer = usb->transfer;
+    ep->bytes += length;
+
+    control = pcap_record_control(record);
+    if ((control != NULL) && (control->stage == USBPCAP_CONTROL_STAGE_DATA))
+    {
+        /* Part of URB submitted with SETUP stage */
+        s = probe(p->slots, p, irp, bus);
+        if (s->used)
+        {
+            s->bytes += length;
+        }
+        return;
+    }
+
+    if (usb->info & USBPCAP_INFO_PDO_TO_FDO)
+    {
+        complete(p, record, irp, bus, length);
+    }
+    else
+    {
+        submit(p, index, record, irp, bus, length);
+    }
+}
+
+void urb_pair_finish(struct urb_pairer *p)
+{
+    unsigned int i;
+
+    for (i = 0; i < p->slot_count; i++)
+    {
+        if (p->slots[i].used)
+        {
+            struct urb_endpoint *ep = &p->endpoints[p->slots[i].endpoint];
+
+            ep->orphans++;
+            depth_change(ep, p->last_ts, -1);
+            p->slots[i].used = 0;
+            p->in_flight++;
+        }
+    }
+    p->count = 0;
+    urb_pair_advance(p, p->last_ts);
+}
+
+void urb_pair_advance(struct urb_pairer *p, unsigned long long ts)
+{
+    unsigned int i;
+
+    for (i = 0; i < p->endpoint_count; i++)
+    {
+        depth_change(&p->endpoints[i], ts, 0);
+    }
+}
+
+void urb_pair_destroy(struct urb_pairer *p)
+{
+    free(p->slots);
+    free(p->spare);
+    free(p->endpoints);
+    free(p->endpoint_slots);
+    p->slots = NULL;
+    p->spare = NULL;
+    p->endpoints = NULL;
+    p->endpoint_slots = NULL;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Streaming URB pairing engine.
+ *
+ * Records are passed in capture order. A record without
+ * USBPCAP_INFO_PDO_TO_FDO submits an URB, one with it completes the URB
+ * with the same IRP id on the same bus. Control transfer DATA stage
+ * records belong to the URB of their SETUP stage, IRP information
+ * records are ignored.
+ *
+ * URBs in flight are kept in an open addressing hash table with linear
+ * probing of fixed size, so memory stays bounded whatever the capture
+ * is. Submits older than timeout are evicted as orphans when the table
+ * is swept, every quarter of timeout. If the table still fills up, the
+ * oldest half of URBs is evicted. A submit of IRP id that is already in
+ * flight means the IRP was completed without being captured and then
+ * reused, the earlier URB is counted as orphan too.
+ *
+ * Every endpoint keeps URB, error and byte counters, latency histogram
+ * with four buckets per power of two nanoseconds and queue depth, i.e.
+ * URBs in flight, both as histogram sampled at every submit and as
+ * integral over time. Counters are cumulative, snapshots can be diffed
+ * to get them over time.
+ */
+
+#ifndef USBPCAP_HOST_URBPAIR_H
+#define USBPCAP_HOST_URBPAIR_H
+
+#include "pcapfile.h"
+
+#define URB_PAIR_DEFAULT_SLOTS    (1 << 16)
+#define URB_PAIR_DEFAULT_TIMEOUT  (5 * 1000000000ULL)
+
+#define URB_LATENCY_BUCKETS       128
+#define URB_DEPTH_BUCKETS         64  /* Last one for deeper queues */
+
+struct urb_endpoint
+{
+    unsigned short     bus;
+    unsigned short     device;
+    unsigned char      endpoint;
+    unsigned char      transfer;
+
+    unsigned long long urbs;          /* Completed and paired */
+    unsigned long long errors;        /* ...with non-zero status */
+    unsigned long long bytes;         /* dataLength of all records */
+    unsigned long long orphans;       /* Submits never completed */
+    unsigned long long latency_sum;   /* ns */
+    unsigned long long latency_max;
+    unsigned long long latency[URB_LATENCY_BUCKETS];
+
+    unsigned int       depth;         /* URBs in flight now */
+    unsigned int       depth_max;
+    unsigned long long depth_hist[URB_DEPTH_BUCKETS];
+    unsigned long long depth_area;    /* Sum of depth times ns */
+    unsigned long long depth_ts;      /* Last change of depth */
+};
+
+struct urb_pair
+{
+    unsigned long long irp;
+    unsigned long long submit_offset;
+    unsigned long long complete_offset;
+    unsigned long long submit_ts;
+    unsigned long long complete_ts;
+    unsigned int       status;
+    unsigned int       bytes;          /* dataLength of submit and completion */
+    const struct urb_endpoint *endpoint;
+};
+
+/* Called for every completed URB */
+typedef void (*urb_pair_fn)(void *context, const struct urb_pair *pair);
+
+struct urb_slot;
+
+struct urb_pairer
+{
+    struct urb_slot    *slots;
+    struct urb_slot    *spare;        /* Swapped with slots when sweeping */
+    unsigned int        slot_count;
+    unsigned int        count;
+    unsigned long long  timeout;
+    unsigned long long  next_sweep;
+
+    struct urb_endpoint *endpoints;
+    unsigned int        endpoint_count;
+    unsigned int        endpoint_size;
+    unsigned int       *endpoint_slots; /* Endpoint index + 1, 0 if free */
+    unsigned int        endpoint_slot_count;
+
+    urb_pair_fn         fn;           /* May be NULL */
+    void               *context;
+
+    unsigned long long  records;
+    unsigned long long  pairs;
+    unsigned long long  unmatched;    /* Completions without submit */
+    unsigned long long  reused;       /* Submits of IRP id in flight */
+    unsigned long long  timed_out;    /* Evicted after timeout */
+    unsigned long long  overflowed;   /* Evicted because table was full */
+    unsigned long long  in_flight;    /* Left when finished */
+    unsigned long long  first_ts;
+    unsigned long long  last_ts;
+    int                 failed;       /* Out of memory for endpoints */
+};
+
+/*
+ * slot_count is rounded up to power of two, 0 for default. timeout is
+ * in nanoseconds, 0 for no timeout. Returns 0 if memory could not be
+ * allocated.
+ */
+int urb_pair_init(struct urb_pairer *p, unsigned int slot_count,
+                  unsigned long long timeout, urb_pair_fn fn, void *context);
+
+void urb_pair_record(struct urb_pairer *p, const struct pcap_record *record);
+
+/* Brings depth integrals of all endpoints up to ts */
+void urb_pair_advance(struct urb_pairer *p, unsigned long long ts);
+
+/* Counts URBs still in flight as orphans and closes depth integrals */
+void urb_pair_finish(struct urb_pairer *p);
+
+void urb_pair_destroy(struct urb_pairer *p);
+
+/*
+ * Latency in ns that pct percent of URBs of histogram did not exceed.
+ * The value is interpolated linearly by rank between the start and end
+ * of the bucket it falls into, assuming latencies spread evenly in the
+ * bucket, and clamped to max, the highest latency seen. The last bucket
+ * ends at max, so latencies beyond the histogram range are not cut.
+ */
+unsigned long long urb_latency_percentile(const unsigned long long *latency,
+                                          unsigned long long max,
+                                          unsigned int pct);
+
+/* Bucket of histogram that latency ns is counted in */
+unsigned int urb_latency_bucket(unsigned long long ns);
+
+/* Lowest latency in ns that falls into bucket */
+unsigned long long urb_latency_bucket_start(unsigned int index);
+
+#endif /* USBPCAP_HOST_URBPAIR_H */
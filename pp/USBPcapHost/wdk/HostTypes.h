@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**************************************************************************
+ *
+ * Windows base types for user-mode host builds.
+ *
+ * All sizes follow the Windows LLP64 model (LONG and ULONG are always
+ * 32 bits wide), so structures shared with the driver have the same
+ * layout as on Windows.
+ *
+ **************************************************************************/
+
+#ifndef USBPCAP_HOST_TYPES_H
+#define USBPCAP_HOST_TYPES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef VOID
+#define VOID void
+#endif
+
+typedef void                *PVOID, **PPVOID;
+typedef char                CHAR, CCHAR, *PCHAR, *PSTR;
+typedef const char          *PCSTR;
+typedef unsigned char       UCHAR, *PUCHAR;
+typedef int16_t             SHORT, *PSHORT;
+typedef uint16_t            USHORT, *PUSHORT;
+typedef int32_t             LONG, *PLONG;
+typedef uint32_t            ULONG, *PULONG;
+typedef int64_t             LONGLONG, *PLONGLONG;
+typedef uint64_t            ULONGLONG, *PULONGLONG;
+typedef int                 INT, *PINT;
+typedef unsigned int        UINT, *PUINT;
+typedef int8_t              INT8, *PINT8;
+typedef uint8_t             UINT8, *PUINT8;
+typedef int16_t             INT16, *PINT16;
+typedef uint16_t            UINT16, *PUINT16;
+typedef int32_t             INT32, *PINT32;
+typedef uint32_t            UINT32, *PUINT32;
+typedef int64_t             INT64, *PINT64;
+typedef uint64_t            UINT64, *PUINT64;
+typedef intptr_t            LONG_PTR, INT_PTR;
+typedef uintptr_t           ULONG_PTR, UINT_PTR, *PULONG_PTR;
+typedef size_t              SIZE_T, *PSIZE_T;
+typedef ULONG               CLONG;
+typedef UCHAR               BOOLEAN, *PBOOLEAN;
+typedef int                 BOOL;
+typedef uint8_t             BYTE, *PBYTE;
+typedef uint16_t            WORD;
+typedef uint32_t            DWORD, *PDWORD;
+typedef LONG                NTSTATUS, *PNTSTATUS;
+typedef PVOID               HANDLE, *PHANDLE;
+typedef ULONG               ACCESS_MASK;
+
+/* WCHAR is always UTF-16. Sources using L"" literals with WCHAR must be
+ * compiled with -fshort-wchar.
+ */
+typedef uint16_t            WCHAR, *PWCHAR, *PWSTR;
+typedef const WCHAR         *PCWSTR;
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        ULONG LowPart;
+        LONG  HighPart;
+    };
+    struct
+    {
+        ULONG LowPart;
+        LONG  HighPart;
+    } u;
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef union _ULARGE_INTEGER
+{
+    struct
+    {
+        ULONG LowPart;
+        ULONG HighPart;
+    };
+    struct
+    {
+        ULONG LowPart;
+        ULONG HighPart;
+    } u;
+    ULONGLONG QuadPart;
+} ULARGE_INTEGER, *PULARGE_INTEGER;
+
+typedef struct _GUID
+{
+    UINT32 Data1;
+    UINT16 Data2;
+    UINT16 Data3;
+    UINT8  Data4[8];
+} GUID, *PGUID, *LPGUID;
+typedef const GUID *LPCGUID;
+
+#ifdef INITGUID
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    const GUID name = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+#else
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    extern const GUID name
+#endif
+
+#ifndef TRUE
+#define TRUE  1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define UNALIGNED
+#define CONST const
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *)((PCHAR)(address) - offsetof(type, field)))
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+#define STATUS_SUCCESS                 ((NTSTATUS)0x00000000L)
+#define STATUS_WAIT_0                  ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                 ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                 ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW         ((NTSTATUS)0x80000005L)
+#define STATUS_UNSUCCESSFUL            ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED         ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_HANDLE          ((NTSTATUS)0xC0000008L)
+#define STATUS_INVALID_PARAMETER       ((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST  ((NTSTATUS)0xC0000010L)
+#define STATUS_ACCESS_DENIED           ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL        ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_TYPE_MISMATCH    ((NTSTATUS)0xC0000024L)
+#define STATUS_OBJECT_NAME_NOT_FOUND   ((NTSTATUS)0xC0000034L)
+#define STATUS_INSUFFICIENT_RESOURCES  ((NTSTATUS)0xC000009AL)
+#define STATUS_DEVICE_NOT_READY        ((NTSTATUS)0xC00000A3L)
+#define STATUS_NOT_SUPPORTED           ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED               ((NTSTATUS)0xC0000120L)
+#define STATUS_NOT_FOUND               ((NTSTATUS)0xC0000225L)
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#define FILE_DEVICE_UNKNOWN  0x00000022
+#define FILE_DEVICE_USB      FILE_DEVICE_UNKNOWN
+
+#define METHOD_BUFFERED      0
+#define METHOD_IN_DIRECT     1
+#define METHOD_OUT_DIRECT    2
+#define METHOD_NEITHER       3
+
+#define FILE_ANY_ACCESS      0
+#define FILE_READ_ACCESS     0x0001
+#define FILE_WRITE_ACCESS    0x0002
+
+/* Code analysis annotations carry no meaning for gcc/clang */
+#define __in
+#define __out
+#define __inout
+#define __in_opt
+#define __out_opt
+#define __drv_in(x)
+#define __drv_out_deref(x)
+#define __drv_savesIRQL
+#define __drv_restoresIRQL
+#define __drv_raisesIRQL(x)
+#define __drv_maxIRQL(x)
+#define __drv_minIRQL(x)
+#define __drv_requiresIRQL(x)
+#define __drv_dispatchType(x)
+#define __drv_dispatchType_other
+#define __drv_functionClass(x)
+#define __drv_sameIRQL
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBPCAP_HOST_TYPES_H */
@@ -0,0 +1,12 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_HOST_NTDDK_H
+#define USBPCAP_HOST_NTDDK_H
+
+#include "Wdm.h"
+
+#endif /* USBPCAP_HOST_NTDDK_H */
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_HOST_USBDLIB_H
+#define USBPCAP_HOST_USBDLIB_H
+
+#include "usb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Searches configuration descriptor for interface descriptor matching
+ * the criteria. Any of the criteria set to -1 is ignored.
+ */
+PUSB_INTERFACE_DESCRIPTOR
+USBD_ParseConfigurationDescriptorEx(PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor,
+                                    PVOID StartPosition,
+                                    LONG InterfaceNumber,
+                                    LONG AlternateSetting,
+                                    LONG InterfaceClass,
+                                    LONG InterfaceSubClass,
+                                    LONG InterfaceProtocol);
+
+PUSB_COMMON_DESCRIPTOR
+USBD_ParseDescriptors(PVOID DescriptorBuffer,
+                      ULONG TotalLength,
+                      PVOID StartPosition,
+                      LONG DescriptorType);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBPCAP_HOST_USBDLIB_H */
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_HOST_USBIOCTL_H
+#define USBPCAP_HOST_USBIOCTL_H
+
+#include "usb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* {F18A0E88-C30C-11D0-8815-00A0C906BED8} */
+DEFINE_GUID(GUID_DEVINTERFACE_USB_HUB, 0xf18a0e88, 0xc30c, 0x11d0,
+            0x88, 0x15, 0x00, 0xa0, 0xc9, 0x06, 0xbe, 0xd8);
+
+#define USB_GET_NODE_INFORMATION                258
+#define USB_GET_NODE_CONNECTION_INFORMATION     259
+#define USB_GET_DESCRIPTOR_FROM_NODE_CONNECTION 260
+#define USB_GET_NODE_CONNECTION_NAME            261
+#define USB_GET_NODE_CONNECTION_DRIVERKEY_NAME  264
+#define USB_GET_HUB_CAPABILITIES                271
+
+#define IOCTL_USB_GET_NODE_INFORMATION \
+    CTL_CODE(FILE_DEVICE_USB, USB_GET_NODE_INFORMATION, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_USB_GET_NODE_CONNECTION_INFORMATION \
+    CTL_CODE(FILE_DEVICE_USB, USB_GET_NODE_CONNECTION_INFORMATION, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_USB_GET_DESCRIPTOR_FROM_NODE_CONNECTION \
+    CTL_CODE(FILE_DEVICE_USB, USB_GET_DESCRIPTOR_FROM_NODE_CONNECTION, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_USB_GET_NODE_CONNECTION_NAME \
+    CTL_CODE(FILE_DEVICE_USB, USB_GET_NODE_CONNECTION_NAME, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_USB_GET_NODE_CONNECTION_DRIVERKEY_NAME \
+    CTL_CODE(FILE_DEVICE_USB, USB_GET_NODE_CONNECTION_DRIVERKEY_NAME, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef enum _USB_HUB_NODE
+{
+    UsbHub,
+    UsbMIParent
+} USB_HUB_NODE;
+
+typedef enum _USB_CONNECTION_STATUS
+{
+    NoDeviceConnected,
+    DeviceConnected,
+    DeviceFailedEnumeration,
+    DeviceGeneralFailure,
+    DeviceCausedOvercurrent,
+    DeviceNotEnoughPower,
+    DeviceNotEnoughBandwidth,
+    DeviceHubNestedTooDeeply,
+    DeviceInLegacyHub,
+    DeviceEnumerating,
+    DeviceReset
+} USB_CONNECTION_STATUS;
+
+#pragma pack(push, 1)
+typedef struct _USB_HUB_DESCRIPTOR
+{
+    UCHAR   bDescriptorLength;
+    UCHAR   bDescriptorType;
+    UCHAR   bNumberOfPorts;
+    USHORT  wHubCharacteristics;
+    UCHAR   bPowerOnToPowerGood;
+    UCHAR   bHubControlCurrent;
+    UCHAR   bRemoveAndPowerMask[64];
+} USB_HUB_DESCRIPTOR, *PUSB_HUB_DESCRIPTOR;
+
+typedef struct _USB_HUB_INFORMATION
+{
+    USB_HUB_DESCRIPTOR  HubDescriptor;
+    BOOLEAN             HubIsBusPowered;
+} USB_HUB_INFORMATION, *PUSB_HUB_INFORMATION;
+
+typedef struct _USB_MI_PARENT_INFORMATION
+{
+    ULONG  NumberOfInterfaces;
+} USB_MI_PARENT_INFORMATION, *PUSB_MI_PARENT_INFORMATION;
+
+typedef struct _USB_NODE_INFORMATION
+{
+    USB_HUB_NODE  NodeType;
+    union
+    {
+        USB_HUB_INFORMATION        HubInformation;
+        USB_MI_PARENT_INFORMATION  MiParentInformation;
+    } u;
+} USB_NODE_INFORMATION, *PUSB_NODE_INFORMATION;
+
+typedef struct _USB_PIPE_INFO
+{
+    USB_ENDPOINT_DESCRIPTOR  EndpointDescriptor;
+    ULONG                    ScheduleOffset;
+} USB_PIPE_INFO, *PUSB_PIPE_INFO;
+
+typedef struct _USB_NODE_CONNECTION_INFORMATION
+{
+    ULONG                  ConnectionIndex;
+    USB_DEVICE_DESCRIPTOR  DeviceDescriptor;
+    UCHAR                  CurrentConfigurationValue;
+    BOOLEAN                LowSpeed;
+    BOOLEAN                DeviceIsHub;
+    USHORT                 DeviceAddress;
+    ULONG                  NumberOfOpenPipes;
+    USB_CONNECTION_STATUS  ConnectionStatus;
+    USB_PIPE_INFO          PipeList[0];
+} USB_NODE_CONNECTION_INFORMATION, *PUSB_NODE_CONNECTION_INFORMATION;
+
+typedef struct _USB_NODE_CONNECTION_DRIVERKEY_NAME
+{
+    ULONG  ConnectionIndex;
+    ULONG  ActualLength;
+    WCHAR  DriverKeyName[1];
+} USB_NODE_CONNECTION_DRIVERKEY_NAME, *PUSB_NODE_CONNECTION_DRIVERKEY_NAME;
+#pragma pack(pop)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBPCAP_HOST_USBIOCTL_H */
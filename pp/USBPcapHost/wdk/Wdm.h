@@ -0,0 +1,764 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**************************************************************************
+ *
+ * Subset of the Windows kernel API needed to run the USBPcap capture
+ * core in user mode. Objects keep the WDK field names used by the driver;
+ * the runtime is implemented in HostWdm.c, HostGenericTable.c and
+ * HostUsbd.c.
+ *
+ **************************************************************************/
+
+#ifndef USBPCAP_HOST_WDM_H
+#define USBPCAP_HOST_WDM_H
+
+#include <assert.h>
+#include <pthread.h>
+
+#include "HostTypes.h"
+#include "usb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef DBG
+#define DBG 0
+#endif
+
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#define NTDDI_WINXP  0x05010000
+#define NTDDI_VISTA  0x06000000
+#define NTDDI_WIN7   0x06010000
+#define NTDDI_WIN8   0x06020000
+
+#ifndef NTDDI_VERSION
+#define NTDDI_VERSION NTDDI_WIN8
+#endif
+
+ULONG DbgPrint(PCSTR Format, ...);
+
+#if DBG
+#define KdPrint(_x_)  DbgPrint _x_
+#define ASSERT(_e_)   assert(_e_)
+#else
+#define KdPrint(_x_)
+#define ASSERT(_e_)   ((void)0)
+#endif
+
+#define PAGED_CODE()
+
+#define RtlCopyMemory(Destination, Source, Length) \
+    memcpy((Destination), (Source), (Length))
+#define RtlMoveMemory(Destination, Source, Length) \
+    memmove((Destination), (Source), (Length))
+#define RtlFillMemory(Destination, Length, Fill) \
+    memset((Destination), (Fill), (Length))
+#define RtlZeroMemory(Destination, Length) \
+    memset((Destination), 0, (Length))
+
+/* Only used on WCHAR strings in the driver */
+int HostWcscmp(PCWSTR string1, PCWSTR string2);
+#define wcscmp HostWcscmp
+
+#define UNICODE_NULL ((WCHAR)0)
+
+typedef struct _UNICODE_STRING
+{
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PWSTR   Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+VOID RtlInitUnicodeString(PUNICODE_STRING DestinationString,
+                          PCWSTR SourceString);
+BOOLEAN RtlEqualUnicodeString(PCUNICODE_STRING String1,
+                              PCUNICODE_STRING String2,
+                              BOOLEAN CaseInSensitive);
+NTSTATUS RtlUnicodeStringToInteger(PCUNICODE_STRING String,
+                                   ULONG Base,
+                                   PULONG Value);
+
+/* Doubly linked lists */
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+__inline static VOID InitializeListHead(PLIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+__inline static BOOLEAN IsListEmpty(const LIST_ENTRY *ListHead)
+{
+    return (BOOLEAN)(ListHead->Flink == ListHead);
+}
+
+__inline static BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Blink = Entry->Blink;
+    PLIST_ENTRY Flink = Entry->Flink;
+
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+    return (BOOLEAN)(Flink == Blink);
+}
+
+__inline static PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY Entry = ListHead->Flink;
+
+    RemoveEntryList(Entry);
+    return Entry;
+}
+
+__inline static VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Blink = ListHead->Blink;
+
+    Entry->Flink = ListHead;
+    Entry->Blink = Blink;
+    Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+__inline static VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Flink = ListHead->Flink;
+
+    Entry->Flink = Flink;
+    Entry->Blink = ListHead;
+    Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+/* Interlocked operations */
+__inline static LONG InterlockedIncrement(volatile LONG *Addend)
+{
+    return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+__inline static LONG InterlockedDecrement(volatile LONG *Addend)
+{
+    return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+__inline static LONG InterlockedExchangeAdd(volatile LONG *Addend, LONG Value)
+{
+    return __atomic_fetch_add(Addend, Value, __ATOMIC_SEQ_CST);
+}
+
+__inline static LONG InterlockedExchange(volatile LONG *Target, LONG Value)
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+__inline static LONG InterlockedCompareExchange(volatile LONG *Destination,
+                                                LONG Exchange,
+                                                LONG Comperand)
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+__inline static PVOID InterlockedCompareExchangePointer(PVOID volatile *Destination,
+                                                        PVOID Exchange,
+                                                        PVOID Comperand)
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+__inline static PVOID InterlockedExchangePointer(PVOID volatile *Target,
+                                                 PVOID Value)
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+/* IRQL and spin locks */
+typedef UCHAR KIRQL, *PKIRQL;
+
+#define PASSIVE_LEVEL   0
+#define APC_LEVEL       1
+#define DISPATCH_LEVEL  2
+
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+KIRQL KeGetCurrentIrql(VOID);
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock);
+VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql);
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql);
+VOID KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock);
+VOID KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK SpinLock);
+
+/* Memory pools */
+typedef enum _POOL_TYPE
+{
+    NonPagedPool,
+    PagedPool,
+    NonPagedPoolNx = 512
+} POOL_TYPE;
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
+PVOID ExAllocatePool(POOL_TYPE PoolType, SIZE_T NumberOfBytes);
+VOID ExFreePool(PVOID P);
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag);
+
+/* System time in 100 ns units since January 1, 1601 (UTC) */
+VOID KeQuerySystemTime(PLARGE_INTEGER CurrentTime);
+VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime);
+
+/* Dispatcher objects */
+typedef enum _EVENT_TYPE
+{
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _KWAIT_REASON
+{
+    Executive,
+    UserRequest = 6
+} KWAIT_REASON;
+
+typedef enum _MODE
+{
+    KernelMode,
+    UserMode
+} KPROCESSOR_MODE, MODE;
+
+typedef struct _KEVENT
+{
+    EVENT_TYPE       Type;
+    volatile LONG    SignalState;
+    pthread_mutex_t  HostMutex;
+    pthread_cond_t   HostCond;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+typedef LONG KPRIORITY;
+
+#define IO_NO_INCREMENT  0
+
+VOID KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+LONG KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait);
+VOID KeClearEvent(PRKEVENT Event);
+LONG KeResetEvent(PRKEVENT Event);
+LONG KeReadStateEvent(PRKEVENT Event);
+/* Object must point to KEVENT */
+NTSTATUS KeWaitForSingleObject(PVOID Object,
+                               KWAIT_REASON WaitReason,
+                               KPROCESSOR_MODE WaitMode,
+                               BOOLEAN Alertable,
+                               PLARGE_INTEGER Timeout);
+
+/* Object manager */
+typedef struct _OBJECT_TYPE *POBJECT_TYPE;
+typedef struct _OBJECT_HANDLE_INFORMATION *POBJECT_HANDLE_INFORMATION;
+
+#define EVENT_QUERY_STATE   0x0001
+#define EVENT_MODIFY_STATE  0x0002
+
+extern POBJECT_TYPE *ExEventObjectType;
+
+VOID ObReferenceObject(PVOID Object);
+VOID ObDereferenceObject(PVOID Object);
+/*
+ * Host handles are plain object pointers. Only ExEventObjectType is
+ * supported, so Handle must point to KEVENT.
+ */
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle,
+                                   ACCESS_MASK DesiredAccess,
+                                   POBJECT_TYPE ObjectType,
+                                   KPROCESSOR_MODE AccessMode,
+                                   PVOID *Object,
+                                   POBJECT_HANDLE_INFORMATION HandleInformation);
+
+/* Memory descriptor lists. Host MDLs always describe mapped memory. */
+typedef struct _MDL
+{
+    struct _MDL  *Next;
+    SHORT        Size;
+    SHORT        MdlFlags;
+    PVOID        Process;
+    PVOID        MappedSystemVa;
+    PVOID        StartVa;
+    ULONG        ByteCount;
+    ULONG        ByteOffset;
+} MDL, *PMDL;
+
+typedef enum _MM_PAGE_PRIORITY
+{
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+#define MmGetSystemAddressForMdlSafe(Mdl, Priority)  ((Mdl)->MappedSystemVa)
+#define MmGetMdlByteCount(Mdl)                       ((Mdl)->ByteCount)
+#define MmGetMdlVirtualAddress(Mdl)                  ((Mdl)->StartVa)
+
+/* I/O manager objects */
+struct _IRP;
+struct _DEVICE_OBJECT;
+struct _DRIVER_OBJECT;
+struct _IO_CSQ;
+
+typedef struct _IO_STATUS_BLOCK
+{
+    union
+    {
+        NTSTATUS  Status;
+        PVOID     Pointer;
+    };
+    ULONG_PTR  Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+typedef struct _FILE_OBJECT
+{
+    SHORT                  Type;
+    SHORT                  Size;
+    struct _DEVICE_OBJECT  *DeviceObject;
+    PVOID                  FsContext;
+    PVOID                  FsContext2;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _DEVICE_OBJECT
+{
+    SHORT                  Type;
+    USHORT                 Size;
+    LONG                   ReferenceCount;
+    struct _DRIVER_OBJECT  *DriverObject;
+    struct _DEVICE_OBJECT  *NextDevice;
+    struct _DEVICE_OBJECT  *AttachedDevice;
+    struct _IRP            *CurrentIrp;
+    ULONG                  Flags;
+    ULONG                  Characteristics;
+    PVOID                  DeviceExtension;
+    ULONG                  DeviceType;
+    CHAR                   StackSize;
+} DEVICE_OBJECT, *PDEVICE_OBJECT;
+
+#define DO_BUFFERED_IO         0x00000004
+#define DO_EXCLUSIVE           0x00000008
+#define DO_DIRECT_IO           0x00000010
+#define DO_DEVICE_INITIALIZING 0x00000080
+#define DO_POWER_PAGABLE       0x00002000
+
+typedef enum _DEVICE_RELATION_TYPE
+{
+    BusRelations,
+    EjectionRelations,
+    PowerRelations,
+    RemovalRelations,
+    TargetDeviceRelation
+} DEVICE_RELATION_TYPE;
+
+typedef struct _DEVICE_RELATIONS
+{
+    ULONG           Count;
+    PDEVICE_OBJECT  Objects[1];
+} DEVICE_RELATIONS, *PDEVICE_RELATIONS;
+
+#define IRP_MJ_CREATE                   0x00
+#define IRP_MJ_CLOSE                    0x02
+#define IRP_MJ_READ                     0x03
+#define IRP_MJ_WRITE                    0x04
+#define IRP_MJ_DEVICE_CONTROL           0x0e
+#define IRP_MJ_INTERNAL_DEVICE_CONTROL  0x0f
+#define IRP_MJ_CLEANUP                  0x12
+#define IRP_MJ_POWER                    0x16
+#define IRP_MJ_PNP                      0x1b
+#define IRP_MJ_MAXIMUM_FUNCTION         0x1b
+
+#define IRP_MN_START_DEVICE             0x00
+#define IRP_MN_REMOVE_DEVICE            0x02
+#define IRP_MN_QUERY_DEVICE_RELATIONS   0x07
+
+typedef struct _IO_STACK_LOCATION
+{
+    UCHAR  MajorFunction;
+    UCHAR  MinorFunction;
+    UCHAR  Flags;
+    UCHAR  Control;
+
+    union
+    {
+        struct
+        {
+            ULONG          Length;
+            ULONG          Key;
+            LARGE_INTEGER  ByteOffset;
+        } Read;
+
+        struct
+        {
+            ULONG          Length;
+            ULONG          Key;
+            LARGE_INTEGER  ByteOffset;
+        } Write;
+
+        struct
+        {
+            ULONG  OutputBufferLength;
+            ULONG  InputBufferLength;
+            ULONG  IoControlCode;
+            PVOID  Type3InputBuffer;
+        } DeviceIoControl;
+
+        struct
+        {
+            DEVICE_RELATION_TYPE  Type;
+        } QueryDeviceRelations;
+
+        struct
+        {
+            PVOID  Argument1;
+            PVOID  Argument2;
+            PVOID  Argument3;
+            PVOID  Argument4;
+        } Others;
+    } Parameters;
+
+    PDEVICE_OBJECT  DeviceObject;
+    PFILE_OBJECT    FileObject;
+    PVOID           CompletionRoutine;
+    PVOID           Context;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+typedef struct _IRP
+{
+    SHORT            Type;
+    USHORT           Size;
+    PMDL             MdlAddress;
+    ULONG            Flags;
+
+    union
+    {
+        struct _IRP  *MasterIrp;
+        LONG         IrpCount;
+        PVOID        SystemBuffer;
+    } AssociatedIrp;
+
+    IO_STATUS_BLOCK  IoStatus;
+    KPROCESSOR_MODE  RequestorMode;
+    BOOLEAN          PendingReturned;
+    CHAR             StackCount;
+    CHAR             CurrentLocation;
+    BOOLEAN          Cancel;
+    KIRQL            CancelIrql;
+
+    /* Filled in on completion when not NULL */
+    PIO_STATUS_BLOCK UserIosb;
+    PKEVENT          UserEvent;
+    PVOID            UserBuffer;
+
+    union
+    {
+        struct
+        {
+            PVOID          DriverContext[4];
+            PVOID          Thread;
+            PCHAR          AuxiliaryBuffer;
+            LIST_ENTRY     ListEntry;
+            union
+            {
+                struct _IO_STACK_LOCATION  *CurrentStackLocation;
+                ULONG                      PacketType;
+            };
+            PFILE_OBJECT   OriginalFileObject;
+        } Overlay;
+    } Tail;
+} IRP, *PIRP;
+
+typedef struct _IO_REMOVE_LOCK
+{
+    volatile LONG  IoCount;
+    BOOLEAN        Removed;
+    KEVENT         RemoveEvent;
+} IO_REMOVE_LOCK, *PIO_REMOVE_LOCK;
+
+typedef NTSTATUS DRIVER_DISPATCH(struct _DEVICE_OBJECT *DeviceObject,
+                                 struct _IRP *Irp);
+typedef DRIVER_DISPATCH *PDRIVER_DISPATCH;
+
+typedef NTSTATUS DRIVER_ADD_DEVICE(struct _DRIVER_OBJECT *DriverObject,
+                                   struct _DEVICE_OBJECT *PhysicalDeviceObject);
+typedef DRIVER_ADD_DEVICE *PDRIVER_ADD_DEVICE;
+
+typedef NTSTATUS DRIVER_INITIALIZE(struct _DRIVER_OBJECT *DriverObject,
+                                   PUNICODE_STRING RegistryPath);
+
+typedef VOID DRIVER_UNLOAD(struct _DRIVER_OBJECT *DriverObject);
+typedef DRIVER_UNLOAD *PDRIVER_UNLOAD;
+
+typedef NTSTATUS IO_COMPLETION_ROUTINE(PDEVICE_OBJECT DeviceObject,
+                                       PIRP Irp,
+                                       PVOID Context);
+typedef IO_COMPLETION_ROUTINE *PIO_COMPLETION_ROUTINE;
+
+typedef struct _DRIVER_EXTENSION
+{
+    struct _DRIVER_OBJECT  *DriverObject;
+    PDRIVER_ADD_DEVICE     AddDevice;
+} DRIVER_EXTENSION, *PDRIVER_EXTENSION;
+
+typedef struct _DRIVER_OBJECT
+{
+    SHORT              Type;
+    SHORT              Size;
+    PDEVICE_OBJECT     DeviceObject;
+    PDRIVER_EXTENSION  DriverExtension;
+    PDRIVER_UNLOAD     DriverUnload;
+    PDRIVER_DISPATCH   MajorFunction[IRP_MJ_MAXIMUM_FUNCTION + 1];
+} DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+#define IoGetCurrentIrpStackLocation(Irp) \
+    ((Irp)->Tail.Overlay.CurrentStackLocation)
+#define IoGetNextIrpStackLocation(Irp) \
+    ((Irp)->Tail.Overlay.CurrentStackLocation - 1)
+#define IoSetNextIrpStackLocation(Irp) \
+    ((Irp)->CurrentLocation--, (Irp)->Tail.Overlay.CurrentStackLocation--)
+#define IoSkipCurrentIrpStackLocation(Irp) \
+    ((Irp)->CurrentLocation++, (Irp)->Tail.Overlay.CurrentStackLocation++)
+#define IoMarkIrpPending(Irp) \
+    ((Irp)->PendingReturned = TRUE)
+
+PIRP IoAllocateIrp(CCHAR StackSize, BOOLEAN ChargeQuota);
+VOID IoFreeIrp(PIRP Irp);
+PMDL IoAllocateMdl(PVOID VirtualAddress,
+                   ULONG Length,
+                   BOOLEAN SecondaryBuffer,
+                   BOOLEAN ChargeQuota,
+                   PIRP Irp);
+VOID IoFreeMdl(PMDL Mdl);
+VOID MmBuildMdlForNonPagedPool(PMDL MemoryDescriptorList);
+
+/* Copies IoStatus to UserIosb and signals UserEvent */
+VOID IoCompleteRequest(PIRP Irp, CCHAR PriorityBoost);
+/* Dispatches to the device's driver MajorFunction table */
+NTSTATUS IoCallDriver(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+
+NTSTATUS IoCreateDevice(PDRIVER_OBJECT DriverObject,
+                        ULONG DeviceExtensionSize,
+                        PUNICODE_STRING DeviceName,
+                        ULONG DeviceType,
+                        ULONG DeviceCharacteristics,
+                        BOOLEAN Exclusive,
+                        PDEVICE_OBJECT *DeviceObject);
+VOID IoDeleteDevice(PDEVICE_OBJECT DeviceObject);
+PDEVICE_OBJECT IoGetAttachedDeviceReference(PDEVICE_OBJECT DeviceObject);
+
+/* There is no lower stack on host; the requests below always fail */
+PIRP IoBuildSynchronousFsdRequest(ULONG MajorFunction,
+                                  PDEVICE_OBJECT DeviceObject,
+                                  PVOID Buffer,
+                                  ULONG Length,
+                                  PLARGE_INTEGER StartingOffset,
+                                  PKEVENT Event,
+                                  PIO_STATUS_BLOCK IoStatusBlock);
+PIRP IoBuildDeviceIoControlRequest(ULONG IoControlCode,
+                                   PDEVICE_OBJECT DeviceObject,
+                                   PVOID InputBuffer,
+                                   ULONG InputBufferLength,
+                                   PVOID OutputBuffer,
+                                   ULONG OutputBufferLength,
+                                   BOOLEAN InternalDeviceIoControl,
+                                   PKEVENT Event,
+                                   PIO_STATUS_BLOCK IoStatusBlock);
+
+typedef enum _DEVICE_REGISTRY_PROPERTY
+{
+    DevicePropertyDeviceDescription,
+    DevicePropertyHardwareID,
+    DevicePropertyCompatibleIDs,
+    DevicePropertyBootConfiguration,
+    DevicePropertyBootConfigurationTranslated,
+    DevicePropertyClassName,
+    DevicePropertyClassGuid,
+    DevicePropertyDriverKeyName,
+    DevicePropertyManufacturer,
+    DevicePropertyFriendlyName,
+    DevicePropertyLocationInformation
+} DEVICE_REGISTRY_PROPERTY;
+
+NTSTATUS IoGetDeviceProperty(PDEVICE_OBJECT DeviceObject,
+                             DEVICE_REGISTRY_PROPERTY DeviceProperty,
+                             ULONG BufferLength,
+                             PVOID PropertyBuffer,
+                             PULONG ResultLength);
+NTSTATUS IoGetDeviceInterfaces(const GUID *InterfaceClassGuid,
+                               PDEVICE_OBJECT PhysicalDeviceObject,
+                               ULONG Flags,
+                               PWSTR *SymbolicLinkList);
+
+/* Registry */
+#define REG_NONE      0
+#define REG_SZ        1
+#define REG_DWORD     4
+#define REG_MULTI_SZ  7
+
+#define RTL_REGISTRY_ABSOLUTE  0
+#define RTL_REGISTRY_SERVICES  1
+
+#define RTL_QUERY_REGISTRY_SUBKEY    0x00000001
+#define RTL_QUERY_REGISTRY_REQUIRED  0x00000004
+#define RTL_QUERY_REGISTRY_DIRECT    0x00000020
+
+typedef NTSTATUS RTL_QUERY_REGISTRY_ROUTINE(PWSTR ValueName,
+                                            ULONG ValueType,
+                                            PVOID ValueData,
+                                            ULONG ValueLength,
+                                            PVOID Context,
+                                            PVOID EntryContext);
+typedef RTL_QUERY_REGISTRY_ROUTINE *PRTL_QUERY_REGISTRY_ROUTINE;
+
+typedef struct _RTL_QUERY_REGISTRY_TABLE
+{
+    PRTL_QUERY_REGISTRY_ROUTINE  QueryRoutine;
+    ULONG                        Flags;
+    PWSTR                        Name;
+    PVOID                        EntryContext;
+    ULONG                        DefaultType;
+    PVOID                        DefaultData;
+    ULONG                        DefaultLength;
+} RTL_QUERY_REGISTRY_TABLE, *PRTL_QUERY_REGISTRY_TABLE;
+
+NTSTATUS RtlQueryRegistryValues(ULONG RelativeTo,
+                                PCWSTR Path,
+                                PRTL_QUERY_REGISTRY_TABLE QueryTable,
+                                PVOID Context,
+                                PVOID Environment);
+
+/* Cancel-safe IRP queue */
+typedef VOID IO_CSQ_INSERT_IRP(struct _IO_CSQ *Csq, PIRP Irp);
+typedef IO_CSQ_INSERT_IRP *PIO_CSQ_INSERT_IRP;
+typedef VOID IO_CSQ_REMOVE_IRP(struct _IO_CSQ *Csq, PIRP Irp);
+typedef IO_CSQ_REMOVE_IRP *PIO_CSQ_REMOVE_IRP;
+typedef PIRP IO_CSQ_PEEK_NEXT_IRP(struct _IO_CSQ *Csq, PIRP Irp, PVOID PeekContext);
+typedef IO_CSQ_PEEK_NEXT_IRP *PIO_CSQ_PEEK_NEXT_IRP;
+typedef VOID IO_CSQ_ACQUIRE_LOCK(struct _IO_CSQ *Csq, PKIRQL Irql);
+typedef IO_CSQ_ACQUIRE_LOCK *PIO_CSQ_ACQUIRE_LOCK;
+typedef VOID IO_CSQ_RELEASE_LOCK(struct _IO_CSQ *Csq, KIRQL Irql);
+typedef IO_CSQ_RELEASE_LOCK *PIO_CSQ_RELEASE_LOCK;
+typedef VOID IO_CSQ_COMPLETE_CANCELED_IRP(struct _IO_CSQ *Csq, PIRP Irp);
+typedef IO_CSQ_COMPLETE_CANCELED_IRP *PIO_CSQ_COMPLETE_CANCELED_IRP;
+
+typedef struct _IO_CSQ
+{
+    ULONG                          Type;
+    PIO_CSQ_INSERT_IRP             CsqInsertIrp;
+    PIO_CSQ_REMOVE_IRP             CsqRemoveIrp;
+    PIO_CSQ_PEEK_NEXT_IRP          CsqPeekNextIrp;
+    PIO_CSQ_ACQUIRE_LOCK           CsqAcquireLock;
+    PIO_CSQ_RELEASE_LOCK           CsqReleaseLock;
+    PIO_CSQ_COMPLETE_CANCELED_IRP  CsqCompleteCanceledIrp;
+    PVOID                          ReservePointer;
+} IO_CSQ, *PIO_CSQ;
+
+typedef struct _IO_CSQ_IRP_CONTEXT
+{
+    ULONG    Type;
+    PIRP     Irp;
+    PIO_CSQ  Csq;
+} IO_CSQ_IRP_CONTEXT, *PIO_CSQ_IRP_CONTEXT;
+
+NTSTATUS IoCsqInitialize(PIO_CSQ Csq,
+                         PIO_CSQ_INSERT_IRP CsqInsertIrp,
+                         PIO_CSQ_REMOVE_IRP CsqRemoveIrp,
+                         PIO_CSQ_PEEK_NEXT_IRP CsqPeekNextIrp,
+                         PIO_CSQ_ACQUIRE_LOCK CsqAcquireLock,
+                         PIO_CSQ_RELEASE_LOCK CsqReleaseLock,
+                         PIO_CSQ_COMPLETE_CANCELED_IRP CsqCompleteCanceledIrp);
+VOID IoCsqInsertIrp(PIO_CSQ Csq, PIRP Irp, PIO_CSQ_IRP_CONTEXT Context);
+PIRP IoCsqRemoveNextIrp(PIO_CSQ Csq, PVOID PeekContext);
+
+/* Generic tables (splay tree ordered, with insertion order list) */
+typedef struct _RTL_SPLAY_LINKS
+{
+    struct _RTL_SPLAY_LINKS  *Parent;
+    struct _RTL_SPLAY_LINKS  *LeftChild;
+    struct _RTL_SPLAY_LINKS  *RightChild;
+} RTL_SPLAY_LINKS, *PRTL_SPLAY_LINKS;
+
+typedef enum _RTL_GENERIC_COMPARE_RESULTS
+{
+    GenericLessThan,
+    GenericGreaterThan,
+    GenericEqual
+} RTL_GENERIC_COMPARE_RESULTS;
+
+struct _RTL_GENERIC_TABLE;
+
+typedef RTL_GENERIC_COMPARE_RESULTS
+HOST_RTL_GENERIC_COMPARE_ROUTINE(struct _RTL_GENERIC_TABLE *Table,
+                                 PVOID FirstStruct,
+                                 PVOID SecondStruct);
+typedef HOST_RTL_GENERIC_COMPARE_ROUTINE *PRTL_GENERIC_COMPARE_ROUTINE;
+
+typedef PVOID
+HOST_RTL_GENERIC_ALLOCATE_ROUTINE(struct _RTL_GENERIC_TABLE *Table,
+                                  CLONG ByteSize);
+typedef HOST_RTL_GENERIC_ALLOCATE_ROUTINE *PRTL_GENERIC_ALLOCATE_ROUTINE;
+
+typedef VOID
+HOST_RTL_GENERIC_FREE_ROUTINE(struct _RTL_GENERIC_TABLE *Table,
+                              PVOID Buffer);
+typedef HOST_RTL_GENERIC_FREE_ROUTINE *PRTL_GENERIC_FREE_ROUTINE;
+
+/* MSVC accepts a non-static role type declaration followed by a static
+ * definition, gcc and clang do not. The role types are only ever used to
+ * declare the callbacks right before their static definitions, so make
+ * the declarations static.
+ */
+#define RTL_GENERIC_COMPARE_ROUTINE   static HOST_RTL_GENERIC_COMPARE_ROUTINE
+#define RTL_GENERIC_ALLOCATE_ROUTINE  static HOST_RTL_GENERIC_ALLOCATE_ROUTINE
+#define RTL_GENERIC_FREE_ROUTINE      static HOST_RTL_GENERIC_FREE_ROUTINE
+
+typedef struct _RTL_GENERIC_TABLE
+{
+    PRTL_SPLAY_LINKS               TableRoot;
+    LIST_ENTRY                     InsertOrderList;
+    PLIST_ENTRY                    OrderedPointer;
+    ULONG                          WhichOrderedElement;
+    ULONG                          NumberGenericTableElements;
+    PRTL_GENERIC_COMPARE_ROUTINE   CompareRoutine;
+    PRTL_GENERIC_ALLOCATE_ROUTINE  AllocateRoutine;
+    PRTL_GENERIC_FREE_ROUTINE      FreeRoutine;
+    PVOID                          TableContext;
+} RTL_GENERIC_TABLE, *PRTL_GENERIC_TABLE;
+
+VOID RtlInitializeGenericTable(PRTL_GENERIC_TABLE Table,
+                               PRTL_GENERIC_COMPARE_ROUTINE CompareRoutine,
+                               PRTL_GENERIC_ALLOCATE_ROUTINE AllocateRoutine,
+                               PRTL_GENERIC_FREE_ROUTINE FreeRoutine,
+                               PVOID TableContext);
+PVOID RtlInsertElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                   PVOID Buffer,
+                                   CLONG BufferSize,
+                                   PBOOLEAN NewElement);
+BOOLEAN RtlDeleteElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                     PVOID Buffer);
+PVOID RtlLookupElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                   PVOID Buffer);
+PVOID RtlGetElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                ULONG I);
+ULONG RtlNumberGenericTableElements(PRTL_GENERIC_TABLE Table);
+BOOLEAN RtlIsGenericTableEmpty(PRTL_GENERIC_TABLE Table);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBPCAP_HOST_WDM_H */
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**************************************************************************
+ *
+ * USB descriptors, USBD status codes and URB structures for user-mode
+ * host builds. Layouts follow the WDK usb.h, usb100.h and usb200.h.
+ *
+ **************************************************************************/
+
+#ifndef USBPCAP_HOST_USB_H
+#define USBPCAP_HOST_USB_H
+
+#include "HostTypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef LONG USBD_STATUS;
+
+#define USBD_SUCCESS(Status) ((USBD_STATUS)(Status) >= 0)
+#define USBD_PENDING(Status) ((ULONG)(Status) >> 30 == 1)
+#define USBD_ERROR(Status)   ((USBD_STATUS)(Status) < 0)
+
+#define USBD_STATUS_SUCCESS                ((USBD_STATUS)0x00000000L)
+#define USBD_STATUS_PENDING                ((USBD_STATUS)0x40000000L)
+#define USBD_STATUS_CRC                    ((USBD_STATUS)0xC0000001L)
+#define USBD_STATUS_BTSTUFF                ((USBD_STATUS)0xC0000002L)
+#define USBD_STATUS_DATA_TOGGLE_MISMATCH   ((USBD_STATUS)0xC0000003L)
+#define USBD_STATUS_STALL_PID              ((USBD_STATUS)0xC0000004L)
+#define USBD_STATUS_DEV_NOT_RESPONDING     ((USBD_STATUS)0xC0000005L)
+#define USBD_STATUS_PID_CHECK_FAILURE      ((USBD_STATUS)0xC0000006L)
+#define USBD_STATUS_UNEXPECTED_PID         ((USBD_STATUS)0xC0000007L)
+#define USBD_STATUS_DATA_OVERRUN           ((USBD_STATUS)0xC0000008L)
+#define USBD_STATUS_DATA_UNDERRUN          ((USBD_STATUS)0xC0000009L)
+#define USBD_STATUS_BUFFER_OVERRUN         ((USBD_STATUS)0xC000000CL)
+#define USBD_STATUS_BUFFER_UNDERRUN        ((USBD_STATUS)0xC000000DL)
+#define USBD_STATUS_NOT_ACCESSED           ((USBD_STATUS)0xC000000FL)
+#define USBD_STATUS_FIFO                   ((USBD_STATUS)0xC0000010L)
+#define USBD_STATUS_XACT_ERROR             ((USBD_STATUS)0xC0000011L)
+#define USBD_STATUS_BABBLE_DETECTED        ((USBD_STATUS)0xC0000012L)
+#define USBD_STATUS_DATA_BUFFER_ERROR      ((USBD_STATUS)0xC0000013L)
+#define USBD_STATUS_ENDPOINT_HALTED        ((USBD_STATUS)0xC0000030L)
+#define USBD_STATUS_INVALID_URB_FUNCTION   ((USBD_STATUS)0x80000200L)
+#define USBD_STATUS_INVALID_PARAMETER      ((USBD_STATUS)0x80000300L)
+#define USBD_STATUS_ERROR_BUSY             ((USBD_STATUS)0x80000400L)
+#define USBD_STATUS_INVALID_PIPE_HANDLE    ((USBD_STATUS)0x80000600L)
+#define USBD_STATUS_NO_BANDWIDTH           ((USBD_STATUS)0x80000700L)
+#define USBD_STATUS_INTERNAL_HC_ERROR      ((USBD_STATUS)0x80000800L)
+#define USBD_STATUS_ERROR_SHORT_TRANSFER   ((USBD_STATUS)0x80000900L)
+#define USBD_STATUS_CANCELED               ((USBD_STATUS)0xC0010000L)
+#define USBD_STATUS_ISO_NOT_ACCESSED_BY_HW ((USBD_STATUS)0xC0020000L)
+#define USBD_STATUS_DEVICE_GONE            ((USBD_STATUS)0xC0007000L)
+
+/* USB 1.0/2.0 descriptors (usb100.h, usb200.h) */
+#define USB_DEVICE_DESCRIPTOR_TYPE         0x01
+#define USB_CONFIGURATION_DESCRIPTOR_TYPE  0x02
+#define USB_STRING_DESCRIPTOR_TYPE         0x03
+#define USB_INTERFACE_DESCRIPTOR_TYPE      0x04
+#define USB_ENDPOINT_DESCRIPTOR_TYPE       0x05
+
+#define USB_ENDPOINT_DIRECTION_MASK        0x80
+#define USB_ENDPOINT_DIRECTION_IN(x)       ((x) & USB_ENDPOINT_DIRECTION_MASK)
+#define USB_ENDPOINT_DIRECTION_OUT(x)      (!USB_ENDPOINT_DIRECTION_IN(x))
+
+#define USB_ENDPOINT_TYPE_MASK             0x03
+#define USB_ENDPOINT_TYPE_CONTROL          0x00
+#define USB_ENDPOINT_TYPE_ISOCHRONOUS      0x01
+#define USB_ENDPOINT_TYPE_BULK             0x02
+#define USB_ENDPOINT_TYPE_INTERRUPT        0x03
+
+#pragma pack(push, 1)
+typedef struct _USB_DEVICE_DESCRIPTOR
+{
+    UCHAR   bLength;
+    UCHAR   bDescriptorType;
+    USHORT  bcdUSB;
+    UCHAR   bDeviceClass;
+    UCHAR   bDeviceSubClass;
+    UCHAR   bDeviceProtocol;
+    UCHAR   bMaxPacketSize0;
+    USHORT  idVendor;
+    USHORT  idProduct;
+    USHORT  bcdDevice;
+    UCHAR   iManufacturer;
+    UCHAR   iProduct;
+    UCHAR   iSerialNumber;
+    UCHAR   bNumConfigurations;
+} USB_DEVICE_DESCRIPTOR, *PUSB_DEVICE_DESCRIPTOR;
+
+typedef struct _USB_ENDPOINT_DESCRIPTOR
+{
+    UCHAR   bLength;
+    UCHAR   bDescriptorType;
+    UCHAR   bEndpointAddress;
+    UCHAR   bmAttributes;
+    USHORT  wMaxPacketSize;
+    UCHAR   bInterval;
+} USB_ENDPOINT_DESCRIPTOR, *PUSB_ENDPOINT_DESCRIPTOR;
+
+typedef struct _USB_CONFIGURATION_DESCRIPTOR
+{
+    UCHAR   bLength;
+    UCHAR   bDescriptorType;
+    USHORT  wTotalLength;
+    UCHAR   bNumInterfaces;
+    UCHAR   bConfigurationValue;
+    UCHAR   iConfiguration;
+    UCHAR   bmAttributes;
+    UCHAR   MaxPower;
+} USB_CONFIGURATION_DESCRIPTOR, *PUSB_CONFIGURATION_DESCRIPTOR;
+
+typedef struct _USB_INTERFACE_DESCRIPTOR
+{
+    UCHAR   bLength;
+    UCHAR   bDescriptorType;
+    UCHAR   bInterfaceNumber;
+    UCHAR   bAlternateSetting;
+    UCHAR   bNumEndpoints;
+    UCHAR   bInterfaceClass;
+    UCHAR   bInterfaceSubClass;
+    UCHAR   bInterfaceProtocol;
+    UCHAR   iInterface;
+} USB_INTERFACE_DESCRIPTOR, *PUSB_INTERFACE_DESCRIPTOR;
+
+typedef struct _USB_STRING_DESCRIPTOR
+{
+    UCHAR   bLength;
+    UCHAR   bDescriptorType;
+    WCHAR   bString[1];
+} USB_STRING_DESCRIPTOR, *PUSB_STRING_DESCRIPTOR;
+
+typedef struct _USB_COMMON_DESCRIPTOR
+{
+    UCHAR   bLength;
+    UCHAR   bDescriptorType;
+} USB_COMMON_DESCRIPTOR, *PUSB_COMMON_DESCRIPTOR;
+#pragma pack(pop)
+
+/* URB function codes */
+#define URB_FUNCTION_SELECT_CONFIGURATION            0x0000
+#define URB_FUNCTION_SELECT_INTERFACE                0x0001
+#define URB_FUNCTION_ABORT_PIPE                      0x0002
+#define URB_FUNCTION_TAKE_FRAME_LENGTH_CONTROL       0x0003
+#define URB_FUNCTION_RELEASE_FRAME_LENGTH_CONTROL    0x0004
+#define URB_FUNCTION_GET_FRAME_LENGTH                0x0005
+#define URB_FUNCTION_SET_FRAME_LENGTH                0x0006
+#define URB_FUNCTION_GET_CURRENT_FRAME_NUMBER        0x0007
+#define URB_FUNCTION_CONTROL_TRANSFER                0x0008
+#define URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER      0x0009
+#define URB_FUNCTION_ISOCH_TRANSFER                  0x000A
+#define URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE      0x000B
+#define URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE        0x000C
+#define URB_FUNCTION_SET_FEATURE_TO_DEVICE           0x000D
+#define URB_FUNCTION_SET_FEATURE_TO_INTERFACE        0x000E
+#define URB_FUNCTION_SET_FEATURE_TO_ENDPOINT         0x000F
+#define URB_FUNCTION_CLEAR_FEATURE_TO_DEVICE         0x0010
+#define URB_FUNCTION_CLEAR_FEATURE_TO_INTERFACE      0x0011
+#define URB_FUNCTION_CLEAR_FEATURE_TO_ENDPOINT       0x0012
+#define URB_FUNCTION_GET_STATUS_FROM_DEVICE          0x0013
+#define URB_FUNCTION_GET_STATUS_FROM_INTERFACE       0x0014
+#define URB_FUNCTION_GET_STATUS_FROM_ENDPOINT        0x0015
+#define URB_FUNCTION_RESERVED_0X0016                 0x0016
+#define URB_FUNCTION_VENDOR_DEVICE                   0x0017
+#define URB_FUNCTION_VENDOR_INTERFACE                0x0018
+#define URB_FUNCTION_VENDOR_ENDPOINT                 0x0019
+#define URB_FUNCTION_CLASS_DEVICE                    0x001A
+#define URB_FUNCTION_CLASS_INTERFACE                 0x001B
+#define URB_FUNCTION_CLASS_ENDPOINT                  0x001C
+#define URB_FUNCTION_RESERVE_0X001D                  0x001D
+#define URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL 0x001E
+#define URB_FUNCTION_CLASS_OTHER                     0x001F
+#define URB_FUNCTION_VENDOR_OTHER                    0x0020
+#define URB_FUNCTION_GET_STATUS_FROM_OTHER           0x0021
+#define URB_FUNCTION_CLEAR_FEATURE_TO_OTHER          0x0022
+#define URB_FUNCTION_SET_FEATURE_TO_OTHER            0x0023
+#define URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT    0x0024
+#define URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT      0x0025
+#define URB_FUNCTION_GET_CONFIGURATION               0x0026
+#define URB_FUNCTION_GET_INTERFACE                   0x0027
+#define URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE   0x0028
+#define URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE     0x0029
+#define URB_FUNCTION_GET_MS_FEATURE_DESCRIPTOR       0x002A
+#define URB_FUNCTION_SYNC_RESET_PIPE                 0x0030
+#define URB_FUNCTION_SYNC_CLEAR_STALL                0x0031
+#define URB_FUNCTION_CONTROL_TRANSFER_EX             0x0032
+#define URB_FUNCTION_SET_PIPE_IO_POLICY              0x0033
+#define URB_FUNCTION_GET_PIPE_IO_POLICY              0x0034
+#define URB_FUNCTION_OPEN_STATIC_STREAMS             0x0035
+#define URB_FUNCTION_CLOSE_STATIC_STREAMS            0x0036
+#define URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER_USING_CHAINED_MDL 0x0037
+#define URB_FUNCTION_ISOCH_TRANSFER_USING_CHAINED_MDL 0x0038
+
+/* TransferFlags */
+#define USBD_TRANSFER_DIRECTION_OUT   0
+#define USBD_TRANSFER_DIRECTION_IN    1
+#define USBD_SHORT_TRANSFER_OK        2
+#define USBD_START_ISO_TRANSFER_ASAP  4
+#define USBD_DEFAULT_PIPE_TRANSFER    8
+
+#define USBD_TRANSFER_DIRECTION(x)    ((x) & USBD_TRANSFER_DIRECTION_IN)
+
+typedef PVOID USBD_PIPE_HANDLE;
+typedef PVOID USBD_CONFIGURATION_HANDLE;
+typedef PVOID USBD_INTERFACE_HANDLE;
+
+typedef enum _USBD_PIPE_TYPE
+{
+    UsbdPipeTypeControl,
+    UsbdPipeTypeIsochronous,
+    UsbdPipeTypeBulk,
+    UsbdPipeTypeInterrupt
+} USBD_PIPE_TYPE;
+
+typedef struct _USBD_PIPE_INFORMATION
+{
+    USHORT            MaximumPacketSize;
+    UCHAR             EndpointAddress;
+    UCHAR             Interval;
+    USBD_PIPE_TYPE    PipeType;
+    USBD_PIPE_HANDLE  PipeHandle;
+    ULONG             MaximumTransferSize;
+    ULONG             PipeFlags;
+} USBD_PIPE_INFORMATION, *PUSBD_PIPE_INFORMATION;
+
+typedef struct _USBD_INTERFACE_INFORMATION
+{
+    USHORT                 Length;
+    UCHAR                  InterfaceNumber;
+    UCHAR                  AlternateSetting;
+    UCHAR                  Class;
+    UCHAR                  SubClass;
+    UCHAR                  Protocol;
+    UCHAR                  Reserved;
+    USBD_INTERFACE_HANDLE  InterfaceHandle;
+    ULONG                  NumberOfPipes;
+    USBD_PIPE_INFORMATION  Pipes[1];
+} USBD_INTERFACE_INFORMATION, *PUSBD_INTERFACE_INFORMATION;
+
+typedef struct _USBD_ISO_PACKET_DESCRIPTOR
+{
+    ULONG        Offset;
+    ULONG        Length;
+    USBD_STATUS  Status;
+} USBD_ISO_PACKET_DESCRIPTOR, *PUSBD_ISO_PACKET_DESCRIPTOR;
+
+struct _MDL;
+struct _URB;
+
+struct _URB_HEADER
+{
+    USHORT       Length;
+    USHORT       Function;
+    USBD_STATUS  Status;
+    PVOID        UsbdDeviceHandle;
+    ULONG        UsbdFlags;
+};
+
+struct _URB_HCD_AREA
+{
+    PVOID  Reserved8[8];
+};
+
+struct _URB_SELECT_INTERFACE
+{
+    struct _URB_HEADER          Hdr;
+    USBD_CONFIGURATION_HANDLE   ConfigurationHandle;
+    USBD_INTERFACE_INFORMATION  Interface;
+};
+
+struct _URB_SELECT_CONFIGURATION
+{
+    struct _URB_HEADER             Hdr;
+    PUSB_CONFIGURATION_DESCRIPTOR  ConfigurationDescriptor;
+    USBD_CONFIGURATION_HANDLE      ConfigurationHandle;
+    USBD_INTERFACE_INFORMATION     Interface;
+};
+
+struct _URB_PIPE_REQUEST
+{
+    struct _URB_HEADER  Hdr;
+    USBD_PIPE_HANDLE    PipeHandle;
+    ULONG               Reserved;
+};
+
+struct _URB_FRAME_LENGTH_CONTROL
+{
+    struct _URB_HEADER  Hdr;
+};
+
+struct _URB_GET_FRAME_LENGTH
+{
+    struct _URB_HEADER  Hdr;
+    ULONG               FrameLength;
+    ULONG               FrameNumber;
+};
+
+struct _URB_SET_FRAME_LENGTH
+{
+    struct _URB_HEADER  Hdr;
+    LONG                FrameLengthDelta;
+};
+
+struct _URB_GET_CURRENT_FRAME_NUMBER
+{
+    struct _URB_HEADER  Hdr;
+    ULONG               FrameNumber;
+};
+
+struct _URB_CONTROL_TRANSFER
+{
+    struct _URB_HEADER    Hdr;
+    USBD_PIPE_HANDLE      PipeHandle;
+    ULONG                 TransferFlags;
+    ULONG                 TransferBufferLength;
+    PVOID                 TransferBuffer;
+    struct _MDL           *TransferBufferMDL;
+    struct _URB           *UrbLink;
+    struct _URB_HCD_AREA  hca;
+    UCHAR                 SetupPacket[8];
+};
+
+struct _URB_CONTROL_TRANSFER_EX
+{
+    struct _URB_HEADER    Hdr;
+    USBD_PIPE_HANDLE      PipeHandle;
+    ULONG                 TransferFlags;
+    ULONG                 TransferBufferLength;
+    PVOID                 TransferBuffer;
+    struct _MDL           *TransferBufferMDL;
+    ULONG                 Timeout;
+#if UINTPTR_MAX > 0xFFFFFFFFu
+    ULONG                 Pad;
+#endif
+    struct _URB_HCD_AREA  hca;
+    UCHAR                 SetupPacket[8];
+};
+
+struct _URB_BULK_OR_INTERRUPT_TRANSFER
+{
+    struct _URB_HEADER    Hdr;
+    USBD_PIPE_HANDLE      PipeHandle;
+    ULONG                 TransferFlags;
+    ULONG                 TransferBufferLength;
+    PVOID                 TransferBuffer;
+    struct _MDL           *TransferBufferMDL;
+    struct _URB           *UrbLink;
+    struct _URB_HCD_AREA  hca;
+};
+
+struct _URB_ISOCH_TRANSFER
+{
+    struct _URB_HEADER          Hdr;
+    USBD_PIPE_HANDLE            PipeHandle;
+    ULONG                       TransferFlags;
+    ULONG                       TransferBufferLength;
+    PVOID                       TransferBuffer;
+    struct _MDL                 *TransferBufferMDL;
+    struct _URB                 *UrbLink;
+    struct _URB_HCD_AREA        hca;
+    ULONG                       StartFrame;
+    ULONG                       NumberOfPackets;
+    ULONG                       ErrorCount;
+    USBD_ISO_PACKET_DESCRIPTOR  IsoPacket[1];
+};
+
+struct _URB_CONTROL_DESCRIPTOR_REQUEST
+{
+    struct _URB_HEADER    Hdr;
+    PVOID                 Reserved;
+    ULONG                 Reserved0;
+    ULONG                 TransferBufferLength;
+    PVOID                 TransferBuffer;
+    struct _MDL           *TransferBufferMDL;
+    struct _URB           *UrbLink;
+    struct _URB_HCD_AREA  hca;
+    USHORT                Reserved1;
+    UCHAR                 Index;
+    UCHAR                 DescriptorType;
+    USHORT                LanguageId;
+    USHORT                Reserved2;
+};
+
+struct _URB_CONTROL_GET_STATUS_REQUEST
+{
+    struct _URB_HEADER    Hdr;
+    PVOID                 Reserved;
+    ULONG                 Reserved0;
+    ULONG                 TransferBufferLength;
+    PVOID                 TransferBuffer;
+    struct _MDL           *TransferBufferMDL;
+    struct _URB           *UrbLink;
+    struct _URB_HCD_AREA  hca;
+    UCHAR                 Reserved1[4];
+    USHORT                Index;
+    USHORT                Reserved2;
+};
+
+struct _URB_CONTROL_FEATURE_REQUEST
+{
+    struct _URB_HEADER    Hdr;
+    PVOID                 Reserved;
+    ULONG                 Reserved2;
+    ULONG                 Reserved3;
+    PVOID                 Reserved4;
+    struct _MDL           *Reserved5;
+    struct _URB           *UrbLink;
+    struct _URB_HCD_AREA  hca;
+    USHORT                Reserved0;
+    USHORT                FeatureSelector;
+    USHORT                Index;
+    USHORT                Reserved1;
+};
+
+struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST
+{
+    struct _URB_HEADER    Hdr;
+    PVOID                 Reserved;
+    ULONG                 TransferFlags;
+    ULONG                 TransferBufferLength;
+    PVOID                 TransferBuffer;
+    struct _MDL           *TransferBufferMDL;
+    struct _URB           *UrbLink;
+    struct _URB_HCD_AREA  hca;
+    UCHAR                 RequestTypeReservedBits;
+    UCHAR                 Request;
+    USHORT                Value;
+    USHORT                Index;
+    USHORT                Reserved1;
+};
+
+struct _URB_CONTROL_GET_INTERFACE_REQUEST
+{
+    struct _URB_HEADER    Hdr;
+    PVOID                 Reserved;
+    ULONG                 Reserved0;
+    ULONG                 TransferBufferLength;
+    PVOID                 TransferBuffer;
+    struct _MDL           *TransferBufferMDL;
+    struct _URB           *UrbLink;
+    struct _URB_HCD_AREA  hca;
+    UCHAR                 Reserved1[4];
+    USHORT                Interface;
+    USHORT                Reserved2;
+};
+
+struct _URB_CONTROL_GET_CONFIGURATION_REQUEST
+{
+    struct _URB_HEADER    Hdr;
+    PVOID                 Reserved;
+    ULONG                 Reserved0;
+    ULONG                 TransferBufferLength;
+    PVOID                 TransferBuffer;
+    struct _MDL           *TransferBufferMDL;
+    struct _URB           *UrbLink;
+    struct _URB_HCD_AREA  hca;
+    UCHAR                 Reserved1[8];
+};
+
+typedef struct _URB
+{
+    union
+    {
+        struct _URB_HEADER                          UrbHeader;
+        struct _URB_SELECT_INTERFACE                UrbSelectInterface;
+        struct _URB_SELECT_CONFIGURATION            UrbSelectConfiguration;
+        struct _URB_PIPE_REQUEST                    UrbPipeRequest;
+        struct _URB_FRAME_LENGTH_CONTROL            UrbFrameLengthControl;
+        struct _URB_GET_FRAME_LENGTH                UrbGetFrameLength;
+        struct _URB_SET_FRAME_LENGTH                UrbSetFrameLength;
+        struct _URB_GET_CURRENT_FRAME_NUMBER        UrbGetCurrentFrameNumber;
+        struct _URB_CONTROL_TRANSFER                UrbControlTransfer;
+        struct _URB_CONTROL_TRANSFER_EX             UrbControlTransferEx;
+        struct _URB_BULK_OR_INTERRUPT_TRANSFER      UrbBulkOrInterruptTransfer;
+        struct _URB_ISOCH_TRANSFER                  UrbIsochronousTransfer;
+        struct _URB_CONTROL_DESCRIPTOR_REQUEST      UrbControlDescriptorRequest;
+        struct _URB_CONTROL_GET_STATUS_REQUEST      UrbControlGetStatusRequest;
+        struct _URB_CONTROL_FEATURE_REQUEST         UrbControlFeatureRequest;
+        struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST UrbControlVendorClassRequest;
+        struct _URB_CONTROL_GET_INTERFACE_REQUEST   UrbControlGetInterfaceRequest;
+        struct _URB_CONTROL_GET_CONFIGURATION_REQUEST UrbControlGetConfigurationRequest;
+    };
+} URB, *PURB;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBPCAP_HOST_USB_H */
@@ -0,0 +1,562 @@
+/*
+ * Copyright (c) 2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Capture output benchmark.
+ *
+ * Reader thread plays the role of USBPcapCMD read thread: it fills
+ * buffers as fast as it can (or at given rate) and hands them over to
+ * writer thread through the USBPcapCMD buffer pool. Writer thread
+ * writes the buffers to file or pipe and flushes the output according
+ * to the selected policy.
+ *
+ * With --inline the reader writes and flushes every buffer itself
+ * before reading the next one, like USBPcapCMD used to do.
+ *
+ * Time the reader spends not reading (waiting for free buffer or
+ * writing) is reported as stall. On real system the capture buffer in
+ * driver fills up while the reader is stalled.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../USBPcapCMD/bufpool.h"
+#include "../USBPcapCMD/outname.h"
+
+#define DEFAULT_BUFFER_SIZE      (1024*1024)
+#define DEFAULT_BUFFERS          5
+#define DEFAULT_TOTAL_MB         256
+#define PIPE_READ_SIZE           (64*1024)
+
+struct bench
+{
+    const char          *output;        /* NULL - pipe */
+    unsigned int         bufferSize;
+    unsigned int         buffers;
+    unsigned long long   totalBytes;
+    unsigned int         rate;          /* MB/s, 0 - unlimited */
+    unsigned int         flushSize;     /* MB, 0 - only at close */
+    unsigned int         flushInterval; /* ms, 0 - only at close */
+    int                  inlineWrite;
+    int                  json;
+
+    int                  fd;
+    int                  isPipe;
+    int                  pipeRead;
+    struct bufpool       pool;
+    volatile int         failed;
+
+    unsigned long long   startNs;
+    unsigned long long   endNs;
+
+    /* Reader results */
+    unsigned long long   stallNs;
+    unsigned long long   maxStallNs;
+
+    /* Writer results */
+    unsigned long long   writtenBytes;
+    unsigned long long   flushes;
+    unsigned long long   flushNs;
+    unsigned long long   maxFlushNs;
+
+    /* Pipe sink results */
+    unsigned long long   pipeBytes;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ns(unsigned long long ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    {
+    }
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -o, --output FILE      write to FILE (default: pipe drained by\n"
+        "                         another thread)\n"
+        "  -b, --bufferlen N      buffer size in bytes (default %d)\n"
+        "  -n, --size MB          amount of data to write (default %d)\n"
+        "      --buffers N        number of buffers in pool (default %d)\n"
+        "      --rate MB          produce at most MB megabytes per second\n"
+        "      --flush-size MB    flush after every MB megabytes\n"
+        "      --flush-interval MS\n"
+        "                         flush at least every MS milliseconds\n"
+        "      --inline           write and flush every buffer from reader\n"
+        "      --json             print results as JSON\n",
+        argv0, DEFAULT_BUFFER_SIZE, DEFAULT_TOTAL_MB, DEFAULT_BUFFERS);
+}
+
+static int write_all(struct bench *bench, const unsigned char *data,
+                     unsigned int length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(bench->fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "write() failed: %s\n", strerror(errno));
+            bench->failed = 1;
+            return 0;
+        }
+        data += written;
+        length -= (unsigned int)written;
+        bench->writtenBytes += (unsigned long long)written;
+    }
+    return 1;
+}
+
+static void flush_output(struct bench *bench)
+{
+    unsigned long long start;
+    unsigned long long ns;
+
+    /* There is nothing to flush in a pipe */
+    if (bench->isPipe)
+    {
+        return;
+    }
+
+    start = now_ns();
+    fdatasync(bench->fd);
+    ns = now_ns() - start;
+
+    bench->flushes++;
+    bench->flushNs += ns;
+    if (ns > bench->maxFlushNs)
+    {
+        bench->maxFlushNs = ns;
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    struct bench           *bench = arg;
+    struct bufpool_buffer  *buffer;
+    unsigned long long      unflushed = 0;
+    unsigned long long      lastFlush = now_ns();
+    int                     timeout;
+
+    timeout = (bench->flushInterval != 0) ? (int)bench->flushInterval
+                                          : BUFPOOL_INFINITE;
+
+    for (;;)
+    {
+        buffer = bufpool_next(&bench->pool, timeout);
+        if (buffer != NULL)
+        {
+            if (!bench->failed)
+            {
+                write_all(bench, buffer->data, buffer->length);
+                unflushed += buffer->length;
+            }
+            bufpool_release(&bench->pool, buffer);
+        }
+        else if (bufpool_is_drained(&bench->pool))
+        {
+            break;
+        }
+
+        if ((unflushed > 0) &&
+            (((bench->flushSize != 0) &&
+              (unflushed >= (unsigned long long)bench->flushSize * 1000000ULL)) ||
+             ((bench->flushInterval != 0) &&
+              (now_ns() - lastFlush >= bench->flushInterval * 1000000ULL))))
+        {
+            flush_output(bench);
+            unflushed = 0;
+            lastFlush = now_ns();
+        }
+    }
+
+    flush_output(bench);
+    return NULL;
+}
+
+static void *pipe_thread(void *arg)
+{
+    struct bench   *bench = arg;
+    unsigned char  *data;
+    ssize_t         got;
+
+    data = malloc(PIPE_READ_SIZE);
+    if (data == NULL)
+    {
+        return NULL;
+    }
+
+    while ((got = read(bench->pipeRead, data, PIPE_READ_SIZE)) != 0)
+    {
+        if (got < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        bench->pipeBytes += (unsigned long long)got;
+    }
+
+    free(data);
+    return NULL;
+}
+
+static void add_stall(struct bench *bench, unsigned long long ns)
+{
+    bench->stallNs += ns;
+    if (ns > bench->maxStallNs)
+    {
+        bench->maxStallNs = ns;
+    }
+}
+
+static void fill(unsigned char *data, unsigned int length,
+                 unsigned long long offset)
+{
+    unsigned int i;
+
+    for (i = 0; i < length; i += 64)
+    {
+        data[i] = (unsigned char)((offset + i) >> 6);
+    }
+}
+
+static void run_reader(struct bench *bench)
+{
+    struct bufpool_buffer  *buffer;
+    unsigned char          *data = NULL;
+    unsigned long long      produced = 0;
+    unsigned long long      start;
+    unsigned int            length;
+
+    if (bench->inlineWrite)
+    {
+        data = calloc(1, bench->bufferSize);
+        if (data == NULL)
+        {
+            fprintf(stderr, "Failed to allocate buffer.\n");
+            bench->failed = 1;
+            return;
+        }
+    }
+
+    while ((produced < bench->totalBytes) && !bench->failed)
+    {
+        length = bench->bufferSize;
+        if (bench->totalBytes - produced < length)
+        {
+            length = (unsigned int)(bench->totalBytes - produced);
+        }
+
+        if (bench->rate != 0)
+        {
+            unsigned long long due;
+
+            due = bench->startNs + produced * 1000ULL / bench->rate;
+            start = now_ns();
+            if (due > start)
+            {
+                sleep_ns(due - start);
+            }
+        }
+
+        if (bench->inlineWrite)
+        {
+            fill(data, length, produced);
+            start = now_ns();
+            write_all(bench, data, length);
+            flush_output(bench);
+            add_stall(bench, now_ns() - start);
+        }
+        else
+        {
+            start = now_ns();
+            buffer = bufpool_get(&bench->pool, 0);
+            if (buffer == NULL)
+            {
+                buffer = bufpool_get(&bench->pool, BUFPOOL_INFINITE);
+                add_stall(bench, now_ns() - start);
+            }
+            fill(buffer->data, length, produced);
+            buffer->length = length;
+            bufpool_submit(&bench->pool, buffer);
+        }
+
+        produced += length;
+    }
+
+    free(data);
+}
+
+static int run(struct bench *bench)
+{
+    pthread_t  writer;
+    pthread_t  sink;
+    int        fds[2];
+
+    if (bench->output != NULL)
+    {
+        bench->fd = open(bench->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (bench->fd < 0)
+        {
+            fprintf(stderr, "Failed to open %s: %s\n", bench->output,
+                    strerror(errno));
+            return 0;
+        }
+    }
+    else
+    {
+        if (pipe(fds) != 0)
+        {
+            fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+            return 0;
+        }
+        bench->pipeRead = fds[0];
+        bench->fd = fds[1];
+        bench->isPipe = 1;
+        if (pthread_create(&sink, NULL, pipe_thread, bench) != 0)
+        {
+            fprintf(stderr, "Failed to create pipe thread.\n");
+            return 0;
+        }
+    }
+
+    if (!bench->inlineWrite)
+    {
+        if (!bufpool_init(&bench->pool, bench->buffers, bench->bufferSize))
+        {
+            fprintf(stderr, "Failed to allocate buffer pool.\n");
+            return 0;
+        }
+    }
+
+    bench->startNs = now_ns();
+
+    if (!bench->inlineWrite)
+    {
+        if (pthread_create(&writer, NULL, writer_thread, bench) != 0)
+        {
+            fprintf(stderr, "Failed to create writer thread.\n");
+            return 0;
+        }
+    }
+
+    run_reader(bench);
+
+    if (!bench->inlineWrite)
+    {
+        bufpool_close(&bench->pool);
+        pthread_join(writer, NULL);
+        bufpool_destroy(&bench->pool);
+    }
+
+    close(bench->fd);
+    if (bench->isPipe)
+    {
+        pthread_join(sink, NULL);
+        close(bench->pipeRead);
+    }
+
+    bench->endNs = now_ns();
+    return !bench->failed;
+}
+
+static void print_results(struct bench *bench)
+{
+    double elapsed = (double)(bench->endNs - bench->startNs) / 1e9;
+
+    if (bench->json)
+    {
+        printf("{\n");
+        printf("  \"elapsed_s\": %.6f,\n", elapsed);
+        printf("  \"sink\": \"%s\",\n", bench->isPipe ? "pipe" : "file");
+        printf("  \"mode\": \"%s\",\n", bench->inlineWrite ? "inline" : "pool");
+        printf("  \"buffer_bytes\": %u,\n", bench->bufferSize);
+        printf("  \"buffers\": %u,\n", bench->inlineWrite ? 1 : bench->buffers);
+        printf("  \"flush_size_mb\": %u,\n", bench->flushSize);
+        printf("  \"flush_interval_ms\": %u,\n", bench->flushInterval);
+        printf("  \"written_bytes\": %llu,\n", bench->writtenBytes);
+        printf("  \"bytes_per_s\": %.1f,\n", (double)bench->writtenBytes / elapsed);
+        printf("  \"reader_stall_s\": %.6f,\n", (double)bench->stallNs / 1e9);
+        printf("  \"reader_max_stall_ms\": %.3f,\n", (double)bench->maxStallNs / 1e6);
+        printf("  \"flushes\": %llu,\n", bench->flushes);
+        printf("  \"flush_s\": %.6f,\n", (double)bench->flushNs / 1e9);
+        printf("  \"max_flush_ms\": %.3f\n", (double)bench->maxFlushNs / 1e6);
+        printf("}\n");
+    }
+    else
+    {
+        printf("Elapsed: %.3f s, %s sink, %s, %u x %u bytes buffers\n",
+               elapsed, bench->isPipe ? "pipe" : "file",
+               bench->inlineWrite ? "inline write" : "writer thread",
+               bench->inlineWrite ? 1 : bench->buffers, bench->bufferSize);
+        printf("Written: %llu bytes, %.1f MB/s\n",
+               bench->writtenBytes,
+               (double)bench->writtenBytes / elapsed / 1e6);
+        printf("Reader stall: %.3f s total (%.1f%%), %.3f ms max\n",
+               (double)bench->stallNs / 1e9,
+               100.0 * (double)bench->stallNs / (double)(bench->endNs - bench->startNs),
+               (double)bench->maxStallNs / 1e6);
+        printf("Flushes: %llu, %.3f s total, %.3f ms max\n",
+               bench->flushes,
+               (double)bench->flushNs / 1e9,
+               (double)bench->maxFlushNs / 1e6);
+    }
+}
+
+/*
+ * Checks output file naming before writing anything. Streams must keep
+ * their names even with rotation, elevated worker opens its relay pipe
+ * by that name.
+ */
+static int check_output_names(void)
+{
+    static const struct
+    {
+        const char   *filename;
+        unsigned int  index;
+        int           rotate;
+        const char   *expected;
+    } cases[] =
+    {
+        {"capture.pcap",             1,      1, "capture_00001.pcap"},
+        {"capture.pcap",             123456, 1, "capture_123456.pcap"},
+        {"C:\\out.d\\capture",       7,      1, "C:\\out.d\\capture_00007"},
+        {"capture.pcap",             1,      0, "capture.pcap"},
+        {"-",                        1,      1, "-"},
+        {"\\\\.\\pipe\\_._USBPcap1", 0,      1, "\\\\.\\pipe\\_._USBPcap1"},
+        {"\\\\.\\pipe\\_._USBPcap1", 3,      1, "\\\\.\\pipe\\_._USBPcap1"},
+    };
+    unsigned int i;
+    int errors = 0;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        char *name = outname_rotated(cases[i].filename, cases[i].index, cases[i].rotate);
+
+        if ((name == NULL) || (strcmp(name, cases[i].expected) != 0))
+        {
+            fprintf(stderr, "Output name of %s (%u) is %s, expected %s\n",
+                    cases[i].filename, cases[i].index,
+                    name ? name : "(null)", cases[i].expected);
+            errors++;
+        }
+        free(name);
+    }
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"output",         required_argument, NULL, 'o'},
+        {"bufferlen",      required_argument, NULL, 'b'},
+        {"size",           required_argument, NULL, 'n'},
+        {"buffers",        required_argument, NULL, 'B'},
+        {"rate",           required_argument, NULL, 'R'},
+        {"flush-size",     required_argument, NULL, 'S'},
+        {"flush-interval", required_argument, NULL, 'T'},
+        {"inline",         no_argument,       NULL, 'i'},
+        {"json",           no_argument,       NULL, 'J'},
+        {"help",           no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct bench  bench;
+    int           c;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.bufferSize = DEFAULT_BUFFER_SIZE;
+    bench.buffers = DEFAULT_BUFFERS;
+    bench.totalBytes = DEFAULT_TOTAL_MB * 1000000ULL;
+    bench.fd = -1;
+    bench.pipeRead = -1;
+
+    while ((c = getopt_long(argc, argv, "o:b:n:h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'o':
+                bench.output = optarg;
+                break;
+            case 'b':
+                bench.bufferSize = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                bench.totalBytes = strtoull(optarg, NULL, 10) * 1000000ULL;
+                break;
+            case 'B':
+                bench.buffers = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                bench.rate = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                bench.flushSize = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                bench.flushInterval = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                bench.inlineWrite = 1;
+                break;
+            case 'J':
+                bench.json = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (bench.bufferSize == 0 || bench.buffers < 2)
+    {
+        fprintf(stderr, "Invalid buffer length or number of buffers.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (check_output_names() != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (!run(&bench))
+    {
+        return EXIT_FAILURE;
+    }
+
+    print_results(&bench);
+    return EXIT_SUCCESS;
+}